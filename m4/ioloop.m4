@@ -21,6 +21,26 @@ AC_DEFUN([DOVECOT_IOLOOP], [
       AC_DEFINE(IOLOOP_EPOLL,, [Implement I/O loop with Linux 2.6 epoll()])
       have_ioloop=yes
       ioloop=epoll
+
+      AC_CACHE_CHECK([whether we can use io_uring],i_cv_io_uring_works,[
+        AC_TRY_COMPILE([
+          #include <sys/syscall.h>
+          #include <linux/io_uring.h>
+        ], [
+          struct io_uring_getevents_arg arg;
+          int features = IORING_FEAT_EXT_ARG | IORING_FEAT_NODROP;
+          long nr = __NR_io_uring_setup + __NR_io_uring_enter;
+          (void)arg; (void)features; (void)nr;
+        ], [
+          i_cv_io_uring_works=yes
+        ], [
+          i_cv_io_uring_works=no
+        ])
+      ])
+      if test $i_cv_io_uring_works = yes; then
+        AC_DEFINE(IOLOOP_URING,, [Allow using io_uring instead of epoll at runtime])
+        ioloop="epoll (+uring)"
+      fi
     else
       if test "$ioloop" = "epoll" ; then
         AC_MSG_ERROR([epoll ioloop requested but epoll_create() is not available])
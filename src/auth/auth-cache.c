@@ -2,6 +2,7 @@
 
 #include "auth-common.h"
 #include "lib-signals.h"
+#include "array.h"
 #include "hash.h"
 #include "str.h"
 #include "strescape.h"
@@ -11,14 +12,38 @@
 
 #include <time.h>
 
+/* Nodes are allocated in chunks of this many nodes */
+#define AUTH_CACHE_NODES_PER_CHUNK 64
+
+/* Number of hash functions (rows) in the frequency sketch */
+#define AUTH_CACHE_SKETCH_DEPTH 4
+/* Minimum number of counters per row */
+#define AUTH_CACHE_SKETCH_MIN_WIDTH 1024
+/* Counters are 4 bits wide */
+#define AUTH_CACHE_SKETCH_COUNTER_MAX 15
+/* Halve all counters after this many increments per counter in a row, so
+   that entries which were popular a long time ago don't stay that way. */
+#define AUTH_CACHE_SKETCH_SAMPLE_MULTIPLIER 10
+
 struct auth_cache {
 	HASH_TABLE(char *, struct auth_cache_node *) hash;
 	struct auth_cache_node *head, *tail;
 
+	/* fixed size nodes are allocated from these chunks */
+	ARRAY(struct auth_cache_node *) node_chunks;
+	struct auth_cache_node *free_nodes;
+
+	/* TinyLFU-style count-min sketch of the access frequencies of the
+	   cache keys, including keys that aren't in the cache. Two 4bit
+	   counters per byte, AUTH_CACHE_SKETCH_DEPTH rows. */
+	unsigned char *sketch;
+	unsigned int sketch_width;
+	unsigned int sketch_increments, sketch_sample_size;
+
 	size_t max_size, size_left;
 	unsigned int ttl_secs, neg_ttl_secs;
 
-	unsigned int hit_count, miss_count;
+	struct auth_cache_stats stats, stats_at_reset;
 	unsigned int pos_entries, neg_entries;
 	unsigned long long pos_size, neg_size;
 };
@@ -143,6 +168,100 @@ char *auth_cache_parse_key(pool_t pool, const char *query)
 	return p_strdup(pool, str_c(str));
 }
 
+static unsigned int
+auth_cache_sketch_index(struct auth_cache *cache, unsigned int key_hash,
+			unsigned int row)
+{
+	uint32_t h = key_hash + row * 0x9e3779b9U;
+
+	h ^= h >> 16;
+	h *= 0x85ebca6bU;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35U;
+	h ^= h >> 16;
+	return row * cache->sketch_width + (h & (cache->sketch_width - 1));
+}
+
+static unsigned int
+auth_cache_sketch_get(struct auth_cache *cache, unsigned int idx)
+{
+	unsigned char value = cache->sketch[idx / 2];
+
+	return idx % 2 == 0 ? (value & 0x0f) : (value >> 4);
+}
+
+static void auth_cache_sketch_halve(struct auth_cache *cache)
+{
+	size_t i, size = cache->sketch_width * AUTH_CACHE_SKETCH_DEPTH / 2;
+
+	for (i = 0; i < size; i++)
+		cache->sketch[i] = (cache->sketch[i] >> 1) & 0x77;
+	cache->sketch_increments /= 2;
+}
+
+static void
+auth_cache_sketch_increment(struct auth_cache *cache, unsigned int key_hash)
+{
+	unsigned int row, idx;
+	bool incremented = FALSE;
+
+	for (row = 0; row < AUTH_CACHE_SKETCH_DEPTH; row++) {
+		idx = auth_cache_sketch_index(cache, key_hash, row);
+		if (auth_cache_sketch_get(cache, idx) <
+		    AUTH_CACHE_SKETCH_COUNTER_MAX) {
+			cache->sketch[idx / 2] += idx % 2 == 0 ? 0x01 : 0x10;
+			incremented = TRUE;
+		}
+	}
+	if (incremented &&
+	    ++cache->sketch_increments >= cache->sketch_sample_size)
+		auth_cache_sketch_halve(cache);
+}
+
+static unsigned int
+auth_cache_sketch_estimate(struct auth_cache *cache, unsigned int key_hash)
+{
+	unsigned int row, count, min_count = AUTH_CACHE_SKETCH_COUNTER_MAX;
+
+	for (row = 0; row < AUTH_CACHE_SKETCH_DEPTH; row++) {
+		count = auth_cache_sketch_get(cache,
+			auth_cache_sketch_index(cache, key_hash, row));
+		if (count < min_count)
+			min_count = count;
+	}
+	return min_count;
+}
+
+static struct auth_cache_node *auth_cache_node_alloc(struct auth_cache *cache)
+{
+	struct auth_cache_node *node, *chunk;
+	unsigned int i;
+
+	if (cache->free_nodes == NULL) {
+		chunk = i_new(struct auth_cache_node,
+			      AUTH_CACHE_NODES_PER_CHUNK);
+		array_append(&cache->node_chunks, &chunk, 1);
+		for (i = 0; i < AUTH_CACHE_NODES_PER_CHUNK; i++) {
+			chunk[i].next = cache->free_nodes;
+			cache->free_nodes = &chunk[i];
+		}
+	}
+	node = cache->free_nodes;
+	cache->free_nodes = node->next;
+	return node;
+}
+
+static void
+auth_cache_node_free(struct auth_cache *cache, struct auth_cache_node *node)
+{
+	if (node->data != node->inline_data)
+		i_free(node->data);
+	node->data = NULL;
+	node->prev = NULL;
+	node->next = cache->free_nodes;
+	cache->free_nodes = node;
+}
+
 static void
 auth_cache_node_unlink(struct auth_cache *cache, struct auth_cache_node *node)
 {
@@ -184,7 +303,18 @@ auth_cache_node_destroy(struct auth_cache *cache, struct auth_cache_node *node)
 
 	cache->size_left += node->alloc_size;
 	hash_table_remove(cache->hash, key);
-	i_free(node);
+	auth_cache_node_free(cache, node);
+}
+
+static bool
+auth_cache_node_is_expired(struct auth_cache *cache,
+			   struct auth_cache_node *node, time_t now)
+{
+	const char *value = node->data + strlen(node->data) + 1;
+	unsigned int ttl_secs = *value == '\0' ?
+		cache->neg_ttl_secs : cache->ttl_secs;
+
+	return node->created < now - (time_t)ttl_secs;
 }
 
 static void sig_auth_cache_clear(const siginfo_t *si ATTR_UNUSED, void *context)
@@ -198,19 +328,27 @@ static void sig_auth_cache_clear(const siginfo_t *si ATTR_UNUSED, void *context)
 static void sig_auth_cache_stats(const siginfo_t *si ATTR_UNUSED, void *context)
 {
 	struct auth_cache *cache = context;
-	unsigned int total_count;
+	unsigned long long hit_count, total_count;
 	size_t cache_used;
 
-	total_count = cache->hit_count + cache->miss_count;
-	i_info("Authentication cache hits %u/%u (%u%%)",
-	       cache->hit_count, total_count,
-	       total_count == 0 ? 100 : (cache->hit_count * 100 / total_count));
+	hit_count = cache->stats.hit_count - cache->stats_at_reset.hit_count;
+	total_count = hit_count +
+		cache->stats.miss_count - cache->stats_at_reset.miss_count;
+	i_info("Authentication cache hits %llu/%llu (%u%%)",
+	       hit_count, total_count, total_count == 0 ? 100 :
+	       (unsigned int)(hit_count * 100 / total_count));
 
 	i_info("Authentication cache inserts: "
 	       "positive: %u entries %llu bytes, "
 	       "negative: %u entries %llu bytes",
 	       cache->pos_entries, cache->pos_size,
 	       cache->neg_entries, cache->neg_size);
+	i_info("Authentication cache admission rejects: %llu, "
+	       "evictions: %llu",
+	       cache->stats.admission_reject_count -
+	       cache->stats_at_reset.admission_reject_count,
+	       cache->stats.eviction_count -
+	       cache->stats_at_reset.eviction_count);
 
 	cache_used = cache->max_size - cache->size_left;
 	i_info("Authentication cache current size: "
@@ -219,7 +357,7 @@ static void sig_auth_cache_stats(const siginfo_t *si ATTR_UNUSED, void *context)
 	       (unsigned int)(cache_used * 100ULL / cache->max_size));
 
 	/* reset counters */
-	cache->hit_count = cache->miss_count = 0;
+	cache->stats_at_reset = cache->stats;
 	cache->pos_entries = cache->neg_entries = 0;
 	cache->pos_size = cache->neg_size = 0;
 }
@@ -232,6 +370,14 @@ struct auth_cache *auth_cache_new(size_t max_size, unsigned int ttl_secs,
 
 	cache = i_new(struct auth_cache, 1);
 	hash_table_create(&cache->hash, default_pool, 0, str_hash, strcmp);
+	i_array_init(&cache->node_chunks, 16);
+	/* size the sketch by the maximum number of nodes */
+	cache->sketch_width = nearest_power(I_MAX(AUTH_CACHE_SKETCH_MIN_WIDTH,
+		max_size / sizeof(struct auth_cache_node)));
+	cache->sketch = i_new(unsigned char,
+		cache->sketch_width * AUTH_CACHE_SKETCH_DEPTH / 2);
+	cache->sketch_sample_size =
+		cache->sketch_width * AUTH_CACHE_SKETCH_SAMPLE_MULTIPLIER;
 	cache->max_size = max_size;
 	cache->size_left = max_size;
 	cache->ttl_secs = ttl_secs;
@@ -247,6 +393,7 @@ struct auth_cache *auth_cache_new(size_t max_size, unsigned int ttl_secs,
 void auth_cache_free(struct auth_cache **_cache)
 {
 	struct auth_cache *cache = *_cache;
+	struct auth_cache_node **chunkp;
 
 	*_cache = NULL;
 	lib_signals_unset_handler(SIGHUP, sig_auth_cache_clear, cache);
@@ -254,6 +401,10 @@ void auth_cache_free(struct auth_cache **_cache)
 
 	auth_cache_clear(cache);
 	hash_table_destroy(&cache->hash);
+	array_foreach_modifiable(&cache->node_chunks, chunkp)
+		i_free(*chunkp);
+	array_free(&cache->node_chunks);
+	i_free(cache->sketch);
 	i_free(cache);
 }
 
@@ -267,13 +418,11 @@ unsigned int auth_cache_clear(struct auth_cache *cache)
 	return ret;
 }
 
-static bool auth_cache_node_is_user(struct auth_cache_node *node,
-				    const char *username)
+bool auth_cache_key_is_user(const char *data, const char *username)
 {
-	const char *data = node->data;
 	unsigned int username_len;
 
-	/* The cache nodes begin with "P"/"U", passdb/userdb ID, optional
+	/* The cache keys begin with "P"/"U", passdb/userdb ID, optional
 	   "+" master user, "\t" and then usually followed by the username.
 	   It's too much trouble to keep track of all the cache keys, so we'll
 	   just match it as if it was the username. If e.g. '%n' is used in the
@@ -305,7 +454,7 @@ static bool auth_cache_node_is_one_of_users(struct auth_cache_node *node,
 	unsigned int i;
 
 	for (i = 0; usernames[i] != NULL; i++) {
-		if (auth_cache_node_is_user(node, usernames[i]))
+		if (auth_cache_key_is_user(node->data, usernames[i]))
 			return TRUE;
 	}
 	return FALSE;
@@ -336,7 +485,7 @@ auth_cache_escape(const char *string,
 	return str_tabescape(string);
 }
 
-static const char *
+const char *
 auth_request_expand_cache_key(const struct auth_request *request,
 			      const char *key)
 {
@@ -357,6 +506,15 @@ auth_request_expand_cache_key(const struct auth_request *request,
 	return value;
 }
 
+void auth_cache_get_stats(struct auth_cache *cache,
+			  struct auth_cache_stats *stats_r)
+{
+	*stats_r = cache->stats;
+	stats_r->entry_count = hash_table_count(cache->hash);
+	stats_r->used_size = cache->max_size - cache->size_left;
+	stats_r->max_size = cache->max_size;
+}
+
 const char *
 auth_cache_lookup(struct auth_cache *cache, const struct auth_request *request,
 		  const char *key, struct auth_cache_node **node_r,
@@ -364,26 +522,25 @@ auth_cache_lookup(struct auth_cache *cache, const struct auth_request *request,
 {
 	struct auth_cache_node *node;
 	const char *value;
-	unsigned int ttl_secs;
 	time_t now;
 
 	*expired_r = FALSE;
 	*neg_expired_r = FALSE;
 
 	key = auth_request_expand_cache_key(request, key);
+	auth_cache_sketch_increment(cache, str_hash(key));
 	node = hash_table_lookup(cache->hash, key);
 	if (node == NULL) {
-		cache->miss_count++;
+		cache->stats.miss_count++;
 		return NULL;
 	}
 
 	value = node->data + strlen(node->data) + 1;
-	ttl_secs = *value == '\0' ? cache->neg_ttl_secs : cache->ttl_secs;
 
 	now = time(NULL);
-	if (node->created < now - (time_t)ttl_secs) {
+	if (auth_cache_node_is_expired(cache, node, now)) {
 		/* TTL expired */
-		cache->miss_count++;
+		cache->stats.miss_count++;
 		*expired_r = TRUE;
 	} else {
 		/* move to head */
@@ -391,7 +548,7 @@ auth_cache_lookup(struct auth_cache *cache, const struct auth_request *request,
 			auth_cache_node_unlink(cache, node);
 			auth_cache_node_link_head(cache, node);
 		}
-		cache->hit_count++;
+		cache->stats.hit_count++;
 	}
 	if (node->created < now - (time_t)cache->neg_ttl_secs)
 		*neg_expired_r = TRUE;
@@ -402,6 +559,24 @@ auth_cache_lookup(struct auth_cache *cache, const struct auth_request *request,
 	return value;
 }
 
+static bool
+auth_cache_admit(struct auth_cache *cache, const char *key, size_t alloc_size)
+{
+	struct auth_cache_node *victim = cache->tail;
+
+	if (cache->size_left >= alloc_size || victim == NULL)
+		return TRUE;
+	if (auth_cache_node_is_expired(cache, victim, time(NULL)))
+		return TRUE;
+
+	/* The cache is full. Replace the least recently used entry only if
+	   the new key has been seen more often than it. This prevents a
+	   flood of one-time lookups (e.g. nonexistent users) from pushing
+	   out all the frequently used entries. */
+	return auth_cache_sketch_estimate(cache, str_hash(key)) >
+		auth_cache_sketch_estimate(cache, str_hash(victim->data));
+}
+
 void auth_cache_insert(struct auth_cache *cache, struct auth_request *request,
 		       const char *key, const char *value, bool last_success)
 {
@@ -425,29 +600,47 @@ void auth_cache_insert(struct auth_cache *cache, struct auth_request *request,
 	key = auth_request_expand_cache_key(request, key);
 	key_len = strlen(key);
 
+	if (request->user != current_username &&
+	    strcmp(request->user, current_username) != 0) {
+		/* the lookup was done with a different key, so this key's
+		   access wasn't counted yet */
+		auth_cache_sketch_increment(cache, str_hash(key));
+	}
 	request->user = current_username;
 
 	data_size = key_len + 1 + value_len + 1;
-	alloc_size = sizeof(struct auth_cache_node) -
-		sizeof(node->data) + data_size;
-
-	/* make sure we have enough space */
-	while (cache->size_left < alloc_size && cache->tail != NULL)
-		auth_cache_node_destroy(cache, cache->tail);
+	alloc_size = sizeof(struct auth_cache_node);
+	if (data_size > sizeof(node->inline_data))
+		alloc_size += data_size;
 
 	node = hash_table_lookup(cache->hash, key);
 	if (node != NULL) {
 		/* key is already in cache (probably expired), remove it */
 		auth_cache_node_destroy(cache, node);
+	} else if (!auth_cache_admit(cache, key, alloc_size)) {
+		cache->stats.admission_reject_count++;
+		return;
 	}
 
-	/* @UNSAFE */
-	node = i_malloc(alloc_size);
+	/* make sure we have enough space */
+	while (cache->size_left < alloc_size && cache->tail != NULL) {
+		auth_cache_node_destroy(cache, cache->tail);
+		cache->stats.eviction_count++;
+	}
+
+	node = auth_cache_node_alloc(cache);
 	node->created = time(NULL);
 	node->alloc_size = alloc_size;
 	node->last_success = last_success;
+	/* @UNSAFE */
+	if (data_size <= sizeof(node->inline_data))
+		node->data = node->inline_data;
+	else
+		node->data = i_malloc(data_size);
 	memcpy(node->data, key, key_len);
+	node->data[key_len] = '\0';
 	memcpy(node->data + key_len + 1, value, value_len);
+	node->data[key_len + 1 + value_len] = '\0';
 
 	auth_cache_node_link_head(cache, node);
 
@@ -455,6 +648,7 @@ void auth_cache_insert(struct auth_cache *cache, struct auth_request *request,
 	hash_key = node->data;
 	hash_table_insert(cache->hash, hash_key, node);
 
+	cache->stats.insert_count++;
 	if (*value != '\0') {
 		cache->pos_entries++;
 		cache->pos_size += alloc_size;
@@ -1,6 +1,10 @@
 #ifndef AUTH_CACHE_H
 #define AUTH_CACHE_H
 
+/* Number of key+value bytes that fit into the node itself. Larger entries
+   are stored in a separately allocated buffer. */
+#define AUTH_CACHE_NODE_INLINE_DATA_SIZE 216
+
 struct auth_cache_node {
 	struct auth_cache_node *prev, *next;
 
@@ -10,7 +14,23 @@ struct auth_cache_node {
 	/* TRUE if the user gave the correct password the last time. */
 	bool last_success:1;
 
-	char data[4]; /* key \0 value \0 */
+	/* key \0 value \0 - points to inline_data if it fits there */
+	char *data;
+	char inline_data[AUTH_CACHE_NODE_INLINE_DATA_SIZE];
+};
+
+struct auth_cache_stats {
+	/* Lookups since the cache was created */
+	unsigned long long hit_count, miss_count;
+	/* Inserted entries, and entries that weren't inserted because the
+	   admission policy considered them less popular than the entry
+	   that would have been evicted. */
+	unsigned long long insert_count, admission_reject_count;
+	/* Entries dropped to make space for new ones */
+	unsigned long long eviction_count;
+
+	unsigned int entry_count;
+	size_t used_size, max_size;
 };
 
 struct auth_cache;
@@ -20,6 +40,14 @@ struct auth_request;
    list, so it can be used as a cache key. */
 char *auth_cache_parse_key(pool_t pool, const char *query);
 
+/* Expand the %variables in key for the request. The passdb/userdb is
+   identified in the beginning of the returned key. */
+const char *
+auth_request_expand_cache_key(const struct auth_request *request,
+			      const char *key);
+/* Returns TRUE if the expanded cache key belongs to the given username. */
+bool auth_cache_key_is_user(const char *key, const char *username);
+
 /* Create a new cache. max_size specifies the maximum amount of memory in
    bytes to use for cache (it's not fully exact). ttl_secs specifies time to
    live for cache record, requests older than that are not used.
@@ -34,6 +62,10 @@ auth_cache_clear(struct auth_cache *cache);
 unsigned int auth_cache_clear_users(struct auth_cache *cache,
 				    const char *const *usernames);
 
+/* Get cumulative statistics of the cache. */
+void auth_cache_get_stats(struct auth_cache *cache,
+			  struct auth_cache_stats *stats_r);
+
 /* Look key from cache. key should be the same string as returned by
    auth_cache_parse_key(). Returned node can't be used after any other
    auth_cache_*() calls. */
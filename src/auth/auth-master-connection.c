@@ -19,6 +19,7 @@
 #include "userdb-blocking.h"
 #include "master-interface.h"
 #include "passdb-cache.h"
+#include "userdb-shared-cache.h"
 #include "auth-request-handler.h"
 #include "auth-client-connection.h"
 #include "auth-master-connection.h"
@@ -145,20 +146,59 @@ master_input_cache_flush(struct auth_master_connection *conn, const char *args)
 		return FALSE;
 	}
 
+	count = 0;
 	if (passdb_cache == NULL) {
 		/* cache disabled */
-		count = 0;
 	} else if (list[1] == NULL) {
 		/* flush the whole cache */
 		count = auth_cache_clear(passdb_cache);
 	} else {
 		count = auth_cache_clear_users(passdb_cache, list+1);
 	}
+	/* the shared cache is flushed for all the auth processes */
+	if (userdb_shared_cache == NULL) {
+		/* cache disabled */
+	} else if (list[1] == NULL) {
+		count += userdb_shared_cache_clear(userdb_shared_cache);
+	} else {
+		count += userdb_shared_cache_clear_users(userdb_shared_cache,
+							 list+1);
+	}
 	(void)o_stream_send_str(conn->output,
 		t_strdup_printf("OK\t%s\t%u\n", list[0], count));
 	return TRUE;
 }
 
+static bool
+master_input_cache_stats(struct auth_master_connection *conn, const char *args)
+{
+	struct auth_cache_stats stats;
+	string_t *str;
+
+	/* <id> */
+	if (*args == '\0') {
+		i_error("BUG: doveadm sent broken CACHE-STATS");
+		return FALSE;
+	}
+
+	str = t_str_new(256);
+	str_printfa(str, "OK\t%s", args);
+	if (passdb_cache != NULL) {
+		auth_cache_get_stats(passdb_cache, &stats);
+		str_printfa(str, "\thits=%llu\tmisses=%llu"
+			    "\tinserts=%llu\tadmission_rejects=%llu"
+			    "\tevictions=%llu\tentries=%u"
+			    "\tused_size=%"PRIuSIZE_T"\tmax_size=%"PRIuSIZE_T,
+			    stats.hit_count, stats.miss_count,
+			    stats.insert_count, stats.admission_reject_count,
+			    stats.eviction_count, stats.entry_count,
+			    stats.used_size, stats.max_size);
+	}
+	str_append_c(str, '\n');
+	(void)o_stream_send(conn->output, str_data(str), str_len(str));
+	return TRUE;
+}
+
 static int
 master_input_auth_request(struct auth_master_connection *conn, const char *args,
 			  const char *cmd, struct auth_request **request_r,
@@ -623,6 +663,8 @@ auth_master_input_line(struct auth_master_connection *conn, const char *line)
 			return master_input_request(conn, line + 8);
 		if (strncmp(line, "CACHE-FLUSH\t", 12) == 0)
 			return master_input_cache_flush(conn, line + 12);
+		if (strncmp(line, "CACHE-STATS\t", 12) == 0)
+			return master_input_cache_stats(conn, line + 12);
 		if (strncmp(line, "CPID\t", 5) == 0) {
 			i_error("Authentication client trying to connect to "
 				"master socket");
@@ -2,6 +2,7 @@
 
 #include "auth-common.h"
 #include "ioloop.h"
+#include "time-util.h"
 #include "buffer.h"
 #include "hash.h"
 #include "sha1.h"
@@ -20,9 +21,12 @@
 #include "auth-client-connection.h"
 #include "auth-master-connection.h"
 #include "auth-policy.h"
+#include "auth-worker-server.h"
+#include "auth-worker-passw.h"
 #include "passdb.h"
 #include "passdb-blocking.h"
 #include "passdb-cache.h"
+#include "userdb-shared-cache.h"
 #include "passdb-template.h"
 #include "userdb-blocking.h"
 #include "userdb-template.h"
@@ -1214,7 +1218,8 @@ static void auth_request_userdb_save_cache(struct auth_request *request,
 	string_t *str;
 	const char *cache_value;
 
-	if (passdb_cache == NULL || userdb->cache_key == NULL)
+	if ((passdb_cache == NULL && userdb_shared_cache == NULL) ||
+	    userdb->cache_key == NULL)
 		return;
 
 	if (result == USERDB_RESULT_USER_UNKNOWN)
@@ -1239,8 +1244,14 @@ static void auth_request_userdb_save_cache(struct auth_request *request,
 		cache_value = str_c(str);
 	}
 	/* last_success has no meaning with userdb */
-	auth_cache_insert(passdb_cache, request, userdb->cache_key,
-			  cache_value, FALSE);
+	if (passdb_cache != NULL) {
+		auth_cache_insert(passdb_cache, request, userdb->cache_key,
+				  cache_value, FALSE);
+	}
+	if (userdb_shared_cache != NULL) {
+		userdb_shared_cache_insert(userdb_shared_cache, request,
+					   userdb->cache_key, cache_value);
+	}
 }
 
 static bool auth_request_lookup_user_cache(struct auth_request *request,
@@ -1249,12 +1260,26 @@ static bool auth_request_lookup_user_cache(struct auth_request *request,
 					   bool use_expired)
 {
 	struct auth_stats *stats = auth_request_stats_get(request);
-	const char *value;
+	const char *value = NULL, *shared_value;
 	struct auth_cache_node *node;
-	bool expired, neg_expired;
-
-	value = auth_cache_lookup(passdb_cache, request, key, &node,
-				  &expired, &neg_expired);
+	bool expired = FALSE, neg_expired, shared_expired, shared = FALSE;
+
+	passdb_cache_sync_flushes();
+	if (passdb_cache != NULL) {
+		value = auth_cache_lookup(passdb_cache, request, key, &node,
+					  &expired, &neg_expired);
+	}
+	if ((value == NULL || expired) && userdb_shared_cache != NULL) {
+		/* another auth process may have already looked it up */
+		shared_value = userdb_shared_cache_lookup(userdb_shared_cache,
+							  request, key,
+							  &shared_expired);
+		if (shared_value != NULL && (value == NULL || !shared_expired)) {
+			value = shared_value;
+			expired = shared_expired;
+			shared = TRUE;
+		}
+	}
 	if (value == NULL || (expired && !use_expired)) {
 		stats->auth_cache_miss_count++;
 		auth_request_log_debug(request, AUTH_SUBSYS_DB,
@@ -1264,7 +1289,8 @@ static bool auth_request_lookup_user_cache(struct auth_request *request,
 	}
 	stats->auth_cache_hit_count++;
 	auth_request_log_debug(request, AUTH_SUBSYS_DB,
-				"userdb cache hit: %s", value);
+				"userdb %scache hit: %s",
+				shared ? "shared " : "", value);
 
 	if (*value == '\0') {
 		/* negative cache entry */
@@ -1398,7 +1424,8 @@ void auth_request_userdb_callback(enum userdb_result result,
 	} else if (result != USERDB_RESULT_INTERNAL_FAILURE) {
 		if (!request->userdb_result_from_cache)
 			auth_request_userdb_save_cache(request, result);
-	} else if (passdb_cache != NULL && userdb->cache_key != NULL) {
+	} else if ((passdb_cache != NULL || userdb_shared_cache != NULL) &&
+		   userdb->cache_key != NULL) {
 		/* lookup failed. if we're looking here only because the
 		   request was expired in cache, fallback to using cached
 		   expired record. */
@@ -1440,7 +1467,8 @@ void auth_request_lookup_user(struct auth_request *request,
 	}
 
 	/* (for now) auth_cache is shared between passdb and userdb */
-	cache_key = passdb_cache == NULL ? NULL : userdb->cache_key;
+	cache_key = passdb_cache == NULL && userdb_shared_cache == NULL ?
+		NULL : userdb->cache_key;
 	if (cache_key != NULL) {
 		enum userdb_result result;
 
@@ -2356,34 +2384,48 @@ void auth_request_log_unknown_user(struct auth_request *request,
 	i_info("%s", str_c(str));
 }
 
-int auth_request_password_verify(struct auth_request *request,
-				 const char *plain_password,
-				 const char *crypted_password,
-				 const char *scheme, const char *subsystem)
+struct auth_request_password_verify_context {
+	struct auth_request *request;
+	const char *plain_password;
+	const char *crypted_password;
+	const char *scheme;
+	const char *subsystem;
+	verify_plain_callback_t *callback;
+
+	struct timeval start_time;
+};
+
+static bool
+auth_request_password_verify_prepare(struct auth_request *request,
+				     const char *crypted_password,
+				     const char *scheme, const char *subsystem,
+				     const unsigned char **raw_password_r,
+				     size_t *raw_password_size_r, int *ret_r)
 {
-	const unsigned char *raw_password;
-	size_t raw_password_size;
 	const char *error;
 	int ret;
 
 	if (request->skip_password_check) {
 		/* passdb continue* rule after a successful authentication */
-		return 1;
+		*ret_r = 1;
+		return FALSE;
 	}
 
 	if (request->passdb->set->deny) {
 		/* this is a deny database, we don't care about the password */
-		return 0;
+		*ret_r = 0;
+		return FALSE;
 	}
 
 	if (auth_fields_exists(request->extra_fields, "nopassword")) {
 		auth_request_log_debug(request, subsystem,
 					"Allowing any password");
-		return 1;
+		*ret_r = 1;
+		return FALSE;
 	}
 
 	ret = password_decode(crypted_password, scheme,
-			      &raw_password, &raw_password_size, &error);
+			      raw_password_r, raw_password_size_r, &error);
 	if (ret <= 0) {
 		if (ret < 0) {
 			auth_request_log_error(request, subsystem,
@@ -2393,14 +2435,19 @@ int auth_request_password_verify(struct auth_request *request,
 			auth_request_log_error(request, subsystem,
 						"Unknown scheme %s", scheme);
 		}
-		return -1;
+		*ret_r = -1;
+		return FALSE;
 	}
+	return TRUE;
+}
 
-	/* Use original_username since it may be important for some
-	   password schemes (eg. digest-md5). Otherwise the username is used
-	   only for logging purposes. */
-	ret = password_verify(plain_password, request->original_username,
-			      scheme, raw_password, raw_password_size, &error);
+static void
+auth_request_password_verify_finish(struct auth_request *request,
+				    const char *plain_password,
+				    const char *crypted_password,
+				    const char *scheme, const char *subsystem,
+				    int ret, const char *error)
+{
 	if (ret < 0) {
 		const char *password_str = request->set->debug_passwords ?
 			t_strdup_printf(" '%s'", crypted_password) : "";
@@ -2416,9 +2463,131 @@ int auth_request_password_verify(struct auth_request *request,
 				     request->original_username,
 				     subsystem);
 	} T_END;
+}
+
+int auth_request_password_verify(struct auth_request *request,
+				 const char *plain_password,
+				 const char *crypted_password,
+				 const char *scheme, const char *subsystem)
+{
+	const unsigned char *raw_password;
+	size_t raw_password_size;
+	const char *error;
+	int ret;
+
+	if (!auth_request_password_verify_prepare(request, crypted_password,
+						  scheme, subsystem,
+						  &raw_password,
+						  &raw_password_size, &ret))
+		return ret;
+
+	/* Use original_username since it may be important for some
+	   password schemes (eg. digest-md5). Otherwise the username is used
+	   only for logging purposes. */
+	ret = password_verify(plain_password, request->original_username,
+			      scheme, raw_password, raw_password_size, &error);
+	auth_request_password_verify_finish(request, plain_password,
+					    crypted_password, scheme,
+					    subsystem, ret, error);
 	return ret;
 }
 
+static bool
+auth_request_password_verify_worker_callback(const char *reply, void *context)
+{
+	struct auth_request_password_verify_context *ctx = context;
+	struct auth_request *request = ctx->request;
+	enum passdb_result result;
+	struct auth_stats *stats;
+	const char *error;
+	long long diff;
+	int ret;
+
+	if (request->set->stats) {
+		stats = auth_request_stats_get(request);
+		diff = timeval_diff_usecs(&ioloop_timeval, &ctx->start_time);
+		if (diff > 0) {
+			stats->auth_worker_verify_time.tv_sec += diff / 1000000;
+			stats->auth_worker_verify_time.tv_usec += diff % 1000000;
+			if (stats->auth_worker_verify_time.tv_usec >= 1000000) {
+				stats->auth_worker_verify_time.tv_sec++;
+				stats->auth_worker_verify_time.tv_usec -= 1000000;
+			}
+		}
+	}
+
+	result = auth_worker_passw_reply_parse(reply, &ret, &error);
+	if (result != PASSDB_RESULT_INTERNAL_FAILURE) {
+		auth_request_password_verify_finish(request,
+			ctx->plain_password, ctx->crypted_password,
+			ctx->scheme, ctx->subsystem, ret, error);
+	}
+	ctx->callback(result, request);
+	auth_request_unref(&request);
+	return TRUE;
+}
+
+void auth_request_password_verify_async(struct auth_request *request,
+					const char *plain_password,
+					const char *crypted_password,
+					const char *scheme,
+					const char *subsystem,
+					verify_plain_callback_t *callback)
+{
+	struct auth_request_password_verify_context *ctx;
+	const unsigned char *raw_password;
+	size_t raw_password_size;
+	struct auth_stats *stats;
+	string_t *str;
+	int ret;
+
+	if (worker || !request->set->worker_password_verify ||
+	    !password_scheme_is_slow(scheme)) {
+		/* cheap enough to verify in this process */
+		ret = auth_request_password_verify(request, plain_password,
+						   crypted_password, scheme,
+						   subsystem);
+		callback(ret > 0 ? PASSDB_RESULT_OK :
+			 PASSDB_RESULT_PASSWORD_MISMATCH, request);
+		return;
+	}
+
+	if (!auth_request_password_verify_prepare(request, crypted_password,
+						  scheme, subsystem,
+						  &raw_password,
+						  &raw_password_size, &ret)) {
+		callback(ret > 0 ? PASSDB_RESULT_OK :
+			 PASSDB_RESULT_PASSWORD_MISMATCH, request);
+		return;
+	}
+
+	ctx = p_new(request->pool, struct auth_request_password_verify_context, 1);
+	ctx->request = request;
+	ctx->plain_password = p_strdup(request->pool, plain_password);
+	ctx->crypted_password = p_strdup(request->pool, crypted_password);
+	ctx->scheme = p_strdup(request->pool, scheme);
+	/* subsystem is compared by pointer, so it mustn't be copied */
+	ctx->subsystem = subsystem;
+	ctx->callback = callback;
+	ctx->start_time = ioloop_timeval;
+
+	str = t_str_new(128);
+	auth_worker_passw_request(str, scheme, plain_password,
+				  crypted_password, request->original_username);
+
+	auth_request_ref(request);
+	if (auth_worker_call(request->pool, request->user, str_c(str),
+			     auth_request_password_verify_worker_callback,
+			     ctx) == NULL && request->set->stats) {
+		stats = auth_request_stats_get(request);
+		stats->auth_worker_verify_queued_count++;
+	}
+	if (request->set->stats) {
+		stats = auth_request_stats_get(request);
+		stats->auth_worker_verify_count++;
+	}
+}
+
 static void get_log_prefix(string_t *str, struct auth_request *auth_request,
 			   const char *subsystem)
 {
@@ -235,6 +235,16 @@ int auth_request_password_verify(struct auth_request *request,
 				 const char *plain_password,
 				 const char *crypted_password,
 				 const char *scheme, const char *subsystem);
+/* Same as auth_request_password_verify(), but slow password schemes may be
+   verified in an auth worker process when auth_worker_password_verify=yes.
+   The callback is called with PASSDB_RESULT_OK, _PASSWORD_MISMATCH or
+   _INTERNAL_FAILURE, possibly before this function returns. */
+void auth_request_password_verify_async(struct auth_request *request,
+					const char *plain_password,
+					const char *crypted_password,
+					const char *scheme,
+					const char *subsystem,
+					verify_plain_callback_t *callback);
 
 void auth_request_log_debug(struct auth_request *auth_request,
 			    const char *subsystem,
@@ -226,6 +226,7 @@ static const struct setting_define auth_setting_defines[] = {
 	DEF(SET_SIZE, cache_size),
 	DEF(SET_TIME, cache_ttl),
 	DEF(SET_TIME, cache_negative_ttl),
+	DEF(SET_SIZE, userdb_shared_cache_size),
 	DEF(SET_STR, username_chars),
 	DEF(SET_STR, username_translation),
 	DEF(SET_STR, username_format),
@@ -256,6 +257,7 @@ static const struct setting_define auth_setting_defines[] = {
 	DEF(SET_BOOL, use_winbind),
 
 	DEF(SET_UINT, worker_max_count),
+	DEF(SET_BOOL, worker_password_verify),
 
 	DEFLIST(passdbs, "passdb", &auth_passdb_setting_parser_info),
 	DEFLIST(userdbs, "userdb", &auth_userdb_setting_parser_info),
@@ -277,6 +279,7 @@ static const struct auth_settings auth_default_settings = {
 	.cache_size = 0,
 	.cache_ttl = 60*60,
 	.cache_negative_ttl = 60*60,
+	.userdb_shared_cache_size = 0,
 	.username_chars = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ01234567890.-_@",
 	.username_translation = "",
 	.username_format = "%Lu",
@@ -307,6 +310,7 @@ static const struct auth_settings auth_default_settings = {
 	.use_winbind = FALSE,
 
 	.worker_max_count = 30,
+	.worker_password_verify = FALSE,
 
 	.passdbs = ARRAY_INIT,
 	.userdbs = ARRAY_INIT,
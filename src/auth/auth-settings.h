@@ -42,6 +42,7 @@ struct auth_settings {
 	uoff_t cache_size;
 	unsigned int cache_ttl;
 	unsigned int cache_negative_ttl;
+	uoff_t userdb_shared_cache_size;
 	const char *username_chars;
 	const char *username_translation;
 	const char *username_format;
@@ -70,6 +71,7 @@ struct auth_settings {
 	bool use_winbind;
 
 	unsigned int worker_max_count;
+	bool worker_password_verify;
 
 	/* settings that don't have auth_ prefix: */
 	ARRAY(struct auth_passdb_settings *) passdbs;
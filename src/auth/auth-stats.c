@@ -15,7 +15,12 @@ static struct stats_parser_field auth_stats_fields[] = {
 	EN("auth_db_tempfails", auth_db_tempfail_count),
 
 	EN("auth_cache_hits", auth_cache_hit_count),
-	EN("auth_cache_misses", auth_cache_miss_count)
+	EN("auth_cache_misses", auth_cache_miss_count),
+
+	EN("auth_worker_verifies", auth_worker_verify_count),
+	EN("auth_worker_verifies_queued", auth_worker_verify_queued_count),
+	E("auth_worker_verify_time", auth_worker_verify_time,
+	  STATS_PARSER_TYPE_TIMEVAL)
 };
 
 static size_t auth_stats_alloc_size(void)
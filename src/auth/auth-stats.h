@@ -9,6 +9,12 @@ struct auth_stats {
 
 	uint32_t auth_cache_hit_count;
 	uint32_t auth_cache_miss_count;
+
+	/* password verifications done in auth worker processes, how many of
+	   them had to wait for a free worker and their total latency */
+	uint32_t auth_worker_verify_count;
+	uint32_t auth_worker_verify_queued_count;
+	struct timeval auth_worker_verify_time;
 };
 
 extern const struct stats_vfuncs auth_stats_vfuncs;
@@ -12,6 +12,7 @@
 #include "process-title.h"
 #include "master-service.h"
 #include "auth-request.h"
+#include "auth-worker-passw.h"
 #include "auth-worker-client.h"
 
 
@@ -444,6 +445,24 @@ auth_worker_handle_user(struct auth_worker_client *client,
 	return TRUE;
 }
 
+static bool
+auth_worker_handle_passw(struct auth_worker_client *client,
+			 unsigned int id, const char *const *args)
+{
+	/* verify plaintext password against a slow password scheme */
+	string_t *str;
+
+	str = t_str_new(128);
+	str_printfa(str, "%u\t", id);
+	if (!auth_worker_passw_verify(args, str)) {
+		i_error("BUG: Auth worker server sent us invalid PASSW");
+		return FALSE;
+	}
+	str_append_c(str, '\n');
+	auth_worker_send_reply(client, NULL, str);
+	return TRUE;
+}
+
 static void
 auth_worker_client_idle_kill(struct auth_worker_client *client ATTR_UNUSED)
 {
@@ -627,6 +646,8 @@ auth_worker_handle_line(struct auth_worker_client *client, const char *line)
 		ret = auth_worker_handle_user(client, id, args + 2);
 	else if (strcmp(args[1], "LIST") == 0)
 		ret = auth_worker_handle_list(client, id, args + 2);
+	else if (strcmp(args[1], "PASSW") == 0)
+		ret = auth_worker_handle_passw(client, id, args + 2);
 	else {
 		i_error("BUG: Auth-worker received unknown command: %s",
 			args[1]);
@@ -0,0 +1,90 @@
+/* Copyright (c) 2016 Dovecot authors, see the included COPYING file */
+
+#include "auth-common.h"
+#include "str.h"
+#include "strescape.h"
+#include "password-scheme.h"
+#include "auth-worker-passw.h"
+
+void auth_worker_passw_request(string_t *str, const char *scheme,
+			       const char *plain_password,
+			       const char *crypted_password,
+			       const char *username)
+{
+	str_append(str, "PASSW\t");
+	str_append_tabescaped(str, scheme);
+	str_append_c(str, '\t');
+	str_append_tabescaped(str, plain_password);
+	str_append_c(str, '\t');
+	str_append_tabescaped(str, crypted_password);
+	str_append_c(str, '\t');
+	str_append_tabescaped(str, username);
+}
+
+bool auth_worker_passw_verify(const char *const *args, string_t *reply)
+{
+	const char *scheme, *password, *crypted, *username, *error;
+	const unsigned char *raw_password;
+	size_t raw_password_size;
+	int ret;
+
+	/* <scheme> <password> <crypted password> <username> */
+	if (str_array_length(args) < 4)
+		return FALSE;
+	scheme = args[0];
+	password = args[1];
+	crypted = args[2];
+	username = args[3];
+
+	ret = password_decode(crypted, scheme, &raw_password,
+			      &raw_password_size, &error);
+	if (ret == 0)
+		error = t_strdup_printf("Unknown scheme %s", scheme);
+	if (ret > 0) {
+		ret = password_verify(password, username, scheme,
+				      raw_password, raw_password_size, &error);
+	} else {
+		ret = -1;
+	}
+
+	if (ret > 0)
+		str_append(reply, "OK");
+	else {
+		str_printfa(reply, "FAIL\t%d", PASSDB_RESULT_PASSWORD_MISMATCH);
+		if (ret < 0) {
+			str_append_c(reply, '\t');
+			str_append_tabescaped(reply, error);
+		}
+	}
+	return TRUE;
+}
+
+enum passdb_result
+auth_worker_passw_reply_parse(const char *reply, int *ret_r,
+			      const char **error_r)
+{
+	const char *const *args = t_strsplit_tabescaped(reply);
+	int worker_result;
+
+	*ret_r = -1;
+	*error_r = NULL;
+	if (args[0] == NULL) {
+		/* broken reply */
+		return PASSDB_RESULT_INTERNAL_FAILURE;
+	}
+	if (strcmp(args[0], "OK") == 0) {
+		*ret_r = 1;
+		return PASSDB_RESULT_OK;
+	}
+	if (strcmp(args[0], "FAIL") == 0 && args[1] != NULL &&
+	    str_to_int(args[1], &worker_result) == 0 &&
+	    worker_result == PASSDB_RESULT_PASSWORD_MISMATCH) {
+		if (args[2] == NULL)
+			*ret_r = 0;
+		else
+			*error_r = args[2];
+		return PASSDB_RESULT_PASSWORD_MISMATCH;
+	}
+	/* the worker died or the request was aborted */
+	return PASSDB_RESULT_INTERNAL_FAILURE;
+}
@@ -0,0 +1,22 @@
+#ifndef AUTH_WORKER_PASSW_H
+#define AUTH_WORKER_PASSW_H
+
+#include "passdb.h"
+
+/* Append PASSW command and its parameters to str. */
+void auth_worker_passw_request(string_t *str, const char *scheme,
+			       const char *plain_password,
+			       const char *crypted_password,
+			       const char *username);
+/* Verify the password in PASSW parameters and append the reply to str.
+   Returns FALSE if the parameters are invalid. */
+bool auth_worker_passw_verify(const char *const *args, string_t *reply);
+/* Parse auth worker's reply to PASSW. Returns PASSDB_RESULT_OK,
+   _PASSWORD_MISMATCH or _INTERNAL_FAILURE if the worker failed. Unless
+   internal failure is returned, ret_r is set the same way as
+   password_verify() sets it and error_r is set if ret_r is -1. */
+enum passdb_result
+auth_worker_passw_reply_parse(const char *reply, int *ret_r,
+			      const char **error_r);
+
+#endif
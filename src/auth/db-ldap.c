@@ -6,6 +6,7 @@
 
 #include "net.h"
 #include "ioloop.h"
+#include "lib-signals.h"
 #include "array.h"
 #include "hash.h"
 #include "aqueue.h"
@@ -120,6 +121,9 @@ static struct setting_def setting_defs[] = {
 	DEF_STR(default_pass_scheme),
 	DEF_BOOL(userdb_warning_disable),
 	DEF_BOOL(blocking),
+	DEF_INT(connections),
+	DEF_INT(max_pending_requests),
+	DEF_INT(request_stall_secs),
 
 	{ 0, NULL, 0 }
 };
@@ -156,13 +160,23 @@ static struct ldap_settings default_ldap_settings = {
 	.iterate_filter = "(objectClass=posixAccount)",
 	.default_pass_scheme = "crypt",
 	.userdb_warning_disable = FALSE,
-	.blocking = FALSE
+	.blocking = FALSE,
+	.connections = 1,
+	.max_pending_requests = DB_LDAP_MAX_PENDING_REQUESTS,
+	.request_stall_secs = DB_LDAP_REQUEST_STALL_SECS
 };
 
 static struct ldap_connection *ldap_connections = NULL;
 
-static int db_ldap_bind(struct ldap_connection *conn);
-static void db_ldap_conn_close(struct ldap_connection *conn);
+static int db_ldap_bind(struct ldap_link *link);
+static int db_ldap_link_connect(struct ldap_link *link);
+static void db_ldap_link_close(struct ldap_link *link);
+static void
+db_ldap_request_dispatch(struct ldap_connection *conn,
+			 struct ldap_request *request,
+			 struct ldap_link *skip_link) ATTR_NULL(3);
+static void
+db_ldap_link_stall_timeout_update(struct ldap_link *link, bool reply_received);
 struct db_ldap_result_iterate_context *
 db_ldap_result_iterate_init_full(struct ldap_connection *conn,
 				 struct ldap_request_search *ldap_request,
@@ -216,11 +230,11 @@ static int tls_require_cert2str(const char *str, int *value_r)
 }
 #endif
 
-static int ldap_get_errno(struct ldap_connection *conn)
+static int ldap_get_errno(struct ldap_link *link)
 {
 	int ret, err;
 
-	ret = ldap_get_option(conn->ld, LDAP_OPT_ERROR_NUMBER, (void *) &err);
+	ret = ldap_get_option(link->ld, LDAP_OPT_ERROR_NUMBER, (void *) &err);
 	if (ret != LDAP_SUCCESS) {
 		i_error("LDAP: Can't get error number: %s",
 			ldap_err2string(ret));
@@ -230,32 +244,32 @@ static int ldap_get_errno(struct ldap_connection *conn)
 	return err;
 }
 
-const char *ldap_get_error(struct ldap_connection *conn)
+const char *ldap_get_error(struct ldap_link *link)
 {
 	const char *ret;
 	char *str = NULL;
 
-	ret = ldap_err2string(ldap_get_errno(conn));
+	ret = ldap_err2string(ldap_get_errno(link));
 
-	ldap_get_option(conn->ld, LDAP_OPT_ERROR_STRING, (void *)&str);
+	ldap_get_option(link->ld, LDAP_OPT_ERROR_STRING, (void *)&str);
 	if (str != NULL) {
 		ret = t_strconcat(ret, ", ", str, NULL);
 		ldap_memfree(str);
 	}
-	ldap_set_option(conn->ld, LDAP_OPT_ERROR_STRING, NULL);
+	ldap_set_option(link->ld, LDAP_OPT_ERROR_STRING, NULL);
 	return ret;
 }
 
-static void ldap_conn_reconnect(struct ldap_connection *conn)
+static void db_ldap_link_reconnect(struct ldap_link *link)
 {
-	db_ldap_conn_close(conn);
-	if (db_ldap_connect(conn) < 0)
-		db_ldap_conn_close(conn);
+	db_ldap_link_close(link);
+	if (db_ldap_link_connect(link) < 0)
+		db_ldap_link_close(link);
 }
 
-static int ldap_handle_error(struct ldap_connection *conn)
+static int ldap_handle_error(struct ldap_link *link)
 {
-	int err = ldap_get_errno(conn);
+	int err = ldap_get_errno(link);
 
 	switch (err) {
 	case LDAP_SUCCESS:
@@ -288,12 +302,12 @@ static int ldap_handle_error(struct ldap_connection *conn)
 	case LDAP_OPERATIONS_ERROR:
 	default:
 		/* connection problems */
-		ldap_conn_reconnect(conn);
+		db_ldap_link_reconnect(link);
 		return 0;
 	}
 }
 
-static int db_ldap_request_bind(struct ldap_connection *conn,
+static int db_ldap_request_bind(struct ldap_link *link,
 				struct ldap_request *request)
 {
 	struct ldap_request_bind *brequest =
@@ -301,45 +315,45 @@ static int db_ldap_request_bind(struct ldap_connection *conn,
 
 	i_assert(request->type == LDAP_REQUEST_TYPE_BIND);
 	i_assert(request->msgid == -1);
-	i_assert(conn->conn_state == LDAP_CONN_STATE_BOUND_AUTH ||
-		 conn->conn_state == LDAP_CONN_STATE_BOUND_DEFAULT);
-	i_assert(conn->pending_count == 0);
+	i_assert(link->conn_state == LDAP_CONN_STATE_BOUND_AUTH ||
+		 link->conn_state == LDAP_CONN_STATE_BOUND_DEFAULT);
+	i_assert(link->pending_count == 0);
 
-	request->msgid = ldap_bind(conn->ld, brequest->dn,
+	request->msgid = ldap_bind(link->ld, brequest->dn,
 				   request->auth_request->mech_password,
 				   LDAP_AUTH_SIMPLE);
 	if (request->msgid == -1) {
 		auth_request_log_error(request->auth_request, AUTH_SUBSYS_DB,
 				       "ldap_bind(%s) failed: %s",
-				       brequest->dn, ldap_get_error(conn));
-		if (ldap_handle_error(conn) < 0) {
+				       brequest->dn, ldap_get_error(link));
+		if (ldap_handle_error(link) < 0) {
 			/* broken request, remove it */
 			return 0;
 		}
 		return -1;
 	}
-	conn->conn_state = LDAP_CONN_STATE_BINDING;
+	link->conn_state = LDAP_CONN_STATE_BINDING;
 	return 1;
 }
 
-static int db_ldap_request_search(struct ldap_connection *conn,
+static int db_ldap_request_search(struct ldap_link *link,
 				  struct ldap_request *request)
 {
 	struct ldap_request_search *srequest =
 		(struct ldap_request_search *)request;
 
-	i_assert(conn->conn_state == LDAP_CONN_STATE_BOUND_DEFAULT);
+	i_assert(link->conn_state == LDAP_CONN_STATE_BOUND_DEFAULT);
 	i_assert(request->msgid == -1);
 
 	request->msgid =
-		ldap_search(conn->ld, *srequest->base == '\0' ? NULL :
-			    srequest->base, conn->set.ldap_scope,
+		ldap_search(link->ld, *srequest->base == '\0' ? NULL :
+			    srequest->base, link->conn->set.ldap_scope,
 			    srequest->filter, srequest->attributes, 0);
 	if (request->msgid == -1) {
 		auth_request_log_error(request->auth_request, AUTH_SUBSYS_DB,
 				       "ldap_search(%s) parsing failed: %s",
-				       srequest->filter, ldap_get_error(conn));
-		if (ldap_handle_error(conn) < 0) {
+				       srequest->filter, ldap_get_error(link));
+		if (ldap_handle_error(link) < 0) {
 			/* broken request, remove it */
 			return 0;
 		}
@@ -348,37 +362,37 @@ static int db_ldap_request_search(struct ldap_connection *conn,
 	return 1;
 }
 
-static bool db_ldap_request_queue_next(struct ldap_connection *conn)
+static bool db_ldap_request_queue_next(struct ldap_link *link)
 {
 	struct ldap_request *const *requestp, *request;
 	int ret = -1;
 
 	/* connecting may call db_ldap_connect_finish(), which gets us back
 	   here. so do the connection before checking the request queue. */
-	if (db_ldap_connect(conn) < 0)
+	if (db_ldap_link_connect(link) < 0)
 		return FALSE;
 
-	if (conn->pending_count == aqueue_count(conn->request_queue)) {
+	if (link->pending_count == aqueue_count(link->request_queue)) {
 		/* no non-pending requests */
 		return FALSE;
 	}
-	if (conn->pending_count > DB_LDAP_MAX_PENDING_REQUESTS) {
+	if (link->pending_count >= link->conn->set.max_pending_requests) {
 		/* wait until server has replied to some requests */
 		return FALSE;
 	}
 
-	requestp = array_idx(&conn->request_array,
-			     aqueue_idx(conn->request_queue,
-					conn->pending_count));
+	requestp = array_idx(&link->request_array,
+			     aqueue_idx(link->request_queue,
+					link->pending_count));
 	request = *requestp;
 
-	if (conn->pending_count > 0 &&
+	if (link->pending_count > 0 &&
 	    request->type == LDAP_REQUEST_TYPE_BIND) {
 		/* we can't do binds until all existing requests are finished */
 		return FALSE;
 	}
 
-	switch (conn->conn_state) {
+	switch (link->conn_state) {
 	case LDAP_CONN_STATE_DISCONNECTED:
 	case LDAP_CONN_STATE_BINDING:
 		/* wait until we're in bound state */
@@ -388,8 +402,8 @@ static bool db_ldap_request_queue_next(struct ldap_connection *conn)
 			break;
 
 		/* bind to default dn first */
-		i_assert(conn->pending_count == 0);
-		(void)db_ldap_bind(conn);
+		i_assert(link->pending_count == 0);
+		(void)db_ldap_bind(link);
 		return FALSE;
 	case LDAP_CONN_STATE_BOUND_DEFAULT:
 		/* we can do anything in this state */
@@ -398,108 +412,157 @@ static bool db_ldap_request_queue_next(struct ldap_connection *conn)
 
 	switch (request->type) {
 	case LDAP_REQUEST_TYPE_BIND:
-		ret = db_ldap_request_bind(conn, request);
+		ret = db_ldap_request_bind(link, request);
 		break;
 	case LDAP_REQUEST_TYPE_SEARCH:
-		ret = db_ldap_request_search(conn, request);
+		ret = db_ldap_request_search(link, request);
 		break;
 	}
 
 	if (ret > 0) {
 		/* success */
 		i_assert(request->msgid != -1);
-		conn->pending_count++;
+		request->send_time = ioloop_timeval;
+		link->pending_count++;
+		db_ldap_link_stall_timeout_update(link, FALSE);
 		return TRUE;
 	} else if (ret < 0) {
 		/* disconnected */
 		return FALSE;
 	} else {
 		/* broken request, remove from queue */
-		aqueue_delete_tail(conn->request_queue);
-		request->callback(conn, request, NULL);
+		aqueue_delete_tail(link->request_queue);
+		request->callback(link->conn, request, NULL);
 		return TRUE;
 	}
 }
 
 static bool
-db_ldap_check_limits(struct ldap_connection *conn, struct ldap_request *request)
+db_ldap_check_limits(struct ldap_link *link, struct ldap_request *request)
 {
 	struct ldap_request *const *first_requestp;
 	unsigned int count;
 	time_t secs_diff;
 
-	count = aqueue_count(conn->request_queue);
+	count = aqueue_count(link->request_queue);
 	if (count == 0)
 		return TRUE;
 
-	first_requestp = array_idx(&conn->request_array,
-				   aqueue_idx(conn->request_queue, 0));
+	first_requestp = array_idx(&link->request_array,
+				   aqueue_idx(link->request_queue, 0));
 	secs_diff = ioloop_time - (*first_requestp)->create_time;
 	if (secs_diff > DB_LDAP_REQUEST_LOST_TIMEOUT_SECS) {
 		auth_request_log_error(request->auth_request, AUTH_SUBSYS_DB,
 			"Connection appears to be hanging, reconnecting");
-		ldap_conn_reconnect(conn);
+		db_ldap_link_reconnect(link);
 		return TRUE;
 	}
 	return TRUE;
 }
 
-void db_ldap_request(struct ldap_connection *conn,
-		     struct ldap_request *request)
+static bool db_ldap_link_is_usable(struct ldap_link *link)
 {
-	i_assert(request->auth_request != NULL);
+	return link->conn_state != LDAP_CONN_STATE_DISCONNECTED ||
+		link->delayed_connect;
+}
+
+static struct ldap_link *
+db_ldap_get_link(struct ldap_connection *conn, struct ldap_link *skip_link)
+{
+	struct ldap_link *const *linkp, *link = NULL;
+	unsigned int count, min_count = UINT_MAX;
+	bool usable, link_usable = FALSE;
+
+	/* use the connection with the least outstanding requests. prefer
+	   connections that aren't known to be down. */
+	array_foreach(&conn->links, linkp) {
+		if (*linkp == skip_link)
+			continue;
+		usable = db_ldap_link_is_usable(*linkp);
+		if (link_usable && !usable)
+			continue;
+
+		count = aqueue_count((*linkp)->request_queue);
+		if (link == NULL || (usable && !link_usable) ||
+		    count < min_count) {
+			link = *linkp;
+			link_usable = usable;
+			min_count = count;
+		}
+	}
+	return link != NULL ? link : skip_link;
+}
+
+static void
+db_ldap_request_dispatch(struct ldap_connection *conn,
+			 struct ldap_request *request,
+			 struct ldap_link *skip_link)
+{
+	struct ldap_link *link;
+
+	link = db_ldap_get_link(conn, skip_link);
+	i_assert(link != NULL);
 
 	request->msgid = -1;
-	request->create_time = ioloop_time;
+	request->link = link;
 
-	if (!db_ldap_check_limits(conn, request)) {
+	if (!db_ldap_check_limits(link, request)) {
 		request->callback(conn, request, NULL);
 		return;
 	}
 
-	aqueue_append(conn->request_queue, &request);
-	(void)db_ldap_request_queue_next(conn);
+	aqueue_append(link->request_queue, &request);
+	(void)db_ldap_request_queue_next(link);
 }
 
-static int db_ldap_connect_finish(struct ldap_connection *conn, int ret)
+void db_ldap_request(struct ldap_connection *conn,
+		     struct ldap_request *request)
+{
+	i_assert(request->auth_request != NULL);
+
+	request->create_time = ioloop_time;
+	db_ldap_request_dispatch(conn, request, NULL);
+}
+
+static int db_ldap_connect_finish(struct ldap_link *link, int ret)
 {
 	if (ret == LDAP_SERVER_DOWN) {
 		i_error("LDAP: Can't connect to server: %s",
-			conn->set.uris != NULL ?
-			conn->set.uris : conn->set.hosts);
+			link->conn->set.uris != NULL ?
+			link->conn->set.uris : link->conn->set.hosts);
 		return -1;
 	}
 	if (ret != LDAP_SUCCESS) {
 		i_error("LDAP: binding failed (dn %s): %s",
-			conn->set.dn == NULL ? "(none)" : conn->set.dn,
-			ldap_get_error(conn));
+			link->conn->set.dn == NULL ? "(none)" : link->conn->set.dn,
+			ldap_get_error(link));
 		return -1;
 	}
 
-	if (conn->to != NULL)
-		timeout_remove(&conn->to);
-	conn->conn_state = LDAP_CONN_STATE_BOUND_DEFAULT;
-	while (db_ldap_request_queue_next(conn))
+	if (link->to != NULL)
+		timeout_remove(&link->to);
+	link->conn_state = LDAP_CONN_STATE_BOUND_DEFAULT;
+	while (db_ldap_request_queue_next(link))
 		;
 	return 0;
 }
 
-static void db_ldap_default_bind_finished(struct ldap_connection *conn,
+static void db_ldap_default_bind_finished(struct ldap_link *link,
 					  struct db_ldap_result *res)
 {
 	int ret;
 
-	i_assert(conn->pending_count == 0);
-	conn->default_bind_msgid = -1;
+	i_assert(link->pending_count == 0);
+	link->default_bind_msgid = -1;
 
-	ret = ldap_result2error(conn->ld, res->msg, FALSE);
-	if (db_ldap_connect_finish(conn, ret) < 0) {
+	ret = ldap_result2error(link->ld, res->msg, FALSE);
+	if (db_ldap_connect_finish(link, ret) < 0) {
 		/* lost connection, close it */
-		db_ldap_conn_close(conn);
+		db_ldap_link_close(link);
 	}
 }
 
-static void db_ldap_abort_requests(struct ldap_connection *conn,
+static void db_ldap_abort_requests(struct ldap_link *link,
 				   unsigned int max_count,
 				   unsigned int timeout_secs,
 				   bool error, const char *reason)
@@ -507,9 +570,9 @@ static void db_ldap_abort_requests(struct ldap_connection *conn,
 	struct ldap_request *const *requestp, *request;
 	time_t diff;
 
-	while (aqueue_count(conn->request_queue) > 0 && max_count > 0) {
-		requestp = array_idx(&conn->request_array,
-				     aqueue_idx(conn->request_queue, 0));
+	while (aqueue_count(link->request_queue) > 0 && max_count > 0) {
+		requestp = array_idx(&link->request_array,
+				     aqueue_idx(link->request_queue, 0));
 		request = *requestp;
 
 		diff = ioloop_time - request->create_time;
@@ -517,11 +580,11 @@ static void db_ldap_abort_requests(struct ldap_connection *conn,
 			break;
 
 		/* timed out, abort */
-		aqueue_delete_tail(conn->request_queue);
+		aqueue_delete_tail(link->request_queue);
 
 		if (request->msgid != -1) {
-			i_assert(conn->pending_count > 0);
-			conn->pending_count--;
+			i_assert(link->pending_count > 0);
+			link->pending_count--;
 		}
 		if (error) {
 			auth_request_log_error(request->auth_request, AUTH_SUBSYS_DB,
@@ -530,25 +593,25 @@ static void db_ldap_abort_requests(struct ldap_connection *conn,
 			auth_request_log_info(request->auth_request, AUTH_SUBSYS_DB,
 					      "%s", reason);
 		}
-		request->callback(conn, request, NULL);
+		request->callback(link->conn, request, NULL);
 		max_count--;
 	}
 }
 
 static struct ldap_request *
-db_ldap_find_request(struct ldap_connection *conn, int msgid,
+db_ldap_find_request(struct ldap_link *link, int msgid,
 		     unsigned int *idx_r)
 {
 	struct ldap_request *const *requests, *request = NULL;
 	unsigned int i, count;
 
-	count = aqueue_count(conn->request_queue);
+	count = aqueue_count(link->request_queue);
 	if (count == 0)
 		return NULL;
 
-	requests = array_idx(&conn->request_array, 0);
+	requests = array_idx(&link->request_array, 0);
 	for (i = 0; i < count; i++) {
-		request = requests[aqueue_idx(conn->request_queue, i)];
+		request = requests[aqueue_idx(link->request_queue, i)];
 		if (request->msgid == msgid) {
 			*idx_r = i;
 			return request;
@@ -559,6 +622,84 @@ db_ldap_find_request(struct ldap_connection *conn, int msgid,
 	return NULL;
 }
 
+static void
+db_ldap_link_add_latency(struct ldap_link *link,
+			 const struct ldap_request *request)
+{
+	int msecs = timeval_diff_msecs(&ioloop_timeval, &request->send_time);
+	unsigned int idx = 0;
+
+	while (msecs > 0 && idx < DB_LDAP_LATENCY_HISTOGRAM_SIZE-1) {
+		msecs >>= 1;
+		idx++;
+	}
+	link->latency_histogram[idx]++;
+}
+
+static void db_ldap_link_stalled(struct ldap_link *link)
+{
+	ARRAY(struct ldap_request *) requests;
+	struct ldap_request *const *requestp, *request;
+	unsigned int count;
+
+	if (link->io == NULL) {
+		/* input is disabled, so we're not even trying to read the
+		   replies. */
+		timeout_remove(&link->to_stall);
+		return;
+	}
+
+	count = aqueue_count(link->request_queue);
+	link->stall_count++;
+	i_warning("LDAP %s: Connection %u hasn't replied in %u secs, "
+		  "reconnecting and retrying %u requests on other connections",
+		  link->conn->config_path, link->idx,
+		  link->conn->set.request_stall_secs, count);
+
+	/* move all the requests away from this connection before
+	   reconnecting it */
+	i_array_init(&requests, count);
+	while (aqueue_count(link->request_queue) > 0) {
+		requestp = array_idx(&link->request_array,
+				     aqueue_idx(link->request_queue, 0));
+		array_append(&requests, requestp, 1);
+		aqueue_delete_tail(link->request_queue);
+	}
+	link->pending_count = 0;
+	db_ldap_link_reconnect(link);
+
+	array_foreach(&requests, requestp) {
+		request = *requestp;
+		if (request->replied) {
+			/* we already got a partial reply, so the request
+			   can't be safely retried */
+			auth_request_log_error(request->auth_request,
+				AUTH_SUBSYS_DB,
+				"Connection stalled in the middle of reply");
+			request->callback(link->conn, request, NULL);
+		} else {
+			db_ldap_request_dispatch(link->conn, request, link);
+		}
+	}
+	array_free(&requests);
+}
+
+static void
+db_ldap_link_stall_timeout_update(struct ldap_link *link, bool reply_received)
+{
+	if (link->pending_count == 0 || array_count(&link->conn->links) == 1 ||
+	    link->conn->set.request_stall_secs == 0) {
+		/* nothing to retry, nowhere to retry it, or disabled */
+		if (link->to_stall != NULL)
+			timeout_remove(&link->to_stall);
+	} else if (link->to_stall == NULL) {
+		link->to_stall = timeout_add(link->conn->set.request_stall_secs*1000,
+					     db_ldap_link_stalled, link);
+	} else if (reply_received) {
+		timeout_reset(link->to_stall);
+	}
+}
+
 static int db_ldap_fields_get_dn(struct ldap_connection *conn,
 				 struct ldap_request_search *request,
 				 struct db_ldap_result *res)
@@ -616,7 +757,7 @@ db_ldap_field_subquery_find(const char *data, void *context,
 }
 
 static int
-ldap_request_send_subquery(struct ldap_connection *conn,
+ldap_request_send_subquery(struct ldap_link *link,
 			   struct ldap_request_search *request,
 			   struct ldap_request_named_result *named_res)
 {
@@ -660,12 +801,12 @@ ldap_request_send_subquery(struct ldap_connection *conn,
 	array_append_zero(&ctx.attr_names);
 
 	request->request.msgid =
-		ldap_search(conn->ld, named_res->dn, LDAP_SCOPE_BASE,
+		ldap_search(link->ld, named_res->dn, LDAP_SCOPE_BASE,
 			    NULL, array_idx_modifiable(&ctx.attr_names, 0), 0);
 	if (request->request.msgid == -1) {
 		auth_request_log_error(request->request.auth_request, AUTH_SUBSYS_DB,
 				       "ldap_search(dn=%s) failed: %s",
-				       named_res->dn, ldap_get_error(conn));
+				       named_res->dn, ldap_get_error(link));
 		return -1;
 	}
 	return 0;
@@ -691,7 +832,7 @@ static int db_ldap_search_save_result(struct ldap_request_search *request,
 	return 0;
 }
 
-static int db_ldap_search_next_subsearch(struct ldap_connection *conn,
+static int db_ldap_search_next_subsearch(struct ldap_link *link,
 					 struct ldap_request_search *request,
 					 struct db_ldap_result *res)
 {
@@ -711,7 +852,7 @@ static int db_ldap_search_next_subsearch(struct ldap_connection *conn,
 			named_res = array_append_space(&request->named_results);
 			named_res->field = field;
 		}
-		if (db_ldap_fields_get_dn(conn, request, res) < 0)
+		if (db_ldap_fields_get_dn(link->conn, request, res) < 0)
 			return -1;
 	} else {
 		request->name_idx++;
@@ -721,7 +862,7 @@ static int db_ldap_search_next_subsearch(struct ldap_connection *conn,
 		named_res = array_idx_modifiable(&request->named_results,
 						 request->name_idx);
 		if (named_res->dn != NULL) {
-			if (ldap_request_send_subquery(conn, request,
+			if (ldap_request_send_subquery(link, request,
 						       named_res) < 0)
 				return -1;
 			return 1;
@@ -733,7 +874,7 @@ static int db_ldap_search_next_subsearch(struct ldap_connection *conn,
 }
 
 static bool
-db_ldap_handle_request_result(struct ldap_connection *conn,
+db_ldap_handle_request_result(struct ldap_link *link,
 			      struct ldap_request *request, unsigned int idx,
 			      struct db_ldap_result *res)
 {
@@ -742,12 +883,12 @@ db_ldap_handle_request_result(struct ldap_connection *conn,
 	int ret;
 	bool final_result;
 
-	i_assert(conn->pending_count > 0);
+	i_assert(link->pending_count > 0);
 
 	if (request->type == LDAP_REQUEST_TYPE_BIND) {
-		i_assert(conn->conn_state == LDAP_CONN_STATE_BINDING);
-		i_assert(conn->pending_count == 1);
-		conn->conn_state = LDAP_CONN_STATE_BOUND_AUTH;
+		i_assert(link->conn_state == LDAP_CONN_STATE_BINDING);
+		i_assert(link->pending_count == 1);
+		link->conn_state = LDAP_CONN_STATE_BOUND_AUTH;
 	} else {
 		srequest = (struct ldap_request_search *)request;
 		switch (ldap_msgtype(res->msg)) {
@@ -768,7 +909,7 @@ db_ldap_handle_request_result(struct ldap_connection *conn,
 		final_result = FALSE;
 	} else {
 		final_result = TRUE;
-		ret = ldap_result2error(conn->ld, res->msg, 0);
+		ret = ldap_result2error(link->ld, res->msg, 0);
 	}
 	/* LDAP_NO_SUCH_OBJECT is returned for nonexistent base */
 	if (ret != LDAP_SUCCESS && ret != LDAP_NO_SUCH_OBJECT &&
@@ -803,7 +944,7 @@ db_ldap_handle_request_result(struct ldap_connection *conn,
 				return FALSE;
 			}
 		} else {
-			ret = db_ldap_search_next_subsearch(conn, srequest, res);
+			ret = db_ldap_search_next_subsearch(link, srequest, res);
 			if (ret > 0) {
 				/* more LDAP queries left */
 				return FALSE;
@@ -820,20 +961,21 @@ db_ldap_handle_request_result(struct ldap_connection *conn,
 	if (request->failed)
 		res = NULL;
 	if (final_result) {
-		conn->pending_count--;
-		aqueue_delete(conn->request_queue, idx);
+		link->pending_count--;
+		aqueue_delete(link->request_queue, idx);
+		db_ldap_link_add_latency(link, request);
 	}
 
 	T_BEGIN {
 		if (res != NULL && srequest != NULL && srequest->result != NULL)
-			request->callback(conn, request, srequest->result->msg);
+			request->callback(link->conn, request, srequest->result->msg);
 
-		request->callback(conn, request, res == NULL ? NULL : res->msg);
+		request->callback(link->conn, request, res == NULL ? NULL : res->msg);
 	} T_END;
 
 	if (idx > 0) {
 		/* see if there are timed out requests */
-		db_ldap_abort_requests(conn, idx,
+		db_ldap_abort_requests(link, idx,
 				       DB_LDAP_REQUEST_LOST_TIMEOUT_SECS,
 				       TRUE, "Request lost");
 	}
@@ -874,7 +1016,7 @@ db_ldap_request_free(struct ldap_request *request)
 }
 
 static void
-db_ldap_handle_result(struct ldap_connection *conn, struct db_ldap_result *res)
+db_ldap_handle_result(struct ldap_link *link, struct db_ldap_result *res)
 {
 	struct auth_request *auth_request;
 	struct ldap_request *request;
@@ -882,42 +1024,44 @@ db_ldap_handle_result(struct ldap_connection *conn, struct db_ldap_result *res)
 	int msgid;
 
 	msgid = ldap_msgid(res->msg);
-	if (msgid == conn->default_bind_msgid) {
-		db_ldap_default_bind_finished(conn, res);
+	if (msgid == link->default_bind_msgid) {
+		db_ldap_default_bind_finished(link, res);
 		return;
 	}
 
-	request = db_ldap_find_request(conn, msgid, &idx);
+	request = db_ldap_find_request(link, msgid, &idx);
 	if (request == NULL) {
 		i_error("LDAP: Reply with unknown msgid %d", msgid);
 		return;
 	}
+	request->replied = TRUE;
 	/* request is allocated from auth_request's pool */
 	auth_request = request->auth_request;
 	auth_request_ref(auth_request);
-	if (db_ldap_handle_request_result(conn, request, idx, res))
+	if (db_ldap_handle_request_result(link, request, idx, res))
 		db_ldap_request_free(request);
 	auth_request_unref(&auth_request);
 }
 
-static void ldap_input(struct ldap_connection *conn)
+static void ldap_input(struct ldap_link *link)
 {
 	struct timeval timeout;
 	struct db_ldap_result *res;
 	LDAPMessage *msg;
 	time_t prev_reply_diff;
+	bool reply_received = FALSE;
 	int ret;
 
 	do {
-		if (conn->ld == NULL)
+		if (link->ld == NULL)
 			return;
 
 		memset(&timeout, 0, sizeof(timeout));
-		ret = ldap_result(conn->ld, LDAP_RES_ANY, 0, &timeout, &msg);
+		ret = ldap_result(link->ld, LDAP_RES_ANY, 0, &timeout, &msg);
 #ifdef OPENLDAP_ASYNC_WORKAROUND
 		if (ret == 0) {
 			/* try again, there may be another in buffer */
-			ret = ldap_result(conn->ld, LDAP_RES_ANY, 0,
+			ret = ldap_result(link->ld, LDAP_RES_ANY, 0,
 					  &timeout, &msg);
 		}
 #endif
@@ -927,31 +1071,33 @@ static void ldap_input(struct ldap_connection *conn)
 		res = i_new(struct db_ldap_result, 1);
 		res->refcount = 1;
 		res->msg = msg;
-		db_ldap_handle_result(conn, res);
+		db_ldap_handle_result(link, res);
 		db_ldap_result_unref(&res);
-	} while (conn->io != NULL);
+		reply_received = TRUE;
+	} while (link->io != NULL);
 
-	prev_reply_diff = ioloop_time - conn->last_reply_stamp;
-	conn->last_reply_stamp = ioloop_time;
+	prev_reply_diff = ioloop_time - link->last_reply_stamp;
+	link->last_reply_stamp = ioloop_time;
+	db_ldap_link_stall_timeout_update(link, reply_received);
 
 	if (ret > 0) {
 		/* input disabled, continue once it's enabled */
-		i_assert(conn->io == NULL);
+		i_assert(link->io == NULL);
 	} else if (ret == 0) {
 		/* send more requests */
-		while (db_ldap_request_queue_next(conn))
+		while (db_ldap_request_queue_next(link))
 			;
-	} else if (ldap_get_errno(conn) != LDAP_SERVER_DOWN) {
-		i_error("LDAP: ldap_result() failed: %s", ldap_get_error(conn));
-		ldap_conn_reconnect(conn);
-	} else if (aqueue_count(conn->request_queue) > 0 ||
+	} else if (ldap_get_errno(link) != LDAP_SERVER_DOWN) {
+		i_error("LDAP: ldap_result() failed: %s", ldap_get_error(link));
+		db_ldap_link_reconnect(link);
+	} else if (aqueue_count(link->request_queue) > 0 ||
 		   prev_reply_diff < DB_LDAP_IDLE_RECONNECT_SECS) {
 		i_error("LDAP: Connection lost to LDAP server, reconnecting");
-		ldap_conn_reconnect(conn);
+		db_ldap_link_reconnect(link);
 	} else {
 		/* server probably disconnected an idle connection. don't
 		   reconnect until the next request comes. */
-		db_ldap_conn_close(conn);
+		db_ldap_link_close(link);
 	}
 }
 
@@ -992,42 +1138,42 @@ sasl_interact(LDAP *ld ATTR_UNUSED, unsigned flags ATTR_UNUSED,
 }
 #endif
 
-static void ldap_connection_timeout(struct ldap_connection *conn)
+static void ldap_connection_timeout(struct ldap_link *link)
 {
-	i_assert(conn->conn_state == LDAP_CONN_STATE_BINDING);
+	i_assert(link->conn_state == LDAP_CONN_STATE_BINDING);
 
 	i_error("LDAP %s: Initial binding to LDAP server timed out",
-		conn->config_path);
-	db_ldap_conn_close(conn);
+		link->conn->config_path);
+	db_ldap_link_close(link);
 }
 
 #ifdef HAVE_LDAP_SASL
-static int db_ldap_bind_sasl(struct ldap_connection *conn)
+static int db_ldap_bind_sasl(struct ldap_link *link)
 {
 	struct db_ldap_sasl_bind_context context;
 	int ret;
 
 	memset(&context, 0, sizeof(context));
-	context.authcid = conn->set.dn;
-	context.passwd = conn->set.dnpass;
-	context.realm = conn->set.sasl_realm;
-	context.authzid = conn->set.sasl_authz_id;
+	context.authcid = link->conn->set.dn;
+	context.passwd = link->conn->set.dnpass;
+	context.realm = link->conn->set.sasl_realm;
+	context.authzid = link->conn->set.sasl_authz_id;
 
 	/* There doesn't seem to be a way to do SASL binding
 	   asynchronously.. */
-	ret = ldap_sasl_interactive_bind_s(conn->ld, NULL,
-					   conn->set.sasl_mech,
+	ret = ldap_sasl_interactive_bind_s(link->ld, NULL,
+					   link->conn->set.sasl_mech,
 					   NULL, NULL, LDAP_SASL_QUIET,
 					   sasl_interact, &context);
-	if (db_ldap_connect_finish(conn, ret) < 0)
+	if (db_ldap_connect_finish(link, ret) < 0)
 		return -1;
 	
-	conn->conn_state = LDAP_CONN_STATE_BOUND_DEFAULT;
+	link->conn_state = LDAP_CONN_STATE_BOUND_DEFAULT;
 
 	return 0;
 }
 #else
-static int db_ldap_bind_sasl(struct ldap_connection *conn ATTR_UNUSED)
+static int db_ldap_bind_sasl(struct ldap_link *link ATTR_UNUSED)
 {
 	i_unreached(); /* already checked at init */
 
@@ -1035,65 +1181,65 @@ static int db_ldap_bind_sasl(struct ldap_connection *conn ATTR_UNUSED)
 }
 #endif
 
-static int db_ldap_bind_simple(struct ldap_connection *conn)
+static int db_ldap_bind_simple(struct ldap_link *link)
 {
 	int msgid;
 
-	i_assert(conn->conn_state != LDAP_CONN_STATE_BINDING);
-	i_assert(conn->default_bind_msgid == -1);
-	i_assert(conn->pending_count == 0);
+	i_assert(link->conn_state != LDAP_CONN_STATE_BINDING);
+	i_assert(link->default_bind_msgid == -1);
+	i_assert(link->pending_count == 0);
 
-	msgid = ldap_bind(conn->ld, conn->set.dn, conn->set.dnpass,
+	msgid = ldap_bind(link->ld, link->conn->set.dn, link->conn->set.dnpass,
 			  LDAP_AUTH_SIMPLE);
 	if (msgid == -1) {
-		i_assert(ldap_get_errno(conn) != LDAP_SUCCESS);
-		if (db_ldap_connect_finish(conn, ldap_get_errno(conn)) < 0) {
+		i_assert(ldap_get_errno(link) != LDAP_SUCCESS);
+		if (db_ldap_connect_finish(link, ldap_get_errno(link)) < 0) {
 			/* lost connection, close it */
-			db_ldap_conn_close(conn);
+			db_ldap_link_close(link);
 		}
 		return -1;
 	}
 
-	conn->conn_state = LDAP_CONN_STATE_BINDING;
-	conn->default_bind_msgid = msgid;
+	link->conn_state = LDAP_CONN_STATE_BINDING;
+	link->default_bind_msgid = msgid;
 
-	if (conn->to != NULL)
-		timeout_remove(&conn->to);
-	conn->to = timeout_add(DB_LDAP_REQUEST_LOST_TIMEOUT_SECS*1000,
-			       ldap_connection_timeout, conn);
+	if (link->to != NULL)
+		timeout_remove(&link->to);
+	link->to = timeout_add(DB_LDAP_REQUEST_LOST_TIMEOUT_SECS*1000,
+			       ldap_connection_timeout, link);
 	return 0;
 }
 
-static int db_ldap_bind(struct ldap_connection *conn)
+static int db_ldap_bind(struct ldap_link *link)
 {
-	if (conn->set.sasl_bind) {
-		if (db_ldap_bind_sasl(conn) < 0)
+	if (link->conn->set.sasl_bind) {
+		if (db_ldap_bind_sasl(link) < 0)
 			return -1;
 	} else {
-		if (db_ldap_bind_simple(conn) < 0)
+		if (db_ldap_bind_simple(link) < 0)
 			return -1;
 	}
 
 	return 0;
 }
 
-static void db_ldap_get_fd(struct ldap_connection *conn)
+static void db_ldap_get_fd(struct ldap_link *link)
 {
 	int ret;
 
 	/* get the connection's fd */
-	ret = ldap_get_option(conn->ld, LDAP_OPT_DESC, (void *)&conn->fd);
+	ret = ldap_get_option(link->ld, LDAP_OPT_DESC, (void *)&link->fd);
 	if (ret != LDAP_SUCCESS) {
 		i_fatal("LDAP %s: Can't get connection fd: %s",
-			conn->config_path, ldap_err2string(ret));
+			link->conn->config_path, ldap_err2string(ret));
 	}
-	if (conn->fd <= STDERR_FILENO) {
+	if (link->fd <= STDERR_FILENO) {
 		/* Solaris LDAP library seems to be broken */
 		i_fatal("LDAP %s: Buggy LDAP library returned wrong fd: %d",
-			conn->config_path, conn->fd);
+			link->conn->config_path, link->fd);
 	}
-	i_assert(conn->fd != -1);
-	net_set_nonblock(conn->fd, TRUE);
+	i_assert(link->fd != -1);
+	net_set_nonblock(link->fd, TRUE);
 }
 
 static void ATTR_NULL(1)
@@ -1146,7 +1292,7 @@ static void db_ldap_set_tls_options(struct ldap_connection *conn)
 #endif
 }
 
-static void db_ldap_set_options(struct ldap_connection *conn)
+static void db_ldap_set_options(struct ldap_link *link)
 {
 	unsigned int ldap_version;
 	int value;
@@ -1156,54 +1302,54 @@ static void db_ldap_set_options(struct ldap_connection *conn)
 	int ret;
 
 	tv.tv_sec = DB_LDAP_CONNECT_TIMEOUT_SECS; tv.tv_usec = 0;
-	ret = ldap_set_option(conn->ld, LDAP_OPT_NETWORK_TIMEOUT, &tv);
+	ret = ldap_set_option(link->ld, LDAP_OPT_NETWORK_TIMEOUT, &tv);
 	if (ret != LDAP_SUCCESS) {
 		i_fatal("LDAP %s: Can't set network-timeout: %s",
-			conn->config_path, ldap_err2string(ret));
+			link->conn->config_path, ldap_err2string(ret));
 	}
 #endif
 
-	db_ldap_set_opt(conn, conn->ld, LDAP_OPT_DEREF, &conn->set.ldap_deref,
-			"deref", conn->set.deref);
+	db_ldap_set_opt(link->conn, link->ld, LDAP_OPT_DEREF, &link->conn->set.ldap_deref,
+			"deref", link->conn->set.deref);
 #ifdef LDAP_OPT_DEBUG_LEVEL
-	if (str_to_int(conn->set.debug_level, &value) >= 0 && value != 0) {
-		db_ldap_set_opt(conn, NULL, LDAP_OPT_DEBUG_LEVEL, &value,
-				"debug_level", conn->set.debug_level);
+	if (str_to_int(link->conn->set.debug_level, &value) >= 0 && value != 0) {
+		db_ldap_set_opt(link->conn, NULL, LDAP_OPT_DEBUG_LEVEL, &value,
+				"debug_level", link->conn->set.debug_level);
 	}
 #endif
 
-	ldap_version = conn->set.ldap_version;
-	db_ldap_set_opt(conn, conn->ld, LDAP_OPT_PROTOCOL_VERSION, &ldap_version,
+	ldap_version = link->conn->set.ldap_version;
+	db_ldap_set_opt(link->conn, link->ld, LDAP_OPT_PROTOCOL_VERSION, &ldap_version,
 			"protocol_version", dec2str(ldap_version));
-	db_ldap_set_tls_options(conn);
+	db_ldap_set_tls_options(link->conn);
 }
 
-static void db_ldap_init_ld(struct ldap_connection *conn)
+static void db_ldap_init_ld(struct ldap_link *link)
 {
 	int ret;
 
-	if (conn->set.uris != NULL) {
+	if (link->conn->set.uris != NULL) {
 #ifdef LDAP_HAVE_INITIALIZE
-		ret = ldap_initialize(&conn->ld, conn->set.uris);
+		ret = ldap_initialize(&link->ld, link->conn->set.uris);
 		if (ret != LDAP_SUCCESS) {
 			i_fatal("LDAP %s: ldap_initialize() failed with uris %s: %s",
-				conn->config_path, conn->set.uris,
+				link->conn->config_path, link->conn->set.uris,
 				ldap_err2string(ret));
 		}
 #else
 		i_unreached(); /* already checked at init */
 #endif
 	} else {
-		conn->ld = ldap_init(conn->set.hosts, LDAP_PORT);
-		if (conn->ld == NULL) {
+		link->ld = ldap_init(link->conn->set.hosts, LDAP_PORT);
+		if (link->ld == NULL) {
 			i_fatal("LDAP %s: ldap_init() failed with hosts: %s",
-				conn->config_path, conn->set.hosts);
+				link->conn->config_path, link->conn->set.hosts);
 		}
 	}
-	db_ldap_set_options(conn);
+	db_ldap_set_options(link);
 }
 
-int db_ldap_connect(struct ldap_connection *conn)
+static int db_ldap_link_connect(struct ldap_link *link)
 {
 	int debug_level;
 	bool debug;
@@ -1211,37 +1357,37 @@ int db_ldap_connect(struct ldap_connection *conn)
 	int ret;
 
 	debug = FALSE;
-	if (str_to_int(conn->set.debug_level, &debug_level) >= 0)
+	if (str_to_int(link->conn->set.debug_level, &debug_level) >= 0)
 		debug = debug_level > 0;
 
-	if (conn->conn_state != LDAP_CONN_STATE_DISCONNECTED)
+	if (link->conn_state != LDAP_CONN_STATE_DISCONNECTED)
 		return 0;
 
 	if (debug) {
 		if (gettimeofday(&start, NULL) < 0)
 			memset(&start, 0, sizeof(start));
 	}
-	i_assert(conn->pending_count == 0);
+	i_assert(link->pending_count == 0);
 
-	if (conn->delayed_connect) {
-		conn->delayed_connect = FALSE;
-		timeout_remove(&conn->to);
+	if (link->delayed_connect) {
+		link->delayed_connect = FALSE;
+		timeout_remove(&link->to);
 	}
-	if (conn->ld == NULL)
-		db_ldap_init_ld(conn);
+	if (link->ld == NULL)
+		db_ldap_init_ld(link);
 
-	if (conn->set.tls) {
+	if (link->conn->set.tls) {
 #ifdef LDAP_HAVE_START_TLS_S
-		ret = ldap_start_tls_s(conn->ld, NULL, NULL);
+		ret = ldap_start_tls_s(link->ld, NULL, NULL);
 		if (ret != LDAP_SUCCESS) {
 			if (ret == LDAP_OPERATIONS_ERROR &&
-			    conn->set.uris != NULL &&
-			    strncmp(conn->set.uris, "ldaps:", 6) == 0) {
+			    link->conn->set.uris != NULL &&
+			    strncmp(link->conn->set.uris, "ldaps:", 6) == 0) {
 				i_fatal("LDAP %s: Don't use both tls=yes "
-					"and ldaps URI", conn->config_path);
+					"and ldaps URI", link->conn->config_path);
 			}
 			i_error("LDAP %s: ldap_start_tls_s() failed: %s",
-				conn->config_path, ldap_err2string(ret));
+				link->conn->config_path, ldap_err2string(ret));
 			return -1;
 		}
 #else
@@ -1249,7 +1395,7 @@ int db_ldap_connect(struct ldap_connection *conn)
 #endif
 	}
 
-	if (db_ldap_bind(conn) < 0)
+	if (db_ldap_bind(link) < 0)
 		return -1;
 
 	if (debug) {
@@ -1259,90 +1405,117 @@ int db_ldap_connect(struct ldap_connection *conn)
 		}
 	}
 
-	db_ldap_get_fd(conn);
-	conn->io = io_add(conn->fd, IO_READ, ldap_input, conn);
+	db_ldap_get_fd(link);
+	link->io = io_add(link->fd, IO_READ, ldap_input, link);
 	return 0;
 }
 
-static void db_ldap_connect_callback(struct ldap_connection *conn)
+int db_ldap_connect(struct ldap_connection *conn)
 {
-	i_assert(conn->conn_state == LDAP_CONN_STATE_DISCONNECTED);
-	(void)db_ldap_connect(conn);
+	struct ldap_link *const *linkp;
+	int ret = -1;
+
+	array_foreach(&conn->links, linkp) {
+		if (db_ldap_link_connect(*linkp) == 0)
+			ret = 0;
+	}
+	return ret;
+}
+
+static void db_ldap_connect_callback(struct ldap_link *link)
+{
+	i_assert(link->conn_state == LDAP_CONN_STATE_DISCONNECTED);
+	(void)db_ldap_link_connect(link);
 }
 
 void db_ldap_connect_delayed(struct ldap_connection *conn)
 {
-	if (conn->delayed_connect)
-		return;
-	conn->delayed_connect = TRUE;
+	struct ldap_link *const *linkp, *link;
+
+	array_foreach(&conn->links, linkp) {
+		link = *linkp;
+		if (link->delayed_connect)
+			continue;
+		link->delayed_connect = TRUE;
 
-	i_assert(conn->to == NULL);
-	conn->to = timeout_add_short(0, db_ldap_connect_callback, conn);
+		i_assert(link->to == NULL);
+		link->to = timeout_add_short(0, db_ldap_connect_callback, link);
+	}
 }
 
-void db_ldap_enable_input(struct ldap_connection *conn, bool enable)
+void db_ldap_enable_input(struct ldap_request *request, bool enable)
 {
+	struct ldap_link *link = request->link;
+
+	if (link == NULL)
+		return;
+
 	if (!enable) {
-		if (conn->io != NULL)
-			io_remove(&conn->io);
+		if (link->io != NULL)
+			io_remove(&link->io);
+		if (link->to_stall != NULL)
+			timeout_remove(&link->to_stall);
 	} else {
-		if (conn->io == NULL && conn->fd != -1) {
-			conn->io = io_add(conn->fd, IO_READ, ldap_input, conn);
-			ldap_input(conn);
+		if (link->io == NULL && link->fd != -1) {
+			link->io = io_add(link->fd, IO_READ, ldap_input, link);
+			db_ldap_link_stall_timeout_update(link, FALSE);
+			ldap_input(link);
 		}
 	}
 }
 
-static void db_ldap_disconnect_timeout(struct ldap_connection *conn)
+static void db_ldap_disconnect_timeout(struct ldap_link *link)
 {
-	db_ldap_abort_requests(conn, UINT_MAX,
+	db_ldap_abort_requests(link, UINT_MAX,
 		DB_LDAP_REQUEST_DISCONNECT_TIMEOUT_SECS, FALSE,
 		"Aborting (timeout), we're not connected to LDAP server");
 
-	if (aqueue_count(conn->request_queue) == 0) {
+	if (aqueue_count(link->request_queue) == 0) {
 		/* no requests left, remove this timeout handler */
-		timeout_remove(&conn->to);
+		timeout_remove(&link->to);
 	}
 }
 
-static void db_ldap_conn_close(struct ldap_connection *conn)
+static void db_ldap_link_close(struct ldap_link *link)
 {
 	struct ldap_request *const *requests, *request;
 	unsigned int i;
 
-	conn->conn_state = LDAP_CONN_STATE_DISCONNECTED;
-	conn->delayed_connect = FALSE;
-	conn->default_bind_msgid = -1;
+	link->conn_state = LDAP_CONN_STATE_DISCONNECTED;
+	link->delayed_connect = FALSE;
+	link->default_bind_msgid = -1;
 
-	if (conn->to != NULL)
-		timeout_remove(&conn->to);
+	if (link->to != NULL)
+		timeout_remove(&link->to);
 
-	if (conn->pending_count != 0) {
-		requests = array_idx(&conn->request_array, 0);
-		for (i = 0; i < conn->pending_count; i++) {
-			request = requests[aqueue_idx(conn->request_queue, i)];
+	if (link->pending_count != 0) {
+		requests = array_idx(&link->request_array, 0);
+		for (i = 0; i < link->pending_count; i++) {
+			request = requests[aqueue_idx(link->request_queue, i)];
 
 			i_assert(request->msgid != -1);
 			request->msgid = -1;
 		}
-		conn->pending_count = 0;
+		link->pending_count = 0;
 	}
 
-	if (conn->ld != NULL) {
-		ldap_unbind(conn->ld);
-		conn->ld = NULL;
+	if (link->ld != NULL) {
+		ldap_unbind(link->ld);
+		link->ld = NULL;
 	}
-	conn->fd = -1;
+	link->fd = -1;
 
-	if (conn->io != NULL) {
+	if (link->io != NULL) {
 		/* the fd may have already been closed before ldap_unbind(),
 		   so we'll have to use io_remove_closed(). */
-		io_remove_closed(&conn->io);
+		io_remove_closed(&link->io);
 	}
 
-	if (aqueue_count(conn->request_queue) > 0) {
-		conn->to = timeout_add(DB_LDAP_REQUEST_DISCONNECT_TIMEOUT_SECS *
-				       1000/2, db_ldap_disconnect_timeout, conn);
+	db_ldap_link_stall_timeout_update(link, FALSE);
+
+	if (aqueue_count(link->request_queue) > 0) {
+		link->to = timeout_add(DB_LDAP_REQUEST_DISCONNECT_TIMEOUT_SECS *
+				       1000/2, db_ldap_disconnect_timeout, link);
 	}
 }
 
@@ -1522,17 +1695,16 @@ ldap_field_hide_password(struct db_ldap_result_iterate_context *ctx,
 
 static void
 get_ldap_fields(struct db_ldap_result_iterate_context *ctx,
-		struct ldap_connection *conn, LDAPMessage *entry,
-		const char *suffix)
+		LDAP *ld, LDAPMessage *entry, const char *suffix)
 {
 	struct db_ldap_value *ldap_value;
 	char *attr, **vals;
 	unsigned int i, count;
 	BerElement *ber;
 
-	attr = ldap_first_attribute(conn->ld, entry, &ber);
+	attr = ldap_first_attribute(ld, entry, &ber);
 	while (attr != NULL) {
-		vals = ldap_get_values(conn->ld, entry, attr);
+		vals = ldap_get_values(ld, entry, attr);
 
 		ldap_value = p_new(ctx->pool, struct db_ldap_value, 1);
 		if (vals == NULL) {
@@ -1566,17 +1738,18 @@ get_ldap_fields(struct db_ldap_result_iterate_context *ctx,
 
 		ldap_value_free(vals);
 		ldap_memfree(attr);
-		attr = ldap_next_attribute(conn->ld, entry, ber);
+		attr = ldap_next_attribute(ld, entry, ber);
 	}
 	ber_free(ber, 0);
 }
 
 struct db_ldap_result_iterate_context *
-db_ldap_result_iterate_init_full(struct ldap_connection *conn,
+db_ldap_result_iterate_init_full(struct ldap_connection *conn ATTR_UNUSED,
 				 struct ldap_request_search *ldap_request,
 				 LDAPMessage *res, bool skip_null_values,
 				 bool iter_dn_values)
 {
+	LDAP *ld = ldap_request->request.link->ld;
 	struct db_ldap_result_iterate_context *ctx;
 	const struct ldap_request_named_result *named_res;
 	const char *suffix;
@@ -1594,13 +1767,13 @@ db_ldap_result_iterate_init_full(struct ldap_connection *conn,
 	if (ctx->auth_request->debug)
 		ctx->debug = t_str_new(256);
 
-	get_ldap_fields(ctx, conn, res, "");
+	get_ldap_fields(ctx, ld, res, "");
 	if (array_is_created(&ldap_request->named_results)) {
 		array_foreach(&ldap_request->named_results, named_res) {
 			suffix = t_strdup_printf("@%s", named_res->field->name);
 			if (named_res->result != NULL) {
-				get_ldap_fields(ctx, conn,
-						named_res->result->msg, suffix);
+				get_ldap_fields(ctx, ld, named_res->result->msg,
+						suffix);
 			}
 		}
 	}
@@ -1854,10 +2027,44 @@ static struct ldap_connection *ldap_conn_find(const char *config_path)
 	return NULL;
 }
 
+static void db_ldap_link_log_stats(struct ldap_link *link)
+{
+	string_t *str = t_str_new(128);
+	unsigned int i, msecs;
+
+	str_printfa(str, "LDAP %s: Connection %u stalled %u times, latencies:",
+		    link->conn->config_path, link->idx, link->stall_count);
+	for (i = 0; i < DB_LDAP_LATENCY_HISTOGRAM_SIZE; i++) {
+		if (link->latency_histogram[i] == 0)
+			continue;
+		msecs = 1U << i;
+		str_printfa(str, " %s%ums=%u",
+			    i == DB_LDAP_LATENCY_HISTOGRAM_SIZE-1 ? ">=" : "<",
+			    i == DB_LDAP_LATENCY_HISTOGRAM_SIZE-1 ? msecs/2 : msecs,
+			    link->latency_histogram[i]);
+	}
+	i_info("%s", str_c(str));
+
+	/* reset counters */
+	memset(link->latency_histogram, 0, sizeof(link->latency_histogram));
+	link->stall_count = 0;
+}
+
+static void sig_db_ldap_stats(const siginfo_t *si ATTR_UNUSED, void *context)
+{
+	struct ldap_connection *conn = context;
+	struct ldap_link *const *linkp;
+
+	array_foreach(&conn->links, linkp)
+		T_BEGIN { db_ldap_link_log_stats(*linkp); } T_END;
+}
+
 struct ldap_connection *db_ldap_init(const char *config_path, bool userdb)
 {
 	struct ldap_connection *conn;
+	struct ldap_link *const *linkp, *link;
 	const char *str, *error;
+	unsigned int i;
 	pool_t pool;
 
 	/* see if it already exists */
@@ -1878,9 +2085,6 @@ struct ldap_connection *db_ldap_init(const char *config_path, bool userdb)
 	conn->refcount = 1;
 
 	conn->userdb_used = userdb;
-	conn->conn_state = LDAP_CONN_STATE_DISCONNECTED;
-	conn->default_bind_msgid = -1;
-	conn->fd = -1;
 	conn->config_path = p_strdup(pool, config_path);
 	conn->set = default_ldap_settings;
 	if (!settings_read_nosection(config_path, parse_setting, conn, &error))
@@ -1934,21 +2138,52 @@ struct ldap_connection *db_ldap_init(const char *config_path, bool userdb)
 		i_fatal("LDAP %s: Unknown deref option '%s'", config_path, conn->set.deref);
 	if (scope2str(conn->set.scope, &conn->set.ldap_scope) < 0)
 		i_fatal("LDAP %s: Unknown scope option '%s'", config_path, conn->set.scope);
-
-	i_array_init(&conn->request_array, 512);
-	conn->request_queue = aqueue_init(&conn->request_array.arr);
+	if (conn->set.connections == 0)
+		i_fatal("LDAP %s: connections must be at least 1", config_path);
+	if (conn->set.max_pending_requests == 0)
+		i_fatal("LDAP %s: max_pending_requests must be at least 1", config_path);
+
+	p_array_init(&conn->links, pool, conn->set.connections);
+	for (i = 0; i < conn->set.connections; i++) {
+		link = p_new(pool, struct ldap_link, 1);
+		link->conn = conn;
+		link->idx = i;
+		link->conn_state = LDAP_CONN_STATE_DISCONNECTED;
+		link->default_bind_msgid = -1;
+		link->fd = -1;
+		i_array_init(&link->request_array, 512);
+		link->request_queue = aqueue_init(&link->request_array.arr);
+		array_append(&conn->links, &link, 1);
+	}
 
 	conn->next = ldap_connections;
         ldap_connections = conn;
 
-	db_ldap_init_ld(conn);
+	lib_signals_set_handler(SIGUSR2, LIBSIG_FLAGS_SAFE,
+				sig_db_ldap_stats, conn);
+
+	array_foreach(&conn->links, linkp)
+		db_ldap_init_ld(*linkp);
 	return conn;
 }
 
+static void db_ldap_link_deinit(struct ldap_link *link)
+{
+	db_ldap_abort_requests(link, UINT_MAX, 0, FALSE, "Shutting down");
+	i_assert(link->pending_count == 0);
+	db_ldap_link_close(link);
+	i_assert(link->to == NULL);
+	i_assert(link->to_stall == NULL);
+
+	array_free(&link->request_array);
+	aqueue_deinit(&link->request_queue);
+}
+
 void db_ldap_unref(struct ldap_connection **_conn)
 {
         struct ldap_connection *conn = *_conn;
 	struct ldap_connection **p;
+	struct ldap_link *const *linkp;
 
 	*_conn = NULL;
 	i_assert(conn->refcount >= 0);
@@ -1962,14 +2197,9 @@ void db_ldap_unref(struct ldap_connection **_conn)
 		}
 	}
 
-	db_ldap_abort_requests(conn, UINT_MAX, 0, FALSE, "Shutting down");
-	i_assert(conn->pending_count == 0);
-	db_ldap_conn_close(conn);
-	i_assert(conn->to == NULL);
-
-	array_free(&conn->request_array);
-	aqueue_deinit(&conn->request_queue);
-
+	lib_signals_unset_handler(SIGUSR2, sig_db_ldap_stats, conn);
+	array_foreach(&conn->links, linkp)
+		db_ldap_link_deinit(*linkp);
 	pool_unref(&conn->pool);
 }
 
@@ -5,7 +5,8 @@
    This define enables them until the code here can be refactored */
 #define LDAP_DEPRECATED 1
 
-/* Maximum number of pending requests before delaying new requests. */
+/* Default maximum number of pending requests per LDAP connection before
+   delaying new requests. */
 #define DB_LDAP_MAX_PENDING_REQUESTS 8
 /* connect() timeout to LDAP */
 #define DB_LDAP_CONNECT_TIMEOUT_SECS 5
@@ -17,11 +18,20 @@
 /* If server disconnects us, don't reconnect if no requests have been sent
    for this many seconds. */
 #define DB_LDAP_IDLE_RECONNECT_SECS 60
+/* Default number of seconds a connection may go without replying to any of its
+   pending requests before it's assumed stalled and the requests are retried
+   on other connections. */
+#define DB_LDAP_REQUEST_STALL_SECS 5
+/* Number of request latency histogram buckets. Bucket 0 is <1ms and each
+   following bucket doubles the limit. The last bucket has everything
+   slower. */
+#define DB_LDAP_LATENCY_HISTOGRAM_SIZE 16
 
 #include <ldap.h>
 
 struct auth_request;
 struct ldap_connection;
+struct ldap_link;
 struct ldap_request;
 
 typedef void db_search_callback_t(struct ldap_connection *conn,
@@ -68,6 +78,10 @@ struct ldap_settings {
 	bool userdb_warning_disable; /* deprecated for now at least */
 	bool blocking;
 
+	unsigned int connections;
+	unsigned int max_pending_requests;
+	unsigned int request_stall_secs;
+
 	/* ... */
 	int ldap_deref, ldap_scope, ldap_tls_require_cert_parsed;
 	uid_t uid;
@@ -103,8 +117,14 @@ struct ldap_request {
 	int msgid;
 	/* timestamp when request was created */
 	time_t create_time;
+	/* timestamp when request was (last) sent */
+	struct timeval send_time;
+	/* connection where the request was queued */
+	struct ldap_link *link;
 
 	bool failed;
+	/* Some reply was received for the request, so it can't be retried */
+	bool replied;
 
 	db_search_callback_t *callback;
 	struct auth_request *auth_request;
@@ -148,14 +168,10 @@ enum ldap_connection_state {
 	LDAP_CONN_STATE_BOUND_DEFAULT
 };
 
-struct ldap_connection {
-	struct ldap_connection *next;
-
-	pool_t pool;
-	int refcount;
-
-	char *config_path;
-        struct ldap_settings set;
+/* A single connection to LDAP server. */
+struct ldap_link {
+	struct ldap_connection *conn;
+	unsigned int idx;
 
 	LDAP *ld;
 	enum ldap_connection_state conn_state;
@@ -164,6 +180,9 @@ struct ldap_connection {
 	int fd;
 	struct io *io;
 	struct timeout *to;
+	/* Running while there are pending requests. Reset whenever a reply
+	   is received. */
+	struct timeout *to_stall;
 
 	/* Request queue contains sent requests at tail (msgid != -1) and
 	   queued requests at head (msgid == -1). */
@@ -175,10 +194,30 @@ struct ldap_connection {
 	/* Timestamp when we last received a reply */
 	time_t last_reply_stamp;
 
+	/* Number of finished requests by their latency, and number of times
+	   the connection stalled since the last SIGUSR2 */
+	unsigned int latency_histogram[DB_LDAP_LATENCY_HISTOGRAM_SIZE];
+	unsigned int stall_count;
+
+	bool delayed_connect;
+};
+
+struct ldap_connection {
+	struct ldap_connection *next;
+
+	pool_t pool;
+	int refcount;
+
+	char *config_path;
+        struct ldap_settings set;
+
+	/* Pool of set.connections links. New requests are queued to the one
+	   with the least outstanding requests. */
+	ARRAY(struct ldap_link *) links;
+
 	char **pass_attr_names, **user_attr_names, **iterate_attr_names;
 	ARRAY_TYPE(ldap_field) pass_attr_map, user_attr_map, iterate_attr_map;
 	bool userdb_used;
-	bool delayed_connect;
 };
 
 /* Send/queue request */
@@ -195,11 +234,13 @@ void db_ldap_unref(struct ldap_connection **conn);
 int db_ldap_connect(struct ldap_connection *conn);
 void db_ldap_connect_delayed(struct ldap_connection *conn);
 
-void db_ldap_enable_input(struct ldap_connection *conn, bool enable);
+/* Enable/disable reading replies from the connection where the request was
+   sent to. */
+void db_ldap_enable_input(struct ldap_request *request, bool enable);
 
 const char *ldap_escape(const char *str,
 			const struct auth_request *auth_request);
-const char *ldap_get_error(struct ldap_connection *conn);
+const char *ldap_get_error(struct ldap_link *link);
 
 struct db_ldap_result_iterate_context *
 db_ldap_result_iterate_init(struct ldap_connection *conn,
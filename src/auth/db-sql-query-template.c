@@ -0,0 +1,84 @@
+/* Copyright (c) 2016 Dovecot authors, see the included COPYING file */
+
+#include "auth-common.h"
+#include "array.h"
+#include "str.h"
+#include "auth-request.h"
+#include "db-sql.h"
+
+#include <ctype.h>
+
+static bool db_sql_is_identifier_chr(char c)
+{
+	/* e.g. E'..', N'..', U&'..' or _utf8'..' */
+	return i_isalnum(c) || c == '_' || c == '$' || c == '&';
+}
+
+bool db_sql_query_template_parse(pool_t pool, const char *query,
+				 const char **template_r,
+				 const char *const **params_r)
+{
+	ARRAY_TYPE(const_string) params;
+	string_t *query_template, *param;
+	const char *p, *end, *value;
+
+	query_template = t_str_new(256);
+	p_array_init(&params, pool, 4);
+	for (p = query; *p != '\0'; p++) {
+		switch (*p) {
+		case '%':
+		case '?':
+			/* variable outside quoted string or something that
+			   would be mistaken as a parameter */
+			return FALSE;
+		case '"':
+		case '`':
+			/* quoted identifier */
+			end = strchr(p + 1, *p);
+			if (end == NULL || memchr(p, '%', end - p) != NULL)
+				return FALSE;
+			str_append_n(query_template, p, end - p + 1);
+			p = end;
+			break;
+		case '\'':
+			/* string literal with '' as an escaped quote */
+			param = t_str_new(64);
+			for (end = p + 1;; end++) {
+				if (*end == '\0')
+					return FALSE;
+				if (*end == '\'') {
+					if (end[1] != '\'')
+						break;
+					end++;
+				}
+				str_append_c(param, *end);
+			}
+			if (strchr(str_c(param), '\\') != NULL) {
+				/* backslash escaping is database specific, so
+				   the end of the string isn't known for sure */
+				return FALSE;
+			} else if (strchr(str_c(param), '%') == NULL) {
+				/* static string */
+				str_append_n(query_template, p, end - p + 1);
+			} else if (p > query && db_sql_is_identifier_chr(p[-1])) {
+				/* prefixed literal. replacing only the quoted
+				   part would leave e.g. E? */
+				return FALSE;
+			} else {
+				str_append_c(query_template, '?');
+				value = p_strdup(pool, str_c(param));
+				array_append(&params, &value, 1);
+			}
+			p = end;
+			break;
+		default:
+			str_append_c(query_template, *p);
+			break;
+		}
+	}
+	array_append_zero(&params);
+
+	*template_r = p_strdup(pool, str_c(query_template));
+	*params_r = array_idx(&params, 0);
+	return TRUE;
+}
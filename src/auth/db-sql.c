@@ -23,6 +23,7 @@ static struct setting_def setting_defs[] = {
  	DEF_STR(update_query),
  	DEF_STR(iterate_query),
 	DEF_STR(default_pass_scheme),
+	DEF_BOOL(prepared_statements),
 	DEF_BOOL(userdb_warning_disable),
 
 	{ 0, NULL, 0 }
@@ -36,6 +37,7 @@ static struct sql_settings default_sql_settings = {
 	.update_query = "UPDATE users SET password = '%w' WHERE username = '%n' AND domain = '%d'",
 	.iterate_query = "SELECT username, domain FROM users",
 	.default_pass_scheme = "MD5",
+	.prepared_statements = TRUE,
 	.userdb_warning_disable = FALSE
 };
 
@@ -60,6 +62,68 @@ static const char *parse_setting(const char *key, const char *value,
 				       &conn->set, key, value);
 }
 
+static struct db_sql_prepared_query *
+db_sql_prepared_query_init(struct sql_connection *conn, const char *query)
+{
+	struct db_sql_prepared_query *prep_query;
+	const char *query_template;
+	const char *const *params;
+
+	if (!db_sql_query_template_parse(conn->pool, query,
+					 &query_template, &params))
+		return NULL;
+
+	prep_query = p_new(conn->pool, struct db_sql_prepared_query, 1);
+	prep_query->prep_stmt =
+		sql_prepared_statement_init(conn->db, query_template);
+	prep_query->params = params;
+	return prep_query;
+}
+
+static void db_sql_prepared_query_deinit(struct db_sql_prepared_query *prep_query)
+{
+	if (prep_query != NULL)
+		sql_prepared_statement_deinit(&prep_query->prep_stmt);
+}
+
+int db_sql_query_expand(const char *query_template,
+			struct db_sql_prepared_query *prep_query,
+			struct auth_request *auth_request,
+			auth_request_escape_func_t *escape_func,
+			struct sql_statement **stmt_r, const char **query_r,
+			const char **error_r)
+{
+	struct sql_statement *stmt;
+	const char *value;
+	unsigned int i;
+	int ret;
+
+	*stmt_r = NULL;
+	if (prep_query == NULL || auth_request->debug) {
+		/* the escaped query is also used for debug logging */
+		ret = t_auth_request_var_expand(query_template, auth_request,
+						escape_func, query_r, error_r);
+		if (ret <= 0 || prep_query == NULL)
+			return ret;
+	} else {
+		*query_r = query_template;
+	}
+
+	stmt = sql_statement_init_prepared(prep_query->prep_stmt);
+	for (i = 0; prep_query->params[i] != NULL; i++) {
+		ret = t_auth_request_var_expand(prep_query->params[i],
+						auth_request, NULL,
+						&value, error_r);
+		if (ret <= 0) {
+			sql_statement_abort(&stmt);
+			return ret;
+		}
+		sql_statement_bind_str(stmt, i, value);
+	}
+	*stmt_r = stmt;
+	return 1;
+}
+
 struct sql_connection *db_sql_init(const char *config_path, bool userdb)
 {
 	struct sql_connection *conn;
@@ -107,6 +171,14 @@ struct sql_connection *db_sql_init(const char *config_path, bool userdb)
 			config_path);
 	}
 	conn->db = sql_init(conn->set.driver, conn->set.connect);
+	if (conn->set.prepared_statements) T_BEGIN {
+		conn->password_query =
+			db_sql_prepared_query_init(conn, conn->set.password_query);
+		conn->user_query =
+			db_sql_prepared_query_init(conn, conn->set.user_query);
+		conn->update_query =
+			db_sql_prepared_query_init(conn, conn->set.update_query);
+	} T_END;
 
 	conn->next = connections;
 	connections = conn;
@@ -125,6 +197,9 @@ void db_sql_unref(struct sql_connection **_conn)
 	if (--conn->refcount > 0)
 		return;
 
+	db_sql_prepared_query_deinit(conn->password_query);
+	db_sql_prepared_query_deinit(conn->user_query);
+	db_sql_prepared_query_deinit(conn->update_query);
 	sql_deinit(&conn->db);
 	pool_unref(&conn->pool);
 }
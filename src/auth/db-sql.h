@@ -11,9 +11,17 @@ struct sql_settings {
 	const char *update_query;
 	const char *iterate_query;
 	const char *default_pass_scheme;
+	bool prepared_statements;
 	bool userdb_warning_disable;
 };
 
+/* Query where the quoted %variables are sent as statement parameters */
+struct db_sql_prepared_query {
+	struct sql_prepared_statement *prep_stmt;
+	/* var_expand() template for each "?" parameter */
+	const char *const *params;
+};
+
 struct sql_connection {
 	struct sql_connection *next;
 
@@ -24,6 +32,11 @@ struct sql_connection {
 	struct sql_settings set;
 	struct sql_db *db;
 
+	/* NULL if the query is sent as plain text */
+	struct db_sql_prepared_query *password_query;
+	struct db_sql_prepared_query *user_query;
+	struct db_sql_prepared_query *update_query;
+
 	bool default_password_query:1;
 	bool default_user_query:1;
 	bool default_update_query:1;
@@ -39,4 +52,24 @@ void db_sql_success(struct sql_connection *conn);
 
 void db_sql_check_userdb_warning(struct sql_connection *conn);
 
+/* Convert the query into a statement template, where each '...' string
+   containing %variables is replaced with a "?" parameter. *params_r is set
+   to the NULL-terminated list of the unquoted strings. Returns FALSE if the
+   query can't be safely converted, and it should be sent as plain text. */
+bool db_sql_query_template_parse(pool_t pool, const char *query,
+				 const char **template_r,
+				 const char *const **params_r);
+
+/* Expand query_template for the auth request. If prep_query is non-NULL,
+   *stmt_r is set to the statement to execute. Otherwise *stmt_r is set to
+   NULL and the query is expanded using escape_func. *query_r is set to the
+   expanded query for logging. Returns the same as
+   t_auth_request_var_expand(). */
+int db_sql_query_expand(const char *query_template,
+			struct db_sql_prepared_query *prep_query,
+			struct auth_request *auth_request,
+			auth_request_escape_func_t *escape_func,
+			struct sql_statement **stmt_r, const char **query_r,
+			const char **error_r);
+
 #endif
@@ -19,6 +19,7 @@
 #include "dict.h"
 #include "password-scheme.h"
 #include "passdb-cache.h"
+#include "userdb-shared-cache.h"
 #include "mech.h"
 #include "auth.h"
 #include "auth-penalty.h"
@@ -208,8 +209,11 @@ static void main_preinit(void)
 		      mech_reg, services);
 
 	listeners_init();
-	if (!worker)
+	if (!worker) {
 		auth_token_init();
+		/* base_dir is writable only by root */
+		userdb_shared_cache_init(global_auth_settings);
+	}
 
 	/* Password lookups etc. may require roots, allow it. */
 	restrict_access_by_env(NULL, FALSE);
@@ -297,6 +301,7 @@ static void main_deinit(void)
 	userdbs_deinit();
 	passdbs_deinit();
 	passdb_cache_deinit();
+	userdb_shared_cache_deinit();
         password_schemes_deinit();
 	auth_request_stats_deinit();
 
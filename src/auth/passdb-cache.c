@@ -7,6 +7,7 @@
 #include "password-scheme.h"
 #include "passdb.h"
 #include "passdb-cache.h"
+#include "userdb-shared-cache.h"
 
 struct auth_cache *passdb_cache = NULL;
 
@@ -33,6 +34,8 @@ passdb_cache_lookup(struct auth_request *request, const char *key,
 	const char *value;
 	bool expired;
 
+	passdb_cache_sync_flushes();
+
 	/* value = password \t ... */
 	value = auth_cache_lookup(passdb_cache, request, key, node_r,
 				  &expired, neg_expired_r);
@@ -143,6 +146,13 @@ bool passdb_cache_lookup_credentials(struct auth_request *request,
 	return TRUE;
 }
 
+void passdb_cache_sync_flushes(void)
+{
+	if (passdb_cache != NULL && userdb_shared_cache != NULL &&
+	    userdb_shared_cache_flushed(userdb_shared_cache))
+		(void)auth_cache_clear(passdb_cache);
+}
+
 void passdb_cache_init(const struct auth_settings *set)
 {
 	rlim_t limit;
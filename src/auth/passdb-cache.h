@@ -15,6 +15,10 @@ bool passdb_cache_lookup_credentials(struct auth_request *request,
 				     enum passdb_result *result_r,
 				     bool use_expired);
 
+/* Clear passdb_cache if some auth process has flushed the caches since the
+   previous call. The flushes are seen via the userdb shared cache. */
+void passdb_cache_sync_flushes(void);
+
 void passdb_cache_init(const struct auth_settings *set);
 void passdb_cache_deinit(void);
 
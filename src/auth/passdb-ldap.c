@@ -70,7 +70,6 @@ ldap_lookup_finish(struct auth_request *auth_request,
 {
 	enum passdb_result passdb_result;
 	const char *password = NULL, *scheme;
-	int ret;
 
 	if (res == NULL) {
 		passdb_result = PASSDB_RESULT_INTERNAL_FAILURE;
@@ -104,15 +103,14 @@ ldap_lookup_finish(struct auth_request *auth_request,
 			auth_request);
 	} else {
 		if (password != NULL) {
-			ret = auth_request_password_verify(auth_request,
+			auth_request_password_verify_async(auth_request,
 					auth_request->mech_password,
-					password, scheme, AUTH_SUBSYS_DB);
-			passdb_result = ret > 0 ? PASSDB_RESULT_OK :
-				PASSDB_RESULT_PASSWORD_MISMATCH;
+					password, scheme, AUTH_SUBSYS_DB,
+					ldap_request->callback.verify_plain);
+		} else {
+			ldap_request->callback.verify_plain(passdb_result,
+							    auth_request);
 		}
-
-		ldap_request->callback.verify_plain(passdb_result,
-						    auth_request);
 	}
 }
 
@@ -151,7 +149,7 @@ ldap_auth_bind_callback(struct ldap_connection *conn,
 	passdb_result = PASSDB_RESULT_INTERNAL_FAILURE;
 
 	if (res != NULL) {
-		ret = ldap_result2error(conn->ld, res, 0);
+		ret = ldap_result2error(ldap_request->link->ld, res, 0);
 		if (ret == LDAP_SUCCESS)
 			passdb_result = PASSDB_RESULT_OK;
 		else if (ret == LDAP_INVALID_CREDENTIALS) {
@@ -260,7 +258,7 @@ static void ldap_bind_lookup_dn_callback(struct ldap_connection *conn,
 				       &passdb_ldap_request->request.search, res);
 
 		/* save dn */
-		dn = ldap_get_dn(conn->ld, res);
+		dn = ldap_get_dn(ldap_request->link->ld, res);
 		passdb_ldap_request->dn = p_strdup(auth_request->pool, dn);
 		ldap_memfree(dn);
 	} else if (res == NULL || passdb_ldap_request->entries != 1) {
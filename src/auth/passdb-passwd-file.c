@@ -94,11 +94,8 @@ passwd_file_verify_plain(struct auth_request *request, const char *password,
 		return;
 	}
 
-	ret = auth_request_password_verify(request, password, crypted_pass,
-					   scheme, AUTH_SUBSYS_DB);
-
-	callback(ret > 0 ? PASSDB_RESULT_OK : PASSDB_RESULT_PASSWORD_MISMATCH,
-		 request);
+	auth_request_password_verify_async(request, password, crypted_pass,
+					   scheme, AUTH_SUBSYS_DB, callback);
 }
 
 static void
@@ -130,13 +130,10 @@ static void sql_query_callback(struct sql_result *result,
 		return;
 	}
 
-	ret = auth_request_password_verify(auth_request,
+	auth_request_password_verify_async(auth_request,
 					   auth_request->mech_password,
-					   password, scheme, AUTH_SUBSYS_DB);
-
-	sql_request->callback.verify_plain(ret > 0 ? PASSDB_RESULT_OK :
-					   PASSDB_RESULT_PASSWORD_MISMATCH,
-					   auth_request);
+					   password, scheme, AUTH_SUBSYS_DB,
+					   sql_request->callback.verify_plain);
 	auth_request_unref(&auth_request);
 }
 
@@ -154,11 +151,13 @@ static void sql_lookup_pass(struct passdb_sql_request *sql_request)
 	struct passdb_module *_module =
 		sql_request->auth_request->passdb->passdb;
 	struct sql_passdb_module *module = (struct sql_passdb_module *)_module;
+	struct sql_statement *stmt;
 	const char *query, *error;
 
-	if (t_auth_request_var_expand(module->conn->set.password_query,
-				      sql_request->auth_request,
-				      passdb_sql_escape, &query, &error) <= 0) {
+	if (db_sql_query_expand(module->conn->set.password_query,
+				module->conn->password_query,
+				sql_request->auth_request, passdb_sql_escape,
+				&stmt, &query, &error) <= 0) {
 		auth_request_log_debug(sql_request->auth_request, AUTH_SUBSYS_DB,
 			"Failed to expand password_query=%s: %s",
 			module->conn->set.password_query, error);
@@ -171,8 +170,12 @@ static void sql_lookup_pass(struct passdb_sql_request *sql_request)
 			       "query: %s", query);
 
 	auth_request_ref(sql_request->auth_request);
-	sql_query(module->conn->db, query,
-		  sql_query_callback, sql_request);
+	if (stmt != NULL)
+		sql_statement_query(&stmt, sql_query_callback, sql_request);
+	else {
+		sql_query(module->conn->db, query,
+			  sql_query_callback, sql_request);
+	}
 }
 
 static void sql_verify_plain(struct auth_request *request,
@@ -234,13 +237,15 @@ static void sql_set_credentials(struct auth_request *request,
 		(struct sql_passdb_module *) request->passdb->passdb;
 	struct sql_transaction_context *transaction;
 	struct passdb_sql_request *sql_request;
+	struct sql_statement *stmt;
 	const char *query, *error;
 
 	request->mech_password = p_strdup(request->pool, new_credentials);
 
-	if (t_auth_request_var_expand(module->conn->set.update_query,
-				      request, passdb_sql_escape,
-				      &query, &error) <= 0) {
+	if (db_sql_query_expand(module->conn->set.update_query,
+				module->conn->update_query, request,
+				passdb_sql_escape, &stmt, &query,
+				&error) <= 0) {
 		auth_request_log_error(request, AUTH_SUBSYS_DB,
 			"Failed to expand update_query=%s: %s",
 			module->conn->set.update_query, error);
@@ -253,7 +258,10 @@ static void sql_set_credentials(struct auth_request *request,
 	sql_request->callback.set_credentials = callback;
 
 	transaction = sql_transaction_begin(module->conn->db);
-	sql_update(transaction, query);
+	if (stmt != NULL)
+		sql_update_stmt(transaction, &stmt);
+	else
+		sql_update(transaction, query);
 	sql_transaction_commit(&transaction,
 			       sql_set_credentials_callback, sql_request);
 }
@@ -294,6 +294,19 @@ bool password_scheme_is_alias(const char *scheme1, const char *scheme2)
 		s1->password_generate == s2->password_generate;
 }
 
+bool password_scheme_is_slow(const char *scheme)
+{
+	const struct password_scheme *s;
+
+	s = password_scheme_lookup_name(t_strcut(scheme, '.'));
+	if (s == NULL)
+		return FALSE;
+	/* CRYPT can also be any of the expensive crypt() algorithms */
+	return s->password_verify == crypt_verify ||
+		s->password_verify == pbkdf2_verify ||
+		s->password_verify == scram_sha1_verify;
+}
+
 const char *
 password_scheme_detect(const char *plain_password, const char *crypted_password,
 		       const char *user)
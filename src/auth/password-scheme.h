@@ -57,6 +57,9 @@ bool password_generate_encoded(const char *plaintext, const char *user,
 
 /* Returns TRUE if schemes are equivalent. */
 bool password_scheme_is_alias(const char *scheme1, const char *scheme2);
+/* Returns TRUE if verifying passwords with the scheme is intentionally
+   CPU intensive (crypt() and the iterated hashes). */
+bool password_scheme_is_slow(const char *scheme);
 
 /* Try to detect in which scheme crypted password is. Returns the scheme name
    or NULL if nothing was found. */
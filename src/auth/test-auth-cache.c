@@ -15,6 +15,7 @@ const struct var_expand_table auth_request_var_expand_static_tab[] = {
 	{ 'a', NULL, NULL },
 	{ '\0', NULL, "longb" },
 	{ 'c', NULL, "longc" },
+	{ '!', NULL, NULL },
 	{ '\0', NULL, NULL }
 };
 
@@ -64,10 +65,85 @@ static void test_auth_cache_parse_key(void)
 	test_end();
 }
 
+static const char *
+test_auth_cache_lookup(struct auth_cache *cache, struct auth_request *request,
+		       const char *key)
+{
+	bool expired, neg_expired;
+
+	return auth_cache_lookup(cache, request, key, NULL,
+				 &expired, &neg_expired);
+}
+
+static void test_auth_cache_admission(void)
+{
+	struct auth_request request;
+	struct auth_cache *cache;
+	struct auth_cache_stats stats;
+	string_t *str;
+	const char *key, *value;
+	unsigned int i, j;
+
+	test_begin("auth cache admission");
+	memset(&request, 0, sizeof(request));
+	request.user = "user";
+	cache = auth_cache_new(sizeof(struct auth_cache_node) * 4, 3600, 3600);
+
+	/* fill the cache with frequently used entries */
+	for (i = 0; i < 4; i++) {
+		key = t_strdup_printf("hot%u", i);
+		for (j = 0; j < 3; j++)
+			(void)test_auth_cache_lookup(cache, &request, key);
+		auth_cache_insert(cache, &request, key, "value", TRUE);
+	}
+	/* one-time lookups don't replace them */
+	for (i = 0; i < 20; i++) {
+		key = t_strdup_printf("once%u", i);
+		test_assert(test_auth_cache_lookup(cache, &request, key) == NULL);
+		auth_cache_insert(cache, &request, key, "", FALSE);
+	}
+	for (i = 0; i < 4; i++) {
+		key = t_strdup_printf("hot%u", i);
+		value = test_auth_cache_lookup(cache, &request, key);
+		test_assert(value != NULL && strcmp(value, "value") == 0);
+	}
+	auth_cache_get_stats(cache, &stats);
+	test_assert(stats.admission_reject_count == 20);
+	test_assert(stats.eviction_count == 0);
+	test_assert(stats.entry_count == 4);
+
+	/* a key used more often than the LRU entry gets in */
+	for (j = 0; j < 6; j++)
+		(void)test_auth_cache_lookup(cache, &request, "popular");
+	auth_cache_insert(cache, &request, "popular", "value2", TRUE);
+	value = test_auth_cache_lookup(cache, &request, "popular");
+	test_assert(value != NULL && strcmp(value, "value2") == 0);
+	auth_cache_get_stats(cache, &stats);
+	test_assert(stats.eviction_count == 1);
+	test_assert(stats.entry_count == 4);
+
+	/* values not fitting into the node are stored separately */
+	str = t_str_new(AUTH_CACHE_NODE_INLINE_DATA_SIZE * 2 + 1);
+	for (i = 0; i < AUTH_CACHE_NODE_INLINE_DATA_SIZE * 2; i++)
+		str_append_c(str, 'x');
+	value = str_c(str);
+	test_assert(auth_cache_clear(cache) == 4);
+	auth_cache_insert(cache, &request, "large", value, TRUE);
+	test_assert(null_strcmp(test_auth_cache_lookup(cache, &request,
+						       "large"), value) == 0);
+	auth_cache_get_stats(cache, &stats);
+	test_assert(stats.used_size == sizeof(struct auth_cache_node) +
+		    strlen(value) + 1 + strlen("P\tlarge") + 1);
+
+	auth_cache_free(&cache);
+	test_end();
+}
+
 int main(void)
 {
 	static void (*test_functions[])(void) = {
 		test_auth_cache_parse_key,
+		test_auth_cache_admission,
 		NULL
 	};
 	return test_run(test_functions);
@@ -0,0 +1,147 @@
+/* Copyright (c) 2016 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "str.h"
+#include "randgen.h"
+#include "strescape.h"
+#include "password-scheme.h"
+#include "auth-worker-passw.h"
+#include "test-common.h"
+
+static void test_password_scheme_is_slow(void)
+{
+	static const char *const slow_schemes[] = {
+		"CRYPT", "crypt", "PBKDF2", "SCRAM-SHA-1", "CRYPT.HEX"
+	};
+	static const char *const fast_schemes[] = {
+		"PLAIN", "SHA1", "SSHA512", "MD5", "MD5-CRYPT", "PLAIN-MD5",
+		"CRAM-MD5", "nonexistent", ""
+	};
+	unsigned int i;
+
+	test_begin("password scheme is slow");
+	for (i = 0; i < N_ELEMENTS(slow_schemes); i++)
+		test_assert_idx(password_scheme_is_slow(slow_schemes[i]), i);
+	for (i = 0; i < N_ELEMENTS(fast_schemes); i++)
+		test_assert_idx(!password_scheme_is_slow(fast_schemes[i]), i);
+	test_end();
+}
+
+static enum passdb_result
+test_auth_worker_passw(const char *scheme, const char *password,
+		       const char *crypted, int *ret_r, const char **error_r)
+{
+	const char *const *args;
+	string_t *str = t_str_new(128);
+
+	auth_worker_passw_request(str, scheme, password, crypted, "user");
+	args = t_strsplit_tabescaped(str_c(str));
+	test_assert(strcmp(args[0], "PASSW") == 0);
+
+	str_truncate(str, 0);
+	test_assert(auth_worker_passw_verify(args + 1, str));
+	return auth_worker_passw_reply_parse(str_c(str), ret_r, error_r);
+}
+
+static void test_auth_worker_passw_verify(void)
+{
+	static const char *const schemes[] = {
+		"PBKDF2", "SCRAM-SHA-1", "CRYPT", "SHA1"
+	};
+	static const char *const args[] = {
+		"PBKDF2", "secret", "$1$nonsense", NULL
+	};
+	const char *crypted, *error;
+	string_t *str = t_str_new(128);
+	unsigned int i;
+	int ret;
+
+	test_begin("auth worker passw verify");
+	for (i = 0; i < N_ELEMENTS(schemes); i++) {
+		test_assert_idx(password_generate_encoded("pass\tword", "user",
+							  schemes[i], &crypted), i);
+		test_assert_idx(test_auth_worker_passw(schemes[i], "pass\tword",
+						       crypted, &ret, &error) ==
+				PASSDB_RESULT_OK, i);
+		test_assert_idx(ret == 1 && error == NULL, i);
+
+		test_assert_idx(test_auth_worker_passw(schemes[i], "password",
+						       crypted, &ret, &error) ==
+				PASSDB_RESULT_PASSWORD_MISMATCH, i);
+		test_assert_idx(ret == 0 && error == NULL, i);
+	}
+
+	/* unknown scheme */
+	test_assert(test_auth_worker_passw("nonexistent", "secret", "secret",
+					   &ret, &error) ==
+		    PASSDB_RESULT_PASSWORD_MISMATCH);
+	test_assert(ret == -1 &&
+		    null_strcmp(error, "Unknown scheme nonexistent") == 0);
+
+	/* broken password */
+	test_assert(test_auth_worker_passw("SCRAM-SHA-1", "secret", "broken",
+					   &ret, &error) ==
+		    PASSDB_RESULT_PASSWORD_MISMATCH);
+	test_assert(ret == -1 && error != NULL);
+
+	/* missing parameters */
+	test_assert(!auth_worker_passw_verify(args, str));
+	test_assert(str_len(str) == 0);
+	test_end();
+}
+
+static void test_auth_worker_passw_reply_parse(void)
+{
+	static const struct {
+		const char *reply;
+		enum passdb_result result;
+		int ret;
+		const char *error;
+	} tests[] = {
+		{ "OK", PASSDB_RESULT_OK, 1, NULL },
+		{ "FAIL\t0", PASSDB_RESULT_PASSWORD_MISMATCH, 0, NULL },
+		{ "FAIL\t0\tbroken\001tpassword",
+		  PASSDB_RESULT_PASSWORD_MISMATCH, -1, "broken\tpassword" },
+		/* sent by auth worker server when the worker dies or the
+		   request times out */
+		{ "FAIL\t-1", PASSDB_RESULT_INTERNAL_FAILURE, 0, NULL },
+		{ "FAIL\t-3", PASSDB_RESULT_INTERNAL_FAILURE, 0, NULL },
+		{ "FAIL\tx", PASSDB_RESULT_INTERNAL_FAILURE, 0, NULL },
+		{ "FAIL", PASSDB_RESULT_INTERNAL_FAILURE, 0, NULL },
+		{ "", PASSDB_RESULT_INTERNAL_FAILURE, 0, NULL },
+	};
+	const char *error;
+	unsigned int i;
+	int ret;
+
+	test_begin("auth worker passw reply parse");
+	for (i = 0; i < N_ELEMENTS(tests); i++) {
+		test_assert_idx(auth_worker_passw_reply_parse(tests[i].reply,
+						&ret, &error) == tests[i].result, i);
+		if (tests[i].result == PASSDB_RESULT_INTERNAL_FAILURE)
+			continue;
+		test_assert_idx(ret == tests[i].ret, i);
+		test_assert_idx(null_strcmp(error, tests[i].error) == 0, i);
+	}
+	test_end();
+}
+
+int main(void)
+{
+	static void (*test_functions[])(void) = {
+		test_password_scheme_is_slow,
+		test_auth_worker_passw_verify,
+		test_auth_worker_passw_reply_parse,
+		NULL
+	};
+	int ret;
+
+	lib_init();
+	random_init();
+	password_schemes_init();
+	ret = test_run(test_functions);
+	password_schemes_deinit();
+	random_deinit();
+	lib_deinit();
+	return ret;
+}
@@ -0,0 +1,100 @@
+/* Copyright (c) 2016 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "str.h"
+#include "auth-request.h"
+#include "db-sql.h"
+#include "test-common.h"
+
+static const char *
+test_params_join(const char *const *params)
+{
+	string_t *str = t_str_new(64);
+
+	for (; *params != NULL; params++) {
+		if (str_len(str) > 0)
+			str_append_c(str, ',');
+		str_printfa(str, "[%s]", *params);
+	}
+	return str_c(str);
+}
+
+static void test_db_sql_query_template_parse(void)
+{
+	static const struct {
+		const char *query, *template, *params;
+	} tests[] = {
+		{ "SELECT password FROM users WHERE username = '%n' AND domain = '%d'",
+		  "SELECT password FROM users WHERE username = ? AND domain = ?",
+		  "[%n],[%d]" },
+		/* static strings and quoted identifiers are kept */
+		{ "SELECT \"pass\" FROM `users` WHERE a = 'x' AND u = '%u'",
+		  "SELECT \"pass\" FROM `users` WHERE a = 'x' AND u = ?",
+		  "[%u]" },
+		{ "SELECT 1", "SELECT 1", "" },
+		/* '' is unescaped in the parameter */
+		{ "SELECT 1 WHERE a = 'it''s %u'",
+		  "SELECT 1 WHERE a = ?", "[it's %u]" },
+		{ "SELECT 1 WHERE a = 'it''s' AND b = '%u'''",
+		  "SELECT 1 WHERE a = 'it''s' AND b = ?", "[%u']" },
+		/* the whole literal becomes the parameter */
+		{ "SELECT 1 WHERE u = '%n@%d'",
+		  "SELECT 1 WHERE u = ?", "[%n@%d]" },
+		{ "SELECT 1 WHERE u IN ('%u', '%n')",
+		  "SELECT 1 WHERE u IN (?, ?)", "[%u],[%n]" },
+		{ "SELECT 1 WHERE u=('%u')",
+		  "SELECT 1 WHERE u=(?)", "[%u]" },
+		/* prefixed static strings are fine */
+		{ "SELECT N'x' WHERE u = '%u'",
+		  "SELECT N'x' WHERE u = ?", "[%u]" },
+	};
+	static const char *const fallback_tests[] = {
+		/* variable outside a string */
+		"SELECT 1 WHERE uid = %{uid}",
+		/* would be mistaken as a parameter */
+		"SELECT 1 WHERE a = ? AND u = '%u'",
+		/* variable in a quoted identifier */
+		"SELECT \"%u\" FROM users",
+		"SELECT `%u` FROM users",
+		/* unterminated strings */
+		"SELECT 1 WHERE u = '%u",
+		"SELECT \"pass FROM users",
+		/* backslash escaping */
+		"SELECT 1 WHERE u = '%u\\' OR 1=1'",
+		"SELECT 1 WHERE a = 'x\\' AND u = '%u'",
+		/* prefixed literals */
+		"SELECT 1 WHERE u = E'%u'",
+		"SELECT 1 WHERE u = N'%u'",
+		"SELECT 1 WHERE u = U&'%u'",
+		"SELECT 1 WHERE u = _utf8'%u'",
+	};
+	pool_t pool;
+	const char *query_template;
+	const char *const *params;
+	unsigned int i;
+
+	test_begin("db sql query template parse");
+	pool = pool_alloconly_create("test db sql", 1024);
+	for (i = 0; i < N_ELEMENTS(tests); i++) {
+		test_assert_idx(db_sql_query_template_parse(pool,
+			tests[i].query, &query_template, &params), i);
+		test_assert_idx(strcmp(query_template, tests[i].template) == 0, i);
+		test_assert_idx(strcmp(test_params_join(params),
+				       tests[i].params) == 0, i);
+	}
+	for (i = 0; i < N_ELEMENTS(fallback_tests); i++) {
+		test_assert_idx(!db_sql_query_template_parse(pool,
+			fallback_tests[i], &query_template, &params), i);
+	}
+	pool_unref(&pool);
+	test_end();
+}
+
+int main(void)
+{
+	static void (*test_functions[])(void) = {
+		test_db_sql_query_template_parse,
+		NULL
+	};
+	return test_run(test_functions);
+}
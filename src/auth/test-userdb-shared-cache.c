@@ -0,0 +1,136 @@
+/* Copyright (c) 2016 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "str.h"
+#include "auth-request.h"
+#include "auth-cache.h"
+#include "userdb-shared-cache.h"
+#include "test-common.h"
+
+#include <unistd.h>
+
+#define TEST_CACHE_PATH ".test-userdb-shared-cache"
+#define TEST_CACHE_SIZE (1024*64)
+
+const struct var_expand_table auth_request_var_expand_static_tab[] = {
+	{ 'u', NULL, "user" },
+	{ '!', NULL, NULL },
+	{ '\0', NULL, NULL }
+};
+
+int t_auth_request_var_expand(const char *str,
+			      const struct auth_request *auth_request ATTR_UNUSED,
+			      auth_request_escape_func_t *escape_func ATTR_UNUSED,
+			      const char **value_r, const char **error_r)
+{
+	string_t *dest = t_str_new(128);
+	int ret = var_expand(dest, str, auth_request_var_expand_static_tab, error_r);
+	*value_r = str_c(dest);
+	return ret;
+}
+
+static struct userdb_shared_cache *test_cache_open(uoff_t size)
+{
+	struct userdb_shared_cache *cache;
+	const char *error;
+
+	if (userdb_shared_cache_open(TEST_CACHE_PATH, size, 3600, 3600,
+				     &cache, &error) < 0)
+		i_fatal("userdb_shared_cache_open() failed: %s", error);
+	return cache;
+}
+
+static const char *
+test_cache_lookup(struct userdb_shared_cache *cache,
+		  const struct auth_request *request, const char *key)
+{
+	bool expired;
+
+	return userdb_shared_cache_lookup(cache, request, key, &expired);
+}
+
+static void test_userdb_shared_cache(void)
+{
+	struct userdb_shared_cache *cache, *cache2;
+	struct auth_request request;
+	const char *const users[] = { "user2", NULL };
+	string_t *str;
+	unsigned int i;
+
+	test_begin("userdb shared cache");
+	i_unlink_if_exists(TEST_CACHE_PATH);
+	memset(&request, 0, sizeof(request));
+	request.user = "user";
+
+	cache = test_cache_open(TEST_CACHE_SIZE);
+	cache2 = test_cache_open(TEST_CACHE_SIZE);
+	test_assert(test_cache_lookup(cache, &request, "user1") == NULL);
+
+	/* records are visible to other processes using the same file */
+	userdb_shared_cache_insert(cache, &request, "user1", "uid=1");
+	userdb_shared_cache_insert(cache, &request, "user2", "");
+	test_assert(null_strcmp(test_cache_lookup(cache2, &request, "user1"),
+				"uid=1") == 0);
+	test_assert(null_strcmp(test_cache_lookup(cache2, &request, "user2"),
+				"") == 0);
+	userdb_shared_cache_insert(cache2, &request, "user1", "uid=2");
+	test_assert(null_strcmp(test_cache_lookup(cache, &request, "user1"),
+				"uid=2") == 0);
+
+	/* flushing specific users */
+	test_assert(!userdb_shared_cache_flushed(cache));
+	test_assert(userdb_shared_cache_clear_users(cache2, users) == 1);
+	test_assert(test_cache_lookup(cache, &request, "user2") == NULL);
+	test_assert(test_cache_lookup(cache, &request, "user1") != NULL);
+	/* other processes see the flush, the flushing one doesn't */
+	test_assert(userdb_shared_cache_flushed(cache));
+	test_assert(!userdb_shared_cache_flushed(cache));
+	test_assert(!userdb_shared_cache_flushed(cache2));
+
+	/* reopening keeps the records */
+	userdb_shared_cache_close(&cache);
+	cache = test_cache_open(TEST_CACHE_SIZE);
+	test_assert(null_strcmp(test_cache_lookup(cache, &request, "user1"),
+				"uid=2") == 0);
+
+	/* flushing everything invalidates records for all processes */
+	test_assert(userdb_shared_cache_clear(cache2) == 1);
+	test_assert(test_cache_lookup(cache, &request, "user1") == NULL);
+	test_assert(userdb_shared_cache_flushed(cache));
+	test_assert(!userdb_shared_cache_flushed(cache2));
+
+	/* too large records aren't cached */
+	str = t_str_new(1024);
+	for (i = 0; i < 1024; i++)
+		str_append_c(str, 'x');
+	userdb_shared_cache_insert(cache, &request, "large", str_c(str));
+	test_assert(test_cache_lookup(cache, &request, "large") == NULL);
+
+	/* with many more keys than records the latest ones are found */
+	for (i = 0; i < 1000; i++) {
+		userdb_shared_cache_insert(cache, &request,
+					   t_strdup_printf("key%u", i), "v");
+	}
+	test_assert(null_strcmp(test_cache_lookup(cache2, &request, "key999"),
+				"v") == 0);
+	userdb_shared_cache_close(&cache2);
+
+	/* changing the size recreates the file */
+	userdb_shared_cache_close(&cache);
+	test_expect_error_string("recreating");
+	cache = test_cache_open(TEST_CACHE_SIZE * 2);
+	test_assert(test_cache_lookup(cache, &request, "key999") == NULL);
+	userdb_shared_cache_close(&cache);
+
+	i_unlink(TEST_CACHE_PATH);
+	test_end();
+}
+
+int main(void)
+{
+	static void (*test_functions[])(void) = {
+		test_userdb_shared_cache,
+		NULL
+	};
+	return test_run(test_functions);
+}
@@ -190,7 +190,7 @@ static void userdb_ldap_iterate_callback(struct ldap_connection *conn,
 	}
 	db_ldap_result_iterate_deinit(&ldap_iter);
 	if (!ctx->continued)
-		db_ldap_enable_input(conn, FALSE);
+		db_ldap_enable_input(request, FALSE);
 	ctx->in_callback = FALSE;
 }
 
@@ -259,7 +259,7 @@ static void userdb_ldap_iterate_next(struct userdb_iterate_context *_ctx)
 
 	ctx->continued = TRUE;
 	if (!ctx->in_callback)
-		db_ldap_enable_input(ctx->conn, TRUE);
+		db_ldap_enable_input(&ctx->request.request.request, TRUE);
 }
 
 static int userdb_ldap_iterate_deinit(struct userdb_iterate_context *_ctx)
@@ -268,7 +268,7 @@ static int userdb_ldap_iterate_deinit(struct userdb_iterate_context *_ctx)
 		(struct ldap_userdb_iterate_context *)_ctx;
 	int ret = _ctx->failed ? -1 : 0;
 
-	db_ldap_enable_input(ctx->conn, TRUE);
+	db_ldap_enable_input(&ctx->request.request.request, TRUE);
 	auth_request_unref(&ctx->request.request.request.auth_request);
 	i_free(ctx);
 	return ret;
@@ -0,0 +1,511 @@
+/* Copyright (c) 2016 Dovecot authors, see the included COPYING file */
+
+#include "auth-common.h"
+#include "hash.h"
+#include "file-lock.h"
+#include "write-full.h"
+#include "restrict-access.h"
+#include "auth-request.h"
+#include "auth-cache.h"
+#include "auth-settings.h"
+#include "userdb-shared-cache.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#define USERDB_SHARED_CACHE_MAGIC 0x55444332
+#define USERDB_SHARED_CACHE_RECORD_SIZE 512
+#define USERDB_SHARED_CACHE_RECORD_DATA_SIZE \
+	(USERDB_SHARED_CACHE_RECORD_SIZE - 16)
+/* Number of records checked for a key, starting from its hash position */
+#define USERDB_SHARED_CACHE_MAX_PROBES 8
+#define USERDB_SHARED_CACHE_LOCK_TIMEOUT_SECS 2
+
+struct userdb_shared_cache_header {
+	uint32_t magic;
+	uint32_t record_size;
+	uint32_t record_count;
+	/* Incremented whenever the whole cache is flushed. Records with a
+	   different generation are unused. */
+	uint32_t generation;
+	/* Incremented by every flush, including flushing only some users.
+	   Auth processes clear their in-process caches when this changes. */
+	uint32_t flush_count;
+	uint32_t unused;
+};
+
+struct userdb_shared_cache_record {
+	/* 0 = unused */
+	uint32_t generation;
+	uint32_t key_hash;
+	uint32_t created;
+	uint16_t key_size;
+	uint16_t value_size;
+	/* key \0 value \0 */
+	char data[USERDB_SHARED_CACHE_RECORD_DATA_SIZE];
+};
+
+struct userdb_shared_cache {
+	char *path;
+	int fd;
+
+	void *mmap_base;
+	size_t mmap_size;
+	struct userdb_shared_cache_header *hdr;
+	struct userdb_shared_cache_record *records;
+	unsigned int record_count;
+
+	unsigned int ttl_secs, neg_ttl_secs;
+	/* hdr->flush_count when userdb_shared_cache_flushed() was called */
+	uint32_t last_flush_count;
+};
+
+struct userdb_shared_cache *userdb_shared_cache = NULL;
+
+static int
+userdb_shared_cache_lock(struct userdb_shared_cache *cache, int lock_type,
+			 struct file_lock **lock_r)
+{
+	const char *error;
+	int ret;
+
+	ret = file_wait_lock_error(cache->fd, cache->path, lock_type,
+				   FILE_LOCK_METHOD_FCNTL,
+				   USERDB_SHARED_CACHE_LOCK_TIMEOUT_SECS,
+				   lock_r, &error);
+	if (ret <= 0) {
+		i_error("userdb shared cache: %s", error);
+		return -1;
+	}
+	return 0;
+}
+
+static int
+userdb_shared_cache_open_locked(struct userdb_shared_cache *cache,
+				struct file_lock **lock_r,
+				const char **error_r)
+{
+	struct stat st1, st2;
+	const char *error;
+
+	for (;;) {
+		cache->fd = open(cache->path, O_RDWR | O_CREAT, 0600);
+		if (cache->fd == -1) {
+			*error_r = t_strdup_printf("open(%s) failed: %m",
+						   cache->path);
+			return -1;
+		}
+		if (file_wait_lock_error(cache->fd, cache->path, F_WRLCK,
+					 FILE_LOCK_METHOD_FCNTL,
+					 USERDB_SHARED_CACHE_LOCK_TIMEOUT_SECS,
+					 lock_r, &error) <= 0) {
+			*error_r = error;
+			i_close_fd(&cache->fd);
+			return -1;
+		}
+		if (fstat(cache->fd, &st1) < 0) {
+			*error_r = t_strdup_printf("fstat(%s) failed: %m",
+						   cache->path);
+			file_unlock(lock_r);
+			i_close_fd(&cache->fd);
+			return -1;
+		}
+		if (stat(cache->path, &st2) == 0 &&
+		    st1.st_ino == st2.st_ino && CMP_DEV_T(st1.st_dev, st2.st_dev))
+			return 0;
+		/* the file was replaced while we were waiting for the lock */
+		file_unlock(lock_r);
+		i_close_fd(&cache->fd);
+	}
+}
+
+static int
+userdb_shared_cache_init_file(struct userdb_shared_cache *cache,
+			      size_t size, const char **error_r)
+{
+	struct userdb_shared_cache_header hdr;
+
+	if (ftruncate(cache->fd, size) < 0) {
+		*error_r = t_strdup_printf("ftruncate(%s) failed: %m",
+					   cache->path);
+		return -1;
+	}
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = USERDB_SHARED_CACHE_MAGIC;
+	hdr.record_size = USERDB_SHARED_CACHE_RECORD_SIZE;
+	hdr.record_count = cache->record_count;
+	hdr.generation = 1;
+	if (pwrite_full(cache->fd, &hdr, sizeof(hdr), 0) < 0) {
+		*error_r = t_strdup_printf("write(%s) failed: %m", cache->path);
+		return -1;
+	}
+	return 0;
+}
+
+static bool
+userdb_shared_cache_hdr_is_valid(struct userdb_shared_cache *cache,
+				 const struct userdb_shared_cache_header *hdr)
+{
+	return hdr->magic == USERDB_SHARED_CACHE_MAGIC &&
+		hdr->record_size == USERDB_SHARED_CACHE_RECORD_SIZE &&
+		hdr->record_count == cache->record_count &&
+		hdr->generation != 0;
+}
+
+static int
+userdb_shared_cache_map(struct userdb_shared_cache *cache,
+			const char **error_r)
+{
+	struct userdb_shared_cache_header hdr;
+	struct file_lock *lock;
+	struct stat st;
+	size_t size;
+	ssize_t ret;
+
+	size = sizeof(hdr) +
+		(size_t)cache->record_count * USERDB_SHARED_CACHE_RECORD_SIZE;
+	for (;;) {
+		if (userdb_shared_cache_open_locked(cache, &lock, error_r) < 0)
+			return -1;
+		ret = pread(cache->fd, &hdr, sizeof(hdr), 0);
+		if (ret < 0 || fstat(cache->fd, &st) < 0) {
+			*error_r = t_strdup_printf("read(%s) failed: %m",
+						   cache->path);
+			file_unlock(&lock);
+			return -1;
+		}
+		if (ret == 0) {
+			/* newly created */
+			if (userdb_shared_cache_init_file(cache, size,
+							  error_r) < 0) {
+				file_unlock(&lock);
+				return -1;
+			}
+			break;
+		}
+		if (ret == sizeof(hdr) && (size_t)st.st_size == size &&
+		    userdb_shared_cache_hdr_is_valid(cache, &hdr))
+			break;
+
+		/* Broken or created with a different size. Other processes
+		   may still have the old file mapped, so don't truncate it
+		   but create a new file. */
+		i_warning("userdb shared cache %s: File has different size "
+			  "or is corrupted - recreating", cache->path);
+		i_unlink(cache->path);
+		file_unlock(&lock);
+		i_close_fd(&cache->fd);
+	}
+
+	cache->mmap_base = mmap(NULL, size, PROT_READ | PROT_WRITE,
+				MAP_SHARED, cache->fd, 0);
+	file_unlock(&lock);
+	if (cache->mmap_base == MAP_FAILED) {
+		cache->mmap_base = NULL;
+		*error_r = t_strdup_printf("mmap(%s) failed: %m", cache->path);
+		return -1;
+	}
+	cache->mmap_size = size;
+	cache->hdr = cache->mmap_base;
+	cache->records = PTR_OFFSET(cache->mmap_base, sizeof(hdr));
+	cache->last_flush_count = cache->hdr->flush_count;
+	return 0;
+}
+
+int userdb_shared_cache_open(const char *path, uoff_t max_size,
+			     unsigned int ttl_secs, unsigned int neg_ttl_secs,
+			     struct userdb_shared_cache **cache_r,
+			     const char **error_r)
+{
+	struct userdb_shared_cache *cache;
+	uoff_t record_count;
+
+	if (max_size < sizeof(struct userdb_shared_cache_header) +
+	    USERDB_SHARED_CACHE_RECORD_SIZE * USERDB_SHARED_CACHE_MAX_PROBES) {
+		*error_r = "Cache size is too small";
+		return -1;
+	}
+	record_count = (max_size - sizeof(struct userdb_shared_cache_header)) /
+		USERDB_SHARED_CACHE_RECORD_SIZE;
+	if (record_count > (uint32_t)-1)
+		record_count = (uint32_t)-1;
+
+	cache = i_new(struct userdb_shared_cache, 1);
+	cache->path = i_strdup(path);
+	cache->fd = -1;
+	cache->record_count = record_count;
+	cache->ttl_secs = ttl_secs;
+	cache->neg_ttl_secs = neg_ttl_secs;
+
+	if (userdb_shared_cache_map(cache, error_r) < 0) {
+		userdb_shared_cache_close(&cache);
+		return -1;
+	}
+	*cache_r = cache;
+	return 0;
+}
+
+void userdb_shared_cache_close(struct userdb_shared_cache **_cache)
+{
+	struct userdb_shared_cache *cache = *_cache;
+
+	*_cache = NULL;
+	if (cache->mmap_base != NULL) {
+		if (munmap(cache->mmap_base, cache->mmap_size) < 0)
+			i_error("munmap(%s) failed: %m", cache->path);
+	}
+	if (cache->fd != -1)
+		i_close_fd(&cache->fd);
+	i_free(cache->path);
+	i_free(cache);
+}
+
+static bool
+userdb_shared_cache_record_is_valid(struct userdb_shared_cache *cache,
+				    const struct userdb_shared_cache_record *rec)
+{
+	if (rec->generation != cache->hdr->generation)
+		return FALSE;
+	/* don't trust the sizes, the file may have been corrupted */
+	return (size_t)rec->key_size + 1 + rec->value_size + 1 <=
+		sizeof(rec->data) &&
+		rec->data[rec->key_size] == '\0' &&
+		rec->data[rec->key_size + 1 + rec->value_size] == '\0';
+}
+
+static bool
+userdb_shared_cache_record_is_expired(struct userdb_shared_cache *cache,
+				      const struct userdb_shared_cache_record *rec,
+				      time_t now)
+{
+	unsigned int ttl_secs = rec->value_size == 0 ?
+		cache->neg_ttl_secs : cache->ttl_secs;
+
+	return (time_t)rec->created < now - (time_t)ttl_secs;
+}
+
+static struct userdb_shared_cache_record *
+userdb_shared_cache_record_get(struct userdb_shared_cache *cache,
+			       unsigned int key_hash, unsigned int probe)
+{
+	return &cache->records[(key_hash + probe) % cache->record_count];
+}
+
+static struct userdb_shared_cache_record *
+userdb_shared_cache_find(struct userdb_shared_cache *cache,
+			 const char *key, unsigned int key_hash)
+{
+	struct userdb_shared_cache_record *rec;
+	size_t key_len = strlen(key);
+	unsigned int i;
+
+	for (i = 0; i < USERDB_SHARED_CACHE_MAX_PROBES; i++) {
+		rec = userdb_shared_cache_record_get(cache, key_hash, i);
+		if (rec->key_hash == key_hash && rec->key_size == key_len &&
+		    userdb_shared_cache_record_is_valid(cache, rec) &&
+		    memcmp(rec->data, key, key_len) == 0)
+			return rec;
+	}
+	return NULL;
+}
+
+const char *
+userdb_shared_cache_lookup(struct userdb_shared_cache *cache,
+			   const struct auth_request *request,
+			   const char *key, bool *expired_r)
+{
+	const struct userdb_shared_cache_record *rec;
+	struct file_lock *lock;
+	const char *value = NULL;
+
+	*expired_r = FALSE;
+
+	key = auth_request_expand_cache_key(request, key);
+	if (userdb_shared_cache_lock(cache, F_RDLCK, &lock) < 0)
+		return NULL;
+	rec = userdb_shared_cache_find(cache, key, str_hash(key));
+	if (rec != NULL) {
+		value = t_strndup(rec->data + rec->key_size + 1,
+				  rec->value_size);
+		*expired_r = userdb_shared_cache_record_is_expired(cache, rec,
+								   time(NULL));
+	}
+	file_unlock(&lock);
+	return value;
+}
+
+static struct userdb_shared_cache_record *
+userdb_shared_cache_get_free(struct userdb_shared_cache *cache,
+			     unsigned int key_hash, time_t now)
+{
+	struct userdb_shared_cache_record *rec, *oldest = NULL;
+	unsigned int i;
+
+	for (i = 0; i < USERDB_SHARED_CACHE_MAX_PROBES; i++) {
+		rec = userdb_shared_cache_record_get(cache, key_hash, i);
+		if (!userdb_shared_cache_record_is_valid(cache, rec) ||
+		    userdb_shared_cache_record_is_expired(cache, rec, now))
+			return rec;
+		if (oldest == NULL || rec->created < oldest->created)
+			oldest = rec;
+	}
+	/* all the records are in use - evict the oldest one */
+	return oldest;
+}
+
+void userdb_shared_cache_insert(struct userdb_shared_cache *cache,
+				struct auth_request *request,
+				const char *key, const char *value)
+{
+	struct userdb_shared_cache_record *rec;
+	struct file_lock *lock;
+	char *current_username;
+	size_t key_len, value_len = strlen(value);
+	unsigned int key_hash;
+	time_t now;
+
+	if (*value == '\0' && cache->neg_ttl_secs == 0) {
+		/* we're not caching negative entries */
+		return;
+	}
+
+	/* same as with auth_cache_insert(): store using the translated
+	   username, except if we're doing a master user login */
+	current_username = request->user;
+	if (request->translated_username != NULL &&
+	    request->requested_login_user == NULL &&
+	    request->master_user == NULL)
+		request->user = t_strdup_noconst(request->translated_username);
+	key = auth_request_expand_cache_key(request, key);
+	request->user = current_username;
+
+	key_len = strlen(key);
+	if (key_len + 1 + value_len + 1 > USERDB_SHARED_CACHE_RECORD_DATA_SIZE) {
+		/* doesn't fit into a record */
+		return;
+	}
+	key_hash = str_hash(key);
+
+	if (userdb_shared_cache_lock(cache, F_WRLCK, &lock) < 0)
+		return;
+	now = time(NULL);
+	rec = userdb_shared_cache_find(cache, key, key_hash);
+	if (rec == NULL)
+		rec = userdb_shared_cache_get_free(cache, key_hash, now);
+
+	rec->generation = cache->hdr->generation;
+	rec->key_hash = key_hash;
+	rec->created = now;
+	rec->key_size = key_len;
+	rec->value_size = value_len;
+	memcpy(rec->data, key, key_len + 1);
+	memcpy(rec->data + key_len + 1, value, value_len + 1);
+	file_unlock(&lock);
+}
+
+unsigned int userdb_shared_cache_clear(struct userdb_shared_cache *cache)
+{
+	struct file_lock *lock;
+	unsigned int i, count = 0;
+
+	if (userdb_shared_cache_lock(cache, F_WRLCK, &lock) < 0)
+		return 0;
+	for (i = 0; i < cache->record_count; i++) {
+		if (cache->records[i].generation == cache->hdr->generation)
+			count++;
+	}
+	if (++cache->hdr->generation == 0) {
+		/* wrapped - 0 is reserved for unused records */
+		memset(cache->records, 0, cache->mmap_size -
+		       sizeof(struct userdb_shared_cache_header));
+		cache->hdr->generation = 1;
+	}
+	cache->last_flush_count = ++cache->hdr->flush_count;
+	file_unlock(&lock);
+	return count;
+}
+
+unsigned int userdb_shared_cache_clear_users(struct userdb_shared_cache *cache,
+					     const char *const *usernames)
+{
+	struct userdb_shared_cache_record *rec;
+	struct file_lock *lock;
+	unsigned int i, j, count = 0;
+
+	if (userdb_shared_cache_lock(cache, F_WRLCK, &lock) < 0)
+		return 0;
+	for (i = 0; i < cache->record_count; i++) {
+		rec = &cache->records[i];
+		if (!userdb_shared_cache_record_is_valid(cache, rec))
+			continue;
+		for (j = 0; usernames[j] != NULL; j++) {
+			if (auth_cache_key_is_user(rec->data, usernames[j])) {
+				rec->generation = 0;
+				count++;
+				break;
+			}
+		}
+	}
+	cache->last_flush_count = ++cache->hdr->flush_count;
+	file_unlock(&lock);
+	return count;
+}
+
+bool userdb_shared_cache_flushed(struct userdb_shared_cache *cache)
+{
+	uint32_t flush_count = cache->hdr->flush_count;
+
+	if (flush_count == cache->last_flush_count)
+		return FALSE;
+	cache->last_flush_count = flush_count;
+	return TRUE;
+}
+
+static void
+userdb_shared_cache_chown(struct userdb_shared_cache *cache)
+{
+	struct restrict_access_settings rset;
+	struct stat st;
+
+	/* the file was opened while still running as root. make it owned by
+	   the auth user, so auth processes started without root privileges
+	   can open it as well. */
+	restrict_access_get_env(&rset);
+	if (fstat(cache->fd, &st) < 0) {
+		i_error("fstat(%s) failed: %m", cache->path);
+		return;
+	}
+	if ((rset.uid == (uid_t)-1 || st.st_uid == rset.uid) &&
+	    (rset.gid == (gid_t)-1 || st.st_gid == rset.gid))
+		return;
+	if (fchown(cache->fd, rset.uid, rset.gid) < 0)
+		i_error("fchown(%s) failed: %m", cache->path);
+}
+
+void userdb_shared_cache_init(const struct auth_settings *set)
+{
+	const char *path, *error;
+
+	if (set->userdb_shared_cache_size == 0 || set->cache_ttl == 0)
+		return;
+
+	path = t_strconcat(set->base_dir, "/",
+			   USERDB_SHARED_CACHE_FNAME, NULL);
+	if (userdb_shared_cache_open(path, set->userdb_shared_cache_size,
+				     set->cache_ttl, set->cache_negative_ttl,
+				     &userdb_shared_cache, &error) < 0) {
+		i_error("userdb shared cache %s: %s - disabled", path, error);
+		return;
+	}
+	if (geteuid() == 0)
+		userdb_shared_cache_chown(userdb_shared_cache);
+}
+
+void userdb_shared_cache_deinit(void)
+{
+	if (userdb_shared_cache != NULL)
+		userdb_shared_cache_close(&userdb_shared_cache);
+}
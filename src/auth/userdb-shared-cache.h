@@ -0,0 +1,52 @@
+#ifndef USERDB_SHARED_CACHE_H
+#define USERDB_SHARED_CACHE_H
+
+/* userdb result cache in a mmap()ed file, which is shared by all the auth
+   processes using the same base_dir. The cache survives auth process
+   restarts. Records are fixed size, so results with too large key+value
+   aren't cached. */
+
+#define USERDB_SHARED_CACHE_FNAME "auth-userdb-cache"
+
+struct auth_request;
+struct auth_settings;
+
+extern struct userdb_shared_cache *userdb_shared_cache;
+
+/* Open or create the cache file. If an existing file was created with a
+   different size, it's replaced with a new empty one. */
+int userdb_shared_cache_open(const char *path, uoff_t max_size,
+			     unsigned int ttl_secs, unsigned int neg_ttl_secs,
+			     struct userdb_shared_cache **cache_r,
+			     const char **error_r);
+void userdb_shared_cache_close(struct userdb_shared_cache **cache);
+
+/* Look up the key (as returned by auth_cache_parse_key()) from cache.
+   Returns NULL if not found, "" for negative entries. */
+const char *
+userdb_shared_cache_lookup(struct userdb_shared_cache *cache,
+			   const struct auth_request *request,
+			   const char *key, bool *expired_r);
+/* Insert key => value into cache. "" value means negative cache entry. */
+void userdb_shared_cache_insert(struct userdb_shared_cache *cache,
+				struct auth_request *request,
+				const char *key, const char *value);
+
+/* Invalidate all records by incrementing the cache generation. Returns
+   how many valid records there were. */
+unsigned int ATTR_NOWARN_UNUSED_RESULT
+userdb_shared_cache_clear(struct userdb_shared_cache *cache);
+unsigned int userdb_shared_cache_clear_users(struct userdb_shared_cache *cache,
+					     const char *const *usernames);
+
+/* Returns TRUE if the cache has been flushed by any process since the
+   previous call. The caller should then clear its in-process caches,
+   because they may contain the flushed users. */
+bool userdb_shared_cache_flushed(struct userdb_shared_cache *cache);
+
+/* Open the cache file. This must be called while still running as root,
+   because the file is created to the root owned base_dir. */
+void userdb_shared_cache_init(const struct auth_settings *set);
+void userdb_shared_cache_deinit(void);
+
+#endif
@@ -223,6 +223,52 @@ static void cmd_auth_cache_flush(int argc, char *argv[])
 	auth_master_deinit(&conn);
 }
 
+static void cmd_auth_cache_stats(int argc, char *argv[])
+{
+	const char *master_socket_path = NULL;
+	struct auth_master_connection *conn;
+	pool_t pool;
+	const char *const *fields, *const *field;
+	int c;
+
+	while ((c = getopt(argc, argv, "a:")) > 0) {
+		switch (c) {
+		case 'a':
+			master_socket_path = optarg;
+			break;
+		default:
+			doveadm_exit_code = EX_USAGE;
+			return;
+		}
+	}
+	if (argv[optind] != NULL) {
+		doveadm_exit_code = EX_USAGE;
+		return;
+	}
+
+	if (master_socket_path == NULL) {
+		master_socket_path = t_strconcat(doveadm_settings->base_dir,
+						 "/auth-master", NULL);
+	}
+
+	pool = pool_alloconly_create("auth cache stats", 512);
+	conn = doveadm_get_auth_master_conn(master_socket_path);
+	if (auth_master_cache_stats(conn, pool, &fields) < 0) {
+		i_error("Cache stats lookup failed");
+		doveadm_exit_code = EX_TEMPFAIL;
+	} else {
+		doveadm_print_init(DOVEADM_PRINT_TYPE_PAGER);
+		for (field = fields; *field != NULL; field++)
+			doveadm_print_header_simple(t_strcut(*field, '='));
+		for (field = fields; *field != NULL; field++) {
+			const char *value = strchr(*field, '=');
+			doveadm_print(value == NULL ? "" : value + 1);
+		}
+	}
+	auth_master_deinit(&conn);
+	pool_unref(&pool);
+}
+
 static void cmd_user_mail_input_field(const char *key, const char *value,
 				      const char *show_field)
 {
@@ -485,6 +531,14 @@ DOVEADM_CMD_PARAM('a', "socket-path", CMD_PARAM_STR, 0)
 DOVEADM_CMD_PARAM('\0', "user", CMD_PARAM_ARRAY, CMD_PARAM_FLAG_POSITIONAL)
 DOVEADM_CMD_PARAMS_END
 },
+{
+	.name = "auth cache stats",
+	.old_cmd = cmd_auth_cache_stats,
+	.usage = "[-a <master socket path>]",
+DOVEADM_CMD_PARAMS_START
+DOVEADM_CMD_PARAM('a', "socket-path", CMD_PARAM_STR, 0)
+DOVEADM_CMD_PARAMS_END
+},
 {
 	.name = "user",
 	.cmd = cmd_user_ver2,
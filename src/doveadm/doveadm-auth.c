@@ -293,6 +293,46 @@ static void cmd_auth_cache_flush(int argc, char *argv[])
 	auth_master_deinit(&conn);
 }
 
+static void cmd_auth_cache_stats(int argc, char *argv[])
+{
+	const char *master_socket_path = NULL;
+	struct auth_master_connection *conn;
+	pool_t pool;
+	const char *const *fields;
+	int c;
+
+	while ((c = getopt(argc, argv, "a:")) > 0) {
+		switch (c) {
+		case 'a':
+			master_socket_path = optarg;
+			break;
+		default:
+			auth_cmd_help(cmd_auth_cache_stats);
+		}
+	}
+	if (argv[optind] != NULL)
+		auth_cmd_help(cmd_auth_cache_stats);
+
+	if (master_socket_path == NULL) {
+		master_socket_path = t_strconcat(doveadm_settings->base_dir,
+						 "/auth-master", NULL);
+	}
+
+	pool = pool_alloconly_create("auth cache stats", 512);
+	conn = doveadm_get_auth_master_conn(master_socket_path);
+	if (auth_master_cache_stats(conn, pool, &fields) < 0) {
+		i_error("Cache stats lookup failed");
+		doveadm_exit_code = EX_TEMPFAIL;
+	} else if (fields[0] == NULL) {
+		printf("Authentication cache is disabled\n");
+	} else {
+		for (; *fields != NULL; fields++)
+			printf("%s\n", *fields);
+	}
+	auth_master_deinit(&conn);
+	pool_unref(&pool);
+}
+
 static void authtest_input_init(struct authtest_input *input)
 {
 	memset(input, 0, sizeof(*input));
@@ -710,6 +750,8 @@ struct doveadm_cmd doveadm_cmd_auth[] = {
 	  "[-a <userdb socket path>] [-x <auth info>] [-f field] <user> [...]" },
 	{ cmd_auth_cache_flush, "auth cache flush",
 	  "[-a <master socket path>] [<user> [...]]" },
+	{ cmd_auth_cache_stats, "auth cache stats",
+	  "[-a <master socket path>]" },
 	{ cmd_user, "user",
 	  "[-a <userdb socket path>] [-x <auth info>] [-f field] [-e <value>] [-u] <user mask> [...]" }
 };
@@ -464,8 +464,14 @@ static bool cmd_search_more(struct client_command_context *cmd)
 		}
 		search_add_result_id(ctx, id);
 	}
-	if (tryagain)
+	if (tryagain) {
+		if (mailbox_search_is_waiting(ctx->search_ctx) &&
+		    ctx->to != NULL) {
+			/* cmd_search_async_callback() continues the search */
+			timeout_remove(&ctx->to);
+		}
 		return FALSE;
+	}
 
 	if (minmax && array_count(&ctx->result) > 0 &&
 	    (opts & (SEARCH_RETURN_MODSEQ | SEARCH_RETURN_SAVE)) != 0) {
@@ -530,6 +536,14 @@ static void cmd_search_more_callback(struct client_command_context *cmd)
 		client_continue_pending_input(client);
 }
 
+static void cmd_search_async_callback(struct client_command_context *cmd)
+{
+	struct imap_search_context *ctx = cmd->context;
+
+	if (ctx->to == NULL)
+		ctx->to = timeout_add(0, cmd_search_more_callback, cmd);
+}
+
 int cmd_search_parse_return_if_found(struct imap_search_context *ctx,
 				     const struct imap_arg **_args)
 {
@@ -584,6 +598,8 @@ bool imap_search_start(struct imap_search_context *ctx,
 	ctx->sargs = sargs;
 	ctx->search_ctx =
 		mailbox_search_init(ctx->trans, sargs, sort_program, 0, NULL);
+	mailbox_search_set_async_callback(ctx->search_ctx,
+					  cmd_search_async_callback, cmd);
 	ctx->sorting = sort_program != NULL;
 	i_array_init(&ctx->result, 128);
 	if ((ctx->return_options & SEARCH_RETURN_UPDATE) != 0)
@@ -601,7 +617,8 @@ bool imap_search_start(struct imap_search_context *ctx,
 		return TRUE;
 
 	/* we may have moved onto syncing by now */
-	if (cmd->func == cmd_search_more)
+	if (cmd->func == cmd_search_more &&
+	    !mailbox_search_is_waiting(ctx->search_ctx))
 		ctx->to = timeout_add(0, cmd_search_more_callback, cmd);
 	return FALSE;
 }
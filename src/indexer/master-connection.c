@@ -5,6 +5,7 @@
 #include "istream.h"
 #include "write-full.h"
 #include "strescape.h"
+#include "time-util.h"
 #include "process-title.h"
 #include "master-service.h"
 #include "master-service-settings.h"
@@ -22,6 +23,10 @@
 #define INDEXER_WORKER_HANDSHAKE "VERSION\tindexer-worker-master\t1\t0\n%u\n"
 #define INDEXER_MASTER_NAME "indexer-master-worker"
 
+/* Number of mails to read ahead while the previous ones are being indexed,
+   unless mail_prefetch_count is higher. */
+#define INDEXER_WORKER_PREFETCH_COUNT 16
+
 struct master_connection {
 	struct mail_storage_service_ctx *storage_service;
 
@@ -35,7 +40,8 @@ struct master_connection {
 
 static void ATTR_NULL(1, 2)
 indexer_worker_refresh_proctitle(const char *username, const char *mailbox,
-				 uint32_t seq1, uint32_t seq2)
+				 uint32_t seq1, uint32_t seq2,
+				 unsigned int msgs_per_sec)
 {
 	if (!master_service_settings_get(master_service)->verbose_proctitle)
 		return;
@@ -45,11 +51,27 @@ indexer_worker_refresh_proctitle(const char *username, const char *mailbox,
 	else if (seq1 == 0)
 		process_title_set(t_strdup_printf("[%s %s]", username, mailbox));
 	else {
-		process_title_set(t_strdup_printf("[%s %s - %u/%u]",
-						  username, mailbox, seq1, seq2));
+		process_title_set(t_strdup_printf("[%s %s - %u/%u, %u msgs/sec]",
+						  username, mailbox, seq1, seq2,
+						  msgs_per_sec));
 	}
 }
 
+static unsigned int
+indexer_worker_msgs_per_sec(const struct timeval *start_time,
+			    unsigned int counter)
+{
+	struct timeval now;
+	int msecs;
+
+	if (gettimeofday(&now, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
+	msecs = timeval_diff_msecs(&now, start_time);
+	if (msecs <= 0)
+		return counter;
+	return (unsigned long long)counter * 1000 / msecs;
+}
+
 static int
 index_mailbox_precache(struct master_connection *conn, struct mailbox *box)
 {
@@ -62,6 +84,7 @@ index_mailbox_precache(struct master_connection *conn, struct mailbox *box)
 	struct mail_search_context *ctx;
 	struct mail *mail;
 	struct mailbox_metadata metadata;
+	struct timeval start_time;
 	uint32_t seq;
 	char percentage_str[2+1+1];
 	unsigned int counter = 0, max, percentage, percentage_sent = 0;
@@ -80,6 +103,8 @@ index_mailbox_precache(struct master_connection *conn, struct mailbox *box)
 		return -1;
 	}
 	seq = status.last_cached_seq + 1;
+	if (gettimeofday(&start_time, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
 
 	trans = mailbox_transaction_begin(box, MAILBOX_TRANSACTION_FLAG_NO_CACHE_DEC);
 	search_args = mail_search_build_init();
@@ -87,6 +112,11 @@ index_mailbox_precache(struct master_connection *conn, struct mailbox *box)
 	ctx = mailbox_search_init(trans, search_args, NULL,
 				  metadata.precache_fields, NULL);
 	mail_search_args_unref(&search_args);
+	/* FTS indexing reads the full mails, so have the OS read the next
+	   ones into memory while the current one is being indexed. */
+	mailbox_search_set_prefetch(ctx,
+		I_MAX(storage->set->mail_prefetch_count,
+		      INDEXER_WORKER_PREFETCH_COUNT), TRUE);
 
 	max = status.messages + 1 - seq;
 	while (mailbox_search_next(ctx, &mail)) {
@@ -103,7 +133,8 @@ index_mailbox_precache(struct master_connection *conn, struct mailbox *box)
 						 strlen(percentage_str));
 			}
 			indexer_worker_refresh_proctitle(username, box_vname,
-							 counter, max);
+				counter, max,
+				indexer_worker_msgs_per_sec(&start_time, counter));
 		}
 	}
 	if (mailbox_search_deinit(&ctx) < 0) {
@@ -117,8 +148,9 @@ index_mailbox_precache(struct master_connection *conn, struct mailbox *box)
 		ret = -1;
 	}
 	if (ret == 0) {
-		i_info("Indexed %u messages in %s",
-		       counter, mailbox_get_vname(box));
+		i_info("Indexed %u messages in %s (%u msgs/sec)",
+		       counter, mailbox_get_vname(box),
+		       indexer_worker_msgs_per_sec(&start_time, counter));
 	}
 	return ret;
 }
@@ -224,10 +256,10 @@ master_connection_input_line(struct master_connection *conn, const char *line)
 		i_error("User %s lookup failed: %s", args[0], error);
 		ret = -1;
 	} else {
-		indexer_worker_refresh_proctitle(user->username, args[1], 0, 0);
+		indexer_worker_refresh_proctitle(user->username, args[1], 0, 0, 0);
 		ret = index_mailbox(conn, user, args[1],
 				    max_recent_msgs, args[4]);
-		indexer_worker_refresh_proctitle(NULL, NULL, 0, 0);
+		indexer_worker_refresh_proctitle(NULL, NULL, 0, 0, 0);
 		mail_user_unref(&user);
 		mail_storage_service_user_free(&service_user);
 	}
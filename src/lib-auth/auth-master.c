@@ -643,6 +643,54 @@ int auth_master_cache_flush(struct auth_master_connection *conn,
 	return ctx.failed ? -1 : 0;
 }
 
+struct auth_master_cache_stats_ctx {
+	struct auth_master_connection *conn;
+	pool_t pool;
+	const char *const *fields;
+	bool failed;
+};
+
+static bool
+auth_cache_stats_reply_callback(const char *cmd, const char *const *args,
+				void *context)
+{
+	struct auth_master_cache_stats_ctx *ctx = context;
+
+	if (strcmp(cmd, "OK") != 0)
+		ctx->failed = TRUE;
+	else
+		ctx->fields = p_strarray_dup(ctx->pool, args);
+
+	io_loop_stop(ctx->conn->ioloop);
+	return TRUE;
+}
+
+int auth_master_cache_stats(struct auth_master_connection *conn, pool_t pool,
+			    const char *const **fields_r)
+{
+	struct auth_master_cache_stats_ctx ctx;
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.conn = conn;
+	ctx.pool = pool;
+
+	conn->reply_callback = auth_cache_stats_reply_callback;
+	conn->reply_context = &ctx;
+
+	conn->prefix = "auth cache stats";
+	(void)auth_master_run_cmd(conn, t_strdup_printf("CACHE-STATS\t%u\n",
+		auth_master_next_request_id(conn)));
+	conn->prefix = DEFAULT_USERDB_LOOKUP_PREFIX;
+
+	conn->reply_context = NULL;
+	if (ctx.failed || ctx.fields == NULL) {
+		*fields_r = NULL;
+		return -1;
+	}
+	*fields_r = ctx.fields;
+	return 0;
+}
+
 static bool
 auth_user_list_reply_callback(const char *cmd, const char *const *args,
 			      void *context)
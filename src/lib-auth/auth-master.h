@@ -47,6 +47,10 @@ int auth_master_pass_lookup(struct auth_master_connection *conn,
    users. Returns number of users flushed from cache. */
 int auth_master_cache_flush(struct auth_master_connection *conn,
 			    const char *const *users, unsigned int *count_r);
+/* Get authentication cache statistics as key=value fields. The returned
+   array is empty if the cache is disabled. */
+int auth_master_cache_stats(struct auth_master_connection *conn, pool_t pool,
+			    const char *const **fields_r);
 
 /* Parse userdb extra fields into auth_user_reply structure. */
 void auth_user_fields_parse(const char *const *fields, pool_t pool,
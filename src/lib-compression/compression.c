@@ -5,6 +5,8 @@
 #include "istream-zlib.h"
 #include "ostream-zlib.h"
 #include "iostream-lz4.h"
+#include "iostream-framed.h"
+#include "iostream-zstd.h"
 #include "compression.h"
 
 #ifndef HAVE_ZLIB
@@ -12,6 +14,8 @@
 #  define o_stream_create_gz NULL
 #  define i_stream_create_deflate NULL
 #  define o_stream_create_deflate NULL
+#  define i_stream_create_framed NULL
+#  define o_stream_create_framed NULL
 #endif
 #ifndef HAVE_BZLIB
 #  define i_stream_create_bz2 NULL
@@ -25,6 +29,10 @@
 #  define i_stream_create_lz4 NULL
 #  define o_stream_create_lz4 NULL
 #endif
+#ifndef HAVE_ZSTD
+#  define i_stream_create_zstd NULL
+#  define o_stream_create_zstd NULL
+#endif
 
 static bool is_compressed_zlib(struct istream *input)
 {
@@ -79,6 +87,26 @@ static bool is_compressed_lz4(struct istream *input)
 	return memcmp(data, IOSTREAM_LZ4_MAGIC, IOSTREAM_LZ4_MAGIC_LEN) == 0;
 }
 
+static bool is_compressed_framed(struct istream *input)
+{
+	const unsigned char *data;
+	size_t size;
+
+	if (i_stream_read_bytes(input, &data, &size, IOSTREAM_FRAMED_MAGIC_LEN) <= 0)
+		return FALSE;
+	return memcmp(data, IOSTREAM_FRAMED_MAGIC, IOSTREAM_FRAMED_MAGIC_LEN) == 0;
+}
+
+static bool is_compressed_zstd(struct istream *input)
+{
+	const unsigned char *data;
+	size_t size;
+
+	if (i_stream_read_bytes(input, &data, &size, IOSTREAM_ZSTD_MAGIC_LEN) <= 0)
+		return FALSE;
+	return memcmp(data, IOSTREAM_ZSTD_MAGIC, IOSTREAM_ZSTD_MAGIC_LEN) == 0;
+}
+
 const struct compression_handler *compression_lookup_handler(const char *name)
 {
 	unsigned int i;
@@ -122,14 +150,18 @@ compression_lookup_handler_from_ext(const char *path)
 
 const struct compression_handler compression_handlers[] = {
 	{ "gz", ".gz", is_compressed_zlib,
-	  i_stream_create_gz, o_stream_create_gz },
+	  i_stream_create_gz, o_stream_create_gz, FALSE },
 	{ "bz2", ".bz2", is_compressed_bzlib,
-	  i_stream_create_bz2, o_stream_create_bz2 },
+	  i_stream_create_bz2, o_stream_create_bz2, FALSE },
 	{ "deflate", NULL, NULL,
-	  i_stream_create_deflate, o_stream_create_deflate },
+	  i_stream_create_deflate, o_stream_create_deflate, FALSE },
 	{ "xz", ".xz", is_compressed_xz,
-	  i_stream_create_lzma, o_stream_create_lzma },
+	  i_stream_create_lzma, o_stream_create_lzma, FALSE },
 	{ "lz4", ".lz4", is_compressed_lz4,
-	  i_stream_create_lz4, o_stream_create_lz4 },
-	{ NULL, NULL, NULL, NULL, NULL }
+	  i_stream_create_lz4, o_stream_create_lz4, FALSE },
+	{ "zstd", ".zst", is_compressed_zstd,
+	  i_stream_create_zstd, o_stream_create_zstd, FALSE },
+	{ "framed", ".fz", is_compressed_framed,
+	  i_stream_create_framed, o_stream_create_framed, TRUE },
+	{ NULL, NULL, NULL, NULL, NULL, FALSE }
 };
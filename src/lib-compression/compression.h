@@ -8,6 +8,9 @@ struct compression_handler {
 	struct istream *(*create_istream)(struct istream *input,
 					  bool log_errors);
 	struct ostream *(*create_ostream)(struct ostream *output, int level);
+	/* TRUE if seeking the istream doesn't require uncompressing all the
+	   data before the wanted offset */
+	bool random_access;
 };
 
 extern const struct compression_handler compression_handlers[];
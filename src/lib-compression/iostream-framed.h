@@ -0,0 +1,60 @@
+#ifndef IOSTREAM_FRAMED_H
+#define IOSTREAM_FRAMED_H
+
+/*
+   Dovecot's framed zlib files contain:
+
+   IOSTREAM_FRAMED_HEADER
+   n x (frame prefix, zlib compressed frame)
+   4 zero bytes (end of frames)
+   n x frame prefix (the frame index)
+   IOSTREAM_FRAMED_FOOTER
+
+   Each frame is compressed independently, so when the whole file is
+   available the reader can use the index at the end of the file to seek
+   directly to the frame containing the wanted offset.
+*/
+
+#define IOSTREAM_FRAMED_MAGIC "Dovecot-FZ\x0d\x2a\x9b\xc6"
+#define IOSTREAM_FRAMED_MAGIC_LEN (sizeof(IOSTREAM_FRAMED_MAGIC)-1)
+#define IOSTREAM_FRAMED_FOOTER_MAGIC "FZ-index"
+#define IOSTREAM_FRAMED_FOOTER_MAGIC_LEN (sizeof(IOSTREAM_FRAMED_FOOTER_MAGIC)-1)
+
+struct iostream_framed_header {
+	unsigned char magic[IOSTREAM_FRAMED_MAGIC_LEN];
+	/* OSTREAM_FRAMED_FRAME_SIZE in big-endian */
+	unsigned char max_uncompressed_frame_size[4];
+};
+
+struct iostream_framed_frame_prefix {
+	/* big-endian sizes of the frame */
+	unsigned char compressed_size[4];
+	unsigned char uncompressed_size[4];
+};
+
+struct iostream_framed_footer {
+	/* big-endian number of frames */
+	unsigned char frame_count[4];
+	unsigned char magic[IOSTREAM_FRAMED_FOOTER_MAGIC_LEN];
+};
+
+/* How large frames we're buffering into memory before compressing them.
+   Seeking needs to uncompress at most this much data. */
+#define OSTREAM_FRAMED_FRAME_SIZE (1024*64)
+/* How large frames we allow in input data before returning a failure. */
+#define ISTREAM_FRAMED_FRAME_SIZE (1024*1024)
+
+static inline void iostream_framed_put_be32(unsigned char *p, uint32_t num)
+{
+	p[0] = (num & 0xff000000) >> 24;
+	p[1] = (num & 0x00ff0000) >> 16;
+	p[2] = (num & 0x0000ff00) >> 8;
+	p[3] = (num & 0x000000ff);
+}
+
+static inline uint32_t iostream_framed_get_be32(const unsigned char *p)
+{
+	return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+#endif
@@ -0,0 +1,14 @@
+#ifndef IOSTREAM_ZSTD_PRIVATE_H
+#define IOSTREAM_ZSTD_PRIVATE_H
+
+#include "iostream-zstd.h"
+#include <zstd.h>
+
+/* Returns the digested dictionary for compression with the given level,
+   or NULL if no dictionary is set. */
+const ZSTD_CDict *iostream_zstd_get_cdict(int level);
+/* Returns the digested dictionary for decompression, or NULL if no
+   dictionary is set. */
+const ZSTD_DDict *iostream_zstd_get_ddict(void);
+
+#endif
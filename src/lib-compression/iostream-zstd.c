@@ -0,0 +1,118 @@
+/* Copyright (c) 2016 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "buffer.h"
+#include "istream.h"
+#include "iostream-zstd.h"
+
+#ifdef HAVE_ZSTD
+
+#include "iostream-zstd-private.h"
+
+/* the dictionary is digested separately for each compression level, but
+   only the levels that are actually used */
+static buffer_t *zstd_dict = NULL;
+static ARRAY(ZSTD_CDict *) zstd_cdicts = ARRAY_INIT;
+static ZSTD_DDict *zstd_ddict = NULL;
+static bool zstd_atexit_registered = FALSE;
+
+static void iostream_zstd_free_dictionary(void)
+{
+	ZSTD_CDict **cdictp;
+
+	if (array_is_created(&zstd_cdicts)) {
+		array_foreach_modifiable(&zstd_cdicts, cdictp) {
+			if (*cdictp != NULL)
+				(void)ZSTD_freeCDict(*cdictp);
+		}
+		array_free(&zstd_cdicts);
+	}
+	if (zstd_ddict != NULL) {
+		(void)ZSTD_freeDDict(zstd_ddict);
+		zstd_ddict = NULL;
+	}
+	if (zstd_dict != NULL)
+		buffer_free(&zstd_dict);
+}
+
+void iostream_zstd_set_dictionary(const void *data, size_t size)
+{
+	iostream_zstd_free_dictionary();
+	if (size == 0)
+		return;
+
+	zstd_dict = buffer_create_dynamic(default_pool, size);
+	buffer_append(zstd_dict, data, size);
+	i_array_init(&zstd_cdicts, 8);
+	zstd_ddict = ZSTD_createDDict(zstd_dict->data, zstd_dict->used);
+	if (zstd_ddict == NULL)
+		i_fatal_status(FATAL_OUTOFMEM, "zstd: Out of memory");
+	if (!zstd_atexit_registered) {
+		lib_atexit(iostream_zstd_free_dictionary);
+		zstd_atexit_registered = TRUE;
+	}
+}
+
+const ZSTD_CDict *iostream_zstd_get_cdict(int level)
+{
+	ZSTD_CDict **cdictp;
+
+	if (zstd_dict == NULL)
+		return NULL;
+
+	cdictp = array_idx_modifiable(&zstd_cdicts, level);
+	if (*cdictp == NULL) {
+		*cdictp = ZSTD_createCDict(zstd_dict->data, zstd_dict->used,
+					   level);
+		if (*cdictp == NULL)
+			i_fatal_status(FATAL_OUTOFMEM, "zstd: Out of memory");
+	}
+	return *cdictp;
+}
+
+const ZSTD_DDict *iostream_zstd_get_ddict(void)
+{
+	return zstd_ddict;
+}
+
+int iostream_zstd_load_dictionary(const char *path, const char **error_r)
+{
+	struct istream *input;
+	const unsigned char *data;
+	buffer_t *buf;
+	size_t size;
+	int ret = -1;
+
+	input = i_stream_create_file(path, IO_BLOCK_SIZE);
+	buf = buffer_create_dynamic(default_pool, 1024*16);
+	while (i_stream_read_more(input, &data, &size) > 0) {
+		buffer_append(buf, data, size);
+		i_stream_skip(input, size);
+	}
+	if (input->stream_errno != 0) {
+		*error_r = t_strdup_printf("Failed to read zstd dictionary: %s",
+					   i_stream_get_error(input));
+	} else if (buf->used == 0) {
+		*error_r = t_strdup_printf("zstd dictionary %s is empty", path);
+	} else {
+		iostream_zstd_set_dictionary(buf->data, buf->used);
+		ret = 0;
+	}
+	i_stream_unref(&input);
+	buffer_free(&buf);
+	return ret;
+}
+#else
+void iostream_zstd_set_dictionary(const void *data ATTR_UNUSED,
+				  size_t size ATTR_UNUSED)
+{
+}
+
+int iostream_zstd_load_dictionary(const char *path ATTR_UNUSED,
+				  const char **error_r)
+{
+	*error_r = "zstd support not compiled in";
+	return -1;
+}
+#endif
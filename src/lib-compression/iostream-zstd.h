@@ -0,0 +1,17 @@
+#ifndef IOSTREAM_ZSTD_H
+#define IOSTREAM_ZSTD_H
+
+/* zstd frame magic number in little-endian */
+#define IOSTREAM_ZSTD_MAGIC "\x28\xb5\x2f\xfd"
+#define IOSTREAM_ZSTD_MAGIC_LEN (sizeof(IOSTREAM_ZSTD_MAGIC)-1)
+
+/* Use the given trained dictionary (e.g. created with "zstd --train") for all
+   the zstd streams created after this call. Small mails compress much better
+   with a dictionary, but the same dictionary is then also needed for
+   reading them. The data is copied. size=0 unsets the dictionary. */
+void iostream_zstd_set_dictionary(const void *data, size_t size);
+/* Read the dictionary from the given path and set it. Returns 0 on success,
+   -1 on error. */
+int iostream_zstd_load_dictionary(const char *path, const char **error_r);
+
+#endif
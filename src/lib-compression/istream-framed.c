@@ -0,0 +1,552 @@
+/* Copyright (c) 2016 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+
+#ifdef HAVE_ZLIB
+
+#include "array.h"
+#include "buffer.h"
+#include "istream-private.h"
+#include "istream-zlib.h"
+#include "iostream-framed.h"
+#include <zlib.h>
+
+struct framed_istream_frame {
+	/* parent offset of the frame prefix */
+	uoff_t parent_offset;
+	/* uncompressed offset where the frame begins */
+	uoff_t offset;
+};
+
+struct framed_istream {
+	struct istream_private istream;
+
+	uoff_t stream_size;
+	size_t high_pos;
+	struct stat last_parent_statbuf;
+
+	buffer_t *chunk_buf;
+	uint32_t frame_size, frame_left, frame_uncompressed_size;
+	uint32_t max_uncompressed_frame_size;
+
+	/* frames read from the index at the end of the file */
+	ARRAY(struct framed_istream_frame) frames;
+	/* index of the next frame to be read after an index-based seek,
+	   UINT_MAX if the position isn't known */
+	unsigned int frame_idx;
+
+	bool log_errors:1;
+	bool marked:1;
+	bool header_read:1;
+	bool index_loaded:1;
+	bool index_unavailable:1;
+};
+
+static void i_stream_framed_close(struct iostream_private *stream,
+				  bool close_parent)
+{
+	struct framed_istream *zstream = (struct framed_istream *)stream;
+
+	if (zstream->chunk_buf != NULL)
+		buffer_free(&zstream->chunk_buf);
+	if (array_is_created(&zstream->frames))
+		array_free(&zstream->frames);
+	if (close_parent)
+		i_stream_close(zstream->istream.parent);
+}
+
+static void framed_read_error(struct framed_istream *zstream, const char *error)
+{
+	io_stream_set_error(&zstream->istream.iostream,
+			    "framed.read(%s): %s at %"PRIuUOFF_T,
+			    i_stream_get_name(&zstream->istream.istream), error,
+			    i_stream_get_absolute_offset(&zstream->istream.istream));
+	if (zstream->log_errors)
+		i_error("%s", zstream->istream.iostream.error);
+}
+
+static int i_stream_framed_read_header(struct framed_istream *zstream)
+{
+	const struct iostream_framed_header *hdr;
+	const unsigned char *data;
+	size_t size;
+	int ret;
+
+	ret = i_stream_read_bytes(zstream->istream.parent, &data, &size,
+				  sizeof(*hdr));
+	if (ret == 0 && !zstream->istream.parent->eof)
+		return 0;
+	if (ret <= 0) {
+		if (zstream->istream.parent->stream_errno != 0) {
+			zstream->istream.istream.stream_errno =
+				zstream->istream.parent->stream_errno;
+		} else if (size > 0) {
+			/* EOF in the middle of the header */
+			framed_read_error(zstream, "truncated header");
+			zstream->istream.istream.stream_errno = EPIPE;
+		} else {
+			/* empty input */
+			zstream->istream.istream.eof = TRUE;
+		}
+		return -1;
+	}
+	hdr = (const void *)data;
+	if (memcmp(hdr->magic, IOSTREAM_FRAMED_MAGIC,
+		   IOSTREAM_FRAMED_MAGIC_LEN) != 0) {
+		framed_read_error(zstream, "wrong magic in header (not framed file?)");
+		zstream->istream.istream.stream_errno = EINVAL;
+		return -1;
+	}
+	zstream->max_uncompressed_frame_size =
+		iostream_framed_get_be32(hdr->max_uncompressed_frame_size);
+	if (zstream->max_uncompressed_frame_size > ISTREAM_FRAMED_FRAME_SIZE) {
+		framed_read_error(zstream, t_strdup_printf(
+			"max frame size too large (%u > %u)",
+			zstream->max_uncompressed_frame_size,
+			ISTREAM_FRAMED_FRAME_SIZE));
+		zstream->istream.istream.stream_errno = EINVAL;
+		return -1;
+	}
+	i_stream_skip(zstream->istream.parent, sizeof(*hdr));
+	zstream->header_read = TRUE;
+	return 1;
+}
+
+static void i_stream_framed_drop_index(struct framed_istream *zstream)
+{
+	if (array_is_created(&zstream->frames))
+		array_free(&zstream->frames);
+	zstream->frame_idx = UINT_MAX;
+	zstream->index_loaded = FALSE;
+	zstream->index_unavailable = TRUE;
+}
+
+static bool
+i_stream_framed_prefix_matches_index(struct framed_istream *zstream)
+{
+	const struct framed_istream_frame *frames;
+	unsigned int count, idx = zstream->frame_idx;
+
+	frames = array_get(&zstream->frames, &count);
+	if (idx + 1 >= count)
+		return FALSE;
+	return frames[idx].parent_offset == zstream->istream.parent->v_offset &&
+		frames[idx+1].parent_offset - frames[idx].parent_offset ==
+		sizeof(struct iostream_framed_frame_prefix) + zstream->frame_size &&
+		frames[idx+1].offset - frames[idx].offset ==
+		zstream->frame_uncompressed_size;
+}
+
+static int i_stream_framed_read_prefix(struct framed_istream *zstream)
+{
+	struct istream_private *stream = &zstream->istream;
+	const struct iostream_framed_frame_prefix *prefix;
+	const unsigned char *data;
+	size_t size;
+	int ret;
+
+	/* the frames end with a 4 byte zero compressed_size */
+	ret = i_stream_read_bytes(stream->parent, &data, &size,
+				  sizeof(prefix->compressed_size));
+	if (ret > 0 && iostream_framed_get_be32(data) == 0) {
+		stream->istream.eof = TRUE;
+		zstream->stream_size = stream->istream.v_offset +
+			stream->pos - stream->skip;
+		return -1;
+	}
+	if (ret > 0) {
+		ret = i_stream_read_bytes(stream->parent, &data, &size,
+					  sizeof(*prefix));
+	}
+	if (ret < 0) {
+		stream->istream.stream_errno = stream->parent->stream_errno;
+		if (stream->istream.stream_errno == 0) {
+			framed_read_error(zstream, "truncated framed stream");
+			stream->istream.stream_errno = EINVAL;
+		}
+		return -1;
+	}
+	if (ret == 0)
+		return 0;
+
+	prefix = (const void *)data;
+	zstream->frame_size = zstream->frame_left =
+		iostream_framed_get_be32(prefix->compressed_size);
+	zstream->frame_uncompressed_size =
+		iostream_framed_get_be32(prefix->uncompressed_size);
+	if (zstream->frame_uncompressed_size == 0 ||
+	    zstream->frame_uncompressed_size >
+	    zstream->max_uncompressed_frame_size ||
+	    zstream->frame_size > compressBound(zstream->max_uncompressed_frame_size)) {
+		framed_read_error(zstream, t_strdup_printf(
+			"invalid frame size: %u -> %u", zstream->frame_size,
+			zstream->frame_uncompressed_size));
+		stream->istream.stream_errno = EINVAL;
+		return -1;
+	}
+	if (zstream->frame_idx != UINT_MAX) {
+		/* we seeked here using the index. make sure it was right. */
+		if (!i_stream_framed_prefix_matches_index(zstream)) {
+			i_stream_framed_drop_index(zstream);
+			framed_read_error(zstream, "frame doesn't match index");
+			stream->istream.stream_errno = EINVAL;
+			return -1;
+		}
+		zstream->frame_idx++;
+	}
+	i_stream_skip(stream->parent, sizeof(*prefix));
+	buffer_set_used_size(zstream->chunk_buf, 0);
+	return 1;
+}
+
+static ssize_t i_stream_framed_read(struct istream_private *stream)
+{
+	struct framed_istream *zstream = (struct framed_istream *)stream;
+	const unsigned char *data;
+	uLongf dest_len;
+	size_t size, max_size;
+	int ret;
+
+	if (stream->pos < zstream->high_pos) {
+		/* we're here because we seeked back within the read buffer. */
+		ret = zstream->high_pos - stream->pos;
+		stream->pos = zstream->high_pos;
+		zstream->high_pos = 0;
+		return ret;
+	}
+	zstream->high_pos = 0;
+
+	if (!zstream->header_read) {
+		if ((ret = i_stream_framed_read_header(zstream)) <= 0)
+			return ret;
+	}
+
+	if (zstream->frame_left == 0 && zstream->frame_size == 0) {
+		if ((ret = i_stream_framed_read_prefix(zstream)) <= 0)
+			return ret;
+	}
+
+	/* read the whole compressed frame into memory */
+	while (zstream->frame_left > 0 &&
+	       (ret = i_stream_read_more(zstream->istream.parent, &data, &size)) > 0) {
+		if (size > zstream->frame_left)
+			size = zstream->frame_left;
+		buffer_append(zstream->chunk_buf, data, size);
+		i_stream_skip(zstream->istream.parent, size);
+		zstream->frame_left -= size;
+	}
+	if (zstream->frame_left > 0) {
+		if (ret == -1 && zstream->istream.parent->stream_errno == 0) {
+			framed_read_error(zstream, "truncated frame");
+			stream->istream.stream_errno = EINVAL;
+			return -1;
+		}
+		zstream->istream.istream.stream_errno =
+			zstream->istream.parent->stream_errno;
+		return ret;
+	}
+	/* if we already have max_buffer_size amount of data, fail here */
+	i_stream_compress(stream);
+	if (stream->pos >= i_stream_get_max_buffer_size(&stream->istream))
+		return -2;
+	max_size = stream->pos + zstream->frame_uncompressed_size;
+	if (stream->buffer_size < max_size) {
+		stream->w_buffer = i_realloc(stream->w_buffer,
+					     stream->buffer_size, max_size);
+		stream->buffer_size = max_size;
+		stream->buffer = stream->w_buffer;
+	}
+	dest_len = zstream->frame_uncompressed_size;
+	ret = uncompress(stream->w_buffer + stream->pos, &dest_len,
+			 zstream->chunk_buf->data, zstream->chunk_buf->used);
+	if (ret == Z_MEM_ERROR) {
+		i_fatal_status(FATAL_OUTOFMEM, "framed.read(%s): Out of memory",
+			       i_stream_get_name(&stream->istream));
+	}
+	if (ret != Z_OK || dest_len != zstream->frame_uncompressed_size) {
+		framed_read_error(zstream, "corrupted frame");
+		stream->istream.stream_errno = EINVAL;
+		return -1;
+	}
+	zstream->frame_size = 0;
+	stream->pos += dest_len;
+	return dest_len;
+}
+
+static int i_stream_framed_load_index(struct framed_istream *zstream)
+{
+	struct istream_private *stream = &zstream->istream;
+	const struct iostream_framed_footer *footer;
+	const struct iostream_framed_frame_prefix *prefix;
+	struct framed_istream_frame *frame;
+	const unsigned char *data;
+	uoff_t parent_size, index_offset, parent_offset, offset;
+	size_t size;
+	uint32_t i, count, frame_size, uncompressed_size;
+
+	if (zstream->index_loaded)
+		return 1;
+	if (zstream->index_unavailable || !stream->parent->seekable)
+		return 0;
+	/* if anything fails, just fallback to reading the frames */
+	zstream->index_unavailable = TRUE;
+
+	if (!zstream->header_read) {
+		/* nothing has been read yet */
+		i_stream_seek(stream->parent, stream->parent_start_offset);
+		if (i_stream_framed_read_header(zstream) <= 0)
+			return 0;
+		stream->parent_expected_offset = stream->parent->v_offset;
+	}
+	if (i_stream_get_size(stream->parent, TRUE, &parent_size) <= 0 ||
+	    parent_size < stream->parent_start_offset +
+	    sizeof(struct iostream_framed_header) + 4 + sizeof(*footer))
+		return 0;
+
+	i_stream_seek(stream->parent, parent_size - sizeof(*footer));
+	if (i_stream_read_bytes(stream->parent, &data, &size,
+				sizeof(*footer)) <= 0)
+		return 0;
+	footer = (const void *)data;
+	if (memcmp(footer->magic, IOSTREAM_FRAMED_FOOTER_MAGIC,
+		   sizeof(footer->magic)) != 0)
+		return 0;
+	count = iostream_framed_get_be32(footer->frame_count);
+	if (count > (parent_size - stream->parent_start_offset) /
+	    sizeof(*prefix))
+		return 0;
+	index_offset = parent_size - sizeof(*footer) -
+		(uoff_t)count * sizeof(*prefix);
+
+	i_array_init(&zstream->frames, count + 1);
+	parent_offset = stream->parent_start_offset +
+		sizeof(struct iostream_framed_header);
+	offset = 0;
+	i_stream_seek(stream->parent, index_offset);
+	for (i = 0; i < count; i++) {
+		if (i_stream_read_bytes(stream->parent, &data, &size,
+					sizeof(*prefix)) <= 0)
+			break;
+		prefix = (const void *)data;
+		frame_size = iostream_framed_get_be32(prefix->compressed_size);
+		uncompressed_size =
+			iostream_framed_get_be32(prefix->uncompressed_size);
+		if (frame_size == 0 || uncompressed_size == 0 ||
+		    uncompressed_size > zstream->max_uncompressed_frame_size)
+			break;
+
+		frame = array_append_space(&zstream->frames);
+		frame->parent_offset = parent_offset;
+		frame->offset = offset;
+		parent_offset += sizeof(*prefix) + frame_size;
+		offset += uncompressed_size;
+		i_stream_skip(stream->parent, sizeof(*prefix));
+	}
+	/* the frames must end exactly where the index begins */
+	if (i != count || parent_offset + 4 != index_offset) {
+		array_free(&zstream->frames);
+		return 0;
+	}
+	/* add the end of frames marker as the last frame */
+	frame = array_append_space(&zstream->frames);
+	frame->parent_offset = parent_offset;
+	frame->offset = offset;
+
+	zstream->stream_size = offset;
+	zstream->index_loaded = TRUE;
+	zstream->index_unavailable = FALSE;
+	return 1;
+}
+
+static void
+i_stream_framed_seek_frame(struct framed_istream *zstream, uoff_t v_offset)
+{
+	struct istream_private *stream = &zstream->istream;
+	const struct framed_istream_frame *frames;
+	unsigned int idx, left_idx, right_idx, count;
+
+	/* find the last frame beginning at or before v_offset */
+	frames = array_get(&zstream->frames, &count);
+	left_idx = 0; right_idx = count;
+	while (left_idx + 1 < right_idx) {
+		idx = (left_idx + right_idx) / 2;
+		if (frames[idx].offset <= v_offset)
+			left_idx = idx;
+		else
+			right_idx = idx;
+	}
+
+	stream->parent_expected_offset = frames[left_idx].parent_offset;
+	i_stream_seek(stream->parent, stream->parent_expected_offset);
+	zstream->frame_size = zstream->frame_left = 0;
+	zstream->high_pos = 0;
+
+	stream->skip = stream->pos = 0;
+	stream->istream.v_offset = frames[left_idx].offset;
+	zstream->frame_idx = left_idx;
+}
+
+static void i_stream_framed_reset(struct framed_istream *zstream)
+{
+	struct istream_private *stream = &zstream->istream;
+
+	i_stream_seek(stream->parent, stream->parent_start_offset);
+	zstream->header_read = FALSE;
+	zstream->frame_size = zstream->frame_left = 0;
+	zstream->frame_idx = UINT_MAX;
+
+	stream->parent_expected_offset = stream->parent_start_offset;
+	stream->skip = stream->pos = 0;
+	stream->istream.v_offset = 0;
+	zstream->high_pos = 0;
+}
+
+static void
+i_stream_framed_seek(struct istream_private *stream, uoff_t v_offset, bool mark)
+{
+	struct framed_istream *zstream = (struct framed_istream *) stream;
+	uoff_t start_offset = stream->istream.v_offset - stream->skip;
+
+	if (zstream->high_pos != 0) {
+		stream->pos = zstream->high_pos;
+		zstream->high_pos = 0;
+	}
+
+	if (v_offset >= start_offset && v_offset <= start_offset + stream->pos) {
+		/* seeking within what's already cached */
+		stream->skip = v_offset - start_offset;
+		stream->istream.v_offset = v_offset;
+		zstream->high_pos = stream->pos;
+		stream->pos = stream->skip;
+	} else {
+		/* jump directly to the wanted frame if we have the index,
+		   otherwise read and cache forward */
+		ssize_t ret;
+
+		if (i_stream_framed_load_index(zstream) > 0)
+			i_stream_framed_seek_frame(zstream, v_offset);
+		else if (v_offset < start_offset)
+			i_stream_framed_reset(zstream);
+
+		for (;;) {
+			size_t avail = stream->pos - stream->skip;
+
+			if (stream->istream.v_offset + avail >= v_offset) {
+				i_stream_skip(&stream->istream,
+					      v_offset -
+					      stream->istream.v_offset);
+				break;
+			}
+
+			i_stream_skip(&stream->istream, avail);
+			if ((ret = i_stream_read(&stream->istream)) <= 0) {
+				i_assert(ret == -1);
+				break;
+			}
+		}
+
+		if (stream->istream.v_offset != v_offset) {
+			/* some failure, we've broken it */
+			if (stream->istream.stream_errno != 0) {
+				i_error("framed_istream.seek(%s) failed: %s",
+					i_stream_get_name(&stream->istream),
+					strerror(stream->istream.stream_errno));
+				i_stream_close(&stream->istream);
+			} else {
+				/* unexpected EOF. allow it since we may just
+				   want to check if there's anything.. */
+				i_assert(stream->istream.eof);
+			}
+		}
+	}
+
+	if (mark)
+		zstream->marked = TRUE;
+}
+
+static int
+i_stream_framed_stat(struct istream_private *stream, bool exact)
+{
+	struct framed_istream *zstream = (struct framed_istream *) stream;
+	const struct stat *st;
+	size_t size;
+
+	if (i_stream_stat(stream->parent, exact, &st) < 0) {
+		stream->istream.stream_errno = stream->parent->stream_errno;
+		return -1;
+	}
+	stream->statbuf = *st;
+
+	/* when exact=FALSE always return the parent stat's size, even if we
+	   know the exact value. this is necessary because otherwise e.g. mbox
+	   code can see two different values and think that a compressed mbox
+	   file keeps changing. */
+	if (!exact)
+		return 0;
+
+	if (zstream->stream_size == (uoff_t)-1 &&
+	    i_stream_framed_load_index(zstream) == 0) {
+		uoff_t old_offset = stream->istream.v_offset;
+		ssize_t ret;
+
+		do {
+			size = i_stream_get_data_size(&stream->istream);
+			i_stream_skip(&stream->istream, size);
+		} while ((ret = i_stream_read(&stream->istream)) > 0);
+		i_assert(ret == -1);
+
+		i_stream_seek(&stream->istream, old_offset);
+		if (zstream->stream_size == (uoff_t)-1)
+			return -1;
+	}
+	stream->statbuf.st_size = zstream->stream_size;
+	return 0;
+}
+
+static void i_stream_framed_sync(struct istream_private *stream)
+{
+	struct framed_istream *zstream = (struct framed_istream *) stream;
+	const struct stat *st;
+
+	if (i_stream_stat(stream->parent, FALSE, &st) < 0) {
+		if (memcmp(&zstream->last_parent_statbuf,
+			   st, sizeof(*st)) == 0) {
+			/* a compressed file doesn't change unexpectedly,
+			   don't clear our caches unnecessarily */
+			return;
+		}
+		zstream->last_parent_statbuf = *st;
+	}
+	i_stream_framed_reset(zstream);
+	if (array_is_created(&zstream->frames))
+		array_free(&zstream->frames);
+	zstream->index_loaded = FALSE;
+	zstream->index_unavailable = FALSE;
+	zstream->stream_size = (uoff_t)-1;
+}
+
+struct istream *i_stream_create_framed(struct istream *input, bool log_errors)
+{
+	struct framed_istream *zstream;
+
+	zstream = i_new(struct framed_istream, 1);
+	zstream->stream_size = (uoff_t)-1;
+	zstream->frame_idx = UINT_MAX;
+	zstream->log_errors = log_errors;
+
+	zstream->istream.iostream.close = i_stream_framed_close;
+	zstream->istream.max_buffer_size = input->real_stream->max_buffer_size;
+	zstream->istream.read = i_stream_framed_read;
+	zstream->istream.seek = i_stream_framed_seek;
+	zstream->istream.stat = i_stream_framed_stat;
+	zstream->istream.sync = i_stream_framed_sync;
+
+	zstream->istream.istream.readable_fd = FALSE;
+	zstream->istream.istream.blocking = input->blocking;
+	zstream->istream.istream.seekable = input->seekable;
+	zstream->chunk_buf = buffer_create_dynamic(default_pool, 1024);
+
+	return i_stream_create(&zstream->istream, input,
+			       i_stream_get_fd(input));
+}
+#endif
@@ -0,0 +1,355 @@
+/* Copyright (c) 2016 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+
+#ifdef HAVE_ZSTD
+
+#include "istream-private.h"
+#include "istream-zlib.h"
+#include "iostream-zstd-private.h"
+
+#define CHUNK_SIZE (1024*64)
+
+struct zstd_istream {
+	struct istream_private istream;
+
+	ZSTD_DCtx *dctx;
+	uoff_t eof_offset, stream_size;
+	size_t high_pos;
+	struct stat last_parent_statbuf;
+
+	bool log_errors:1;
+	bool marked:1;
+	/* we're in the middle of a frame */
+	bool frame_started:1;
+};
+
+static void i_stream_zstd_close(struct iostream_private *stream,
+				bool close_parent)
+{
+	struct zstd_istream *zstream = (struct zstd_istream *)stream;
+
+	if (zstream->dctx != NULL) {
+		(void)ZSTD_freeDCtx(zstream->dctx);
+		zstream->dctx = NULL;
+	}
+	if (close_parent)
+		i_stream_close(zstream->istream.parent);
+}
+
+static void zstd_read_error(struct zstd_istream *zstream, const char *error)
+{
+	io_stream_set_error(&zstream->istream.iostream,
+			    "zstd.read(%s): %s at %"PRIuUOFF_T,
+			    i_stream_get_name(&zstream->istream.istream), error,
+			    i_stream_get_absolute_offset(&zstream->istream.istream));
+	if (zstream->log_errors)
+		i_error("%s", zstream->istream.iostream.error);
+}
+
+static void zstd_stream_end(struct zstd_istream *zstream)
+{
+	zstream->eof_offset = zstream->istream.istream.v_offset +
+		(zstream->istream.pos - zstream->istream.skip);
+	zstream->stream_size = zstream->eof_offset;
+}
+
+static ssize_t i_stream_zstd_read(struct istream_private *stream)
+{
+	struct zstd_istream *zstream = (struct zstd_istream *)stream;
+	const unsigned char *data;
+	ZSTD_inBuffer in;
+	ZSTD_outBuffer out;
+	uoff_t high_offset;
+	size_t size, ret;
+	bool parent_eof = FALSE;
+
+	high_offset = stream->istream.v_offset + (stream->pos - stream->skip);
+	if (zstream->eof_offset == high_offset) {
+		i_assert(zstream->high_pos == 0 ||
+			 zstream->high_pos == stream->pos);
+		stream->istream.eof = TRUE;
+		return -1;
+	}
+
+	if (stream->pos < zstream->high_pos) {
+		/* we're here because we seeked back within the read buffer. */
+		ret = zstream->high_pos - stream->pos;
+		stream->pos = zstream->high_pos;
+		zstream->high_pos = 0;
+
+		if (zstream->eof_offset != (uoff_t)-1) {
+			high_offset = stream->istream.v_offset +
+				(stream->pos - stream->skip);
+			i_assert(zstream->eof_offset == high_offset);
+			stream->istream.eof = TRUE;
+		}
+		return ret;
+	}
+	zstream->high_pos = 0;
+
+	if (stream->pos + CHUNK_SIZE > stream->buffer_size) {
+		/* try to keep at least CHUNK_SIZE available */
+		if (!zstream->marked && stream->skip > 0) {
+			/* don't try to keep anything cached if we don't
+			   have a seek mark. */
+			i_stream_compress(stream);
+		}
+		if (stream->buffer_size < i_stream_get_max_buffer_size(&stream->istream))
+			i_stream_grow_buffer(stream, CHUNK_SIZE);
+
+		if (stream->pos == stream->buffer_size) {
+			if (stream->skip > 0) {
+				/* lose our buffer cache */
+				i_stream_compress(stream);
+			}
+
+			if (stream->pos == stream->buffer_size)
+				return -2; /* buffer full */
+		}
+	}
+
+	if (i_stream_read_more(stream->parent, &data, &size) < 0) {
+		if (stream->parent->stream_errno != 0) {
+			stream->istream.stream_errno =
+				stream->parent->stream_errno;
+			return -1;
+		}
+		i_assert(stream->parent->eof);
+		if (!zstream->frame_started) {
+			zstd_stream_end(zstream);
+			stream->istream.eof = TRUE;
+			return -1;
+		}
+		/* the decompressor may still have buffered output */
+		parent_eof = TRUE;
+		data = NULL;
+		size = 0;
+	} else if (size == 0 && !zstream->frame_started) {
+		/* no more input */
+		i_assert(!stream->istream.blocking);
+		return 0;
+	}
+
+	in.src = data;
+	in.size = size;
+	in.pos = 0;
+	out.dst = stream->w_buffer + stream->pos;
+	out.size = stream->buffer_size - stream->pos;
+	out.pos = 0;
+	ret = ZSTD_decompressStream(zstream->dctx, &out, &in);
+
+	stream->pos += out.pos;
+	i_stream_skip(stream->parent, in.pos);
+
+	if (ZSTD_isError(ret)) {
+		switch (ZSTD_getErrorCode(ret)) {
+		case ZSTD_error_memory_allocation:
+			i_fatal_status(FATAL_OUTOFMEM,
+				       "zstd.read(%s): Out of memory",
+				       i_stream_get_name(&stream->istream));
+		case ZSTD_error_dictionary_wrong:
+			zstd_read_error(zstream,
+				"compressed with a different dictionary");
+			break;
+		default:
+			zstd_read_error(zstream, t_strdup_printf(
+				"corrupted data: %s", ZSTD_getErrorName(ret)));
+			break;
+		}
+		stream->istream.stream_errno = EINVAL;
+		return -1;
+	}
+	/* ret=0 means that the frame was fully decoded and flushed */
+	zstream->frame_started = ret != 0;
+
+	if (out.pos == 0) {
+		if (parent_eof) {
+			if (zstream->frame_started) {
+				zstd_read_error(zstream, "truncated zstd stream");
+				stream->istream.stream_errno = EINVAL;
+				return -1;
+			}
+			zstd_stream_end(zstream);
+			stream->istream.eof = TRUE;
+			return -1;
+		}
+		if (size == 0) {
+			/* no more input */
+			i_assert(!stream->istream.blocking);
+			return 0;
+		}
+		/* read more input */
+		return i_stream_zstd_read(stream);
+	}
+	return out.pos;
+}
+
+static void i_stream_zstd_init(struct zstd_istream *zstream)
+{
+	const ZSTD_DDict *ddict;
+
+	zstream->dctx = ZSTD_createDCtx();
+	if (zstream->dctx == NULL)
+		i_fatal_status(FATAL_OUTOFMEM, "zstd: Out of memory");
+	ddict = iostream_zstd_get_ddict();
+	if (ddict != NULL)
+		(void)ZSTD_DCtx_refDDict(zstream->dctx, ddict);
+}
+
+static void i_stream_zstd_reset(struct zstd_istream *zstream)
+{
+	struct istream_private *stream = &zstream->istream;
+
+	i_stream_seek(stream->parent, stream->parent_start_offset);
+	zstream->eof_offset = (uoff_t)-1;
+	zstream->frame_started = FALSE;
+
+	stream->parent_expected_offset = stream->parent_start_offset;
+	stream->skip = stream->pos = 0;
+	stream->istream.v_offset = 0;
+	zstream->high_pos = 0;
+
+	/* this keeps the dictionary */
+	(void)ZSTD_DCtx_reset(zstream->dctx, ZSTD_reset_session_only);
+}
+
+static void
+i_stream_zstd_seek(struct istream_private *stream, uoff_t v_offset, bool mark)
+{
+	struct zstd_istream *zstream = (struct zstd_istream *) stream;
+	uoff_t start_offset = stream->istream.v_offset - stream->skip;
+
+	if (v_offset < start_offset) {
+		/* have to seek backwards */
+		i_stream_zstd_reset(zstream);
+		start_offset = 0;
+	} else if (zstream->high_pos != 0) {
+		stream->pos = zstream->high_pos;
+		zstream->high_pos = 0;
+	}
+
+	if (v_offset <= start_offset + stream->pos) {
+		/* seeking backwards within what's already cached */
+		stream->skip = v_offset - start_offset;
+		stream->istream.v_offset = v_offset;
+		zstream->high_pos = stream->pos;
+		stream->pos = stream->skip;
+	} else {
+		/* read and cache forward */
+		ssize_t ret = -1;
+
+		do {
+			size_t avail = stream->pos - stream->skip;
+
+			if (stream->istream.v_offset + avail >= v_offset) {
+				i_stream_skip(&stream->istream,
+					      v_offset -
+					      stream->istream.v_offset);
+				break;
+			}
+
+			i_stream_skip(&stream->istream, avail);
+		} while ((ret = i_stream_read(&stream->istream)) > 0);
+		i_assert(ret == -1);
+
+		if (stream->istream.v_offset != v_offset) {
+			/* some failure, we've broken it */
+			if (stream->istream.stream_errno != 0) {
+				i_error("zstd_istream.seek(%s) failed: %s",
+					i_stream_get_name(&stream->istream),
+					strerror(stream->istream.stream_errno));
+				i_stream_close(&stream->istream);
+			} else {
+				/* unexpected EOF. allow it since we may just
+				   want to check if there's anything.. */
+				i_assert(stream->istream.eof);
+			}
+		}
+	}
+
+	if (mark)
+		zstream->marked = TRUE;
+}
+
+static int
+i_stream_zstd_stat(struct istream_private *stream, bool exact)
+{
+	struct zstd_istream *zstream = (struct zstd_istream *) stream;
+	const struct stat *st;
+	size_t size;
+
+	if (i_stream_stat(stream->parent, exact, &st) < 0) {
+		stream->istream.stream_errno = stream->parent->stream_errno;
+		return -1;
+	}
+	stream->statbuf = *st;
+
+	/* when exact=FALSE always return the parent stat's size, even if we
+	   know the exact value. this is necessary because otherwise e.g. mbox
+	   code can see two different values and think that a compressed mbox
+	   file keeps changing. */
+	if (!exact)
+		return 0;
+
+	if (zstream->stream_size == (uoff_t)-1) {
+		uoff_t old_offset = stream->istream.v_offset;
+		ssize_t ret;
+
+		do {
+			size = i_stream_get_data_size(&stream->istream);
+			i_stream_skip(&stream->istream, size);
+		} while ((ret = i_stream_read(&stream->istream)) > 0);
+		i_assert(ret == -1);
+
+		i_stream_seek(&stream->istream, old_offset);
+		if (zstream->stream_size == (uoff_t)-1)
+			return -1;
+	}
+	stream->statbuf.st_size = zstream->stream_size;
+	return 0;
+}
+
+static void i_stream_zstd_sync(struct istream_private *stream)
+{
+	struct zstd_istream *zstream = (struct zstd_istream *) stream;
+	const struct stat *st;
+
+	if (i_stream_stat(stream->parent, FALSE, &st) < 0) {
+		if (memcmp(&zstream->last_parent_statbuf,
+			   st, sizeof(*st)) == 0) {
+			/* a compressed file doesn't change unexpectedly,
+			   don't clear our caches unnecessarily */
+			return;
+		}
+		zstream->last_parent_statbuf = *st;
+	}
+	i_stream_zstd_reset(zstream);
+}
+
+struct istream *i_stream_create_zstd(struct istream *input, bool log_errors)
+{
+	struct zstd_istream *zstream;
+
+	zstream = i_new(struct zstd_istream, 1);
+	zstream->eof_offset = (uoff_t)-1;
+	zstream->stream_size = (uoff_t)-1;
+	zstream->log_errors = log_errors;
+
+	i_stream_zstd_init(zstream);
+
+	zstream->istream.iostream.close = i_stream_zstd_close;
+	zstream->istream.max_buffer_size = input->real_stream->max_buffer_size;
+	zstream->istream.read = i_stream_zstd_read;
+	zstream->istream.seek = i_stream_zstd_seek;
+	zstream->istream.stat = i_stream_zstd_stat;
+	zstream->istream.sync = i_stream_zstd_sync;
+
+	zstream->istream.istream.readable_fd = FALSE;
+	zstream->istream.istream.blocking = input->blocking;
+	zstream->istream.istream.seekable = input->seekable;
+
+	return i_stream_create(&zstream->istream, input,
+			       i_stream_get_fd(input));
+}
+#endif
@@ -0,0 +1,263 @@
+/* Copyright (c) 2016 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+
+#ifdef HAVE_ZLIB
+
+#include "buffer.h"
+#include "ostream-private.h"
+#include "ostream-zlib.h"
+#include "iostream-framed.h"
+#include <zlib.h>
+
+#define FRAME_SIZE OSTREAM_FRAMED_FRAME_SIZE
+/* compressBound() for FRAME_SIZE */
+#define FRAME_COMPRESSBOUND \
+	(FRAME_SIZE + (FRAME_SIZE >> 12) + (FRAME_SIZE >> 14) + \
+	 (FRAME_SIZE >> 25) + 13)
+
+struct framed_ostream {
+	struct ostream_private ostream;
+	int level;
+
+	unsigned char compressbuf[FRAME_SIZE];
+	unsigned int compressbuf_offset;
+
+	/* frame prefix, followed by compressed data */
+	unsigned char outbuf[sizeof(struct iostream_framed_frame_prefix) +
+			     FRAME_COMPRESSBOUND];
+	unsigned int outbuf_offset, outbuf_used;
+
+	/* copies of all the frame prefixes written so far */
+	buffer_t *index;
+	/* end of frames marker + index + footer, once we're finishing */
+	buffer_t *trailer;
+	size_t trailer_offset;
+
+	bool finished:1;
+};
+
+static void o_stream_framed_close(struct iostream_private *stream,
+				  bool close_parent)
+{
+	struct framed_ostream *zstream = (struct framed_ostream *)stream;
+
+	(void)o_stream_flush(&zstream->ostream.ostream);
+	if (zstream->index != NULL)
+		buffer_free(&zstream->index);
+	if (zstream->trailer != NULL)
+		buffer_free(&zstream->trailer);
+	if (close_parent)
+		o_stream_close(zstream->ostream.parent);
+}
+
+static int
+o_stream_framed_send_buf(struct framed_ostream *zstream,
+			 const unsigned char *data, size_t size,
+			 size_t *offset)
+{
+	ssize_t ret;
+
+	if (*offset == size)
+		return 1;
+
+	ret = o_stream_send(zstream->ostream.parent, data + *offset,
+			    size - *offset);
+	if (ret < 0) {
+		o_stream_copy_error_from_parent(&zstream->ostream);
+		return -1;
+	}
+	*offset += ret;
+	return *offset == size ? 1 : 0;
+}
+
+static int o_stream_framed_send_outbuf(struct framed_ostream *zstream)
+{
+	size_t offset = zstream->outbuf_offset;
+	int ret;
+
+	if (zstream->outbuf_used == 0)
+		return 1;
+
+	ret = o_stream_framed_send_buf(zstream, zstream->outbuf,
+				       zstream->outbuf_used, &offset);
+	zstream->outbuf_offset = offset;
+	if (ret > 0)
+		zstream->outbuf_offset = zstream->outbuf_used = 0;
+	return ret;
+}
+
+static int o_stream_framed_compress(struct framed_ostream *zstream)
+{
+	struct iostream_framed_frame_prefix *prefix;
+	uLongf dest_len;
+	int ret;
+
+	if (zstream->compressbuf_offset == 0)
+		return 1;
+	if ((ret = o_stream_framed_send_outbuf(zstream)) <= 0)
+		return ret;
+
+	i_assert(zstream->outbuf_offset == 0);
+	i_assert(zstream->outbuf_used == 0);
+
+	dest_len = sizeof(zstream->outbuf) - sizeof(*prefix);
+	ret = compress2(zstream->outbuf + sizeof(*prefix), &dest_len,
+			zstream->compressbuf, zstream->compressbuf_offset,
+			zstream->level);
+	switch (ret) {
+	case Z_OK:
+		break;
+	case Z_MEM_ERROR:
+		i_fatal_status(FATAL_OUTOFMEM, "framed.write(%s): Out of memory",
+			       o_stream_get_name(&zstream->ostream.ostream));
+	default:
+		i_panic("framed.write(%s): compress2() failed with %d",
+			o_stream_get_name(&zstream->ostream.ostream), ret);
+	}
+
+	prefix = (void *)zstream->outbuf;
+	iostream_framed_put_be32(prefix->compressed_size, dest_len);
+	iostream_framed_put_be32(prefix->uncompressed_size,
+				 zstream->compressbuf_offset);
+	buffer_append(zstream->index, prefix, sizeof(*prefix));
+
+	zstream->outbuf_used = sizeof(*prefix) + dest_len;
+	zstream->compressbuf_offset = 0;
+	return 1;
+}
+
+static void o_stream_framed_build_trailer(struct framed_ostream *zstream)
+{
+	struct iostream_framed_footer footer;
+	unsigned char end[4] = { 0, 0, 0, 0 };
+
+	zstream->trailer = buffer_create_dynamic(default_pool,
+		sizeof(end) + zstream->index->used + sizeof(footer));
+	buffer_append(zstream->trailer, end, sizeof(end));
+	buffer_append_buf(zstream->trailer, zstream->index, 0, (size_t)-1);
+	iostream_framed_put_be32(footer.frame_count,
+		zstream->index->used /
+		sizeof(struct iostream_framed_frame_prefix));
+	memcpy(footer.magic, IOSTREAM_FRAMED_FOOTER_MAGIC, sizeof(footer.magic));
+	buffer_append(zstream->trailer, &footer, sizeof(footer));
+}
+
+static int o_stream_framed_send_flush(struct framed_ostream *zstream)
+{
+	int ret;
+
+	/* the index is written at the end, so flushing finishes the
+	   stream. nothing can be written after it. */
+	if ((ret = o_stream_framed_compress(zstream)) <= 0)
+		return ret;
+	if ((ret = o_stream_framed_send_outbuf(zstream)) <= 0)
+		return ret;
+
+	if (!zstream->finished) {
+		o_stream_framed_build_trailer(zstream);
+		zstream->finished = TRUE;
+	}
+	return o_stream_framed_send_buf(zstream, zstream->trailer->data,
+					zstream->trailer->used,
+					&zstream->trailer_offset);
+}
+
+static ssize_t
+o_stream_framed_send_chunk(struct framed_ostream *zstream,
+			   const void *data, size_t size)
+{
+	size_t max_size;
+	ssize_t added_bytes = 0;
+	int ret;
+
+	i_assert(zstream->outbuf_used == 0);
+
+	do {
+		max_size = I_MIN(size, sizeof(zstream->compressbuf) -
+				 zstream->compressbuf_offset);
+		memcpy(zstream->compressbuf + zstream->compressbuf_offset,
+		       data, max_size);
+		zstream->compressbuf_offset += max_size;
+
+		data = CONST_PTR_OFFSET(data, max_size);
+		size -= max_size;
+		added_bytes += max_size;
+
+		if (zstream->compressbuf_offset == sizeof(zstream->compressbuf)) {
+			ret = o_stream_framed_compress(zstream);
+			if (ret <= 0)
+				return added_bytes != 0 ? added_bytes : ret;
+		}
+	} while (size > 0);
+
+	return added_bytes;
+}
+
+static int o_stream_framed_flush(struct ostream_private *stream)
+{
+	struct framed_ostream *zstream = (struct framed_ostream *)stream;
+	int ret;
+
+	if ((ret = o_stream_framed_send_flush(zstream)) <= 0)
+		return ret;
+
+	ret = o_stream_flush(stream->parent);
+	if (ret < 0)
+		o_stream_copy_error_from_parent(stream);
+	return ret;
+}
+
+static ssize_t
+o_stream_framed_sendv(struct ostream_private *stream,
+		      const struct const_iovec *iov, unsigned int iov_count)
+{
+	struct framed_ostream *zstream = (struct framed_ostream *)stream;
+	ssize_t ret, bytes = 0;
+	unsigned int i;
+
+	i_assert(!zstream->finished);
+
+	if ((ret = o_stream_framed_send_outbuf(zstream)) <= 0) {
+		/* error / we still couldn't flush existing data to
+		   parent stream. */
+		return ret;
+	}
+
+	for (i = 0; i < iov_count; i++) {
+		ret = o_stream_framed_send_chunk(zstream, iov[i].iov_base,
+						 iov[i].iov_len);
+		if (ret < 0)
+			return -1;
+		bytes += ret;
+		if ((size_t)ret != iov[i].iov_len)
+			break;
+	}
+	stream->ostream.offset += bytes;
+	return bytes;
+}
+
+struct ostream *o_stream_create_framed(struct ostream *output, int level)
+{
+	struct iostream_framed_header *hdr;
+	struct framed_ostream *zstream;
+
+	i_assert(level >= 1 && level <= 9);
+
+	zstream = i_new(struct framed_ostream, 1);
+	zstream->ostream.sendv = o_stream_framed_sendv;
+	zstream->ostream.flush = o_stream_framed_flush;
+	zstream->ostream.iostream.close = o_stream_framed_close;
+	zstream->level = level;
+	zstream->index = buffer_create_dynamic(default_pool, 256);
+
+	i_assert(sizeof(zstream->outbuf) >= sizeof(*hdr));
+	hdr = (void *)zstream->outbuf;
+	memcpy(hdr->magic, IOSTREAM_FRAMED_MAGIC, sizeof(hdr->magic));
+	iostream_framed_put_be32(hdr->max_uncompressed_frame_size,
+				 OSTREAM_FRAMED_FRAME_SIZE);
+	zstream->outbuf_used = sizeof(*hdr);
+	return o_stream_create(&zstream->ostream, output,
+			       o_stream_get_fd(output));
+}
+#endif
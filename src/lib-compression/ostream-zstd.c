@@ -0,0 +1,220 @@
+/* Copyright (c) 2016 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+
+#ifdef HAVE_ZSTD
+
+#include "ostream-private.h"
+#include "ostream-zlib.h"
+#include "iostream-zstd-private.h"
+
+#define CHUNK_SIZE (1024*64)
+
+struct zstd_ostream {
+	struct ostream_private ostream;
+	ZSTD_CCtx *cctx;
+
+	unsigned char outbuf[CHUNK_SIZE];
+	unsigned int outbuf_offset, outbuf_used;
+
+	bool flushed:1;
+};
+
+static void o_stream_zstd_close(struct iostream_private *stream,
+				bool close_parent)
+{
+	struct zstd_ostream *zstream = (struct zstd_ostream *)stream;
+
+	(void)o_stream_flush(&zstream->ostream.ostream);
+	if (zstream->cctx != NULL) {
+		(void)ZSTD_freeCCtx(zstream->cctx);
+		zstream->cctx = NULL;
+	}
+	if (close_parent)
+		o_stream_close(zstream->ostream.parent);
+}
+
+static void o_stream_zstd_check_error(struct zstd_ostream *zstream,
+				      size_t ret)
+{
+	if (!ZSTD_isError(ret))
+		return;
+	if (ZSTD_getErrorCode(ret) == ZSTD_error_memory_allocation) {
+		i_fatal_status(FATAL_OUTOFMEM, "zstd.write(%s): Out of memory",
+			       o_stream_get_name(&zstream->ostream.ostream));
+	}
+	i_panic("zstd.write(%s) failed: %s",
+		o_stream_get_name(&zstream->ostream.ostream),
+		ZSTD_getErrorName(ret));
+}
+
+static int o_stream_zstd_send_outbuf(struct zstd_ostream *zstream)
+{
+	ssize_t ret;
+	size_t size;
+
+	if (zstream->outbuf_used == 0)
+		return 1;
+
+	size = zstream->outbuf_used - zstream->outbuf_offset;
+	i_assert(size > 0);
+	ret = o_stream_send(zstream->ostream.parent,
+			    zstream->outbuf + zstream->outbuf_offset, size);
+	if (ret < 0) {
+		o_stream_copy_error_from_parent(&zstream->ostream);
+		return -1;
+	}
+	if ((size_t)ret != size) {
+		zstream->outbuf_offset += ret;
+		return 0;
+	}
+	zstream->outbuf_offset = 0;
+	zstream->outbuf_used = 0;
+	return 1;
+}
+
+static ssize_t
+o_stream_zstd_send_chunk(struct zstd_ostream *zstream,
+			 const void *data, size_t size)
+{
+	ZSTD_inBuffer in;
+	ZSTD_outBuffer out;
+	int ret;
+
+	i_assert(zstream->outbuf_used == 0);
+
+	in.src = data;
+	in.size = size;
+	in.pos = 0;
+	while (in.pos < in.size) {
+		out.dst = zstream->outbuf;
+		out.size = sizeof(zstream->outbuf);
+		out.pos = 0;
+		o_stream_zstd_check_error(zstream,
+			ZSTD_compressStream2(zstream->cctx, &out, &in,
+					     ZSTD_e_continue));
+		if (out.pos == 0)
+			continue;
+
+		zstream->outbuf_used = out.pos;
+		if ((ret = o_stream_zstd_send_outbuf(zstream)) < 0)
+			return -1;
+		if (ret == 0) {
+			/* parent stream's buffer full */
+			break;
+		}
+	}
+
+	zstream->flushed = FALSE;
+	return in.pos;
+}
+
+/* Returns 1 if the frame end has been written to parent, 0 if parent is
+   full, -1 on error. */
+static int o_stream_zstd_send_flush(struct zstd_ostream *zstream)
+{
+	ZSTD_inBuffer in = { NULL, 0, 0 };
+	ZSTD_outBuffer out;
+	size_t remaining;
+	int ret;
+
+	if (zstream->flushed)
+		return 1;
+
+	if ((ret = o_stream_flush_parent_if_needed(&zstream->ostream)) <= 0)
+		return ret;
+	if ((ret = o_stream_zstd_send_outbuf(zstream)) <= 0)
+		return ret;
+
+	/* end the current frame. if more data is written after this, it
+	   goes to a new frame. */
+	i_assert(zstream->outbuf_used == 0);
+	do {
+		out.dst = zstream->outbuf;
+		out.size = sizeof(zstream->outbuf);
+		out.pos = 0;
+		remaining = ZSTD_compressStream2(zstream->cctx, &out, &in,
+						 ZSTD_e_end);
+		o_stream_zstd_check_error(zstream, remaining);
+
+		zstream->outbuf_used = out.pos;
+		if ((ret = o_stream_zstd_send_outbuf(zstream)) <= 0)
+			return ret;
+	} while (remaining > 0);
+
+	zstream->flushed = TRUE;
+	return 1;
+}
+
+static int o_stream_zstd_flush(struct ostream_private *stream)
+{
+	struct zstd_ostream *zstream = (struct zstd_ostream *)stream;
+	int ret;
+
+	/* don't report success until the whole frame end is written */
+	if ((ret = o_stream_zstd_send_flush(zstream)) <= 0)
+		return ret;
+
+	ret = o_stream_flush(stream->parent);
+	if (ret < 0)
+		o_stream_copy_error_from_parent(stream);
+	return ret;
+}
+
+static ssize_t
+o_stream_zstd_sendv(struct ostream_private *stream,
+		    const struct const_iovec *iov, unsigned int iov_count)
+{
+	struct zstd_ostream *zstream = (struct zstd_ostream *)stream;
+	ssize_t ret, bytes = 0;
+	unsigned int i;
+
+	if ((ret = o_stream_zstd_send_outbuf(zstream)) <= 0) {
+		/* error / we still couldn't flush existing data to
+		   parent stream. */
+		return ret;
+	}
+
+	for (i = 0; i < iov_count; i++) {
+		ret = o_stream_zstd_send_chunk(zstream, iov[i].iov_base,
+					       iov[i].iov_len);
+		if (ret < 0)
+			return -1;
+		bytes += ret;
+		if ((size_t)ret != iov[i].iov_len)
+			break;
+	}
+	stream->ostream.offset += bytes;
+	return bytes;
+}
+
+struct ostream *o_stream_create_zstd(struct ostream *output, int level)
+{
+	struct zstd_ostream *zstream;
+	const ZSTD_CDict *cdict;
+
+	i_assert(level >= 1 && level <= ZSTD_maxCLevel());
+
+	zstream = i_new(struct zstd_ostream, 1);
+	zstream->ostream.sendv = o_stream_zstd_sendv;
+	zstream->ostream.flush = o_stream_zstd_flush;
+	zstream->ostream.iostream.close = o_stream_zstd_close;
+
+	zstream->cctx = ZSTD_createCCtx();
+	if (zstream->cctx == NULL)
+		i_fatal_status(FATAL_OUTOFMEM, "zstd: Out of memory");
+	o_stream_zstd_check_error(zstream,
+		ZSTD_CCtx_setParameter(zstream->cctx,
+				       ZSTD_c_compressionLevel, level));
+	o_stream_zstd_check_error(zstream,
+		ZSTD_CCtx_setParameter(zstream->cctx,
+				       ZSTD_c_checksumFlag, 1));
+	cdict = iostream_zstd_get_cdict(level);
+	if (cdict != NULL) {
+		o_stream_zstd_check_error(zstream,
+			ZSTD_CCtx_refCDict(zstream->cctx, cdict));
+	}
+	return o_stream_create(&zstream->ostream, output,
+			       o_stream_get_fd(output));
+}
+#endif
@@ -2,12 +2,16 @@
 
 #include "lib.h"
 #include "buffer.h"
+#include "str.h"
+#include "ioloop.h"
 #include "istream.h"
 #include "ostream.h"
 #include "sha1.h"
 #include "randgen.h"
 #include "test-common.h"
 #include "compression.h"
+#include "iostream-zstd.h"
+#include "iostream-framed.h"
 
 #include <unistd.h>
 #include <fcntl.h>
@@ -159,6 +163,368 @@ static void test_gz_no_concat(void)
 	test_end();
 }
 
+static buffer_t *
+test_zstd_compress(const struct compression_handler *zstd,
+		   const char *str1, const char *str2)
+{
+	struct ostream *buf_output, *output;
+	buffer_t *buf = buffer_create_dynamic(pool_datastack_create(), 512);
+
+	buf_output = o_stream_create_buffer(buf);
+	output = zstd->create_ostream(buf_output, 3);
+	o_stream_nsend_str(output, str1);
+	if (str2 != NULL) {
+		/* flushing ends the frame, so this writes two frames */
+		test_assert(o_stream_nfinish(output) == 0);
+		o_stream_nsend_str(output, str2);
+	}
+	test_assert(o_stream_nfinish(output) == 0);
+	o_stream_destroy(&output);
+	o_stream_destroy(&buf_output);
+	return buf;
+}
+
+static int
+test_zstd_uncompress(const struct compression_handler *zstd,
+		     const buffer_t *buf, size_t size, string_t *str)
+{
+	struct istream *test_input, *input;
+	const unsigned char *data;
+	size_t i, data_size;
+	int ret;
+
+	/* feed the input one byte at a time */
+	test_input = test_istream_create_data(buf->data, size);
+	test_istream_set_allow_eof(test_input, FALSE);
+	input = zstd->create_istream(test_input, FALSE);
+	for (i = 0, ret = 0; i <= size && ret >= 0; i++) {
+		test_istream_set_size(test_input, i);
+		ret = i_stream_read(input);
+	}
+	if (ret >= 0) {
+		test_istream_set_allow_eof(test_input, TRUE);
+		while ((ret = i_stream_read(input)) > 0) ;
+	}
+	test_assert(ret == -1);
+
+	data = i_stream_get_data(input, &data_size);
+	str_append_n(str, data, data_size);
+	ret = input->stream_errno == 0 ? 0 : -1;
+
+	/* seeking back must give the same data */
+	i_stream_seek(input, 0);
+	if (ret == 0 && data_size > 0) {
+		test_assert(i_stream_read_bytes(input, &data, &i,
+						data_size) > 0);
+		test_assert(memcmp(data, str_data(str), data_size) == 0);
+	}
+	i_stream_unref(&input);
+	i_stream_unref(&test_input);
+	return ret;
+}
+
+static void test_zstd(void)
+{
+	const struct compression_handler *zstd =
+		compression_lookup_handler("zstd");
+	const char *str1 = "hello world, hello world, hello world";
+	const char *dict =
+		"Subject: hello world\r\nFrom: user@example.com\r\n";
+	string_t *str = t_str_new(128);
+	buffer_t *buf;
+	size_t nodict_size;
+
+	if (zstd == NULL || zstd->create_ostream == NULL)
+		return; /* not compiled in */
+
+	test_begin("zstd");
+	/* two frames */
+	buf = test_zstd_compress(zstd, str1, "second frame");
+	test_assert(test_zstd_uncompress(zstd, buf, buf->used, str) == 0);
+	test_assert(strcmp(str_c(str), t_strconcat(str1, "second frame", NULL)) == 0);
+
+	/* truncated input is an error */
+	buf = test_zstd_compress(zstd, str1, NULL);
+	str_truncate(str, 0);
+	test_assert(test_zstd_uncompress(zstd, buf, buf->used-1, str) < 0);
+
+	buf = test_zstd_compress(zstd, "Subject: hello world\r\n", NULL);
+	nodict_size = buf->used;
+
+	/* dictionary */
+	iostream_zstd_set_dictionary(dict, strlen(dict));
+	buf = test_zstd_compress(zstd, "Subject: hello world\r\n", NULL);
+	str_truncate(str, 0);
+	test_assert(test_zstd_uncompress(zstd, buf, buf->used, str) == 0);
+	test_assert(strcmp(str_c(str), "Subject: hello world\r\n") == 0);
+	test_assert(buf->used < nodict_size);
+
+	/* reading fails without the dictionary */
+	iostream_zstd_set_dictionary(NULL, 0);
+	str_truncate(str, 0);
+	test_assert(test_zstd_uncompress(zstd, buf, buf->used, str) < 0);
+	test_end();
+}
+
+static void test_zstd_flush_full_parent(void)
+{
+	const struct compression_handler *zstd =
+		compression_lookup_handler("zstd");
+	struct ioloop *ioloop;
+	struct ostream *test_output, *output;
+	string_t *str = t_str_new(128);
+	buffer_t *buf;
+
+	if (zstd == NULL || zstd->create_ostream == NULL)
+		return; /* not compiled in */
+
+	test_begin("zstd flush with full parent");
+	ioloop = io_loop_create();
+	buf = buffer_create_dynamic(pool_datastack_create(), 512);
+	test_output = test_ostream_create_nonblocking(buf, 0);
+	output = zstd->create_ostream(test_output, 3);
+	test_assert(o_stream_send_str(output, "hello world") > 0);
+
+	/* the frame end can't be written while the parent is full */
+	test_ostream_set_max_output_size(test_output, buf->used);
+	test_assert(o_stream_flush(output) == 0);
+	test_assert(o_stream_flush(output) == 0);
+
+	test_ostream_set_max_output_size(test_output, (size_t)-1);
+	test_assert(o_stream_flush(output) == 1);
+	test_assert(test_zstd_uncompress(zstd, buf, buf->used, str) == 0);
+	test_assert(strcmp(str_c(str), "hello world") == 0);
+
+	o_stream_destroy(&output);
+	o_stream_destroy(&test_output);
+	io_loop_destroy(&ioloop);
+	test_end();
+}
+
+static void test_framed_seek_verify(struct istream *input, uoff_t offset,
+				    size_t size)
+{
+	const unsigned char *data;
+	size_t i, data_size;
+
+	i_stream_seek(input, offset);
+	if (i_stream_read_bytes(input, &data, &data_size, size) <= 0) {
+		test_assert(FALSE);
+		return;
+	}
+	for (i = 0; i < size; i++) {
+		if (data[i] != (unsigned char)((offset + i) % 251)) {
+			test_assert(FALSE);
+			break;
+		}
+	}
+}
+
+static void test_framed_truncated_header(void)
+{
+	const struct compression_handler *handler =
+		compression_lookup_handler("framed");
+	struct ostream *buf_output, *output;
+	struct istream *test_input, *input;
+	buffer_t *buf;
+	size_t size;
+
+	if (handler == NULL || handler->create_ostream == NULL)
+		return; /* not compiled in */
+
+	test_begin("framed truncated header");
+	buf = buffer_create_dynamic(pool_datastack_create(), 128);
+	buf_output = o_stream_create_buffer(buf);
+	output = handler->create_ostream(buf_output, 6);
+	o_stream_nsend_str(output, "hello");
+	test_assert(o_stream_nfinish(output) == 0);
+	o_stream_destroy(&output);
+	o_stream_destroy(&buf_output);
+
+	/* empty input is just EOF */
+	test_input = test_istream_create_data(buf->data, 0);
+	input = handler->create_istream(test_input, FALSE);
+	test_assert(i_stream_read(input) == -1 && input->stream_errno == 0);
+	i_stream_unref(&input);
+	i_stream_unref(&test_input);
+
+	/* EOF in the middle of the header is an error */
+	for (size = 1; size < sizeof(struct iostream_framed_header); size++) {
+		test_input = test_istream_create_data(buf->data, size);
+		input = handler->create_istream(test_input, FALSE);
+		test_assert_idx(i_stream_read(input) == -1 &&
+				input->stream_errno == EPIPE, size);
+		i_stream_unref(&input);
+		i_stream_unref(&test_input);
+	}
+	test_end();
+}
+
+static void test_framed_seek(void)
+{
+	const struct compression_handler *handler =
+		compression_lookup_handler("framed");
+	const char *path = "test-compression-framed.tmp";
+	struct ostream *file_output, *output;
+	struct istream *file_input, *input;
+	unsigned char buf[1024];
+	struct stat st;
+	uoff_t offset, total_size = 1024*1024;
+	unsigned int i;
+	int fd;
+
+	if (handler == NULL || handler->create_ostream == NULL)
+		return; /* not compiled in */
+
+	test_begin("framed seek");
+	fd = open(path, O_TRUNC | O_CREAT | O_RDWR, 0600);
+	if (fd == -1)
+		i_fatal("creat(%s) failed: %m", path);
+	file_output = o_stream_create_fd_file(fd, 0, FALSE);
+	output = handler->create_ostream(file_output, 6);
+	for (offset = 0; offset < total_size; offset += sizeof(buf)) {
+		for (i = 0; i < sizeof(buf); i++)
+			buf[i] = (offset + i) % 251;
+		o_stream_nsend(output, buf, sizeof(buf));
+	}
+	test_assert(o_stream_nfinish(output) == 0);
+	o_stream_destroy(&output);
+	o_stream_destroy(&file_output);
+
+	/* random access using the index */
+	file_input = i_stream_create_fd(fd, IO_BLOCK_SIZE);
+	input = handler->create_istream(file_input, FALSE);
+	test_assert(i_stream_get_size(input, TRUE, &offset) > 0 &&
+		    offset == total_size);
+	for (i = 0; i < 100; i++) {
+		offset = rand() % (total_size - 100);
+		test_framed_seek_verify(input, offset, 100);
+	}
+	test_framed_seek_verify(input, total_size - 1, 1);
+	test_framed_seek_verify(input, 0, 100);
+	i_stream_seek(input, total_size);
+	test_assert(i_stream_read(input) == -1 && input->stream_errno == 0);
+	i_stream_destroy(&input);
+	i_stream_destroy(&file_input);
+
+	/* without the footer the index can't be used, but seeking
+	   still works by reading the frames */
+	if (fstat(fd, &st) < 0)
+		i_fatal("fstat(%s) failed: %m", path);
+	if (ftruncate(fd, st.st_size - 1) < 0)
+		i_fatal("ftruncate(%s) failed: %m", path);
+	file_input = i_stream_create_fd(fd, IO_BLOCK_SIZE);
+	input = handler->create_istream(file_input, FALSE);
+	test_framed_seek_verify(input, total_size - 200, 100);
+	test_framed_seek_verify(input, 100, 100);
+	test_assert(i_stream_get_size(input, TRUE, &offset) > 0 &&
+		    offset == total_size);
+	i_stream_destroy(&input);
+	i_stream_destroy(&file_input);
+
+	/* truncated frames are an error */
+	if (ftruncate(fd, st.st_size / 2) < 0)
+		i_fatal("ftruncate(%s) failed: %m", path);
+	file_input = i_stream_create_fd(fd, IO_BLOCK_SIZE);
+	input = handler->create_istream(file_input, FALSE);
+	test_expect_errors(1);
+	i_stream_seek(input, total_size - 1);
+	test_assert(i_stream_read(input) == -1 &&
+		    input->stream_errno == EINVAL);
+	i_stream_destroy(&input);
+	i_stream_destroy(&file_input);
+
+	i_unlink(path);
+	i_close_fd(&fd);
+	test_end();
+}
+
+static void
+test_framed_index_modify(int fd, unsigned int idx, int32_t diff)
+{
+	struct iostream_framed_footer footer;
+	struct iostream_framed_frame_prefix prefix;
+	struct stat st;
+	off_t offset;
+	uint32_t size;
+
+	if (fstat(fd, &st) < 0)
+		i_fatal("fstat() failed: %m");
+	if (pread(fd, &footer, sizeof(footer),
+		  st.st_size - sizeof(footer)) != sizeof(footer))
+		i_fatal("pread() failed: %m");
+	offset = st.st_size - sizeof(footer) -
+		(iostream_framed_get_be32(footer.frame_count) - idx) *
+		sizeof(prefix);
+	if (pread(fd, &prefix, sizeof(prefix), offset) != sizeof(prefix))
+		i_fatal("pread() failed: %m");
+	size = iostream_framed_get_be32(prefix.uncompressed_size) + diff;
+	iostream_framed_put_be32(prefix.uncompressed_size, size);
+	if (pwrite(fd, &prefix, sizeof(prefix), offset) != sizeof(prefix))
+		i_fatal("pwrite() failed: %m");
+}
+
+static void test_framed_index_corrupted(void)
+{
+	const struct compression_handler *handler =
+		compression_lookup_handler("framed");
+	const char *path = "test-compression-framed.tmp";
+	struct ostream *file_output, *output;
+	struct istream *file_input, *input;
+	unsigned char buf[1024];
+	uoff_t offset, total_size = 4*OSTREAM_FRAMED_FRAME_SIZE - sizeof(buf);
+	unsigned int i;
+	int fd;
+
+	if (handler == NULL || handler->create_ostream == NULL)
+		return; /* not compiled in */
+
+	test_begin("framed corrupted index");
+	fd = open(path, O_TRUNC | O_CREAT | O_RDWR, 0600);
+	if (fd == -1)
+		i_fatal("creat(%s) failed: %m", path);
+	file_output = o_stream_create_fd_file(fd, 0, FALSE);
+	output = handler->create_ostream(file_output, 6);
+	for (offset = 0; offset < total_size; offset += sizeof(buf)) {
+		for (i = 0; i < sizeof(buf); i++)
+			buf[i] = (offset + i) % 251;
+		o_stream_nsend(output, buf, sizeof(buf));
+	}
+	test_assert(o_stream_nfinish(output) == 0);
+	o_stream_destroy(&output);
+	o_stream_destroy(&file_output);
+
+	/* a zero-sized index entry makes the index unusable. seeking falls
+	   back to reading the frames. */
+	test_framed_index_modify(fd, 1, -OSTREAM_FRAMED_FRAME_SIZE);
+	file_input = i_stream_create_fd(fd, IO_BLOCK_SIZE);
+	input = handler->create_istream(file_input, FALSE);
+	test_framed_seek_verify(input, total_size - 200, 100);
+	test_framed_seek_verify(input, OSTREAM_FRAMED_FRAME_SIZE + 100, 100);
+	i_stream_destroy(&input);
+	i_stream_destroy(&file_input);
+
+	/* per-frame sizes that don't match the frames are an error, even
+	   when the total size is right */
+	test_framed_index_modify(fd, 1, OSTREAM_FRAMED_FRAME_SIZE);
+	test_framed_index_modify(fd, 2, -1);
+	test_framed_index_modify(fd, 3, 1);
+	file_input = i_stream_create_fd(fd, IO_BLOCK_SIZE);
+	input = handler->create_istream(file_input, FALSE);
+	test_assert(i_stream_get_size(input, TRUE, &offset) > 0 &&
+		    offset == total_size);
+	test_expect_errors(1);
+	i_stream_seek(input, 2*OSTREAM_FRAMED_FRAME_SIZE + 100);
+	test_assert(i_stream_read(input) == -1 &&
+		    input->stream_errno == EINVAL);
+	i_stream_destroy(&input);
+	i_stream_destroy(&file_input);
+
+	i_unlink(path);
+	i_close_fd(&fd);
+	test_end();
+}
+
 static void test_uncompress_file(const char *path)
 {
 	const struct compression_handler *handler;
@@ -249,6 +615,11 @@ int main(int argc, char *argv[])
 		test_compression,
 		test_gz_concat,
 		test_gz_no_concat,
+		test_zstd,
+		test_zstd_flush_full_parent,
+		test_framed_truncated_header,
+		test_framed_seek,
+		test_framed_index_corrupted,
 		NULL
 	};
 	if (argc == 2) {
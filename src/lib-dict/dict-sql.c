@@ -2,6 +2,7 @@
 
 #include "lib.h"
 #include "array.h"
+#include "hash.h"
 #include "istream.h"
 #include "hex-binary.h"
 #include "str.h"
@@ -30,9 +31,22 @@ struct sql_dict {
 	const char *username;
 	const struct dict_sql_settings *set;
 
+	/* query template => prepared statement */
+	HASH_TABLE(char *, struct sql_prepared_statement *) prep_stmt_hash;
+
 	bool has_on_duplicate_key:1;
 };
 
+struct sql_dict_param {
+	enum dict_sql_type value_type;
+
+	const char *value_str;
+	int64_t value_int64;
+	const void *value_binary;
+	size_t value_binary_size;
+};
+ARRAY_DEFINE_TYPE(sql_dict_param, struct sql_dict_param);
+
 struct sql_dict_iterate_context {
 	struct dict_iterate_context ctx;
 	pool_t pool;
@@ -100,14 +114,31 @@ sql_dict_init(struct dict *driver, const char *uri,
 
 	dict->db = sql_db_cache_new(dict_sql_db_cache, driver->name,
 				    dict->set->connect);
+	hash_table_create(&dict->prep_stmt_hash, dict->pool, 0,
+			  str_hash, strcmp);
 	*dict_r = &dict->dict;
 	return 0;
 }
 
+static void sql_dict_prep_stmts_free(struct sql_dict *dict)
+{
+	struct hash_iterate_context *iter;
+	struct sql_prepared_statement *prep_stmt;
+	char *query;
+
+	iter = hash_table_iterate_init(dict->prep_stmt_hash);
+	while (hash_table_iterate(iter, dict->prep_stmt_hash,
+				  &query, &prep_stmt))
+		sql_prepared_statement_deinit(&prep_stmt);
+	hash_table_iterate_deinit(&iter);
+	hash_table_destroy(&dict->prep_stmt_hash);
+}
+
 static void sql_dict_deinit(struct dict *_dict)
 {
 	struct sql_dict *dict = (struct sql_dict *)_dict;
 
+	sql_dict_prep_stmts_free(dict);
 	sql_deinit(&dict->db);
 	pool_unref(&dict->pool);
 }
@@ -212,20 +243,81 @@ sql_dict_find_map(struct sql_dict *dict, const char *path,
 	return NULL;
 }
 
+static struct sql_statement *
+sql_dict_statement_init(struct sql_dict *dict, const char *query,
+			const ARRAY_TYPE(sql_dict_param) *params)
+{
+	struct sql_prepared_statement *prep_stmt;
+	struct sql_statement *stmt;
+	const struct sql_dict_param *param;
+	unsigned int idx;
+
+	prep_stmt = hash_table_lookup(dict->prep_stmt_hash, query);
+	if (prep_stmt == NULL) {
+		prep_stmt = sql_prepared_statement_init(dict->db, query);
+		hash_table_insert(dict->prep_stmt_hash,
+				  p_strdup(dict->pool, query), prep_stmt);
+	}
+
+	stmt = sql_statement_init_prepared(prep_stmt);
+	array_foreach(params, param) {
+		idx = array_foreach_idx(params, param);
+		switch (param->value_type) {
+		case DICT_SQL_TYPE_STRING:
+			sql_statement_bind_str(stmt, idx, param->value_str);
+			break;
+		case DICT_SQL_TYPE_UINT:
+			sql_statement_bind_int64(stmt, idx, param->value_int64);
+			break;
+		case DICT_SQL_TYPE_HEXBLOB:
+			sql_statement_bind_binary(stmt, idx,
+						  param->value_binary,
+						  param->value_binary_size);
+			break;
+		}
+	}
+	return stmt;
+}
+
+static void
+sql_dict_param_add_int64(string_t *str, ARRAY_TYPE(sql_dict_param) *params,
+			 int64_t value)
+{
+	struct sql_dict_param *param;
+
+	str_append_c(str, '?');
+	param = array_append_space(params);
+	param->value_type = DICT_SQL_TYPE_UINT;
+	param->value_int64 = value;
+}
+
+static void
+sql_dict_param_add_str(string_t *str, ARRAY_TYPE(sql_dict_param) *params,
+		       const char *value)
+{
+	struct sql_dict_param *param;
+
+	str_append_c(str, '?');
+	param = array_append_space(params);
+	param->value_type = DICT_SQL_TYPE_STRING;
+	param->value_str = value;
+}
+
 static int
-sql_dict_value_escape(string_t *str, struct sql_dict *dict,
-		      const struct dict_sql_map *map,
-		      enum dict_sql_type value_type, const char *field_name,
-		      const char *value, const char *value_suffix,
-		      const char **error_r)
+sql_dict_value_get(string_t *str, ARRAY_TYPE(sql_dict_param) *params,
+		   const struct dict_sql_map *map,
+		   enum dict_sql_type value_type, const char *field_name,
+		   const char *value, const char *value_suffix,
+		   const char **error_r)
 {
+	struct sql_dict_param *param;
 	buffer_t *buf;
 	unsigned int num;
 
 	switch (value_type) {
 	case DICT_SQL_TYPE_STRING:
-		str_printfa(str, "'%s%s'", sql_escape_string(dict->db, value),
-			    value_suffix);
+		sql_dict_param_add_str(str, params,
+				       t_strconcat(value, value_suffix, NULL));
 		return 0;
 	case DICT_SQL_TYPE_UINT:
 		if (value_suffix[0] != '\0' || str_to_uint(value, &num) < 0) {
@@ -234,7 +326,7 @@ sql_dict_value_escape(string_t *str, struct sql_dict *dict,
 				field_name, value, value_suffix, map->pattern);
 			return -1;
 		}
-		str_printfa(str, "%u", num);
+		sql_dict_param_add_int64(str, params, num);
 		return 0;
 	case DICT_SQL_TYPE_HEXBLOB:
 		break;
@@ -249,26 +341,31 @@ sql_dict_value_escape(string_t *str, struct sql_dict *dict,
 		return -1;
 	}
 	str_append(buf, value_suffix);
-	str_append(str, sql_escape_blob(dict->db, buf->data, buf->used));
+	str_append_c(str, '?');
+	param = array_append_space(params);
+	param->value_type = DICT_SQL_TYPE_HEXBLOB;
+	param->value_binary = buf->data;
+	param->value_binary_size = buf->used;
 	return 0;
 }
 
 static int
-sql_dict_field_escape_value(string_t *str, struct sql_dict *dict,
-			    const struct dict_sql_map *map,
-			    const struct dict_sql_field *field,
-			    const char *value, const char *value_suffix,
-			    const char **error_r)
+sql_dict_field_get_value(string_t *str, ARRAY_TYPE(sql_dict_param) *params,
+			 const struct dict_sql_map *map,
+			 const struct dict_sql_field *field,
+			 const char *value, const char *value_suffix,
+			 const char **error_r)
 {
-	return sql_dict_value_escape(str, dict, map, field->value_type,
-				     field->name, value, value_suffix, error_r);
+	return sql_dict_value_get(str, params, map, field->value_type,
+				  field->name, value, value_suffix, error_r);
 }
 
 static int
 sql_dict_where_build(struct sql_dict *dict, const struct dict_sql_map *map,
 		     const ARRAY_TYPE(const_string) *values_arr,
 		     char key1, enum sql_recurse_type recurse_type,
-		     string_t *query, const char **error_r)
+		     string_t *query, ARRAY_TYPE(sql_dict_param) *params,
+		     const char **error_r)
 {
 	const struct dict_sql_field *sql_fields;
 	const char *const *values;
@@ -292,8 +389,8 @@ sql_dict_where_build(struct sql_dict *dict, const struct dict_sql_map *map,
 		if (i > 0)
 			str_append(query, " AND");
 		str_printfa(query, " %s = ", sql_fields[i].name);
-		if (sql_dict_field_escape_value(query, dict, map, &sql_fields[i],
-						values[i], "", error_r) < 0)
+		if (sql_dict_field_get_value(query, params, map, &sql_fields[i],
+					     values[i], "", error_r) < 0)
 			return -1;
 	}
 	switch (recurse_type) {
@@ -304,12 +401,14 @@ sql_dict_where_build(struct sql_dict *dict, const struct dict_sql_map *map,
 			str_append(query, " AND");
 		if (i < count2) {
 			str_printfa(query, " %s LIKE ", sql_fields[i].name);
-			if (sql_dict_field_escape_value(query, dict, map, &sql_fields[i],
-							values[i], "/%", error_r) < 0)
+			if (sql_dict_field_get_value(query, params, map,
+						&sql_fields[i], values[i],
+						"/%", error_r) < 0)
 				return -1;
 			str_printfa(query, " AND %s NOT LIKE ", sql_fields[i].name);
-			if (sql_dict_field_escape_value(query, dict, map, &sql_fields[i],
-							values[i], "/%/%", error_r) < 0)
+			if (sql_dict_field_get_value(query, params, map,
+						&sql_fields[i], values[i],
+						"/%/%", error_r) < 0)
 				return -1;
 		} else {
 			str_printfa(query, " %s LIKE '%%' AND "
@@ -323,8 +422,9 @@ sql_dict_where_build(struct sql_dict *dict, const struct dict_sql_map *map,
 				str_append(query, " AND");
 			str_printfa(query, " %s LIKE ",
 				    sql_fields[i].name);
-			if (sql_dict_field_escape_value(query, dict, map, &sql_fields[i],
-							values[i], "/%", error_r) < 0)
+			if (sql_dict_field_get_value(query, params, map,
+						&sql_fields[i], values[i],
+						"/%", error_r) < 0)
 				return -1;
 		}
 		break;
@@ -332,19 +432,21 @@ sql_dict_where_build(struct sql_dict *dict, const struct dict_sql_map *map,
 	if (priv) {
 		if (count2 > 0)
 			str_append(query, " AND");
-		str_printfa(query, " %s = '%s'", map->username_field,
-			    sql_escape_string(dict->db, dict->username));
+		str_printfa(query, " %s = ", map->username_field);
+		sql_dict_param_add_str(query, params, dict->username);
 	}
 	return 0;
 }
 
 static int
 sql_lookup_get_query(struct sql_dict *dict, const char *key,
-		     string_t *query, const struct dict_sql_map **map_r,
-		     const char **error_r)
+		     const struct dict_sql_map **map_r,
+		     struct sql_statement **stmt_r, const char **error_r)
 {
 	const struct dict_sql_map *map;
 	ARRAY_TYPE(const_string) values;
+	ARRAY_TYPE(sql_dict_param) params;
+	string_t *query = t_str_new(256);
 	const char *error;
 
 	map = *map_r = sql_dict_find_map(dict, key, &values);
@@ -355,12 +457,15 @@ sql_lookup_get_query(struct sql_dict *dict, const char *key,
 	}
 	str_printfa(query, "SELECT %s FROM %s",
 		    map->value_field, map->table);
+	t_array_init(&params, 4);
 	if (sql_dict_where_build(dict, map, &values, key[0],
-				 SQL_DICT_RECURSE_NONE, query, &error) < 0) {
+				 SQL_DICT_RECURSE_NONE, query, &params,
+				 &error) < 0) {
 		*error_r = t_strdup_printf(
 			"sql dict lookup: Failed to lookup key %s: %s", key, error);
 		return -1;
 	}
+	*stmt_r = sql_dict_statement_init(dict, str_c(query), &params);
 	return 0;
 }
 
@@ -425,16 +530,16 @@ static int sql_dict_lookup(struct dict *_dict, pool_t pool, const char *key,
 {
 	struct sql_dict *dict = (struct sql_dict *)_dict;
 	const struct dict_sql_map *map;
+	struct sql_statement *stmt;
 	struct sql_result *result = NULL;
-	string_t *query = t_str_new(256);
 	int ret;
 
 	*value_r = NULL;
 
-	if (sql_lookup_get_query(dict, key, query, &map, error_r) < 0)
+	if (sql_lookup_get_query(dict, key, &map, &stmt, error_r) < 0)
 		return -1;
 
-	result = sql_query_s(dict->db, str_c(query));
+	result = sql_statement_query_s(&stmt);
 	ret = sql_result_next_row(result);
 	if (ret < 0) {
 		*error_r = t_strdup_printf("dict sql lookup failed: %s",
@@ -485,10 +590,10 @@ sql_dict_lookup_async(struct dict *_dict, const char *key,
 	struct sql_dict *dict = (struct sql_dict *)_dict;
 	const struct dict_sql_map *map;
 	struct sql_dict_lookup_context *ctx;
-	string_t *query = t_str_new(256);
+	struct sql_statement *stmt;
 	const char *error;
 
-	if (sql_lookup_get_query(dict, key, query, &map, &error) < 0) {
+	if (sql_lookup_get_query(dict, key, &map, &stmt, &error) < 0) {
 		struct dict_lookup_result result;
 
 		memset(&result, 0, sizeof(result));
@@ -500,8 +605,7 @@ sql_dict_lookup_async(struct dict *_dict, const char *key,
 		ctx->callback = callback;
 		ctx->context = context;
 		ctx->map = map;
-		sql_query(dict->db, str_c(query),
-			  sql_dict_lookup_async_callback, ctx);
+		sql_statement_query(&stmt, sql_dict_lookup_async_callback, ctx);
 	}
 }
 
@@ -540,13 +644,16 @@ sql_dict_iterate_find_next_map(struct sql_dict_iterate_context *ctx,
 
 static int
 sql_dict_iterate_build_next_query(struct sql_dict_iterate_context *ctx,
-				  string_t *query, const char **error_r)
+				  struct sql_statement **stmt_r,
+				  const char **error_r)
 {
 	struct sql_dict *dict = (struct sql_dict *)ctx->ctx.dict;
 	const struct dict_sql_map *map;
 	ARRAY_TYPE(const_string) values;
+	ARRAY_TYPE(sql_dict_param) params;
 	const struct dict_sql_field *sql_fields;
 	enum sql_recurse_type recurse_type;
+	string_t *query = t_str_new(256);
 	unsigned int i, count;
 
 	map = sql_dict_iterate_find_next_map(ctx, &values);
@@ -586,9 +693,10 @@ sql_dict_iterate_build_next_query(struct sql_dict_iterate_context *ctx,
 		recurse_type = SQL_DICT_RECURSE_NONE;
 	else
 		recurse_type = SQL_DICT_RECURSE_ONE;
+	t_array_init(&params, 4);
 	if (sql_dict_where_build(dict, map, &values,
 				 ctx->paths[ctx->path_idx][0],
-				 recurse_type, query, error_r) < 0)
+				 recurse_type, query, &params, error_r) < 0)
 		return -1;
 
 	if ((ctx->flags & DICT_ITERATE_FLAG_SORT_BY_KEY) != 0) {
@@ -603,10 +711,12 @@ sql_dict_iterate_build_next_query(struct sql_dict_iterate_context *ctx,
 
 	if (ctx->ctx.max_rows > 0) {
 		i_assert(ctx->ctx.row_count < ctx->ctx.max_rows);
-		str_printfa(query, " LIMIT %llu",
-			(unsigned long long)(ctx->ctx.max_rows - ctx->ctx.row_count));
+		str_append(query, " LIMIT ");
+		sql_dict_param_add_int64(query, &params,
+			ctx->ctx.max_rows - ctx->ctx.row_count);
 	}
 
+	*stmt_r = sql_dict_statement_init(dict, str_c(query), &params);
 	ctx->map = map;
 	return 1;
 }
@@ -622,25 +732,25 @@ static void sql_dict_iterate_callback(struct sql_result *result,
 
 static int sql_dict_iterate_next_query(struct sql_dict_iterate_context *ctx)
 {
-	struct sql_dict *dict = (struct sql_dict *)ctx->ctx.dict;
-	string_t *query = t_str_new(256);
+	struct sql_statement *stmt;
 	const char *error;
 	unsigned int path_idx = ctx->path_idx;
 	int ret;
 
-	ret = sql_dict_iterate_build_next_query(ctx, query, &error);
-	if (ret <= 0) {
+	ret = sql_dict_iterate_build_next_query(ctx, &stmt, &error);
+	if (ret == 0 && ctx->map != NULL) {
+		/* no more maps */
+	} else if (ret <= 0) {
 		/* failed */
 		ctx->error = p_strdup_printf(ctx->pool,
 			"sql dict iterate failed for %s: %s",
 			ctx->paths[path_idx], error);
 	} else if ((ctx->flags & DICT_ITERATE_FLAG_ASYNC) == 0) {
-		ctx->result = sql_query_s(dict->db, str_c(query));
+		ctx->result = sql_statement_query_s(&stmt);
 	} else {
 		i_assert(ctx->result == NULL);
 		ctx->synchronous_result = TRUE;
-		sql_query(dict->db, str_c(query),
-			  sql_dict_iterate_callback, ctx);
+		sql_statement_query(&stmt, sql_dict_iterate_callback, ctx);
 		ctx->synchronous_result = FALSE;
 	}
 	return ret;
@@ -877,7 +987,9 @@ static void sql_dict_transaction_rollback(struct dict_transaction_context *_ctx)
 
 struct dict_sql_build_query_field {
 	const struct dict_sql_map *map;
+	/* value to set, or with increments the diff */
 	const char *value;
+	long long diff;
 };
 
 struct dict_sql_build_query {
@@ -890,18 +1002,23 @@ struct dict_sql_build_query {
 };
 
 static int sql_dict_set_query(const struct dict_sql_build_query *build,
-			      const char **query_r, const char **error_r)
+			      struct sql_statement **stmt_r,
+			      const char **error_r)
 {
 	struct sql_dict *dict = build->dict;
 	const struct dict_sql_build_query_field *fields;
 	const struct dict_sql_field *sql_fields;
 	const char *const *extra_values;
 	unsigned int i, field_count, count, count2;
+	ARRAY_TYPE(sql_dict_param) params, suffix_params;
 	string_t *prefix, *suffix;
 
 	fields = array_get(&build->fields, &field_count);
 	i_assert(field_count > 0);
 
+	/* the VALUES in suffix come after all the prefix's parameters */
+	t_array_init(&params, 4);
+	t_array_init(&suffix_params, 4);
 	prefix = t_str_new(64);
 	suffix = t_str_new(256);
 	str_printfa(prefix, "INSERT INTO %s (", fields[0].map->table);
@@ -912,21 +1029,22 @@ static int sql_dict_set_query(const struct dict_sql_build_query *build,
 			str_append_c(suffix, ',');
 		}
 		str_append(prefix, fields[i].map->value_field);
-		if (build->inc)
-			str_append(suffix, fields[i].value);
-		else {
+		if (build->inc) {
+			sql_dict_param_add_int64(suffix, &suffix_params,
+						 fields[i].diff);
+		} else {
 			enum dict_sql_type value_type =
 				sql_dict_map_type(fields[i].map);
-			if (sql_dict_value_escape(suffix, dict, fields[i].map,
-				value_type, "value", fields[i].value,
-				"", error_r) < 0)
+			if (sql_dict_value_get(suffix, &suffix_params,
+				fields[i].map, value_type, "value",
+				fields[i].value, "", error_r) < 0)
 				return -1;
 		}
 	}
 	if (build->key1 == DICT_PATH_PRIVATE[0]) {
 		str_printfa(prefix, ",%s", fields[0].map->username_field);
-		str_printfa(suffix, ",'%s'",
-			    sql_escape_string(dict->db, dict->username));
+		str_append_c(suffix, ',');
+		sql_dict_param_add_str(suffix, &suffix_params, dict->username);
 	}
 
 	/* add the other fields from the key */
@@ -936,15 +1054,17 @@ static int sql_dict_set_query(const struct dict_sql_build_query *build,
 	for (i = 0; i < count; i++) {
 		str_printfa(prefix, ",%s", sql_fields[i].name);
 		str_append_c(suffix, ',');
-		if (sql_dict_field_escape_value(suffix, dict, fields[0].map, &sql_fields[i],
-						extra_values[i], "", error_r) < 0)
+		if (sql_dict_field_get_value(suffix, &suffix_params,
+					     fields[0].map, &sql_fields[i],
+					     extra_values[i], "", error_r) < 0)
 			return -1;
 	}
 
 	str_append_str(prefix, suffix);
 	str_append_c(prefix, ')');
+	array_append_array(&params, &suffix_params);
 	if (!dict->has_on_duplicate_key) {
-		*query_r = str_c(prefix);
+		*stmt_r = sql_dict_statement_init(dict, str_c(prefix), &params);
 		return 0;
 	}
 
@@ -955,28 +1075,29 @@ static int sql_dict_set_query(const struct dict_sql_build_query *build,
 		str_append(prefix, fields[i].map->value_field);
 		str_append_c(prefix, '=');
 		if (build->inc) {
-			str_printfa(prefix, "%s+%s",
-				    fields[i].map->value_field,
-				    fields[i].value);
+			str_printfa(prefix, "%s+", fields[i].map->value_field);
+			sql_dict_param_add_int64(prefix, &params,
+						 fields[i].diff);
 		} else {
 			enum dict_sql_type value_type =
 				sql_dict_map_type(fields[i].map);
-			if (sql_dict_value_escape(prefix, dict, fields[i].map,
+			if (sql_dict_value_get(prefix, &params, fields[i].map,
 				value_type, "value", fields[i].value,
 				"", error_r) < 0)
 				return -1;
 		}
 	}
-	*query_r = str_c(prefix);
+	*stmt_r = sql_dict_statement_init(dict, str_c(prefix), &params);
 	return 0;
 }
 
 static int
 sql_dict_update_query(const struct dict_sql_build_query *build,
-		      const char **query_r, const char **error_r)
+		      struct sql_statement **stmt_r, const char **error_r)
 {
 	struct sql_dict *dict = build->dict;
 	const struct dict_sql_build_query_field *fields;
+	ARRAY_TYPE(sql_dict_param) params;
 	unsigned int i, field_count;
 	string_t *query;
 
@@ -985,22 +1106,22 @@ sql_dict_update_query(const struct dict_sql_build_query *build,
 	fields = array_get(&build->fields, &field_count);
 	i_assert(field_count > 0);
 
+	t_array_init(&params, 4);
 	query = t_str_new(64);
 	str_printfa(query, "UPDATE %s SET ", fields[0].map->table);
 	for (i = 0; i < field_count; i++) {
 		if (i > 0)
 			str_append_c(query, ',');
-		str_printfa(query, "%s=%s", fields[i].map->value_field,
+		str_printfa(query, "%s=%s+", fields[i].map->value_field,
 			    fields[i].map->value_field);
-		if (fields[i].value[0] != '-')
-			str_append_c(query, '+');
-		str_append(query, fields[i].value);
+		sql_dict_param_add_int64(query, &params, fields[i].diff);
 	}
 
 	if (sql_dict_where_build(dict, fields[0].map, build->extra_values,
-				 build->key1, SQL_DICT_RECURSE_NONE, query, error_r) < 0)
+				 build->key1, SQL_DICT_RECURSE_NONE, query,
+				 &params, error_r) < 0)
 		return -1;
-	*query_r = str_c(query);
+	*stmt_r = sql_dict_statement_init(dict, str_c(query), &params);
 	return 0;
 }
 
@@ -1014,7 +1135,8 @@ static void sql_dict_set(struct dict_transaction_context *_ctx,
 	ARRAY_TYPE(const_string) values;
 	struct dict_sql_build_query build;
 	struct dict_sql_build_query_field field;
-	const char *query, *error;
+	struct sql_statement *stmt;
+	const char *error;
 
 	if (ctx->error != NULL)
 		return;
@@ -1029,6 +1151,7 @@ static void sql_dict_set(struct dict_transaction_context *_ctx,
 	if (ctx->prev_inc_map != NULL)
 		sql_dict_prev_inc_flush(ctx);
 
+	memset(&field, 0, sizeof(field));
 	field.map = map;
 	field.value = value;
 
@@ -1039,11 +1162,11 @@ static void sql_dict_set(struct dict_transaction_context *_ctx,
 	build.extra_values = &values;
 	build.key1 = key[0];
 
-	if (sql_dict_set_query(&build, &query, &error) < 0) {
+	if (sql_dict_set_query(&build, &stmt, &error) < 0) {
 		ctx->error = i_strdup_printf("dict-sql: Failed to set %s=%s: %s",
 					     key, value, error);
 	} else {
-		sql_update(ctx->sql_ctx, query);
+		sql_update_stmt(ctx->sql_ctx, &stmt);
 	}
 }
 
@@ -1055,7 +1178,9 @@ static void sql_dict_unset(struct dict_transaction_context *_ctx,
 	struct sql_dict *dict = (struct sql_dict *)_ctx->dict;
 	const struct dict_sql_map *map;
 	ARRAY_TYPE(const_string) values;
+	ARRAY_TYPE(sql_dict_param) params;
 	string_t *query = t_str_new(256);
+	struct sql_statement *stmt;
 	const char *error;
 
 	if (ctx->error != NULL)
@@ -1071,12 +1196,15 @@ static void sql_dict_unset(struct dict_transaction_context *_ctx,
 	}
 
 	str_printfa(query, "DELETE FROM %s", map->table);
+	t_array_init(&params, 4);
 	if (sql_dict_where_build(dict, map, &values, key[0],
-				 SQL_DICT_RECURSE_NONE, query, &error) < 0) {
+				 SQL_DICT_RECURSE_NONE, query, &params,
+				 &error) < 0) {
 		ctx->error = i_strdup_printf(
 			"dict-sql: Failed to delete %s: %s", key, error);
 	} else {
-		sql_update(ctx->sql_ctx, str_c(query));
+		stmt = sql_dict_statement_init(dict, str_c(query), &params);
+		sql_update_stmt(ctx->sql_ctx, &stmt);
 	}
 }
 
@@ -1104,7 +1232,8 @@ static void sql_dict_atomic_inc_real(struct sql_dict_transaction_context *ctx,
 	ARRAY_TYPE(const_string) values;
 	struct dict_sql_build_query build;
 	struct dict_sql_build_query_field field;
-	const char *query, *error;
+	struct sql_statement *stmt;
+	const char *error;
 
 	if (ctx->error != NULL)
 		return;
@@ -1112,8 +1241,9 @@ static void sql_dict_atomic_inc_real(struct sql_dict_transaction_context *ctx,
 	map = sql_dict_find_map(dict, key, &values);
 	i_assert(map != NULL);
 
+	memset(&field, 0, sizeof(field));
 	field.map = map;
-	field.value = t_strdup_printf("%lld", diff);
+	field.diff = diff;
 
 	memset(&build, 0, sizeof(build));
 	build.dict = dict;
@@ -1123,12 +1253,12 @@ static void sql_dict_atomic_inc_real(struct sql_dict_transaction_context *ctx,
 	build.key1 = key[0];
 	build.inc = TRUE;
 
-	if (sql_dict_update_query(&build, &query, &error) < 0) {
+	if (sql_dict_update_query(&build, &stmt, &error) < 0) {
 		ctx->error = i_strdup_printf(
 			"dict-sql: Failed to increase %s: %s", key, error);
 	} else {
-		sql_update_get_rows(ctx->sql_ctx, query,
-				    sql_dict_next_inc_row(ctx));
+		sql_update_stmt_get_rows(ctx->sql_ctx, &stmt,
+					 sql_dict_next_inc_row(ctx));
 	}
 }
 
@@ -1210,7 +1340,8 @@ static void sql_dict_atomic_inc(struct dict_transaction_context *_ctx,
 	} else {
 		struct dict_sql_build_query build;
 		struct dict_sql_build_query_field *field;
-		const char *query, *error;
+		struct sql_statement *stmt;
+		const char *error;
 
 		memset(&build, 0, sizeof(build));
 		build.dict = dict;
@@ -1221,17 +1352,17 @@ static void sql_dict_atomic_inc(struct dict_transaction_context *_ctx,
 
 		field = array_append_space(&build.fields);
 		field->map = ctx->prev_inc_map;
-		field->value = t_strdup_printf("%lld", ctx->prev_inc_diff);
+		field->diff = ctx->prev_inc_diff;
 		field = array_append_space(&build.fields);
 		field->map = map;
-		field->value = t_strdup_printf("%lld", diff);
+		field->diff = diff;
 
-		if (sql_dict_update_query(&build, &query, &error) < 0) {
+		if (sql_dict_update_query(&build, &stmt, &error) < 0) {
 			ctx->error = i_strdup_printf(
 				"dict-sql: Failed to increase %s: %s", key, error);
 		} else {
-			sql_update_get_rows(ctx->sql_ctx, query,
-					    sql_dict_next_inc_row(ctx));
+			sql_update_stmt_get_rows(ctx->sql_ctx, &stmt,
+						 sql_dict_next_inc_row(ctx));
 		}
 
 		i_free_and_null(ctx->prev_inc_key);
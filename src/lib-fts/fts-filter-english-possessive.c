@@ -1,6 +1,7 @@
 /* Copyright (c) 2015-2016 Dovecot authors, see the included COPYING file */
 
 #include "lib.h"
+#include "str.h"
 #include "unichar.h"
 #include "fts-common.h"
 #include "fts-filter-private.h"
@@ -19,7 +20,7 @@ static unichar_t get_ending_utf8_char(const char *str, unsigned int *end_pos)
 }
 
 static int
-fts_filter_english_possessive_filter(struct fts_filter *filter ATTR_UNUSED,
+fts_filter_english_possessive_filter(struct fts_filter *filter,
 				     const char **token,
 				     const char **error_r ATTR_UNUSED)
 {
@@ -29,8 +30,13 @@ fts_filter_english_possessive_filter(struct fts_filter *filter ATTR_UNUSED,
 	if (len > 1 && ((*token)[len-1] == 's' || (*token)[len-1] == 'S')) {
 		len -= 2;
 		c = get_ending_utf8_char(*token, &len);
-		if (IS_APOSTROPHE(c))
-			*token = t_strndup(*token, len);
+		if (IS_APOSTROPHE(c)) {
+			if (filter->token == NULL)
+				filter->token = str_new(default_pool, 64);
+			str_truncate(filter->token, 0);
+			str_append_n(filter->token, *token, len);
+			*token = str_c(filter->token);
+		}
 	}
 	return 1;
 }
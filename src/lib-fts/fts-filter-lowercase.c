@@ -43,19 +43,47 @@ fts_filter_lowercase_create(const struct fts_language *lang ATTR_UNUSED,
 	return 0;
 }
 
+/* Returns TRUE if the token is ASCII-only and has no uppercase letters, so
+   lowercasing wouldn't change it. */
+static bool fts_filter_lowercase_is_ascii_lcase(const char *token, size_t *len_r)
+{
+	const unsigned char *p = (const unsigned char *)token;
+
+	for (; *p != '\0'; p++) {
+		if (*p >= 0x80 || (*p >= 'A' && *p <= 'Z'))
+			return FALSE;
+	}
+	*len_r = p - (const unsigned char *)token;
+	return TRUE;
+}
+
 static int
-fts_filter_lowercase_filter(struct fts_filter *filter ATTR_UNUSED,
+fts_filter_lowercase_filter(struct fts_filter *filter,
                             const char **token,
                             const char **error_r ATTR_UNUSED)
 {
+	size_t len;
+
+	if (fts_filter_lowercase_is_ascii_lcase(*token, &len)) {
+		/* nothing to change - avoid copying the token */
 #ifdef HAVE_LIBICU
+		if (len > filter->max_length) {
+			str_truncate(filter->token, 0);
+			str_append_n(filter->token, *token, filter->max_length);
+			*token = str_c(filter->token);
+		}
+#endif
+		return 1;
+	}
 	str_truncate(filter->token, 0);
+#ifdef HAVE_LIBICU
 	fts_icu_lcase(filter->token, *token);
 	fts_filter_truncate_token(filter->token, filter->max_length);
-	*token = str_c(filter->token);
 #else
-	*token = t_str_lcase(*token);
+	str_append(filter->token, *token);
+	str_lcase(str_c_modifiable(filter->token));
 #endif
+	*token = str_c(filter->token);
 	return 1;
 }
 
@@ -1,6 +1,7 @@
 /* Copyright (c) 2014-2016 Dovecot authors, see the included COPYING file */
 
 #include "lib.h"
+#include "str.h"
 #include "fts-language.h"
 #include "fts-filter-private.h"
 
@@ -47,6 +48,7 @@ fts_filter_stemmer_snowball_create(const struct fts_language *lang,
 	sp->filter = *fts_filter_stemmer_snowball;
 	sp->lang = p_malloc(sp->pool, sizeof(struct fts_language));
 	sp->lang->name = p_strdup(sp->pool, lang->name);
+	sp->filter.token = str_new(sp->pool, 64);
 	*filter_r = &sp->filter;
 	return 0;
 }
@@ -87,7 +89,9 @@ fts_filter_stemmer_snowball_filter(struct fts_filter *filter,
 			       "sb_stemmer_stem(len=%"PRIuSIZE_T") failed: "
 			       "Out of memory", strlen(*token));
 	}
-	*token = t_strndup(base, sb_stemmer_length(sp->stemmer));
+	str_truncate(filter->token, 0);
+	str_append_n(filter->token, base, sb_stemmer_length(sp->stemmer));
+	*token = str_c(filter->token);
 	return 1;
 }
 
@@ -63,7 +63,9 @@ void fts_filter_unref(struct fts_filter **filter);
 
 /* Returns 1 if token is returned in *token, 0 if token was filtered
    out (*token is also set to NULL) and -1 on error.
-   Input is also given via *token.
+   Input is also given via *token. The returned token may point to the input
+   token or to the filter's internal buffer, so it's valid only until the
+   next call to the filter or the tokenizer.
 */
 int fts_filter_filter(struct fts_filter *filter, const char **token,
 		      const char **error_r);
@@ -122,7 +122,9 @@ fts_tokenizer_address_parent_data(struct email_address_fts_tokenizer *tok,
 			return FALSE;
 	}
 
-	*token_r = t_strdup(str_c(tok->parent_data));
+	/* the caller copies the token to the parent tokenizer's input
+	   before we're called again, so it doesn't need to be duplicated */
+	*token_r = str_c(tok->parent_data);
 	str_truncate(tok->parent_data, 0);
 	return TRUE;
 }
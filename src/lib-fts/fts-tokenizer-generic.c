@@ -27,6 +27,24 @@ static unsigned char fts_ascii_word_breaks[128] = {
 	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 0  /* 112-127: {|}~ */
 };
 
+/* letter_type() lookups for ASCII characters, filled by
+   fts_ascii_letter_types_init() */
+static enum letter_type fts_ascii_letter_types[128];
+static bool fts_ascii_letter_types_initialized = FALSE;
+
+static enum letter_type letter_type(unichar_t c);
+
+static void fts_ascii_letter_types_init(void)
+{
+	unichar_t c;
+
+	if (fts_ascii_letter_types_initialized)
+		return;
+	for (c = 0; c < N_ELEMENTS(fts_ascii_letter_types); c++)
+		fts_ascii_letter_types[c] = letter_type(c);
+	fts_ascii_letter_types_initialized = TRUE;
+}
+
 static int
 fts_tokenizer_generic_create(const char *const *settings,
 			     struct fts_tokenizer **tokenizer_r,
@@ -78,9 +96,10 @@ fts_tokenizer_generic_create(const char *const *settings,
 	}
 
 	tok = i_new(struct generic_fts_tokenizer, 1);
-	if (algo == BOUNDARY_ALGORITHM_TR29)
+	if (algo == BOUNDARY_ALGORITHM_TR29) {
+		fts_ascii_letter_types_init();
 		tok->tokenizer.v = &generic_tokenizer_vfuncs_tr29;
-	else
+	} else
 		tok->tokenizer.v = &generic_tokenizer_vfuncs_simple;
 	tok->max_length = max_length;
 	tok->algorithm = algo;
@@ -101,6 +120,17 @@ fts_tokenizer_generic_destroy(struct fts_tokenizer *_tok)
 	i_free(tok);
 }
 
+/* Returns the first len bytes of the token buffer as a NUL-terminated
+   string. The token is returned directly from the buffer, so it's valid only
+   until the next call to the tokenizer. */
+static const char *
+fts_tokenizer_generic_token_str(struct generic_fts_tokenizer *tok, size_t len)
+{
+	buffer_set_used_size(tok->token, len);
+	buffer_append_c(tok->token, '\0');
+	return tok->token->data;
+}
+
 static bool
 fts_tokenizer_generic_simple_current_token(struct generic_fts_tokenizer *tok,
                                            const char **token_r)
@@ -125,7 +155,7 @@ fts_tokenizer_generic_simple_current_token(struct generic_fts_tokenizer *tok,
 	i_assert(len <= tok->max_length);
 
 	*token_r = len == 0 ? "" :
-		t_strndup(tok->token->data, len);
+		fts_tokenizer_generic_token_str(tok, len);
 	buffer_set_used_size(tok->token, 0);
 	tok->untruncated_length = 0;
 	tok->prev_letter = LETTER_TYPE_NONE;
@@ -184,6 +214,11 @@ static void fts_tokenizer_generic_reset(struct fts_tokenizer *_tok)
 	buffer_set_used_size(tok->token, 0);
 }
 
+static inline bool fts_ascii_is_word_char(unsigned char c)
+{
+	return c < 0x80 && fts_ascii_word_breaks[c] == 0 && c != '\'';
+}
+
 static void tok_append_truncated(struct generic_fts_tokenizer *tok,
 				 const unsigned char *data, size_t size)
 {
@@ -206,8 +241,23 @@ fts_tokenizer_generic_simple_next(struct fts_tokenizer *_tok,
 	bool apostrophe;
 
 	for (i = 0; i < size; i += char_size) {
-		char_size = uni_utf8_get_char_n(data + i, size - i, &c);
-		i_assert(char_size > 0);
+		if (fts_ascii_is_word_char(data[i])) {
+			/* ASCII fast path: find the end of the word
+			   without decoding it one character at a time. */
+			char_size = 1;
+			while (i + char_size < size &&
+			       fts_ascii_is_word_char(data[i + char_size]))
+				char_size++;
+			tok->prev_letter = LETTER_TYPE_NONE;
+			continue;
+		}
+		if (data[i] < 0x80) {
+			c = data[i];
+			char_size = 1;
+		} else {
+			char_size = uni_utf8_get_char_n(data + i, size - i, &c);
+			i_assert(char_size > 0);
+		}
 
 		apostrophe = IS_APOSTROPHE(c);
 		if (fts_simple_is_word_break(tok, c, apostrophe)) {
@@ -579,7 +629,7 @@ fts_tokenizer_generic_tr29_current_token(struct generic_fts_tokenizer *tok,
 
 	tok->prev_prev_letter = LETTER_TYPE_NONE;
 	tok->prev_letter = LETTER_TYPE_NONE;
-	*token_r = t_strndup(data, len);
+	*token_r = fts_tokenizer_generic_token_str(tok, len);
 	buffer_set_used_size(tok->token, 0);
 	tok->untruncated_length = 0;
 }
@@ -661,10 +711,28 @@ fts_tokenizer_generic_tr29_next(struct fts_tokenizer *_tok,
 
 	for (i = 0; i < size; ) {
 		char_start_i = i;
-		char_size = uni_utf8_get_char_n(data + i, size - i, &c);
-		i_assert(char_size > 0);
+		if (data[i] < 0x80) {
+			c = data[i];
+			char_size = 1;
+			lt = fts_ascii_letter_types[c];
+		} else {
+			char_size = uni_utf8_get_char_n(data + i, size - i, &c);
+			i_assert(char_size > 0);
+			lt = letter_type(c);
+		}
 		i += char_size;
-		lt = letter_type(c);
+
+		if (lt == LETTER_TYPE_ALETTER &&
+		    tok->prev_letter == LETTER_TYPE_ALETTER && !tok->wb5a) {
+			/* WB5: no break between letters. Skip the rest of
+			   the ASCII letters in the word at once. */
+			while (i < size && data[i] < 0x80 &&
+			       fts_ascii_letter_types[data[i]] ==
+			       LETTER_TYPE_ALETTER)
+				i++;
+			tok->prev_prev_letter = LETTER_TYPE_ALETTER;
+			continue;
+		}
 
 		/* The WB5a break is detected only when the "after
 		   break" char is inspected. That char needs to be
@@ -73,7 +73,10 @@ void fts_tokenizer_reset(struct fts_tokenizer *tok);
 
    data must contain only valid complete UTF-8 sequences, but otherwise it
    may be broken into however small pieces. (Input to this function typically
-   comes from message-decoder, which returns only complete UTF-8 sequences.) */
+   comes from message-decoder, which returns only complete UTF-8 sequences.)
+
+   The returned token may point to the tokenizer's internal buffer, so it's
+   valid only until the next call to the tokenizer. */
 
 int fts_tokenizer_next(struct fts_tokenizer *tok,
 		       const unsigned char *data, size_t size,
@@ -0,0 +1,490 @@
+/* Copyright (c) 2016 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "buffer.h"
+#include "str.h"
+#include "strfuncs.h"
+#include "unichar.h"
+#include "read-full.h"
+#include "time-util.h"
+#include "fts-language.h"
+#include "fts-tokenizer.h"
+#include "fts-filter.h"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+/* Measures the cost of tokenizer and filter chains over a corpus of text
+   files, so that the language settings can be chosen based on the
+   measured throughput. Usage:
+
+   test-fts-bench [-l <lang>] [-t <tokenizers>] [-f <filters>]
+		  [-d <stopwords dir>] [-n <iterations>] <corpus dir>
+
+   Tokenizers and filters are given in the same order as in the fts_tokenizers
+   and fts_filters settings. Each one may have its settings appended after a
+   ':' as comma-separated key=value pairs, for example:
+
+   -t "generic:algorithm=tr29 email-address" -f "lowercase stopwords snowball"
+
+   The tokenizer chain is timed as one stage. Each filter is then timed as its
+   own stage over the tokens that passed the previous filters. */
+
+struct bench_file {
+	char *path;
+	unsigned char *data;
+	size_t size;
+};
+
+struct bench_stage {
+	const char *name;
+	struct fts_filter *filter;
+
+	long long usecs;
+	unsigned long long tokens_in, tokens_out;
+	unsigned long long heap_allocs, stack_allocs;
+};
+
+static ARRAY(struct bench_file) files;
+static ARRAY(struct bench_stage) stages;
+static unsigned long long corpus_size = 0;
+
+/* default_pool wrapper counting the heap allocations */
+static pool_t bench_parent_pool;
+static struct pool bench_pool;
+static struct pool_vfuncs bench_pool_vfuncs;
+static unsigned long long bench_heap_allocs = 0;
+
+static void *bench_pool_malloc(pool_t pool ATTR_UNUSED, size_t size)
+{
+	bench_heap_allocs++;
+	return bench_parent_pool->v->malloc(bench_parent_pool, size);
+}
+
+static void *bench_pool_realloc(pool_t pool ATTR_UNUSED, void *mem,
+				size_t old_size, size_t new_size)
+{
+	bench_heap_allocs++;
+	return bench_parent_pool->v->realloc(bench_parent_pool, mem,
+					     old_size, new_size);
+}
+
+static void bench_pool_init(void)
+{
+	bench_parent_pool = default_pool;
+	bench_pool_vfuncs = *bench_parent_pool->v;
+	bench_pool_vfuncs.malloc = bench_pool_malloc;
+	bench_pool_vfuncs.realloc = bench_pool_realloc;
+	bench_pool = *bench_parent_pool;
+	bench_pool.v = &bench_pool_vfuncs;
+	default_pool = &bench_pool;
+}
+
+static void bench_pool_deinit(void)
+{
+	default_pool = bench_parent_pool;
+}
+
+static unsigned long long bench_stack_allocs(void)
+{
+#ifdef DEBUG
+	return data_stack_get_alloc_count();
+#else
+	/* counted only with --enable-devel-checks */
+	return 0;
+#endif
+}
+
+static void bench_stage_begin(struct bench_stage *stage,
+			      struct timeval *tv_start_r)
+{
+	stage->heap_allocs -= bench_heap_allocs;
+	stage->stack_allocs -= bench_stack_allocs();
+	if (gettimeofday(tv_start_r, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
+}
+
+static void bench_stage_end(struct bench_stage *stage,
+			    const struct timeval *tv_start)
+{
+	struct timeval tv_end;
+
+	if (gettimeofday(&tv_end, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
+	stage->usecs += timeval_diff_usecs(&tv_end, tv_start);
+	stage->heap_allocs += bench_heap_allocs;
+	stage->stack_allocs += bench_stack_allocs();
+}
+
+static const char *const *
+bench_parse_settings(const char *spec, const char **name_r)
+{
+	const char *p = strchr(spec, ':');
+
+	if (p == NULL) {
+		*name_r = spec;
+		return NULL;
+	}
+	*name_r = t_strdup_until(spec, p);
+	return (const char *const *)t_strsplit(p + 1, ",=");
+}
+
+static void bench_read_file(const char *path)
+{
+	struct bench_file *file;
+	struct stat st;
+	buffer_t *buf;
+	void *data;
+	int fd, ret;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		i_fatal("open(%s) failed: %m", path);
+	if (fstat(fd, &st) < 0)
+		i_fatal("fstat(%s) failed: %m", path);
+	if (!S_ISREG(st.st_mode) || st.st_size == 0) {
+		i_close_fd(&fd);
+		return;
+	}
+	data = i_malloc(st.st_size);
+	ret = read_full(fd, data, st.st_size);
+	if (ret < 0)
+		i_fatal("read(%s) failed: %m", path);
+	if (ret == 0)
+		i_fatal("read(%s) failed: Unexpected EOF", path);
+	i_close_fd(&fd);
+
+	file = array_append_space(&files);
+	file->path = i_strdup(path);
+	file->data = data;
+	file->size = st.st_size;
+
+	/* tokenizers require valid UTF-8 input */
+	buf = buffer_create_dynamic(default_pool, file->size);
+	if (uni_utf8_get_valid_data(file->data, file->size, buf)) {
+		buffer_free(&buf);
+	} else {
+		i_free(data);
+		file->size = buf->used;
+		file->data = buffer_free_without_data(&buf);
+	}
+	corpus_size += file->size;
+}
+
+static void bench_read_corpus(const char *dir)
+{
+	ARRAY_TYPE(const_string) names;
+	const char *const *namep, *name;
+	struct dirent *d;
+	DIR *dirp;
+
+	dirp = opendir(dir);
+	if (dirp == NULL)
+		i_fatal("opendir(%s) failed: %m", dir);
+	t_array_init(&names, 64);
+	while ((d = readdir(dirp)) != NULL) {
+		if (d->d_name[0] == '.')
+			continue;
+		name = t_strdup(d->d_name);
+		array_append(&names, &name, 1);
+	}
+	if (closedir(dirp) < 0)
+		i_error("closedir(%s) failed: %m", dir);
+
+	array_sort(&names, i_strcmp_p);
+	array_foreach(&names, namep)
+		bench_read_file(t_strconcat(dir, "/", *namep, NULL));
+	if (array_count(&files) == 0)
+		i_fatal("No files found in %s", dir);
+}
+
+static struct fts_tokenizer *bench_tokenizers_init(const char *str)
+{
+	const struct fts_tokenizer *tok_class;
+	struct fts_tokenizer *tok, *parent = NULL;
+	const char *const *specs, *const *settings, *name, *error;
+
+	specs = t_strsplit_spaces(str, " ");
+	for (; *specs != NULL; specs++) {
+		settings = bench_parse_settings(*specs, &name);
+		tok_class = fts_tokenizer_find(name);
+		if (tok_class == NULL)
+			i_fatal("Unknown tokenizer: %s", name);
+		if (fts_tokenizer_create(tok_class, parent, settings,
+					 &tok, &error) < 0)
+			i_fatal("Tokenizer %s: %s", name, error);
+		if (parent != NULL)
+			fts_tokenizer_unref(&parent);
+		parent = tok;
+	}
+	if (parent == NULL)
+		i_fatal("No tokenizers given");
+	return parent;
+}
+
+static void bench_filters_init(const char *str,
+			       const struct fts_language *lang,
+			       const char *stopwords_dir)
+{
+	const struct fts_filter *filter_class;
+	struct bench_stage *stage;
+	const char *const *specs, *const *settings, *name, *error;
+
+	specs = t_strsplit_spaces(str, " ");
+	for (; *specs != NULL; specs++) {
+		settings = bench_parse_settings(*specs, &name);
+		filter_class = fts_filter_find(name);
+		if (filter_class == NULL)
+			i_fatal("Unknown filter: %s", name);
+		if (settings == NULL && filter_class == fts_filter_stopwords) {
+			const char **stopwords_set = t_new(const char *, 3);
+
+			stopwords_set[0] = "stopwords_dir";
+			stopwords_set[1] = stopwords_dir;
+			settings = stopwords_set;
+		}
+
+		stage = array_append_space(&stages);
+		stage->name = t_strdup_printf("filter %s", name);
+		if (fts_filter_create(filter_class, NULL, lang, settings,
+				      &stage->filter, &error) < 0)
+			i_fatal("Filter %s: %s", name, error);
+	}
+}
+
+static void
+bench_tokenize(struct fts_tokenizer *tok, const struct bench_file *file,
+	       pool_t pool, ARRAY_TYPE(const_string) *tokens,
+	       unsigned long long *count)
+{
+	const char *token, *error;
+	int ret;
+
+	while ((ret = fts_tokenizer_next(tok, file->data, file->size,
+					 &token, &error)) > 0) {
+		if (tokens != NULL) {
+			token = p_strdup(pool, token);
+			array_append(tokens, &token, 1);
+		}
+		(*count)++;
+	}
+	while (ret >= 0 &&
+	       (ret = fts_tokenizer_final(tok, &token, &error)) > 0) {
+		if (tokens != NULL) {
+			token = p_strdup(pool, token);
+			array_append(tokens, &token, 1);
+		}
+		(*count)++;
+	}
+	if (ret < 0)
+		i_fatal("Tokenizer failed with %s: %s", file->path, error);
+}
+
+static void
+bench_filter(struct fts_filter *filter,
+	     const ARRAY_TYPE(const_string) *input, pool_t pool,
+	     ARRAY_TYPE(const_string) *output, unsigned long long *count)
+{
+	const char *const *tokenp, *token, *error;
+	int ret;
+
+	array_foreach(input, tokenp) T_BEGIN {
+		token = *tokenp;
+		ret = fts_filter_filter(filter, &token, &error);
+		if (ret < 0)
+			i_fatal("Filter failed with '%s': %s", *tokenp, error);
+		if (ret > 0) {
+			if (output != NULL) {
+				token = p_strdup(pool, token);
+				array_append(output, &token, 1);
+			}
+			(*count)++;
+		}
+	} T_END;
+}
+
+static void bench_run(struct fts_tokenizer *tok, unsigned int iterations)
+{
+	ARRAY_TYPE(const_string) input, output;
+	struct bench_stage *stage;
+	const struct bench_file *file;
+	struct timeval tv_start;
+	unsigned long long count;
+	unsigned int i, n, stage_count;
+	pool_t pool;
+
+	/* the tokens are kept in memory between the stages, but copying them
+	   isn't included in the measurements */
+	pool = pool_alloconly_create(MEMPOOL_GROWING"fts bench tokens",
+				     1024*1024);
+	stage = array_idx_modifiable(&stages, 0);
+	for (n = 0; n < iterations; n++) {
+		bench_stage_begin(stage, &tv_start);
+		array_foreach(&files, file) T_BEGIN {
+			bench_tokenize(tok, file, NULL, NULL,
+				       &stage->tokens_out);
+		} T_END;
+		bench_stage_end(stage, &tv_start);
+	}
+	i_array_init(&input, 1024*64);
+	array_foreach(&files, file) T_BEGIN {
+		count = 0;
+		bench_tokenize(tok, file, pool, &input, &count);
+	} T_END;
+
+	stage_count = array_count(&stages);
+	for (i = 1; i < stage_count; i++) {
+		stage = array_idx_modifiable(&stages, i);
+		for (n = 0; n < iterations; n++) {
+			stage->tokens_in += array_count(&input);
+			bench_stage_begin(stage, &tv_start);
+			bench_filter(stage->filter, &input, NULL, NULL,
+				     &stage->tokens_out);
+			bench_stage_end(stage, &tv_start);
+		}
+		i_array_init(&output, array_count(&input) + 1);
+		count = 0;
+		bench_filter(stage->filter, &input, pool, &output, &count);
+		array_free(&input);
+		input = output;
+	}
+	array_free(&input);
+	pool_unref(&pool);
+}
+
+static void bench_print_stage(const struct bench_stage *stage)
+{
+	unsigned long long tokens = stage->tokens_in == 0 ?
+		stage->tokens_out : stage->tokens_in;
+
+	printf("%-32s %10.1f %12llu %12llu %12.0f %8.2f %8.2f\n",
+	       stage->name, stage->usecs / 1000.0,
+	       stage->tokens_in, stage->tokens_out,
+	       stage->usecs == 0 ? 0.0 : tokens * 1000000.0 / stage->usecs,
+	       tokens == 0 ? 0.0 : (double)stage->heap_allocs / tokens,
+	       tokens == 0 ? 0.0 : (double)stage->stack_allocs / tokens);
+}
+
+static void bench_print(unsigned int iterations)
+{
+	const struct bench_stage *stage, *first;
+	struct bench_stage total;
+
+	first = array_idx(&stages, 0);
+	printf("%u files, %llu bytes, %u iterations\n\n",
+	       array_count(&files), corpus_size, iterations);
+	printf("%-32s %10s %12s %12s %12s %8s %8s\n", "stage", "msecs",
+	       "tokens in", "tokens out", "tokens/sec", "mallocs", "t_allocs");
+
+	memset(&total, 0, sizeof(total));
+	total.name = "total";
+	array_foreach(&stages, stage) {
+		bench_print_stage(stage);
+		total.usecs += stage->usecs;
+		total.heap_allocs += stage->heap_allocs;
+		total.stack_allocs += stage->stack_allocs;
+		total.tokens_out = stage->tokens_out;
+	}
+	total.tokens_in = first->tokens_out;
+	bench_print_stage(&total);
+
+	printf("\ntokenizer: %.1f MB/s, total: %.1f MB/s\n",
+	       first->usecs == 0 ? 0.0 :
+	       (double)corpus_size * iterations / first->usecs,
+	       total.usecs == 0 ? 0.0 :
+	       (double)corpus_size * iterations / total.usecs);
+	printf("mallocs and t_allocs are allocations per input token\n");
+#ifndef DEBUG
+	printf("t_allocs are counted only when built with --enable-devel-checks\n");
+#endif
+}
+
+static void bench_deinit(void)
+{
+	struct bench_stage *stage;
+	struct bench_file *file;
+
+	array_foreach_modifiable(&stages, stage) {
+		if (stage->filter != NULL)
+			fts_filter_unref(&stage->filter);
+	}
+	array_foreach_modifiable(&files, file) {
+		i_free(file->path);
+		i_free(file->data);
+	}
+	array_free(&stages);
+	array_free(&files);
+}
+
+static void ATTR_NORETURN usage(void)
+{
+	i_fatal("Usage: test-fts-bench [-l <lang>] [-t <tokenizers>] "
+		"[-f <filters>] [-d <stopwords dir>] [-n <iterations>] "
+		"<corpus dir>");
+}
+
+int main(int argc, char *argv[])
+{
+	struct fts_language lang = { .name = "en" };
+	const char *tokenizers = "generic email-address";
+	const char *filters = "lowercase";
+	const char *stopwords_dir = TEST_STOPWORDS_DIR;
+	struct fts_tokenizer *tok;
+	struct bench_stage *stage;
+	unsigned int iterations = 1;
+	int c;
+
+	lib_init();
+	while ((c = getopt(argc, argv, "l:t:f:d:n:")) > 0) {
+		switch (c) {
+		case 'l':
+			lang.name = optarg;
+			break;
+		case 't':
+			tokenizers = optarg;
+			break;
+		case 'f':
+			filters = optarg;
+			break;
+		case 'd':
+			stopwords_dir = optarg;
+			break;
+		case 'n':
+			if (str_to_uint(optarg, &iterations) < 0 ||
+			    iterations == 0)
+				usage();
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind + 1 != argc)
+		usage();
+
+	fts_tokenizers_init();
+	fts_filters_init();
+	i_array_init(&files, 64);
+	i_array_init(&stages, 8);
+
+	bench_read_corpus(argv[optind]);
+	stage = array_append_space(&stages);
+	stage->name = t_strdup_printf("tokenizer %s", tokenizers);
+	tok = bench_tokenizers_init(tokenizers);
+	bench_filters_init(filters, &lang, stopwords_dir);
+
+	bench_pool_init();
+	bench_run(tok, iterations);
+	bench_pool_deinit();
+	bench_print(iterations);
+
+	fts_tokenizer_unref(&tok);
+	bench_deinit();
+	fts_filters_deinit();
+	fts_tokenizers_deinit();
+	lib_deinit();
+	return 0;
+}
@@ -13,6 +13,12 @@
 #include <stdio.h>
 #include <sys/stat.h>
 
+struct mail_cache_copy_column {
+	unsigned int field_idx, field_size;
+	buffer_t *bitmap, *data;
+	bool have_value;
+};
+
 struct mail_cache_copy_context {
 	struct mail_cache *cache;
 
@@ -20,6 +26,12 @@ struct mail_cache_copy_context {
 	ARRAY(unsigned int) bitmask_pos;
 	uint32_t *field_file_map;
 
+	/* field_idx -> columns index or UINT_MAX. NULL if there are no
+	   columns. */
+	unsigned int *field_column_map;
+	ARRAY(struct mail_cache_copy_column) columns;
+	ARRAY(uint32_t) column_uids;
+
 	uint8_t field_seen_value;
 	bool new_msg;
 };
@@ -46,6 +58,23 @@ mail_cache_merge_bitmask(struct mail_cache_copy_context *ctx,
 		dest[i] |= ((const unsigned char*)field->data)[i];
 }
 
+static void
+mail_cache_compress_column_add(struct mail_cache_copy_context *ctx,
+			       const struct mail_cache_iterate_field *field)
+{
+	struct mail_cache_copy_column *column;
+
+	column = array_idx_modifiable(&ctx->columns,
+				      ctx->field_column_map[field->field_idx]);
+	if (field->size != column->field_size)
+		return;
+
+	buffer_write(column->data,
+		     array_count(&ctx->column_uids) * column->field_size,
+		     field->data, field->size);
+	column->have_value = TRUE;
+}
+
 static void
 mail_cache_compress_field(struct mail_cache_copy_context *ctx,
 			  const struct mail_cache_iterate_field *field)
@@ -96,6 +125,138 @@ mail_cache_compress_field(struct mail_cache_copy_context *ctx,
 	buffer_append(ctx->buffer, field->data, field->size);
 	if ((field->size & 3) != 0)
 		buffer_append_zero(ctx->buffer, 4 - (field->size & 3));
+
+	if (ctx->field_column_map != NULL &&
+	    ctx->field_column_map[field->field_idx] != UINT_MAX)
+		mail_cache_compress_column_add(ctx, field);
+}
+
+static void
+mail_cache_compress_columns_init(struct mail_cache_copy_context *ctx)
+{
+	struct mail_cache *cache = ctx->cache;
+	const struct mail_cache_field *field;
+	struct mail_cache_copy_column *column;
+	unsigned int i;
+
+	for (i = 0; i < cache->fields_count; i++) {
+		field = &cache->fields[i].field;
+		if (ctx->field_file_map[i] == (uint32_t)-1 ||
+		    field->type != MAIL_CACHE_FIELD_FIXED_SIZE ||
+		    field->field_size == 0 ||
+		    field->field_size > MAIL_CACHE_COLUMN_MAX_FIELD_SIZE ||
+		    (field->decision & ~MAIL_CACHE_DECISION_FORCED) !=
+		    MAIL_CACHE_DECISION_YES)
+			continue;
+
+		if (ctx->field_column_map == NULL) {
+			ctx->field_column_map =
+				t_new(unsigned int, cache->fields_count);
+			memset(ctx->field_column_map, 0xff,
+			       sizeof(unsigned int) * cache->fields_count);
+			i_array_init(&ctx->columns, 8);
+			i_array_init(&ctx->column_uids, 256);
+		}
+		ctx->field_column_map[i] = array_count(&ctx->columns);
+		column = array_append_space(&ctx->columns);
+		column->field_idx = i;
+		column->field_size = field->field_size;
+		column->bitmap = buffer_create_dynamic(default_pool, 64);
+		column->data = buffer_create_dynamic(default_pool, 1024);
+	}
+}
+
+static void
+mail_cache_compress_columns_msg_end(struct mail_cache_copy_context *ctx,
+				    uint32_t uid, bool record_written)
+{
+	struct mail_cache_copy_column *column;
+	unsigned int idx = array_count(&ctx->column_uids);
+	unsigned char *bits;
+
+	array_foreach_modifiable(&ctx->columns, column) {
+		if (record_written && column->have_value) {
+			bits = buffer_get_space_unsafe(column->bitmap,
+						       idx / 8, 1);
+			*bits |= 1 << (idx % 8);
+		} else {
+			/* keep the data aligned with the UIDs */
+			buffer_set_used_size(column->data,
+					     idx * column->field_size);
+			if (record_written) {
+				buffer_append_zero(column->data,
+						   column->field_size);
+			}
+		}
+		column->have_value = FALSE;
+	}
+	if (record_written)
+		array_append(&ctx->column_uids, &uid, 1);
+}
+
+static uint32_t
+mail_cache_compress_columns_write(struct mail_cache_copy_context *ctx,
+				  struct ostream *output)
+{
+	struct mail_cache_column_header hdr;
+	struct mail_cache_column col;
+	const struct mail_cache_copy_column *column;
+	uint32_t hdr_offset, offset, bitmap_size, data_size;
+
+	hdr.uids_count = array_count(&ctx->column_uids);
+	hdr.columns_count = array_count(&ctx->columns);
+	if (hdr.uids_count == 0)
+		return 0;
+
+	i_assert((output->offset & 3) == 0);
+	hdr_offset = output->offset;
+	o_stream_nsend(output, &hdr, sizeof(hdr));
+	o_stream_nsend(output, array_idx(&ctx->column_uids, 0),
+		       hdr.uids_count * sizeof(uint32_t));
+
+	bitmap_size = (hdr.uids_count + 31) / 32 * sizeof(uint32_t);
+	offset = output->offset + hdr.columns_count * sizeof(col);
+	array_foreach(&ctx->columns, column) {
+		col.file_field = ctx->field_file_map[column->field_idx];
+		col.offset = offset;
+		o_stream_nsend(output, &col, sizeof(col));
+
+		data_size = (hdr.uids_count * column->field_size + 3) & ~3U;
+		offset += bitmap_size + data_size;
+	}
+	array_foreach(&ctx->columns, column) {
+		i_assert(column->bitmap->used <= bitmap_size);
+		i_assert(column->data->used ==
+			 hdr.uids_count * column->field_size);
+
+		buffer_append_zero(column->bitmap,
+				   bitmap_size - column->bitmap->used);
+		if ((column->data->used & 3) != 0) {
+			buffer_append_zero(column->data,
+					   4 - (column->data->used & 3));
+		}
+		o_stream_nsend(output, column->bitmap->data,
+			       column->bitmap->used);
+		o_stream_nsend(output, column->data->data,
+			       column->data->used);
+	}
+	return hdr_offset;
+}
+
+static void
+mail_cache_compress_columns_deinit(struct mail_cache_copy_context *ctx)
+{
+	struct mail_cache_copy_column *column;
+
+	if (ctx->field_column_map == NULL)
+		return;
+
+	array_foreach_modifiable(&ctx->columns, column) {
+		buffer_free(&column->bitmap);
+		buffer_free(&column->data);
+	}
+	array_free(&ctx->columns);
+	array_free(&ctx->column_uids);
 }
 
 static uint32_t get_next_file_seq(struct mail_cache *cache)
@@ -174,6 +335,7 @@ mail_cache_copy(struct mail_cache *cache, struct mail_index_transaction *trans,
 	struct mail_cache_record cache_rec;
 	struct ostream *output;
 	uint32_t message_count, seq, first_new_seq, ext_offset;
+	uint32_t column_hdr_offset = 0;
 	unsigned int i, used_fields_count, orig_fields_count, record_count;
 	time_t max_drop_time;
 
@@ -194,6 +356,7 @@ mail_cache_copy(struct mail_cache *cache, struct mail_index_transaction *trans,
 	hdr.indexid = cache->index->indexid;
 	hdr.file_seq = get_next_file_seq(cache);
 	o_stream_nsend(output, &hdr, sizeof(hdr));
+	o_stream_nsend(output, &column_hdr_offset, sizeof(column_hdr_offset));
 
 	memset(&ctx, 0, sizeof(ctx));
 	ctx.cache = cache;
@@ -243,6 +406,9 @@ mail_cache_copy(struct mail_cache *cache, struct mail_index_transaction *trans,
 		}
 	}
 
+	if ((cache->index->flags & MAIL_INDEX_OPEN_FLAG_CACHE_COLUMNS) != 0)
+		mail_cache_compress_columns_init(&ctx);
+
 	/* get sequence of first message which doesn't need its temp fields
 	   removed. */
 	first_new_seq = mail_cache_get_first_new_seq(view);
@@ -284,11 +450,21 @@ mail_cache_copy(struct mail_cache *cache, struct mail_index_transaction *trans,
 			o_stream_nsend(output, ctx.buffer->data, cache_rec.size);
 			record_count++;
 		}
+		if (ctx.field_column_map != NULL) {
+			mail_cache_compress_columns_msg_end(&ctx, *max_uid_r,
+							    ext_offset != 0);
+		}
 
 		array_append(ext_offsets, &ext_offset, 1);
 	}
 	i_assert(orig_fields_count == cache->fields_count);
 
+	if (ctx.field_column_map != NULL) {
+		column_hdr_offset =
+			mail_cache_compress_columns_write(&ctx, output);
+		mail_cache_compress_columns_deinit(&ctx);
+	}
+
 	hdr.record_count = record_count;
 	hdr.field_header_offset = mail_index_uint32_to_offset(output->offset);
 	mail_cache_compress_get_fields(&ctx, used_fields_count);
@@ -300,6 +476,7 @@ mail_cache_copy(struct mail_cache *cache, struct mail_index_transaction *trans,
 
 	(void)o_stream_seek(output, 0);
 	o_stream_nsend(output, &hdr, sizeof(hdr));
+	o_stream_nsend(output, &column_hdr_offset, sizeof(column_hdr_offset));
 
 	mail_cache_view_close(&cache_view);
 
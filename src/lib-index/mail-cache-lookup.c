@@ -401,6 +401,222 @@ mail_cache_lookup_bitmask(struct mail_cache_lookup_iterate_ctx *iter,
 	return ret < 0 ? -1 : (found ? 1 : 0);
 }
 
+static int mail_cache_columns_read(struct mail_cache *cache)
+{
+	const struct mail_cache_column_header *hdr;
+	const struct mail_cache_column *columns;
+	const struct mail_cache_field *field;
+	struct mail_cache_column_map *map;
+	const void *data;
+	uint32_t hdr_offset, columns_end_offset, bitmap_size;
+	uint64_t column_end_offset;
+	unsigned int i, count, field_idx;
+	int ret;
+
+	if (array_is_created(&cache->columns))
+		array_clear(&cache->columns);
+	else
+		i_array_init(&cache->columns, 32);
+	cache->columns_file_seq = cache->hdr->file_seq;
+	cache->column_uids_offset = 0;
+	cache->column_uids_count = 0;
+
+	if (cache->hdr->minor_version < 2)
+		return 0;
+
+	ret = mail_cache_map(cache, MAIL_CACHE_COLUMN_HEADER_OFFSET_POS,
+			     sizeof(uint32_t), &data);
+	if (ret <= 0) {
+		if (ret == 0)
+			mail_cache_set_corrupted(cache, "file truncated");
+		return -1;
+	}
+	hdr_offset = *(const uint32_t *)data;
+	if (hdr_offset == 0)
+		return 0;
+	if ((hdr_offset & 3) != 0 ||
+	    hdr_offset < MAIL_CACHE_COLUMN_HEADER_OFFSET_POS + sizeof(uint32_t)) {
+		mail_cache_set_corrupted(cache, "invalid column header offset");
+		return -1;
+	}
+
+	if ((ret = mail_cache_map(cache, hdr_offset, sizeof(*hdr), &data)) <= 0) {
+		if (ret == 0) {
+			mail_cache_set_corrupted(cache,
+				"column header points outside file");
+		}
+		return -1;
+	}
+	hdr = data;
+	count = hdr->columns_count;
+	if ((uint64_t)hdr_offset + sizeof(*hdr) +
+	    (uint64_t)hdr->uids_count * sizeof(uint32_t) +
+	    (uint64_t)count * sizeof(*columns) > (uint32_t)-1) {
+		mail_cache_set_corrupted(cache, "column header too large");
+		return -1;
+	}
+	cache->column_uids_offset = hdr_offset + sizeof(*hdr);
+	cache->column_uids_count = hdr->uids_count;
+	bitmap_size = (cache->column_uids_count + 31) / 32 * sizeof(uint32_t);
+	columns_end_offset = cache->column_uids_offset +
+		cache->column_uids_count * sizeof(uint32_t) +
+		count * sizeof(*columns);
+
+	ret = mail_cache_map(cache, cache->column_uids_offset +
+			     cache->column_uids_count * sizeof(uint32_t),
+			     count * sizeof(*columns), &data);
+	if (ret <= 0) {
+		if (ret == 0)
+			mail_cache_set_corrupted(cache, "columns point outside file");
+		cache->column_uids_count = 0;
+		return -1;
+	}
+	columns = data;
+	for (i = 0; i < count; i++) {
+		if (columns[i].file_field >= cache->file_fields_count ||
+		    (columns[i].offset & 3) != 0 ||
+		    columns[i].offset < columns_end_offset) {
+			mail_cache_set_corrupted(cache, "invalid column");
+			array_clear(&cache->columns);
+			cache->column_uids_count = 0;
+			return -1;
+		}
+		field_idx = cache->file_field_map[columns[i].file_field];
+		field = &cache->fields[field_idx].field;
+		if (field->type != MAIL_CACHE_FIELD_FIXED_SIZE ||
+		    field->field_size == 0 ||
+		    field->field_size > MAIL_CACHE_COLUMN_MAX_FIELD_SIZE)
+			continue;
+
+		/* the whole column must fit before the field header */
+		column_end_offset = (uint64_t)columns[i].offset + bitmap_size +
+			(uint64_t)cache->column_uids_count * field->field_size;
+		if (column_end_offset >
+		    mail_index_offset_to_uint32(cache->hdr->field_header_offset)) {
+			mail_cache_set_corrupted(cache,
+				"column points outside records");
+			array_clear(&cache->columns);
+			cache->column_uids_count = 0;
+			return -1;
+		}
+
+		map = array_idx_modifiable(&cache->columns, field_idx);
+		map->field_size = field->field_size;
+		map->bitmap_offset = columns[i].offset;
+		map->data_offset = columns[i].offset + bitmap_size;
+	}
+	return 0;
+}
+
+static bool
+mail_cache_column_find_uid(struct mail_cache_view *view, const uint32_t *uids,
+			   unsigned int count, uint32_t uid, unsigned int *idx_r)
+{
+	unsigned int idx, left_idx, right_idx;
+
+	/* messages are usually looked up in ascending order */
+	idx = view->column_uid_idx_hint;
+	if (idx < count && uids[idx] == uid) {
+		*idx_r = idx;
+		return TRUE;
+	}
+	if (idx + 1 < count && uids[idx+1] == uid) {
+		*idx_r = view->column_uid_idx_hint = idx + 1;
+		return TRUE;
+	}
+
+	left_idx = 0; right_idx = count;
+	while (left_idx < right_idx) {
+		idx = (left_idx + right_idx) / 2;
+		if (uids[idx] < uid)
+			left_idx = idx + 1;
+		else if (uids[idx] > uid)
+			right_idx = idx;
+		else {
+			*idx_r = view->column_uid_idx_hint = idx;
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+static int
+mail_cache_lookup_column(struct mail_cache_view *view, buffer_t *dest_buf,
+			 uint32_t seq, unsigned int field_idx)
+{
+	struct mail_cache *cache = view->cache;
+	const struct mail_cache_column_map *map;
+	const unsigned char *bitmap;
+	const void *data;
+	uint32_t uid, offset, reset_id;
+	unsigned int idx;
+	int ret;
+
+	if (!cache->opened)
+		(void)mail_cache_open_and_verify(cache);
+	if (MAIL_CACHE_IS_UNUSABLE(cache))
+		return 0;
+
+	if (cache->columns_file_seq != cache->hdr->file_seq) {
+		if (mail_cache_columns_read(cache) < 0)
+			return -1;
+	}
+	if (cache->column_uids_count == 0)
+		return 0;
+
+	/* The columns have the values from the time the file was compressed.
+	   Fixed size fields may be updated later on (e.g. "flags"), so if a
+	   record has been added for the message after the compression, the
+	   record chain may have a newer value. */
+	if (view->trans_seq1 <= seq && view->trans_seq2 >= seq)
+		return 0;
+	offset = mail_cache_lookup_cur_offset(view->view, seq, &reset_id);
+	if (offset == 0 || reset_id != cache->hdr->file_seq ||
+	    offset >= cache->column_uids_offset)
+		return 0;
+
+	if (field_idx >= array_count(&cache->columns))
+		return 0;
+	map = array_idx(&cache->columns, field_idx);
+	if (map->field_size == 0)
+		return 0;
+
+	mail_index_lookup_uid(view->view, seq, &uid);
+	ret = mail_cache_map(cache, cache->column_uids_offset,
+			     cache->column_uids_count * sizeof(uint32_t), &data);
+	if (ret <= 0) {
+		if (ret == 0)
+			mail_cache_set_corrupted(cache, "column UIDs point outside file");
+		return -1;
+	}
+	if (!mail_cache_column_find_uid(view, data, cache->column_uids_count,
+					uid, &idx))
+		return 0;
+
+	if ((ret = mail_cache_map(cache, map->bitmap_offset + idx/8, 1,
+				  &data)) <= 0) {
+		if (ret == 0)
+			mail_cache_set_corrupted(cache, "column points outside file");
+		return -1;
+	}
+	bitmap = data;
+	if ((*bitmap & (1 << (idx % 8))) == 0) {
+		/* not in column, but it may have been added to the record
+		   later */
+		return 0;
+	}
+
+	if ((ret = mail_cache_map(cache, map->data_offset +
+				  (size_t)idx * map->field_size, map->field_size,
+				  &data)) <= 0) {
+		if (ret == 0)
+			mail_cache_set_corrupted(cache, "column points outside file");
+		return -1;
+	}
+	buffer_append(dest_buf, data, map->field_size);
+	return 1;
+}
+
 int mail_cache_lookup_field(struct mail_cache_view *view, buffer_t *dest_buf,
 			    uint32_t seq, unsigned int field_idx)
 {
@@ -409,6 +625,11 @@ int mail_cache_lookup_field(struct mail_cache_view *view, buffer_t *dest_buf,
 	struct mail_cache_iterate_field field;
 	int ret;
 
+	if ((ret = mail_cache_lookup_column(view, dest_buf, seq, field_idx)) != 0) {
+		mail_cache_decision_state_update(view, seq, field_idx);
+		return ret;
+	}
+
 	ret = mail_cache_field_exists(view, seq, field_idx);
 	mail_cache_decision_state_update(view, seq, field_idx);
 	if (ret <= 0)
@@ -6,7 +6,7 @@
 #include "mail-cache.h"
 
 #define MAIL_CACHE_MAJOR_VERSION 1
-#define MAIL_CACHE_MINOR_VERSION 1
+#define MAIL_CACHE_MINOR_VERSION 2
 
 /* Drop fields that haven't been accessed for n seconds */
 #define MAIL_CACHE_FIELD_DROP_SECS (3600*24*30)
@@ -28,6 +28,9 @@
 /* If cache record becomes larger than this, don't add it. */
 #define MAIL_CACHE_RECORD_MAX_SIZE (64*1024)
 
+/* Fixed size fields larger than this aren't written as columns */
+#define MAIL_CACHE_COLUMN_MAX_FIELD_SIZE 32
+
 #define MAIL_CACHE_LOCK_TIMEOUT 10
 #define MAIL_CACHE_LOCK_CHANGE_TIMEOUT 300
 
@@ -56,6 +59,35 @@ struct mail_cache_header {
 	uint32_t field_header_offset;
 };
 
+/* With minor_version>=2 the header is followed by a uint32_t offset to
+   struct mail_cache_column_header, or 0 if the file has no columns. */
+#define MAIL_CACHE_COLUMN_HEADER_OFFSET_POS \
+	sizeof(struct mail_cache_header)
+
+/* Columns contain a copy of the most commonly used fixed size fields for all
+   messages that existed when the file was compressed. They're a read-only
+   lookup optimization: the same fields are still written to the records.
+   The columns are used only for messages that haven't had records added
+   since the compression, because the records may have newer values. */
+struct mail_cache_column_header {
+	uint32_t uids_count;
+	uint32_t columns_count;
+
+#if 0
+	/* sorted list of UIDs that the columns contain */
+	uint32_t uids[uids_count];
+	struct mail_cache_column columns[columns_count];
+#endif
+};
+
+struct mail_cache_column {
+	uint32_t file_field;
+	/* Offset to a bitmap of uids_count bits telling which messages have
+	   the field cached, padded to 32 bits. It's followed by
+	   uids_count * field_size bytes of data. */
+	uint32_t offset;
+};
+
 struct mail_cache_header_fields {
 	uint32_t next_offset;
 	uint32_t size;
@@ -93,6 +125,12 @@ struct mail_cache_record {
 	/* array of { uint32_t field; [ uint32_t size; ] { .. } } */
 };
 
+struct mail_cache_column_map {
+	/* 0 if the field has no column */
+	unsigned int field_size;
+	uint32_t bitmap_offset, data_offset;
+};
+
 struct mail_cache_field_private {
 	struct mail_cache_field field;
 
@@ -154,6 +192,12 @@ struct mail_cache {
 	unsigned int *file_field_map;
 	unsigned int file_fields_count;
 
+	/* columns of the file with file_seq=columns_file_seq, indexed by
+	   field_idx */
+	uint32_t columns_file_seq;
+	uint32_t column_uids_offset, column_uids_count;
+	ARRAY(struct mail_cache_column_map) columns;
+
 	bool opened:1;
 	bool locked:1;
 	bool last_lock_failed:1;
@@ -185,6 +229,9 @@ struct mail_cache_view {
 	uint8_t cached_exists_value;
 	uint32_t cached_exists_seq;
 
+	/* index to column UIDs of the previous column lookup */
+	unsigned int column_uid_idx_hint;
+
 	bool no_decision_updates:1;
 };
 
@@ -68,6 +68,7 @@ void mail_cache_file_close(struct mail_cache *cache)
 	cache->hdr = NULL;
 	cache->mmap_length = 0;
 	cache->last_field_header_offset = 0;
+	cache->columns_file_seq = 0;
 
 	if (cache->file_lock != NULL)
 		file_lock_free(&cache->file_lock);
@@ -569,6 +570,8 @@ void mail_cache_free(struct mail_cache **_cache)
 		buffer_free(&cache->read_buf);
 	hash_table_destroy(&cache->field_name_hash);
 	pool_unref(&cache->field_pool);
+	if (array_is_created(&cache->columns))
+		array_free(&cache->columns);
 	i_free(cache->field_file_map);
 	i_free(cache->file_field_map);
 	i_free(cache->fields);
@@ -7,6 +7,16 @@
 #include "mail-index-private.h"
 #include "mail-index-modseq.h"
 
+static struct mail_index_map_stats mail_index_map_stats;
+
+static struct mail_index_map *
+mail_index_map_dup(const struct mail_index_map *map);
+
+const struct mail_index_map_stats *mail_index_map_get_stats(void)
+{
+	return &mail_index_map_stats;
+}
+
 void mail_index_map_init_extbufs(struct mail_index_map *map,
 				 unsigned int initial_count)
 {
@@ -260,7 +270,7 @@ struct mail_index_map *mail_index_map_alloc(struct mail_index *index)
 
 	/* a bit kludgy way to do this, but it initializes everything
 	   nicely and correctly */
-	return mail_index_map_clone(&tmp_map);
+	return mail_index_map_dup(&tmp_map);
 }
 
 static void mail_index_record_map_free(struct mail_index_map *map,
@@ -322,18 +332,23 @@ void mail_index_unmap(struct mail_index_map **_map)
 
 static void mail_index_map_copy_records(struct mail_index_record_map *dest,
 					const struct mail_index_record_map *src,
+					unsigned int records_count,
 					unsigned int record_size)
 {
 	size_t size;
 
-	size = src->records_count * record_size;
+	i_assert(records_count <= src->records_count);
+
+	size = records_count * record_size;
+	mail_index_map_stats.records_copy_count++;
+	mail_index_map_stats.records_copy_bytes += size;
 	/* +1% so we have a bit of space to grow. useful for huge mailboxes. */
 	dest->buffer = buffer_create_dynamic(default_pool,
 					     size + I_MAX(size/100, 1024));
 	buffer_append(dest->buffer, src->records, size);
 
 	dest->records = buffer_get_modifiable_data(dest->buffer, NULL);
-	dest->records_count = src->records_count;
+	dest->records_count = records_count;
 }
 
 static void mail_index_map_copy_header(struct mail_index_map *dest,
@@ -376,7 +391,8 @@ mail_index_record_map_alloc(struct mail_index_map *map)
 	return rec_map;
 }
 
-struct mail_index_map *mail_index_map_clone(const struct mail_index_map *map)
+static struct mail_index_map *
+mail_index_map_dup(const struct mail_index_map *map)
 {
 	struct mail_index_map *mem_map;
 	struct mail_index_ext *ext;
@@ -424,21 +440,41 @@ struct mail_index_map *mail_index_map_clone(const struct mail_index_map *map)
 	return mem_map;
 }
 
+struct mail_index_map *mail_index_map_clone(const struct mail_index_map *map)
+{
+	mail_index_map_stats.clone_count++;
+	return mail_index_map_dup(map);
+}
+
 void mail_index_record_map_move_to_private(struct mail_index_map *map)
 {
 	struct mail_index_record_map *new_map;
 	const struct mail_index_record *rec;
 
 	if (array_count(&map->rec_map->maps) > 1) {
+		/* records appended by the other maps past our messages_count
+		   would be dropped below anyway, so don't copy them. */
 		new_map = mail_index_record_map_alloc(map);
 		mail_index_map_copy_records(new_map, map->rec_map,
-					    map->hdr.record_size);
+			I_MIN(map->rec_map->records_count,
+			      map->hdr.messages_count),
+			map->hdr.record_size);
 		mail_index_record_map_unlink(map);
 		map->rec_map = new_map;
 		if (map->rec_map->modseq != NULL)
 			new_map->modseq = mail_index_map_modseq_clone(map->rec_map->modseq);
+		if (new_map->records_count > 0) {
+			rec = MAIL_INDEX_REC_AT_SEQ(map, new_map->records_count);
+			new_map->last_appended_uid = rec->uid;
+		}
 	} else {
 		new_map = map->rec_map;
+		if (new_map->mmap_base != NULL) {
+			/* the mapping is MAP_PRIVATE, so it can be modified
+			   directly. the kernel copies only the pages that
+			   actually get changed. */
+			mail_index_map_stats.records_inplace_count++;
+		}
 	}
 
 	if (new_map->records_count != map->hdr.messages_count) {
@@ -449,8 +485,11 @@ void mail_index_record_map_move_to_private(struct mail_index_map *map)
 			rec = MAIL_INDEX_REC_AT_SEQ(map, new_map->records_count);
 			new_map->last_appended_uid = rec->uid;
 		}
-		buffer_set_used_size(new_map->buffer, new_map->records_count *
-				     map->hdr.record_size);
+		if (new_map->buffer != NULL) {
+			buffer_set_used_size(new_map->buffer,
+					     new_map->records_count *
+					     map->hdr.record_size);
+		}
 	}
 }
 
@@ -470,6 +509,7 @@ void mail_index_map_move_to_memory(struct mail_index_map *map)
 	}
 
 	mail_index_map_copy_records(new_map, map->rec_map,
+				    map->rec_map->records_count,
 				    map->hdr.record_size);
 	mail_index_map_copy_header(map, map);
 
@@ -60,8 +60,15 @@ int mail_index_sync_record(struct mail_index_sync_map_ctx *ctx,
 			   const struct mail_transaction_header *hdr,
 			   const void *data);
 
+/* Make sure the view's map and its records aren't shared with anyone else,
+   so they can be modified. The map is moved to memory. */
 struct mail_index_map *
 mail_index_sync_get_atomic_map(struct mail_index_sync_map_ctx *ctx);
+/* Like mail_index_sync_get_atomic_map(), but if the records are in a private
+   mmap() they're kept there. This is enough for updates that don't grow the
+   header or the records, since only the modified pages get copied. */
+struct mail_index_map *
+mail_index_sync_get_atomic_records_map(struct mail_index_sync_map_ctx *ctx);
 
 void mail_index_sync_init_expunge_handlers(struct mail_index_sync_map_ctx *ctx);
 void
@@ -71,7 +71,7 @@ static void mail_index_sync_replace_map(struct mail_index_sync_map_ctx *ctx,
 }
 
 static struct mail_index_map *
-mail_index_sync_move_to_private_memory(struct mail_index_sync_map_ctx *ctx)
+mail_index_sync_move_to_private(struct mail_index_sync_map_ctx *ctx)
 {
 	struct mail_index_map *map = ctx->view->map;
 
@@ -79,9 +79,17 @@ mail_index_sync_move_to_private_memory(struct mail_index_sync_map_ctx *ctx)
 		map = mail_index_map_clone(map);
 		mail_index_sync_replace_map(ctx, map);
 	}
+	return map;
+}
+
+static struct mail_index_map *
+mail_index_sync_move_to_private_memory(struct mail_index_sync_map_ctx *ctx)
+{
+	struct mail_index_map *map;
 
-	if (!MAIL_INDEX_MAP_IS_IN_MEMORY(ctx->view->map))
-		mail_index_map_move_to_memory(ctx->view->map);
+	map = mail_index_sync_move_to_private(ctx);
+	if (!MAIL_INDEX_MAP_IS_IN_MEMORY(map))
+		mail_index_map_move_to_memory(map);
 	mail_index_modseq_sync_map_replaced(ctx->modseq_ctx);
 	return map;
 }
@@ -95,6 +103,15 @@ mail_index_sync_get_atomic_map(struct mail_index_sync_map_ctx *ctx)
 	return ctx->view->map;
 }
 
+struct mail_index_map *
+mail_index_sync_get_atomic_records_map(struct mail_index_sync_map_ctx *ctx)
+{
+	(void)mail_index_sync_move_to_private(ctx);
+	mail_index_record_map_move_to_private(ctx->view->map);
+	mail_index_modseq_sync_map_replaced(ctx->modseq_ctx);
+	return ctx->view->map;
+}
+
 static int
 mail_index_header_update_counts(struct mail_index_header *hdr,
 				uint8_t old_flags, uint8_t new_flags,
@@ -247,7 +264,7 @@ sync_expunge_range(struct mail_index_sync_map_ctx *ctx, const ARRAY_TYPE(seq_ran
 	if (count == 0)
 		return;
 
-	map = mail_index_sync_get_atomic_map(ctx);
+	map = mail_index_sync_get_atomic_records_map(ctx);
 
 	/* call the expunge handlers first */
 	if (sync_expunge_handlers_init(ctx)) {
@@ -418,7 +418,7 @@ view_sync_get_log_lost_changes(struct mail_index_view_sync_ctx *ctx,
 	/* we don't update the map in the same order as it's typically done.
 	   map->rec_map may already have some messages appended that we don't
 	   want. get an atomic map to make sure these get removed. */
-	(void)mail_index_sync_get_atomic_map(&ctx->sync_map_ctx);
+	(void)mail_index_sync_get_atomic_records_map(&ctx->sync_map_ctx);
 
 	if (!mail_index_map_get_ext_idx(new_map, view->index->modseq_ext_id,
 					&ctx->lost_new_ext_idx))
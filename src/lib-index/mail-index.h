@@ -37,6 +37,9 @@ enum mail_index_open_flags {
 	MAIL_INDEX_OPEN_FLAG_SAVEONLY		= 0x400,
 	/* Enable debug logging */
 	MAIL_INDEX_OPEN_FLAG_DEBUG		= 0x800,
+	/* Write the commonly used fixed size cache fields also as columns
+	   when compressing dovecot.index.cache */
+	MAIL_INDEX_OPEN_FLAG_CACHE_COLUMNS	= 0x1000,
 };
 
 enum mail_index_header_compat_flags {
@@ -228,6 +231,20 @@ struct mail_index_transaction_commit_result {
 	unsigned int ignored_modseq_changes;
 };
 
+/* Process-wide counters of how much index map copying has been done. */
+struct mail_index_map_stats {
+	/* Number of times a map was cloned. Clones share the records with
+	   the original map until either of them modifies them. */
+	uint64_t clone_count;
+	/* Number of times the records had to be copied to a private map,
+	   and the total number of bytes copied. */
+	uint64_t records_copy_count, records_copy_bytes;
+	/* Number of times a private copy was avoided by modifying the
+	   records in place in a private mmap(). Only the modified pages are
+	   copied by the kernel. */
+	uint64_t records_inplace_count;
+};
+
 struct mail_index;
 struct mail_index_map;
 struct mail_index_view;
@@ -278,6 +295,8 @@ bool mail_index_is_in_memory(struct mail_index *index);
 int mail_index_move_to_memory(struct mail_index *index);
 
 struct mail_cache *mail_index_get_cache(struct mail_index *index);
+/* Returns the map copying counters for this process. */
+const struct mail_index_map_stats *mail_index_map_get_stats(void);
 
 /* Refresh index so mail_index_lookup*() will return latest values. Note that
    immediately after this call there may already be changes, so if you need to
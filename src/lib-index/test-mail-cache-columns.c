@@ -0,0 +1,256 @@
+/* Copyright (c) 2016 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "buffer.h"
+#include "ioloop.h"
+#include "unlink-directory.h"
+#include "test-common.h"
+#include "mail-index-private.h"
+#include "mail-cache-private.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define TEST_DIR ".test-mail-cache-columns"
+#define TEST_CACHE_PATH TEST_DIR"/test.index.cache"
+
+static struct ioloop *test_ioloop;
+static struct mail_cache_field test_field = {
+	.name = "test-fixed",
+	.type = MAIL_CACHE_FIELD_FIXED_SIZE,
+	.field_size = sizeof(uint32_t),
+	/* compression would change a non-forced decision to temp */
+	.decision = MAIL_CACHE_DECISION_YES | MAIL_CACHE_DECISION_FORCED,
+};
+
+static struct mail_index *test_index_open(void)
+{
+	struct mail_index *index;
+
+	index = mail_index_alloc(TEST_DIR, "test.index");
+	if (mail_index_open_or_create(index, MAIL_INDEX_OPEN_FLAG_CREATE |
+				      MAIL_INDEX_OPEN_FLAG_CACHE_COLUMNS) < 0)
+		i_fatal("mail_index_open_or_create() failed");
+	mail_cache_register_fields(index->cache, &test_field, 1);
+	return index;
+}
+
+static void test_index_create(void)
+{
+	struct mail_index *index;
+	struct mail_index_sync_ctx *sync_ctx;
+	struct mail_index_view *view;
+	struct mail_index_transaction *trans;
+	struct mail_cache_view *cache_view;
+	struct mail_cache_transaction_ctx *cache_trans;
+	struct mail_cache_compress_lock *lock;
+	const char *error;
+	uint32_t seq, uid, value, uid_validity = 1;
+
+	(void)unlink_directory(TEST_DIR, UNLINK_DIRECTORY_FLAG_RMDIR, &error);
+	if (mkdir(TEST_DIR, 0700) < 0)
+		i_fatal("mkdir(%s) failed: %m", TEST_DIR);
+	index = test_index_open();
+
+	/* append UIDs 10, 20, 30 */
+	if (mail_index_sync_begin(index, &sync_ctx, &view, &trans, 0) < 0)
+		i_fatal("mail_index_sync_begin() failed");
+	mail_index_update_header(trans,
+		offsetof(struct mail_index_header, uid_validity),
+		&uid_validity, sizeof(uid_validity), TRUE);
+	for (uid = 10; uid <= 30; uid += 10)
+		mail_index_append(trans, uid, &seq);
+	if (mail_index_sync_commit(&sync_ctx) < 0)
+		i_fatal("mail_index_sync_commit() failed");
+
+	/* cache the field for all but the second message */
+	view = mail_index_view_open(index);
+	trans = mail_index_transaction_begin(view, 0);
+	cache_view = mail_cache_view_open(index->cache, view);
+	cache_trans = mail_cache_get_transaction(cache_view, trans);
+	for (seq = 1; seq <= 3; seq++) {
+		if (seq == 2)
+			continue;
+		value = 1000 + seq;
+		mail_cache_add(cache_trans, seq, test_field.idx,
+			       &value, sizeof(value));
+	}
+	if (mail_index_transaction_commit(&trans) < 0)
+		i_fatal("mail_index_transaction_commit() failed");
+	mail_cache_view_close(&cache_view);
+	mail_index_view_close(&view);
+
+	/* compression writes the columns */
+	index->cache->need_compress_file_seq = index->cache->hdr->file_seq;
+	if (mail_index_sync_begin(index, &sync_ctx, &view, &trans, 0) < 0)
+		i_fatal("mail_index_sync_begin() failed");
+	if (mail_cache_compress(index->cache, trans, &lock) < 0)
+		i_fatal("mail_cache_compress() failed");
+	if (mail_index_sync_commit(&sync_ctx) < 0)
+		i_fatal("mail_index_sync_commit() failed");
+	mail_cache_compress_unlock(&lock);
+
+	mail_index_close(index);
+	mail_index_free(&index);
+}
+
+static int test_lookup(struct mail_index *index, uint32_t seq,
+		       uint32_t *value_r)
+{
+	struct mail_index_view *view;
+	struct mail_cache_view *cache_view;
+	buffer_t *buf;
+	int ret;
+
+	buf = buffer_create_dynamic(pool_datastack_create(), 16);
+	view = mail_index_view_open(index);
+	cache_view = mail_cache_view_open(index->cache, view);
+	ret = mail_cache_lookup_field(cache_view, buf, seq, test_field.idx);
+	if (ret > 0) {
+		test_assert(buf->used == sizeof(*value_r));
+		memcpy(value_r, buf->data, sizeof(*value_r));
+	}
+	mail_cache_view_close(&cache_view);
+	mail_index_view_close(&view);
+	return ret;
+}
+
+static void test_mail_cache_columns_read(void)
+{
+	const struct mail_cache_column_map *map;
+	struct mail_index *index;
+	uint32_t value;
+
+	test_begin("mail cache columns read/write");
+	test_index_create();
+
+	index = test_index_open();
+	test_assert(test_lookup(index, 1, &value) == 1 && value == 1001);
+	/* the message without a record isn't in the columns */
+	test_assert(index->cache->column_uids_count == 2);
+	test_assert(array_count(&index->cache->columns) > test_field.idx);
+	map = array_idx(&index->cache->columns, test_field.idx);
+	test_assert(map->field_size == sizeof(value));
+	test_assert(test_lookup(index, 2, &value) == 0);
+	test_assert(test_lookup(index, 3, &value) == 1 && value == 1003);
+	mail_index_close(index);
+	mail_index_free(&index);
+	test_end();
+}
+
+static void test_mail_cache_columns_updated(void)
+{
+	struct mail_index *index;
+	struct mail_index_view *view;
+	struct mail_index_transaction *trans;
+	struct mail_cache_view *cache_view;
+	struct mail_cache_transaction_ctx *cache_trans;
+	uint32_t value;
+
+	test_begin("mail cache columns updated");
+	test_index_create();
+
+	/* update the field for the first message after compression */
+	index = test_index_open();
+	view = mail_index_view_open(index);
+	trans = mail_index_transaction_begin(view, 0);
+	cache_view = mail_cache_view_open(index->cache, view);
+	cache_trans = mail_cache_get_transaction(cache_view, trans);
+	value = 2001;
+	mail_cache_add(cache_trans, 1, test_field.idx, &value, sizeof(value));
+	if (mail_index_transaction_commit(&trans) < 0)
+		i_fatal("mail_index_transaction_commit() failed");
+	mail_cache_view_close(&cache_view);
+	mail_index_view_close(&view);
+
+	/* the updated value comes from the record, the others still from
+	   the columns */
+	test_assert(test_lookup(index, 1, &value) == 1 && value == 2001);
+	test_assert(test_lookup(index, 3, &value) == 1 && value == 1003);
+	mail_index_close(index);
+	mail_index_free(&index);
+	test_end();
+}
+
+static void test_corrupt_column_offset(uint32_t new_offset)
+{
+	struct mail_cache_column_header hdr;
+	struct mail_cache_column col;
+	uint32_t hdr_offset, col_offset;
+	int fd;
+
+	fd = open(TEST_CACHE_PATH, O_RDWR);
+	if (fd == -1)
+		i_fatal("open(%s) failed: %m", TEST_CACHE_PATH);
+	if (pread(fd, &hdr_offset, sizeof(hdr_offset),
+		  MAIL_CACHE_COLUMN_HEADER_OFFSET_POS) != sizeof(hdr_offset) ||
+	    pread(fd, &hdr, sizeof(hdr), hdr_offset) != sizeof(hdr))
+		i_fatal("pread(%s) failed: %m", TEST_CACHE_PATH);
+	i_assert(hdr_offset != 0 && hdr.columns_count > 0);
+	col_offset = hdr_offset + sizeof(hdr) + hdr.uids_count * sizeof(uint32_t);
+	if (pread(fd, &col, sizeof(col), col_offset) != sizeof(col))
+		i_fatal("pread(%s) failed: %m", TEST_CACHE_PATH);
+	col.offset = new_offset;
+	if (pwrite(fd, &col, sizeof(col), col_offset) != sizeof(col))
+		i_fatal("pwrite(%s) failed: %m", TEST_CACHE_PATH);
+	i_close_fd(&fd);
+}
+
+static void test_mail_cache_columns_corrupted(void)
+{
+	struct mail_index *index;
+	uint32_t value, offsets[] = {
+		/* pointing to the column header */
+		sizeof(struct mail_cache_header) + 4,
+		/* beyond the records */
+		0x7ffffff0
+	};
+	const char *errors[N_ELEMENTS(offsets)] = {
+		"invalid column",
+		"column points outside records"
+	};
+	unsigned int i;
+
+	test_begin("mail cache columns corrupted");
+	for (i = 0; i < N_ELEMENTS(offsets); i++) {
+		test_index_create();
+		test_corrupt_column_offset(offsets[i]);
+
+		index = test_index_open();
+		test_expect_error_string(errors[i]);
+		test_assert_idx(test_lookup(index, 1, &value) < 0, i);
+		test_expect_no_more_errors();
+		mail_index_close(index);
+		mail_index_free(&index);
+	}
+	test_end();
+}
+
+static void test_setup(void)
+{
+	/* index creation uses ioloop_time as the indexid */
+	test_ioloop = io_loop_create();
+}
+
+static void test_teardown(void)
+{
+	const char *error;
+
+	io_loop_destroy(&test_ioloop);
+	(void)unlink_directory(TEST_DIR, UNLINK_DIRECTORY_FLAG_RMDIR, &error);
+}
+
+int main(void)
+{
+	static void (*test_functions[])(void) = {
+		test_setup,
+		test_mail_cache_columns_read,
+		test_mail_cache_columns_updated,
+		test_mail_cache_columns_corrupted,
+		test_teardown,
+		NULL
+	};
+	return test_run(test_functions);
+}
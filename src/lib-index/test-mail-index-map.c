@@ -2,6 +2,8 @@
 
 #include "lib.h"
 #include "array.h"
+#include "buffer.h"
+#include "mmap-util.h"
 #include "test-common.h"
 #include "mail-index-private.h"
 #include "mail-index-modseq.h"
@@ -47,10 +49,124 @@ static void test_mail_index_map_lookup_seq_range(void)
 	test_end();
 }
 
+static void test_mail_index_map_add_records(struct mail_index_map *map,
+					    unsigned int count)
+{
+	struct mail_index_record *rec;
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		rec = buffer_append_space_unsafe(map->rec_map->buffer,
+						 sizeof(*rec));
+		rec->uid = map->hdr.next_uid++;
+	}
+	map->rec_map->records =
+		buffer_get_modifiable_data(map->rec_map->buffer, NULL);
+	map->rec_map->records_count += count;
+	map->hdr.messages_count += count;
+}
+
+static void test_mail_index_map_clone_records(void)
+{
+	struct mail_index index;
+	struct mail_index_map *map, *map2;
+	struct mail_index_map_stats old_stats;
+	const struct mail_index_map_stats *stats;
+	uint32_t seq;
+
+	test_begin("mail index map clone records");
+	memset(&index, 0, sizeof(index));
+	map = mail_index_map_alloc(&index);
+	test_mail_index_map_add_records(map, 10);
+
+	old_stats = *mail_index_map_get_stats();
+	map2 = mail_index_map_clone(map);
+	stats = mail_index_map_get_stats();
+	test_assert(stats->clone_count == old_stats.clone_count + 1);
+	test_assert(stats->records_copy_count == old_stats.records_copy_count);
+	test_assert(map2->rec_map == map->rec_map);
+
+	/* records appended to the original map after cloning aren't visible
+	   to the clone and shouldn't be copied to it */
+	test_mail_index_map_add_records(map, 5);
+	mail_index_record_map_move_to_private(map2);
+	test_assert(map2->rec_map != map->rec_map);
+	test_assert(stats->records_copy_count == old_stats.records_copy_count + 1);
+	test_assert(stats->records_copy_bytes == old_stats.records_copy_bytes +
+		    10 * sizeof(struct mail_index_record));
+	test_assert(map2->rec_map->records_count == 10);
+	test_assert(map2->rec_map->last_appended_uid == 10);
+	for (seq = 1; seq <= 10; seq++)
+		test_assert(MAIL_INDEX_REC_AT_SEQ(map2, seq)->uid == seq);
+
+	/* the original map is no longer shared, so it's not copied */
+	mail_index_record_map_move_to_private(map);
+	test_assert(stats->records_copy_count == old_stats.records_copy_count + 1);
+	test_assert(map->rec_map->records_count == 15);
+
+	mail_index_unmap(&map);
+	mail_index_unmap(&map2);
+	test_end();
+}
+
+static void test_mail_index_map_private_mmap(void)
+{
+	struct mail_index index;
+	struct mail_index_map *map;
+	struct mail_index_record_map *rec_map;
+	struct mail_index_map_stats old_stats;
+	const struct mail_index_map_stats *stats;
+	struct mail_index_record *recs;
+	uint32_t seq;
+
+	test_begin("mail index map private mmap");
+	memset(&index, 0, sizeof(index));
+	map = mail_index_map_alloc(&index);
+	rec_map = map->rec_map;
+	buffer_free(&rec_map->buffer);
+	rec_map->mmap_size = 8 * sizeof(*recs);
+	rec_map->mmap_base = mmap(NULL, rec_map->mmap_size,
+				  PROT_READ | PROT_WRITE,
+				  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	test_assert(rec_map->mmap_base != MAP_FAILED);
+	recs = rec_map->mmap_base;
+	for (seq = 1; seq <= 8; seq++)
+		recs[seq-1].uid = seq;
+	rec_map->records = recs;
+	rec_map->records_count = map->hdr.messages_count = 8;
+
+	/* an unshared private mapping is modified in place */
+	old_stats = *mail_index_map_get_stats();
+	mail_index_record_map_move_to_private(map);
+	stats = mail_index_map_get_stats();
+	test_assert(map->rec_map == rec_map);
+	test_assert(rec_map->mmap_base == recs);
+	test_assert(stats->records_copy_count == old_stats.records_copy_count);
+	test_assert(stats->records_inplace_count ==
+		    old_stats.records_inplace_count + 1);
+
+	/* shrinking the map (e.g. expunges) doesn't need a buffer either */
+	map->hdr.messages_count = 6;
+	mail_index_record_map_move_to_private(map);
+	test_assert(rec_map->records_count == 6);
+	test_assert(rec_map->last_appended_uid == 6);
+
+	/* moving to memory is the only case where it's copied */
+	mail_index_map_move_to_memory(map);
+	test_assert(MAIL_INDEX_MAP_IS_IN_MEMORY(map));
+	test_assert(stats->records_copy_count == old_stats.records_copy_count + 1);
+	test_assert(MAIL_INDEX_REC_AT_SEQ(map, 6)->uid == 6);
+
+	mail_index_unmap(&map);
+	test_end();
+}
+
 int main(void)
 {
 	static void (*test_functions[])(void) = {
 		test_mail_index_map_lookup_seq_range,
+		test_mail_index_map_clone_records,
+		test_mail_index_map_private_mmap,
 		NULL
 	};
 	return test_run(test_functions);
@@ -4,6 +4,7 @@
 #include "buffer.h"
 #include "istream.h"
 #include "str.h"
+#include "message-scan.h"
 #include "message-size.h"
 #include "message-header-parser.h"
 
@@ -187,13 +188,12 @@ int message_parse_header_next(struct message_header_parser_ctx *ctx,
 		}
 
 		/* find '\n' */
-		for (; i < parse_size; i++) {
-			if (msg[i] <= '\n') {
-				if (msg[i] == '\n')
-					break;
-				if (msg[i] == '\0')
-					ctx->has_nuls = TRUE;
-			}
+		for (;;) {
+			i += message_scan_find_lf_or_nul(msg + i, parse_size - i);
+			if (i == parse_size || msg[i] == '\n')
+				break;
+			ctx->has_nuls = TRUE;
+			i++;
 		}
 
 		if (i < parse_size && i+1 == size && ret == -2) {
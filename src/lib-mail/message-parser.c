@@ -7,6 +7,7 @@
 #include "rfc822-parser.h"
 #include "rfc2231-parser.h"
 #include "message-parser.h"
+#include "message-scan.h"
 
 /* RFC-2046 requires boundaries are max. 70 chars + "--" prefix + "--" suffix.
    We'll add a bit more just in case. */
@@ -89,37 +90,26 @@ boundary_find(struct message_boundary *boundaries,
 static void parse_body_add_block(struct message_parser_ctx *ctx,
 				 struct message_block *block)
 {
-	unsigned int missing_cr_count = 0;
-	const unsigned char *cur, *next, *data = block->data;
+	struct message_scan_result scan;
+	const unsigned char *data = block->data;
 
 	i_assert(block->size > 0);
 
 	block->hdr = NULL;
 
-	/* check if we have NULs */
-	if (memchr(data, '\0', block->size) != NULL)
+	/* count number of lines and missing CRs, and check if we have NULs */
+	memset(&scan, 0, sizeof(scan));
+	message_scan_linefeeds(data, block->size, ctx->last_chr, &scan);
+	if (scan.has_nuls)
 		ctx->part->flags |= MESSAGE_PART_FLAG_HAS_NULS;
+	ctx->part->body_size.lines += scan.lines;
 
-	/* count number of lines and missing CRs */
-	if (*data == '\n') {
-		ctx->part->body_size.lines++;
-		if (ctx->last_chr != '\r')
-			missing_cr_count++;
-	}
-
-	cur = data + 1;
-	while ((next = memchr(cur, '\n', block->size - (cur - data))) != NULL) {
-		ctx->part->body_size.lines++;
-		if (next[-1] != '\r')
-			missing_cr_count++;
-
-		cur = next + 1;
-	}
 	ctx->last_chr = data[block->size - 1];
 	ctx->skip += block->size;
 
 	ctx->part->body_size.physical_size += block->size;
-	ctx->part->body_size.virtual_size += block->size + missing_cr_count;
+	ctx->part->body_size.virtual_size +=
+		block->size + scan.missing_cr_count;
 }
 
 static int message_parser_read_more(struct message_parser_ctx *ctx,
@@ -391,7 +381,9 @@ static int parse_next_body_to_boundary(struct message_parser_ctx *ctx,
 	/* skip to beginning of the next line. the first line was
 	   handled already. */
 	cur = data; end = data + block_r->size;
-	while ((next = memchr(cur, '\n', end - cur)) != NULL) {
+	while ((next = message_scan_find_boundary_lf(cur, end - cur)) != NULL) {
+		/* the lines skipped over can't begin a boundary, so only
+		   the last one matters for boundary_start */
 		cur = next + 1;
 
 		boundary_start = next - data;
@@ -412,6 +404,20 @@ static int parse_next_body_to_boundary(struct message_parser_ctx *ctx,
 			break;
 		}
 	}
+	if (next == NULL) {
+		/* none of the remaining lines can be a boundary, but the
+		   last line may still continue to one in the next block */
+		for (next = end; next > cur; next--) {
+			if (next[-1] == '\n')
+				break;
+		}
+		if (next > cur) {
+			boundary_start = (next - 1) - data;
+			if (next - 1 > data && next[-2] == '\r')
+				boundary_start--;
+		}
+		next = NULL;
+	}
 
 	if (next != NULL) {
 		/* found / need more data */
@@ -0,0 +1,140 @@
+/* Copyright (c) 2016 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "message-scan.h"
+
+#if defined(__GNUC__) && defined(__AVX2__)
+#  include <immintrin.h>
+#  define MESSAGE_SCAN_VECTOR
+#  define VEC_SIZE 32
+typedef __m256i vec_t;
+#  define vec_loadu(p) _mm256_loadu_si256((const __m256i *)(const void *)(p))
+#  define vec_set1(c) _mm256_set1_epi8(c)
+#  define vec_cmpeq(a, b) _mm256_cmpeq_epi8(a, b)
+#  define vec_and(a, b) _mm256_and_si256(a, b)
+#  define vec_or(a, b) _mm256_or_si256(a, b)
+#  define vec_zero() _mm256_setzero_si256()
+#  define vec_mask(v) ((uint32_t)_mm256_movemask_epi8(v))
+#elif defined(__GNUC__) && defined(__SSE2__)
+#  include <emmintrin.h>
+#  define MESSAGE_SCAN_VECTOR
+#  define VEC_SIZE 16
+typedef __m128i vec_t;
+#  define vec_loadu(p) _mm_loadu_si128((const __m128i *)(const void *)(p))
+#  define vec_set1(c) _mm_set1_epi8(c)
+#  define vec_cmpeq(a, b) _mm_cmpeq_epi8(a, b)
+#  define vec_and(a, b) _mm_and_si128(a, b)
+#  define vec_or(a, b) _mm_or_si128(a, b)
+#  define vec_zero() _mm_setzero_si128()
+#  define vec_mask(v) ((uint32_t)_mm_movemask_epi8(v))
+#endif
+
+void message_scan_linefeeds(const unsigned char *data, size_t size,
+			    unsigned char prev_chr,
+			    struct message_scan_result *result)
+{
+	size_t i;
+
+	if (size == 0)
+		return;
+
+	if (data[0] == '\n') {
+		result->lines++;
+		if (prev_chr != '\r')
+			result->missing_cr_count++;
+	} else if (data[0] == '\0') {
+		result->has_nuls = TRUE;
+	}
+	i = 1;
+
+#ifdef MESSAGE_SCAN_VECTOR
+	/* data[i-1] is always accessible here, so the CR check can be done
+	   by comparing the block shifted by one byte. */
+	const vec_t lf = vec_set1('\n'), cr = vec_set1('\r');
+	vec_t nuls = vec_zero();
+	uint32_t lf_mask, cr_mask;
+
+	for (; i + VEC_SIZE <= size; i += VEC_SIZE) {
+		vec_t v = vec_loadu(data + i);
+		vec_t prev = vec_loadu(data + i - 1);
+
+		nuls = vec_or(nuls, vec_cmpeq(v, vec_zero()));
+		lf_mask = vec_mask(vec_cmpeq(v, lf));
+		if (lf_mask == 0)
+			continue;
+		cr_mask = vec_mask(vec_cmpeq(prev, cr));
+		result->lines += __builtin_popcount(lf_mask);
+		result->missing_cr_count +=
+			__builtin_popcount(lf_mask & ~cr_mask);
+	}
+	if (vec_mask(nuls) != 0)
+		result->has_nuls = TRUE;
+#endif
+	for (; i < size; i++) {
+		if (data[i] > '\n')
+			continue;
+		if (data[i] == '\n') {
+			result->lines++;
+			if (data[i-1] != '\r')
+				result->missing_cr_count++;
+		} else if (data[i] == '\0') {
+			result->has_nuls = TRUE;
+		}
+	}
+}
+
+size_t message_scan_find_lf_or_nul(const unsigned char *data, size_t size)
+{
+	size_t i = 0;
+
+#ifdef MESSAGE_SCAN_VECTOR
+	const vec_t lf = vec_set1('\n');
+	uint32_t mask;
+
+	for (; i + VEC_SIZE <= size; i += VEC_SIZE) {
+		vec_t v = vec_loadu(data + i);
+
+		mask = vec_mask(vec_or(vec_cmpeq(v, lf),
+				       vec_cmpeq(v, vec_zero())));
+		if (mask != 0)
+			return i + __builtin_ctz(mask);
+	}
+#endif
+	for (; i < size; i++) {
+		if (data[i] <= '\n' && (data[i] == '\n' || data[i] == '\0'))
+			break;
+	}
+	return i;
+}
+
+const unsigned char *
+message_scan_find_boundary_lf(const unsigned char *data, size_t size)
+{
+	const unsigned char *p;
+	size_t i = 0;
+
+#ifdef MESSAGE_SCAN_VECTOR
+	const vec_t lf = vec_set1('\n'), dash = vec_set1('-');
+	uint32_t mask;
+
+	/* look for "\n--" - the two bytes after the block must be
+	   accessible */
+	for (; i + VEC_SIZE + 2 <= size; i += VEC_SIZE) {
+		mask = vec_mask(vec_cmpeq(vec_loadu(data + i), lf));
+		if (mask == 0)
+			continue;
+		mask &= vec_mask(vec_and(vec_cmpeq(vec_loadu(data + i + 1), dash),
+					 vec_cmpeq(vec_loadu(data + i + 2), dash)));
+		if (mask != 0)
+			return data + i + __builtin_ctz(mask);
+	}
+#endif
+	while ((p = memchr(data + i, '\n', size - i)) != NULL) {
+		i = p - data;
+		if (size - i - 1 < 2 ||
+		    (data[i+1] == '-' && data[i+2] == '-'))
+			return p;
+		i++;
+	}
+	return NULL;
+}
@@ -0,0 +1,29 @@
+#ifndef MESSAGE_SCAN_H
+#define MESSAGE_SCAN_H
+
+/* Helpers for scanning message data for linefeeds and MIME boundary lines.
+   These use SSE2/AVX2 when the compiler has them enabled, and fallback to
+   scalar code otherwise. */
+
+struct message_scan_result {
+	/* number of LFs */
+	unsigned int lines;
+	/* number of LFs that weren't preceded by CR */
+	unsigned int missing_cr_count;
+	bool has_nuls;
+};
+
+/* Count linefeeds in data and add them to result. prev_chr is the character
+   before data (used for checking whether the first LF has CR before it). */
+void message_scan_linefeeds(const unsigned char *data, size_t size,
+			    unsigned char prev_chr,
+			    struct message_scan_result *result);
+/* Returns offset to the first LF or NUL in data, or size if none found. */
+size_t message_scan_find_lf_or_nul(const unsigned char *data, size_t size);
+/* Returns pointer to the first LF that may begin a "\n--boundary" line, i.e.
+   it's followed by "--" or there are less than 2 bytes after it. Returns
+   NULL if there are none. */
+const unsigned char *
+message_scan_find_boundary_lf(const unsigned char *data, size_t size);
+
+#endif
@@ -3,6 +3,7 @@
 #include "lib.h"
 #include "istream.h"
 #include "message-parser.h"
+#include "message-scan.h"
 #include "message-size.h"
 
 int message_get_header_size(struct istream *input, struct message_size *hdr,
@@ -68,6 +69,7 @@ int message_get_header_size(struct istream *input, struct message_size *hdr,
 int message_get_body_size(struct istream *input, struct message_size *body,
 			  bool *has_nuls_r)
 {
+	struct message_scan_result scan;
 	const unsigned char *msg;
 	size_t i, size, missing_cr_count;
 	int ret;
@@ -85,23 +87,13 @@ int message_get_body_size(struct istream *input, struct message_size *body,
 		missing_cr_count++;
 
 	do {
-		for (i = 1; i < size; i++) {
-			if (msg[i] > '\n')
-				continue;
-
-			if (msg[i] == '\n') {
-				if (msg[i-1] != '\r') {
-					/* missing CR */
-					missing_cr_count++;
-				}
-
-				/* increase after making sure we didn't break
-				   at virtual \r */
-				body->lines++;
-			} else if (msg[i] == '\0') {
-				*has_nuls_r = TRUE;
-			}
-		}
+		memset(&scan, 0, sizeof(scan));
+		message_scan_linefeeds(msg + 1, size - 1, msg[0], &scan);
+		missing_cr_count += scan.missing_cr_count;
+		body->lines += scan.lines;
+		if (scan.has_nuls)
+			*has_nuls_r = TRUE;
+		i = size;
 
 		/* leave the last character, it may be \r */
 		i_stream_skip(input, i - 1);
@@ -2,10 +2,14 @@
 
 #include "lib.h"
 #include "str.h"
+#include "strnum.h"
 #include "istream.h"
+#include "time-util.h"
 #include "message-parser.h"
 #include "test-common.h"
 
+#include <stdio.h>
+
 static const char test_msg[] =
 "Return-Path: <test@example.org>\n"
 "Subject: Hello world\n"
@@ -643,7 +647,65 @@ static void test_message_parser_no_eoh(void)
 	test_end();
 }
 
-int main(void)
+static int test_message_parser_benchmark(unsigned int mbytes)
+{
+	static const char hdr[] =
+		"From: user@example.com\r\n"
+		"Content-Type: multipart/mixed; boundary=\"bench-boundary\"\r\n"
+		"\r\n";
+	static const char part_hdr[] =
+		"--bench-boundary\r\n"
+		"Content-Type: text/plain\r\n"
+		"\r\n";
+	static const char line[] =
+		"Lorem ipsum dolor sit amet, consectetur adipiscing elit, "
+		"sed do eiusmod tempor incididunt ut labore.\r\n";
+	struct message_parser_ctx *parser;
+	struct istream *input;
+	struct message_part *parts;
+	struct message_block block;
+	struct timeval tv_start, tv_end;
+	pool_t pool;
+	string_t *str;
+	unsigned int i;
+	size_t size;
+	long long usecs;
+	int ret;
+
+	lib_init();
+	str = str_new(default_pool, mbytes * 1024 * 1024 + 1024);
+	str_append(str, hdr);
+	while (str_len(str) < mbytes * 1024 * 1024) {
+		str_append(str, part_hdr);
+		for (i = 0; i < 100; i++)
+			str_append(str, line);
+	}
+	str_append(str, "--bench-boundary--\r\n");
+
+	pool = pool_alloconly_create("message parser", 1024*64);
+	input = i_stream_create_from_data(str_data(str), str_len(str));
+	if (gettimeofday(&tv_start, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
+	parser = message_parser_init(pool, input, 0, 0);
+	while ((ret = message_parser_parse_next_block(parser, &block)) > 0) ;
+	message_parser_deinit(&parser, &parts);
+	if (gettimeofday(&tv_end, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
+	i_assert(ret < 0 && input->stream_errno == 0);
+
+	size = str_len(str);
+	usecs = timeval_diff_usecs(&tv_end, &tv_start);
+	printf("%"PRIuSIZE_T" bytes parsed in %lld usecs: %.1f MB/s\n",
+	       size, usecs, usecs == 0 ? 0.0 : (double)size / usecs);
+
+	i_stream_unref(&input);
+	pool_unref(&pool);
+	str_free(&str);
+	lib_deinit();
+	return 0;
+}
+
+int main(int argc, char *argv[])
 {
 	static void (*test_functions[])(void) = {
 		test_message_parser_small_blocks,
@@ -658,5 +720,15 @@ int main(void)
 		test_message_parser_no_eoh,
 		NULL
 	};
+	/* "bench [<MB>]" measures parsing throughput of a large multipart
+	   message instead of running the tests */
+	if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+		unsigned int mbytes = 64;
+
+		if (argc > 2 && (str_to_uint(argv[2], &mbytes) < 0 ||
+				 mbytes == 0 || mbytes > 1024))
+			i_fatal("Invalid benchmark size: %s", argv[2]);
+		return test_message_parser_benchmark(mbytes);
+	}
 	return test_run(test_functions);
 }
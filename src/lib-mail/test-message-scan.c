@@ -0,0 +1,123 @@
+/* Copyright (c) 2016 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "message-scan.h"
+#include "test-common.h"
+
+static void
+test_scan_linefeeds_ref(const unsigned char *data, size_t size,
+			unsigned char prev_chr,
+			struct message_scan_result *result)
+{
+	size_t i;
+
+	for (i = 0; i < size; i++) {
+		if (data[i] == '\n') {
+			result->lines++;
+			if ((i == 0 ? prev_chr : data[i-1]) != '\r')
+				result->missing_cr_count++;
+		} else if (data[i] == '\0') {
+			result->has_nuls = TRUE;
+		}
+	}
+}
+
+static const unsigned char *
+test_find_boundary_lf_ref(const unsigned char *data, size_t size)
+{
+	size_t i;
+
+	for (i = 0; i < size; i++) {
+		if (data[i] == '\n' &&
+		    (i + 2 >= size || (data[i+1] == '-' && data[i+2] == '-')))
+			return data + i;
+	}
+	return NULL;
+}
+
+static void test_fill_random(unsigned char *data, size_t size)
+{
+	static const unsigned char chars[] = "\r\n-\0ab";
+	/* mostly plain text with occasional special characters */
+	unsigned int special_freq = rand() % 64 + 1;
+	size_t i;
+
+	for (i = 0; i < size; i++) {
+		if (rand() % special_freq == 0)
+			data[i] = chars[rand() % (sizeof(chars)-1)];
+		else
+			data[i] = 'x';
+	}
+}
+
+static void test_message_scan_linefeeds(void)
+{
+	unsigned char data[200];
+	struct message_scan_result result, ref;
+	unsigned int i, size;
+
+	test_begin("message scan linefeeds");
+	for (i = 0; i < 1000; i++) {
+		size = rand() % sizeof(data);
+		test_fill_random(data, size);
+
+		memset(&result, 0, sizeof(result));
+		memset(&ref, 0, sizeof(ref));
+		message_scan_linefeeds(data, size, i % 2 == 0 ? '\r' : 'x',
+				       &result);
+		test_scan_linefeeds_ref(data, size, i % 2 == 0 ? '\r' : 'x',
+					&ref);
+		test_assert_idx(result.lines == ref.lines, i);
+		test_assert_idx(result.missing_cr_count == ref.missing_cr_count, i);
+		test_assert_idx(result.has_nuls == ref.has_nuls, i);
+	}
+	test_end();
+}
+
+static void test_message_scan_find_lf_or_nul(void)
+{
+	unsigned char data[200];
+	unsigned int i, size;
+	size_t pos;
+
+	test_begin("message scan find lf or nul");
+	for (i = 0; i < 1000; i++) {
+		size = rand() % sizeof(data);
+		test_fill_random(data, size);
+
+		pos = message_scan_find_lf_or_nul(data, size);
+		test_assert_idx(pos <= size, i);
+		test_assert_idx(pos == size ||
+				data[pos] == '\n' || data[pos] == '\0', i);
+		test_assert_idx(memchr(data, '\n', pos) == NULL &&
+				memchr(data, '\0', pos) == NULL, i);
+	}
+	test_end();
+}
+
+static void test_message_scan_find_boundary_lf(void)
+{
+	unsigned char data[200];
+	unsigned int i, size;
+
+	test_begin("message scan find boundary lf");
+	for (i = 0; i < 1000; i++) {
+		size = rand() % sizeof(data);
+		test_fill_random(data, size);
+
+		test_assert_idx(message_scan_find_boundary_lf(data, size) ==
+				test_find_boundary_lf_ref(data, size), i);
+	}
+	test_end();
+}
+
+int main(void)
+{
+	static void (*test_functions[])(void) = {
+		test_message_scan_linefeeds,
+		test_message_scan_find_lf_or_nul,
+		test_message_scan_find_boundary_lf,
+		NULL
+	};
+	return test_run(test_functions);
+}
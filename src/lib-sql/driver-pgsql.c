@@ -3,6 +3,7 @@
 #include "lib.h"
 #include "array.h"
 #include "ioloop.h"
+#include "hash.h"
 #include "hex-binary.h"
 #include "str.h"
 #include "time-util.h"
@@ -12,6 +13,9 @@
 #include <libpq-fe.h>
 
 #define PGSQL_DNS_WARN_MSECS 500
+/* Maximum number of statements prepared per connection. Statements beyond
+   this are sent as unnamed queries with parameters. */
+#define PGSQL_MAX_PREPARED_STATEMENTS 256
 
 struct pgsql_db {
 	struct sql_db api;
@@ -35,7 +39,15 @@ struct pgsql_db {
 	char *error;
 	const char *connect_state;
 
+	/* query_template => prepared statement name. Prepared statements
+	   exist only for the lifetime of the connection. */
+	HASH_TABLE(char *, char *) prepared_stmts;
+	pool_t prepared_stmts_pool;
+	unsigned int prepared_stmt_counter;
+
 	bool fatal_error:1;
+	/* The current query was sent in pipeline mode */
+	bool pipeline:1;
 };
 
 struct pgsql_binary_value {
@@ -59,6 +71,8 @@ struct pgsql_result {
 	void *context;
 
 	bool timeout:1;
+	/* PREPARE was pipelined before the query. Its result comes first. */
+	bool prepare_pending:1;
 };
 
 struct pgsql_transaction_context {
@@ -131,6 +145,10 @@ static void driver_pgsql_close(struct pgsql_db *db)
 
 	PQfinish(db->pg);
 	db->pg = NULL;
+	db->pipeline = FALSE;
+
+	hash_table_clear(db->prepared_stmts, TRUE);
+	p_clear(db->prepared_stmts_pool);
 
 	if (db->to_connect != NULL)
 		timeout_remove(&db->to_connect);
@@ -281,6 +299,10 @@ static struct sql_db *driver_pgsql_init_v(const char *connect_string)
 	db = i_new(struct pgsql_db, 1);
 	db->connect_string = i_strdup(connect_string);
 	db->api = driver_pgsql_db;
+	db->prepared_stmts_pool =
+		pool_alloconly_create("pgsql prepared statements", 1024);
+	hash_table_create(&db->prepared_stmts, default_pool, 0,
+			  str_hash, strcmp);
 
 	T_BEGIN {
 		const char *const *arg = t_strsplit(connect_string, " ");
@@ -298,6 +320,8 @@ static void driver_pgsql_deinit_v(struct sql_db *_db)
 	struct pgsql_db *db = (struct pgsql_db *)_db;
 
 	driver_pgsql_disconnect(_db);
+	hash_table_destroy(&db->prepared_stmts);
+	pool_unref(&db->prepared_stmts_pool);
 	i_free(db->host);
 	i_free(db->error);
 	i_free(db->connect_string);
@@ -315,6 +339,18 @@ static void driver_pgsql_set_idle(struct pgsql_db *db)
 		driver_pgsql_set_state(db, SQL_DB_STATE_IDLE);
 }
 
+#ifdef LIBPQ_HAS_PIPELINING
+static void driver_pgsql_pipeline_exit(struct pgsql_db *db)
+{
+	db->pipeline = FALSE;
+	if (PQexitPipelineMode(db->pg) == 0) {
+		i_error("%s: PQexitPipelineMode() failed: %s",
+			pgsql_prefix(db), last_error(db));
+		db->fatal_error = TRUE;
+	}
+}
+#endif
+
 static void consume_results(struct pgsql_db *db)
 {
 	PGresult *pgres;
@@ -330,8 +366,21 @@ static void consume_results(struct pgsql_db *db)
 		}
 
 		pgres = PQgetResult(db->pg);
-		if (pgres == NULL)
+		if (pgres == NULL) {
+			/* in pipeline mode this only ends the current
+			   query's results. continue until the sync. */
+			if (!db->pipeline)
+				break;
+			continue;
+		}
+#ifdef LIBPQ_HAS_PIPELINING
+		if (db->pipeline &&
+		    PQresultStatus(pgres) == PGRES_PIPELINE_SYNC) {
+			PQclear(pgres);
+			driver_pgsql_pipeline_exit(db);
 			break;
+		}
+#endif
 		PQclear(pgres);
 	}
 
@@ -355,7 +404,9 @@ static void driver_pgsql_result_free(struct sql_result *_result)
 		db->sync_result = NULL;
 	db->cur_result = NULL;
 
-	success = result->pgres != NULL && !db->fatal_error;
+	/* with pipelining the sync still needs to be read even when the
+	   query's results were already read */
+	success = (result->pgres != NULL || db->pipeline) && !db->fatal_error;
 	if (result->pgres != NULL) {
 		PQclear(result->pgres);
 		result->pgres = NULL;
@@ -436,6 +487,20 @@ static void get_result(struct pgsql_result *result)
 	}
 
 	result->pgres = PQgetResult(db->pg);
+	if (result->prepare_pending && result->pgres != NULL &&
+	    PQresultStatus(result->pgres) == PGRES_COMMAND_OK) {
+		/* PREPARE succeeded. skip over its terminating NULL and
+		   wait for the actual query's result. if it failed, the
+		   error is returned as the query's result. */
+		result->prepare_pending = FALSE;
+		PQclear(result->pgres);
+		result->pgres = PQgetResult(db->pg);
+		if (result->pgres != NULL)
+			PQclear(result->pgres);
+		result->pgres = NULL;
+		get_result(result);
+		return;
+	}
 	result_finish(result);
 }
 
@@ -473,10 +538,94 @@ static void query_timeout(struct pgsql_result *result)
 	result_finish(result);
 }
 
-static void do_query(struct pgsql_result *result, const char *query)
+static const char *
+driver_pgsql_get_param_placeholder(unsigned int idx,
+				   void *context ATTR_UNUSED)
+{
+	return t_strdup_printf("$%u", idx + 1);
+}
+
+static int
+driver_pgsql_send_statement(struct pgsql_result *result,
+			    const struct sql_statement *stmt)
 {
         struct pgsql_db *db = (struct pgsql_db *)result->api.db;
-	int ret;
+	const struct sql_statement_param *params;
+	const char *query, *name, **values;
+	int *lengths, *formats;
+	unsigned int i, count;
+
+	params = array_get(&stmt->params, &count);
+	values = t_new(const char *, count + 1);
+	lengths = t_new(int, count + 1);
+	formats = t_new(int, count + 1);
+	for (i = 0; i < count; i++) {
+		switch (params[i].type) {
+		case SQL_STATEMENT_PARAM_TYPE_NULL:
+			break;
+		case SQL_STATEMENT_PARAM_TYPE_STR:
+			values[i] = params[i].value_str;
+			break;
+		case SQL_STATEMENT_PARAM_TYPE_BINARY:
+			values[i] = (const char *)params[i].value_binary;
+			lengths[i] = params[i].value_binary_size;
+			formats[i] = 1;
+			break;
+		case SQL_STATEMENT_PARAM_TYPE_INT64:
+			values[i] = t_strdup_printf("%lld",
+				(long long)params[i].value_int64);
+			break;
+		}
+	}
+
+	if (stmt->prepared) {
+		name = hash_table_lookup(db->prepared_stmts,
+					 stmt->query_template);
+		if (name != NULL) {
+			return PQsendQueryPrepared(db->pg, name, count, values,
+						   lengths, formats, 0);
+		}
+	}
+
+	query = t_sql_query_template_expand(stmt->query_template,
+		driver_pgsql_get_param_placeholder, NULL);
+#ifdef LIBPQ_HAS_PIPELINING
+	if (stmt->prepared &&
+	    hash_table_count(db->prepared_stmts) < PGSQL_MAX_PREPARED_STATEMENTS) {
+		char *new_name;
+
+		/* send PREPARE and the query in the same round trip. the
+		   name is remembered already now - if PREPARE fails, it's a
+		   fatal error that closes the connection anyway. */
+		new_name = p_strdup_printf(db->prepared_stmts_pool,
+					   "dovecot_%u",
+					   ++db->prepared_stmt_counter);
+		if (PQenterPipelineMode(db->pg) == 0)
+			return 0;
+		db->pipeline = TRUE;
+		result->prepare_pending = TRUE;
+		if (PQsendPrepare(db->pg, new_name, query, 0, NULL) == 0 ||
+		    PQsendQueryPrepared(db->pg, new_name, count, values,
+					lengths, formats, 0) == 0 ||
+		    PQpipelineSync(db->pg) == 0)
+			return 0;
+		hash_table_insert(db->prepared_stmts,
+			p_strdup(db->prepared_stmts_pool, stmt->query_template),
+			new_name);
+		return 1;
+	}
+#endif
+	/* without pipelining a separate PREPARE would cost an extra round
+	   trip, so just send the parameters with an unnamed query */
+	return PQsendQueryParams(db->pg, query, count, NULL, values,
+				 lengths, formats, 0);
+}
+
+static void do_query(struct pgsql_result *result, const char *query,
+		     const struct sql_statement *stmt)
+{
+        struct pgsql_db *db = (struct pgsql_db *)result->api.db;
+	int ret, send_ret;
 
 	i_assert(SQL_DB_IS_READY(&db->api));
 	i_assert(db->cur_result == NULL);
@@ -487,8 +636,12 @@ static void do_query(struct pgsql_result *result, const char *query)
 	result->to = timeout_add(SQL_QUERY_TIMEOUT_SECS * 1000,
 				 query_timeout, result);
 
-	if (PQsendQuery(db->pg, query) == 0 ||
-	    (ret = PQflush(db->pg)) < 0) {
+	if (stmt == NULL)
+		send_ret = PQsendQuery(db->pg, query);
+	else T_BEGIN {
+		send_ret = driver_pgsql_send_statement(result, stmt);
+	} T_END;
+	if (send_ret == 0 || (ret = PQflush(db->pg)) < 0) {
 		/* failed to send query */
 		result_finish(result);
 		return;
@@ -548,7 +701,7 @@ static void driver_pgsql_exec(struct sql_db *db, const char *query)
 	result->api.db = db;
 	result->api.refcount = 1;
 	result->callback = exec_callback;
-	do_query(result, query);
+	do_query(result, query, NULL);
 }
 
 static void driver_pgsql_query(struct sql_db *db, const char *query,
@@ -562,7 +715,22 @@ static void driver_pgsql_query(struct sql_db *db, const char *query,
 	result->api.refcount = 1;
 	result->callback = callback;
 	result->context = context;
-	do_query(result, query);
+	do_query(result, query, NULL);
+}
+
+static void
+driver_pgsql_statement_query(struct sql_db *db, struct sql_statement *stmt,
+			     sql_query_callback_t *callback, void *context)
+{
+	struct pgsql_result *result;
+
+	result = i_new(struct pgsql_result, 1);
+	result->api = driver_pgsql_result;
+	result->api.db = db;
+	result->api.refcount = 1;
+	result->callback = callback;
+	result->context = context;
+	do_query(result, NULL, stmt);
 }
 
 static void pgsql_query_s_callback(struct sql_result *result, void *context)
@@ -609,7 +777,8 @@ static void driver_pgsql_sync_deinit(struct pgsql_db *db)
 }
 
 static struct sql_result *
-driver_pgsql_sync_query(struct pgsql_db *db, const char *query)
+driver_pgsql_sync_query(struct pgsql_db *db, const char *query,
+			struct sql_statement *stmt)
 {
 	struct sql_result *result;
 
@@ -626,7 +795,12 @@ driver_pgsql_sync_query(struct pgsql_db *db, const char *query)
 		break;
 	}
 
-	driver_pgsql_query(&db->api, query, pgsql_query_s_callback, db);
+	if (stmt == NULL)
+		driver_pgsql_query(&db->api, query, pgsql_query_s_callback, db);
+	else {
+		driver_pgsql_statement_query(&db->api, stmt,
+					     pgsql_query_s_callback, db);
+	}
 	if (db->sync_result == NULL)
 		io_loop_run(db->ioloop);
 
@@ -653,7 +827,19 @@ driver_pgsql_query_s(struct sql_db *_db, const char *query)
 	struct sql_result *result;
 
 	driver_pgsql_sync_init(db);
-	result = driver_pgsql_sync_query(db, query);
+	result = driver_pgsql_sync_query(db, query, NULL);
+	driver_pgsql_sync_deinit(db);
+	return result;
+}
+
+static struct sql_result *
+driver_pgsql_statement_query_s(struct sql_db *_db, struct sql_statement *stmt)
+{
+	struct pgsql_db *db = (struct pgsql_db *)_db;
+	struct sql_result *result;
+
+	driver_pgsql_sync_init(db);
+	result = driver_pgsql_sync_query(db, NULL, stmt);
 	driver_pgsql_sync_deinit(db);
 	return result;
 }
@@ -1042,7 +1228,7 @@ driver_pgsql_transaction_commit_multi(struct pgsql_transaction_context *ctx)
 	struct sql_result *result;
 	struct sql_transaction_query *query;
 
-	result = driver_pgsql_sync_query(db, "BEGIN");
+	result = driver_pgsql_sync_query(db, "BEGIN", NULL);
 	if (sql_result_next_row(result) < 0) {
 		commit_multi_fail(ctx, result, "BEGIN");
 		return NULL;
@@ -1051,7 +1237,7 @@ driver_pgsql_transaction_commit_multi(struct pgsql_transaction_context *ctx)
 
 	/* send queries */
 	for (query = ctx->ctx.head; query != NULL; query = query->next) {
-		result = driver_pgsql_sync_query(db, query->query);
+		result = driver_pgsql_sync_query(db, query->query, NULL);
 		if (sql_result_next_row(result) < 0) {
 			commit_multi_fail(ctx, result, query->query);
 			break;
@@ -1068,7 +1254,7 @@ driver_pgsql_transaction_commit_multi(struct pgsql_transaction_context *ctx)
 	}
 
 	return driver_pgsql_sync_query(db, ctx->failed ?
-				       "ROLLBACK" : "COMMIT");
+				       "ROLLBACK" : "COMMIT", NULL);
 }
 
 static void
@@ -1191,7 +1377,10 @@ const struct sql_db driver_pgsql_db = {
 
 		driver_pgsql_update,
 
-		driver_pgsql_escape_blob
+		driver_pgsql_escape_blob,
+
+		driver_pgsql_statement_query,
+		driver_pgsql_statement_query_s
 	}
 };
 
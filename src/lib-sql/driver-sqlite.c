@@ -3,6 +3,7 @@
 #include "lib.h"
 #include "array.h"
 #include "str.h"
+#include "hash.h"
 #include "hex-binary.h"
 #include "sql-api-private.h"
 
@@ -11,6 +12,15 @@
 
 /* retry time if db is busy (in ms) */
 static const int sqlite_busy_timeout = 1000;
+/* Maximum number of prepared statements kept compiled per database.
+   Statements beyond this are compiled for each query. */
+#define SQLITE_MAX_PREPARED_STATEMENTS 256
+
+struct sqlite_prepared_stmt {
+	sqlite3_stmt *stmt;
+	/* an unfreed result is still using this statement */
+	bool in_use;
+};
 
 struct sqlite_db {
 	struct sql_db api;
@@ -20,6 +30,9 @@ struct sqlite_db {
 	sqlite3 *sqlite;
 	bool connected:1;
 	int rc;
+
+	/* query_template => compiled statement */
+	HASH_TABLE(char *, struct sqlite_prepared_stmt *) prepared_stmts;
 };
 
 struct sqlite_result {
@@ -27,6 +40,9 @@ struct sqlite_result {
 	sqlite3_stmt *stmt;
 	unsigned int cols;
 	const char **row;
+
+	/* stmt is owned by this prepared statement */
+	struct sqlite_prepared_stmt *prep_stmt;
 };
 
 struct sqlite_transaction_context {
@@ -60,12 +76,31 @@ static int driver_sqlite_connect(struct sql_db *_db)
 	}
 }
 
+static void driver_sqlite_prepared_stmts_free(struct sqlite_db *db)
+{
+	struct hash_iterate_context *iter;
+	struct sqlite_prepared_stmt *prep_stmt;
+	char *query_template;
+
+	iter = hash_table_iterate_init(db->prepared_stmts);
+	while (hash_table_iterate(iter, db->prepared_stmts,
+				  &query_template, &prep_stmt)) {
+		i_assert(!prep_stmt->in_use);
+		(void)sqlite3_finalize(prep_stmt->stmt);
+	}
+	hash_table_iterate_deinit(&iter);
+	/* the keys and values are left to the db pool */
+	hash_table_clear(db->prepared_stmts, TRUE);
+}
+
 static void driver_sqlite_disconnect(struct sql_db *_db)
 {
  	struct sqlite_db *db = (struct sqlite_db *)_db;
 
+	driver_sqlite_prepared_stmts_free(db);
 	sqlite3_close(db->sqlite);
 	db->sqlite = NULL;
+	db->connected = FALSE;
 }
 
 static struct sql_db *driver_sqlite_init_v(const char *connect_string)
@@ -81,6 +116,8 @@ static struct sql_db *driver_sqlite_init_v(const char *connect_string)
 	db->api = driver_sqlite_db;
 	db->dbfile = p_strdup(db->pool, connect_string);
 	db->connected = FALSE;
+	hash_table_create(&db->prepared_stmts, default_pool, 0,
+			  str_hash, strcmp);
 
 	return &db->api;
 }
@@ -92,6 +129,8 @@ static void driver_sqlite_deinit_v(struct sql_db *_db)
 	_db->no_reconnect = TRUE;
 	sql_db_set_state(&db->api, SQL_DB_STATE_DISCONNECTED);
 
+	driver_sqlite_prepared_stmts_free(db);
+	hash_table_destroy(&db->prepared_stmts);
 	sqlite3_close(db->sqlite);
 	array_free(&_db->module_contexts);
 	pool_unref(&db->pool);
@@ -184,6 +223,130 @@ driver_sqlite_query_s(struct sql_db *_db, const char *query)
 	return &result->api;
 }
 
+static struct sqlite_prepared_stmt *
+driver_sqlite_prepared_stmt_get(struct sqlite_db *db,
+				const char *query_template)
+{
+	struct sqlite_prepared_stmt *prep_stmt;
+	sqlite3_stmt *stmt;
+
+	prep_stmt = hash_table_lookup(db->prepared_stmts, query_template);
+	if (prep_stmt != NULL) {
+		/* a nested query with the same statement is compiled
+		   separately */
+		return prep_stmt->in_use ? NULL : prep_stmt;
+	}
+	if (hash_table_count(db->prepared_stmts) >=
+	    SQLITE_MAX_PREPARED_STATEMENTS)
+		return NULL;
+
+	if (sqlite3_prepare_v2(db->sqlite, query_template, -1,
+			       &stmt, NULL) != SQLITE_OK)
+		return NULL;
+	prep_stmt = p_new(db->pool, struct sqlite_prepared_stmt, 1);
+	prep_stmt->stmt = stmt;
+	hash_table_insert(db->prepared_stmts,
+			  p_strdup(db->pool, query_template), prep_stmt);
+	return prep_stmt;
+}
+
+static void
+driver_sqlite_prepared_stmt_release(struct sqlite_prepared_stmt *prep_stmt)
+{
+	/* errors were already returned by sqlite3_step() */
+	(void)sqlite3_reset(prep_stmt->stmt);
+	(void)sqlite3_clear_bindings(prep_stmt->stmt);
+	prep_stmt->in_use = FALSE;
+}
+
+static int
+driver_sqlite_bind(sqlite3_stmt *sqlite_stmt, const struct sql_statement *stmt)
+{
+	const struct sql_statement_param *param;
+	int rc = SQLITE_OK, idx = 0;
+
+	array_foreach(&stmt->params, param) {
+		idx++;
+		switch (param->type) {
+		case SQL_STATEMENT_PARAM_TYPE_NULL:
+			rc = sqlite3_bind_null(sqlite_stmt, idx);
+			break;
+		case SQL_STATEMENT_PARAM_TYPE_STR:
+			rc = sqlite3_bind_text(sqlite_stmt, idx,
+					       param->value_str, -1,
+					       SQLITE_TRANSIENT);
+			break;
+		case SQL_STATEMENT_PARAM_TYPE_BINARY:
+			rc = sqlite3_bind_blob(sqlite_stmt, idx,
+					       param->value_binary,
+					       param->value_binary_size,
+					       SQLITE_TRANSIENT);
+			break;
+		case SQL_STATEMENT_PARAM_TYPE_INT64:
+			rc = sqlite3_bind_int64(sqlite_stmt, idx,
+						param->value_int64);
+			break;
+		}
+		if (rc != SQLITE_OK)
+			break;
+	}
+	return rc;
+}
+
+static struct sql_result *
+driver_sqlite_statement_query_s(struct sql_db *_db, struct sql_statement *stmt)
+{
+	struct sqlite_db *db = (struct sqlite_db *)_db;
+	struct sqlite_result *result;
+	int rc;
+
+	result = i_new(struct sqlite_result, 1);
+	result->api = driver_sqlite_error_result;
+	result->api.db = _db;
+	result->api.refcount = 1;
+
+	if (driver_sqlite_connect(_db) < 0)
+		return &result->api;
+
+	if (stmt->prepared)
+		result->prep_stmt =
+			driver_sqlite_prepared_stmt_get(db, stmt->query_template);
+	if (result->prep_stmt != NULL) {
+		result->prep_stmt->in_use = TRUE;
+		result->stmt = result->prep_stmt->stmt;
+		rc = SQLITE_OK;
+	} else {
+		rc = sqlite3_prepare_v2(db->sqlite, stmt->query_template, -1,
+					&result->stmt, NULL);
+	}
+	if (rc == SQLITE_OK)
+		rc = driver_sqlite_bind(result->stmt, stmt);
+	if (rc != SQLITE_OK) {
+		/* error result: the statement is freed with it */
+		return &result->api;
+	}
+
+	result->api.v = driver_sqlite_result.v;
+	result->cols = sqlite3_column_count(result->stmt);
+	/* INSERT, UPDATE etc. don't have any columns */
+	if (result->cols > 0)
+		result->row = i_new(const char *, result->cols);
+	return &result->api;
+}
+
+static void
+driver_sqlite_statement_query(struct sql_db *db, struct sql_statement *stmt,
+			      sql_query_callback_t *callback, void *context)
+{
+	struct sql_result *result;
+
+	result = driver_sqlite_statement_query_s(db, stmt);
+	result->callback = TRUE;
+	callback(result, context);
+	result->callback = FALSE;
+	sql_result_unref(result);
+}
+
 static void driver_sqlite_result_free(struct sql_result *_result)
 {
 	struct sqlite_result *result = (struct sqlite_result *)_result;
@@ -193,7 +356,10 @@ static void driver_sqlite_result_free(struct sql_result *_result)
 	if (_result->callback)
 		return;
 
-	if (result->stmt != NULL) {
+	if (result->prep_stmt != NULL) {
+		driver_sqlite_prepared_stmt_release(result->prep_stmt);
+		i_free(result->row);
+	} else if (result->stmt != NULL) {
 		if ((rc = sqlite3_finalize(result->stmt)) != SQLITE_OK) {
 			i_warning("sqlite: finalize failed: %s (%d)",
 				  sqlite3_errmsg(db->sqlite), rc);
@@ -426,7 +592,10 @@ const struct sql_db driver_sqlite_db = {
 		driver_sqlite_transaction_rollback,
 		driver_sqlite_update,
 
-		driver_sqlite_escape_blob
+		driver_sqlite_escape_blob,
+
+		driver_sqlite_statement_query,
+		driver_sqlite_statement_query_s
 	}
 };
 
@@ -51,6 +51,8 @@ struct sqlpool_request {
 
 	/* requests are a) queries */
 	char *query;
+	/* prepared statement queries also have the statement */
+	struct sql_statement *stmt;
 	sql_query_callback_t *callback;
 	void *context;
 
@@ -100,6 +102,8 @@ sqlpool_request_free(struct sqlpool_request **_request)
 	*_request = NULL;
 
 	i_assert(request->prev == NULL && request->next == NULL);
+	if (request->stmt != NULL)
+		sql_statement_unref(&request->stmt);
 	i_free(request->query);
 	i_free(request);
 }
@@ -150,6 +154,19 @@ sqlpool_request_handle_transaction(struct sql_db *conndb,
 			       driver_sqlpool_commit_callback, trans);
 }
 
+static void
+sqlpool_request_query(struct sqlpool_request *request, struct sql_db *conndb)
+{
+	if (request->stmt != NULL) {
+		sql_db_statement_query(conndb, request->stmt,
+			(sql_query_callback_t *)driver_sqlpool_query_callback,
+			request);
+	} else {
+		sql_query(conndb, request->query,
+			  driver_sqlpool_query_callback, request);
+	}
+}
+
 static void
 sqlpool_request_send_next(struct sqlpool_db *db, struct sql_db *conndb)
 {
@@ -163,8 +180,7 @@ sqlpool_request_send_next(struct sqlpool_db *db, struct sql_db *conndb)
 	timeout_reset(db->request_to);
 
 	if (request->query != NULL) {
-		sql_query(conndb, request->query,
-			  driver_sqlpool_query_callback, request);
+		sqlpool_request_query(request, conndb);
 	} else if (request->trans != NULL) {
 		sqlpool_request_handle_transaction(conndb, request->trans);
 	} else {
@@ -642,25 +658,31 @@ driver_sqlpool_query_callback(struct sql_result *result,
 	}
 }
 
+static void
+driver_sqlpool_request_query(struct sqlpool_db *db,
+			     struct sqlpool_request *request)
+{
+	const struct sqlpool_connection *conn;
+
+	if (!driver_sqlpool_get_connection(db, UINT_MAX, &conn))
+		driver_sqlpool_append_request(db, request);
+	else {
+		request->host_idx = conn->host_idx;
+		sqlpool_request_query(request, conn->db);
+	}
+}
+
 static void ATTR_NULL(3, 4)
 driver_sqlpool_query(struct sql_db *_db, const char *query,
 		     sql_query_callback_t *callback, void *context)
 {
         struct sqlpool_db *db = (struct sqlpool_db *)_db;
 	struct sqlpool_request *request;
-	const struct sqlpool_connection *conn;
 
 	request = sqlpool_request_new(db, query);
 	request->callback = callback;
 	request->context = context;
-
-	if (!driver_sqlpool_get_connection(db, UINT_MAX, &conn))
-		driver_sqlpool_append_request(db, request);
-	else {
-		request->host_idx = conn->host_idx;
-		sql_query(conn->db, query, driver_sqlpool_query_callback,
-			  request);
-	}
+	driver_sqlpool_request_query(db, request);
 }
 
 static void driver_sqlpool_exec(struct sql_db *_db, const char *query)
@@ -691,6 +713,46 @@ driver_sqlpool_query_s(struct sql_db *_db, const char *query)
 	return result;
 }
 
+static void ATTR_NULL(3, 4)
+driver_sqlpool_statement_query(struct sql_db *_db, struct sql_statement *stmt,
+			       sql_query_callback_t *callback, void *context)
+{
+        struct sqlpool_db *db = (struct sqlpool_db *)_db;
+	struct sqlpool_request *request;
+
+	/* the query is used for logging */
+	request = sqlpool_request_new(db, stmt->query_template);
+	request->stmt = stmt;
+	sql_statement_ref(stmt);
+	request->callback = callback;
+	request->context = context;
+	driver_sqlpool_request_query(db, request);
+}
+
+static struct sql_result *
+driver_sqlpool_statement_query_s(struct sql_db *_db,
+				 struct sql_statement *stmt)
+{
+        struct sqlpool_db *db = (struct sqlpool_db *)_db;
+	const struct sqlpool_connection *conn;
+	struct sql_result *result;
+
+	if (!driver_sqlpool_get_sync_connection(db, &conn)) {
+		sql_not_connected_result.refcount++;
+		return &sql_not_connected_result;
+	}
+
+	result = sql_db_statement_query_s(conn->db, stmt);
+	if (result->failed_try_retry) {
+		if (!driver_sqlpool_get_sync_connection(db, &conn))
+			return result;
+
+		sql_result_unref(result);
+		result = sql_db_statement_query_s(conn->db, stmt);
+	}
+	return result;
+}
+
 static struct sql_transaction_context *
 driver_sqlpool_transaction_begin(struct sql_db *_db)
 {
@@ -832,6 +894,9 @@ struct sql_db driver_sqlpool_db = {
 
 		driver_sqlpool_update,
 
-		driver_sqlpool_escape_blob
+		driver_sqlpool_escape_blob,
+
+		driver_sqlpool_statement_query,
+		driver_sqlpool_statement_query_s
 	}
 };
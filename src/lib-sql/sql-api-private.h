@@ -53,6 +53,40 @@ struct sql_transaction_query {
 	unsigned int *affected_rows;
 };
 
+enum sql_statement_param_type {
+	SQL_STATEMENT_PARAM_TYPE_NULL = 0,
+	SQL_STATEMENT_PARAM_TYPE_STR,
+	SQL_STATEMENT_PARAM_TYPE_BINARY,
+	SQL_STATEMENT_PARAM_TYPE_INT64
+};
+
+struct sql_statement_param {
+	enum sql_statement_param_type type;
+
+	const char *value_str;
+	const unsigned char *value_binary;
+	size_t value_binary_size;
+	int64_t value_int64;
+};
+
+struct sql_prepared_statement {
+	struct sql_db *db;
+	char *query_template;
+};
+
+struct sql_statement {
+	pool_t pool;
+	int refcount;
+
+	struct sql_db *db;
+	const char *query_template;
+	ARRAY(struct sql_statement_param) params;
+
+	/* Created from a prepared statement. Drivers may keep the query
+	   prepared on the server side, keyed by its query_template. */
+	bool prepared:1;
+};
+
 struct sql_db_vfuncs {
 	struct sql_db *(*init)(const char *connect_string);
 	void (*deinit)(struct sql_db *db);
@@ -78,6 +112,13 @@ struct sql_db_vfuncs {
 		       unsigned int *affected_rows);
 	const char *(*escape_blob)(struct sql_db *db,
 				   const unsigned char *data, size_t size);
+
+	/* Optional: If NULL, statements are expanded into plain queries.
+	   The statement needs to be valid only until the function returns. */
+	void (*statement_query)(struct sql_db *db, struct sql_statement *stmt,
+				sql_query_callback_t *callback, void *context);
+	struct sql_result *(*statement_query_s)(struct sql_db *db,
+						struct sql_statement *stmt);
 };
 
 struct sql_db {
@@ -165,6 +206,25 @@ driver_sqlpool_init(const char *connect_string, const struct sql_db *driver);
 
 void sql_db_set_state(struct sql_db *db, enum sql_db_state state);
 
+void sql_statement_ref(struct sql_statement *stmt);
+void sql_statement_unref(struct sql_statement **stmt);
+/* Execute the statement in the given db, which may be different from the
+   stmt->db when connection pooling is used. */
+void sql_db_statement_query(struct sql_db *db, struct sql_statement *stmt,
+			    sql_query_callback_t *callback, void *context);
+struct sql_result *
+sql_db_statement_query_s(struct sql_db *db, struct sql_statement *stmt);
+/* Return the statement as a plain query, with parameters escaped using db. */
+const char *sql_statement_get_query(struct sql_db *db,
+				    const struct sql_statement *stmt);
+/* Replace each "?" parameter outside quoted strings in query_template with
+   the string returned by param_func. */
+const char *
+t_sql_query_template_expand(const char *query_template,
+			    const char *(*param_func)(unsigned int idx,
+						      void *context),
+			    void *context);
+
 void sql_transaction_add_query(struct sql_transaction_context *ctx, pool_t pool,
 			       const char *query, unsigned int *affected_rows);
 
@@ -3,6 +3,7 @@
 #include "lib.h"
 #include "array.h"
 #include "ioloop.h"
+#include "str.h"
 #include "sql-api-private.h"
 
 #include <time.h>
@@ -148,6 +149,227 @@ struct sql_result *sql_query_s(struct sql_db *db, const char *query)
 	return db->v.query_s(db, query);
 }
 
+struct sql_prepared_statement *
+sql_prepared_statement_init(struct sql_db *db, const char *query_template)
+{
+	struct sql_prepared_statement *prep_stmt;
+
+	prep_stmt = i_new(struct sql_prepared_statement, 1);
+	prep_stmt->db = db;
+	prep_stmt->query_template = i_strdup(query_template);
+	return prep_stmt;
+}
+
+void sql_prepared_statement_deinit(struct sql_prepared_statement **_prep_stmt)
+{
+	struct sql_prepared_statement *prep_stmt = *_prep_stmt;
+
+	*_prep_stmt = NULL;
+	i_free(prep_stmt->query_template);
+	i_free(prep_stmt);
+}
+
+struct sql_statement *
+sql_statement_init(struct sql_db *db, const char *query_template)
+{
+	struct sql_statement *stmt;
+	pool_t pool;
+
+	pool = pool_alloconly_create("sql statement", 1024);
+	stmt = p_new(pool, struct sql_statement, 1);
+	stmt->pool = pool;
+	stmt->refcount = 1;
+	stmt->db = db;
+	stmt->query_template = p_strdup(pool, query_template);
+	p_array_init(&stmt->params, pool, 8);
+	return stmt;
+}
+
+struct sql_statement *
+sql_statement_init_prepared(struct sql_prepared_statement *prep_stmt)
+{
+	struct sql_statement *stmt;
+
+	stmt = sql_statement_init(prep_stmt->db, prep_stmt->query_template);
+	stmt->prepared = TRUE;
+	return stmt;
+}
+
+void sql_statement_ref(struct sql_statement *stmt)
+{
+	i_assert(stmt->refcount > 0);
+	stmt->refcount++;
+}
+
+void sql_statement_unref(struct sql_statement **_stmt)
+{
+	struct sql_statement *stmt = *_stmt;
+
+	*_stmt = NULL;
+	i_assert(stmt->refcount > 0);
+	if (--stmt->refcount > 0)
+		return;
+	pool_unref(&stmt->pool);
+}
+
+void sql_statement_abort(struct sql_statement **stmt)
+{
+	sql_statement_unref(stmt);
+}
+
+void sql_statement_bind_str(struct sql_statement *stmt,
+			    unsigned int column_idx, const char *value)
+{
+	struct sql_statement_param *param;
+
+	param = array_idx_modifiable(&stmt->params, column_idx);
+	memset(param, 0, sizeof(*param));
+	if (value != NULL) {
+		param->type = SQL_STATEMENT_PARAM_TYPE_STR;
+		param->value_str = p_strdup(stmt->pool, value);
+	}
+}
+
+void sql_statement_bind_binary(struct sql_statement *stmt,
+			       unsigned int column_idx, const void *value,
+			       size_t value_size)
+{
+	struct sql_statement_param *param;
+
+	param = array_idx_modifiable(&stmt->params, column_idx);
+	memset(param, 0, sizeof(*param));
+	param->type = SQL_STATEMENT_PARAM_TYPE_BINARY;
+	param->value_binary = p_memdup(stmt->pool, value, value_size);
+	param->value_binary_size = value_size;
+}
+
+void sql_statement_bind_int64(struct sql_statement *stmt,
+			      unsigned int column_idx, int64_t value)
+{
+	struct sql_statement_param *param;
+
+	param = array_idx_modifiable(&stmt->params, column_idx);
+	memset(param, 0, sizeof(*param));
+	param->type = SQL_STATEMENT_PARAM_TYPE_INT64;
+	param->value_int64 = value;
+}
+
+const char *
+t_sql_query_template_expand(const char *query_template,
+			    const char *(*param_func)(unsigned int idx,
+						      void *context),
+			    void *context)
+{
+	string_t *query = t_str_new(256);
+	const char *p, *start;
+	unsigned int idx = 0;
+	char quote;
+
+	for (p = start = query_template; *p != '\0'; p++) {
+		if (*p == '\'' || *p == '"' || *p == '`') {
+			/* skip over quoted string. doubled quote characters
+			   are handled as two adjacent strings. */
+			quote = *p;
+			while (p[1] != '\0' && p[1] != quote)
+				p++;
+			if (p[1] == '\0')
+				break;
+			p++;
+		} else if (*p == '?') {
+			str_append_n(query, start, p - start);
+			str_append(query, param_func(idx++, context));
+			start = p + 1;
+		}
+	}
+	str_append(query, start);
+	return str_c(query);
+}
+
+struct sql_statement_get_query_context {
+	struct sql_db *db;
+	const struct sql_statement *stmt;
+};
+
+static const char *
+sql_statement_get_param_value(unsigned int idx, void *context)
+{
+	struct sql_statement_get_query_context *ctx = context;
+	const struct sql_statement_param *param;
+
+	if (idx >= array_count(&ctx->stmt->params))
+		return "NULL";
+	param = array_idx(&ctx->stmt->params, idx);
+	switch (param->type) {
+	case SQL_STATEMENT_PARAM_TYPE_NULL:
+		break;
+	case SQL_STATEMENT_PARAM_TYPE_STR:
+		return t_strdup_printf("'%s'",
+			sql_escape_string(ctx->db, param->value_str));
+	case SQL_STATEMENT_PARAM_TYPE_BINARY:
+		return sql_escape_blob(ctx->db, param->value_binary,
+				       param->value_binary_size);
+	case SQL_STATEMENT_PARAM_TYPE_INT64:
+		return t_strdup_printf("%lld", (long long)param->value_int64);
+	}
+	return "NULL";
+}
+
+const char *sql_statement_get_query(struct sql_db *db,
+				    const struct sql_statement *stmt)
+{
+	struct sql_statement_get_query_context ctx = {
+		.db = db,
+		.stmt = stmt
+	};
+
+	return t_sql_query_template_expand(stmt->query_template,
+					   sql_statement_get_param_value, &ctx);
+}
+
+void sql_db_statement_query(struct sql_db *db, struct sql_statement *stmt,
+			    sql_query_callback_t *callback, void *context)
+{
+	if (db->v.statement_query != NULL)
+		db->v.statement_query(db, stmt, callback, context);
+	else T_BEGIN {
+		db->v.query(db, sql_statement_get_query(db, stmt),
+			    callback, context);
+	} T_END;
+}
+
+struct sql_result *
+sql_db_statement_query_s(struct sql_db *db, struct sql_statement *stmt)
+{
+	struct sql_result *result;
+
+	if (db->v.statement_query_s != NULL)
+		return db->v.statement_query_s(db, stmt);
+	T_BEGIN {
+		result = db->v.query_s(db, sql_statement_get_query(db, stmt));
+	} T_END;
+	return result;
+}
+
+#undef sql_statement_query
+void sql_statement_query(struct sql_statement **_stmt,
+			 sql_query_callback_t *callback, void *context)
+{
+	struct sql_statement *stmt = *_stmt;
+
+	sql_db_statement_query(stmt->db, stmt, callback, context);
+	sql_statement_unref(_stmt);
+}
+
+struct sql_result *sql_statement_query_s(struct sql_statement **_stmt)
+{
+	struct sql_statement *stmt = *_stmt;
+	struct sql_result *result;
+
+	result = sql_db_statement_query_s(stmt->db, stmt);
+	sql_statement_unref(_stmt);
+	return result;
+}
+
 void sql_result_ref(struct sql_result *result)
 {
 	result->refcount++;
@@ -388,6 +610,26 @@ void sql_update_get_rows(struct sql_transaction_context *ctx, const char *query,
 	ctx->db->v.update(ctx, query, affected_rows);
 }
 
+void sql_update_stmt(struct sql_transaction_context *ctx,
+		     struct sql_statement **stmt)
+{
+	sql_update_stmt_get_rows(ctx, stmt, NULL);
+}
+
+void sql_update_stmt_get_rows(struct sql_transaction_context *ctx,
+			      struct sql_statement **_stmt,
+			      unsigned int *affected_rows)
+{
+	struct sql_statement *stmt = *_stmt;
+
+	/* transactions are queued as plain queries */
+	T_BEGIN {
+		ctx->db->v.update(ctx, sql_statement_get_query(ctx->db, stmt),
+				  affected_rows);
+	} T_END;
+	sql_statement_unref(_stmt);
+}
+
 void sql_db_set_state(struct sql_db *db, enum sql_db_state state)
 {
 	enum sql_db_state old_state = db->state;
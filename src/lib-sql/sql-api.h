@@ -47,6 +47,8 @@ enum sql_result_error_type {
 
 struct sql_db;
 struct sql_result;
+struct sql_prepared_statement;
+struct sql_statement;
 
 struct sql_commit_result {
 	const char *error;
@@ -101,6 +103,43 @@ void sql_query(struct sql_db *db, const char *query,
 /* Execute blocking SQL query and return result. */
 struct sql_result *sql_query_s(struct sql_db *db, const char *query);
 
+/* Create a prepared statement from the query template. Each "?" outside
+   quoted strings is a parameter, which is bound separately for each
+   statement. Drivers supporting it prepare the query once per connection
+   and afterwards send only the parameters. Others expand the parameters into
+   the query with proper escaping. */
+struct sql_prepared_statement *
+sql_prepared_statement_init(struct sql_db *db, const char *query_template);
+void sql_prepared_statement_deinit(struct sql_prepared_statement **prep_stmt);
+
+/* Create a new statement with parameters. sql_statement_init() is for one-off
+   queries, which are never prepared on the server. The statement is freed by
+   executing it or with sql_statement_abort(). */
+struct sql_statement *
+sql_statement_init(struct sql_db *db, const char *query_template);
+struct sql_statement *
+sql_statement_init_prepared(struct sql_prepared_statement *prep_stmt);
+void sql_statement_abort(struct sql_statement **stmt);
+/* Bind a value to the parameter at column_idx (0 = first "?"). Values are
+   copied. NULL string binds SQL NULL. */
+void sql_statement_bind_str(struct sql_statement *stmt,
+			    unsigned int column_idx, const char *value);
+void sql_statement_bind_binary(struct sql_statement *stmt,
+			       unsigned int column_idx, const void *value,
+			       size_t value_size);
+void sql_statement_bind_int64(struct sql_statement *stmt,
+			      unsigned int column_idx, int64_t value);
+/* Execute the statement and return result in callback. */
+void sql_statement_query(struct sql_statement **stmt,
+			 sql_query_callback_t *callback, void *context);
+#define sql_statement_query(stmt, callback, context) \
+	sql_statement_query(stmt + \
+		CALLBACK_TYPECHECK(callback, void (*)( \
+			struct sql_result *, typeof(context))), \
+		(sql_query_callback_t *)callback, context)
+/* Execute blocking statement and return result. */
+struct sql_result *sql_statement_query_s(struct sql_statement **stmt);
+
 void sql_result_setup_fetch(struct sql_result *result,
 			    const struct sql_field_def *fields,
 			    void *dest, size_t dest_size);
@@ -159,5 +198,11 @@ void sql_update(struct sql_transaction_context *ctx, const char *query);
    commit callback is called. */
 void sql_update_get_rows(struct sql_transaction_context *ctx, const char *query,
 			 unsigned int *affected_rows);
+/* Execute statement in given transaction. */
+void sql_update_stmt(struct sql_transaction_context *ctx,
+		     struct sql_statement **stmt);
+void sql_update_stmt_get_rows(struct sql_transaction_context *ctx,
+			      struct sql_statement **stmt,
+			      unsigned int *affected_rows);
 
 #endif
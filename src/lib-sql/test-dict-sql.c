@@ -0,0 +1,274 @@
+/* Copyright (c) 2016 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "str.h"
+#include "write-full.h"
+#include "sql-api-private.h"
+#include "dict-private.h"
+#include "dict-sql.h"
+#include "test-common.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#define TEST_DICT_SQL_CONF ".test-dict-sql.conf"
+#define TEST_DICT_SQL_DB ".test-dict-sql.sqlite"
+
+struct dict dict_driver_client;
+struct dict dict_driver_file;
+struct dict dict_driver_memcached;
+struct dict dict_driver_memcached_ascii;
+struct dict dict_driver_redis;
+
+static const char *test_dict_sql_conf =
+"connect = "TEST_DICT_SQL_DB"\n"
+"map {\n"
+"  pattern = priv/quota/storage\n"
+"  table = quota\n"
+"  username_field = username\n"
+"  value_field = bytes\n"
+"  value_type = uint\n"
+"}\n"
+"map {\n"
+"  pattern = priv/quota/messages\n"
+"  table = quota\n"
+"  username_field = username\n"
+"  value_field = messages\n"
+"  value_type = uint\n"
+"}\n"
+"map {\n"
+"  pattern = shared/expire/$user/$mailbox\n"
+"  table = expires\n"
+"  value_field = expire_stamp\n"
+"  fields {\n"
+"    username = $user\n"
+"    mailbox = $mailbox\n"
+"  }\n"
+"}\n"
+"map {\n"
+"  pattern = shared/blob/$key\n"
+"  table = blobs\n"
+"  value_field = value\n"
+"  value_type = hexblob\n"
+"  fields {\n"
+"    key = ${hexblob:key}\n"
+"  }\n"
+"}\n";
+
+static bool test_dict_sql_have_sqlite(void)
+{
+	const struct sql_db *const *driverp;
+
+	array_foreach(&sql_drivers, driverp) {
+		if (strcmp((*driverp)->name, "sqlite") == 0)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+static void test_dict_sql_init(void)
+{
+	struct sql_db *db;
+	int fd;
+
+	i_unlink_if_exists(TEST_DICT_SQL_DB);
+	fd = creat(TEST_DICT_SQL_CONF, 0600);
+	if (fd == -1)
+		i_fatal("creat(%s) failed: %m", TEST_DICT_SQL_CONF);
+	if (write_full(fd, test_dict_sql_conf, strlen(test_dict_sql_conf)) < 0)
+		i_fatal("write(%s) failed: %m", TEST_DICT_SQL_CONF);
+	i_close_fd(&fd);
+
+	db = sql_init("sqlite", TEST_DICT_SQL_DB);
+	sql_exec(db, "CREATE TABLE quota (username TEXT PRIMARY KEY, "
+		 "bytes INTEGER NOT NULL DEFAULT 0, "
+		 "messages INTEGER NOT NULL DEFAULT 0)");
+	sql_exec(db, "CREATE TABLE expires (username TEXT, mailbox TEXT, "
+		 "expire_stamp TEXT, PRIMARY KEY (username, mailbox))");
+	sql_exec(db, "CREATE TABLE blobs (key BLOB PRIMARY KEY, value BLOB)");
+	sql_deinit(&db);
+}
+
+static struct dict *test_dict_sql_open(const char *username)
+{
+	struct dict_settings set;
+	struct dict *dict;
+	const char *error;
+
+	memset(&set, 0, sizeof(set));
+	set.username = username;
+	if (dict_init("sqlite:"TEST_DICT_SQL_CONF, &set, &dict, &error) < 0)
+		i_fatal("dict_init() failed: %s", error);
+	return dict;
+}
+
+static const char *test_dict_sql_lookup(struct dict *dict, const char *key)
+{
+	const char *value, *error;
+	int ret;
+
+	ret = dict_lookup(dict, pool_datastack_create(), key, &value, &error);
+	test_assert(ret >= 0);
+	return ret > 0 ? value : NULL;
+}
+
+static void test_dict_sql_set_lookup(void)
+{
+	struct dict *dict;
+	struct dict_transaction_context *trans;
+	const char *error;
+
+	test_begin("dict sql set and lookup");
+	dict = test_dict_sql_open("user1");
+	trans = dict_transaction_begin(dict);
+	dict_set(trans, "shared/expire/user1/INBOX", "100");
+	dict_set(trans, "shared/expire/user1/it's/x", "it's 200");
+	dict_set(trans, "shared/expire/user2/INBOX", "300");
+	dict_set(trans, "shared/blob/0102ff", "00ab");
+	dict_set(trans, "priv/quota/storage", "1024");
+	test_assert(dict_transaction_commit(&trans, &error) == 1);
+
+	test_assert(null_strcmp(test_dict_sql_lookup(dict,
+		"shared/expire/user1/INBOX"), "100") == 0);
+	test_assert(null_strcmp(test_dict_sql_lookup(dict,
+		"shared/expire/user1/it's/x"), "it's 200") == 0);
+	test_assert(null_strcmp(test_dict_sql_lookup(dict,
+		"shared/expire/user2/INBOX"), "300") == 0);
+	test_assert(test_dict_sql_lookup(dict,
+		"shared/expire/user3/INBOX") == NULL);
+	test_assert(null_strcmp(test_dict_sql_lookup(dict,
+		"shared/blob/0102ff"), "00ab") == 0);
+	test_assert(test_dict_sql_lookup(dict, "shared/blob/0102") == NULL);
+	test_assert(null_strcmp(test_dict_sql_lookup(dict,
+		"priv/quota/storage"), "1024") == 0);
+	test_assert(null_strcmp(test_dict_sql_lookup(dict,
+		"priv/quota/messages"), "0") == 0);
+	/* the same compiled statements are used again */
+	test_assert(null_strcmp(test_dict_sql_lookup(dict,
+		"shared/expire/user1/INBOX"), "100") == 0);
+	dict_deinit(&dict);
+
+	/* private keys are looked up for the dict's username only */
+	dict = test_dict_sql_open("user2");
+	test_assert(test_dict_sql_lookup(dict, "priv/quota/storage") == NULL);
+	test_assert(null_strcmp(test_dict_sql_lookup(dict,
+		"shared/expire/user1/INBOX"), "100") == 0);
+	dict_deinit(&dict);
+	test_end();
+}
+
+static void test_dict_sql_iterate(void)
+{
+	static const struct {
+		const char *path;
+		enum dict_iterate_flags flags;
+		const char *result;
+	} tests[] = {
+		{ "shared/expire/user1/", 0,
+		  "shared/expire/user1/INBOX=100" },
+		{ "shared/expire/user1/", DICT_ITERATE_FLAG_RECURSE,
+		  "shared/expire/user1/INBOX=100,"
+		  "shared/expire/user1/it's/x=it's 200" },
+		{ "shared/expire/", DICT_ITERATE_FLAG_RECURSE,
+		  "shared/expire/user1/INBOX=100,"
+		  "shared/expire/user1/it's/x=it's 200,"
+		  "shared/expire/user2/INBOX=300" },
+		{ "shared/expire/user1/INBOX", DICT_ITERATE_FLAG_EXACT_KEY,
+		  "shared/expire/user1/INBOX=100" },
+		{ "shared/expire/user3/", DICT_ITERATE_FLAG_RECURSE, "" },
+	};
+	struct dict *dict;
+	struct dict_iterate_context *iter;
+	const char *key, *value, *error;
+	string_t *str = t_str_new(128);
+	unsigned int i;
+
+	test_begin("dict sql iterate");
+	dict = test_dict_sql_open("user1");
+	for (i = 0; i < N_ELEMENTS(tests); i++) {
+		str_truncate(str, 0);
+		iter = dict_iterate_init(dict, tests[i].path,
+					 tests[i].flags |
+					 DICT_ITERATE_FLAG_SORT_BY_KEY);
+		while (dict_iterate(iter, &key, &value)) {
+			if (str_len(str) > 0)
+				str_append_c(str, ',');
+			str_printfa(str, "%s=%s", key, value);
+		}
+		test_assert_idx(dict_iterate_deinit(&iter, &error) == 0, i);
+		test_assert_idx(strcmp(str_c(str), tests[i].result) == 0, i);
+	}
+	dict_deinit(&dict);
+	test_end();
+}
+
+static void test_dict_sql_inc_unset(void)
+{
+	struct dict *dict;
+	struct dict_transaction_context *trans;
+	const char *error;
+
+	test_begin("dict sql atomic inc and unset");
+	dict = test_dict_sql_open("user1");
+	trans = dict_transaction_begin(dict);
+	/* both fields of the quota row are updated with a single UPDATE */
+	dict_atomic_inc(trans, "priv/quota/storage", -24);
+	dict_atomic_inc(trans, "priv/quota/messages", 2);
+	test_assert(dict_transaction_commit(&trans, &error) == 1);
+	test_assert(null_strcmp(test_dict_sql_lookup(dict,
+		"priv/quota/storage"), "1000") == 0);
+	test_assert(null_strcmp(test_dict_sql_lookup(dict,
+		"priv/quota/messages"), "2") == 0);
+
+	trans = dict_transaction_begin(dict);
+	dict_unset(trans, "shared/expire/user1/INBOX");
+	dict_unset(trans, "shared/blob/0102ff");
+	test_assert(dict_transaction_commit(&trans, &error) == 1);
+	test_assert(test_dict_sql_lookup(dict,
+		"shared/expire/user1/INBOX") == NULL);
+	test_assert(null_strcmp(test_dict_sql_lookup(dict,
+		"shared/expire/user1/it's/x"), "it's 200") == 0);
+	test_assert(test_dict_sql_lookup(dict, "shared/blob/0102ff") == NULL);
+	dict_deinit(&dict);
+
+	/* nonexistent row */
+	dict = test_dict_sql_open("user2");
+	trans = dict_transaction_begin(dict);
+	dict_atomic_inc(trans, "priv/quota/storage", 100);
+	test_assert(dict_transaction_commit(&trans, &error) == 0);
+	dict_deinit(&dict);
+	test_end();
+}
+
+int main(void)
+{
+	static void (*test_functions[])(void) = {
+		test_dict_sql_set_lookup,
+		test_dict_sql_iterate,
+		test_dict_sql_inc_unset,
+		NULL
+	};
+	int ret;
+
+	lib_init();
+	sql_drivers_init();
+	sql_drivers_register_all();
+	if (!test_dict_sql_have_sqlite()) {
+		/* sqlite is built as a plugin or not at all */
+		sql_drivers_deinit();
+		lib_deinit();
+		return 0;
+	}
+	dict_sql_register();
+	test_dict_sql_init();
+
+	ret = test_run(test_functions);
+
+	dict_sql_unregister();
+	sql_drivers_deinit();
+	i_unlink(TEST_DICT_SQL_CONF);
+	i_unlink(TEST_DICT_SQL_DB);
+	lib_deinit();
+	return ret;
+}
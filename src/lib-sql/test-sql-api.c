@@ -0,0 +1,264 @@
+/* Copyright (c) 2016 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "str.h"
+#include "sql-api-private.h"
+#include "test-common.h"
+
+#include <unistd.h>
+
+#define TEST_SQLITE_PATH ".test-sql-api.sqlite"
+
+static const char *test_param_name(unsigned int idx, void *context)
+{
+	unsigned int *count = context;
+
+	*count += 1;
+	return t_strdup_printf("<%u>", idx);
+}
+
+static void test_sql_query_template_expand(void)
+{
+	static const struct {
+		const char *template, *output;
+		unsigned int count;
+	} tests[] = {
+		{ "", "", 0 },
+		{ "SELECT 1", "SELECT 1", 0 },
+		{ "SELECT ?", "SELECT <0>", 1 },
+		{ "?,?", "<0>,<1>", 2 },
+		{ "a = ? AND b = ?", "a = <0> AND b = <1>", 2 },
+		/* quoted question marks aren't parameters */
+		{ "a = '?' AND b = ?", "a = '?' AND b = <0>", 1 },
+		{ "\"?\" = ? AND `?` = ?", "\"?\" = <0> AND `?` = <1>", 2 },
+		{ "a = '\"?' AND b = ?", "a = '\"?' AND b = <0>", 1 },
+		/* '' inside a string */
+		{ "a = 'it''s ?' AND b = ?", "a = 'it''s ?' AND b = <0>", 1 },
+		{ "a = '''?''' AND b = ?", "a = '''?''' AND b = <0>", 1 },
+		/* unterminated string */
+		{ "a = ? AND b = '?", "a = <0> AND b = '?", 1 },
+	};
+	const char *output;
+	unsigned int i, count;
+
+	test_begin("sql query template expand");
+	for (i = 0; i < N_ELEMENTS(tests); i++) {
+		count = 0;
+		output = t_sql_query_template_expand(tests[i].template,
+						     test_param_name, &count);
+		test_assert_idx(strcmp(output, tests[i].output) == 0, i);
+		test_assert_idx(count == tests[i].count, i);
+	}
+	test_end();
+}
+
+static const char *
+test_escape_string(struct sql_db *db ATTR_UNUSED, const char *string)
+{
+	return t_str_replace(string, '\'', '_');
+}
+
+static const char *
+test_escape_blob(struct sql_db *db ATTR_UNUSED,
+		 const unsigned char *data ATTR_UNUSED, size_t size)
+{
+	return t_strdup_printf("blob(%u)", (unsigned int)size);
+}
+
+static void test_sql_statement_get_query(void)
+{
+	struct sql_db db;
+	struct sql_statement *stmt;
+
+	test_begin("sql statement get query");
+	memset(&db, 0, sizeof(db));
+	db.v.escape_string = test_escape_string;
+	db.v.escape_blob = test_escape_blob;
+
+	stmt = sql_statement_init(&db, "SELECT ? FROM t WHERE a = ? AND "
+				  "b = '?' AND c = ? AND d = ? AND e = ?");
+	sql_statement_bind_str(stmt, 0, "x'y");
+	sql_statement_bind_int64(stmt, 1, -123456789012LL);
+	sql_statement_bind_binary(stmt, 2, "\0\1\2", 3);
+	sql_statement_bind_str(stmt, 3, NULL);
+	/* the 5th parameter isn't bound */
+	test_assert(strcmp(sql_statement_get_query(&db, stmt),
+			   "SELECT 'x_y' FROM t WHERE a = -123456789012 AND "
+			   "b = '?' AND c = blob(3) AND d = NULL AND "
+			   "e = NULL") == 0);
+	test_assert(!stmt->prepared);
+
+	/* rebinding replaces the value */
+	sql_statement_bind_int64(stmt, 0, 5);
+	test_assert(strncmp(sql_statement_get_query(&db, stmt),
+			    "SELECT 5 ", 9) == 0);
+	sql_statement_abort(&stmt);
+	test_assert(stmt == NULL);
+	test_end();
+}
+
+#ifdef BUILD_SQLITE
+extern const struct sql_db driver_sqlite_db;
+
+static struct sql_db *test_sqlite_db;
+
+static const char *
+test_sqlite_lookup(struct sql_prepared_statement *prep_stmt, int64_t id)
+{
+	struct sql_statement *stmt;
+	struct sql_result *result;
+	const char *value = NULL;
+
+	stmt = sql_statement_init_prepared(prep_stmt);
+	sql_statement_bind_int64(stmt, 0, id);
+	result = sql_statement_query_s(&stmt);
+	if (sql_result_next_row(result) > 0)
+		value = t_strdup(sql_result_get_field_value(result, 0));
+	sql_result_unref(result);
+	return value;
+}
+
+static void test_sqlite_insert(int64_t id, const char *name)
+{
+	struct sql_statement *stmt;
+	struct sql_result *result;
+
+	stmt = sql_statement_init(test_sqlite_db,
+				  "INSERT INTO t (id, name) VALUES (?, ?)");
+	sql_statement_bind_int64(stmt, 0, id);
+	sql_statement_bind_str(stmt, 1, name);
+	result = sql_statement_query_s(&stmt);
+	test_assert(sql_result_next_row(result) == 0);
+	sql_result_unref(result);
+}
+
+static void test_sql_sqlite_statement_cache(void)
+{
+	struct sql_prepared_statement *prep_stmt, *prep_stmts[300];
+	struct sql_statement *stmt;
+	struct sql_result *result;
+	const unsigned char *data;
+	size_t size;
+	unsigned int i;
+
+	test_begin("sql sqlite statement cache");
+	i_unlink_if_exists(TEST_SQLITE_PATH);
+	sql_driver_register(&driver_sqlite_db);
+	test_sqlite_db = sql_init("sqlite", TEST_SQLITE_PATH);
+	test_assert(sql_connect(test_sqlite_db) == 1);
+	sql_exec(test_sqlite_db, "CREATE TABLE t (id INTEGER, name TEXT, "
+		 "data BLOB)");
+	test_sqlite_insert(1, "one");
+	test_sqlite_insert(2, "it's two");
+	test_sqlite_insert(3, NULL);
+
+	/* the same compiled statement is reset and reused with new
+	   parameters */
+	prep_stmt = sql_prepared_statement_init(test_sqlite_db,
+		"SELECT name FROM t WHERE id = ?");
+	test_assert(null_strcmp(test_sqlite_lookup(prep_stmt, 1),
+				"one") == 0);
+	test_assert(null_strcmp(test_sqlite_lookup(prep_stmt, 2),
+				"it's two") == 0);
+	test_assert(test_sqlite_lookup(prep_stmt, 3) == NULL);
+	test_assert(test_sqlite_lookup(prep_stmt, 4) == NULL);
+	test_assert(null_strcmp(test_sqlite_lookup(prep_stmt, 1),
+				"one") == 0);
+
+	/* a result that wasn't fully read doesn't break the next query */
+	stmt = sql_statement_init_prepared(prep_stmt);
+	sql_statement_bind_int64(stmt, 0, 2);
+	result = sql_statement_query_s(&stmt);
+
+	/* the statement is still in use by the unfreed result, so a nested
+	   query with it is compiled separately */
+	test_assert(null_strcmp(test_sqlite_lookup(prep_stmt, 1),
+				"one") == 0);
+	test_assert(sql_result_next_row(result) > 0);
+	test_assert(null_strcmp(sql_result_get_field_value(result, 0),
+				"it's two") == 0);
+	sql_result_unref(result);
+	test_assert(null_strcmp(test_sqlite_lookup(prep_stmt, 2),
+				"it's two") == 0);
+
+	/* binary values */
+	stmt = sql_statement_init(test_sqlite_db,
+				  "UPDATE t SET data = ? WHERE id = ?");
+	sql_statement_bind_binary(stmt, 0, "\0\1\2", 3);
+	sql_statement_bind_int64(stmt, 1, 1);
+	result = sql_statement_query_s(&stmt);
+	test_assert(sql_result_next_row(result) == 0);
+	sql_result_unref(result);
+	stmt = sql_statement_init(test_sqlite_db,
+				  "SELECT data FROM t WHERE id = ?");
+	sql_statement_bind_int64(stmt, 0, 1);
+	result = sql_statement_query_s(&stmt);
+	test_assert(sql_result_next_row(result) > 0);
+	data = sql_result_get_field_value_binary(result, 0, &size);
+	test_assert(size == 3 && memcmp(data, "\0\1\2", 3) == 0);
+	sql_result_unref(result);
+
+	/* more statements than are kept compiled */
+	for (i = 0; i < N_ELEMENTS(prep_stmts); i++) {
+		prep_stmts[i] = sql_prepared_statement_init(test_sqlite_db,
+			t_strdup_printf("SELECT name FROM t WHERE id = ? "
+					"AND %u = %u", i, i));
+	}
+	for (i = 0; i < N_ELEMENTS(prep_stmts); i++) {
+		test_assert_idx(null_strcmp(test_sqlite_lookup(prep_stmts[i], 1),
+					    "one") == 0, i);
+	}
+	for (i = 0; i < N_ELEMENTS(prep_stmts); i++) {
+		test_assert_idx(null_strcmp(test_sqlite_lookup(prep_stmts[i], 2),
+					    "it's two") == 0, i);
+		sql_prepared_statement_deinit(&prep_stmts[i]);
+	}
+
+	/* unbound parameters are NULL */
+	stmt = sql_statement_init_prepared(prep_stmt);
+	result = sql_statement_query_s(&stmt);
+	test_assert(sql_result_next_row(result) == 0);
+	sql_result_unref(result);
+
+	/* broken statements return an error result */
+	prep_stmts[0] = sql_prepared_statement_init(test_sqlite_db,
+		"SELECT name FROM nonexistent WHERE id = ?");
+	stmt = sql_statement_init_prepared(prep_stmts[0]);
+	sql_statement_bind_int64(stmt, 0, 1);
+	result = sql_statement_query_s(&stmt);
+	test_assert(sql_result_next_row(result) < 0);
+	sql_result_unref(result);
+	sql_prepared_statement_deinit(&prep_stmts[0]);
+	test_assert(null_strcmp(test_sqlite_lookup(prep_stmt, 1),
+				"one") == 0);
+
+	/* the compiled statements are dropped on disconnect */
+	sql_disconnect(test_sqlite_db);
+	test_assert(null_strcmp(test_sqlite_lookup(prep_stmt, 2),
+				"it's two") == 0);
+
+	sql_prepared_statement_deinit(&prep_stmt);
+	sql_deinit(&test_sqlite_db);
+	sql_driver_unregister(&driver_sqlite_db);
+	i_unlink(TEST_SQLITE_PATH);
+	test_end();
+}
+#endif
+
+int main(void)
+{
+	static void (*test_functions[])(void) = {
+		test_sql_query_template_expand,
+		test_sql_statement_get_query,
+#ifdef BUILD_SQLITE
+		test_sql_sqlite_statement_cache,
+#endif
+		NULL
+	};
+	int ret;
+
+	sql_drivers_init();
+	ret = test_run(test_functions);
+	sql_drivers_deinit();
+	return ret;
+}
@@ -0,0 +1,110 @@
+/* Copyright (c) 2016 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "buffer.h"
+#include "read-full.h"
+#include "write-full.h"
+#include "index-storage.h"
+#include "index-persist-file.h"
+
+#include <stdio.h>
+#include <sys/stat.h>
+
+#if !WORDS_BIGENDIAN
+#  define INDEX_PERSIST_FILE_COMPAT_FLAGS MAIL_INDEX_COMPAT_LITTLE_ENDIAN
+#else
+#  define INDEX_PERSIST_FILE_COMPAT_FLAGS 0
+#endif
+
+void index_persist_file_header_init(struct index_persist_file_header *hdr,
+				    struct mail_index_view *view,
+				    uint32_t version)
+{
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->version = version;
+	hdr->compat_flags = INDEX_PERSIST_FILE_COMPAT_FLAGS;
+	hdr->uid_validity = mail_index_get_header(view)->uid_validity;
+}
+
+int index_persist_file_read(struct mailbox *box, struct mail_index_view *view,
+			    const char *path, uint32_t version,
+			    size_t hdr_size, size_t record_size,
+			    const void **data_r, unsigned int *records_count_r)
+{
+	const struct index_persist_file_header *hdr;
+	unsigned char *data;
+	struct stat st;
+	int fd, ret;
+
+	i_assert(hdr_size >= sizeof(*hdr));
+	i_assert(record_size > 0);
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		if (errno != ENOENT) {
+			mail_storage_set_critical(box->storage,
+				"open(%s) failed: %m", path);
+		}
+		return 0;
+	}
+	if (fstat(fd, &st) < 0) {
+		mail_storage_set_critical(box->storage,
+			"fstat(%s) failed: %m", path);
+		i_close_fd(&fd);
+		return 0;
+	}
+	if (st.st_size < (off_t)hdr_size ||
+	    (st.st_size - hdr_size) % record_size != 0) {
+		/* broken, just rebuild it */
+		i_close_fd(&fd);
+		return 0;
+	}
+	data = t_malloc_no0(st.st_size);
+	ret = read_full(fd, data, st.st_size);
+	if (ret < 0) {
+		mail_storage_set_critical(box->storage,
+			"read(%s) failed: %m", path);
+	}
+	i_close_fd(&fd);
+	if (ret <= 0)
+		return 0;
+
+	hdr = (const void *)data;
+	if (hdr->version != version ||
+	    hdr->compat_flags != INDEX_PERSIST_FILE_COMPAT_FLAGS ||
+	    hdr->uid_validity != mail_index_get_header(view)->uid_validity)
+		return 0;
+
+	*data_r = data;
+	*records_count_r = (st.st_size - hdr_size) / record_size;
+	return 1;
+}
+
+void index_persist_file_write(struct mailbox *box, const char *path,
+			      const buffer_t *data)
+{
+	const char *temp_path;
+	int fd;
+
+	if (box->index->readonly)
+		return;
+
+	fd = mail_index_create_tmp_file(box->index, path, &temp_path);
+	if (fd == -1)
+		return;
+	if (write_full(fd, data->data, data->used) < 0) {
+		mail_storage_set_critical(box->storage,
+			"write(%s) failed: %m", temp_path);
+		i_unlink(temp_path);
+	} else if (box->index->fsync_mode != FSYNC_MODE_NEVER &&
+		   fdatasync(fd) < 0) {
+		mail_storage_set_critical(box->storage,
+			"fdatasync(%s) failed: %m", temp_path);
+		i_unlink(temp_path);
+	} else if (rename(temp_path, path) < 0) {
+		mail_storage_set_critical(box->storage,
+			"rename(%s, %s) failed: %m", temp_path, path);
+		i_unlink(temp_path);
+	}
+	i_close_fd(&fd);
+}
@@ -0,0 +1,36 @@
+#ifndef INDEX_PERSIST_FILE_H
+#define INDEX_PERSIST_FILE_H
+
+/* Common beginning of the header of files that persist results of expensive
+   operations (sort orders, thread trees) in the index directory. The files
+   are only caches, so anything unexpected in them just makes the caller
+   rebuild the data. */
+struct index_persist_file_header {
+	uint32_t version;
+	/* enum mail_index_header_compat_flags */
+	uint8_t compat_flags;
+	uint8_t unused[3];
+	uint32_t uid_validity;
+};
+
+/* Initialize the common header for writing a file with the given version. */
+void index_persist_file_header_init(struct index_persist_file_header *hdr,
+				    struct mail_index_view *view,
+				    uint32_t version);
+
+/* Read the file to data stack. The file begins with a hdr_size bytes header
+   (starting with struct index_persist_file_header) followed by records of
+   record_size bytes. Returns 1 if the file was read and the common header
+   matches the version, this host's endianness and the view's UIDVALIDITY.
+   Returns 0 if the file doesn't exist or it can't be used. Errors are logged
+   as critical errors. */
+int index_persist_file_read(struct mailbox *box, struct mail_index_view *view,
+			    const char *path, uint32_t version,
+			    size_t hdr_size, size_t record_size,
+			    const void **data_r, unsigned int *records_count_r);
+/* Replace the file with the given data. Nothing is written for read-only
+   indexes. */
+void index_persist_file_write(struct mailbox *box, const char *path,
+			      const buffer_t *data);
+
+#endif
@@ -1400,6 +1400,16 @@ static void search_match_finish(struct index_search_context *ctx, int match)
 	}
 }
 
+static unsigned int
+index_search_get_max_mails(struct index_search_context *ctx)
+{
+	if (ctx->mail_ctx.prefetch_count == 0)
+		return ctx->max_mails;
+	if (ctx->mail_ctx.prefetch_count == UINT_MAX)
+		return UINT_MAX;
+	return ctx->mail_ctx.prefetch_count + 1;
+}
+
 static int search_match_next(struct index_search_context *ctx)
 {
 	static enum mail_lookup_abort cache_lookups[] = {
@@ -1418,7 +1428,7 @@ static int search_match_next(struct index_search_context *ctx)
 	}
 
 	/* avoid doing extra work for as long as possible */
-	if (ctx->max_mails > 1) {
+	if (index_search_get_max_mails(ctx) > 1) {
 		/* we're doing prefetching. if we have to read the mail,
 		   do a prefetch first and the final search later */
 		n--;
@@ -1593,7 +1603,7 @@ struct mail *index_search_get_mail(struct index_search_context *ctx)
 	struct mail *const *mails, *mail;
 	unsigned int count;
 
-	if (ctx->unused_mail_idx == ctx->max_mails)
+	if (ctx->unused_mail_idx == index_search_get_max_mails(ctx))
 		return NULL;
 
 	mails = array_get(&ctx->mails, &count);
@@ -1632,6 +1642,10 @@ static int search_more_with_prefetching(struct index_search_context *ctx,
 			*mail_r = mail;
 			return 1;
 		}
+		if (ctx->mail_ctx.prefetch_bodies) {
+			((struct index_mail *)mail)->data.access_part |=
+				READ_HDR | READ_BODY;
+		}
 		if (mail_prefetch(mail) && ctx->unused_mail_idx == 0) {
 			/* no prefetching done, return it immediately */
 			*mail_r = mail;
@@ -0,0 +1,366 @@
+/* Copyright (c) 2016 Dovecot authors, see the included COPYING file */
+
+/* The full sort order of all messages in a mailbox is saved to a
+   dovecot.index.sort-<program> file as a list of UIDs. When the same sort
+   program is used again, the list is updated by dropping the expunged UIDs
+   and inserting the new messages with binary searches. So only the new
+   messages' sort keys need to be looked up, instead of all messages'.
+   If too many messages have been added since the file was written, the
+   order is rebuilt with the normal sorting code. */
+#include "lib.h"
+#include "array.h"
+#include "str.h"
+#include "index-storage.h"
+#include "index-persist-file.h"
+#include "index-sort-private.h"
+
+#define INDEX_SORT_ORDER_FILE_SUFFIX ".sort-"
+#define INDEX_SORT_ORDER_VERSION 2
+/* Smaller mailboxes are fast enough to sort each time */
+#define INDEX_SORT_ORDER_MIN_MESSAGES 1000
+/* Rebuild the order if more than 1/n of the messages are new */
+#define INDEX_SORT_ORDER_MAX_NEW_DIVISOR 4
+
+struct index_sort_order_header {
+	struct index_persist_file_header hdr;
+	/* all messages with UID < next_uid are in the list */
+	uint32_t next_uid;
+	uint32_t uids_count;
+	/* uint32_t uids[uids_count]; */
+};
+
+struct index_sort_order_context {
+	char *path;
+	ARRAY_TYPE(uint32_t) wanted_seqs;
+
+	void (*orig_sort_list_add)(struct mail_search_sort_program *program,
+				   struct mail *mail);
+	void (*orig_sort_list_finish)(struct mail_search_sort_program *program);
+};
+
+static struct mail_search_sort_program *static_order_program;
+
+static const char *
+index_sort_order_get_name(const enum mail_sort_type *sort_program)
+{
+	string_t *str = t_str_new(64);
+	unsigned int i;
+
+	for (i = 0; sort_program[i] != MAIL_SORT_END; i++) {
+		if (i > 0)
+			str_append_c(str, '-');
+		if ((sort_program[i] & MAIL_SORT_FLAG_REVERSE) != 0)
+			str_append_c(str, 'r');
+
+		switch (sort_program[i] & MAIL_SORT_MASK) {
+		case MAIL_SORT_ARRIVAL:
+			str_append(str, "arrival");
+			break;
+		case MAIL_SORT_CC:
+			str_append(str, "cc");
+			break;
+		case MAIL_SORT_DATE:
+			str_append(str, "date");
+			break;
+		case MAIL_SORT_FROM:
+			str_append(str, "from");
+			break;
+		case MAIL_SORT_SIZE:
+			str_append(str, "size");
+			break;
+		case MAIL_SORT_SUBJECT:
+			str_append(str, "subject");
+			break;
+		case MAIL_SORT_TO:
+			str_append(str, "to");
+			break;
+		case MAIL_SORT_DISPLAYFROM:
+			str_append(str, "displayfrom");
+			break;
+		case MAIL_SORT_DISPLAYTO:
+			str_append(str, "displayto");
+			break;
+		default:
+			/* relevancy depends on the search and POP3 order can
+			   be changed. these can't be saved. */
+			return NULL;
+		}
+	}
+	return str_c(str);
+}
+
+static int sort_order_seq_cmp(const uint32_t *seq1, const uint32_t *seq2)
+{
+	struct mail_search_sort_program *program = static_order_program;
+
+	return index_sort_node_cmp_type(program->temp_mail,
+					program->sort_program, *seq1, *seq2);
+}
+
+static void
+index_sort_order_merge_new(struct mail_search_sort_program *program,
+			   ARRAY_TYPE(uint32_t) *seqs,
+			   uint32_t first_new_seq, uint32_t last_new_seq)
+{
+	ARRAY_TYPE(uint32_t) new_seqs, merged_seqs;
+	const uint32_t *old, *new;
+	unsigned int i, j, old_count, new_count, left_idx, right_idx, idx;
+	uint32_t seq;
+
+	t_array_init(&new_seqs, last_new_seq - first_new_seq + 1);
+	for (seq = first_new_seq; seq <= last_new_seq; seq++)
+		array_append(&new_seqs, &seq, 1);
+	static_order_program = program;
+	array_sort(&new_seqs, sort_order_seq_cmp);
+
+	old = array_get(seqs, &old_count);
+	new = array_get(&new_seqs, &new_count);
+	i_array_init(&merged_seqs, old_count + new_count);
+
+	/* the new messages are sorted now, so each one is inserted after
+	   the previous one's position */
+	for (i = j = 0; j < new_count; j++) {
+		left_idx = i; right_idx = old_count;
+		while (left_idx < right_idx) {
+			idx = (left_idx + right_idx) / 2;
+			if (sort_order_seq_cmp(&new[j], &old[idx]) < 0)
+				right_idx = idx;
+			else
+				left_idx = idx + 1;
+		}
+		array_append(&merged_seqs, old + i, left_idx - i);
+		array_append(&merged_seqs, &new[j], 1);
+		i = left_idx;
+	}
+	array_append(&merged_seqs, old + i, old_count - i);
+
+	array_free(seqs);
+	*seqs = merged_seqs;
+}
+
+static int
+index_sort_order_read(struct index_sort_order_context *ctx,
+		      struct mail_search_sort_program *program,
+		      ARRAY_TYPE(uint32_t) *seqs, bool *changed_r)
+{
+	struct mailbox *box = program->t->box;
+	struct mail_index_view *view = program->t->view;
+	const struct mail_index_header *idx_hdr;
+	const struct index_sort_order_header *hdr;
+	const uint32_t *uids;
+	const void *data;
+	unsigned char *seen;
+	unsigned int uids_count;
+	uint32_t i, seq, messages_count, first_new_seq, last_new_seq;
+
+	if (index_persist_file_read(box, view, ctx->path,
+				    INDEX_SORT_ORDER_VERSION, sizeof(*hdr),
+				    sizeof(uint32_t), &data, &uids_count) <= 0)
+		return 0;
+
+	idx_hdr = mail_index_get_header(view);
+	hdr = data;
+	uids = (const void *)(hdr + 1);
+	if (hdr->next_uid > idx_hdr->next_uid ||
+	    hdr->uids_count != uids_count)
+		return 0;
+
+	messages_count = mail_index_view_get_messages_count(view);
+	if (!mail_index_lookup_seq_range(view, hdr->next_uid, (uint32_t)-1,
+					 &first_new_seq, &last_new_seq))
+		first_new_seq = last_new_seq = 0;
+	else if ((last_new_seq - first_new_seq + 1) >
+		 messages_count / INDEX_SORT_ORDER_MAX_NEW_DIVISOR)
+		return 0;
+
+	/* drop expunged messages */
+	seen = t_malloc0(messages_count + 1);
+	for (i = 0; i < hdr->uids_count; i++) {
+		if (uids[i] >= hdr->next_uid)
+			return 0;
+		if (!mail_index_lookup_seq(view, uids[i], &seq))
+			continue;
+		if (seen[seq] != 0)
+			return 0;
+		seen[seq] = 1;
+		array_append(seqs, &seq, 1);
+	}
+	if (array_count(seqs) + (first_new_seq == 0 ? 0 :
+				 last_new_seq - first_new_seq + 1) !=
+	    messages_count) {
+		/* some messages are missing from the list */
+		return 0;
+	}
+	*changed_r = array_count(seqs) != hdr->uids_count ||
+		first_new_seq != 0;
+
+	if (first_new_seq != 0) {
+		index_sort_order_merge_new(program, seqs,
+					   first_new_seq, last_new_seq);
+	}
+	return 1;
+}
+
+static void
+index_sort_order_write(struct index_sort_order_context *ctx,
+		       struct mail_search_sort_program *program,
+		       const ARRAY_TYPE(uint32_t) *seqs)
+{
+	struct mailbox *box = program->t->box;
+	struct mail_index_view *view = program->t->view;
+	struct index_sort_order_header hdr;
+	const uint32_t *seqp;
+	buffer_t *buf;
+	uint32_t uid;
+
+	memset(&hdr, 0, sizeof(hdr));
+	index_persist_file_header_init(&hdr.hdr, view,
+				       INDEX_SORT_ORDER_VERSION);
+	hdr.next_uid = mail_index_get_header(view)->next_uid;
+	hdr.uids_count = array_count(seqs);
+
+	buf = buffer_create_dynamic(default_pool,
+				    sizeof(hdr) + hdr.uids_count * sizeof(uid));
+	buffer_append(buf, &hdr, sizeof(hdr));
+	array_foreach(seqs, seqp) {
+		mail_index_lookup_uid(view, *seqp, &uid);
+		buffer_append(buf, &uid, sizeof(uid));
+	}
+	index_persist_file_write(box, ctx->path, buf);
+	buffer_free(&buf);
+}
+
+static void
+index_sort_order_rebuild(struct index_sort_order_context *ctx,
+			 struct mail_search_sort_program *program,
+			 ARRAY_TYPE(uint32_t) *seqs)
+{
+	struct mail *mail = program->temp_mail;
+	uint32_t seq, messages_count;
+	unsigned int i, count;
+
+	/* sort all the messages with the original sort code */
+	messages_count = mail_index_view_get_messages_count(program->t->view);
+	for (seq = 1; seq <= messages_count; seq++) {
+		mail_set_seq(mail, seq);
+		T_BEGIN {
+			ctx->orig_sort_list_add(program, mail);
+		} T_END;
+	}
+	ctx->orig_sort_list_finish(program);
+
+	/* program->seqs may actually be an array of the sort nodes, which
+	   begin with the seq */
+	count = array_count(&program->seqs);
+	for (i = 0; i < count; i++)
+		array_append(seqs, array_idx(&program->seqs, i), 1);
+	array_free(&program->seqs);
+}
+
+static void
+index_sort_order_list_add(struct mail_search_sort_program *program,
+			  struct mail *mail)
+{
+	struct index_sort_order_context *ctx = program->order_ctx;
+
+	array_append(&ctx->wanted_seqs, &mail->seq, 1);
+}
+
+static void
+index_sort_order_list_finish(struct mail_search_sort_program *program)
+{
+	struct index_sort_order_context *ctx = program->order_ctx;
+	ARRAY_TYPE(uint32_t) seqs;
+	const uint32_t *seqp;
+	unsigned char *wanted;
+	uint32_t messages_count;
+	bool changed = FALSE;
+	int ret;
+
+	messages_count = mail_index_view_get_messages_count(program->t->view);
+	i_array_init(&seqs, messages_count);
+	T_BEGIN {
+		ret = index_sort_order_read(ctx, program, &seqs, &changed);
+	} T_END;
+
+	if (ret > 0) {
+		/* we don't need the original sort context */
+		ctx->orig_sort_list_finish(program);
+	} else {
+		array_clear(&seqs);
+		index_sort_order_rebuild(ctx, program, &seqs);
+		changed = TRUE;
+	}
+	if (changed)
+		index_sort_order_write(ctx, program, &seqs);
+
+	/* the original finish may have left a sort node array here */
+	if (array_is_created(&program->seqs))
+		array_free(&program->seqs);
+	i_array_init(&program->seqs, array_count(&ctx->wanted_seqs));
+
+	if (array_count(&ctx->wanted_seqs) == messages_count) {
+		/* everything was wanted */
+		array_append_array(&program->seqs, &seqs);
+	} else {
+		wanted = i_new(unsigned char, messages_count + 1);
+		array_foreach(&ctx->wanted_seqs, seqp)
+			wanted[*seqp] = 1;
+		array_foreach(&seqs, seqp) {
+			if (wanted[*seqp] != 0)
+				array_append(&program->seqs, seqp, 1);
+		}
+		i_free(wanted);
+	}
+	array_free(&seqs);
+}
+
+void index_sort_order_init(struct mail_search_sort_program *program)
+{
+	struct mailbox_transaction_context *t = program->t;
+	struct index_sort_order_context *ctx;
+	const char *name, *dir;
+	uint32_t messages_count;
+
+	if (mail_index_is_in_memory(t->box->index))
+		return;
+
+	messages_count = mail_index_view_get_messages_count(t->view);
+	if (messages_count < INDEX_SORT_ORDER_MIN_MESSAGES ||
+	    messages_count != mail_index_view_get_messages_count(t->box->view)) {
+		/* small mailbox or there are uncommitted appends */
+		return;
+	}
+
+	name = index_sort_order_get_name(program->sort_program);
+	if (name == NULL)
+		return;
+	if (mailbox_get_path_to(t->box, MAILBOX_LIST_PATH_TYPE_INDEX,
+				&dir) <= 0)
+		return;
+
+	ctx = i_new(struct index_sort_order_context, 1);
+	ctx->path = i_strconcat(dir, "/", t->box->index_prefix,
+				INDEX_SORT_ORDER_FILE_SUFFIX, name, NULL);
+	i_array_init(&ctx->wanted_seqs, 128);
+	ctx->orig_sort_list_add = program->sort_list_add;
+	ctx->orig_sort_list_finish = program->sort_list_finish;
+
+	program->order_ctx = ctx;
+	program->sort_list_add = index_sort_order_list_add;
+	program->sort_list_finish = index_sort_order_list_finish;
+}
+
+void index_sort_order_deinit(struct mail_search_sort_program *program)
+{
+	struct index_sort_order_context *ctx = program->order_ctx;
+
+	/* if sorting wasn't finished, don't bother updating the order */
+	program->sort_list_add = ctx->orig_sort_list_add;
+	program->sort_list_finish = ctx->orig_sort_list_finish;
+	program->order_ctx = NULL;
+
+	array_free(&ctx->wanted_seqs);
+	i_free(ctx->path);
+	i_free(ctx);
+}
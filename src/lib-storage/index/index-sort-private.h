@@ -12,6 +12,7 @@ struct mail_search_sort_program {
 			      struct mail *mail);
 	void (*sort_list_finish)(struct mail_search_sort_program *program);
 	void *context;
+	struct index_sort_order_context *order_ctx;
 
 	ARRAY_TYPE(uint32_t) seqs;
 	unsigned int iter_idx;
@@ -28,4 +29,8 @@ void index_sort_list_add_string(struct mail_search_sort_program *program,
 				struct mail *mail);
 void index_sort_list_finish_string(struct mail_search_sort_program *program);
 
+/* Use the persistent sort order file for the program if possible. */
+void index_sort_order_init(struct mail_search_sort_program *program);
+void index_sort_order_deinit(struct mail_search_sort_program *program);
+
 #endif
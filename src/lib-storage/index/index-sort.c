@@ -327,6 +327,7 @@ index_sort_program_init(struct mailbox_transaction_context *t,
 	default:
 		i_unreached();
 	}
+	index_sort_order_init(program);
 	return program;
 }
 
@@ -336,6 +337,8 @@ void index_sort_program_deinit(struct mail_search_sort_program **_program)
 
 	*_program = NULL;
 
+	if (program->order_ctx != NULL)
+		index_sort_order_deinit(program);
 	if (program->context != NULL)
 		index_sort_list_finish(program);
 	mail_free(&program->temp_mail);
@@ -42,8 +42,16 @@ struct thread_finish_context {
 	ARRAY(struct mail_thread_shadow_node) shadow_nodes;
 	unsigned int next_new_root_idx;
 
+	/* The finished tree in depth-first order. When presorted=TRUE, the
+	   roots and shadow nodes were built from it and shadow index idx
+	   points to tree[idx-1]. */
+	ARRAY_TYPE(mail_thread_tree_node) tree;
+	/* Sort dates of messages in an older saved tree, sorted by UID */
+	ARRAY_TYPE(mail_thread_tree_node) old_dates;
+
 	bool use_sent_date:1;
 	bool return_seqs:1;
+	bool presorted:1;
 };
 
 struct mail_thread_iterate_context {
@@ -129,6 +137,14 @@ static int mail_thread_root_node_cmp(const struct mail_thread_root_node *r1,
 	return mail_thread_child_node_cmp(&r1->node, &r2->node);
 }
 
+static int
+mail_thread_tree_node_uid_cmp(const struct mail_thread_tree_node *n1,
+			      const struct mail_thread_tree_node *n2)
+{
+	return n1->uid < n2->uid ? -1 :
+		(n1->uid > n2->uid ? 1 : 0);
+}
+
 static uint32_t
 thread_lookup_existing(struct thread_finish_context *ctx, uint32_t idx)
 {
@@ -144,10 +160,24 @@ static void
 thread_child_node_fill(struct thread_finish_context *ctx,
 		       struct mail_thread_child_node *child)
 {
+	struct mail_thread_tree_node key;
+	const struct mail_thread_tree_node *old;
 	int tz;
 
 	child->uid = thread_lookup_existing(ctx, child->idx);
 
+	if (ctx->use_sent_date && array_is_created(&ctx->old_dates)) {
+		/* message's date doesn't change, so use the one that was
+		   saved earlier if possible */
+		key.uid = child->uid;
+		old = array_bsearch(&ctx->old_dates, &key,
+				    mail_thread_tree_node_uid_cmp);
+		if (old != NULL) {
+			child->sort_date = old->sort_date;
+			return;
+		}
+	}
+
 	if (!mail_set_uid(ctx->tmp_mail, child->uid)) {
 		/* the UID should have existed. we would have rebuild
 		   the thread tree otherwise. */
@@ -177,8 +207,23 @@ thread_sort_children(struct thread_finish_context *ctx, uint32_t parent_idx,
 	memset(&child, 0, sizeof(child));
 	array_clear(sorted_children);
 
-	/* add all child indexes to the array */
 	shadows = array_get(&ctx->shadow_nodes, &count);
+	if (ctx->presorted) {
+		/* the children were sorted already before saving the tree */
+		const struct mail_thread_tree_node *tree =
+			array_idx(&ctx->tree, 0);
+
+		child.idx = shadows[parent_idx].first_child_idx;
+		for (; child.idx != 0;
+		     child.idx = shadows[child.idx].next_sibling_idx) {
+			child.uid = tree[child.idx-1].uid;
+			child.sort_date = tree[child.idx-1].sort_date;
+			array_append(sorted_children, &child, 1);
+		}
+		return;
+	}
+
+	/* add all child indexes to the array */
 	child.idx = shadows[parent_idx].first_child_idx;
 	i_assert(child.idx != 0);
 	if (shadows[child.idx].next_sibling_idx == 0) {
@@ -608,27 +653,212 @@ mail_thread_iterate_children(struct mail_thread_iterate_context *parent_iter,
 	return child_iter;
 }
 
+static struct mail_thread_iterate_context *
+mail_thread_iterate_root(struct thread_finish_context *ctx)
+{
+	struct mail_thread_iterate_context *iter;
+
+	iter = i_new(struct mail_thread_iterate_context, 1);
+	iter->ctx = ctx;
+	iter->ctx->refcount++;
+
+	mail_thread_iterate_fill_root(iter);
+	if (ctx->return_seqs)
+		nodes_change_uids_to_seqs(iter, TRUE);
+	return iter;
+}
+
+struct mail_thread_tree_parent {
+	uint32_t idx, prev_child_idx;
+	uint32_t children_left;
+};
+
+static bool mail_thread_tree_import(struct thread_finish_context *ctx)
+{
+	ARRAY(struct mail_thread_tree_parent) parents;
+	struct mail_thread_tree_parent *parent, new_parent;
+	struct mail_thread_shadow_node *shadows;
+	struct mail_thread_root_node root;
+	const struct mail_thread_tree_node *tree;
+	unsigned int i, count, parents_count;
+	uint32_t idx;
+	bool ret = TRUE;
+
+	tree = array_get(&ctx->tree, &count);
+	i_array_init(&ctx->roots, I_MIN(128, count + 1));
+	i_array_init(&ctx->shadow_nodes, count + 1);
+	/* make sure all shadow indexes are accessible directly. */
+	(void)array_idx_modifiable(&ctx->shadow_nodes, count);
+	shadows = array_idx_modifiable(&ctx->shadow_nodes, 0);
+
+	memset(&root, 0, sizeof(root));
+	memset(&new_parent, 0, sizeof(new_parent));
+	t_array_init(&parents, 32);
+	for (i = 0; i < count && ret; i++) {
+		idx = i + 1;
+		parent = array_get_modifiable(&parents, &parents_count);
+		if (parents_count == 0) {
+			root.node.idx = idx;
+			root.node.uid = tree[i].uid;
+			root.node.sort_date = tree[i].sort_date;
+			root.dummy = tree[i].uid == 0;
+			if (root.dummy && tree[i].children_count == 0)
+				ret = FALSE;
+			array_append(&ctx->roots, &root, 1);
+		} else {
+			parent += parents_count - 1;
+			if (tree[i].uid == 0)
+				ret = FALSE;
+			if (parent->prev_child_idx == 0) {
+				shadows[parent->idx].first_child_idx = idx;
+			} else {
+				shadows[parent->prev_child_idx].
+					next_sibling_idx = idx;
+			}
+			parent->prev_child_idx = idx;
+			parent->children_left--;
+		}
+
+		if (tree[i].children_count > 0) {
+			new_parent.idx = idx;
+			new_parent.children_left = tree[i].children_count;
+			array_append(&parents, &new_parent, 1);
+		} else {
+			/* drop the parents whose all children are added */
+			while ((parents_count = array_count(&parents)) > 0) {
+				parent = array_idx_modifiable(&parents,
+							      parents_count-1);
+				if (parent->children_left > 0)
+					break;
+				array_delete(&parents, parents_count-1, 1);
+			}
+		}
+	}
+	if (array_count(&parents) > 0)
+		ret = FALSE;
+	if (!ret) {
+		array_free(&ctx->roots);
+		array_free(&ctx->shadow_nodes);
+		return FALSE;
+	}
+	ctx->presorted = TRUE;
+	return TRUE;
+}
+
+static unsigned int
+mail_thread_tree_export(struct mail_thread_iterate_context *iter,
+			ARRAY_TYPE(mail_thread_tree_node) *tree)
+{
+	struct mail_thread_iterate_context *child_iter;
+	const struct mail_thread_child_node *child;
+	struct mail_thread_tree_node *node;
+	unsigned int idx, children_count, count = 0;
+
+	while ((child = mail_thread_iterate_next(iter, &child_iter)) != NULL) {
+		idx = array_count(tree);
+		node = array_append_space(tree);
+		node->uid = child->uid;
+		node->sort_date = child->sort_date;
+		if (child_iter != NULL) {
+			children_count =
+				mail_thread_tree_export(child_iter, tree);
+			node = array_idx_modifiable(tree, idx);
+			node->children_count = children_count;
+			(void)mail_thread_iterate_deinit(&child_iter);
+		}
+		count++;
+	}
+	return count;
+}
+
+static void
+mail_thread_tree_get_old_dates(struct thread_finish_context *ctx,
+			       enum mail_thread_type thread_type)
+{
+	const struct mail_thread_tree_node *node;
+	unsigned int subtree_left = 0;
+
+	i_array_init(&ctx->old_dates, array_count(&ctx->tree));
+	array_foreach(&ctx->tree, node) {
+		if (subtree_left == 0) {
+			/* root node. with REFS its date is the thread's
+			   latest date, not the message's own. */
+			subtree_left = node->children_count;
+			if (thread_type == MAIL_THREAD_REFS)
+				continue;
+		} else {
+			subtree_left += node->children_count;
+			subtree_left--;
+		}
+		if (node->uid != 0 && node->sort_date != 0)
+			array_append(&ctx->old_dates, node, 1);
+	}
+	array_sort(&ctx->old_dates, mail_thread_tree_node_uid_cmp);
+}
+
+static void mail_thread_finish_tree(struct thread_finish_context *ctx,
+				    enum mail_thread_type thread_type)
+{
+	struct mailbox *box = ctx->tmp_mail->box;
+	struct mail_thread_iterate_context *iter;
+	bool current, imported = FALSE, return_seqs = ctx->return_seqs;
+	int ret;
+
+	i_array_init(&ctx->tree, 128);
+	T_BEGIN {
+		ret = mail_thread_tree_read(box, thread_type,
+					    &ctx->tree, &current);
+		if (ret > 0 && current) {
+			/* nothing has changed since the tree was saved */
+			imported = mail_thread_tree_import(ctx);
+		}
+	} T_END;
+	if (imported)
+		return;
+	if (ret > 0)
+		mail_thread_tree_get_old_dates(ctx, thread_type);
+	array_clear(&ctx->tree);
+
+	mail_thread_finish(ctx, thread_type);
+
+	/* save the finished tree and continue iterating it from there.
+	   keep the extra reference so the context isn't freed with the
+	   iterator. */
+	ctx->refcount++;
+	ctx->return_seqs = FALSE;
+	iter = mail_thread_iterate_root(ctx);
+	(void)mail_thread_tree_export(iter, &ctx->tree);
+	(void)mail_thread_iterate_deinit(&iter);
+	ctx->return_seqs = return_seqs;
+	ctx->refcount--;
+
+	mail_thread_tree_write(box, thread_type, &ctx->tree);
+
+	array_free(&ctx->roots);
+	array_free(&ctx->shadow_nodes);
+	T_BEGIN {
+		imported = mail_thread_tree_import(ctx);
+	} T_END;
+	i_assert(imported);
+}
+
 struct mail_thread_iterate_context *
 mail_thread_iterate_init_full(struct mail_thread_cache *cache,
 			      struct mail *tmp_mail,
 			      enum mail_thread_type thread_type,
-			      bool return_seqs)
+			      bool return_seqs, bool use_tree)
 {
-	struct mail_thread_iterate_context *iter;
 	struct thread_finish_context *ctx;
 
-	iter = i_new(struct mail_thread_iterate_context, 1);
-	ctx = iter->ctx = i_new(struct thread_finish_context, 1);
-	ctx->refcount = 1;
+	ctx = i_new(struct thread_finish_context, 1);
 	ctx->cache = cache;
 	ctx->tmp_mail = tmp_mail;
 	ctx->return_seqs = return_seqs;
-	mail_thread_finish(ctx, thread_type);
-
-	mail_thread_iterate_fill_root(iter);
-	if (return_seqs)
-		nodes_change_uids_to_seqs(iter, TRUE);
-	return iter;
+	if (use_tree)
+		mail_thread_finish_tree(ctx, thread_type);
+	else
+		mail_thread_finish(ctx, thread_type);
+	return mail_thread_iterate_root(ctx);
 }
 
 const struct mail_thread_child_node *
@@ -669,6 +899,10 @@ int mail_thread_iterate_deinit(struct mail_thread_iterate_context **_iter)
 	if (--iter->ctx->refcount == 0) {
 		array_free(&iter->ctx->roots);
 		array_free(&iter->ctx->shadow_nodes);
+		if (array_is_created(&iter->ctx->tree))
+			array_free(&iter->ctx->tree);
+		if (array_is_created(&iter->ctx->old_dates))
+			array_free(&iter->ctx->old_dates);
 		i_free(iter->ctx);
 	}
 	array_free(&iter->children);
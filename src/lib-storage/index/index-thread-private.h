@@ -6,6 +6,8 @@
 #include "mail-index-strmap.h"
 
 #define MAIL_THREAD_INDEX_SUFFIX ".thread"
+/* Smaller mailboxes are fast enough to thread each time */
+#define MAIL_THREAD_TREE_MIN_MESSAGES 1000
 
 /* After initially building the index, assign first_invalid_msgid_idx to
    the next unused index + SKIP_COUNT. When more messages are added and
@@ -58,6 +60,17 @@ struct mail_thread_cache {
 	ARRAY_TYPE(mail_thread_node) thread_nodes;
 };
 
+/* Finished thread tree node. The nodes are saved in depth-first order with
+   the children already sorted. */
+struct mail_thread_tree_node {
+	/* UID of the message, or 0 for dummy nodes */
+	uint32_t uid;
+	uint32_t children_count;
+	/* timestamp the node was sorted with, 0 if it wasn't needed */
+	int64_t sort_date;
+};
+ARRAY_DEFINE_TYPE(mail_thread_tree_node, struct mail_thread_tree_node);
+
 static inline uint32_t crc32_str_nonzero(const char *str)
 {
 	uint32_t value = crc32_str(str);
@@ -75,7 +88,22 @@ struct mail_thread_iterate_context *
 mail_thread_iterate_init_full(struct mail_thread_cache *cache,
 			      struct mail *tmp_mail,
 			      enum mail_thread_type thread_type,
-			      bool return_seqs);
+			      bool return_seqs, bool use_tree);
+
+/* Returns TRUE if the finished thread tree should be saved for these
+   search args. */
+bool mail_thread_tree_is_wanted(struct mailbox *box,
+				const struct mail_search_args *args);
+/* Read the saved thread tree. Returns 1 if read, 0 if there is no usable
+   file. current_r is set to TRUE if the tree still matches the mailbox
+   exactly. Otherwise only the sort dates in it can be used. */
+int mail_thread_tree_read(struct mailbox *box,
+			  enum mail_thread_type thread_type,
+			  ARRAY_TYPE(mail_thread_tree_node) *nodes,
+			  bool *current_r);
+void mail_thread_tree_write(struct mailbox *box,
+			    enum mail_thread_type thread_type,
+			    const ARRAY_TYPE(mail_thread_tree_node) *nodes);
 
 void index_thread_mailbox_opened(struct mailbox *box);
 
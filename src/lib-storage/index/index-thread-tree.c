@@ -0,0 +1,137 @@
+/* Copyright (c) 2016 Dovecot authors, see the included COPYING file */
+
+/* The finished thread tree is saved to dovecot.index.thread-<type> file, so
+   that THREAD commands in later sessions don't need to look up the sort
+   dates and subjects of all the messages again. The file is valid as long
+   as no messages have been added or expunged. When the mailbox has changed,
+   the tree is built again, but the sort dates of the old messages are taken
+   from the file. */
+
+#include "lib.h"
+#include "array.h"
+#include "str.h"
+#include "mail-search.h"
+#include "index-storage.h"
+#include "index-persist-file.h"
+#include "index-thread-private.h"
+
+#define MAIL_THREAD_TREE_SUFFIX ".thread-"
+#define MAIL_THREAD_TREE_VERSION 2
+
+struct mail_thread_tree_header {
+	struct index_persist_file_header hdr;
+	/* the tree contains all the messages when these still match */
+	uint32_t next_uid;
+	uint32_t messages_count;
+	uint32_t nodes_count;
+	/* struct mail_thread_tree_node nodes[nodes_count]; */
+};
+
+static const char *
+mail_thread_tree_get_path(struct mailbox *box,
+			  enum mail_thread_type thread_type)
+{
+	return t_strconcat(box->index->filepath, MAIL_THREAD_TREE_SUFFIX,
+			   t_str_lcase(mail_thread_type_to_str(thread_type)),
+			   NULL);
+}
+
+bool mail_thread_tree_is_wanted(struct mailbox *box,
+				const struct mail_search_args *args)
+{
+	const struct mail_search_arg *arg = args->args;
+
+	if (arg == NULL || arg->type != SEARCH_ALL || arg->match_not ||
+	    arg->next != NULL) {
+		/* only the full mailbox's tree is saved */
+		return FALSE;
+	}
+	if (mail_index_is_in_memory(box->index))
+		return FALSE;
+	return mail_index_view_get_messages_count(box->view) >=
+		MAIL_THREAD_TREE_MIN_MESSAGES;
+}
+
+static bool
+mail_thread_tree_is_current(struct mailbox *box,
+			    const struct mail_thread_tree_header *hdr,
+			    const struct mail_thread_tree_node *nodes)
+{
+	const struct mail_index_header *idx_hdr;
+	unsigned char *seen;
+	uint32_t i, seq, messages_count, found_count = 0;
+
+	idx_hdr = mail_index_get_header(box->view);
+	messages_count = mail_index_view_get_messages_count(box->view);
+	if (hdr->next_uid != idx_hdr->next_uid ||
+	    hdr->messages_count != messages_count)
+		return FALSE;
+
+	/* make sure all the messages are in the tree exactly once */
+	seen = t_malloc0(messages_count + 1);
+	for (i = 0; i < hdr->nodes_count; i++) {
+		if (nodes[i].uid == 0)
+			continue;
+		if (!mail_index_lookup_seq(box->view, nodes[i].uid, &seq) ||
+		    seen[seq] != 0)
+			return FALSE;
+		seen[seq] = 1;
+		found_count++;
+	}
+	return found_count == messages_count;
+}
+
+int mail_thread_tree_read(struct mailbox *box,
+			  enum mail_thread_type thread_type,
+			  ARRAY_TYPE(mail_thread_tree_node) *nodes,
+			  bool *current_r)
+{
+	const struct mail_thread_tree_header *hdr;
+	const struct mail_thread_tree_node *file_nodes;
+	const void *data;
+	unsigned int nodes_count;
+
+	*current_r = FALSE;
+
+	if (index_persist_file_read(box, box->view,
+				    mail_thread_tree_get_path(box, thread_type),
+				    MAIL_THREAD_TREE_VERSION, sizeof(*hdr),
+				    sizeof(struct mail_thread_tree_node),
+				    &data, &nodes_count) <= 0)
+		return 0;
+
+	hdr = data;
+	if (hdr->nodes_count != nodes_count)
+		return 0;
+
+	file_nodes = (const void *)(hdr + 1);
+	array_append(nodes, file_nodes, hdr->nodes_count);
+	*current_r = mail_thread_tree_is_current(box, hdr, file_nodes);
+	return 1;
+}
+
+void mail_thread_tree_write(struct mailbox *box,
+			    enum mail_thread_type thread_type,
+			    const ARRAY_TYPE(mail_thread_tree_node) *nodes)
+{
+	struct mail_thread_tree_header hdr;
+	buffer_t *buf;
+
+	memset(&hdr, 0, sizeof(hdr));
+	index_persist_file_header_init(&hdr.hdr, box->view,
+				       MAIL_THREAD_TREE_VERSION);
+	hdr.next_uid = mail_index_get_header(box->view)->next_uid;
+	hdr.messages_count = mail_index_view_get_messages_count(box->view);
+	hdr.nodes_count = array_count(nodes);
+
+	buf = buffer_create_dynamic(default_pool, sizeof(hdr) +
+		hdr.nodes_count * sizeof(struct mail_thread_tree_node));
+	buffer_append(buf, &hdr, sizeof(hdr));
+	if (hdr.nodes_count > 0) {
+		buffer_append(buf, array_idx(nodes, 0), hdr.nodes_count *
+			      sizeof(struct mail_thread_tree_node));
+	}
+	index_persist_file_write(box, mail_thread_tree_get_path(box, thread_type),
+				 buf);
+	buffer_free(&buf);
+}
@@ -611,7 +611,8 @@ mail_thread_iterate_init(struct mail_thread_context *ctx,
 	struct mail_thread_mailbox *tbox = MAIL_THREAD_CONTEXT(ctx->box);
 
 	return mail_thread_iterate_init_full(tbox->cache, ctx->tmp_mail,
-					     thread_type, write_seqs);
+		thread_type, write_seqs,
+		mail_thread_tree_is_wanted(ctx->box, ctx->search_args));
 }
 
 static void mail_thread_mailbox_close(struct mailbox *box)
@@ -7,9 +7,12 @@
 #include "mail-index-view-private.h"
 #include "mail-storage-hooks.h"
 #include "mail-storage-private.h"
+#include "mail-namespace.h"
 #include "mailbox-list-index-storage.h"
 #include "mailbox-list-index-sync.h"
 
+#include <fcntl.h>
+
 #define MAILBOX_LIST_INDEX_REFRESH_DELAY_MSECS 1000
 
 /* dovecot.list.index.log doesn't have to be kept for that long. */
@@ -805,6 +808,65 @@ mailbox_list_index_namespaces_added(struct mail_namespace *namespaces)
 		mailbox_list_index_init_finish(ns->list);
 }
 
+static void
+mailbox_list_index_prefetch_file(struct mail_user *user, const char *path)
+{
+/* HAVE_POSIX_FADVISE alone isn't enough for CentOS 4.9 */
+#if defined(HAVE_POSIX_FADVISE) && defined(POSIX_FADV_WILLNEED)
+	int fd, ret;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		if (errno != ENOENT)
+			i_error("open(%s) failed: %m", path);
+		return;
+	}
+	/* this only starts the reads, so the files are read in parallel */
+	if ((ret = posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED)) != 0) {
+		errno = ret;
+		i_error("posix_fadvise(%s) failed: %m", path);
+	} else if (user->mail_debug) {
+		i_debug("Prefetching index file %s", path);
+	}
+	i_close_fd(&fd);
+#endif
+}
+
+static void
+mailbox_list_index_namespaces_created(struct mail_namespace *namespaces)
+{
+	struct mail_user *user = namespaces->user;
+	struct mail_namespace *ns;
+	const char *dir;
+
+	/* skip e.g. shared and raw users */
+	if (user->autocreated)
+		return;
+	ns = mail_namespace_find_inbox(namespaces);
+	if (ns == NULL || !ns->list->mail_set->mail_prefetch_indexes)
+		return;
+
+	/* INBOX is very likely going to be opened next. start reading its
+	   indexes while the caller is still initializing. */
+	if (mailbox_list_get_path(ns->list, "INBOX",
+				  MAILBOX_LIST_PATH_TYPE_INDEX, &dir) > 0) {
+		mailbox_list_index_prefetch_file(user,
+			t_strconcat(dir, "/"MAIL_INDEX_PREFIX, NULL));
+		mailbox_list_index_prefetch_file(user,
+			t_strconcat(dir, "/"MAIL_INDEX_PREFIX".log", NULL));
+		mailbox_list_index_prefetch_file(user,
+			t_strconcat(dir, "/"MAIL_INDEX_PREFIX".cache", NULL));
+	}
+	if (INDEX_LIST_CONTEXT(ns->list) != NULL &&
+	    mailbox_list_get_root_path(ns->list, MAILBOX_LIST_PATH_TYPE_INDEX,
+				       &dir)) {
+		mailbox_list_index_prefetch_file(user,
+			t_strconcat(dir, "/"MAILBOX_LIST_INDEX_PREFIX, NULL));
+		mailbox_list_index_prefetch_file(user,
+			t_strconcat(dir, "/"MAILBOX_LIST_INDEX_PREFIX".log", NULL));
+	}
+}
+
 static void mailbox_list_index_mailbox_allocated(struct mailbox *box)
 {
 	struct mailbox_list_index *ilist = INDEX_LIST_CONTEXT(box->list);
@@ -827,6 +889,7 @@ static void mailbox_list_index_mailbox_allocated(struct mailbox *box)
 
 static struct mail_storage_hooks mailbox_list_index_hooks = {
 	.mailbox_list_created = mailbox_list_index_created,
+	.mail_namespaces_created = mailbox_list_index_namespaces_created,
 	.mail_namespaces_added = mailbox_list_index_namespaces_added,
 	.mailbox_allocated = mailbox_list_index_mailbox_allocated
 };
@@ -535,6 +535,9 @@ struct mailbox_transaction_stats {
 	unsigned long long files_read_bytes;
 	/* number of cache lookup hits */
 	unsigned long cache_hit_count;
+	/* number of FTS search result cache hits/misses */
+	unsigned long fts_cache_hit_count;
+	unsigned long fts_cache_miss_count;
 };
 
 struct mail_save_private_changes {
@@ -611,8 +614,19 @@ struct mail_search_context {
 
 	ARRAY(union mail_search_module_context *) module_contexts;
 
+	mailbox_search_async_callback_t *async_callback;
+	void *async_context;
+
+	/* if non-zero, overrides mail_prefetch_count */
+	unsigned int prefetch_count;
+
 	bool seen_lost_data:1;
 	bool progress_hidden:1;
+	/* plugin is waiting for an asynchronous lookup to finish. it calls
+	   mailbox_search_async_continue() once it's done. */
+	bool async_waiting:1;
+	/* prefetch the full mails */
+	bool prefetch_bodies:1;
 };
 
 struct mail_save_data {
@@ -733,6 +747,9 @@ int mailbox_get_path_to(struct mailbox *box, enum mailbox_list_path_type type,
 const struct mailbox_permissions *mailbox_get_permissions(struct mailbox *box);
 /* Force permissions to be refreshed on next lookup */
 void mailbox_refresh_permissions(struct mailbox *box);
+/* Finished waiting for an asynchronous search lookup. Clears async_waiting
+   and calls the search's async callback. */
+void mailbox_search_async_continue(struct mail_search_context *ctx);
 
 /* Open private index files for mailbox. Returns 1 if opened, 0 if there
    are no private indexes (or flags) in this mailbox, -1 if error. */
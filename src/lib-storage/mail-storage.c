@@ -1872,6 +1872,35 @@ bool mailbox_search_seen_lost_data(struct mail_search_context *ctx)
 	return ctx->seen_lost_data;
 }
 
+#undef mailbox_search_set_async_callback
+void mailbox_search_set_async_callback(struct mail_search_context *ctx,
+				       mailbox_search_async_callback_t *callback,
+				       void *context)
+{
+	ctx->async_callback = callback;
+	ctx->async_context = context;
+}
+
+bool mailbox_search_is_waiting(struct mail_search_context *ctx)
+{
+	return ctx->async_waiting;
+}
+
+void mailbox_search_set_prefetch(struct mail_search_context *ctx,
+				 unsigned int count, bool bodies)
+{
+	ctx->prefetch_count = count;
+	ctx->prefetch_bodies = bodies;
+}
+
+void mailbox_search_async_continue(struct mail_search_context *ctx)
+{
+	i_assert(ctx->async_waiting);
+
+	ctx->async_waiting = FALSE;
+	ctx->async_callback(ctx->async_context);
+}
+
 int mailbox_search_result_build(struct mailbox_transaction_context *t,
 				struct mail_search_args *args,
 				enum mailbox_search_result_flags flags,
@@ -2555,6 +2584,8 @@ mail_storage_settings_to_index_flags(const struct mail_storage_settings *set)
 		index_flags |= MAIL_INDEX_OPEN_FLAG_DOTLOCK_USE_EXCL;
 	if (set->mail_nfs_index)
 		index_flags |= MAIL_INDEX_OPEN_FLAG_NFS_FLUSH;
+	if (set->mail_cache_columns)
+		index_flags |= MAIL_INDEX_OPEN_FLAG_CACHE_COLUMNS;
 	return index_flags;
 }
 
@@ -403,6 +403,7 @@ ARRAY_DEFINE_TYPE(mailboxes, struct mailbox *);
 extern ARRAY_TYPE(mail_storage) mail_storage_classes;
 
 typedef void mailbox_notify_callback_t(struct mailbox *box, void *context);
+typedef void mailbox_search_async_callback_t(void *context);
 
 void mail_storage_init(void);
 void mail_storage_deinit(void);
@@ -672,6 +673,28 @@ bool mailbox_search_next_nonblock(struct mail_search_context *ctx,
    determine correctly if those messages should have been returned in this
    search. */
 bool mailbox_search_seen_lost_data(struct mail_search_context *ctx);
+/* Allow the search to wait for asynchronous lookups (e.g. FTS lookups from
+   a remote server) instead of blocking. This must be called before the first
+   mailbox_search_next*() call, and the caller must keep running the ioloop
+   between the calls. When mailbox_search_next_nonblock() returns
+   tryagain_r=TRUE and mailbox_search_is_waiting() returns TRUE, the callback
+   is called once the search can be continued. */
+void mailbox_search_set_async_callback(struct mail_search_context *ctx,
+				       mailbox_search_async_callback_t *callback,
+				       void *context);
+#define mailbox_search_set_async_callback(ctx, callback, context) \
+	mailbox_search_set_async_callback(ctx, \
+		(mailbox_search_async_callback_t *)callback, \
+		(void *)((char *)context + CALLBACK_TYPECHECK(callback, \
+			void (*)(typeof(context)))))
+/* Returns TRUE if the search is waiting for an asynchronous lookup. */
+bool mailbox_search_is_waiting(struct mail_search_context *ctx);
+/* Prefetch up to count mails ahead of the returned mail, overriding the
+   mail_prefetch_count setting. If bodies=TRUE, the prefetching reads the
+   full mails, not only the parts needed by wanted_fields. This must be
+   called before the first mailbox_search_next*() call. */
+void mailbox_search_set_prefetch(struct mail_search_context *ctx,
+				 unsigned int count, bool bodies);
 
 /* Remember the search result for future use. This must be called before the
    first mailbox_search_next*() call. */
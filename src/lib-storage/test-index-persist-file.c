@@ -0,0 +1,309 @@
+/* Copyright (c) 2016 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "buffer.h"
+#include "istream.h"
+#include "str.h"
+#include "mail-index.h"
+#include "mail-user.h"
+#include "mail-namespace.h"
+#include "mail-thread.h"
+#include "mail-storage-private.h"
+#include "index/index-persist-file.h"
+#include "test-common.h"
+#include "test-mail-storage-common.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <utime.h>
+#include <sys/stat.h>
+
+#define TEST_VERSION 3
+#define TEST_THREAD_FILE_SUFFIX ".thread-references"
+
+struct test_file_header {
+	struct index_persist_file_header hdr;
+	uint32_t records_count;
+};
+
+static struct test_mail_storage test_storage;
+static unsigned int test_msg_counter;
+
+static struct mailbox *test_box_open(void)
+{
+	struct mail_namespace *ns;
+	struct mailbox *box;
+
+	ns = mail_namespace_find_inbox(test_storage.user->namespaces);
+	box = mailbox_alloc(ns->list, "INBOX", 0);
+	if (mailbox_sync(box, 0) < 0)
+		i_fatal("mailbox_sync(INBOX) failed: %s",
+			mailbox_get_last_error(box, NULL));
+	return box;
+}
+
+static const char *test_index_path(struct mailbox *box, const char *suffix)
+{
+	const char *dir;
+
+	if (mailbox_get_path_to(box, MAILBOX_LIST_PATH_TYPE_INDEX, &dir) <= 0)
+		i_fatal("INBOX has no index directory");
+	return t_strconcat(dir, "/", box->index_prefix, suffix, NULL);
+}
+
+static void test_save(unsigned int count)
+{
+	struct mailbox *box = test_box_open();
+	struct mailbox_transaction_context *t;
+	struct mail_save_context *save_ctx;
+	struct istream *input;
+	string_t *str = t_str_new(128);
+	unsigned int i;
+	int ret;
+
+	t = mailbox_transaction_begin(box, MAILBOX_TRANSACTION_FLAG_EXTERNAL);
+	for (i = 0; i < count; i++) {
+		test_msg_counter++;
+		str_truncate(str, 0);
+		str_printfa(str, "Message-ID: <%u@example.com>\r\n"
+			    "Subject: message %u\r\n\r\nbody\r\n",
+			    test_msg_counter, test_msg_counter);
+		input = i_stream_create_from_data(str_data(str), str_len(str));
+		save_ctx = mailbox_save_alloc(t);
+		if (mailbox_save_begin(&save_ctx, input) < 0)
+			i_fatal("mailbox_save_begin() failed");
+		while ((ret = i_stream_read(input)) > 0 || ret == -2) {
+			if (mailbox_save_continue(save_ctx) < 0)
+				i_fatal("mailbox_save_continue() failed");
+		}
+		if (mailbox_save_finish(&save_ctx) < 0)
+			i_fatal("mailbox_save_finish() failed");
+		i_stream_unref(&input);
+	}
+	if (mailbox_transaction_commit(&t) < 0)
+		i_fatal("mailbox_transaction_commit() failed: %s",
+			mailbox_get_last_error(box, NULL));
+	mailbox_free(&box);
+}
+
+static void
+test_file_write(struct mailbox *box, const char *path,
+		unsigned int records_count)
+{
+	struct test_file_header hdr;
+	buffer_t *buf;
+	uint32_t i;
+
+	memset(&hdr, 0, sizeof(hdr));
+	index_persist_file_header_init(&hdr.hdr, box->view, TEST_VERSION);
+	hdr.records_count = records_count;
+
+	buf = buffer_create_dynamic(default_pool, 128);
+	buffer_append(buf, &hdr, sizeof(hdr));
+	for (i = 0; i < records_count; i++)
+		buffer_append(buf, &i, sizeof(i));
+	index_persist_file_write(box, path, buf);
+	buffer_free(&buf);
+}
+
+static int
+test_file_read(struct mailbox *box, const char *path,
+	       unsigned int *records_count_r)
+{
+	const struct test_file_header *hdr;
+	const uint32_t *records;
+	const void *data;
+	uint32_t i;
+	int ret;
+
+	*records_count_r = 0;
+	ret = index_persist_file_read(box, box->view, path, TEST_VERSION,
+				      sizeof(*hdr), sizeof(uint32_t),
+				      &data, records_count_r);
+	if (ret > 0) {
+		hdr = data;
+		records = (const void *)(hdr + 1);
+		test_assert(hdr->records_count == *records_count_r);
+		for (i = 0; i < *records_count_r; i++)
+			test_assert_idx(records[i] == i, i);
+	}
+	return ret;
+}
+
+static void
+test_file_modify(const char *path, off_t offset, const void *data, size_t size)
+{
+	int fd;
+
+	fd = open(path, O_WRONLY);
+	if (fd == -1)
+		i_fatal("open(%s) failed: %m", path);
+	if (pwrite(fd, data, size, offset) != (ssize_t)size)
+		i_fatal("pwrite(%s) failed: %m", path);
+	i_close_fd(&fd);
+}
+
+static void test_index_persist_file(void)
+{
+	struct mailbox *box;
+	struct index_persist_file_header hdr;
+	const char *path;
+	unsigned int count;
+	uint32_t value;
+	int fd;
+
+	test_begin("index persist file");
+	box = test_box_open();
+	path = test_index_path(box, ".test");
+
+	/* missing */
+	test_assert(test_file_read(box, path, &count) == 0);
+
+	/* round-trip */
+	test_file_write(box, path, 0);
+	test_assert(test_file_read(box, path, &count) == 1 && count == 0);
+	test_file_write(box, path, 5);
+	test_assert(test_file_read(box, path, &count) == 1 && count == 5);
+
+	/* wrong version */
+	value = TEST_VERSION + 1;
+	test_file_modify(path, offsetof(struct index_persist_file_header,
+					version), &value, sizeof(value));
+	test_assert(test_file_read(box, path, &count) == 0);
+
+	/* wrong UIDVALIDITY */
+	test_file_write(box, path, 5);
+	value = mail_index_get_header(box->view)->uid_validity + 1;
+	test_file_modify(path, offsetof(struct index_persist_file_header,
+					uid_validity), &value, sizeof(value));
+	test_assert(test_file_read(box, path, &count) == 0);
+
+	/* written by a host with different endianness */
+	test_file_write(box, path, 5);
+	index_persist_file_header_init(&hdr, box->view, TEST_VERSION);
+	hdr.compat_flags ^= MAIL_INDEX_COMPAT_LITTLE_ENDIAN;
+	test_file_modify(path, offsetof(struct index_persist_file_header,
+					compat_flags),
+			 &hdr.compat_flags, sizeof(hdr.compat_flags));
+	test_assert(test_file_read(box, path, &count) == 0);
+
+	/* partial record */
+	test_file_write(box, path, 5);
+	if (truncate(path, sizeof(struct test_file_header) +
+		     5 * sizeof(uint32_t) - 1) < 0)
+		i_fatal("truncate(%s) failed: %m", path);
+	test_assert(test_file_read(box, path, &count) == 0);
+
+	/* truncated header */
+	if (truncate(path, sizeof(hdr) - 1) < 0)
+		i_fatal("truncate(%s) failed: %m", path);
+	test_assert(test_file_read(box, path, &count) == 0);
+
+	/* the file is only replaced once it's fully written */
+	test_file_write(box, path, 5);
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		i_fatal("open(%s) failed: %m", path);
+	test_file_write(box, path, 2);
+	test_assert(test_file_read(box, path, &count) == 1 && count == 2);
+	test_assert(lseek(fd, 0, SEEK_END) ==
+		    (off_t)(sizeof(struct test_file_header) +
+			    5 * sizeof(uint32_t)));
+	i_close_fd(&fd);
+
+	i_unlink(path);
+	mailbox_free(&box);
+	test_end();
+}
+
+static unsigned int test_thread_roots_count(void)
+{
+	struct mailbox *box = test_box_open();
+	struct mail_thread_context *ctx;
+	struct mail_thread_iterate_context *iter, *child_iter;
+	unsigned int count = 0;
+
+	if (mail_thread_init(box, NULL, &ctx) < 0)
+		i_fatal("mail_thread_init() failed");
+	iter = mail_thread_iterate_init(ctx, MAIL_THREAD_REFERENCES, FALSE);
+	while (mail_thread_iterate_next(iter, &child_iter) != NULL) {
+		if (child_iter != NULL)
+			(void)mail_thread_iterate_deinit(&child_iter);
+		count++;
+	}
+	if (mail_thread_iterate_deinit(&iter) < 0)
+		i_fatal("mail_thread_iterate_deinit() failed");
+	mail_thread_deinit(&ctx);
+	mailbox_free(&box);
+	return count;
+}
+
+static void test_thread_tree_file(void)
+{
+	struct mailbox *box;
+	struct test_file_header hdr;
+	struct utimbuf ut;
+	struct stat st;
+	const char *path;
+	int fd;
+
+	test_begin("thread tree file");
+	test_save(1000);
+	box = test_box_open();
+	path = test_index_path(box, TEST_THREAD_FILE_SUFFIX);
+	mailbox_free(&box);
+
+	test_assert(test_thread_roots_count() == 1000);
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		i_fatal("open(%s) failed: %m", path);
+	if (read(fd, &hdr, sizeof(hdr)) != sizeof(hdr))
+		i_fatal("read(%s) failed: %m", path);
+	i_close_fd(&fd);
+	test_assert(hdr.hdr.version != 0);
+#if !WORDS_BIGENDIAN
+	test_assert(hdr.hdr.compat_flags == MAIL_INDEX_COMPAT_LITTLE_ENDIAN);
+#endif
+
+	/* unchanged mailbox - the file isn't rewritten */
+	ut.actime = ut.modtime = 1;
+	if (utime(path, &ut) < 0)
+		i_fatal("utime(%s) failed: %m", path);
+	test_assert(test_thread_roots_count() == 1000);
+	if (stat(path, &st) < 0)
+		i_fatal("stat(%s) failed: %m", path);
+	test_assert(st.st_mtime == 1);
+
+	/* a new message - the tree is rebuilt and written */
+	test_save(1);
+	test_assert(test_thread_roots_count() == 1001);
+	if (stat(path, &st) < 0)
+		i_fatal("stat(%s) failed: %m", path);
+	test_assert(st.st_mtime != 1);
+	test_end();
+}
+
+static void test_setup(void)
+{
+	test_mail_storage_init(&test_storage, "test-index-persist-file",
+		"persist_test", (const char *const[]) {
+			"mail=sdbox:~/mail", NULL });
+}
+
+static void test_teardown(void)
+{
+	test_mail_storage_deinit(&test_storage);
+}
+
+int main(int argc, char **argv)
+{
+	static void (*test_functions[])(void) = {
+		test_setup,
+		test_index_persist_file,
+		test_thread_tree_file,
+		test_teardown,
+		NULL
+	};
+	return test_mail_storage_run("test-index-persist-file", &argc, &argv,
+				     test_functions);
+}
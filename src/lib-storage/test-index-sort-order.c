@@ -0,0 +1,327 @@
+/* Copyright (c) 2016 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "istream.h"
+#include "str.h"
+#include "mail-index.h"
+#include "mail-user.h"
+#include "mail-namespace.h"
+#include "mail-search-build.h"
+#include "mail-storage-private.h"
+#include "test-common.h"
+#include "test-mail-storage-common.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define TEST_SORT_FILE_NAME "dovecot.index.sort-size"
+
+/* struct index_sort_order_header */
+struct test_sort_file_header {
+	uint32_t version;
+	uint8_t compat_flags;
+	uint8_t unused[3];
+	uint32_t uid_validity;
+	uint32_t next_uid;
+	uint32_t uids_count;
+};
+
+struct test_sort_msg {
+	uint32_t seq, uid;
+	uoff_t size;
+};
+
+static struct test_mail_storage test_storage;
+static const char *test_sort_path;
+static unsigned int test_msg_counter;
+
+static struct mailbox *test_box_open(void)
+{
+	struct mail_namespace *ns;
+	struct mailbox *box;
+
+	ns = mail_namespace_find_inbox(test_storage.user->namespaces);
+	box = mailbox_alloc(ns->list, "INBOX", 0);
+	if (mailbox_sync(box, 0) < 0)
+		i_fatal("mailbox_sync(INBOX) failed: %s",
+			mailbox_get_last_error(box, NULL));
+	return box;
+}
+
+static void test_save(unsigned int count)
+{
+	struct mailbox *box = test_box_open();
+	struct mailbox_transaction_context *t;
+	struct mail_save_context *save_ctx;
+	struct istream *input;
+	string_t *str = t_str_new(1024);
+	unsigned int i;
+	int ret;
+
+	t = mailbox_transaction_begin(box, MAILBOX_TRANSACTION_FLAG_EXTERNAL);
+	for (i = 0; i < count; i++) {
+		test_msg_counter++;
+		str_truncate(str, 0);
+		str_printfa(str, "Subject: message %u\r\n\r\n",
+			    test_msg_counter);
+		/* different sizes, with some duplicates */
+		str_append_n(str, "xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx",
+			     (test_msg_counter * 7919) % 41);
+		str_append(str, "\r\n");
+
+		input = i_stream_create_from_data(str_data(str), str_len(str));
+		save_ctx = mailbox_save_alloc(t);
+		if (mailbox_save_begin(&save_ctx, input) < 0)
+			i_fatal("mailbox_save_begin() failed");
+		while ((ret = i_stream_read(input)) > 0 || ret == -2) {
+			if (mailbox_save_continue(save_ctx) < 0)
+				i_fatal("mailbox_save_continue() failed");
+		}
+		if (mailbox_save_finish(&save_ctx) < 0)
+			i_fatal("mailbox_save_finish() failed");
+		i_stream_unref(&input);
+	}
+	if (mailbox_transaction_commit(&t) < 0)
+		i_fatal("mailbox_transaction_commit() failed: %s",
+			mailbox_get_last_error(box, NULL));
+	mailbox_free(&box);
+}
+
+static void test_expunge(unsigned int first_seq, unsigned int count)
+{
+	struct mailbox *box = test_box_open();
+	struct mailbox_transaction_context *t;
+	struct mail *mail;
+	unsigned int i;
+
+	t = mailbox_transaction_begin(box, 0);
+	mail = mail_alloc(t, 0, NULL);
+	for (i = 0; i < count; i++) {
+		mail_set_seq(mail, first_seq + i*3);
+		mail_expunge(mail);
+	}
+	mail_free(&mail);
+	if (mailbox_transaction_commit(&t) < 0)
+		i_fatal("mailbox_transaction_commit() failed: %s",
+			mailbox_get_last_error(box, NULL));
+	mailbox_free(&box);
+}
+
+static int test_sort_msg_cmp(const struct test_sort_msg *m1,
+			     const struct test_sort_msg *m2)
+{
+	if (m1->size < m2->size)
+		return -1;
+	if (m1->size > m2->size)
+		return 1;
+	return m1->seq < m2->seq ? -1 : (m1->seq > m2->seq ? 1 : 0);
+}
+
+static void
+test_search(bool sort, ARRAY_TYPE(uint32_t) *uids_r)
+{
+	static const enum mail_sort_type sort_program[] = {
+		MAIL_SORT_SIZE, MAIL_SORT_END
+	};
+	struct mailbox *box = test_box_open();
+	struct mailbox_transaction_context *t;
+	struct mail_search_args *args;
+	struct mail_search_context *ctx;
+	struct mail *mail;
+	ARRAY(struct test_sort_msg) msgs;
+	struct test_sort_msg *msg;
+	const struct test_sort_msg *msgp;
+
+	t_array_init(&msgs, 1024);
+	args = mail_search_build_init();
+	mail_search_build_add_all(args);
+
+	t = mailbox_transaction_begin(box, 0);
+	ctx = mailbox_search_init(t, args, sort ? sort_program : NULL,
+				  MAIL_FETCH_VIRTUAL_SIZE, NULL);
+	while (mailbox_search_next(ctx, &mail)) {
+		msg = array_append_space(&msgs);
+		msg->seq = mail->seq;
+		msg->uid = mail->uid;
+		if (mail_get_virtual_size(mail, &msg->size) < 0)
+			i_fatal("mail_get_virtual_size() failed");
+	}
+	if (mailbox_search_deinit(&ctx) < 0)
+		i_fatal("mailbox_search_deinit() failed");
+	(void)mailbox_transaction_commit(&t);
+	mail_search_args_unref(&args);
+	mailbox_free(&box);
+
+	if (!sort)
+		array_sort(&msgs, test_sort_msg_cmp);
+	t_array_init(uids_r, array_count(&msgs));
+	array_foreach(&msgs, msgp)
+		array_append(uids_r, &msgp->uid, 1);
+}
+
+static void test_sort_check(void)
+{
+	ARRAY_TYPE(uint32_t) sorted, expected;
+
+	test_search(TRUE, &sorted);
+	test_search(FALSE, &expected);
+	test_assert(array_cmp(&sorted, &expected));
+}
+
+static ino_t test_sort_file_ino(void)
+{
+	struct stat st;
+
+	if (stat(test_sort_path, &st) < 0) {
+		if (errno != ENOENT)
+			i_fatal("stat(%s) failed: %m", test_sort_path);
+		return 0;
+	}
+	return st.st_ino;
+}
+
+static void test_sort_file_read_hdr(struct test_sort_file_header *hdr_r)
+{
+	int fd;
+
+	memset(hdr_r, 0, sizeof(*hdr_r));
+	fd = open(test_sort_path, O_RDONLY);
+	if (fd == -1)
+		i_fatal("open(%s) failed: %m", test_sort_path);
+	if (read(fd, hdr_r, sizeof(*hdr_r)) < 0)
+		i_fatal("read(%s) failed: %m", test_sort_path);
+	i_close_fd(&fd);
+}
+
+static void test_sort_file_check(uint32_t uids_count)
+{
+	struct test_sort_file_header hdr;
+	uint8_t compat_flags = 0;
+
+#if !WORDS_BIGENDIAN
+	compat_flags |= MAIL_INDEX_COMPAT_LITTLE_ENDIAN;
+#endif
+	test_sort_file_read_hdr(&hdr);
+	test_assert(hdr.version != 0);
+	test_assert(hdr.compat_flags == compat_flags);
+	test_assert(hdr.next_uid == test_msg_counter + 1);
+	test_assert(hdr.uids_count == uids_count);
+}
+
+static void test_sort_file_write(off_t offset, const void *data, size_t size)
+{
+	int fd;
+
+	fd = open(test_sort_path, O_WRONLY);
+	if (fd == -1)
+		i_fatal("open(%s) failed: %m", test_sort_path);
+	if (pwrite(fd, data, size, offset) != (ssize_t)size)
+		i_fatal("pwrite(%s) failed: %m", test_sort_path);
+	i_close_fd(&fd);
+}
+
+static void test_index_sort_order_roundtrip(void)
+{
+	ino_t ino;
+
+	test_begin("sort order file round-trip");
+	test_save(1000);
+	test_assert(test_sort_file_ino() == 0);
+	test_sort_check();
+	ino = test_sort_file_ino();
+	test_assert(ino != 0);
+	test_sort_file_check(1000);
+
+	/* unchanged mailbox - the file is used as-is */
+	test_sort_check();
+	test_assert(test_sort_file_ino() == ino);
+	test_end();
+}
+
+static void test_index_sort_order_invalidation(void)
+{
+	test_begin("sort order file invalidation");
+	/* a few new messages are merged to the existing order */
+	test_save(10);
+	test_sort_check();
+	test_sort_file_check(1010);
+
+	/* expunged messages are dropped */
+	test_expunge(5, 5);
+	test_sort_check();
+	test_sort_file_check(1005);
+
+	/* too many new messages - rebuilt */
+	test_save(400);
+	test_sort_check();
+	test_sort_file_check(1405);
+	test_end();
+}
+
+static void test_index_sort_order_broken(void)
+{
+	struct test_sort_file_header hdr;
+	uint32_t version = 0;
+	uint8_t compat_flags;
+
+	test_begin("sort order file broken");
+	/* unknown version */
+	test_sort_file_write(offsetof(struct test_sort_file_header, version),
+			     &version, sizeof(version));
+	test_sort_check();
+	test_sort_file_check(1405);
+
+	/* written by a host with different endianness */
+	test_sort_file_read_hdr(&hdr);
+	compat_flags = hdr.compat_flags ^ MAIL_INDEX_COMPAT_LITTLE_ENDIAN;
+	test_sort_file_write(offsetof(struct test_sort_file_header,
+				      compat_flags),
+			     &compat_flags, sizeof(compat_flags));
+	test_sort_check();
+	test_sort_file_check(1405);
+
+	/* truncated */
+	if (truncate(test_sort_path, 10) < 0)
+		i_fatal("truncate(%s) failed: %m", test_sort_path);
+	test_sort_check();
+	test_sort_file_check(1405);
+	test_end();
+}
+
+static void test_setup(void)
+{
+	struct mailbox *box;
+	const char *dir;
+
+	test_mail_storage_init(&test_storage, "test-index-sort-order",
+		"sort_test", (const char *const[]) {
+			"mail=sdbox:~/mail", NULL });
+
+	box = test_box_open();
+	if (mailbox_get_path_to(box, MAILBOX_LIST_PATH_TYPE_INDEX, &dir) <= 0)
+		i_fatal("INBOX has no index directory");
+	test_sort_path = p_strconcat(test_storage.pool,
+				     dir, "/"TEST_SORT_FILE_NAME, NULL);
+	mailbox_free(&box);
+}
+
+static void test_teardown(void)
+{
+	test_mail_storage_deinit(&test_storage);
+}
+
+int main(int argc, char **argv)
+{
+	static void (*test_functions[])(void) = {
+		test_setup,
+		test_index_sort_order_roundtrip,
+		test_index_sort_order_invalidation,
+		test_index_sort_order_broken,
+		test_teardown,
+		NULL
+	};
+	return test_mail_storage_run("test-index-sort-order", &argc, &argv,
+				     test_functions);
+}
@@ -0,0 +1,124 @@
+/* Copyright (c) 2016 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "mail-user.h"
+#include "mail-namespace.h"
+#include "mail-storage.h"
+#include "mailbox-list-iter.h"
+#include "mail-storage-service.h"
+#include "test-common.h"
+#include "test-mail-storage-common.h"
+
+static struct test_mail_storage test_storage;
+static ARRAY_TYPE(const_string) prefetched_paths;
+
+static void
+test_debug_handler(const struct failure_context *ctx ATTR_UNUSED,
+		   const char *format, va_list args)
+{
+	const char *line = t_strdup_vprintf(format, args);
+	const char *prefix = "Prefetching index file ";
+
+	if (strncmp(line, prefix, strlen(prefix)) == 0) {
+		line = p_strdup(test_storage.pool, line + strlen(prefix));
+		array_append(&prefetched_paths, &line, 1);
+	}
+}
+
+static struct mail_user *
+test_user_init(bool prefetch, struct mail_storage_service_user **service_user_r)
+{
+	return test_mail_storage_user_init(&test_storage, "prefetch_test",
+		(const char *const[]) {
+			"mail=maildir:~/",
+			"mailbox_list_index=yes",
+			"mail_debug=yes",
+			prefetch ? "mail_prefetch_indexes=yes" :
+				"mail_prefetch_indexes=no",
+			NULL
+		}, service_user_r);
+}
+
+static bool test_prefetched(const char *fname)
+{
+	const char *const *pathp;
+	const char *path = t_strconcat(test_storage.home, "/", fname, NULL);
+
+	array_foreach(&prefetched_paths, pathp) {
+		if (strcmp(*pathp, path) == 0)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+static void test_mail_prefetch_indexes(void)
+{
+	struct mail_storage_service_user *service_user;
+	struct mail_user *user;
+	struct mail_namespace *ns;
+	struct mailbox_list_iterate_context *iter;
+	struct mailbox *box;
+
+	test_begin("mail_prefetch_indexes");
+
+	/* nothing exists yet - nothing gets prefetched */
+	user = test_user_init(TRUE, &service_user);
+	test_assert(array_count(&prefetched_paths) == 0);
+
+	/* create INBOX's and the mailbox list's indexes */
+	ns = mail_namespace_find_inbox(user->namespaces);
+	box = mailbox_alloc(ns->list, "INBOX", 0);
+	if (mailbox_sync(box, 0) < 0)
+		i_fatal("mailbox_sync(INBOX) failed: %s",
+			mailbox_get_last_error(box, NULL));
+	mailbox_free(&box);
+	iter = mailbox_list_iter_init(ns->list, "*", 0);
+	while (mailbox_list_iter_next(iter) != NULL) ;
+	if (mailbox_list_iter_deinit(&iter) < 0)
+		i_fatal("mailbox_list_iter_deinit() failed");
+	mail_user_unref(&user);
+	mail_storage_service_user_free(&service_user);
+
+	/* disabled */
+	user = test_user_init(FALSE, &service_user);
+	test_assert(array_count(&prefetched_paths) == 0);
+	mail_user_unref(&user);
+	mail_storage_service_user_free(&service_user);
+
+	/* enabled */
+	user = test_user_init(TRUE, &service_user);
+	test_assert(test_prefetched("dovecot.index.log"));
+	test_assert(test_prefetched("dovecot.list.index.log"));
+	test_assert(!test_prefetched("dovecot.index.cache"));
+	mail_user_unref(&user);
+	mail_storage_service_user_free(&service_user);
+
+	test_end();
+}
+
+static void test_setup(void)
+{
+	test_mail_storage_init(&test_storage, "test-mail-prefetch-indexes",
+			       NULL, NULL);
+	i_array_init(&prefetched_paths, 8);
+	i_set_debug_handler(test_debug_handler);
+}
+
+static void test_teardown(void)
+{
+	array_free(&prefetched_paths);
+	test_mail_storage_deinit(&test_storage);
+}
+
+int main(int argc, char **argv)
+{
+	static void (*test_functions[])(void) = {
+		test_setup,
+		test_mail_prefetch_indexes,
+		test_teardown,
+		NULL
+	};
+	return test_mail_storage_run("test-mail-prefetch-indexes", &argc, &argv,
+				     test_functions);
+}
@@ -0,0 +1,105 @@
+/* Copyright (c) 2016 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "abspath.h"
+#include "ioloop.h"
+#include "unlink-directory.h"
+#include "master-service.h"
+#include "mail-user.h"
+#include "mail-storage-service.h"
+#include "test-common.h"
+#include "test-mail-storage-common.h"
+
+#include <unistd.h>
+
+int test_mail_storage_run(const char *name, int *argc, char ***argv,
+			  void (*test_functions[])(void))
+{
+	struct ioloop *ioloop;
+	int ret;
+
+	master_service = master_service_init(name,
+					     MASTER_SERVICE_FLAG_STANDALONE |
+					     MASTER_SERVICE_FLAG_NO_CONFIG_SETTINGS |
+					     MASTER_SERVICE_FLAG_NO_SSL_INIT |
+					     MASTER_SERVICE_FLAG_NO_INIT_DATASTACK_FRAME,
+					     argc, argv, "");
+	ioloop = io_loop_create();
+	ret = test_run(test_functions);
+	io_loop_destroy(&ioloop);
+	master_service_deinit(&master_service);
+	return ret;
+}
+
+void test_mail_storage_init(struct test_mail_storage *storage_r,
+			    const char *name, const char *username,
+			    const char *const *userdb_fields)
+{
+	const char *cwd;
+
+	memset(storage_r, 0, sizeof(*storage_r));
+	storage_r->pool = pool_alloconly_create("test mail storage", 1024);
+	if (t_get_current_dir(&cwd) < 0)
+		i_fatal("getcwd() failed: %m");
+	storage_r->home = p_strdup_printf(storage_r->pool, "%s/.%s.%ld",
+					  cwd, name, (long)getpid());
+	storage_r->storage_service =
+		mail_storage_service_init(master_service, NULL,
+			MAIL_STORAGE_SERVICE_FLAG_NO_LOG_INIT |
+			MAIL_STORAGE_SERVICE_FLAG_NO_PLUGINS |
+			MAIL_STORAGE_SERVICE_FLAG_NO_RESTRICT_ACCESS |
+			MAIL_STORAGE_SERVICE_FLAG_NO_CHDIR);
+	if (username != NULL) {
+		storage_r->user =
+			test_mail_storage_user_init(storage_r, username,
+						    userdb_fields,
+						    &storage_r->service_user);
+	}
+}
+
+void test_mail_storage_deinit(struct test_mail_storage *storage)
+{
+	const char *error;
+
+	if (storage->user != NULL) {
+		mail_user_unref(&storage->user);
+		mail_storage_service_user_free(&storage->service_user);
+	}
+	mail_storage_service_deinit(&storage->storage_service);
+	if (unlink_directory(storage->home, UNLINK_DIRECTORY_FLAG_RMDIR,
+			     &error) < 0) {
+		i_error("unlink_directory(%s) failed: %s",
+			storage->home, error);
+	}
+	pool_unref(&storage->pool);
+}
+
+struct mail_user *
+test_mail_storage_user_init(struct test_mail_storage *storage,
+			    const char *username,
+			    const char *const *userdb_fields,
+			    struct mail_storage_service_user **service_user_r)
+{
+	struct mail_storage_service_input input;
+	ARRAY_TYPE(const_string) fields;
+	struct mail_user *user;
+	const char *field, *error;
+
+	t_array_init(&fields, 8);
+	field = t_strdup_printf("home=%s", storage->home);
+	array_append(&fields, &field, 1);
+	for (; *userdb_fields != NULL; userdb_fields++)
+		array_append(&fields, userdb_fields, 1);
+	array_append_zero(&fields);
+
+	memset(&input, 0, sizeof(input));
+	input.userdb_fields = array_idx(&fields, 0);
+	input.username = username;
+	input.no_userdb_lookup = TRUE;
+	if (mail_storage_service_lookup_next(storage->storage_service, &input,
+					     service_user_r, &user,
+					     &error) < 0)
+		i_fatal("mail_storage_service_lookup_next() failed: %s", error);
+	return user;
+}
@@ -0,0 +1,36 @@
+#ifndef TEST_MAIL_STORAGE_COMMON_H
+#define TEST_MAIL_STORAGE_COMMON_H
+
+struct test_mail_storage {
+	pool_t pool;
+	/* Temporary home directory under the current directory. It's removed
+	   by test_mail_storage_deinit(). */
+	const char *home;
+	struct mail_storage_service_ctx *storage_service;
+
+	/* User created by test_mail_storage_init(), or NULL */
+	struct mail_storage_service_user *service_user;
+	struct mail_user *user;
+};
+
+/* Run the test functions in a standalone master service with an ioloop. */
+int test_mail_storage_run(const char *name, int *argc, char ***argv,
+			  void (*test_functions[])(void));
+
+/* Create the storage service and a temporary home directory named after the
+   test. If username isn't NULL, also create the storage->user with the given
+   userdb fields. The home field is added to them automatically. */
+void test_mail_storage_init(struct test_mail_storage *storage_r,
+			    const char *name, const char *username,
+			    const char *const *userdb_fields);
+/* Deinitialize the storage and remove the home directory. */
+void test_mail_storage_deinit(struct test_mail_storage *storage);
+
+/* Look up a new user with the storage's home directory. */
+struct mail_user *
+test_mail_storage_user_init(struct test_mail_storage *storage,
+			    const char *username,
+			    const char *const *userdb_fields,
+			    struct mail_storage_service_user **service_user_r);
+
+#endif
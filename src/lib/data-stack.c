@@ -74,6 +74,9 @@ struct data_stack_frame {
 #endif
 
 unsigned int data_stack_frame_id = 0;
+#ifdef DEBUG
+static unsigned long long data_stack_alloc_count = 0;
+#endif
 
 static bool data_stack_initialized = FALSE;
 static data_stack_frame_t root_frame_id;
@@ -396,6 +399,7 @@ static void *t_malloc_real(size_t size, bool permanent)
 	alloc_size = ALLOC_SIZE(size);
 #ifdef DEBUG
 	if(permanent) {
+		data_stack_alloc_count++;
 		current_frame_block->alloc_bytes[frame_pos] += alloc_size;
 		current_frame_block->alloc_count[frame_pos]++;
 	}
@@ -524,6 +528,13 @@ bool t_try_realloc(void *mem, size_t size)
 	return FALSE;
 }
 
+#ifdef DEBUG
+unsigned long long data_stack_get_alloc_count(void)
+{
+	return data_stack_alloc_count;
+}
+#endif
+
 size_t t_get_bytes_available(void)
 {
 #ifndef DEBUG
@@ -90,6 +90,11 @@ bool t_try_realloc(void *mem, size_t size);
 /* Returns the number of bytes available in data stack without allocating
    more memory. */
 size_t t_get_bytes_available(void) ATTR_PURE;
+#ifdef DEBUG
+/* Returns the number of t_malloc*() allocations done since the process
+   started. Useful for measuring the allocation cost of a code path. */
+unsigned long long data_stack_get_alloc_count(void);
+#endif
 
 #define t_new(type, count) \
 	((type *) t_malloc0(sizeof(type) * (count)))
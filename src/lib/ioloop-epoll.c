@@ -13,6 +13,10 @@
 
 struct ioloop_handler_context {
 	int epfd;
+#ifdef IOLOOP_URING
+	/* non-NULL if io_uring is used instead of epoll */
+	struct ioloop_uring *uring;
+#endif
 
 	unsigned int deleted_count;
 	ARRAY(struct io_list *) fd_index;
@@ -25,6 +29,18 @@ void io_loop_handler_init(struct ioloop *ioloop, unsigned int initial_fd_count)
 
 	ioloop->handler_context = ctx = i_new(struct ioloop_handler_context, 1);
 
+#ifdef IOLOOP_URING
+	if (ioloop->wanted_handler != NULL &&
+	    strcmp(ioloop->wanted_handler, "uring") == 0) {
+		ctx->uring = io_loop_uring_init(initial_fd_count);
+		if (ctx->uring != NULL) {
+			ctx->epfd = -1;
+			ioloop->handler_name = "uring";
+			return;
+		}
+	}
+#endif
+
 	i_array_init(&ctx->events, initial_fd_count);
 	i_array_init(&ctx->fd_index, initial_fd_count);
 
@@ -46,6 +62,14 @@ void io_loop_handler_deinit(struct ioloop *ioloop)
 	struct io_list **list;
 	unsigned int i, count;
 
+#ifdef IOLOOP_URING
+	if (ctx->uring != NULL) {
+		io_loop_uring_deinit(&ctx->uring);
+		i_free(ioloop->handler_context);
+		return;
+	}
+#endif
+
 	list = array_get_modifiable(&ctx->fd_index, &count);
 	for (i = 0; i < count; i++)
 		i_free(list[i]);
@@ -91,6 +115,13 @@ void io_loop_handle_add(struct io_file *io)
 	int op;
 	bool first;
 
+#ifdef IOLOOP_URING
+	if (ctx->uring != NULL) {
+		io_loop_uring_handle_add(ctx->uring, io);
+		return;
+	}
+#endif
+
 	list = array_idx_modifiable(&ctx->fd_index, io->fd);
 	if (*list == NULL)
 		*list = i_new(struct io_list, 1);
@@ -132,6 +163,13 @@ void io_loop_handle_remove(struct io_file *io, bool closed)
 	int op;
 	bool last;
 
+#ifdef IOLOOP_URING
+	if (ctx->uring != NULL) {
+		io_loop_uring_handle_remove(ctx->uring, io, closed);
+		return;
+	}
+#endif
+
 	list = array_idx_modifiable(&ctx->fd_index, io->fd);
 	last = ioloop_iolist_del(*list, io);
 
@@ -175,6 +213,13 @@ void io_loop_handler_run_internal(struct ioloop *ioloop)
 
 	i_assert(ctx != NULL);
 
+#ifdef IOLOOP_URING
+	if (ctx->uring != NULL) {
+		io_loop_uring_run(ioloop, ctx->uring);
+		return;
+	}
+#endif
+
         /* get the time left for next timeout task */
 	msecs = io_loop_get_wait_time(ioloop, &tv);
 
@@ -23,6 +23,10 @@ struct ioloop {
         struct ioloop_handler_context *handler_context;
         struct ioloop_notify_handler_context *notify_handler_context;
 	unsigned int max_fd_count;
+	/* handler requested with io_loop_set_handler() or IOLOOP_HANDLER */
+	char *wanted_handler;
+	/* handler that is actually used */
+	const char *handler_name;
 
 	io_loop_time_moved_callback_t *time_moved_callback;
 	time_t next_max_time;
@@ -115,6 +119,17 @@ void io_loop_handle_remove(struct io_file *io, bool closed);
 void io_loop_handler_init(struct ioloop *ioloop, unsigned int initial_fd_count);
 void io_loop_handler_deinit(struct ioloop *ioloop);
 
+#ifdef IOLOOP_URING
+/* io_uring handler that the epoll handler uses instead of epoll when
+   "uring" handler is wanted. Returns NULL if io_uring isn't usable. */
+struct ioloop_uring *io_loop_uring_init(unsigned int initial_fd_count);
+void io_loop_uring_deinit(struct ioloop_uring **uring);
+void io_loop_uring_handle_add(struct ioloop_uring *uring, struct io_file *io);
+void io_loop_uring_handle_remove(struct ioloop_uring *uring,
+				 struct io_file *io, bool closed);
+void io_loop_uring_run(struct ioloop *ioloop, struct ioloop_uring *uring);
+#endif
+
 void io_loop_notify_remove(struct io *io);
 void io_loop_notify_handler_deinit(struct ioloop *ioloop);
 
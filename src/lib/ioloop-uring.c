@@ -0,0 +1,491 @@
+/* Copyright (c) 2016 Dovecot authors, see the included COPYING file */
+
+/* @UNSAFE: whole file */
+
+#include "lib.h"
+#include "array.h"
+#include "llist.h"
+#include "fd-close-on-exec.h"
+#include "ioloop-private.h"
+#include "ioloop-iolist.h"
+
+#ifdef IOLOOP_URING
+
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/* The io_uring handler is built on top of the epoll handler. Instead of
+   calling epoll_ctl() for each io_add() and io_remove(), the changes are
+   collected and submitted to the kernel as one-shot poll requests in the same
+   io_uring_enter() call that waits for the events. */
+
+#define IOLOOP_URING_MIN_ENTRIES 64
+#define IOLOOP_URING_MAX_ENTRIES 4096
+
+#define IO_URING_ERROR (POLLERR | POLLHUP)
+#define IO_URING_INPUT (POLLIN | POLLPRI | IO_URING_ERROR)
+#define IO_URING_OUTPUT (POLLOUT | IO_URING_ERROR)
+
+/* user_data for requests whose completions are ignored (poll removals) */
+#define IOLOOP_URING_IGNORE_USER_DATA 0
+
+struct ioloop_uring_poll {
+	struct ioloop_uring_poll *prev, *next;
+
+	int fd;
+	int events;
+	/* The fd no longer wants this poll. Its completion only frees it. */
+	bool detached;
+};
+
+struct ioloop_uring_fd {
+	struct io_list list;
+	/* Currently armed poll request, or NULL */
+	struct ioloop_uring_poll *poll;
+	bool dirty;
+};
+
+struct ioloop_uring {
+	int fd;
+	unsigned int sq_entries;
+
+	void *ring_ptr;
+	size_t ring_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+
+	unsigned int *sq_khead, *sq_ktail, *sq_kring_mask, *sq_array;
+	unsigned int *cq_khead, *cq_ktail, *cq_kring_mask;
+	struct io_uring_cqe *cqes;
+
+	unsigned int sq_tail, to_submit;
+
+	ARRAY(struct ioloop_uring_fd *) fd_index;
+	ARRAY(int) dirty_fds;
+	ARRAY(struct io_uring_cqe) events;
+
+	/* all poll requests that the kernel may still complete */
+	struct ioloop_uring_poll *polls;
+};
+
+static int
+sys_io_uring_setup(unsigned int entries, struct io_uring_params *params)
+{
+	return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int
+sys_io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete,
+		   unsigned int flags, const void *arg, size_t argsz)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		       flags, arg, argsz);
+}
+
+static bool io_loop_uring_mmap(struct ioloop_uring *uring,
+			       const struct io_uring_params *params)
+{
+	size_t sq_size, cq_size;
+	void *ptr;
+
+	sq_size = params->sq_off.array +
+		params->sq_entries * sizeof(unsigned int);
+	cq_size = params->cq_off.cqes +
+		params->cq_entries * sizeof(struct io_uring_cqe);
+	uring->ring_size = I_MAX(sq_size, cq_size);
+
+	ptr = mmap(NULL, uring->ring_size, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQ_RING);
+	if (ptr == MAP_FAILED)
+		return FALSE;
+	uring->ring_ptr = ptr;
+
+	uring->sqes_size = params->sq_entries * sizeof(struct io_uring_sqe);
+	ptr = mmap(NULL, uring->sqes_size, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQES);
+	if (ptr == MAP_FAILED) {
+		(void)munmap(uring->ring_ptr, uring->ring_size);
+		uring->ring_ptr = NULL;
+		return FALSE;
+	}
+	uring->sqes = ptr;
+
+	ptr = uring->ring_ptr;
+	uring->sq_khead = PTR_OFFSET(ptr, params->sq_off.head);
+	uring->sq_ktail = PTR_OFFSET(ptr, params->sq_off.tail);
+	uring->sq_kring_mask = PTR_OFFSET(ptr, params->sq_off.ring_mask);
+	uring->sq_array = PTR_OFFSET(ptr, params->sq_off.array);
+	uring->cq_khead = PTR_OFFSET(ptr, params->cq_off.head);
+	uring->cq_ktail = PTR_OFFSET(ptr, params->cq_off.tail);
+	uring->cq_kring_mask = PTR_OFFSET(ptr, params->cq_off.ring_mask);
+	uring->cqes = PTR_OFFSET(ptr, params->cq_off.cqes);
+
+	uring->sq_entries = params->sq_entries;
+	uring->sq_tail = *uring->sq_ktail;
+	return TRUE;
+}
+
+struct ioloop_uring *io_loop_uring_init(unsigned int initial_fd_count)
+{
+	struct ioloop_uring *uring;
+	struct io_uring_params params;
+	unsigned int entries;
+	int fd;
+
+	entries = nearest_power(initial_fd_count);
+	if (entries < IOLOOP_URING_MIN_ENTRIES)
+		entries = IOLOOP_URING_MIN_ENTRIES;
+	else if (entries > IOLOOP_URING_MAX_ENTRIES)
+		entries = IOLOOP_URING_MAX_ENTRIES;
+
+	memset(&params, 0, sizeof(params));
+	fd = sys_io_uring_setup(entries, &params);
+	if (fd < 0) {
+		/* kernel is too old, io_uring is disabled or it's
+		   blocked by seccomp - fallback to epoll */
+		return NULL;
+	}
+	/* We rely on the kernel buffering completions that don't fit the
+	   CQ ring and on waiting with a timeout without using a timeout
+	   request. */
+	if ((params.features & IORING_FEAT_SINGLE_MMAP) == 0 ||
+	    (params.features & IORING_FEAT_NODROP) == 0 ||
+	    (params.features & IORING_FEAT_EXT_ARG) == 0) {
+		i_close_fd(&fd);
+		return NULL;
+	}
+	fd_close_on_exec(fd, TRUE);
+
+	uring = i_new(struct ioloop_uring, 1);
+	uring->fd = fd;
+	if (!io_loop_uring_mmap(uring, &params)) {
+		i_error("mmap(io_uring) failed: %m");
+		i_close_fd(&uring->fd);
+		i_free(uring);
+		return NULL;
+	}
+	i_array_init(&uring->fd_index, initial_fd_count);
+	i_array_init(&uring->dirty_fds, initial_fd_count);
+	i_array_init(&uring->events, params.cq_entries);
+	return uring;
+}
+
+void io_loop_uring_deinit(struct ioloop_uring **_uring)
+{
+	struct ioloop_uring *uring = *_uring;
+	struct ioloop_uring_fd **fds;
+	struct ioloop_uring_poll *poll;
+	unsigned int i, count;
+
+	*_uring = NULL;
+
+	/* closing the ring cancels all the pending requests */
+	if (munmap(uring->sqes, uring->sqes_size) < 0)
+		i_error("munmap(io_uring sqes) failed: %m");
+	if (munmap(uring->ring_ptr, uring->ring_size) < 0)
+		i_error("munmap(io_uring) failed: %m");
+	if (close(uring->fd) < 0)
+		i_error("close(io_uring) failed: %m");
+
+	while (uring->polls != NULL) {
+		poll = uring->polls;
+		DLLIST_REMOVE(&uring->polls, poll);
+		i_free(poll);
+	}
+	fds = array_get_modifiable(&uring->fd_index, &count);
+	for (i = 0; i < count; i++)
+		i_free(fds[i]);
+	array_free(&uring->fd_index);
+	array_free(&uring->dirty_fds);
+	array_free(&uring->events);
+	i_free(uring);
+}
+
+static int io_loop_uring_submit(struct ioloop_uring *uring,
+				unsigned int min_complete, unsigned int flags,
+				const struct io_uring_getevents_arg *arg)
+{
+	unsigned int to_submit = uring->to_submit;
+	int ret;
+
+	/* make the SQEs visible to the kernel before the tail update */
+	__atomic_store_n(uring->sq_ktail, uring->sq_tail, __ATOMIC_RELEASE);
+	ret = sys_io_uring_enter(uring->fd, to_submit, min_complete,
+				 flags | IORING_ENTER_EXT_ARG,
+				 arg, sizeof(*arg));
+	if (ret >= 0) {
+		i_assert((unsigned int)ret <= to_submit);
+		uring->to_submit -= ret;
+	}
+	return ret;
+}
+
+static struct io_uring_sqe *io_loop_uring_get_sqe(struct ioloop_uring *uring)
+{
+	struct io_uring_getevents_arg arg;
+	struct io_uring_sqe *sqe;
+	unsigned int head, idx;
+
+	head = __atomic_load_n(uring->sq_khead, __ATOMIC_ACQUIRE);
+	while (uring->sq_tail - head >= uring->sq_entries) {
+		/* SQ ring is full - submit what we have so far */
+		memset(&arg, 0, sizeof(arg));
+		if (io_loop_uring_submit(uring, 0, 0, &arg) < 0 &&
+		    errno != EINTR && errno != EAGAIN && errno != EBUSY)
+			i_fatal("io_uring_enter() failed: %m");
+		head = __atomic_load_n(uring->sq_khead, __ATOMIC_ACQUIRE);
+	}
+
+	idx = uring->sq_tail & *uring->sq_kring_mask;
+	sqe = &uring->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	uring->sq_array[idx] = idx;
+	uring->sq_tail++;
+	uring->to_submit++;
+	return sqe;
+}
+
+static void io_loop_uring_poll_add(struct ioloop_uring *uring,
+				   struct ioloop_uring_fd *ufd,
+				   int fd, int events)
+{
+	struct ioloop_uring_poll *poll;
+	struct io_uring_sqe *sqe;
+
+	i_assert(ufd->poll == NULL);
+
+	poll = i_new(struct ioloop_uring_poll, 1);
+	poll->fd = fd;
+	poll->events = events;
+	DLLIST_PREPEND(&uring->polls, poll);
+	ufd->poll = poll;
+
+	sqe = io_loop_uring_get_sqe(uring);
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	/* the 16bit field works with both byte orders */
+	sqe->poll_events = events;
+	sqe->user_data = (uintptr_t)poll;
+}
+
+static void io_loop_uring_poll_detach(struct ioloop_uring *uring,
+				      struct ioloop_uring_fd *ufd)
+{
+	struct io_uring_sqe *sqe;
+
+	if (ufd->poll == NULL)
+		return;
+
+	/* the poll is freed once its (cancelled) completion arrives */
+	ufd->poll->detached = TRUE;
+	sqe = io_loop_uring_get_sqe(uring);
+	sqe->opcode = IORING_OP_POLL_REMOVE;
+	sqe->fd = -1;
+	sqe->addr = (uintptr_t)ufd->poll;
+	sqe->user_data = IOLOOP_URING_IGNORE_USER_DATA;
+	ufd->poll = NULL;
+}
+
+static int io_loop_uring_event_mask(const struct io_list *list)
+{
+	int events = 0, i;
+	struct io_file *io;
+
+	for (i = 0; i < IOLOOP_IOLIST_IOS_PER_FD; i++) {
+		io = list->ios[i];
+
+		if (io == NULL)
+			continue;
+
+		if ((io->io.condition & IO_READ) != 0)
+			events |= IO_URING_INPUT;
+		if ((io->io.condition & IO_WRITE) != 0)
+			events |= IO_URING_OUTPUT;
+		if ((io->io.condition & IO_ERROR) != 0)
+			events |= IO_URING_ERROR;
+	}
+	return events;
+}
+
+static void io_loop_uring_set_dirty(struct ioloop_uring *uring,
+				    struct ioloop_uring_fd *ufd, int fd)
+{
+	if (!ufd->dirty) {
+		ufd->dirty = TRUE;
+		array_append(&uring->dirty_fds, &fd, 1);
+	}
+}
+
+void io_loop_uring_handle_add(struct ioloop_uring *uring, struct io_file *io)
+{
+	struct ioloop_uring_fd **ufdp;
+
+	ufdp = array_idx_modifiable(&uring->fd_index, io->fd);
+	if (*ufdp == NULL)
+		*ufdp = i_new(struct ioloop_uring_fd, 1);
+
+	(void)ioloop_iolist_add(&(*ufdp)->list, io);
+	io_loop_uring_set_dirty(uring, *ufdp, io->fd);
+}
+
+void io_loop_uring_handle_remove(struct ioloop_uring *uring,
+				 struct io_file *io, bool closed)
+{
+	struct ioloop_uring_fd *ufd;
+	bool last;
+
+	ufd = *array_idx_modifiable(&uring->fd_index, io->fd);
+	last = ioloop_iolist_del(&ufd->list, io);
+
+	if (last || closed) {
+		/* the poll keeps a reference to the file, so it must be
+		   removed now even if the fd was already closed. otherwise
+		   the fd could be reused while the old poll is still armed. */
+		io_loop_uring_poll_detach(uring, ufd);
+	}
+	if (!last)
+		io_loop_uring_set_dirty(uring, ufd, io->fd);
+	i_free(io);
+}
+
+static void io_loop_uring_apply_changes(struct ioloop_uring *uring)
+{
+	struct ioloop_uring_fd *ufd;
+	const int *fdp;
+	int events;
+
+	array_foreach(&uring->dirty_fds, fdp) {
+		ufd = *array_idx_modifiable(&uring->fd_index, *fdp);
+		ufd->dirty = FALSE;
+
+		events = io_loop_uring_event_mask(&ufd->list);
+		if (ufd->poll != NULL && ufd->poll->events == events)
+			continue;
+
+		io_loop_uring_poll_detach(uring, ufd);
+		if (events != 0)
+			io_loop_uring_poll_add(uring, ufd, *fdp, events);
+	}
+	array_clear(&uring->dirty_fds);
+}
+
+static void io_loop_uring_reap(struct ioloop_uring *uring)
+{
+	unsigned int head, tail, mask;
+
+	head = *uring->cq_khead;
+	tail = __atomic_load_n(uring->cq_ktail, __ATOMIC_ACQUIRE);
+	mask = *uring->cq_kring_mask;
+
+	array_clear(&uring->events);
+	for (; head != tail; head++)
+		array_append(&uring->events, &uring->cqes[head & mask], 1);
+	__atomic_store_n(uring->cq_khead, head, __ATOMIC_RELEASE);
+}
+
+static void io_loop_uring_call(struct ioloop_uring_fd *ufd, int revents)
+{
+	struct io_file *io;
+	bool call;
+	int i;
+
+	for (i = 0; i < IOLOOP_IOLIST_IOS_PER_FD; i++) {
+		io = ufd->list.ios[i];
+		if (io == NULL)
+			continue;
+
+		call = FALSE;
+		if ((revents & (POLLHUP | POLLERR | POLLNVAL)) != 0)
+			call = TRUE;
+		else if ((io->io.condition & IO_READ) != 0)
+			call = (revents & (POLLIN | POLLPRI)) != 0;
+		else if ((io->io.condition & IO_WRITE) != 0)
+			call = (revents & POLLOUT) != 0;
+		else if ((io->io.condition & IO_ERROR) != 0)
+			call = (revents & IO_URING_ERROR) != 0;
+
+		if (call)
+			io_loop_call_io(&io->io);
+	}
+}
+
+void io_loop_uring_run(struct ioloop *ioloop, struct ioloop_uring *uring)
+{
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	const struct io_uring_cqe *cqe;
+	struct ioloop_uring_poll *poll;
+	struct ioloop_uring_fd *ufd;
+	struct timeval tv;
+	unsigned int i, count;
+	int msecs, ret, fd, revents;
+
+	/* get the time left for next timeout task */
+	msecs = io_loop_get_wait_time(ioloop, &tv);
+
+	io_loop_uring_apply_changes(uring);
+
+	memset(&arg, 0, sizeof(arg));
+	if (ioloop->io_files != NULL && uring->polls != NULL) {
+		if (msecs >= 0) {
+			ts.tv_sec = tv.tv_sec;
+			ts.tv_nsec = tv.tv_usec * 1000LL;
+			arg.ts = (uintptr_t)&ts;
+		}
+		/* submit the changes and wait for events in one syscall */
+		ret = io_loop_uring_submit(uring, 1, IORING_ENTER_GETEVENTS,
+					   &arg);
+		if (ret < 0 && errno != EINTR && errno != ETIME &&
+		    errno != EAGAIN && errno != EBUSY)
+			i_fatal("io_uring_enter(): %m");
+	} else {
+		/* no I/Os, but we should have some timeouts.
+		   just wait for them. */
+		if (msecs < 0)
+			i_panic("BUG: No IOs or timeouts set. Not waiting for infinity.");
+		if (uring->to_submit > 0 &&
+		    io_loop_uring_submit(uring, 0, 0, &arg) < 0 &&
+		    errno != EINTR && errno != EAGAIN && errno != EBUSY)
+			i_fatal("io_uring_enter(): %m");
+		usleep(msecs*1000);
+	}
+
+	/* execute timeout handlers */
+	io_loop_handle_timeouts(ioloop);
+
+	if (!ioloop->running)
+		return;
+
+	/* copy the completions first, since the I/O callbacks may add more
+	   requests to the rings */
+	io_loop_uring_reap(uring);
+	count = array_count(&uring->events);
+	for (i = 0; i < count; i++) {
+		cqe = array_idx(&uring->events, i);
+		if (cqe->user_data == IOLOOP_URING_IGNORE_USER_DATA)
+			continue;
+
+		poll = (struct ioloop_uring_poll *)(uintptr_t)cqe->user_data;
+		DLLIST_REMOVE(&uring->polls, poll);
+		if (poll->detached) {
+			i_free(poll);
+			continue;
+		}
+
+		fd = poll->fd;
+		ufd = *array_idx_modifiable(&uring->fd_index, fd);
+		i_assert(ufd->poll == poll);
+		ufd->poll = NULL;
+		i_free(poll);
+
+		/* the poll is one-shot - rearm it before the next wait */
+		io_loop_uring_set_dirty(uring, ufd, fd);
+		revents = cqe->res < 0 ? POLLERR : cqe->res;
+		io_loop_uring_call(ufd, revents);
+	}
+}
+
+#endif	/* IOLOOP_URING */
@@ -9,6 +9,16 @@
 
 #include <unistd.h>
 
+#if defined(IOLOOP_EPOLL)
+#  define IOLOOP_DEFAULT_HANDLER_NAME "epoll"
+#elif defined(IOLOOP_KQUEUE)
+#  define IOLOOP_DEFAULT_HANDLER_NAME "kqueue"
+#elif defined(IOLOOP_POLL)
+#  define IOLOOP_DEFAULT_HANDLER_NAME "poll"
+#else
+#  define IOLOOP_DEFAULT_HANDLER_NAME "select"
+#endif
+
 #define timer_is_larger(tvp, uvp) \
 	((tvp)->tv_sec > (uvp)->tv_sec || \
 	 ((tvp)->tv_sec == (uvp)->tv_sec && \
@@ -28,6 +38,10 @@ static void io_loop_initialize_handler(struct ioloop *ioloop)
 	initial_fd_count = ioloop->max_fd_count > 0 &&
 		ioloop->max_fd_count < IOLOOP_INITIAL_FD_COUNT ?
 		ioloop->max_fd_count : IOLOOP_INITIAL_FD_COUNT;
+	if (ioloop->wanted_handler == NULL)
+		ioloop->wanted_handler = i_strdup(getenv("IOLOOP_HANDLER"));
+	/* the handler changes this if it uses something else */
+	ioloop->handler_name = IOLOOP_DEFAULT_HANDLER_NAME;
 	io_loop_handler_init(ioloop, initial_fd_count);
 }
 
@@ -664,6 +678,21 @@ void io_loop_set_max_fd_count(struct ioloop *ioloop, unsigned int max_fds)
 	ioloop->max_fd_count = max_fds;
 }
 
+void io_loop_set_handler(struct ioloop *ioloop, const char *name)
+{
+	i_assert(ioloop->handler_context == NULL);
+
+	i_free(ioloop->wanted_handler);
+	ioloop->wanted_handler = i_strdup(name);
+}
+
+const char *io_loop_get_handler_name(struct ioloop *ioloop)
+{
+	if (ioloop->handler_context == NULL)
+		io_loop_initialize_handler(ioloop);
+	return ioloop->handler_name;
+}
+
 bool io_loop_is_running(struct ioloop *ioloop)
 {
         return ioloop->running;
@@ -760,6 +789,7 @@ void io_loop_destroy(struct ioloop **_ioloop)
 	if (ioloop->cur_ctx != NULL)
 		io_loop_context_deactivate(ioloop->cur_ctx);
 
+	i_free(ioloop->wanted_handler);
 	i_free(ioloop);
 }
 
@@ -133,6 +133,13 @@ void io_loop_handler_run(struct ioloop *ioloop);
 struct ioloop *io_loop_create(void);
 /* Specify the maximum number of fds we're expecting to use. */
 void io_loop_set_max_fd_count(struct ioloop *ioloop, unsigned int max_fds);
+/* Specify the I/O loop handler to use, e.g. "uring". NULL uses the
+   IOLOOP_HANDLER environment variable, or if it's not set the handler chosen
+   at compile time. If the wanted handler can't be used, the compile time
+   handler is used instead. This must be called before any I/Os are added. */
+void io_loop_set_handler(struct ioloop *ioloop, const char *name);
+/* Returns the name of the I/O loop handler that is actually used. */
+const char *io_loop_get_handler_name(struct ioloop *ioloop);
 /* Destroy I/O loop and set ioloop pointer to NULL. */
 void io_loop_destroy(struct ioloop **ioloop);
 
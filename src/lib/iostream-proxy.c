@@ -95,6 +95,17 @@ struct ostream *iostream_proxy_get_ostream(struct iostream_proxy *proxy, enum io
 	}
 }
 
+struct iostream_pump *iostream_proxy_get_pump(struct iostream_proxy *proxy, enum iostream_proxy_side side)
+{
+	i_assert(proxy != NULL);
+
+	switch(side) {
+	case IOSTREAM_PROXY_SIDE_LEFT: return proxy->ltr;
+	case IOSTREAM_PROXY_SIDE_RIGHT: return proxy->rtl;
+	default: i_unreached();
+	}
+}
+
 void iostream_proxy_ref(struct iostream_proxy *proxy)
 {
 	i_assert(proxy != NULL && proxy->ref > 0);
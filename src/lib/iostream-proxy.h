@@ -40,6 +40,9 @@ iostream_proxy_create(struct istream *left_input, struct ostream *left_output,
 
 struct istream *iostream_proxy_get_istream(struct iostream_proxy *proxy, enum iostream_proxy_side);
 struct ostream *iostream_proxy_get_ostream(struct iostream_proxy *proxy, enum iostream_proxy_side);
+/* Returns the pump moving data from the side's istream to the other side's
+   ostream. */
+struct iostream_pump *iostream_proxy_get_pump(struct iostream_proxy *proxy, enum iostream_proxy_side);
 
 void iostream_proxy_start(struct iostream_proxy *proxy);
 void iostream_proxy_stop(struct iostream_proxy *proxy);
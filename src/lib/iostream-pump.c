@@ -1,15 +1,29 @@
 /* Copyright (c) 2002-2016 Dovecot authors, see the included COPYING file
  */
+
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#define _GNU_SOURCE /* for splice() */
 #include "lib.h"
+#include "ioloop.h"
 #include "buffer.h"
 #include "str.h"
+#include "fd-set-nonblock.h"
 #include "iostream-pump.h"
-#include "istream.h"
-#include "ostream.h"
+#include "istream-file-private.h"
+#include "ostream-file-private.h"
 #include <unistd.h>
+#include <fcntl.h>
 
 #undef iostream_pump_set_completion_callback
 
+/* How much to splice() into the pipe at once */
+#define IOSTREAM_PUMP_SPLICE_SIZE (1024*64)
+/* How much to splice() in one I/O callback before letting others run */
+#define IOSTREAM_PUMP_SPLICE_MAX_PER_CALL (1024*1024)
+
 struct iostream_pump {
 	struct istream *input;
 	struct ostream *output;
@@ -20,19 +34,223 @@ struct iostream_pump {
 
 	iostream_pump_callback_t *callback;
 	void *context;
+	uoff_t bytes_moved;
+	time_t last_io;
+
+	/* pipe used for moving data with splice(). The data in the pipe has
+	   already been read from input, but not yet written to output. */
+	int pipe_fd[2];
+	size_t pipe_bytes;
+
 	bool completed;
+	bool splice_checked;
+	bool splicing;
+	bool splice_eof;
 };
 
+static bool iostream_pump_splice_init(struct iostream_pump *pump)
+{
+#ifdef HAVE_SPLICE
+	/* splice only between plain fds. TLS, rawlog and other filter
+	   streams have a parent stream. */
+	if (!i_stream_is_fd_istream(pump->input) ||
+	    !o_stream_is_fd_ostream(pump->output) ||
+	    pump->input->seekable ||
+	    pump->input->blocking || pump->output->blocking)
+		return FALSE;
+
+	if (pipe(pump->pipe_fd) < 0) {
+		i_error("iostream_pump: pipe() failed: %m");
+		return FALSE;
+	}
+	fd_set_nonblock(pump->pipe_fd[0], TRUE);
+	fd_set_nonblock(pump->pipe_fd[1], TRUE);
+	return TRUE;
+#else
+	(void)pump;
+	return FALSE;
+#endif
+}
+
+static void iostream_pump_splice_deinit(struct iostream_pump *pump)
+{
+	if (!pump->splicing)
+		return;
+	pump->splicing = FALSE;
+	i_close_fd(&pump->pipe_fd[0]);
+	i_close_fd(&pump->pipe_fd[1]);
+}
+
+#ifdef HAVE_SPLICE
+static void iostream_pump_splice_failed(struct iostream_pump *pump,
+					bool input_error)
+{
+	struct iostream_private *iostream = input_error ?
+		&pump->input->real_stream->iostream :
+		&pump->output->real_stream->iostream;
+
+	if (input_error)
+		pump->input->stream_errno = errno;
+	else
+		pump->output->stream_errno = errno;
+	io_stream_set_error(iostream, "splice() failed: %m");
+	if (pump->io != NULL)
+		io_remove(&pump->io);
+	pump->callback(FALSE, pump->context);
+}
+
+/* Returns 1 if the pipe is empty, 0 if output is full, -1 on error. */
+static int iostream_pump_splice_write(struct iostream_pump *pump)
+{
+	ssize_t ret;
+
+	while (pump->pipe_bytes > 0) {
+		ret = splice(pump->pipe_fd[0], NULL,
+			     pump->output->real_stream->fd, NULL,
+			     pump->pipe_bytes,
+			     SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (ret < 0) {
+			if (errno == EAGAIN)
+				break;
+			iostream_pump_splice_failed(pump, FALSE);
+			return -1;
+		}
+		i_assert((size_t)ret <= pump->pipe_bytes);
+		pump->pipe_bytes -= ret;
+		o_stream_fd_written(pump->output, ret);
+		pump->bytes_moved += ret;
+		pump->last_io = ioloop_time;
+	}
+	if (pump->pipe_bytes > 0) {
+		/* wait until output is writable again */
+		if (pump->io != NULL)
+			io_remove(&pump->io);
+		o_stream_set_flush_pending(pump->output, TRUE);
+		return 0;
+	}
+	return 1;
+}
+
+static void iostream_pump_splice_finish(struct iostream_pump *pump)
+{
+	if (pump->io != NULL)
+		io_remove(&pump->io);
+	i_stream_fd_read(pump->input, 0);
+	pump->completed = TRUE;
+	pump->callback(TRUE, pump->context);
+}
+
+static void iostream_pump_splice(struct iostream_pump *pump)
+{
+	size_t moved = 0;
+	ssize_t ret;
+
+	while (moved < IOSTREAM_PUMP_SPLICE_MAX_PER_CALL) {
+		if ((ret = iostream_pump_splice_write(pump)) <= 0)
+			return;
+		if (pump->splice_eof) {
+			iostream_pump_splice_finish(pump);
+			return;
+		}
+
+		ret = splice(pump->input->real_stream->fd, NULL,
+			     pump->pipe_fd[1], NULL, IOSTREAM_PUMP_SPLICE_SIZE,
+			     SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (ret == 0) {
+			pump->splice_eof = TRUE;
+			continue;
+		}
+		if (ret < 0) {
+			if (errno == EAGAIN) {
+				/* wait for more input */
+				if (pump->io == NULL) {
+					pump->io = io_add_istream(pump->input,
+						iostream_pump_splice, pump);
+				}
+				return;
+			}
+			iostream_pump_splice_failed(pump, TRUE);
+			return;
+		}
+		pump->pipe_bytes = ret;
+		i_stream_fd_read(pump->input, ret);
+		pump->last_io = ioloop_time;
+		moved += ret;
+	}
+	/* let other I/Os run - the input io calls us again */
+	if (pump->io == NULL) {
+		pump->io = io_add_istream(pump->input, iostream_pump_splice, pump);
+		io_set_pending(pump->io);
+	}
+}
+
+static bool iostream_pump_try_splice(struct iostream_pump *pump)
+{
+	ssize_t ret;
+
+	if (pump->splice_checked)
+		return pump->splicing;
+	/* anything already buffered must go through the streams first.
+	   try splicing again once they're empty. */
+	if (i_stream_get_data_size(pump->input) > 0 ||
+	    o_stream_get_buffer_used_size(pump->output) > 0)
+		return FALSE;
+	pump->splice_checked = TRUE;
+
+	if (!iostream_pump_splice_init(pump))
+		return FALSE;
+
+	/* see if the kernel supports splicing these fds. if it doesn't,
+	   nothing was read yet and we can fallback to copying. */
+	ret = splice(pump->input->real_stream->fd, NULL,
+		     pump->pipe_fd[1], NULL, IOSTREAM_PUMP_SPLICE_SIZE,
+		     SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	if (ret < 0 && errno == EINVAL) {
+		i_close_fd(&pump->pipe_fd[0]);
+		i_close_fd(&pump->pipe_fd[1]);
+		return FALSE;
+	}
+	pump->splicing = TRUE;
+
+	if (pump->io != NULL)
+		io_remove(&pump->io);
+	if (ret < 0 && errno != EAGAIN) {
+		iostream_pump_splice_failed(pump, TRUE);
+		return TRUE;
+	}
+	if (ret == 0)
+		pump->splice_eof = TRUE;
+	else if (ret > 0) {
+		pump->pipe_bytes = ret;
+		i_stream_fd_read(pump->input, ret);
+		pump->last_io = ioloop_time;
+	}
+	iostream_pump_splice(pump);
+	return TRUE;
+}
+#endif
+
 static
 void iostream_pump_copy(struct iostream_pump *pump)
 {
 	enum ostream_send_istream_result res;
+	uoff_t start_offset;
+
+#ifdef HAVE_SPLICE
+	if (iostream_pump_try_splice(pump))
+		return;
+#endif
 
 	size_t old_size = o_stream_get_max_buffer_size(pump->output);
 	o_stream_set_max_buffer_size(pump->output,
 				     I_MIN(IO_BLOCK_SIZE,
 					   o_stream_get_max_buffer_size(pump->output)));
+	start_offset = pump->input->v_offset;
 	res = o_stream_send_istream(pump->output, pump->input);
+	if (pump->input->v_offset != start_offset) {
+		pump->bytes_moved += pump->input->v_offset - start_offset;
+		pump->last_io = ioloop_time;
+	}
 	o_stream_set_max_buffer_size(pump->output, old_size);
 
 	switch(res) {
@@ -69,6 +287,18 @@ static
 int iostream_pump_flush(struct iostream_pump *pump)
 {
 	int ret;
+
+#ifdef HAVE_SPLICE
+	if (pump->splicing) {
+		if (pump->completed)
+			return 1;
+		if ((ret = iostream_pump_splice_write(pump)) <= 0)
+			return ret < 0 ? -1 : 0;
+		/* pipe is empty again - continue reading input */
+		iostream_pump_splice(pump);
+		return 1;
+	}
+#endif
 	if ((ret = o_stream_flush(pump->output)) <= 0) {
 		if (ret < 0)
 			pump->callback(FALSE, pump->context);
@@ -100,6 +330,7 @@ iostream_pump_create(struct istream *input, struct ostream *output)
 	struct iostream_pump *pump = i_new(struct iostream_pump, 1);
 	pump->input = input;
 	pump->output = output;
+	pump->pipe_fd[0] = pump->pipe_fd[1] = -1;
 
 	pump->ref = 1;
 
@@ -115,7 +346,14 @@ void iostream_pump_start(struct iostream_pump *pump)
 	o_stream_set_flush_callback(pump->output, iostream_pump_flush, pump);
 
 	/* make IO objects */
-	pump->io = io_add_istream(pump->input, iostream_pump_copy, pump);
+#ifdef HAVE_SPLICE
+	if (pump->splicing) {
+		/* restarted after iostream_pump_stop() */
+		pump->io = io_add_istream(pump->input, iostream_pump_splice,
+					  pump);
+	} else
+#endif
+		pump->io = io_add_istream(pump->input, iostream_pump_copy, pump);
 
 	/* make sure we do first read right away */
 	io_set_pending(pump->io);
@@ -133,6 +371,24 @@ struct ostream *iostream_pump_get_output(struct iostream_pump *pump)
 	return pump->output;
 }
 
+bool iostream_pump_is_spliced(struct iostream_pump *pump)
+{
+	i_assert(pump != NULL);
+	return pump->splicing;
+}
+
+uoff_t iostream_pump_get_bytes_moved(struct iostream_pump *pump)
+{
+	i_assert(pump != NULL);
+	return pump->bytes_moved;
+}
+
+time_t iostream_pump_get_last_io(struct iostream_pump *pump)
+{
+	i_assert(pump != NULL);
+	return pump->last_io;
+}
+
 void iostream_pump_set_completion_callback(struct iostream_pump *pump,
 					   iostream_pump_callback_t *callback, void *context)
 {
@@ -156,6 +412,7 @@ void iostream_pump_unref(struct iostream_pump **pump_r)
 	i_assert(pump->ref > 0);
 	if (--pump->ref == 0) {
 		iostream_pump_stop(pump);
+		iostream_pump_splice_deinit(pump);
 		o_stream_unref(&pump->output);
 		i_stream_unref(&pump->input);
 		i_free(pump);
@@ -175,7 +432,8 @@ void iostream_pump_stop(struct iostream_pump *pump)
 void iostream_pump_switch_ioloop(struct iostream_pump *pump)
 {
 	i_assert(pump != NULL);
-	pump->io = io_loop_move_io(&pump->io);
+	if (pump->io != NULL)
+		pump->io = io_loop_move_io(&pump->io);
 	o_stream_switch_ioloop(pump->output);
 	i_stream_switch_ioloop(pump->input);
 }
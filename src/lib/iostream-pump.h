@@ -17,6 +17,11 @@ indicate whether it ended with error.
 The istream and ostream are reffed on creation and unreffed
 on unref.
 
+If both streams are plain non-blocking file descriptors (e.g. sockets
+without TLS or rawlog) the data is moved with splice() via a pipe without
+copying it through userspace. If splice() can't be used, the data is copied
+through the streams as usual.
+
 **/
 
 struct istream;
@@ -31,6 +36,14 @@ iostream_pump_create(struct istream *input, struct ostream *output);
 struct istream *iostream_pump_get_input(struct iostream_pump *pump);
 struct ostream *iostream_pump_get_output(struct iostream_pump *pump);
 
+/* Returns TRUE if the data is moved with splice(). */
+bool iostream_pump_is_spliced(struct iostream_pump *pump);
+/* Returns the number of bytes moved so far. */
+uoff_t iostream_pump_get_bytes_moved(struct iostream_pump *pump);
+/* Returns ioloop_time when data was last moved, or 0 if nothing has been
+   moved yet. */
+time_t iostream_pump_get_last_io(struct iostream_pump *pump);
+
 void iostream_pump_start(struct iostream_pump *pump);
 void iostream_pump_stop(struct iostream_pump *pump);
 
@@ -20,4 +20,13 @@ i_stream_create_file_common(struct file_istream *fstream,
 ssize_t i_stream_file_read(struct istream_private *stream);
 void i_stream_file_close(struct iostream_private *stream, bool close_parent);
 
+/* Returns TRUE if the stream is a plain fd istream created with
+   i_stream_create_fd*(), which reads its data unmodified from the fd. */
+bool i_stream_is_fd_istream(struct istream *stream);
+/* Update the stream's offset after size bytes were read directly from its
+   fd without going through the stream (e.g. with splice()). size=0 means
+   that EOF was reached. The stream must be a plain fd istream and it must
+   not have anything buffered. */
+void i_stream_fd_read(struct istream *stream, size_t size);
+
 #endif
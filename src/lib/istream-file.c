@@ -264,3 +264,27 @@ struct istream *i_stream_create_file(const char *path, size_t max_buffer_size)
 	i_stream_set_name(input, path);
 	return input;
 }
+
+bool i_stream_is_fd_istream(struct istream *stream)
+{
+	struct istream_private *_stream = stream->real_stream;
+
+	return _stream->parent == NULL && _stream->fd != -1 &&
+		_stream->read == i_stream_file_read;
+}
+
+void i_stream_fd_read(struct istream *stream, size_t size)
+{
+	struct file_istream *fstream =
+		(struct file_istream *)stream->real_stream;
+
+	i_assert(i_stream_is_fd_istream(stream));
+	i_assert(i_stream_get_data_size(stream) == 0);
+
+	if (size == 0) {
+		fstream->istream.istream.eof = TRUE;
+		fstream->seen_eof = TRUE;
+	} else {
+		fstream->istream.istream.v_offset += size;
+	}
+}
@@ -40,4 +40,12 @@ ssize_t o_stream_file_sendv(struct ostream_private *stream,
 void o_stream_file_close(struct iostream_private *stream,
 				bool close_parent);
 
+/* Returns TRUE if the stream is a plain fd ostream created with
+   o_stream_create_fd*(), which writes its data unmodified to the fd. */
+bool o_stream_is_fd_ostream(struct ostream *stream);
+/* Update the stream's offsets after size bytes were written directly to its
+   fd without going through the stream (e.g. with splice()). The stream must
+   be a plain fd ostream and it must not have anything buffered. */
+void o_stream_fd_written(struct ostream *stream, size_t size);
+
 #endif
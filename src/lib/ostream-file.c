@@ -1023,6 +1023,28 @@ struct ostream * o_stream_create_fd_common(int fd, size_t max_buffer_size,
 	return ostream;
 }
 
+bool o_stream_is_fd_ostream(struct ostream *stream)
+{
+	struct file_ostream *fstream =
+		(struct file_ostream *)stream->real_stream;
+
+	return stream->real_stream->sendv == o_stream_file_sendv &&
+		fstream->writev == o_stream_file_writev;
+}
+
+void o_stream_fd_written(struct ostream *stream, size_t size)
+{
+	struct file_ostream *fstream =
+		(struct file_ostream *)stream->real_stream;
+
+	i_assert(o_stream_is_fd_ostream(stream));
+	i_assert(IS_STREAM_EMPTY(fstream));
+
+	fstream->real_offset += size;
+	fstream->buffer_offset += size;
+	stream->offset += size;
+}
+
 struct ostream *
 o_stream_create_fd(int fd, size_t max_buffer_size)
 {
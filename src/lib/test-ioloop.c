@@ -5,6 +5,7 @@
 #include "time-util.h"
 #include "ioloop.h"
 #include "istream.h"
+#include "env-util.h"
 
 #include <unistd.h>
 
@@ -21,6 +22,20 @@ static void timeout_callback(struct timeval *tv)
 	io_loop_stop(current_ioloop);
 }
 
+/* If non-NULL, all test ioloops must be using this handler */
+static const char *test_ioloop_handler_name = NULL;
+
+static struct ioloop *test_ioloop_create(void)
+{
+	struct ioloop *ioloop = io_loop_create();
+
+	if (test_ioloop_handler_name != NULL) {
+		test_assert(strcmp(io_loop_get_handler_name(ioloop),
+				   test_ioloop_handler_name) == 0);
+	}
+	return ioloop;
+}
+
 static void test_ioloop_fd_cb_left(struct test_ctx *ctx)
 {
 	ctx->got_left = TRUE;
@@ -58,7 +73,7 @@ static void test_ioloop_fd(void)
 
 	memset(&test_ctx, 0, sizeof(test_ctx));
 
-	struct ioloop *ioloop = io_loop_create();
+	struct ioloop *ioloop = test_ioloop_create();
 
 	struct io *io_left =
 			io_add(fds[0], IO_READ,
@@ -98,10 +113,10 @@ static void test_ioloop_timeout(void)
 
 	test_begin("ioloop timeout");
 
-	ioloop = io_loop_create();
+	ioloop = test_ioloop_create();
 
 	/* add a timeout by moving it from another ioloop */
-	ioloop2 = io_loop_create();
+	ioloop2 = test_ioloop_create();
 	to2 = timeout_add(1000, timeout_callback, &tv_callback);
 	io_loop_set_current(ioloop);
 	to2 = io_loop_move_timeout(&to2);
@@ -150,7 +165,7 @@ static void test_ioloop_find_fd_conditions(void)
 
 	test_begin("ioloop find fd conditions");
 
-	ioloop = io_loop_create();
+	ioloop = test_ioloop_create();
 
 	for (i = 0; i < N_ELEMENTS(tests); i++) {
 		if (socketpair(AF_UNIX, SOCK_STREAM, 0, tests[i].fd) < 0)
@@ -184,7 +199,7 @@ static void test_ioloop_pending_io(void)
 	test_begin("ioloop pending io");
 
 	struct istream *is = i_stream_create_from_data("data", 4);
-	struct ioloop *ioloop = io_loop_create();
+	struct ioloop *ioloop = test_ioloop_create();
 	struct io *io = io_add_istream(is, io_callback_pending_io, NULL);
 	io_loop_set_current(ioloop);
 	io_set_pending(io);
@@ -196,10 +211,71 @@ static void test_ioloop_pending_io(void)
 	test_end();
 }
 
-void test_ioloop(void)
+static void test_ioloop_handler(void)
+{
+	struct ioloop *ioloop;
+	const char *name;
+
+	test_begin("ioloop handler");
+
+	ioloop = io_loop_create();
+	io_loop_set_handler(ioloop, "uring");
+	name = io_loop_get_handler_name(ioloop);
+#ifdef IOLOOP_URING
+	/* falls back to epoll if the kernel doesn't support io_uring */
+	test_assert(strcmp(name, "uring") == 0 || strcmp(name, "epoll") == 0);
+#else
+	test_assert(strcmp(name, "uring") != 0);
+#endif
+	io_loop_destroy(&ioloop);
+
+	ioloop = io_loop_create();
+	io_loop_set_handler(ioloop, "nonexistent");
+	test_assert(strcmp(io_loop_get_handler_name(ioloop), "nonexistent") != 0);
+	io_loop_destroy(&ioloop);
+
+	test_end();
+}
+
+static bool test_ioloop_uring_available(void)
+{
+#ifdef IOLOOP_URING
+	struct ioloop *ioloop;
+	bool ret;
+
+	ioloop = io_loop_create();
+	io_loop_set_handler(ioloop, "uring");
+	ret = strcmp(io_loop_get_handler_name(ioloop), "uring") == 0;
+	io_loop_destroy(&ioloop);
+	return ret;
+#else
+	return FALSE;
+#endif
+}
+
+static void test_ioloop_all(void)
 {
 	test_ioloop_timeout();
 	test_ioloop_find_fd_conditions();
 	test_ioloop_pending_io();
 	test_ioloop_fd();
 }
+
+void test_ioloop(void)
+{
+	test_ioloop_handler();
+	test_ioloop_all();
+
+	/* run the same tests with the io_uring handler. make sure it's really
+	   used instead of silently falling back to epoll. */
+	if (!test_ioloop_uring_available()) {
+		test_out_reason("ioloop uring handler", TRUE,
+				"skipped - io_uring not available");
+		return;
+	}
+	env_put("IOLOOP_HANDLER=uring");
+	test_ioloop_handler_name = "uring";
+	test_ioloop_all();
+	test_ioloop_handler_name = NULL;
+	env_remove("IOLOOP_HANDLER");
+}
@@ -5,6 +5,7 @@
 #include "ostream.h"
 #include "buffer.h"
 #include "ioloop.h"
+#include "iostream-pump.h"
 #include "iostream-proxy.h"
 #include "fd-set-nonblock.h"
 
@@ -89,6 +90,9 @@ void test_iostream_proxy_simple(void)
 	test_assert(strcmp((const char*)i_stream_get_data(left_in, &bytes), "hello, world") == 0);
 	i_stream_skip(left_in, bytes);
 
+	test_assert(iostream_pump_get_bytes_moved(iostream_proxy_get_pump(proxy, IOSTREAM_PROXY_SIDE_LEFT)) == 12);
+	test_assert(iostream_pump_get_bytes_moved(iostream_proxy_get_pump(proxy, IOSTREAM_PROXY_SIDE_RIGHT)) == 12);
+
 	iostream_proxy_unref(&proxy);
 
 	io_loop_destroy(&ioloop);
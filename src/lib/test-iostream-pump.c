@@ -270,6 +270,167 @@ void test_iostream_pump_failure_end_write(bool block)
 	test_end();
 }
 
+struct splice_ctx {
+	int in_fd[2], out_fd[2];
+	struct io *io_write, *io_read;
+	buffer_t *input, *output;
+	size_t written;
+
+	/* stop the pump after this much output and restart it later */
+	size_t restart_offset;
+	struct iostream_pump *pump;
+	struct timeout *to_restart;
+
+	bool completed, success;
+};
+
+static void test_iostream_pump_splice_write(struct splice_ctx *ctx)
+{
+	ssize_t ret;
+
+	ret = write(ctx->in_fd[1], CONST_PTR_OFFSET(ctx->input->data, ctx->written),
+		    ctx->input->used - ctx->written);
+	if (ret < 0) {
+		if (errno == EAGAIN)
+			return;
+		i_fatal("write() failed: %m");
+	}
+	ctx->written += ret;
+	if (ctx->written == ctx->input->used) {
+		io_remove(&ctx->io_write);
+		i_close_fd(&ctx->in_fd[1]);
+	}
+}
+
+static void test_iostream_pump_splice_restart(struct splice_ctx *ctx)
+{
+	timeout_remove(&ctx->to_restart);
+	iostream_pump_start(ctx->pump);
+}
+
+static void test_iostream_pump_splice_read(struct splice_ctx *ctx)
+{
+	unsigned char buf[IO_BLOCK_SIZE];
+	ssize_t ret;
+
+	ret = read(ctx->out_fd[1], buf, sizeof(buf));
+	if (ret < 0) {
+		if (errno == EAGAIN)
+			return;
+		i_fatal("read() failed: %m");
+	}
+	buffer_append(ctx->output, buf, ret);
+	if (ctx->completed && ctx->output->used == ctx->input->used)
+		io_loop_stop(current_ioloop);
+	else if (ctx->restart_offset != 0 &&
+		 ctx->output->used >= ctx->restart_offset) {
+		ctx->restart_offset = 0;
+		iostream_pump_stop(ctx->pump);
+		ctx->to_restart = timeout_add_short(10,
+			test_iostream_pump_splice_restart, ctx);
+	}
+}
+
+static void test_iostream_pump_splice_completed(bool success,
+						struct splice_ctx *ctx)
+{
+	ctx->completed = TRUE;
+	ctx->success = success;
+	if (!success || ctx->output->used == ctx->input->used)
+		io_loop_stop(current_ioloop);
+}
+
+static void test_iostream_pump_splice_timeout(struct splice_ctx *ctx ATTR_UNUSED)
+{
+	io_loop_stop(current_ioloop);
+}
+
+static void test_iostream_pump_splice(bool restart, bool prebuffered)
+{
+	struct splice_ctx ctx;
+	struct ioloop *ioloop;
+	struct iostream_pump *pump;
+	struct istream *input;
+	struct ostream *output;
+	struct timeout *to;
+	unsigned int i;
+
+	test_begin(t_strdup_printf("iostream_pump splice%s%s",
+				   restart ? " stop/start" : "",
+				   prebuffered ? " prebuffered" : ""));
+
+	memset(&ctx, 0, sizeof(ctx));
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, ctx.in_fd) < 0 ||
+	    socketpair(AF_UNIX, SOCK_STREAM, 0, ctx.out_fd) < 0)
+		i_fatal("socketpair() failed: %m");
+	for (i = 0; i < 2; i++) {
+		fd_set_nonblock(ctx.in_fd[i], TRUE);
+		fd_set_nonblock(ctx.out_fd[i], TRUE);
+	}
+
+	/* large enough to fill the socket buffers several times */
+	ctx.input = buffer_create_dynamic(default_pool, 1024*1024);
+	for (i = 0; i < 1024*1024; i++)
+		buffer_append_c(ctx.input, 'a' + i % 26);
+	ctx.output = buffer_create_dynamic(default_pool, 1024*1024);
+
+	ioloop = io_loop_create();
+	input = i_stream_create_fd(ctx.in_fd[0], IO_BLOCK_SIZE);
+	output = o_stream_create_fd(ctx.out_fd[0], IO_BLOCK_SIZE);
+	pump = iostream_pump_create(input, output);
+	ctx.pump = pump;
+	if (restart)
+		ctx.restart_offset = ctx.input->used / 4;
+	iostream_pump_set_completion_callback(pump,
+		test_iostream_pump_splice_completed, &ctx);
+	if (prebuffered) {
+		/* the data already read into the istream's buffer is copied
+		   before splicing starts */
+		ctx.written = 100;
+		if (write(ctx.in_fd[1], ctx.input->data, ctx.written) !=
+		    (ssize_t)ctx.written)
+			i_fatal("write() failed: %m");
+		test_assert(i_stream_read(input) == (ssize_t)ctx.written);
+	}
+
+	ctx.io_write = io_add(ctx.in_fd[1], IO_WRITE,
+			      test_iostream_pump_splice_write, &ctx);
+	ctx.io_read = io_add(ctx.out_fd[1], IO_READ,
+			     test_iostream_pump_splice_read, &ctx);
+	to = timeout_add(5000, test_iostream_pump_splice_timeout, &ctx);
+	iostream_pump_start(pump);
+	io_loop_run(ioloop);
+	timeout_remove(&to);
+	if (ctx.to_restart != NULL)
+		timeout_remove(&ctx.to_restart);
+
+	test_assert(ctx.completed && ctx.success);
+	test_assert(buffer_cmp(ctx.input, ctx.output));
+	test_assert(iostream_pump_get_bytes_moved(pump) == ctx.input->used);
+	test_assert(input->v_offset == ctx.input->used);
+	test_assert(output->offset == ctx.input->used);
+	test_assert(iostream_pump_get_last_io(pump) != 0);
+#if defined(HAVE_SPLICE) && defined(__linux__)
+	test_assert(iostream_pump_is_spliced(pump));
+#endif
+
+	io_remove(&ctx.io_read);
+	if (ctx.io_write != NULL)
+		io_remove(&ctx.io_write);
+	iostream_pump_unref(&pump);
+	i_stream_unref(&input);
+	o_stream_unref(&output);
+	io_loop_destroy(&ioloop);
+	for (i = 0; i < 2; i++) {
+		if (ctx.in_fd[i] != -1)
+			i_close_fd(&ctx.in_fd[i]);
+		i_close_fd(&ctx.out_fd[i]);
+	}
+	buffer_free(&ctx.input);
+	buffer_free(&ctx.output);
+	test_end();
+}
+
 void test_iostream_pump(void)
 {
 	T_BEGIN {
@@ -283,4 +444,7 @@ void test_iostream_pump(void)
 			test_iostream_pump_failure_end_write(i < 1);
 		}
 	} T_END;
+	test_iostream_pump_splice(FALSE, FALSE);
+	test_iostream_pump_splice(TRUE, FALSE);
+	test_iostream_pump_splice(FALSE, TRUE);
 }
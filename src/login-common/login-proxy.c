@@ -4,6 +4,8 @@
 #include "ioloop.h"
 #include "istream.h"
 #include "ostream.h"
+#include "iostream-pump.h"
+#include "iostream-proxy.h"
 #include "llist.h"
 #include "array.h"
 #include "str.h"
@@ -20,7 +22,6 @@
 
 
 #define MAX_PROXY_INPUT_SIZE 4096
-#define OUTBUF_THRESHOLD 1024
 #define LOGIN_PROXY_DIE_IDLE_SECS 2
 #define LOGIN_PROXY_IPC_PATH "ipc-proxy"
 #define LOGIN_PROXY_IPC_NAME "proxy"
@@ -39,6 +40,7 @@ struct login_proxy {
 	struct io *client_io, *server_io;
 	struct istream *client_input, *server_input;
 	struct ostream *client_output, *server_output;
+	struct iostream_proxy *iostream_proxy;
 	struct ssl_proxy *ssl_server_proxy;
 	time_t last_io;
 
@@ -81,27 +83,51 @@ static void
 login_proxy_free_delayed(struct login_proxy **_proxy, const char *reason)
 	ATTR_NULL(2);
 
+static time_t login_proxy_get_last_io(struct login_proxy *proxy)
+{
+	time_t last_io = proxy->last_io;
+
+	if (proxy->iostream_proxy != NULL) {
+		last_io = I_MAX(last_io, iostream_pump_get_last_io(
+			iostream_proxy_get_pump(proxy->iostream_proxy,
+						IOSTREAM_PROXY_SIDE_LEFT)));
+		last_io = I_MAX(last_io, iostream_pump_get_last_io(
+			iostream_proxy_get_pump(proxy->iostream_proxy,
+						IOSTREAM_PROXY_SIDE_RIGHT)));
+	}
+	return last_io;
+}
+
 static void login_proxy_free_errstr(struct login_proxy **_proxy,
 				    const char *errstr, bool server)
 {
 	struct login_proxy *proxy = *_proxy;
 	string_t *reason = t_str_new(128);
+	uoff_t bytes_in = 0, bytes_out = 0;
 
 	str_printfa(reason, "Disconnected by %s", server ? "server" : "client");
 	if (errstr[0] != '\0')
 		str_printfa(reason, ": %s", errstr);
 
+	if (proxy->iostream_proxy != NULL) {
+		bytes_in = iostream_pump_get_bytes_moved(
+			iostream_proxy_get_pump(proxy->iostream_proxy,
+						IOSTREAM_PROXY_SIDE_LEFT));
+		bytes_out = iostream_pump_get_bytes_moved(
+			iostream_proxy_get_pump(proxy->iostream_proxy,
+						IOSTREAM_PROXY_SIDE_RIGHT));
+	}
 	str_printfa(reason, "(%ds idle, in=%"PRIuUOFF_T", out=%"PRIuUOFF_T,
-		    (int)(ioloop_time - proxy->last_io),
-		    proxy->server_output->offset, proxy->client_output->offset);
+		    (int)(ioloop_time - login_proxy_get_last_io(proxy)),
+		    bytes_in, bytes_out);
 	if (o_stream_get_buffer_used_size(proxy->client_output) > 0) {
 		str_printfa(reason, "+%"PRIuSIZE_T,
 			    o_stream_get_buffer_used_size(proxy->client_output));
 	}
-	if (proxy->server_io == NULL)
-		str_append(reason, ", client output blocked");
-	if (proxy->client_io == NULL)
-		str_append(reason, ", server output blocked");
+	if (o_stream_get_buffer_used_size(proxy->server_output) > 0) {
+		str_printfa(reason, ", %"PRIuSIZE_T" bytes unsent to server",
+			    o_stream_get_buffer_used_size(proxy->server_output));
+	}
 	str_append_c(reason, ')');
 	if (server)
 		login_proxy_free_delayed(_proxy, str_c(reason));
@@ -109,15 +135,6 @@ static void login_proxy_free_errstr(struct login_proxy **_proxy,
 		login_proxy_free_reason(_proxy, str_c(reason));
 }
 
-static void login_proxy_free_errno(struct login_proxy **_proxy,
-				   int err, bool server)
-{
-	const char *errstr;
-
-	errstr = err == 0 || err == EPIPE ? "" : strerror(err);
-	login_proxy_free_errstr(_proxy, errstr, server);
-}
-
 static void login_proxy_free_ostream(struct login_proxy **_proxy,
 				     struct ostream *output, bool server)
 {
@@ -129,59 +146,27 @@ static void login_proxy_free_ostream(struct login_proxy **_proxy,
 	login_proxy_free_errstr(_proxy, errstr, server);
 }
 
-static void server_input(struct login_proxy *proxy)
-{
-	unsigned char buf[OUTBUF_THRESHOLD];
-	ssize_t ret, ret2;
-
-	proxy->last_io = ioloop_time;
-	if (o_stream_get_buffer_used_size(proxy->client_output) >
-	    OUTBUF_THRESHOLD) {
-		/* client's output buffer is already quite full.
-		   don't send more until we're below threshold. */
-		io_remove(&proxy->server_io);
-		return;
-	}
-
-	ret = net_receive(proxy->server_fd, buf, sizeof(buf));
-	if (ret < 0) {
-		login_proxy_free_errno(&proxy, errno, TRUE);
-		return;
-	}
-	o_stream_cork(proxy->client_output);
-	ret2 = o_stream_send(proxy->client_output, buf, ret);
-	o_stream_uncork(proxy->client_output);
-	if (ret2 != ret)
-		login_proxy_free_ostream(&proxy, proxy->client_output, FALSE);
-}
-
-static void proxy_client_input(struct login_proxy *proxy)
-{
-	const unsigned char *data;
-	size_t size;
-	ssize_t ret;
-
-	proxy->last_io = ioloop_time;
-	if (o_stream_get_buffer_used_size(proxy->server_output) >
-	    OUTBUF_THRESHOLD) {
-		/* proxy's output buffer is already quite full.
-		   don't send more until we're below threshold. */
-		io_remove(&proxy->client_io);
-		return;
-	}
-
-	if (i_stream_read_more(proxy->client_input, &data, &size) < 0) {
-		const char *errstr = i_stream_get_error(proxy->client_input);
-		login_proxy_free_errstr(&proxy, errstr, FALSE);
-		return;
+static void
+login_proxy_finished(enum iostream_proxy_side side, bool success,
+		     struct login_proxy *proxy)
+{
+	/* LEFT side is the client, RIGHT side is the server */
+	bool server = side == IOSTREAM_PROXY_SIDE_RIGHT;
+	struct istream *input =
+		server ? proxy->server_input : proxy->client_input;
+	struct ostream *output =
+		server ? proxy->client_output : proxy->server_output;
+
+	if (success) {
+		/* EOF from the side */
+		login_proxy_free_errstr(&proxy, "", server);
+	} else if (input->stream_errno != 0) {
+		login_proxy_free_errstr(&proxy, input->stream_errno == EPIPE ?
+					"" : i_stream_get_error(input), server);
+	} else {
+		/* writing to the other side failed */
+		login_proxy_free_ostream(&proxy, output, !server);
 	}
-	o_stream_cork(proxy->server_output);
-	ret = o_stream_send(proxy->server_output, data, size);
-	o_stream_uncork(proxy->server_output);
-	if (ret != (ssize_t)size)
-		login_proxy_free_ostream(&proxy, proxy->server_output, TRUE);
-	else
-		i_stream_skip(proxy->client_input, ret);
 }
 
 static void proxy_client_disconnected_input(struct login_proxy *proxy)
@@ -196,44 +181,6 @@ static void proxy_client_disconnected_input(struct login_proxy *proxy)
 	}
 }
 
-static int server_output(struct login_proxy *proxy)
-{
-	proxy->last_io = ioloop_time;
-	if (o_stream_flush(proxy->server_output) < 0) {
-		login_proxy_free_ostream(&proxy, proxy->server_output, TRUE);
-		return 1;
-	}
-
-	if (proxy->client_io == NULL &&
-	    o_stream_get_buffer_used_size(proxy->server_output) <
-	    OUTBUF_THRESHOLD) {
-		/* there's again space in proxy's output buffer, so we can
-		   read more from client. */
-		proxy->client_io = io_add_istream(proxy->client_input,
-						  proxy_client_input, proxy);
-	}
-	return 1;
-}
-
-static int proxy_client_output(struct login_proxy *proxy)
-{
-	proxy->last_io = ioloop_time;
-	if (o_stream_flush(proxy->client_output) < 0) {
-		login_proxy_free_ostream(&proxy, proxy->client_output, FALSE);
-		return 1;
-	}
-
-	if (proxy->server_io == NULL &&
-	    o_stream_get_buffer_used_size(proxy->client_output) <
-	    OUTBUF_THRESHOLD) {
-		/* there's again space in client's output buffer, so we can
-		   read more from proxy. */
-		proxy->server_io =
-			io_add(proxy->server_fd, IO_READ, server_input, proxy);
-	}
-	return 1;
-}
-
 static void proxy_prelogin_input(struct login_proxy *proxy)
 {
 	proxy->callback(proxy->client);
@@ -479,6 +426,8 @@ static void login_proxy_disconnect(struct login_proxy *proxy)
 		proxy->state_rec->num_proxying_connections--;
 	}
 
+	if (proxy->iostream_proxy != NULL)
+		iostream_proxy_unref(&proxy->iostream_proxy);
 	if (proxy->server_io != NULL)
 		io_remove(&proxy->server_io);
 	if (proxy->server_input != NULL)
@@ -697,8 +646,6 @@ static void login_proxy_notify(struct login_proxy *proxy)
 void login_proxy_detach(struct login_proxy *proxy)
 {
 	struct client *client = proxy->client;
-	const unsigned char *data;
-	size_t size;
 
 	i_assert(proxy->client_fd == -1);
 	i_assert(proxy->server_input != NULL);
@@ -713,23 +660,20 @@ void login_proxy_detach(struct login_proxy *proxy)
 
 	i_stream_set_persistent_buffers(client->input, FALSE);
 	o_stream_set_max_buffer_size(client->output, (size_t)-1);
-	o_stream_set_flush_callback(client->output, proxy_client_output, proxy);
 	client->input = NULL;
 	client->output = NULL;
 
-	/* send all pending client input to proxy */
-	data = i_stream_get_data(proxy->client_input, &size);
-	if (size != 0)
-		o_stream_nsend(proxy->server_output, data, size);
-
-	/* from now on, just do dummy proxying */
+	/* from now on, just do dummy proxying. the pumps first send any
+	   input that is still buffered, and then splice() directly between
+	   the fds whenever possible. */
 	io_remove(&proxy->server_io);
-	proxy->server_io =
-		io_add(proxy->server_fd, IO_READ, server_input, proxy);
-	proxy->client_io =
-		io_add_istream(proxy->client_input, proxy_client_input, proxy);
-	o_stream_set_flush_callback(proxy->server_output, server_output, proxy);
-	i_stream_destroy(&proxy->server_input);
+	proxy->last_io = ioloop_time;
+	proxy->iostream_proxy =
+		iostream_proxy_create(proxy->client_input, proxy->client_output,
+				      proxy->server_input, proxy->server_output);
+	iostream_proxy_set_completion_callback(proxy->iostream_proxy,
+					       login_proxy_finished, proxy);
+	iostream_proxy_start(proxy->iostream_proxy);
 
 	if (proxy->notify_refresh_secs != 0) {
 		proxy->to_notify =
@@ -820,16 +764,18 @@ void login_proxy_kill_idle(void)
 	struct login_proxy *proxy, *next;
 	time_t now = time(NULL);
 	time_t stop_timestamp = now - LOGIN_PROXY_DIE_IDLE_SECS;
+	time_t last_io;
 	unsigned int stop_msecs;
 
 	for (proxy = login_proxies; proxy != NULL; proxy = next) {
 		next = proxy->next;
 
-		if (proxy->last_io <= stop_timestamp)
+		last_io = login_proxy_get_last_io(proxy);
+		if (last_io <= stop_timestamp)
 			proxy_kill_idle(proxy);
 		else {
 			i_assert(proxy->to == NULL);
-			stop_msecs = (proxy->last_io - stop_timestamp) * 1000;
+			stop_msecs = (last_io - stop_timestamp) * 1000;
 			proxy->to = timeout_add(stop_msecs,
 						proxy_kill_idle, proxy);
 		}
@@ -0,0 +1,609 @@
+/* Copyright (c) 2016 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "str.h"
+#include "strescape.h"
+#include "mail-user.h"
+#include "mail-namespace.h"
+#include "mail-storage-private.h"
+#include "mailbox-list-iter.h"
+#include "mail-search.h"
+#include "fts-indexer.h"
+#include "fts-user.h"
+#include "fts-inverted-index.h"
+#include "fts-inverted-plugin.h"
+
+#define FTS_INVERTED_FILE_PREFIX "dovecot.index.fts"
+#define FTS_INVERTED_LOCK_TIMEOUT_SECS 60
+
+/* Terms are prefixed by where the token was found */
+#define FTS_INVERTED_TERM_BODY 'b'
+#define FTS_INVERTED_TERM_HEADER 'h'
+/* For fts_header_want_indexed() headers the token is also indexed as
+   H<lowercased header name>:<token> */
+#define FTS_INVERTED_TERM_NAMED_HEADER 'H'
+
+struct inverted_fts_backend {
+	struct fts_backend backend;
+
+	struct mailbox *box;
+	struct fts_inverted_index *index;
+	bool refresh;
+};
+
+struct inverted_fts_backend_update_context {
+	struct fts_backend_update_context ctx;
+	struct fts_inverted_index_update *update;
+
+	char *first_box_vname;
+	uint32_t uid;
+	char term_type;
+	/* H<header name>: for the current header, empty if not wanted */
+	string_t *hdr_prefix;
+	string_t *term;
+
+	bool need_optimize;
+};
+
+static struct fts_backend *fts_backend_inverted_alloc(void)
+{
+	struct inverted_fts_backend *backend;
+
+	backend = i_new(struct inverted_fts_backend, 1);
+	backend->backend = fts_backend_inverted;
+	return &backend->backend;
+}
+
+static int
+fts_backend_inverted_init(struct fts_backend *_backend, const char **error_r)
+{
+	/* the tokenizers and filters are needed for building and for
+	   expanding the search args */
+	return fts_mail_user_init(_backend->ns->user, error_r);
+}
+
+static void
+fts_backend_inverted_unset_box(struct inverted_fts_backend *backend)
+{
+	if (backend->index != NULL)
+		fts_inverted_index_deinit(&backend->index);
+	backend->box = NULL;
+}
+
+static void fts_backend_inverted_deinit(struct fts_backend *_backend)
+{
+	struct inverted_fts_backend *backend =
+		(struct inverted_fts_backend *)_backend;
+
+	fts_backend_inverted_unset_box(backend);
+	fts_mail_user_deinit(_backend->ns->user);
+	i_free(backend);
+}
+
+static struct fts_inverted_index *
+fts_inverted_index_init_box(struct mailbox *box)
+{
+	const struct mailbox_permissions *perm;
+	struct mail_storage *storage;
+	struct mailbox_status status;
+	struct fts_inverted_index_settings set;
+	const char *path;
+
+	perm = mailbox_get_permissions(box);
+	storage = mailbox_get_storage(box);
+	if (mailbox_get_path_to(box, MAILBOX_LIST_PATH_TYPE_INDEX, &path) <= 0)
+		i_unreached(); /* fts already checked this */
+	mailbox_get_open_status(box, STATUS_UIDVALIDITY, &status);
+
+	memset(&set, 0, sizeof(set));
+	set.uid_validity = status.uidvalidity;
+	set.lock_method = storage->set->parsed_lock_method;
+	set.lock_timeout_secs = mail_storage_get_lock_timeout(storage,
+					FTS_INVERTED_LOCK_TIMEOUT_SECS);
+	set.fsync_mode = storage->set->parsed_fsync_mode;
+	set.mmap_disable = storage->set->mmap_disable;
+	set.mode = perm->file_create_mode;
+	set.gid = perm->file_create_gid;
+	set.gid_origin = perm->file_create_gid_origin;
+
+	return fts_inverted_index_init(
+		t_strconcat(path, "/"FTS_INVERTED_FILE_PREFIX, NULL), &set);
+}
+
+static int
+fts_backend_inverted_set_box(struct inverted_fts_backend *backend,
+			     struct mailbox *box)
+{
+	if (backend->box == box) {
+		if (backend->refresh) {
+			if (fts_inverted_index_refresh(backend->index) < 0)
+				return -1;
+			backend->refresh = FALSE;
+		}
+		return 0;
+	}
+	fts_backend_inverted_unset_box(backend);
+	backend->refresh = FALSE;
+	if (box == NULL)
+		return 0;
+
+	backend->index = fts_inverted_index_init_box(box);
+	backend->box = box;
+	return fts_inverted_index_refresh(backend->index);
+}
+
+static int
+fts_backend_inverted_get_last_uid(struct fts_backend *_backend,
+				  struct mailbox *box, uint32_t *last_uid_r)
+{
+	struct inverted_fts_backend *backend =
+		(struct inverted_fts_backend *)_backend;
+	struct fts_inverted_index *index;
+	int ret;
+
+	if (backend->box != box && fts_backend_is_updating(_backend)) {
+		/* an update may still be writing to the current mailbox's
+		   index (e.g. while indexing a virtual mailbox), so don't
+		   switch away from it. */
+		index = fts_inverted_index_init_box(box);
+		ret = fts_inverted_index_refresh(index);
+		*last_uid_r = fts_inverted_index_get_last_uid(index);
+		fts_inverted_index_deinit(&index);
+		return ret;
+	}
+
+	if (fts_backend_inverted_set_box(backend, box) < 0)
+		return -1;
+	*last_uid_r = fts_inverted_index_get_last_uid(backend->index);
+	return 0;
+}
+
+static struct fts_backend_update_context *
+fts_backend_inverted_update_init(struct fts_backend *_backend)
+{
+	struct inverted_fts_backend_update_context *ctx;
+
+	ctx = i_new(struct inverted_fts_backend_update_context, 1);
+	ctx->ctx.backend = _backend;
+	ctx->hdr_prefix = str_new(default_pool, 64);
+	ctx->term = str_new(default_pool, 128);
+	return &ctx->ctx;
+}
+
+static int
+fts_backend_inverted_update_finish(struct inverted_fts_backend_update_context *ctx)
+{
+	bool need_optimize;
+
+	if (ctx->update == NULL)
+		return 0;
+
+	if (ctx->uid != 0) {
+		fts_inverted_index_update_set_last_uid(ctx->update, ctx->uid);
+		ctx->uid = 0;
+	}
+	if (fts_inverted_index_update_deinit(&ctx->update, &need_optimize) < 0)
+		return -1;
+	if (need_optimize)
+		ctx->need_optimize = TRUE;
+	return 0;
+}
+
+static void
+fts_backend_inverted_request_optimize(struct inverted_fts_backend_update_context *ctx)
+{
+	struct mail_user *user = ctx->ctx.backend->ns->user;
+	const char *cmd, *path;
+	int fd;
+
+	/* merge the segments in the background. the optimize affects all
+	   mailboxes within the namespace, so just use any mailbox name
+	   in it */
+	cmd = t_strdup_printf("OPTIMIZE\t0\t%s\t%s\n",
+			      str_tabescape(user->username),
+			      str_tabescape(ctx->first_box_vname));
+	fd = fts_indexer_cmd(user, cmd, &path);
+	if (fd != -1)
+		i_close_fd(&fd);
+}
+
+static int
+fts_backend_inverted_update_deinit(struct fts_backend_update_context *_ctx)
+{
+	struct inverted_fts_backend_update_context *ctx =
+		(struct inverted_fts_backend_update_context *)_ctx;
+	int ret = _ctx->failed ? -1 : 0;
+
+	if (fts_backend_inverted_update_finish(ctx) < 0)
+		ret = -1;
+	if (ctx->need_optimize && ctx->first_box_vname != NULL)
+		fts_backend_inverted_request_optimize(ctx);
+
+	str_free(&ctx->hdr_prefix);
+	str_free(&ctx->term);
+	i_free(ctx->first_box_vname);
+	i_free(ctx);
+	return ret;
+}
+
+static void
+fts_backend_inverted_update_set_mailbox(struct fts_backend_update_context *_ctx,
+					struct mailbox *box)
+{
+	struct inverted_fts_backend_update_context *ctx =
+		(struct inverted_fts_backend_update_context *)_ctx;
+	struct inverted_fts_backend *backend =
+		(struct inverted_fts_backend *)ctx->ctx.backend;
+
+	if (fts_backend_inverted_update_finish(ctx) < 0)
+		_ctx->failed = TRUE;
+	if (fts_backend_inverted_set_box(backend, box) < 0)
+		_ctx->failed = TRUE;
+	else if (box != NULL) {
+		if (ctx->first_box_vname == NULL)
+			ctx->first_box_vname = i_strdup(box->vname);
+		ctx->update = fts_inverted_index_update_init(backend->index);
+	}
+}
+
+static void
+fts_backend_inverted_update_expunge(struct fts_backend_update_context *_ctx,
+				    uint32_t uid)
+{
+	struct inverted_fts_backend_update_context *ctx =
+		(struct inverted_fts_backend_update_context *)_ctx;
+
+	if (ctx->update != NULL)
+		fts_inverted_index_update_expunge(ctx->update, uid);
+}
+
+static bool
+fts_backend_inverted_update_set_build_key(struct fts_backend_update_context *_ctx,
+					  const struct fts_backend_build_key *key)
+{
+	struct inverted_fts_backend_update_context *ctx =
+		(struct inverted_fts_backend_update_context *)_ctx;
+
+	if (_ctx->failed || ctx->update == NULL)
+		return FALSE;
+
+	if (key->uid != ctx->uid) {
+		/* all the earlier messages have been fully added */
+		fts_inverted_index_update_set_last_uid(ctx->update,
+						       key->uid - 1);
+		ctx->uid = key->uid;
+	}
+
+	str_truncate(ctx->hdr_prefix, 0);
+	switch (key->type) {
+	case FTS_BACKEND_BUILD_KEY_HDR:
+	case FTS_BACKEND_BUILD_KEY_MIME_HDR:
+		ctx->term_type = FTS_INVERTED_TERM_HEADER;
+		if (key->hdr_name[0] != '\0' &&
+		    fts_header_want_indexed(key->hdr_name)) {
+			str_append_c(ctx->hdr_prefix,
+				     FTS_INVERTED_TERM_NAMED_HEADER);
+			str_append(ctx->hdr_prefix, t_str_lcase(key->hdr_name));
+			str_append_c(ctx->hdr_prefix, ':');
+		}
+		break;
+	case FTS_BACKEND_BUILD_KEY_BODY_PART:
+		ctx->term_type = FTS_INVERTED_TERM_BODY;
+		break;
+	case FTS_BACKEND_BUILD_KEY_BODY_PART_BINARY:
+		i_unreached();
+	}
+	return TRUE;
+}
+
+static void
+fts_backend_inverted_update_unset_build_key(struct fts_backend_update_context *_ctx ATTR_UNUSED)
+{
+}
+
+static int
+fts_backend_inverted_update_build_more(struct fts_backend_update_context *_ctx,
+				       const unsigned char *data, size_t size)
+{
+	struct inverted_fts_backend_update_context *ctx =
+		(struct inverted_fts_backend_update_context *)_ctx;
+
+	/* data is a single token */
+	if (size == 0)
+		return 0;
+
+	str_truncate(ctx->term, 0);
+	str_append_c(ctx->term, ctx->term_type);
+	str_append_n(ctx->term, data, size);
+	fts_inverted_index_update_add(ctx->update, str_c(ctx->term), ctx->uid);
+
+	if (str_len(ctx->hdr_prefix) > 0) {
+		str_truncate(ctx->term, 0);
+		str_append_str(ctx->term, ctx->hdr_prefix);
+		str_append_n(ctx->term, data, size);
+		fts_inverted_index_update_add(ctx->update, str_c(ctx->term),
+					      ctx->uid);
+	}
+	return 0;
+}
+
+static int fts_backend_inverted_refresh(struct fts_backend *_backend)
+{
+	struct inverted_fts_backend *backend =
+		(struct inverted_fts_backend *)_backend;
+
+	backend->refresh = TRUE;
+	return 0;
+}
+
+static int fts_backend_inverted_optimize(struct fts_backend *_backend)
+{
+	struct mailbox_list_iterate_context *iter;
+	const struct mailbox_info *info;
+	struct fts_inverted_index *index;
+	struct mailbox *box;
+	int ret = 0;
+
+	iter = mailbox_list_iter_init(_backend->ns->list, "*",
+				      MAILBOX_LIST_ITER_SKIP_ALIASES |
+				      MAILBOX_LIST_ITER_NO_AUTO_BOXES);
+	while ((info = mailbox_list_iter_next(iter)) != NULL) {
+		if ((info->flags &
+		     (MAILBOX_NONEXISTENT | MAILBOX_NOSELECT)) != 0)
+			continue;
+
+		box = mailbox_alloc(info->ns->list, info->vname, 0);
+		if (mailbox_open(box) == 0) T_BEGIN {
+			index = fts_inverted_index_init_box(box);
+			if (fts_inverted_index_optimize(index) < 0)
+				ret = -1;
+			fts_inverted_index_deinit(&index);
+		} T_END;
+		mailbox_free(&box);
+	}
+	if (mailbox_list_iter_deinit(&iter) < 0)
+		ret = -1;
+	return ret;
+}
+
+static int
+inverted_lookup_term(struct inverted_fts_backend *backend,
+		     const struct mail_search_arg *arg, char term_type,
+		     ARRAY_TYPE(seq_range) *uids)
+{
+	string_t *term = t_str_new(128);
+
+	if (term_type == FTS_INVERTED_TERM_NAMED_HEADER) {
+		str_append_c(term, term_type);
+		str_append(term, t_str_lcase(arg->hdr_field_name));
+		str_append_c(term, ':');
+	} else {
+		str_append_c(term, term_type);
+	}
+	str_append(term, arg->value.str);
+	/* IMAP SEARCH matches substrings. we can't do that, but match
+	   prefixes at least. */
+	return fts_inverted_index_lookup(backend->index, str_c(term), TRUE,
+					 uids);
+}
+
+static void
+inverted_add_scores(ARRAY_TYPE(fts_score_map) *scores,
+		    const ARRAY_TYPE(seq_range) *uids, uint32_t messages_count)
+{
+	struct fts_score_map *score;
+	struct seq_range_iter iter;
+	unsigned int n = 0, df;
+	uint32_t uid;
+	float idf;
+
+	/* rarer terms are more relevant. use the integer log2 of the inverse
+	   document frequency, which is close enough for ranking. */
+	df = seq_range_count(uids);
+	if (df == 0)
+		return;
+	idf = 1 + bits_required32(messages_count / df);
+
+	seq_range_array_iter_init(&iter, uids);
+	while (seq_range_array_iter_nth(&iter, n++, &uid)) {
+		score = array_append_space(scores);
+		score->uid = uid;
+		score->score = idf;
+	}
+}
+
+static int inverted_lookup_arg(struct inverted_fts_backend *backend,
+			       const struct mail_search_arg *arg,
+			       bool and_args, uint32_t messages_count,
+			       struct fts_result *result)
+{
+	ARRAY_TYPE(seq_range) tmp_definite_uids, tmp_maybe_uids;
+	int ret = 1;
+
+	i_array_init(&tmp_definite_uids, 128);
+	i_array_init(&tmp_maybe_uids, 128);
+
+	switch (arg->type) {
+	case SEARCH_TEXT:
+		if (inverted_lookup_term(backend, arg, FTS_INVERTED_TERM_HEADER,
+					 &tmp_definite_uids) < 0)
+			ret = -1;
+		/* fall through */
+	case SEARCH_BODY:
+		if (inverted_lookup_term(backend, arg, FTS_INVERTED_TERM_BODY,
+					 &tmp_definite_uids) < 0)
+			ret = -1;
+		break;
+	case SEARCH_HEADER:
+	case SEARCH_HEADER_ADDRESS:
+	case SEARCH_HEADER_COMPRESS_LWSP:
+		if (fts_header_want_indexed(arg->hdr_field_name)) {
+			if (inverted_lookup_term(backend, arg,
+					FTS_INVERTED_TERM_NAMED_HEADER,
+					&tmp_definite_uids) < 0)
+				ret = -1;
+		} else {
+			/* we only know that some header contains the token */
+			if (inverted_lookup_term(backend, arg,
+					FTS_INVERTED_TERM_HEADER,
+					&tmp_maybe_uids) < 0)
+				ret = -1;
+		}
+		break;
+	default:
+		ret = 0;
+		break;
+	}
+	if (ret <= 0) {
+		array_free(&tmp_definite_uids);
+		array_free(&tmp_maybe_uids);
+		return ret;
+	}
+
+	if (arg->match_not) {
+		/* definite -> non-match
+		   maybe -> maybe
+		   non-match -> definite */
+		ARRAY_TYPE(seq_range) matches;
+
+		t_array_init(&matches, array_count(&tmp_definite_uids) +
+			     array_count(&tmp_maybe_uids));
+		array_append_array(&matches, &tmp_definite_uids);
+		seq_range_array_merge(&matches, &tmp_maybe_uids);
+
+		array_clear(&tmp_definite_uids);
+		seq_range_array_add_range(&tmp_definite_uids, 1,
+			fts_inverted_index_get_last_uid(backend->index));
+		seq_range_array_remove_seq_range(&tmp_definite_uids, &matches);
+	} else {
+		inverted_add_scores(&result->scores, &tmp_definite_uids,
+				    messages_count);
+	}
+
+	if (and_args) {
+		/* AND:
+		   definite && definite -> definite
+		   definite && maybe -> maybe
+		   maybe && maybe -> maybe */
+
+		/* put definites among maybies, so they can be intersected */
+		seq_range_array_merge(&result->maybe_uids,
+				      &result->definite_uids);
+		seq_range_array_merge(&tmp_maybe_uids, &tmp_definite_uids);
+
+		seq_range_array_intersect(&result->maybe_uids,
+					  &tmp_maybe_uids);
+		seq_range_array_intersect(&result->definite_uids,
+					  &tmp_definite_uids);
+		/* remove duplicate maybies that are also definites */
+		seq_range_array_remove_seq_range(&result->maybe_uids,
+						 &result->definite_uids);
+	} else {
+		/* OR:
+		   definite || definite -> definite
+		   definite || maybe -> definite
+		   maybe || maybe -> maybe */
+
+		/* remove maybies that are now definites */
+		seq_range_array_remove_seq_range(&tmp_maybe_uids,
+						 &result->definite_uids);
+		seq_range_array_remove_seq_range(&result->maybe_uids,
+						 &tmp_definite_uids);
+
+		seq_range_array_merge(&result->definite_uids,
+				      &tmp_definite_uids);
+		seq_range_array_merge(&result->maybe_uids, &tmp_maybe_uids);
+	}
+
+	array_free(&tmp_definite_uids);
+	array_free(&tmp_maybe_uids);
+	return ret;
+}
+
+static int fts_score_map_uid_cmp(const struct fts_score_map *m1,
+				 const struct fts_score_map *m2)
+{
+	return m1->uid < m2->uid ? -1 :
+		(m1->uid > m2->uid ? 1 : 0);
+}
+
+static void inverted_scores_sum(ARRAY_TYPE(fts_score_map) *scores)
+{
+	struct fts_score_map *map;
+	unsigned int i, j, count;
+
+	array_sort(scores, fts_score_map_uid_cmp);
+	map = array_get_modifiable(scores, &count);
+	for (i = j = 1; i < count; i++) {
+		if (map[i].uid == map[j-1].uid)
+			map[j-1].score += map[i].score;
+		else
+			map[j++] = map[i];
+	}
+	if (count > 0)
+		array_delete(scores, j, count - j);
+}
+
+static int
+fts_backend_inverted_lookup(struct fts_backend *_backend, struct mailbox *box,
+			    struct mail_search_arg *args,
+			    enum fts_lookup_flags flags,
+			    struct fts_result *result)
+{
+	struct inverted_fts_backend *backend =
+		(struct inverted_fts_backend *)_backend;
+	struct mailbox_status status;
+	bool and_args = (flags & FTS_LOOKUP_FLAG_AND_ARGS) != 0;
+	bool first = TRUE;
+	int ret = 0;
+
+	if (fts_backend_inverted_set_box(backend, box) < 0)
+		return -1;
+	mailbox_get_open_status(box, STATUS_MESSAGES, &status);
+
+	for (; args != NULL; args = args->next) {
+		T_BEGIN {
+			ret = inverted_lookup_arg(backend, args,
+						  first ? FALSE : and_args,
+						  status.messages, result);
+		} T_END;
+		if (ret < 0)
+			return -1;
+		if (ret > 0) {
+			args->match_always = TRUE;
+			first = FALSE;
+		}
+	}
+	inverted_scores_sum(&result->scores);
+	result->scores_sorted = TRUE;
+	return 0;
+}
+
+struct fts_backend fts_backend_inverted = {
+	.name = "inverted",
+	.flags = FTS_BACKEND_FLAG_TOKENIZED_INPUT,
+
+	{
+		fts_backend_inverted_alloc,
+		fts_backend_inverted_init,
+		fts_backend_inverted_deinit,
+		fts_backend_inverted_get_last_uid,
+		fts_backend_inverted_update_init,
+		fts_backend_inverted_update_deinit,
+		fts_backend_inverted_update_set_mailbox,
+		fts_backend_inverted_update_expunge,
+		fts_backend_inverted_update_set_build_key,
+		fts_backend_inverted_update_unset_build_key,
+		fts_backend_inverted_update_build_more,
+		fts_backend_inverted_refresh,
+		NULL,
+		fts_backend_inverted_optimize,
+		fts_backend_default_can_lookup,
+		fts_backend_inverted_lookup,
+		NULL,
+		NULL,
+		NULL,
+		NULL
+	}
+};
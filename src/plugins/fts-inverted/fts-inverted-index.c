@@ -0,0 +1,1048 @@
+/* Copyright (c) 2016 Dovecot authors, see the included COPYING file */
+
+/* The list file contains the IDs of the segments in the order they were
+   written, the highest indexed UID and the expunged UIDs that may still
+   exist in the segments. Updates are never done in place: the new messages
+   are always written to a new segment and the list file is replaced. When
+   FTS_INVERTED_MERGE_FACTOR newest segments are about the same size, they
+   are merged into a single larger segment, so there are only a logarithmic
+   number of segments to look up. Merging all the segments also drops the
+   expunged messages. */
+
+#include "lib.h"
+#include "array.h"
+#include "hash.h"
+#include "str.h"
+#include "read-full.h"
+#include "write-full.h"
+#include "eacces-error.h"
+#include "file-create-locked.h"
+#include "fts-inverted-segment.h"
+#include "fts-inverted-index.h"
+
+#include <stdio.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#define FTS_INVERTED_LIST_VERSION 1
+#define FTS_INVERTED_LOCK_SUFFIX ".lock"
+#define FTS_INVERTED_TEMP_SUFFIX ".tmp"
+/* Write a segment when the terms being built use this much memory */
+#define FTS_INVERTED_BUILD_MAX_MEMORY (32*1024*1024)
+/* Merge this many segments of the same size level */
+#define FTS_INVERTED_MERGE_FACTOR 4
+/* All the segments smaller than this are on the lowest size level */
+#define FTS_INVERTED_MERGE_MIN_SIZE (64*1024)
+/* Merge all the segments if there are this many of them */
+#define FTS_INVERTED_MAX_SEGMENTS 32
+/* Ask for optimization once this many UIDs have been expunged */
+#define FTS_INVERTED_OPTIMIZE_EXPUNGE_COUNT 1000
+
+struct fts_inverted_list_header {
+	uint32_t version;
+	uint32_t uid_validity;
+	/* all the messages up to this UID have been indexed */
+	uint32_t last_uid;
+	uint32_t next_segment_id;
+	uint32_t segments_count;
+	uint32_t expunges_count;
+	/* struct fts_inverted_list_segment segments[segments_count]; */
+	/* struct seq_range expunges[expunges_count]; */
+};
+
+struct fts_inverted_list_segment {
+	uint32_t id;
+	uint32_t size;
+};
+
+struct fts_inverted_open_segment {
+	uint32_t id;
+	struct fts_inverted_segment *seg;
+};
+
+struct fts_inverted_index {
+	char *path, *gid_origin;
+	struct fts_inverted_index_settings set;
+
+	/* the list file was last read from this file */
+	struct stat list_st;
+	struct fts_inverted_list_header hdr;
+	ARRAY(struct fts_inverted_list_segment) segments;
+	ARRAY_TYPE(seq_range) expunges;
+
+	ARRAY(struct fts_inverted_open_segment) open_segments;
+	/* ID of the segment found to be corrupted, 0 if none */
+	uint32_t corrupted_segment_id;
+	bool list_read:1;
+};
+
+struct fts_inverted_build_term {
+	ARRAY_TYPE(uint32_t) uids;
+	bool unsorted;
+};
+
+struct fts_inverted_index_update {
+	struct fts_inverted_index *index;
+
+	pool_t pool;
+	HASH_TABLE(char *, struct fts_inverted_build_term *) terms;
+	uint32_t last_uid;
+	ARRAY_TYPE(seq_range) expunges;
+
+	bool failed:1;
+	bool added_terms:1;
+};
+
+struct fts_inverted_merge_input {
+	struct fts_inverted_segment *seg;
+	unsigned int idx, count;
+
+	const char *term;
+	const struct fts_inverted_term *rec;
+};
+
+struct fts_inverted_index *
+fts_inverted_index_init(const char *path,
+			const struct fts_inverted_index_settings *set)
+{
+	struct fts_inverted_index *index;
+
+	index = i_new(struct fts_inverted_index, 1);
+	index->path = i_strdup(path);
+	index->set = *set;
+	index->gid_origin = i_strdup(set->gid_origin);
+	index->set.gid_origin = index->gid_origin;
+	index->hdr.uid_validity = set->uid_validity;
+	i_array_init(&index->segments, 16);
+	i_array_init(&index->expunges, 16);
+	i_array_init(&index->open_segments, 16);
+	return index;
+}
+
+static void
+fts_inverted_index_close_unused(struct fts_inverted_index *index, bool all)
+{
+	struct fts_inverted_open_segment *open_segs;
+	const struct fts_inverted_list_segment *seg;
+	unsigned int i, count;
+	bool found;
+
+	open_segs = array_get_modifiable(&index->open_segments, &count);
+	for (i = count; i > 0; i--) {
+		found = FALSE;
+		if (!all) {
+			array_foreach(&index->segments, seg) {
+				if (seg->id == open_segs[i-1].id) {
+					found = TRUE;
+					break;
+				}
+			}
+		}
+		if (!found) {
+			fts_inverted_segment_close(&open_segs[i-1].seg);
+			array_delete(&index->open_segments, i-1, 1);
+			open_segs = array_get_modifiable(&index->open_segments,
+							 &count);
+		}
+	}
+}
+
+void fts_inverted_index_deinit(struct fts_inverted_index **_index)
+{
+	struct fts_inverted_index *index = *_index;
+
+	*_index = NULL;
+	fts_inverted_index_close_unused(index, TRUE);
+	array_free(&index->segments);
+	array_free(&index->expunges);
+	array_free(&index->open_segments);
+	i_free(index->gid_origin);
+	i_free(index->path);
+	i_free(index);
+}
+
+static const char *
+fts_inverted_index_segment_path(struct fts_inverted_index *index, uint32_t id)
+{
+	return t_strdup_printf("%s.%u", index->path, id);
+}
+
+static void fts_inverted_index_reset(struct fts_inverted_index *index)
+{
+	memset(&index->hdr, 0, sizeof(index->hdr));
+	index->hdr.version = FTS_INVERTED_LIST_VERSION;
+	index->hdr.uid_validity = index->set.uid_validity;
+	index->hdr.next_segment_id = 1;
+	array_clear(&index->segments);
+	array_clear(&index->expunges);
+}
+
+static int
+fts_inverted_index_parse_list(struct fts_inverted_index *index,
+			      const unsigned char *data, size_t size)
+{
+	const struct fts_inverted_list_header *hdr = (const void *)data;
+	const struct fts_inverted_list_segment *segs;
+	const struct seq_range *expunges;
+	size_t expected_size;
+
+	if (size < sizeof(*hdr) || hdr->version != FTS_INVERTED_LIST_VERSION)
+		return -1;
+	expected_size = sizeof(*hdr) +
+		hdr->segments_count * sizeof(*segs) +
+		hdr->expunges_count * sizeof(*expunges);
+	if (size != expected_size)
+		return -1;
+
+	index->hdr = *hdr;
+	segs = CONST_PTR_OFFSET(data, sizeof(*hdr));
+	expunges = CONST_PTR_OFFSET(segs, hdr->segments_count * sizeof(*segs));
+	array_clear(&index->segments);
+	array_append(&index->segments, segs, hdr->segments_count);
+	array_clear(&index->expunges);
+	array_append(&index->expunges, expunges, hdr->expunges_count);
+	return 0;
+}
+
+static int
+fts_inverted_index_read_list(struct fts_inverted_index *index, bool force)
+{
+	unsigned char *data;
+	struct stat st;
+	int fd, ret;
+
+	fd = open(index->path, O_RDONLY);
+	if (fd == -1) {
+		if (errno != ENOENT) {
+			i_error("open(%s) failed: %m", index->path);
+			return -1;
+		}
+		fts_inverted_index_reset(index);
+		memset(&index->list_st, 0, sizeof(index->list_st));
+		index->list_read = TRUE;
+		return 0;
+	}
+	if (fstat(fd, &st) < 0) {
+		i_error("fstat(%s) failed: %m", index->path);
+		i_close_fd(&fd);
+		return -1;
+	}
+	if (!force && index->list_read &&
+	    st.st_ino == index->list_st.st_ino &&
+	    CMP_DEV_T(st.st_dev, index->list_st.st_dev) &&
+	    st.st_mtime == index->list_st.st_mtime &&
+	    st.st_size == index->list_st.st_size) {
+		/* unchanged */
+		i_close_fd(&fd);
+		return 0;
+	}
+
+	data = i_malloc(I_MAX(st.st_size, 1));
+	ret = read_full(fd, data, st.st_size);
+	if (ret < 0)
+		i_error("read(%s) failed: %m", index->path);
+	i_close_fd(&fd);
+	if (ret > 0 && fts_inverted_index_parse_list(index, data,
+						     st.st_size) < 0) {
+		i_error("fts-inverted: Corrupted index list %s, rebuilding",
+			index->path);
+		fts_inverted_index_reset(index);
+	} else if (ret == 0) {
+		/* truncated */
+		fts_inverted_index_reset(index);
+	}
+	i_free(data);
+	if (ret < 0)
+		return -1;
+
+	index->list_st = st;
+	index->list_read = TRUE;
+	fts_inverted_index_close_unused(index, FALSE);
+	return 0;
+}
+
+int fts_inverted_index_refresh(struct fts_inverted_index *index)
+{
+	return fts_inverted_index_read_list(index, FALSE);
+}
+
+uint32_t fts_inverted_index_get_last_uid(struct fts_inverted_index *index)
+{
+	if (index->hdr.uid_validity != index->set.uid_validity) {
+		/* the mailbox was recreated, the index needs a rebuild */
+		return 0;
+	}
+	return index->hdr.last_uid;
+}
+
+static int
+fts_inverted_index_create_file(struct fts_inverted_index *index,
+			       const char *path)
+{
+	int fd;
+
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, index->set.mode);
+	if (fd == -1) {
+		i_error("creat(%s) failed: %m", path);
+		return -1;
+	}
+	if (index->set.gid != (gid_t)-1 &&
+	    fchown(fd, (uid_t)-1, index->set.gid) < 0) {
+		if (errno == EPERM) {
+			i_error("%s", eperm_error_get_chgrp("fchown", path,
+						index->set.gid,
+						index->set.gid_origin));
+		} else {
+			i_error("fchown(%s, -1, %ld) failed: %m",
+				path, (long)index->set.gid);
+		}
+		/* continue anyway */
+	}
+	return fd;
+}
+
+static int fts_inverted_index_write_list(struct fts_inverted_index *index)
+{
+	const char *temp_path;
+	buffer_t *buf;
+	int fd, ret = 0;
+
+	index->hdr.segments_count = array_count(&index->segments);
+	index->hdr.expunges_count = array_count(&index->expunges);
+
+	buf = buffer_create_dynamic(default_pool, 256);
+	buffer_append(buf, &index->hdr, sizeof(index->hdr));
+	if (index->hdr.segments_count > 0) {
+		buffer_append(buf, array_idx(&index->segments, 0),
+			      index->hdr.segments_count *
+			      sizeof(struct fts_inverted_list_segment));
+	}
+	if (index->hdr.expunges_count > 0) {
+		buffer_append(buf, array_idx(&index->expunges, 0),
+			      index->hdr.expunges_count *
+			      sizeof(struct seq_range));
+	}
+
+	/* we're holding the lock, so the temp file name can be fixed */
+	temp_path = t_strconcat(index->path, FTS_INVERTED_TEMP_SUFFIX, NULL);
+	fd = fts_inverted_index_create_file(index, temp_path);
+	if (fd == -1)
+		ret = -1;
+	else if (write_full(fd, buf->data, buf->used) < 0) {
+		i_error("write(%s) failed: %m", temp_path);
+		i_unlink(temp_path);
+		ret = -1;
+	} else if (index->set.fsync_mode != FSYNC_MODE_NEVER &&
+		   fdatasync(fd) < 0) {
+		i_error("fdatasync(%s) failed: %m", temp_path);
+		i_unlink(temp_path);
+		ret = -1;
+	} else if (rename(temp_path, index->path) < 0) {
+		i_error("rename(%s, %s) failed: %m", temp_path, index->path);
+		i_unlink(temp_path);
+		ret = -1;
+	}
+	if (fd != -1)
+		i_close_fd(&fd);
+	buffer_free(&buf);
+
+	/* make sure the list is stat()ed again on the next refresh */
+	memset(&index->list_st, 0, sizeof(index->list_st));
+	return ret;
+}
+
+static int
+fts_inverted_index_lock(struct fts_inverted_index *index,
+			struct file_lock **lock_r)
+{
+	struct file_create_settings set;
+	const char *lock_path, *error;
+	bool created;
+	int fd;
+
+	memset(&set, 0, sizeof(set));
+	set.lock_timeout_secs = index->set.lock_timeout_secs;
+	set.lock_method = index->set.lock_method;
+	set.mode = index->set.mode;
+	set.gid = index->set.gid;
+	set.gid_origin = index->set.gid_origin;
+
+	lock_path = t_strconcat(index->path, FTS_INVERTED_LOCK_SUFFIX, NULL);
+	fd = file_create_locked(lock_path, &set, lock_r, &created, &error);
+	if (fd == -1) {
+		i_error("file_create_locked(%s) failed: %s", lock_path, error);
+		return -1;
+	}
+	return fd;
+}
+
+static void
+fts_inverted_index_unlock(struct file_lock **lock, int *fd)
+{
+	file_unlock(lock);
+	i_close_fd(fd);
+}
+
+static int
+fts_inverted_index_get_segment(struct fts_inverted_index *index, uint32_t id,
+			       struct fts_inverted_segment **seg_r)
+{
+	struct fts_inverted_open_segment *open_seg, new_seg;
+	const char *error;
+	bool corrupted;
+	int ret;
+
+	array_foreach_modifiable(&index->open_segments, open_seg) {
+		if (open_seg->id == id) {
+			*seg_r = open_seg->seg;
+			return 1;
+		}
+	}
+
+	ret = fts_inverted_segment_open(
+		fts_inverted_index_segment_path(index, id),
+		index->set.mmap_disable, &new_seg.seg, &corrupted, &error);
+	if (ret < 0 && corrupted)
+		index->corrupted_segment_id = id;
+	else if (ret < 0)
+		i_error("fts-inverted: %s", error);
+	if (ret <= 0)
+		return ret;
+	new_seg.id = id;
+	array_append(&index->open_segments, &new_seg, 1);
+	*seg_r = new_seg.seg;
+	return 1;
+}
+
+static int
+fts_inverted_segment_lookup(struct fts_inverted_segment *seg,
+			    const char *term, bool prefix,
+			    ARRAY_TYPE(uint32_t) *tmp_uids,
+			    ARRAY_TYPE(seq_range) *uids)
+{
+	const struct fts_inverted_term *rec;
+	const char *cur_term;
+	const uint32_t *uidp;
+	unsigned int idx, count, term_len = strlen(term);
+
+	if (fts_inverted_segment_find(seg, term, &idx) < 0)
+		return -1;
+
+	count = fts_inverted_segment_get_terms_count(seg);
+	for (; idx < count; idx++) {
+		if (fts_inverted_segment_get_term(seg, idx, &cur_term,
+						  &rec) < 0)
+			return -1;
+		if (prefix ? strncmp(cur_term, term, term_len) != 0 :
+		    strcmp(cur_term, term) != 0)
+			break;
+
+		array_clear(tmp_uids);
+		if (fts_inverted_segment_get_uids(seg, rec, tmp_uids) < 0)
+			return -1;
+		array_foreach(tmp_uids, uidp)
+			seq_range_array_add(uids, *uidp);
+	}
+	return 0;
+}
+
+static int
+fts_inverted_index_lookup_segments(struct fts_inverted_index *index,
+				   const char *term, bool prefix,
+				   ARRAY_TYPE(seq_range) *uids)
+{
+	const struct fts_inverted_list_segment *list_seg;
+	struct fts_inverted_segment *seg;
+	ARRAY_TYPE(uint32_t) tmp_uids;
+	int ret = 1;
+
+	i_array_init(&tmp_uids, 128);
+	array_foreach(&index->segments, list_seg) {
+		ret = fts_inverted_index_get_segment(index, list_seg->id, &seg);
+		if (ret <= 0)
+			break;
+		if (fts_inverted_segment_lookup(seg, term, prefix,
+						&tmp_uids, uids) < 0) {
+			index->corrupted_segment_id = list_seg->id;
+			ret = -1;
+			break;
+		}
+	}
+	array_free(&tmp_uids);
+	return ret;
+}
+
+static void fts_inverted_index_delete_locked(struct fts_inverted_index *index)
+{
+	const struct fts_inverted_list_segment *seg;
+	uint32_t next_segment_id = index->hdr.next_segment_id;
+
+	array_foreach(&index->segments, seg) {
+		i_unlink_if_exists(fts_inverted_index_segment_path(index,
+								   seg->id));
+	}
+	/* last_uid=0 makes the next update index all the messages again.
+	   don't reuse the segment IDs in case some old files were left. */
+	fts_inverted_index_reset(index);
+	index->hdr.next_segment_id = next_segment_id;
+	(void)fts_inverted_index_write_list(index);
+	fts_inverted_index_close_unused(index, FALSE);
+}
+
+static void fts_inverted_index_set_corrupted(struct fts_inverted_index *index)
+{
+	const struct fts_inverted_list_segment *seg;
+	struct file_lock *lock;
+	uint32_t id = index->corrupted_segment_id;
+	int lock_fd;
+
+	index->corrupted_segment_id = 0;
+	i_error("fts-inverted: Corrupted segment %s, rebuilding index",
+		fts_inverted_index_segment_path(index, id));
+
+	if ((lock_fd = fts_inverted_index_lock(index, &lock)) == -1)
+		return;
+	if (fts_inverted_index_read_list(index, TRUE) == 0) {
+		/* delete the index unless another process already
+		   replaced the segment */
+		array_foreach(&index->segments, seg) {
+			if (seg->id == id) {
+				fts_inverted_index_delete_locked(index);
+				break;
+			}
+		}
+	}
+	fts_inverted_index_unlock(&lock, &lock_fd);
+}
+
+int fts_inverted_index_lookup(struct fts_inverted_index *index,
+			      const char *term, bool prefix,
+			      ARRAY_TYPE(seq_range) *uids)
+{
+	ARRAY_TYPE(seq_range) term_uids;
+	int ret;
+
+	if (!index->list_read) {
+		if (fts_inverted_index_read_list(index, FALSE) < 0)
+			return -1;
+	}
+	if (index->hdr.uid_validity != index->set.uid_validity)
+		return 0;
+
+	i_array_init(&term_uids, 64);
+	ret = fts_inverted_index_lookup_segments(index, term, prefix,
+						 &term_uids);
+	if (ret == 0) {
+		/* a segment was just merged away, try again with the
+		   latest list */
+		array_clear(&term_uids);
+		if (fts_inverted_index_read_list(index, TRUE) < 0)
+			ret = -1;
+		else {
+			ret = fts_inverted_index_lookup_segments(index, term,
+						prefix, &term_uids);
+			if (ret == 0) {
+				i_error("fts-inverted: Segments of %s keep "
+					"disappearing", index->path);
+				ret = -1;
+			}
+		}
+	}
+	if (ret > 0) {
+		seq_range_array_remove_seq_range(&term_uids, &index->expunges);
+		seq_range_array_merge(uids, &term_uids);
+	} else if (index->corrupted_segment_id != 0) T_BEGIN {
+		fts_inverted_index_set_corrupted(index);
+	} T_END;
+	array_free(&term_uids);
+	return ret < 0 ? -1 : 0;
+}
+
+static int uint32_cmp(const uint32_t *u1, const uint32_t *u2)
+{
+	return *u1 < *u2 ? -1 :
+		(*u1 > *u2 ? 1 : 0);
+}
+
+static void uids_sort_unique(ARRAY_TYPE(uint32_t) *uids)
+{
+	uint32_t *data;
+	unsigned int i, j, count;
+
+	array_sort(uids, uint32_cmp);
+	data = array_get_modifiable(uids, &count);
+	for (i = j = 1; i < count; i++) {
+		if (data[i] != data[j-1])
+			data[j++] = data[i];
+	}
+	if (count > 0)
+		array_delete(uids, j, count - j);
+}
+
+static void
+uids_remove_expunged(ARRAY_TYPE(uint32_t) *uids,
+		     const ARRAY_TYPE(seq_range) *expunges)
+{
+	uint32_t *data;
+	unsigned int i, j, count;
+
+	if (array_count(expunges) == 0)
+		return;
+
+	data = array_get_modifiable(uids, &count);
+	for (i = j = 0; i < count; i++) {
+		if (!seq_range_exists(expunges, data[i]))
+			data[j++] = data[i];
+	}
+	array_delete(uids, j, count - j);
+}
+
+static int
+fts_inverted_index_write_segment_file(struct fts_inverted_index *index,
+				      uint32_t id, int fd,
+				      const char *temp_path, uint32_t *size_r)
+{
+	const char *path = fts_inverted_index_segment_path(index, id);
+	struct stat st;
+
+	if (fstat(fd, &st) < 0) {
+		i_error("fstat(%s) failed: %m", temp_path);
+		return -1;
+	}
+	if (st.st_size > (off_t)(uint32_t)-1) {
+		i_error("fts-inverted: Segment %s is too large", temp_path);
+		return -1;
+	}
+	if (index->set.fsync_mode != FSYNC_MODE_NEVER && fdatasync(fd) < 0) {
+		i_error("fdatasync(%s) failed: %m", temp_path);
+		return -1;
+	}
+	if (rename(temp_path, path) < 0) {
+		i_error("rename(%s, %s) failed: %m", temp_path, path);
+		return -1;
+	}
+	*size_r = st.st_size;
+	return 0;
+}
+
+static bool
+fts_inverted_merge_input_next(struct fts_inverted_merge_input *input)
+{
+	if (input->idx == input->count) {
+		input->term = NULL;
+		return TRUE;
+	}
+	return fts_inverted_segment_get_term(input->seg, input->idx++,
+					     &input->term, &input->rec) == 0;
+}
+
+static int
+fts_inverted_index_merge_write(struct fts_inverted_index *index,
+			       struct fts_inverted_merge_input *inputs,
+			       unsigned int inputs_count,
+			       struct fts_inverted_segment_writer *writer)
+{
+	ARRAY_TYPE(uint32_t) uids;
+	const char *min_term;
+	unsigned int i, contributors;
+	int ret = 0;
+
+	for (i = 0; i < inputs_count; i++) {
+		if (!fts_inverted_merge_input_next(&inputs[i]))
+			return -1;
+	}
+
+	i_array_init(&uids, 1024);
+	for (;;) {
+		min_term = NULL;
+		for (i = 0; i < inputs_count; i++) {
+			if (inputs[i].term != NULL &&
+			    (min_term == NULL ||
+			     strcmp(inputs[i].term, min_term) < 0))
+				min_term = inputs[i].term;
+		}
+		if (min_term == NULL)
+			break;
+
+		array_clear(&uids);
+		contributors = 0;
+		for (i = 0; i < inputs_count; i++) {
+			if (inputs[i].term == NULL ||
+			    strcmp(inputs[i].term, min_term) != 0)
+				continue;
+			if (fts_inverted_segment_get_uids(inputs[i].seg,
+					inputs[i].rec, &uids) < 0) {
+				ret = -1;
+				break;
+			}
+			contributors++;
+			/* the term points to the mapped segment, so it stays
+			   valid after moving to the next term */
+			if (!fts_inverted_merge_input_next(&inputs[i])) {
+				ret = -1;
+				break;
+			}
+		}
+		if (ret < 0)
+			break;
+
+		if (contributors > 1)
+			uids_sort_unique(&uids);
+		uids_remove_expunged(&uids, &index->expunges);
+		if (array_count(&uids) > 0) {
+			fts_inverted_segment_write_term(writer, min_term,
+				array_idx(&uids, 0), array_count(&uids));
+		}
+	}
+	array_free(&uids);
+	return ret;
+}
+
+static int
+fts_inverted_index_merge(struct fts_inverted_index *index,
+			 unsigned int first_idx, unsigned int count)
+{
+	struct fts_inverted_merge_input *inputs;
+	struct fts_inverted_segment_writer *writer;
+	struct fts_inverted_list_segment new_seg, *old_segs;
+	const char *temp_path, *error;
+	unsigned int i, segs_count;
+	bool all, corrupted = FALSE;
+	int fd, ret;
+
+	old_segs = array_get_modifiable(&index->segments, &segs_count);
+	i_assert(first_idx + count <= segs_count && count > 0);
+	all = first_idx == 0 && count == segs_count;
+
+	inputs = t_new(struct fts_inverted_merge_input, count);
+	for (i = 0; i < count; i++) {
+		ret = fts_inverted_index_get_segment(index,
+				old_segs[first_idx + i].id, &inputs[i].seg);
+		if (ret == 0) {
+			i_error("fts-inverted: Segment %s was lost",
+				fts_inverted_index_segment_path(index,
+					old_segs[first_idx + i].id));
+		}
+		if (ret < 0 && index->corrupted_segment_id != 0) {
+			i_error("fts-inverted: Corrupted segment %s, "
+				"rebuilding index",
+				fts_inverted_index_segment_path(index,
+					index->corrupted_segment_id));
+			index->corrupted_segment_id = 0;
+			fts_inverted_index_delete_locked(index);
+			return 0;
+		}
+		if (ret <= 0)
+			return -1;
+		inputs[i].count =
+			fts_inverted_segment_get_terms_count(inputs[i].seg);
+	}
+
+	memset(&new_seg, 0, sizeof(new_seg));
+	new_seg.id = index->hdr.next_segment_id++;
+	temp_path = t_strconcat(fts_inverted_index_segment_path(index,
+				new_seg.id), FTS_INVERTED_TEMP_SUFFIX, NULL);
+	fd = fts_inverted_index_create_file(index, temp_path);
+	if (fd == -1)
+		return -1;
+
+	ret = 0;
+	writer = fts_inverted_segment_writer_init(fd, temp_path,
+						  index->hdr.uid_validity);
+	if (fts_inverted_index_merge_write(index, inputs, count, writer) < 0) {
+		i_error("fts-inverted: Corrupted segment in %s, "
+			"rebuilding index", index->path);
+		corrupted = TRUE;
+		ret = -1;
+	}
+	if (fts_inverted_segment_writer_finish(&writer, &error) < 0) {
+		i_error("fts-inverted: %s", error);
+		ret = -1;
+	}
+	if (ret == 0) {
+		ret = fts_inverted_index_write_segment_file(index, new_seg.id,
+				fd, temp_path, &new_seg.size);
+	}
+	i_close_fd(&fd);
+	if (ret < 0) {
+		i_unlink_if_exists(temp_path);
+		if (!corrupted)
+			return -1;
+		fts_inverted_index_delete_locked(index);
+		return 0;
+	}
+
+	/* replace the merged segments with the new one */
+	old_segs = t_new(struct fts_inverted_list_segment, count);
+	memcpy(old_segs, array_idx(&index->segments, first_idx),
+	       count * sizeof(*old_segs));
+	array_delete(&index->segments, first_idx, count);
+	array_insert(&index->segments, first_idx, &new_seg, 1);
+	if (all)
+		array_clear(&index->expunges);
+	if (fts_inverted_index_write_list(index) < 0)
+		return -1;
+
+	fts_inverted_index_close_unused(index, FALSE);
+	for (i = 0; i < count; i++) {
+		i_unlink_if_exists(fts_inverted_index_segment_path(index,
+							old_segs[i].id));
+	}
+	return 0;
+}
+
+static unsigned int fts_inverted_segment_level(uint32_t size)
+{
+	unsigned int level = 0;
+
+	size /= FTS_INVERTED_MERGE_MIN_SIZE;
+	while (size >= FTS_INVERTED_MERGE_FACTOR) {
+		size /= FTS_INVERTED_MERGE_FACTOR;
+		level++;
+	}
+	return level;
+}
+
+static int fts_inverted_index_merge_newest(struct fts_inverted_index *index)
+{
+	const struct fts_inverted_list_segment *segs;
+	unsigned int i, count, level;
+
+	for (;;) {
+		segs = array_get(&index->segments, &count);
+		if (count >= FTS_INVERTED_MAX_SEGMENTS)
+			return fts_inverted_index_merge(index, 0, count);
+		if (count < FTS_INVERTED_MERGE_FACTOR)
+			return 0;
+
+		/* merge the newest segments that are on the same or lower
+		   level as the newest one */
+		level = fts_inverted_segment_level(segs[count-1].size);
+		for (i = count - 1; i > 0; i--) {
+			if (fts_inverted_segment_level(segs[i-1].size) > level)
+				break;
+		}
+		if (count - i < FTS_INVERTED_MERGE_FACTOR)
+			return 0;
+		if (fts_inverted_index_merge(index, i, count - i) < 0)
+			return -1;
+	}
+}
+
+static int
+fts_inverted_index_write_terms(struct fts_inverted_index_update *update,
+			       struct fts_inverted_list_segment *seg_r)
+{
+	struct fts_inverted_index *index = update->index;
+	struct fts_inverted_segment_writer *writer;
+	struct hash_iterate_context *iter;
+	struct fts_inverted_build_term *bterm;
+	ARRAY_TYPE(const_string) terms;
+	const char *const *termp, *temp_path, *error;
+	char *key;
+	int fd, ret = 0;
+
+	/* sort the terms */
+	i_array_init(&terms, hash_table_count(update->terms));
+	iter = hash_table_iterate_init(update->terms);
+	while (hash_table_iterate(iter, update->terms, &key, &bterm)) {
+		const char *term = key;
+		array_append(&terms, &term, 1);
+	}
+	hash_table_iterate_deinit(&iter);
+	array_sort(&terms, i_strcmp_p);
+
+	memset(seg_r, 0, sizeof(*seg_r));
+	seg_r->id = index->hdr.next_segment_id++;
+	temp_path = t_strconcat(fts_inverted_index_segment_path(index,
+				seg_r->id), FTS_INVERTED_TEMP_SUFFIX, NULL);
+	fd = fts_inverted_index_create_file(index, temp_path);
+	if (fd == -1) {
+		array_free(&terms);
+		return -1;
+	}
+
+	writer = fts_inverted_segment_writer_init(fd, temp_path,
+						  index->hdr.uid_validity);
+	array_foreach(&terms, termp) {
+		bterm = hash_table_lookup(update->terms, *termp);
+		if (bterm->unsorted)
+			uids_sort_unique(&bterm->uids);
+		fts_inverted_segment_write_term(writer, *termp,
+						array_idx(&bterm->uids, 0),
+						array_count(&bterm->uids));
+	}
+	if (fts_inverted_segment_writer_finish(&writer, &error) < 0) {
+		i_error("fts-inverted: %s", error);
+		ret = -1;
+	}
+	if (ret == 0) {
+		ret = fts_inverted_index_write_segment_file(index, seg_r->id,
+				fd, temp_path, &seg_r->size);
+	}
+	i_close_fd(&fd);
+	if (ret < 0)
+		i_unlink_if_exists(temp_path);
+	array_free(&terms);
+	return ret;
+}
+
+static int
+fts_inverted_index_update_write(struct fts_inverted_index_update *update,
+				bool *need_optimize_r)
+{
+	struct fts_inverted_index *index = update->index;
+	struct fts_inverted_list_segment new_seg, *seg;
+	struct file_lock *lock;
+	bool have_terms = hash_table_count(update->terms) > 0;
+	int lock_fd, ret = 0;
+
+	*need_optimize_r = FALSE;
+	if (!have_terms && array_count(&update->expunges) == 0 &&
+	    update->last_uid <= index->hdr.last_uid)
+		return 0;
+
+	if ((lock_fd = fts_inverted_index_lock(index, &lock)) == -1)
+		return -1;
+	if (fts_inverted_index_read_list(index, TRUE) < 0) {
+		fts_inverted_index_unlock(&lock, &lock_fd);
+		return -1;
+	}
+	if (index->hdr.uid_validity != index->set.uid_validity) {
+		/* the mailbox was recreated, drop the old index */
+		array_foreach_modifiable(&index->segments, seg) {
+			i_unlink_if_exists(fts_inverted_index_segment_path(
+				index, seg->id));
+		}
+		fts_inverted_index_reset(index);
+	}
+
+	if (have_terms) {
+		if (fts_inverted_index_write_terms(update, &new_seg) < 0)
+			ret = -1;
+		else
+			array_append(&index->segments, &new_seg, 1);
+	}
+	if (ret == 0) {
+		if (index->hdr.last_uid < update->last_uid)
+			index->hdr.last_uid = update->last_uid;
+		seq_range_array_merge(&index->expunges, &update->expunges);
+		ret = fts_inverted_index_write_list(index);
+	}
+	if (ret == 0 && have_terms) {
+		/* we're already doing the heavy work of indexing,
+		   so merge immediately */
+		ret = fts_inverted_index_merge_newest(index);
+	} else if (ret == 0 && array_count(&update->expunges) > 0) {
+		*need_optimize_r = array_count(&index->segments) > 0 &&
+			seq_range_count(&index->expunges) >=
+			FTS_INVERTED_OPTIMIZE_EXPUNGE_COUNT;
+	}
+	fts_inverted_index_unlock(&lock, &lock_fd);
+
+	hash_table_clear(update->terms, TRUE);
+	p_clear(update->pool);
+	array_clear(&update->expunges);
+	return ret;
+}
+
+struct fts_inverted_index_update *
+fts_inverted_index_update_init(struct fts_inverted_index *index)
+{
+	struct fts_inverted_index_update *update;
+
+	update = i_new(struct fts_inverted_index_update, 1);
+	update->index = index;
+	update->pool = pool_alloconly_create("fts inverted update", 1024*64);
+	hash_table_create(&update->terms, default_pool, 1024, str_hash, strcmp);
+	i_array_init(&update->expunges, 32);
+	return update;
+}
+
+void fts_inverted_index_update_add(struct fts_inverted_index_update *update,
+				   const char *term, uint32_t uid)
+{
+	struct fts_inverted_build_term *bterm;
+	const uint32_t *last_uidp;
+	char *key;
+
+	if (!hash_table_lookup_full(update->terms, term, &key, &bterm)) {
+		key = p_strdup(update->pool, term);
+		bterm = p_new(update->pool, struct fts_inverted_build_term, 1);
+		p_array_init(&bterm->uids, update->pool, 4);
+		hash_table_insert(update->terms, key, bterm);
+	} else {
+		last_uidp = array_idx(&bterm->uids,
+				      array_count(&bterm->uids) - 1);
+		if (*last_uidp == uid)
+			return;
+		if (*last_uidp > uid)
+			bterm->unsorted = TRUE;
+	}
+	array_append(&bterm->uids, &uid, 1);
+}
+
+void fts_inverted_index_update_set_last_uid(struct fts_inverted_index_update *update,
+					    uint32_t last_uid)
+{
+	bool need_optimize;
+
+	if (update->last_uid < last_uid)
+		update->last_uid = last_uid;
+
+	if (pool_alloconly_get_total_used_size(update->pool) >=
+	    FTS_INVERTED_BUILD_MAX_MEMORY) {
+		/* the messages so far are complete, write them out */
+		if (fts_inverted_index_update_write(update, &need_optimize) < 0)
+			update->failed = TRUE;
+	}
+}
+
+void fts_inverted_index_update_expunge(struct fts_inverted_index_update *update,
+				       uint32_t uid)
+{
+	seq_range_array_add(&update->expunges, uid);
+}
+
+int fts_inverted_index_update_deinit(struct fts_inverted_index_update **_update,
+				     bool *need_optimize_r)
+{
+	struct fts_inverted_index_update *update = *_update;
+	int ret = update->failed ? -1 : 0;
+
+	*_update = NULL;
+	*need_optimize_r = FALSE;
+	if (ret == 0) {
+		T_BEGIN {
+			ret = fts_inverted_index_update_write(update,
+							      need_optimize_r);
+		} T_END;
+	}
+
+	hash_table_destroy(&update->terms);
+	pool_unref(&update->pool);
+	array_free(&update->expunges);
+	i_free(update);
+	return ret;
+}
+
+int fts_inverted_index_optimize(struct fts_inverted_index *index)
+{
+	struct file_lock *lock;
+	unsigned int count;
+	int lock_fd, ret = 0;
+
+	if ((lock_fd = fts_inverted_index_lock(index, &lock)) == -1)
+		return -1;
+	if (fts_inverted_index_read_list(index, TRUE) < 0)
+		ret = -1;
+	else if (index->hdr.uid_validity == index->set.uid_validity) {
+		count = array_count(&index->segments);
+		if (count > 1 ||
+		    (count == 1 && array_count(&index->expunges) > 0)) T_BEGIN {
+			ret = fts_inverted_index_merge(index, 0, count);
+		} T_END;
+	}
+	fts_inverted_index_unlock(&lock, &lock_fd);
+	return ret;
+}
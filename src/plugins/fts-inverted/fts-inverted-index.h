@@ -0,0 +1,62 @@
+#ifndef FTS_INVERTED_INDEX_H
+#define FTS_INVERTED_INDEX_H
+
+#include "file-lock.h"
+#include "fsync-mode.h"
+#include "seq-range-array.h"
+
+struct fts_inverted_index_settings {
+	uint32_t uid_validity;
+	enum file_lock_method lock_method;
+	unsigned int lock_timeout_secs;
+	enum fsync_mode fsync_mode;
+	bool mmap_disable;
+
+	mode_t mode;
+	gid_t gid;
+	const char *gid_origin;
+};
+
+/* The index consists of a list file at path and immutable segment files
+   next to it. */
+struct fts_inverted_index *
+fts_inverted_index_init(const char *path,
+			const struct fts_inverted_index_settings *set);
+void fts_inverted_index_deinit(struct fts_inverted_index **index);
+
+/* Re-read the list of segments if it has changed. Returns 0 if ok,
+   -1 if error. */
+int fts_inverted_index_refresh(struct fts_inverted_index *index);
+/* Returns the highest UID that has been indexed. */
+uint32_t fts_inverted_index_get_last_uid(struct fts_inverted_index *index);
+
+/* Add the UIDs of the messages containing the term to uids. If prefix=TRUE,
+   all the terms beginning with the given term are matched. Returns 0 if ok,
+   -1 if error. If a corrupted segment is found, the index is deleted so
+   that it gets rebuilt by the next update, and -1 is returned. */
+int fts_inverted_index_lookup(struct fts_inverted_index *index,
+			      const char *term, bool prefix,
+			      ARRAY_TYPE(seq_range) *uids);
+
+/* Start adding new messages and expunges. The changes are written as a new
+   segment when the update is finished, or when too much memory is used. */
+struct fts_inverted_index_update *
+fts_inverted_index_update_init(struct fts_inverted_index *index);
+void fts_inverted_index_update_add(struct fts_inverted_index_update *update,
+				   const char *term, uint32_t uid);
+/* All the terms of the messages up to last_uid have been added. */
+void fts_inverted_index_update_set_last_uid(struct fts_inverted_index_update *update,
+					    uint32_t last_uid);
+void fts_inverted_index_update_expunge(struct fts_inverted_index_update *update,
+				       uint32_t uid);
+/* Write the changes. need_optimize_r is set to TRUE if the update contained
+   only expunges and the segments should be merged. The merging is left to
+   the caller, so it can be done in the background. Returns 0 if ok,
+   -1 if error. */
+int fts_inverted_index_update_deinit(struct fts_inverted_index_update **update,
+				     bool *need_optimize_r);
+
+/* Merge all the segments into one and drop the expunged messages. */
+int fts_inverted_index_optimize(struct fts_inverted_index *index);
+
+#endif
@@ -0,0 +1,18 @@
+/* Copyright (c) 2016 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "fts-inverted-plugin.h"
+
+const char *fts_inverted_plugin_version = DOVECOT_ABI_VERSION;
+
+void fts_inverted_plugin_init(struct module *module ATTR_UNUSED)
+{
+	fts_backend_register(&fts_backend_inverted);
+}
+
+void fts_inverted_plugin_deinit(void)
+{
+	fts_backend_unregister(fts_backend_inverted.name);
+}
+
+const char *fts_inverted_plugin_dependencies[] = { "fts", NULL };
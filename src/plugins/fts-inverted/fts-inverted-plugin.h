@@ -0,0 +1,14 @@
+#ifndef FTS_INVERTED_PLUGIN_H
+#define FTS_INVERTED_PLUGIN_H
+
+#include "fts-api-private.h"
+
+struct module;
+
+extern const char *fts_inverted_plugin_dependencies[];
+extern struct fts_backend fts_backend_inverted;
+
+void fts_inverted_plugin_init(struct module *module);
+void fts_inverted_plugin_deinit(void);
+
+#endif
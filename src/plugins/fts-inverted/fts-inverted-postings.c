@@ -0,0 +1,139 @@
+/* Copyright (c) 2016 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "buffer.h"
+#include "numpack.h"
+#include "fts-inverted-postings.h"
+
+#define BLOCK_COUNT FTS_INVERTED_POSTINGS_BLOCK_COUNT
+#define LANES FTS_INVERTED_POSTINGS_LANES
+#define LANE_VALUES (BLOCK_COUNT / LANES)
+
+static void
+postings_pack_block(buffer_t *dest, const uint32_t deltas[BLOCK_COUNT])
+{
+	uint32_t words[LANES * 32], max = 0;
+	unsigned char *p;
+	unsigned int i, lane, bits, pos, w, shift;
+
+	for (i = 0; i < BLOCK_COUNT; i++) {
+		if (max < deltas[i])
+			max = deltas[i];
+	}
+	bits = bits_required32(max);
+	buffer_append_c(dest, bits);
+	if (bits == 0)
+		return;
+
+	/* value i goes to lane i % LANES. each lane is a stream of
+	   bits*LANE_VALUES bits, and the lanes' words are interleaved. */
+	memset(words, 0, LANES * bits * sizeof(uint32_t));
+	for (i = 0; i < BLOCK_COUNT; i++) {
+		lane = i % LANES;
+		pos = (i / LANES) * bits;
+		w = pos / 32;
+		shift = pos % 32;
+		words[w * LANES + lane] |= deltas[i] << shift;
+		if (shift + bits > 32) {
+			words[(w + 1) * LANES + lane] |=
+				deltas[i] >> (32 - shift);
+		}
+	}
+
+	p = buffer_append_space_unsafe(dest, LANES * bits * 4);
+	for (i = 0; i < LANES * bits; i++) {
+		p[i*4] = words[i] & 0xff;
+		p[i*4 + 1] = (words[i] >> 8) & 0xff;
+		p[i*4 + 2] = (words[i] >> 16) & 0xff;
+		p[i*4 + 3] = words[i] >> 24;
+	}
+}
+
+static int
+postings_unpack_block(const unsigned char **_p, const unsigned char *end,
+		      uint32_t deltas[BLOCK_COUNT])
+{
+	const unsigned char *p = *_p;
+	uint32_t words[LANES * 32], mask, value;
+	unsigned int i, lane, bits, pos, w, shift;
+
+	if (p == end)
+		return -1;
+	bits = *p++;
+	if (bits > 32 || (size_t)(end - p) < LANES * bits * 4)
+		return -1;
+	if (bits == 0) {
+		memset(deltas, 0, BLOCK_COUNT * sizeof(*deltas));
+		*_p = p;
+		return 0;
+	}
+
+	for (i = 0; i < LANES * bits; i++) {
+		words[i] = p[i*4] | (p[i*4 + 1] << 8) | (p[i*4 + 2] << 16) |
+			((uint32_t)p[i*4 + 3] << 24);
+	}
+	*_p = p + LANES * bits * 4;
+
+	mask = bits == 32 ? (uint32_t)-1 : (1U << bits) - 1;
+	for (i = 0; i < BLOCK_COUNT; i++) {
+		lane = i % LANES;
+		pos = (i / LANES) * bits;
+		w = pos / 32;
+		shift = pos % 32;
+		value = words[w * LANES + lane] >> shift;
+		if (shift + bits > 32)
+			value |= words[(w + 1) * LANES + lane] << (32 - shift);
+		deltas[i] = value & mask;
+	}
+	return 0;
+}
+
+void fts_inverted_postings_encode(buffer_t *dest, const uint32_t *uids,
+				  unsigned int count)
+{
+	uint32_t deltas[BLOCK_COUNT], prev_uid = 0;
+	unsigned int i, j;
+
+	for (i = 0; i + BLOCK_COUNT <= count; i += BLOCK_COUNT) {
+		for (j = 0; j < BLOCK_COUNT; j++) {
+			i_assert(uids[i+j] > prev_uid);
+			deltas[j] = uids[i+j] - prev_uid;
+			prev_uid = uids[i+j];
+		}
+		postings_pack_block(dest, deltas);
+	}
+	for (; i < count; i++) {
+		i_assert(uids[i] > prev_uid);
+		numpack_encode(dest, uids[i] - prev_uid);
+		prev_uid = uids[i];
+	}
+}
+
+int fts_inverted_postings_decode(const unsigned char *data, size_t size,
+				 unsigned int count,
+				 ARRAY_TYPE(uint32_t) *uids)
+{
+	const unsigned char *p = data, *end = data + size;
+	uint32_t deltas[BLOCK_COUNT], uid = 0, delta;
+	unsigned int i, j;
+
+	for (i = 0; i + BLOCK_COUNT <= count; i += BLOCK_COUNT) {
+		if (postings_unpack_block(&p, end, deltas) < 0)
+			return -1;
+		for (j = 0; j < BLOCK_COUNT; j++) {
+			if (deltas[j] == 0 || uid + deltas[j] < uid)
+				return -1;
+			uid += deltas[j];
+			array_append(uids, &uid, 1);
+		}
+	}
+	for (; i < count; i++) {
+		if (numpack_decode32(&p, end, &delta) < 0 ||
+		    delta == 0 || uid + delta < uid)
+			return -1;
+		uid += delta;
+		array_append(uids, &uid, 1);
+	}
+	return p == end ? 0 : -1;
+}
@@ -0,0 +1,22 @@
+#ifndef FTS_INVERTED_POSTINGS_H
+#define FTS_INVERTED_POSTINGS_H
+
+/* Posting lists are stored as deltas between the ascending UIDs. Each full
+   block of FTS_INVERTED_POSTINGS_BLOCK_COUNT deltas is bit-packed using the
+   bit width of its largest delta. The values are interleaved into
+   FTS_INVERTED_POSTINGS_LANES lanes of little-endian 32bit words, so that
+   all the lanes can be packed and unpacked in parallel. The deltas in the
+   final partial block are written with numpack. */
+#define FTS_INVERTED_POSTINGS_BLOCK_COUNT 128
+#define FTS_INVERTED_POSTINGS_LANES 4
+
+/* Append the encoded UIDs to dest. The UIDs must be strictly ascending. */
+void fts_inverted_postings_encode(buffer_t *dest, const uint32_t *uids,
+				  unsigned int count);
+/* Decode count UIDs from data and append them to uids. Returns 0 if ok,
+   -1 if the data is corrupted. */
+int fts_inverted_postings_decode(const unsigned char *data, size_t size,
+				 unsigned int count,
+				 ARRAY_TYPE(uint32_t) *uids);
+
+#endif
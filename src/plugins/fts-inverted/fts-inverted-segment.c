@@ -0,0 +1,335 @@
+/* Copyright (c) 2016 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "buffer.h"
+#include "read-full.h"
+#include "mmap-util.h"
+#include "ostream.h"
+#include "fts-inverted-postings.h"
+#include "fts-inverted-segment.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+
+struct fts_inverted_segment_writer {
+	struct ostream *output;
+	char *path;
+	uint32_t uid_validity;
+
+	uoff_t postings_offset;
+	buffer_t *postings_buf;
+	buffer_t *terms;
+	ARRAY_TYPE(uint32_t) term_offsets;
+#ifdef DEBUG
+	char *prev_term;
+#endif
+};
+
+struct fts_inverted_segment {
+	char *path;
+
+	void *mmap_base;
+	void *data;
+	size_t size;
+
+	const struct fts_inverted_segment_header *hdr;
+	const unsigned char *terms;
+	size_t terms_size;
+	const uint32_t *term_offsets;
+};
+
+struct fts_inverted_segment_writer *
+fts_inverted_segment_writer_init(int fd, const char *path,
+				 uint32_t uid_validity)
+{
+	struct fts_inverted_segment_writer *writer;
+	struct fts_inverted_segment_header hdr;
+
+	writer = i_new(struct fts_inverted_segment_writer, 1);
+	writer->path = i_strdup(path);
+	writer->uid_validity = uid_validity;
+	writer->output = o_stream_create_fd_file(fd, 0, FALSE);
+	o_stream_cork(writer->output);
+	writer->postings_buf = buffer_create_dynamic(default_pool, 1024);
+	writer->terms = buffer_create_dynamic(default_pool, 1024*64);
+	i_array_init(&writer->term_offsets, 1024);
+
+	/* the header is rewritten at the end */
+	memset(&hdr, 0, sizeof(hdr));
+	o_stream_nsend(writer->output, &hdr, sizeof(hdr));
+	writer->postings_offset = sizeof(hdr);
+	return writer;
+}
+
+void fts_inverted_segment_write_term(struct fts_inverted_segment_writer *writer,
+				     const char *term, const uint32_t *uids,
+				     unsigned int count)
+{
+	struct fts_inverted_term rec;
+	uint32_t offset;
+	size_t len;
+
+	i_assert(count > 0);
+#ifdef DEBUG
+	i_assert(writer->prev_term == NULL ||
+		 strcmp(writer->prev_term, term) < 0);
+	i_free(writer->prev_term);
+	writer->prev_term = i_strdup(term);
+#endif
+
+	buffer_set_used_size(writer->postings_buf, 0);
+	fts_inverted_postings_encode(writer->postings_buf, uids, count);
+
+	memset(&rec, 0, sizeof(rec));
+	rec.postings_offset = writer->postings_offset;
+	rec.postings_size = writer->postings_buf->used;
+	rec.uids_count = count;
+	o_stream_nsend(writer->output, writer->postings_buf->data,
+		       writer->postings_buf->used);
+	writer->postings_offset += writer->postings_buf->used;
+
+	offset = writer->terms->used;
+	array_append(&writer->term_offsets, &offset, 1);
+	buffer_append(writer->terms, &rec, sizeof(rec));
+	len = strlen(term) + 1;
+	buffer_append(writer->terms, term, len);
+	/* pad to 32bit alignment */
+	buffer_append_zero(writer->terms, (4 - writer->terms->used % 4) % 4);
+}
+
+int fts_inverted_segment_writer_finish(struct fts_inverted_segment_writer **_writer,
+				       const char **error_r)
+{
+	struct fts_inverted_segment_writer *writer = *_writer;
+	struct fts_inverted_segment_header hdr;
+	uoff_t terms_offset;
+	int ret = 0;
+
+	*_writer = NULL;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.version = FTS_INVERTED_SEGMENT_VERSION;
+	hdr.uid_validity = writer->uid_validity;
+	hdr.terms_count = array_count(&writer->term_offsets);
+
+	/* align the term records */
+	terms_offset = (writer->postings_offset + 3) & ~3ULL;
+	buffer_set_used_size(writer->postings_buf, 0);
+	buffer_append_zero(writer->postings_buf,
+			   terms_offset - writer->postings_offset);
+	o_stream_nsend(writer->output, writer->postings_buf->data,
+		       writer->postings_buf->used);
+
+	if (terms_offset + writer->terms->used +
+	    hdr.terms_count * sizeof(uint32_t) > (uint32_t)-1) {
+		*error_r = t_strdup_printf("Segment %s grew too large",
+					   writer->path);
+		ret = -1;
+	} else {
+		hdr.terms_offset = terms_offset;
+		hdr.term_index_offset = terms_offset + writer->terms->used;
+		o_stream_nsend(writer->output, writer->terms->data,
+			       writer->terms->used);
+		if (hdr.terms_count > 0) {
+			o_stream_nsend(writer->output,
+				       array_idx(&writer->term_offsets, 0),
+				       hdr.terms_count * sizeof(uint32_t));
+		}
+		if (o_stream_nfinish(writer->output) < 0 ||
+		    o_stream_pwrite(writer->output, &hdr, sizeof(hdr), 0) < 0) {
+			*error_r = t_strdup_printf("write(%s) failed: %s",
+				writer->path,
+				o_stream_get_error(writer->output));
+			ret = -1;
+		}
+	}
+	o_stream_destroy(&writer->output);
+	buffer_free(&writer->postings_buf);
+	buffer_free(&writer->terms);
+	array_free(&writer->term_offsets);
+#ifdef DEBUG
+	i_free(writer->prev_term);
+#endif
+	i_free(writer->path);
+	i_free(writer);
+	return ret;
+}
+
+static int fts_inverted_segment_map(struct fts_inverted_segment *seg, int fd,
+				    bool mmap_disable, const char **error_r)
+{
+	struct stat st;
+	int ret;
+
+	if (!mmap_disable) {
+		seg->mmap_base = mmap_ro_file(fd, &seg->size);
+		if (seg->mmap_base == MAP_FAILED) {
+			seg->mmap_base = NULL;
+			*error_r = t_strdup_printf("mmap(%s) failed: %m",
+						   seg->path);
+			return -1;
+		}
+		seg->data = seg->mmap_base;
+		return 0;
+	}
+
+	if (fstat(fd, &st) < 0) {
+		*error_r = t_strdup_printf("fstat(%s) failed: %m", seg->path);
+		return -1;
+	}
+	seg->size = st.st_size;
+	seg->data = i_malloc(I_MAX(seg->size, 1));
+	ret = read_full(fd, seg->data, seg->size);
+	if (ret < 0) {
+		*error_r = t_strdup_printf("read(%s) failed: %m", seg->path);
+		return -1;
+	}
+	if (ret == 0) {
+		*error_r = t_strdup_printf("read(%s) failed: "
+					   "Unexpected EOF", seg->path);
+		return -1;
+	}
+	return 0;
+}
+
+static int fts_inverted_segment_check(struct fts_inverted_segment *seg)
+{
+	const struct fts_inverted_segment_header *hdr = seg->data;
+
+	if (seg->size < sizeof(*hdr) || hdr->version !=
+	    FTS_INVERTED_SEGMENT_VERSION)
+		return -1;
+	if (hdr->terms_offset % 4 != 0 || hdr->term_index_offset % 4 != 0 ||
+	    hdr->terms_offset < sizeof(*hdr) ||
+	    hdr->term_index_offset < hdr->terms_offset ||
+	    hdr->term_index_offset > seg->size ||
+	    (seg->size - hdr->term_index_offset) / sizeof(uint32_t) !=
+	    hdr->terms_count)
+		return -1;
+
+	seg->hdr = hdr;
+	seg->terms = CONST_PTR_OFFSET(seg->data, hdr->terms_offset);
+	seg->terms_size = hdr->term_index_offset - hdr->terms_offset;
+	seg->term_offsets = CONST_PTR_OFFSET(seg->data,
+					     hdr->term_index_offset);
+	return 0;
+}
+
+int fts_inverted_segment_open(const char *path, bool mmap_disable,
+			      struct fts_inverted_segment **seg_r,
+			      bool *corrupted_r, const char **error_r)
+{
+	struct fts_inverted_segment *seg;
+	int fd, ret;
+
+	*corrupted_r = FALSE;
+	fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		if (errno == ENOENT)
+			return 0;
+		*error_r = t_strdup_printf("open(%s) failed: %m", path);
+		return -1;
+	}
+
+	seg = i_new(struct fts_inverted_segment, 1);
+	seg->path = i_strdup(path);
+	ret = fts_inverted_segment_map(seg, fd, mmap_disable, error_r);
+	i_close_fd(&fd);
+	if (ret == 0 && fts_inverted_segment_check(seg) < 0) {
+		*error_r = t_strdup_printf("Corrupted segment %s", path);
+		*corrupted_r = TRUE;
+		ret = -1;
+	}
+	if (ret < 0) {
+		fts_inverted_segment_close(&seg);
+		return -1;
+	}
+	*seg_r = seg;
+	return 1;
+}
+
+void fts_inverted_segment_close(struct fts_inverted_segment **_seg)
+{
+	struct fts_inverted_segment *seg = *_seg;
+
+	*_seg = NULL;
+	if (seg->mmap_base != NULL) {
+		if (munmap(seg->mmap_base, seg->size) < 0)
+			i_error("munmap(%s) failed: %m", seg->path);
+	} else {
+		i_free(seg->data);
+	}
+	i_free(seg->path);
+	i_free(seg);
+}
+
+const char *fts_inverted_segment_get_path(struct fts_inverted_segment *seg)
+{
+	return seg->path;
+}
+
+unsigned int
+fts_inverted_segment_get_terms_count(struct fts_inverted_segment *seg)
+{
+	return seg->hdr->terms_count;
+}
+
+int fts_inverted_segment_get_term(struct fts_inverted_segment *seg,
+				  unsigned int idx, const char **term_r,
+				  const struct fts_inverted_term **rec_r)
+{
+	const struct fts_inverted_term *rec;
+	const char *term;
+	uint32_t offset;
+
+	i_assert(idx < seg->hdr->terms_count);
+
+	offset = seg->term_offsets[idx];
+	if (offset % 4 != 0 || offset + sizeof(*rec) >= seg->terms_size)
+		return -1;
+	rec = CONST_PTR_OFFSET(seg->terms, offset);
+	term = CONST_PTR_OFFSET(rec, sizeof(*rec));
+	if (memchr(term, '\0', seg->terms_size - offset - sizeof(*rec)) == NULL)
+		return -1;
+	if (rec->postings_offset < sizeof(*seg->hdr) ||
+	    rec->postings_offset > seg->hdr->terms_offset ||
+	    rec->postings_size > seg->hdr->terms_offset - rec->postings_offset)
+		return -1;
+
+	*term_r = term;
+	*rec_r = rec;
+	return 0;
+}
+
+int fts_inverted_segment_find(struct fts_inverted_segment *seg,
+			      const char *term, unsigned int *idx_r)
+{
+	const struct fts_inverted_term *rec;
+	const char *cur_term;
+	unsigned int idx, left_idx, right_idx;
+	int ret;
+
+	left_idx = 0; right_idx = seg->hdr->terms_count;
+	while (left_idx < right_idx) {
+		idx = (left_idx + right_idx) / 2;
+		if (fts_inverted_segment_get_term(seg, idx, &cur_term, &rec) < 0)
+			return -1;
+		ret = strcmp(cur_term, term);
+		if (ret < 0)
+			left_idx = idx + 1;
+		else
+			right_idx = idx;
+	}
+	*idx_r = left_idx;
+	return 0;
+}
+
+int fts_inverted_segment_get_uids(struct fts_inverted_segment *seg,
+				  const struct fts_inverted_term *rec,
+				  ARRAY_TYPE(uint32_t) *uids)
+{
+	return fts_inverted_postings_decode(
+		CONST_PTR_OFFSET(seg->data, rec->postings_offset),
+		rec->postings_size, rec->uids_count, uids);
+}
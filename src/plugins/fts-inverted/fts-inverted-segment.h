@@ -0,0 +1,72 @@
+#ifndef FTS_INVERTED_SEGMENT_H
+#define FTS_INVERTED_SEGMENT_H
+
+/* A segment is an immutable file containing the posting lists of terms.
+   The file begins with the header, followed by all the posting lists.
+   After them are the term records sorted by the term and finally an array
+   of offsets to the term records, so that the terms can be binary
+   searched. */
+#define FTS_INVERTED_SEGMENT_VERSION 1
+
+struct fts_inverted_segment_header {
+	uint32_t version;
+	uint32_t uid_validity;
+	uint32_t terms_count;
+	/* offset to the first struct fts_inverted_term */
+	uint32_t terms_offset;
+	/* offset to uint32_t term_offsets[terms_count], which are relative
+	   to terms_offset */
+	uint32_t term_index_offset;
+	uint32_t unused;
+};
+
+struct fts_inverted_term {
+	uint32_t postings_offset;
+	uint32_t postings_size;
+	uint32_t uids_count;
+	/* NUL-terminated term follows, padded to 32bit alignment */
+};
+
+struct fts_inverted_segment;
+struct fts_inverted_segment_writer;
+
+/* Start writing a new segment to the given file. */
+struct fts_inverted_segment_writer *
+fts_inverted_segment_writer_init(int fd, const char *path,
+				 uint32_t uid_validity);
+/* Add the next term with its UIDs in strictly ascending order. The terms
+   must be added sorted by strcmp(). */
+void fts_inverted_segment_write_term(struct fts_inverted_segment_writer *writer,
+				     const char *term, const uint32_t *uids,
+				     unsigned int count);
+/* Finish writing the segment. Returns 0 if ok, -1 if writing failed. */
+int fts_inverted_segment_writer_finish(struct fts_inverted_segment_writer **writer,
+				       const char **error_r);
+
+/* Returns 1 if opened, 0 if the segment doesn't exist, -1 if error.
+   corrupted_r is set to TRUE if the error was because the segment's
+   header is broken. */
+int fts_inverted_segment_open(const char *path, bool mmap_disable,
+			      struct fts_inverted_segment **seg_r,
+			      bool *corrupted_r, const char **error_r);
+void fts_inverted_segment_close(struct fts_inverted_segment **seg);
+
+const char *fts_inverted_segment_get_path(struct fts_inverted_segment *seg);
+unsigned int
+fts_inverted_segment_get_terms_count(struct fts_inverted_segment *seg);
+/* Get the term at the given index. Returns 0 if ok, -1 if the segment is
+   corrupted. */
+int fts_inverted_segment_get_term(struct fts_inverted_segment *seg,
+				  unsigned int idx, const char **term_r,
+				  const struct fts_inverted_term **rec_r);
+/* Find the index of the first term that is equal or larger than the given
+   term. Returns 0 if ok, -1 if the segment is corrupted. */
+int fts_inverted_segment_find(struct fts_inverted_segment *seg,
+			      const char *term, unsigned int *idx_r);
+/* Append the term's UIDs to the array. Returns 0 if ok, -1 if the segment
+   is corrupted. */
+int fts_inverted_segment_get_uids(struct fts_inverted_segment *seg,
+				  const struct fts_inverted_term *rec,
+				  ARRAY_TYPE(uint32_t) *uids);
+
+#endif
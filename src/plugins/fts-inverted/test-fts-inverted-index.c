@@ -0,0 +1,315 @@
+/* Copyright (c) 2016 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "unlink-directory.h"
+#include "test-common.h"
+#include "fts-inverted-segment.h"
+#include "fts-inverted-index.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define TEST_DIR ".test-fts-inverted-index"
+#define TEST_INDEX_PATH TEST_DIR"/index"
+#define TEST_UID_VALIDITY 1234
+
+static struct fts_inverted_index *test_index_init(void)
+{
+	struct fts_inverted_index_settings set;
+
+	memset(&set, 0, sizeof(set));
+	set.uid_validity = TEST_UID_VALIDITY;
+	set.lock_method = FILE_LOCK_METHOD_FCNTL;
+	set.lock_timeout_secs = 5;
+	set.fsync_mode = FSYNC_MODE_ALWAYS;
+	set.mode = 0600;
+	set.gid = (gid_t)-1;
+	return fts_inverted_index_init(TEST_INDEX_PATH, &set);
+}
+
+static void test_dir_reset(void)
+{
+	const char *error;
+
+	(void)unlink_directory(TEST_DIR, UNLINK_DIRECTORY_FLAG_RMDIR, &error);
+	if (mkdir(TEST_DIR, 0700) < 0)
+		i_fatal("mkdir(%s) failed: %m", TEST_DIR);
+}
+
+static bool test_segment_exists(uint32_t id)
+{
+	struct stat st;
+	const char *path = t_strdup_printf("%s.%u", TEST_INDEX_PATH, id);
+
+	if (stat(path, &st) == 0)
+		return TRUE;
+	if (errno != ENOENT)
+		i_fatal("stat(%s) failed: %m", path);
+	return FALSE;
+}
+
+/* add "term<n>" for all UIDs in [first_uid, last_uid] that are
+   divisible by n, and "all" for all of them */
+static void test_index_add(struct fts_inverted_index *index,
+			   uint32_t first_uid, uint32_t last_uid)
+{
+	struct fts_inverted_index_update *update;
+	bool need_optimize;
+	uint32_t uid, n;
+
+	update = fts_inverted_index_update_init(index);
+	for (uid = first_uid; uid <= last_uid; uid++) {
+		for (n = 2; n <= 5; n++) {
+			if (uid % n == 0) {
+				fts_inverted_index_update_add(update,
+					t_strdup_printf("term%u", n), uid);
+			}
+		}
+		fts_inverted_index_update_add(update, "all", uid);
+		fts_inverted_index_update_set_last_uid(update, uid);
+	}
+	test_assert(fts_inverted_index_update_deinit(&update,
+						     &need_optimize) == 0);
+	test_assert(!need_optimize);
+}
+
+static void test_index_expunge(struct fts_inverted_index *index,
+			       uint32_t first_uid, uint32_t last_uid)
+{
+	struct fts_inverted_index_update *update;
+	bool need_optimize;
+	uint32_t uid;
+
+	update = fts_inverted_index_update_init(index);
+	for (uid = first_uid; uid <= last_uid; uid++)
+		fts_inverted_index_update_expunge(update, uid);
+	test_assert(fts_inverted_index_update_deinit(&update,
+						     &need_optimize) == 0);
+}
+
+static unsigned int
+test_index_lookup(struct fts_inverted_index *index, const char *term,
+		  bool prefix)
+{
+	ARRAY_TYPE(seq_range) uids;
+	unsigned int count;
+
+	t_array_init(&uids, 8);
+	test_assert(fts_inverted_index_lookup(index, term, prefix, &uids) == 0);
+	count = seq_range_count(&uids);
+	return count;
+}
+
+static void test_fts_inverted_segment(void)
+{
+	static const char *terms[] = { "aaa", "abc", "abd", "b", "zzzz" };
+	struct fts_inverted_segment_writer *writer;
+	struct fts_inverted_segment *seg;
+	const struct fts_inverted_term *rec;
+	ARRAY_TYPE(uint32_t) uids;
+	const char *path = TEST_INDEX_PATH".1", *term, *error;
+	uint32_t uid_buf[200], version = 0;
+	unsigned int i, j, idx;
+	bool corrupted;
+	int fd;
+
+	test_begin("fts inverted segment");
+	test_dir_reset();
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd == -1)
+		i_fatal("creat(%s) failed: %m", path);
+	writer = fts_inverted_segment_writer_init(fd, path, TEST_UID_VALIDITY);
+	for (i = 0; i < N_ELEMENTS(terms); i++) {
+		/* term i has (i+1)*40 UIDs */
+		for (j = 0; j < (i+1)*40; j++)
+			uid_buf[j] = j*(i+1) + 1;
+		fts_inverted_segment_write_term(writer, terms[i],
+						uid_buf, (i+1)*40);
+	}
+	test_assert(fts_inverted_segment_writer_finish(&writer, &error) == 0);
+	i_close_fd(&fd);
+
+	for (j = 0; j < 2; j++) {
+		test_assert(fts_inverted_segment_open(path, j == 1, &seg,
+					&corrupted, &error) == 1);
+		test_assert(fts_inverted_segment_get_terms_count(seg) ==
+			    N_ELEMENTS(terms));
+		t_array_init(&uids, 200);
+		for (i = 0; i < N_ELEMENTS(terms); i++) {
+			test_assert(fts_inverted_segment_find(seg, terms[i],
+							      &idx) == 0);
+			test_assert_idx(idx == i, i);
+			test_assert(fts_inverted_segment_get_term(seg, idx,
+							&term, &rec) == 0);
+			test_assert_idx(strcmp(term, terms[i]) == 0, i);
+			array_clear(&uids);
+			test_assert(fts_inverted_segment_get_uids(seg, rec,
+								  &uids) == 0);
+			test_assert_idx(array_count(&uids) == (i+1)*40, i);
+			test_assert_idx(*array_idx(&uids, 1) == i+2, i);
+		}
+		/* the position of a missing term */
+		test_assert(fts_inverted_segment_find(seg, "abcd", &idx) == 0 &&
+			    idx == 2);
+		test_assert(fts_inverted_segment_find(seg, "zzzzz", &idx) == 0 &&
+			    idx == N_ELEMENTS(terms));
+		fts_inverted_segment_close(&seg);
+	}
+
+	/* missing */
+	test_assert(fts_inverted_segment_open(TEST_INDEX_PATH".2", FALSE, &seg,
+					      &corrupted, &error) == 0);
+	/* corrupted header */
+	fd = open(path, O_WRONLY);
+	if (fd == -1 || pwrite(fd, &version, sizeof(version), 0) < 0)
+		i_fatal("pwrite(%s) failed: %m", path);
+	i_close_fd(&fd);
+	test_assert(fts_inverted_segment_open(path, FALSE, &seg,
+					      &corrupted, &error) == -1);
+	test_assert(corrupted);
+	test_end();
+}
+
+static void test_fts_inverted_index_lookup(void)
+{
+	struct fts_inverted_index *index;
+
+	test_begin("fts inverted index lookup");
+	test_dir_reset();
+	index = test_index_init();
+	test_assert(fts_inverted_index_refresh(index) == 0);
+	test_assert(fts_inverted_index_get_last_uid(index) == 0);
+	test_assert(test_index_lookup(index, "all", FALSE) == 0);
+
+	test_index_add(index, 1, 100);
+	test_assert(fts_inverted_index_get_last_uid(index) == 100);
+	test_assert(test_index_lookup(index, "all", FALSE) == 100);
+	test_assert(test_index_lookup(index, "term2", FALSE) == 50);
+	test_assert(test_index_lookup(index, "term5", FALSE) == 20);
+	test_assert(test_index_lookup(index, "term", FALSE) == 0);
+	/* prefix matches any of term2..term5 */
+	test_assert(test_index_lookup(index, "term", TRUE) == 100 - 26);
+	test_assert(test_index_lookup(index, "x", TRUE) == 0);
+	fts_inverted_index_deinit(&index);
+
+	/* another instance sees the same data */
+	index = test_index_init();
+	test_assert(fts_inverted_index_refresh(index) == 0);
+	test_assert(fts_inverted_index_get_last_uid(index) == 100);
+	test_assert(test_index_lookup(index, "term3", FALSE) == 33);
+	fts_inverted_index_deinit(&index);
+	test_end();
+}
+
+static void test_fts_inverted_index_merge(void)
+{
+	struct fts_inverted_index *index;
+	uint32_t i;
+
+	test_begin("fts inverted index merge");
+	test_dir_reset();
+	index = test_index_init();
+	/* the 4th segment of the same size gets all of them merged */
+	for (i = 0; i < 3; i++)
+		test_index_add(index, i*100 + 1, (i+1)*100);
+	test_assert(test_segment_exists(1) && test_segment_exists(3));
+	test_assert(test_index_lookup(index, "all", FALSE) == 300);
+
+	test_index_add(index, 301, 400);
+	for (i = 1; i <= 4; i++)
+		test_assert_idx(!test_segment_exists(i), i);
+	test_assert(test_segment_exists(5));
+	test_assert(fts_inverted_index_get_last_uid(index) == 400);
+	test_assert(test_index_lookup(index, "all", FALSE) == 400);
+	test_assert(test_index_lookup(index, "term4", FALSE) == 100);
+	fts_inverted_index_deinit(&index);
+	test_end();
+}
+
+static void test_fts_inverted_index_expunge(void)
+{
+	struct fts_inverted_index *index;
+
+	test_begin("fts inverted index expunge");
+	test_dir_reset();
+	index = test_index_init();
+	test_index_add(index, 1, 100);
+	test_index_add(index, 101, 200);
+
+	/* expunged UIDs are filtered out from the lookups */
+	test_index_expunge(index, 1, 50);
+	test_index_expunge(index, 151, 160);
+	test_assert(test_index_lookup(index, "all", FALSE) == 140);
+	test_assert(test_index_lookup(index, "term5", FALSE) == 28);
+
+	/* optimizing merges the segments and drops the expunged UIDs */
+	test_assert(fts_inverted_index_optimize(index) == 0);
+	test_assert(!test_segment_exists(1) && !test_segment_exists(2));
+	test_assert(test_segment_exists(3));
+	test_assert(test_index_lookup(index, "all", FALSE) == 140);
+	test_assert(test_index_lookup(index, "term5", FALSE) == 28);
+	fts_inverted_index_deinit(&index);
+	test_end();
+}
+
+static void test_fts_inverted_index_corrupted(void)
+{
+	struct fts_inverted_index *index;
+	ARRAY_TYPE(seq_range) uids;
+	const char *path = TEST_INDEX_PATH".2";
+	uint32_t version = 0;
+	int fd;
+
+	test_begin("fts inverted index corrupted");
+	test_dir_reset();
+	index = test_index_init();
+	test_index_add(index, 1, 100);
+	test_index_add(index, 101, 200);
+	fts_inverted_index_deinit(&index);
+
+	fd = open(path, O_WRONLY);
+	if (fd == -1 || pwrite(fd, &version, sizeof(version), 0) < 0)
+		i_fatal("pwrite(%s) failed: %m", path);
+	i_close_fd(&fd);
+
+	/* the lookup fails, but the index is deleted for rebuilding */
+	index = test_index_init();
+	t_array_init(&uids, 8);
+	test_expect_error_string("Corrupted segment");
+	test_assert(fts_inverted_index_lookup(index, "all", FALSE, &uids) < 0);
+	test_expect_no_more_errors();
+	test_assert(!test_segment_exists(1) && !test_segment_exists(2));
+	test_assert(fts_inverted_index_refresh(index) == 0);
+	test_assert(fts_inverted_index_get_last_uid(index) == 0);
+	test_assert(test_index_lookup(index, "all", FALSE) == 0);
+
+	/* rebuilding works */
+	test_index_add(index, 1, 200);
+	test_assert(fts_inverted_index_get_last_uid(index) == 200);
+	test_assert(test_index_lookup(index, "all", FALSE) == 200);
+	fts_inverted_index_deinit(&index);
+	test_end();
+}
+
+static void test_cleanup(void)
+{
+	const char *error;
+
+	(void)unlink_directory(TEST_DIR, UNLINK_DIRECTORY_FLAG_RMDIR, &error);
+}
+
+int main(void)
+{
+	static void (*test_functions[])(void) = {
+		test_fts_inverted_segment,
+		test_fts_inverted_index_lookup,
+		test_fts_inverted_index_merge,
+		test_fts_inverted_index_expunge,
+		test_fts_inverted_index_corrupted,
+		test_cleanup,
+		NULL
+	};
+	return test_run(test_functions);
+}
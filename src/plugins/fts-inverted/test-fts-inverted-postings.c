@@ -0,0 +1,113 @@
+/* Copyright (c) 2016 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "buffer.h"
+#include "fts-inverted-postings.h"
+#include "test-common.h"
+
+#define BLOCK_COUNT FTS_INVERTED_POSTINGS_BLOCK_COUNT
+
+static void test_postings_roundtrip(const uint32_t *uids, unsigned int count)
+{
+	ARRAY_TYPE(uint32_t) decoded;
+	buffer_t *buf;
+	unsigned int i;
+
+	buf = buffer_create_dynamic(default_pool, 256);
+	t_array_init(&decoded, count + 1);
+
+	fts_inverted_postings_encode(buf, uids, count);
+	test_assert(fts_inverted_postings_decode(buf->data, buf->used, count,
+						 &decoded) == 0);
+	test_assert(array_count(&decoded) == count);
+	for (i = 0; i < count && i < array_count(&decoded); i++)
+		test_assert_idx(*array_idx(&decoded, i) == uids[i], i);
+	buffer_free(&buf);
+}
+
+static void test_fts_inverted_postings(void)
+{
+	static const uint32_t small_uids[] = { 1, 2, 3, 100, 100000, (uint32_t)-1 };
+	static const unsigned int counts[] = {
+		0, 1, BLOCK_COUNT - 1, BLOCK_COUNT, BLOCK_COUNT + 1,
+		BLOCK_COUNT * 3 + 17
+	};
+	uint32_t *uids;
+	unsigned int i, j, count, step;
+
+	test_begin("fts inverted postings");
+	test_postings_roundtrip(small_uids, N_ELEMENTS(small_uids));
+
+	for (step = 1; step < 70000; step = step * 3 + 1) {
+		for (i = 0; i < N_ELEMENTS(counts); i++) T_BEGIN {
+			count = counts[i];
+			uids = t_new(uint32_t, count + 1);
+			for (j = 0; j < count; j++) {
+				uids[j] = (j == 0 ? 0 : uids[j-1]) + step +
+					(j % 7 == 0 ? j : 0);
+			}
+			test_postings_roundtrip(uids, count);
+		} T_END;
+	}
+
+	/* full 32bit deltas */
+	uids = t_new(uint32_t, BLOCK_COUNT);
+	uids[0] = (uint32_t)-BLOCK_COUNT;
+	for (j = 1; j < BLOCK_COUNT; j++)
+		uids[j] = uids[j-1] + 1;
+	test_postings_roundtrip(uids, BLOCK_COUNT);
+	test_end();
+}
+
+static void test_fts_inverted_postings_corrupted(void)
+{
+	ARRAY_TYPE(uint32_t) decoded;
+	uint32_t uids[BLOCK_COUNT + 2];
+	buffer_t *buf;
+	unsigned char *data;
+	unsigned int i;
+
+	test_begin("fts inverted postings corrupted");
+	for (i = 0; i < N_ELEMENTS(uids); i++)
+		uids[i] = i * 2 + 1;
+	buf = buffer_create_dynamic(default_pool, 256);
+	t_array_init(&decoded, N_ELEMENTS(uids));
+	fts_inverted_postings_encode(buf, uids, N_ELEMENTS(uids));
+
+	/* truncated data and wrong counts */
+	for (i = 0; i < buf->used; i++) {
+		array_clear(&decoded);
+		test_assert_idx(fts_inverted_postings_decode(buf->data, i,
+			N_ELEMENTS(uids), &decoded) < 0, i);
+	}
+	array_clear(&decoded);
+	test_assert(fts_inverted_postings_decode(buf->data, buf->used,
+			N_ELEMENTS(uids) - 1, &decoded) < 0);
+
+	/* invalid bit width */
+	data = buffer_get_modifiable_data(buf, NULL);
+	data[0] = 33;
+	array_clear(&decoded);
+	test_assert(fts_inverted_postings_decode(buf->data, buf->used,
+			N_ELEMENTS(uids), &decoded) < 0);
+
+	/* zero delta */
+	buffer_set_used_size(buf, 0);
+	buffer_append_zero(buf, 1);
+	array_clear(&decoded);
+	test_assert(fts_inverted_postings_decode(buf->data, buf->used,
+						 1, &decoded) < 0);
+	buffer_free(&buf);
+	test_end();
+}
+
+int main(void)
+{
+	static void (*test_functions[])(void) = {
+		test_fts_inverted_postings,
+		test_fts_inverted_postings_corrupted,
+		NULL
+	};
+	return test_run(test_functions);
+}
@@ -601,6 +601,8 @@ struct fts_backend fts_backend_lucene = {
 		fts_backend_default_can_lookup,
 		fts_backend_lucene_lookup,
 		fts_backend_lucene_lookup_multi,
-		fts_backend_lucene_lookup_done
+		fts_backend_lucene_lookup_done,
+		NULL,
+		NULL
 	}
 };
@@ -1007,27 +1007,23 @@ lucene_index_expunge_record(struct lucene_index *index,
 	return ret < 0 ? -1 : 0;
 }
 
+static int
+lucene_index_expunge_record_cb(const struct fts_expunge_log_read_record *rec,
+			       void *context)
+{
+	return lucene_index_expunge_record((struct lucene_index *)context, rec);
+}
+
 int lucene_index_expunge_from_log(struct lucene_index *index,
 				  struct fts_expunge_log *log)
 {
-	struct fts_expunge_log_read_ctx *ctx;
-	const struct fts_expunge_log_read_record *rec;
-	int ret = 0, ret2;
-
-	ctx = fts_expunge_log_read_begin(log);
-	while ((rec = fts_expunge_log_read_next(ctx)) != NULL) {
-		if (lucene_index_expunge_record(index, rec) < 0) {
-			ret = -1;
-			break;
-		}
-	}
+	int ret;
 
+	/* the records are merged per mailbox, so there's only a single
+	   search for each mailbox instead of one for each expunge record */
+	ret = fts_expunge_log_apply(log, lucene_index_expunge_record_cb, index);
 	lucene_index_close(index);
-
-	ret2 = fts_expunge_log_read_end(&ctx);
-	if (ret < 0 || ret2 < 0)
-		return -1;
-	return ret2;
+	return ret;
 }
 
 int lucene_index_optimize(struct lucene_index *index)
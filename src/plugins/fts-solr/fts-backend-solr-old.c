@@ -249,8 +249,8 @@ fts_backend_solr_init(struct fts_backend *_backend, const char **error_r)
 		*error_r = "Invalid fts_solr setting";
 		return -1;
 	}
-	if (solr_connection_init(fuser->set.url, fuser->set.debug,
-				 &backend->solr_conn, error_r) < 0)
+	if (solr_connection_init(&fuser->set, &backend->solr_conn,
+				 error_r) < 0)
 		return -1;
 
 	str = solr_escape_id_str(_backend->ns->user->username);
@@ -867,6 +867,8 @@ struct fts_backend fts_backend_solr_old = {
 		fts_backend_default_can_lookup,
 		fts_backend_solr_lookup,
 		fts_backend_solr_lookup_multi,
+		NULL,
+		NULL,
 		NULL
 	}
 };
@@ -5,19 +5,26 @@
 #include "str.h"
 #include "hash.h"
 #include "strescape.h"
-#include "unichar.h"
+#include "ioloop.h"
 #include "http-url.h"
 #include "mail-storage-private.h"
 #include "mailbox-list-private.h"
 #include "mail-search.h"
 #include "fts-api.h"
 #include "solr-connection.h"
+#include "solr-json.h"
 #include "fts-solr-plugin.h"
 
 #include <ctype.h>
 
 #define SOLR_CMDBUF_SIZE (1024*64)
 #define SOLR_CMDBUF_FLUSH_SIZE (SOLR_CMDBUF_SIZE-128)
+/* Expunge UID ranges at least this large with a delete-by-query instead of
+   listing each document ID separately */
+#define SOLR_EXPUNGE_QUERY_MIN_UIDS 8
+/* Maximum number of UID ranges in a single delete-by-query. Solr limits the
+   number of clauses in a boolean query (maxBooleanClauses). */
+#define SOLR_EXPUNGE_QUERY_MAX_RANGES 64
 #define SOLR_MAX_MULTI_ROWS 100000
 
 /* If header is larger than this, truncate it. */
@@ -27,14 +34,23 @@
 #define SOLR_HEADER_LINE_MAX_TRUNC_SIZE 1024
 
 #define SOLR_QUERY_MAX_MAILBOX_COUNT 10
-/* How often to flush indexing request to Solr before beginning a new one. */
-#define SOLR_MAIL_FLUSH_INTERVAL 1000
 
 struct solr_fts_backend {
 	struct fts_backend backend;
 	struct solr_connection *solr_conn;
 };
 
+struct solr_fts_backend_lookup {
+	struct fts_backend_lookup_async lookup;
+	pool_t pool;
+	enum fts_lookup_flags flags;
+
+	struct solr_connection_select *definite_select, *maybe_select;
+	struct solr_result **definite_results, **maybe_results;
+	struct timeout *to_finish;
+	int ret;
+};
+
 struct solr_fts_field {
 	char *key;
 	string_t *value;
@@ -46,14 +62,19 @@ struct solr_fts_backend_update_context {
 	struct mailbox *cur_box;
 	char box_guid[MAILBOX_GUID_HEX_LENGTH+1];
 
-	struct solr_connection_post *post;
 	uint32_t prev_uid;
+	/* the batch's update request. cmd contains the part of it that
+	   hasn't been sent yet. */
+	struct solr_connection_update *update;
 	string_t *cmd, *cur_value, *cur_value2;
-	string_t *cmd_expunge;
 	ARRAY(struct solr_fts_field) fields;
+	/* expunged UIDs in cur_box that haven't been sent yet */
+	ARRAY_TYPE(seq_range) expunge_uids;
 
 	uint32_t last_indexed_uid;
-	unsigned int mails_since_flush;
+	/* number of documents and bytes in the batch */
+	unsigned int batch_docs;
+	size_t batch_size;
 
 	bool tokenized_input:1;
 	bool last_indexed_uid_set:1;
@@ -65,86 +86,6 @@ struct solr_fts_backend_update_context {
 
 static const char *solr_escape_chars = "+-&|!(){}[]^\"~*?:\\/ ";
 
-static bool is_valid_xml_char(unichar_t chr)
-{
-	/* Valid characters in XML:
-
-	   #x9 | #xA | #xD | [#x20-#xD7FF] | [#xE000-#xFFFD] |
-	   [#x10000-#x10FFFF]
-
-	   This function gets called only for #x80 and higher */
-	if (chr > 0xd7ff && chr < 0xe000)
-		return FALSE;
-	if (chr > 0xfffd && chr < 0x10000)
-		return FALSE;
-	return chr < 0x10ffff;
-}
-
-static unsigned int
-xml_encode_data_max(string_t *dest, const unsigned char *data, unsigned int len,
-		    unsigned int max_len)
-{
-	unichar_t chr;
-	unsigned int i;
-
-	i_assert(max_len > 0 || len == 0);
-
-	if (max_len > len)
-		max_len = len;
-	for (i = 0; i < max_len; i++) {
-		switch (data[i]) {
-		case '&':
-			str_append(dest, "&amp;");
-			break;
-		case '<':
-			str_append(dest, "&lt;");
-			break;
-		case '>':
-			str_append(dest, "&gt;");
-			break;
-		case '\t':
-		case '\n':
-		case '\r':
-			/* exceptions to the following control char check */
-			str_append_c(dest, data[i]);
-			break;
-		default:
-			if (data[i] < 32) {
-				/* SOLR doesn't like control characters.
-				   replace them with spaces. */
-				str_append_c(dest, ' ');
-			} else if (data[i] >= 0x80) {
-				/* make sure the character is valid for XML
-				   so we don't get XML parser errors */
-				unsigned int char_len =
-					uni_utf8_get_char_n(data + i, len - i, &chr);
-				if (char_len > 0 && is_valid_xml_char(chr))
-					str_append_n(dest, data + i, char_len);
-				else {
-					str_append_n(dest, utf8_replacement_char,
-						     UTF8_REPLACEMENT_CHAR_LEN);
-				}
-				i += char_len - 1;
-			} else {
-				str_append_c(dest, data[i]);
-			}
-			break;
-		}
-	}
-	return i;
-}
-
-static void
-xml_encode_data(string_t *dest, const unsigned char *data, unsigned int len)
-{
-	(void)xml_encode_data_max(dest, data, len, len);
-}
-
-static void xml_encode(string_t *dest, const char *str)
-{
-	xml_encode_data(dest, (const unsigned char *)str, strlen(str));
-}
-
 static const char *solr_escape(const char *str)
 {
 	string_t *ret;
@@ -191,8 +132,7 @@ fts_backend_solr_init(struct fts_backend *_backend, const char **error_r)
 		_backend->flags &= ~FTS_BACKEND_FLAG_FUZZY_SEARCH;
 		_backend->flags |= FTS_BACKEND_FLAG_TOKENIZED_INPUT;
 	}
-	return solr_connection_init(fuser->set.url, fuser->set.debug,
-				    &backend->solr_conn, error_r);
+	return solr_connection_init(&fuser->set, &backend->solr_conn, error_r);
 }
 
 static void fts_backend_solr_deinit(struct fts_backend *_backend)
@@ -282,14 +222,15 @@ fts_backend_solr_update_init(struct fts_backend *_backend)
 	return &ctx->ctx;
 }
 
-static void xml_encode_id(struct solr_fts_backend_update_context *ctx,
-			  string_t *str, uint32_t uid)
+static void json_encode_id(struct solr_fts_backend_update_context *ctx,
+			   string_t *str, uint32_t uid)
 {
-	str_printfa(str, "%u/%s", uid, ctx->box_guid);
+	str_printfa(str, "\"%u/%s", uid, ctx->box_guid);
 	if (ctx->ctx.backend->ns->owner != NULL) {
 		str_append_c(str, '/');
-		xml_encode(str, ctx->ctx.backend->ns->owner->username);
+		solr_json_encode(str, ctx->ctx.backend->ns->owner->username);
 	}
+	str_append_c(str, '"');
 }
 
 static void
@@ -298,18 +239,14 @@ fts_backend_solr_doc_open(struct solr_fts_backend_update_context *ctx,
 {
 	ctx->documents_added = TRUE;
 
-	str_printfa(ctx->cmd, "<doc>"
-		    "<field name=\"uid\">%u</field>"
-		    "<field name=\"box\">%s</field>",
+	str_printfa(ctx->cmd, "{\"uid\":%u,\"box\":\"%s\",\"user\":\"",
 		    uid, ctx->box_guid);
-	str_append(ctx->cmd, "<field name=\"user\">");
-	if (ctx->ctx.backend->ns->owner != NULL)
-		xml_encode(ctx->cmd, ctx->ctx.backend->ns->owner->username);
-	str_append(ctx->cmd, "</field>");
-
-	str_printfa(ctx->cmd, "<field name=\"id\">");
-	xml_encode_id(ctx, ctx->cmd, uid);
-	str_append(ctx->cmd, "</field>");
+	if (ctx->ctx.backend->ns->owner != NULL) {
+		solr_json_encode(ctx->cmd,
+				 ctx->ctx.backend->ns->owner->username);
+	}
+	str_append(ctx->cmd, "\",\"id\":");
+	json_encode_id(ctx, ctx->cmd, uid);
 }
 
 static string_t *
@@ -338,43 +275,125 @@ fts_backend_solr_doc_close(struct solr_fts_backend_update_context *ctx)
 
 	if (ctx->body_open) {
 		ctx->body_open = FALSE;
-		str_append(ctx->cmd, "</field>");
+		str_append_c(ctx->cmd, '"');
 	}
 	array_foreach_modifiable(&ctx->fields, field) {
-		str_printfa(ctx->cmd, "<field name=\"%s\">", field->key);
-		xml_encode_data(ctx->cmd, str_data(field->value), str_len(field->value));
-		str_append(ctx->cmd, "</field>");
+		str_append(ctx->cmd, ",\"");
+		solr_json_encode(ctx->cmd, field->key);
+		str_append(ctx->cmd, "\":\"");
+		solr_json_encode_data(ctx->cmd, str_data(field->value),
+				      str_len(field->value));
+		str_append_c(ctx->cmd, '"');
 		str_truncate(field->value, 0);
 	}
-	str_append(ctx->cmd, "</doc>");
+	str_append_c(ctx->cmd, '}');
 }
 
-static int
-fts_backed_solr_build_flush(struct solr_fts_backend_update_context *ctx)
+static void
+fts_backend_solr_batch_send(struct solr_fts_backend_update_context *ctx)
 {
-	if (ctx->post == NULL)
-		return 0;
+	solr_connection_update_more(ctx->update, str_data(ctx->cmd),
+				    str_len(ctx->cmd));
+	ctx->batch_size += str_len(ctx->cmd);
+	str_truncate(ctx->cmd, 0);
+}
+
+static void
+fts_backend_solr_batch_flush(struct solr_fts_backend_update_context *ctx)
+{
+	if (ctx->batch_docs == 0)
+		return;
 
 	fts_backend_solr_doc_close(ctx);
-	str_append(ctx->cmd, "</add>");
-	ctx->mails_since_flush = 0;
+	str_append_c(ctx->cmd, ']');
+	fts_backend_solr_batch_send(ctx);
+	ctx->batch_docs = 0;
+	ctx->batch_size = 0;
+
+	/* the rest of the request is sent in the background while we
+	   continue indexing the following mails */
+	solr_connection_update_end(&ctx->update);
+}
 
-	solr_connection_post_more(ctx->post, str_data(ctx->cmd),
-				  str_len(ctx->cmd));
-	str_truncate(ctx->cmd, 0);
-	return solr_connection_post_end(&ctx->post);
+static void
+fts_backend_solr_expunge_send_ids(struct solr_fts_backend_update_context *ctx,
+				  string_t *ids)
+{
+	struct solr_fts_backend *backend =
+		(struct solr_fts_backend *)ctx->ctx.backend;
+	string_t *cmd;
+
+	cmd = t_str_new(str_len(ids) + 16);
+	str_printfa(cmd, "{\"delete\":[%s]}", str_c(ids));
+	solr_connection_update(backend->solr_conn, str_data(cmd), str_len(cmd));
+	str_truncate(ids, 0);
 }
 
 static void
-fts_backend_solr_expunge_flush(struct solr_fts_backend_update_context *ctx)
+fts_backend_solr_expunge_send_query(struct solr_fts_backend_update_context *ctx,
+				    string_t *uid_ranges)
 {
 	struct solr_fts_backend *backend =
 		(struct solr_fts_backend *)ctx->ctx.backend;
+	string_t *query, *cmd;
 
-	str_append(ctx->cmd_expunge, "</delete>");
-	(void)solr_connection_post(backend->solr_conn, str_c(ctx->cmd_expunge));
-	str_truncate(ctx->cmd_expunge, 0);
-	str_append(ctx->cmd_expunge, "<delete>");
+	query = t_str_new(str_len(uid_ranges) + 128);
+	str_printfa(query, "+box:%s +user:", ctx->box_guid);
+	if (ctx->ctx.backend->ns->owner != NULL)
+		str_append(query, solr_escape(ctx->ctx.backend->ns->owner->username));
+	else
+		str_append(query, "\"\"");
+	str_printfa(query, " +(%s)", str_c(uid_ranges));
+
+	cmd = t_str_new(str_len(query) + 32);
+	str_append(cmd, "{\"delete\":{\"query\":\"");
+	solr_json_encode(cmd, str_c(query));
+	str_append(cmd, "\"}}");
+	solr_connection_update(backend->solr_conn, str_data(cmd), str_len(cmd));
+	str_truncate(uid_ranges, 0);
+}
+
+static void
+fts_backend_solr_expunge_flush(struct solr_fts_backend_update_context *ctx)
+{
+	const struct seq_range *range;
+	string_t *ids, *uid_ranges;
+	unsigned int range_count = 0;
+	uint32_t uid;
+
+	if (!array_is_created(&ctx->expunge_uids) ||
+	    array_count(&ctx->expunge_uids) == 0)
+		return;
+
+	/* bulk expunges are usually mostly contiguous UIDs. delete them
+	   with range queries, and only the rest of them by their IDs. */
+	ids = t_str_new(1024);
+	uid_ranges = t_str_new(1024);
+	array_foreach(&ctx->expunge_uids, range) {
+		if (range->seq2 - range->seq1 + 1 >= SOLR_EXPUNGE_QUERY_MIN_UIDS) {
+			if (range_count == SOLR_EXPUNGE_QUERY_MAX_RANGES) {
+				fts_backend_solr_expunge_send_query(ctx, uid_ranges);
+				range_count = 0;
+			}
+			if (range_count++ > 0)
+				str_append(uid_ranges, " OR ");
+			str_printfa(uid_ranges, "uid:[%u TO %u]",
+				    range->seq1, range->seq2);
+			continue;
+		}
+		for (uid = range->seq1; uid <= range->seq2; uid++) {
+			if (str_len(ids) >= SOLR_CMDBUF_FLUSH_SIZE)
+				fts_backend_solr_expunge_send_ids(ctx, ids);
+			if (str_len(ids) > 0)
+				str_append_c(ids, ',');
+			json_encode_id(ctx, ids, uid);
+		}
+	}
+	if (range_count > 0)
+		fts_backend_solr_expunge_send_query(ctx, uid_ranges);
+	if (str_len(ids) > 0)
+		fts_backend_solr_expunge_send_ids(ctx, ids);
+	array_clear(&ctx->expunge_uids);
 }
 
 static int
@@ -384,28 +403,37 @@ fts_backend_solr_update_deinit(struct fts_backend_update_context *_ctx)
 		(struct solr_fts_backend_update_context *)_ctx;
 	struct solr_fts_backend *backend =
 		(struct solr_fts_backend *)_ctx->backend;
+	struct fts_solr_user *fuser =
+		FTS_SOLR_USER_CONTEXT(_ctx->backend->ns->user);
 	struct solr_fts_field *field;
 	const char *str;
 	int ret = _ctx->failed ? -1 : 0;
 
-	if (fts_backed_solr_build_flush(ctx) < 0)
+	fts_backend_solr_batch_flush(ctx);
+	T_BEGIN {
+		fts_backend_solr_expunge_flush(ctx);
+	} T_END;
+	if (solr_connection_update_wait(backend->solr_conn) < 0)
 		ret = -1;
 
-	if (ctx->documents_added || ctx->expunges) {
+	if ((ctx->documents_added || ctx->expunges) &&
+	    fuser->set.commit_within_msecs == 0) {
 		/* commit and wait until the documents we just indexed are
-		   visible to the following search */
-		if (ctx->expunges)
-			fts_backend_solr_expunge_flush(ctx);
-		str = t_strdup_printf("<commit softCommit=\"true\" waitSearcher=\"%s\"/>",
+		   visible to the following search. with commit_within Solr
+		   commits them by itself, so the search results may lag
+		   behind the indexing. */
+		str = t_strdup_printf("{\"commit\":{\"softCommit\":true,"
+				      "\"waitSearcher\":%s}}",
 				      ctx->documents_added ? "true" : "false");
-		if (solr_connection_post(backend->solr_conn, str) < 0)
+		solr_connection_update(backend->solr_conn, str, strlen(str));
+		if (solr_connection_update_wait(backend->solr_conn) < 0)
 			ret = -1;
 	}
 
 	if (ctx->cmd != NULL)
 		str_free(&ctx->cmd);
-	if (ctx->cmd_expunge != NULL)
-		str_free(&ctx->cmd_expunge);
+	if (array_is_created(&ctx->expunge_uids))
+		array_free(&ctx->expunge_uids);
 	array_foreach_modifiable(&ctx->fields, field) {
 		str_free(&field->value);
 		i_free(field->key);
@@ -421,14 +449,23 @@ fts_backend_solr_update_set_mailbox(struct fts_backend_update_context *_ctx,
 {
 	struct solr_fts_backend_update_context *ctx =
 		(struct solr_fts_backend_update_context *)_ctx;
+	struct solr_fts_backend *backend =
+		(struct solr_fts_backend *)_ctx->backend;
 	const char *box_guid;
 
+	/* only one update request can be built at a time */
+	fts_backend_solr_batch_flush(ctx);
+	/* the pending expunges are for the previous mailbox */
+	T_BEGIN {
+		fts_backend_solr_expunge_flush(ctx);
+	} T_END;
+
 	if (ctx->prev_uid != 0) {
 		i_assert(ctx->cur_box != NULL);
 
 		/* flush solr between mailboxes, so we don't wrongly update
 		   last_uid before we know it has succeeded */
-		if (fts_backed_solr_build_flush(ctx) < 0)
+		if (solr_connection_update_wait(backend->solr_conn) < 0)
 			_ctx->failed = TRUE;
 		else if (!_ctx->failed)
 			fts_index_set_last_uid(ctx->cur_box, ctx->prev_uid);
@@ -445,6 +482,7 @@ fts_backend_solr_update_set_mailbox(struct fts_backend_update_context *_ctx,
 		memset(ctx->box_guid, 0, sizeof(ctx->box_guid));
 	}
 	ctx->cur_box = box;
+	ctx->last_indexed_uid_set = FALSE;
 }
 
 static void
@@ -468,39 +506,37 @@ fts_backend_solr_update_expunge(struct fts_backend_update_context *_ctx,
 		   highly unlikely to be indexed at this time. */
 		return;
 	}
-	if (!ctx->expunges) {
-		ctx->expunges = TRUE;
-		ctx->cmd_expunge = str_new(default_pool, 1024);
-		str_append(ctx->cmd_expunge, "<delete>");
-	}
-
-	if (str_len(ctx->cmd_expunge) >= SOLR_CMDBUF_FLUSH_SIZE)
-		fts_backend_solr_expunge_flush(ctx);
-
-	str_append(ctx->cmd_expunge, "<id>");
-	xml_encode_id(ctx, ctx->cmd_expunge, uid);
-	str_append(ctx->cmd_expunge, "</id>");
+	if (!array_is_created(&ctx->expunge_uids))
+		i_array_init(&ctx->expunge_uids, 64);
+	seq_range_array_add(&ctx->expunge_uids, uid);
+	ctx->expunges = TRUE;
 }
 
 static void
 fts_backend_solr_uid_changed(struct solr_fts_backend_update_context *ctx,
 			     uint32_t uid)
 {
+	struct fts_solr_user *fuser =
+		FTS_SOLR_USER_CONTEXT(ctx->ctx.backend->ns->user);
 	struct solr_fts_backend *backend =
 		(struct solr_fts_backend *)ctx->ctx.backend;
 
-	if (ctx->mails_since_flush++ >= SOLR_MAIL_FLUSH_INTERVAL) {
-		if (fts_backed_solr_build_flush(ctx) < 0)
-			ctx->ctx.failed = TRUE;
-	}
-	if (ctx->post == NULL) {
+	if (ctx->batch_docs > 0 &&
+	    (ctx->batch_docs >= fuser->set.batch_size ||
+	     ctx->batch_size + str_len(ctx->cmd) >= fuser->set.batch_max_size))
+		fts_backend_solr_batch_flush(ctx);
+
+	if (ctx->batch_docs == 0) {
 		if (ctx->cmd == NULL)
 			ctx->cmd = str_new(default_pool, SOLR_CMDBUF_SIZE);
-		ctx->post = solr_connection_post_begin(backend->solr_conn);
-		str_append(ctx->cmd, "<add>");
+		ctx->update = solr_connection_update_begin(backend->solr_conn);
+		str_append_c(ctx->cmd, '[');
 	} else {
 		fts_backend_solr_doc_close(ctx);
+		str_append_c(ctx->cmd, ',');
+		fts_backend_solr_batch_send(ctx);
 	}
+	ctx->batch_docs++;
 	ctx->prev_uid = uid;
 	ctx->truncate_header = FALSE;
 	fts_backend_solr_doc_open(ctx, uid);
@@ -525,13 +561,13 @@ fts_backend_solr_update_set_build_key(struct fts_backend_update_context *_ctx,
 		/* fall through */
 	case FTS_BACKEND_BUILD_KEY_MIME_HDR:
 		ctx->cur_value = fts_solr_field_get(ctx, "hdr");
-		xml_encode(ctx->cur_value, key->hdr_name);
+		str_append(ctx->cur_value, key->hdr_name);
 		str_append(ctx->cur_value, ": ");
 		break;
 	case FTS_BACKEND_BUILD_KEY_BODY_PART:
 		if (!ctx->body_open) {
 			ctx->body_open = TRUE;
-			str_append(ctx->cmd, "<field name=\"body\">");
+			str_append(ctx->cmd, ",\"body\":\"");
 		}
 		ctx->cur_value = ctx->cmd;
 		break;
@@ -550,7 +586,10 @@ fts_backend_solr_update_unset_build_key(struct fts_backend_update_context *_ctx)
 	/* There can be multiple duplicate keys (duplicate header lines,
 	   multiple MIME body parts). Make sure they are separated by
 	   whitespace. */
-	str_append_c(ctx->cur_value, '\n');
+	if (ctx->cur_value == ctx->cmd)
+		str_append(ctx->cur_value, "\\n");
+	else
+		str_append_c(ctx->cur_value, '\n');
 	ctx->cur_value = NULL;
 	if (ctx->cur_value2 != NULL) {
 		str_append_c(ctx->cur_value2, '\n');
@@ -564,57 +603,36 @@ fts_backend_solr_update_build_more(struct fts_backend_update_context *_ctx,
 {
 	struct solr_fts_backend_update_context *ctx =
 		(struct solr_fts_backend_update_context *)_ctx;
-	unsigned int len;
 
 	if (_ctx->failed)
 		return -1;
 
 	if (ctx->cur_value2 == NULL && ctx->cur_value == ctx->cmd) {
-		/* we're writing to message body. if size is huge,
-		   flush it once in a while */
-		while (size >= SOLR_CMDBUF_FLUSH_SIZE) {
-			if (str_len(ctx->cmd) >= SOLR_CMDBUF_FLUSH_SIZE) {
-				solr_connection_post_more(ctx->post,
-							  str_data(ctx->cmd),
-							  str_len(ctx->cmd));
-				str_truncate(ctx->cmd, 0);
-			}
-			len = xml_encode_data_max(ctx->cmd, data, size,
-						  SOLR_CMDBUF_FLUSH_SIZE -
-						  str_len(ctx->cmd));
-			i_assert(len > 0);
-			i_assert(len <= size);
-			data += len;
-			size -= len;
-		}
-		xml_encode_data(ctx->cmd, data, size);
+		/* we're writing to message body. it's streamed to Solr
+		   whenever enough of it has been buffered. */
+		solr_json_encode_data(ctx->cmd, data, size);
 		if (ctx->tokenized_input)
 			str_append_c(ctx->cmd, ' ');
+		if (str_len(ctx->cmd) >= SOLR_CMDBUF_FLUSH_SIZE)
+			fts_backend_solr_batch_send(ctx);
 	} else {
 		if (!ctx->truncate_header) {
-			xml_encode_data(ctx->cur_value, data, size);
+			str_append_data(ctx->cur_value, data, size);
 			if (ctx->tokenized_input)
 				str_append_c(ctx->cur_value, ' ');
 		}
 		if (ctx->cur_value2 != NULL &&
 		    (!ctx->truncate_header ||
 		     str_len(ctx->cur_value2) < SOLR_HEADER_LINE_MAX_TRUNC_SIZE)) {
-			xml_encode_data(ctx->cur_value2, data, size);
+			str_append_data(ctx->cur_value2, data, size);
 			if (ctx->tokenized_input)
 				str_append_c(ctx->cur_value2, ' ');
 		}
 	}
 
-	if (str_len(ctx->cmd) >= SOLR_CMDBUF_FLUSH_SIZE) {
-		solr_connection_post_more(ctx->post, str_data(ctx->cmd),
-					  str_len(ctx->cmd));
-		str_truncate(ctx->cmd, 0);
-	}
-	if (!ctx->truncate_header &&
+	if (!ctx->truncate_header && ctx->cur_value != ctx->cmd &&
 	    str_len(ctx->cur_value) >= SOLR_HEADER_MAX_SIZE) {
 		/* a large header */
-		i_assert(ctx->cur_value != ctx->cmd);
-
 		i_warning("fts-solr(%s): Mailbox %s UID=%u header size is huge, truncating",
 			  ctx->cur_box->storage->user->username,
 			  mailbox_get_vname(ctx->cur_box), ctx->prev_uid);
@@ -784,15 +802,9 @@ solr_add_maybe_query_args(string_t *str, struct mail_search_arg *arg,
 	return TRUE;
 }
 
-static int solr_search(struct fts_backend *_backend, string_t *str,
-		       const char *box_guid, ARRAY_TYPE(seq_range) *uids_r,
-		       ARRAY_TYPE(fts_score_map) *scores_r)
+static void solr_search_add_filter(struct fts_backend *_backend,
+				   string_t *str, const char *box_guid)
 {
-	struct solr_fts_backend *backend = (struct solr_fts_backend *)_backend;
-	pool_t pool = pool_alloconly_create("fts solr search", 1024);
-	struct solr_result **results;
-	int ret;
-
 	/* use a separate filter query for selecting the mailbox. it shouldn't
 	   affect the score and there could be some caching benefits too. */
 	str_printfa(str, "&fq=%%2Bbox:%s+%%2Buser:", box_guid);
@@ -800,22 +812,43 @@ static int solr_search(struct fts_backend *_backend, string_t *str,
 		solr_quote_http(str, _backend->ns->owner->username);
 	else
 		str_append(str, "%22%22");
+}
 
-	ret = solr_connection_select(backend->solr_conn, str_c(str),
-				     pool, &results);
-	if (ret == 0 && results[0] != NULL) {
+static void solr_search_add_results(struct solr_result **results,
+				    ARRAY_TYPE(seq_range) *uids_r,
+				    ARRAY_TYPE(fts_score_map) *scores_r)
+{
+	if (results[0] != NULL) {
 		array_append_array(uids_r, &results[0]->uids);
 		array_append_array(scores_r, &results[0]->scores);
 	}
+}
+
+static int solr_search(struct fts_backend *_backend, const char *query,
+		       ARRAY_TYPE(seq_range) *uids_r,
+		       ARRAY_TYPE(fts_score_map) *scores_r)
+{
+	struct solr_fts_backend *backend = (struct solr_fts_backend *)_backend;
+	pool_t pool = pool_alloconly_create("fts solr search", 1024);
+	struct solr_result **results;
+	int ret;
+
+	ret = solr_connection_select(backend->solr_conn, query,
+				     pool, &results);
+	if (ret == 0)
+		solr_search_add_results(results, uids_r, scores_r);
 	pool_unref(&pool);
 	return ret;
 }
 
+/* Returns the queries for looking up definite and maybe matches, or NULL
+   if the args don't need such a query. */
 static int
-fts_backend_solr_lookup(struct fts_backend *_backend, struct mailbox *box,
+solr_lookup_get_queries(struct fts_backend *_backend, struct mailbox *box,
 			struct mail_search_arg *args,
 			enum fts_lookup_flags flags,
-			struct fts_result *result)
+			const char **definite_query_r,
+			const char **maybe_query_r)
 {
 	bool and_args = (flags & FTS_LOOKUP_FLAG_AND_ARGS) != 0;
 	struct mailbox_status status;
@@ -832,24 +865,163 @@ fts_backend_solr_lookup(struct fts_backend *_backend, struct mailbox *box,
 		    status.uidnext);
 	prefix_len = str_len(str);
 
+	*definite_query_r = *maybe_query_r = NULL;
 	if (solr_add_definite_query_args(str, args, and_args)) {
+		solr_search_add_filter(_backend, str, box_guid);
+		*definite_query_r = t_strdup(str_c(str));
+	}
+	str_truncate(str, prefix_len);
+	if (solr_add_maybe_query_args(str, args, and_args)) {
+		solr_search_add_filter(_backend, str, box_guid);
+		*maybe_query_r = t_strdup(str_c(str));
+	}
+	return 0;
+}
+
+static int
+fts_backend_solr_lookup(struct fts_backend *_backend, struct mailbox *box,
+			struct mail_search_arg *args,
+			enum fts_lookup_flags flags,
+			struct fts_result *result)
+{
+	const char *definite_query, *maybe_query;
+
+	if (solr_lookup_get_queries(_backend, box, args, flags,
+				    &definite_query, &maybe_query) < 0)
+		return -1;
+
+	if (definite_query != NULL) {
 		ARRAY_TYPE(seq_range) *uids_arr =
 			(flags & FTS_LOOKUP_FLAG_NO_AUTO_FUZZY) == 0 ?
 			&result->definite_uids : &result->maybe_uids;
-		if (solr_search(_backend, str, box_guid,
+		if (solr_search(_backend, definite_query,
 				uids_arr, &result->scores) < 0)
 			return -1;
 	}
-	str_truncate(str, prefix_len);
-	if (solr_add_maybe_query_args(str, args, and_args)) {
-		if (solr_search(_backend, str, box_guid,
+	if (maybe_query != NULL) {
+		if (solr_search(_backend, maybe_query,
 				&result->maybe_uids, &result->scores) < 0)
 			return -1;
-	}               
+	}
 	result->scores_sorted = TRUE;
 	return 0;
 }
 
+static void
+fts_backend_solr_lookup_finish(struct solr_fts_backend_lookup *lookup)
+{
+	struct fts_result *result = lookup->lookup.result;
+	ARRAY_TYPE(seq_range) *uids_arr =
+		(lookup->flags & FTS_LOOKUP_FLAG_NO_AUTO_FUZZY) == 0 ?
+		&result->definite_uids : &result->maybe_uids;
+
+	if (lookup->definite_select != NULL || lookup->maybe_select != NULL) {
+		/* the other select is still running */
+		return;
+	}
+	if (lookup->to_finish != NULL)
+		timeout_remove(&lookup->to_finish);
+
+	/* add the results in the same order as fts_backend_solr_lookup() */
+	if (lookup->ret == 0 && lookup->definite_results != NULL) {
+		solr_search_add_results(lookup->definite_results,
+					uids_arr, &result->scores);
+	}
+	if (lookup->ret == 0 && lookup->maybe_results != NULL) {
+		solr_search_add_results(lookup->maybe_results,
+					&result->maybe_uids, &result->scores);
+	}
+	result->scores_sorted = TRUE;
+	fts_backend_lookup_async_finished(&lookup->lookup, lookup->ret);
+}
+
+static void
+fts_backend_solr_lookup_definite_callback(int ret,
+					  struct solr_result **box_results,
+					  struct solr_fts_backend_lookup *lookup)
+{
+	lookup->definite_select = NULL;
+	if (ret < 0)
+		lookup->ret = -1;
+	else
+		lookup->definite_results = box_results;
+	fts_backend_solr_lookup_finish(lookup);
+}
+
+static void
+fts_backend_solr_lookup_maybe_callback(int ret,
+				       struct solr_result **box_results,
+				       struct solr_fts_backend_lookup *lookup)
+{
+	lookup->maybe_select = NULL;
+	if (ret < 0)
+		lookup->ret = -1;
+	else
+		lookup->maybe_results = box_results;
+	fts_backend_solr_lookup_finish(lookup);
+}
+
+static void
+fts_backend_solr_lookup_async_deinit(struct fts_backend_lookup_async *_lookup)
+{
+	struct solr_fts_backend_lookup *lookup =
+		(struct solr_fts_backend_lookup *)_lookup;
+
+	if (lookup->definite_select != NULL)
+		solr_connection_select_abort(&lookup->definite_select);
+	if (lookup->maybe_select != NULL)
+		solr_connection_select_abort(&lookup->maybe_select);
+	if (lookup->to_finish != NULL)
+		timeout_remove(&lookup->to_finish);
+	pool_unref(&lookup->pool);
+}
+
+static struct fts_backend_lookup_async *
+fts_backend_solr_lookup_async(struct fts_backend *_backend,
+			      struct mailbox *box,
+			      struct mail_search_arg *args,
+			      enum fts_lookup_flags flags,
+			      struct fts_result *result ATTR_UNUSED)
+{
+	struct solr_fts_backend *backend = (struct solr_fts_backend *)_backend;
+	struct solr_fts_backend_lookup *lookup;
+	const char *definite_query, *maybe_query;
+	pool_t pool;
+
+	if (solr_lookup_get_queries(_backend, box, args, flags,
+				    &definite_query, &maybe_query) < 0)
+		return NULL;
+
+	pool = pool_alloconly_create("fts solr lookup", 1024);
+	lookup = p_new(pool, struct solr_fts_backend_lookup, 1);
+	lookup->pool = pool;
+	lookup->flags = flags;
+
+	/* the definite and maybe queries are independent, so send them
+	   in parallel */
+	if (definite_query != NULL) {
+		lookup->definite_select =
+			solr_connection_select_async(backend->solr_conn,
+				definite_query, pool,
+				fts_backend_solr_lookup_definite_callback,
+				lookup);
+	}
+	if (maybe_query != NULL) {
+		lookup->maybe_select =
+			solr_connection_select_async(backend->solr_conn,
+				maybe_query, pool,
+				fts_backend_solr_lookup_maybe_callback,
+				lookup);
+	}
+	if (lookup->definite_select == NULL && lookup->maybe_select == NULL) {
+		/* nothing to look up. finish from the ioloop, since the
+		   callback must not be called before we return. */
+		lookup->to_finish = timeout_add_short(0,
+			fts_backend_solr_lookup_finish, lookup);
+	}
+	return &lookup->lookup;
+}
+
 static int
 solr_search_multi(struct fts_backend *_backend, string_t *str,
 		  struct mailbox *const boxes[], enum fts_lookup_flags flags,
@@ -970,6 +1142,8 @@ struct fts_backend fts_backend_solr = {
 		fts_backend_default_can_lookup,
 		fts_backend_solr_lookup,
 		fts_backend_solr_lookup_multi,
-		NULL
+		NULL,
+		fts_backend_solr_lookup_async,
+		fts_backend_solr_lookup_async_deinit
 	}
 };
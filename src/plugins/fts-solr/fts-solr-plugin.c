@@ -3,6 +3,7 @@
 #include "lib.h"
 #include "array.h"
 #include "http-client.h"
+#include "settings-parser.h"
 #include "mail-user.h"
 #include "mail-storage-hooks.h"
 #include "solr-connection.h"
@@ -20,7 +21,11 @@ static int
 fts_solr_plugin_init_settings(struct mail_user *user,
 			      struct fts_solr_settings *set, const char *str)
 {
-	const char *const *tmp;
+	const char *const *tmp, *error;
+
+	set->batch_size = FTS_SOLR_DEFAULT_BATCH_SIZE;
+	set->batch_max_size = FTS_SOLR_DEFAULT_BATCH_MAX_SIZE;
+	set->max_parallel_updates = 1;
 
 	if (str == NULL)
 		str = "";
@@ -37,6 +42,35 @@ fts_solr_plugin_init_settings(struct mail_user *user,
 		} else if (strcmp(*tmp, "default_ns=") == 0) {
 			set->default_ns_prefix =
 				p_strdup(user->pool, *tmp + 11);
+		} else if (strncmp(*tmp, "batch_size=", 11) == 0) {
+			if (str_to_uint(*tmp + 11, &set->batch_size) < 0 ||
+			    set->batch_size == 0) {
+				i_error("fts_solr: Invalid batch_size: %s",
+					*tmp + 11);
+				return -1;
+			}
+		} else if (strncmp(*tmp, "batch_max_size=", 15) == 0) {
+			if (settings_get_size(*tmp + 15, &set->batch_max_size,
+					      &error) < 0) {
+				i_error("fts_solr: Invalid batch_max_size: %s",
+					error);
+				return -1;
+			}
+		} else if (strncmp(*tmp, "max_parallel_updates=", 21) == 0) {
+			if (str_to_uint(*tmp + 21, &set->max_parallel_updates) < 0 ||
+			    set->max_parallel_updates == 0) {
+				i_error("fts_solr: Invalid max_parallel_updates: %s",
+					*tmp + 21);
+				return -1;
+			}
+		} else if (strncmp(*tmp, "commit_within=", 14) == 0) {
+			if (settings_get_time_msecs(*tmp + 14,
+						    &set->commit_within_msecs,
+						    &error) < 0) {
+				i_error("fts_solr: Invalid commit_within: %s",
+					error);
+				return -1;
+			}
 		} else {
 			i_error("fts_solr: Invalid setting: %s", *tmp);
 			return -1;
@@ -8,8 +8,20 @@
 #define FTS_SOLR_USER_CONTEXT(obj) \
 	MODULE_CONTEXT(obj, fts_solr_user_module)
 
+#define FTS_SOLR_DEFAULT_BATCH_SIZE 1000
+#define FTS_SOLR_DEFAULT_BATCH_MAX_SIZE (4*1024*1024)
+
 struct fts_solr_settings {
 	const char *url, *default_ns_prefix;
+	/* max number of documents and bytes in a single update request */
+	unsigned int batch_size;
+	uoff_t batch_max_size;
+	/* max number of update requests sent without waiting for their
+	   responses */
+	unsigned int max_parallel_updates;
+	/* if non-zero, let Solr commit the updates within this time instead
+	   of explicitly committing them after each indexing run */
+	unsigned int commit_within_msecs;
 	bool use_libfts;
 	bool debug;
 };
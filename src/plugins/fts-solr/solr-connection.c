@@ -5,8 +5,10 @@
 #include "hash.h"
 #include "str.h"
 #include "strescape.h"
+#include "llist.h"
 #include "ioloop.h"
 #include "istream.h"
+#include "istream-chain.h"
 #include "http-url.h"
 #include "http-client.h"
 #include "fts-solr-plugin.h"
@@ -14,6 +16,10 @@
 
 #include <expat.h>
 
+/* Let the HTTP client send the update request bodies and handle the finished
+   requests' responses every time this much more data has been appended */
+#define SOLR_UPDATE_PROGRESS_SIZE (1024*64)
+
 enum solr_xml_response_state {
 	SOLR_XML_RESPONSE_STATE_ROOT,
 	SOLR_XML_RESPONSE_STATE_RESPONSE,
@@ -55,51 +61,153 @@ struct solr_connection_post {
 	bool failed:1;
 };
 
-struct solr_connection {
+struct solr_connection_update {
+	struct solr_connection *conn;
+
+	struct istream *payload;
+	struct istream_chain *payload_chain;
+	/* bytes appended since the HTTP client was last run */
+	size_t progress_size;
+
+	bool ended:1;
+	bool finished:1;
+};
+
+struct solr_connection_select {
+	struct solr_connection_select *prev, *next;
+	struct solr_connection *conn;
+	/* ioloop where the callback is called */
+	struct ioloop *ioloop;
+
 	XML_Parser xml_parser;
+	struct solr_lookup_xml_context lookup;
 
+	struct http_client_request *http_req;
+	struct istream *payload;
+	struct io *io;
+	struct timeout *to_callback;
+
+	solr_connection_select_callback_t *callback;
+	void *context;
+	int ret;
+
+	bool finished:1;
+	bool xml_failed:1;
+};
+
+struct solr_connection {
 	char *http_host;
 	in_port_t http_port;
 	char *http_base_url;
-	char *http_failure;
+	char *http_update_url;
 
 	int request_status;
 
-	struct istream *payload;
-	struct io *io;
+	/* number of asynchronous update requests still waiting for
+	   a response */
+	unsigned int updates_pending;
+	unsigned int max_pending_updates;
+	bool updates_failed;
+
+	/* number of selects in solr_selects for this connection */
+	unsigned int selects_count;
+	/* set while waiting for requests to finish in a nested ioloop */
+	struct ioloop *wait_ioloop;
 
 	bool debug:1;
 	bool posting:1;
-	bool xml_failed:1;
+	bool post_pending:1;
+	bool updating:1;
 	bool http_ssl:1;
 };
 
-static int solr_xml_parse(struct solr_connection *conn,
+/* asynchronous select requests of all connections that haven't called their
+   callback yet. solr_http_client is shared by all the connections, so the
+   ios of all these requests must follow it whenever it switches ioloops. */
+static struct solr_connection_select *solr_selects = NULL;
+
+static int solr_xml_parse(struct solr_connection_select *select,
 			  const void *data, size_t size, bool done)
 {
 	enum XML_Error err;
 	int line, col;
 
-	if (conn->xml_failed)
+	if (select->xml_failed)
 		return -1;
 
-	if (XML_Parse(conn->xml_parser, data, size, done ? 1 : 0) != 0)
+	if (XML_Parse(select->xml_parser, data, size, done ? 1 : 0) != 0)
 		return 0;
 
-	err = XML_GetErrorCode(conn->xml_parser);
+	err = XML_GetErrorCode(select->xml_parser);
 	if (err != XML_ERROR_FINISHED) {
-		line = XML_GetCurrentLineNumber(conn->xml_parser);
-		col = XML_GetCurrentColumnNumber(conn->xml_parser);
+		line = XML_GetCurrentLineNumber(select->xml_parser);
+		col = XML_GetCurrentColumnNumber(select->xml_parser);
 		i_error("fts_solr: Invalid XML input at %d:%d: %s "
 			"(near: %.*s)", line, col, XML_ErrorString(err),
 			(int)I_MIN(size, 128), (const char *)data);
-		conn->xml_failed = TRUE;
+		select->xml_failed = TRUE;
 		return -1;
 	}
 	return 0;
 }
 
-int solr_connection_init(const char *url, bool debug,
+static void solr_connection_switch_ioloop(void)
+{
+	struct solr_connection_select *select;
+
+	/* the callback timeouts stay in the selects' own ioloops */
+	http_client_switch_ioloop(solr_http_client);
+	for (select = solr_selects; select != NULL; select = select->next) {
+		if (select->io != NULL)
+			select->io = io_loop_move_io(&select->io);
+	}
+}
+
+static struct ioloop *solr_connection_wait_begin(struct solr_connection *conn)
+{
+	struct ioloop *prev_ioloop = current_ioloop;
+
+	/* run the HTTP client in its own ioloop. unlike http_client_wait()
+	   this allows waiting for only some of the requests to finish. */
+	i_assert(conn->wait_ioloop == NULL);
+	conn->wait_ioloop = io_loop_create();
+	solr_connection_switch_ioloop();
+	return prev_ioloop;
+}
+
+static void
+solr_connection_select_callback(struct solr_connection_select *select);
+
+static void solr_connection_wait_end(struct solr_connection *conn,
+				     struct ioloop *prev_ioloop)
+{
+	struct solr_connection_select *select;
+
+	io_loop_set_current(prev_ioloop);
+	solr_connection_switch_ioloop();
+	io_loop_set_current(conn->wait_ioloop);
+	io_loop_destroy(&conn->wait_ioloop);
+
+	/* call the callbacks of the asynchronous selects that finished
+	   while we were waiting, now that we're back in their ioloop. these
+	   may belong to other connections as well. */
+	for (select = solr_selects; select != NULL; select = select->next) {
+		if (select->finished && select->ioloop == current_ioloop &&
+		    select->to_callback == NULL) {
+			select->to_callback =
+				timeout_add_short(0, solr_connection_select_callback,
+						  select);
+		}
+	}
+}
+
+static void solr_connection_wait_stop(struct solr_connection *conn)
+{
+	if (conn->wait_ioloop != NULL)
+		io_loop_stop(conn->wait_ioloop);
+}
+
+int solr_connection_init(const struct fts_solr_settings *solr_set,
 			 struct solr_connection **conn_r, const char **error_r)
 {
 	struct http_client_settings http_set;
@@ -107,7 +215,7 @@ int solr_connection_init(const char *url, bool debug,
 	struct http_url *http_url;
 	const char *error;
 
-	if (http_url_parse(url, NULL, 0, pool_datastack_create(),
+	if (http_url_parse(solr_set->url, NULL, 0, pool_datastack_create(),
 			   &http_url, &error) < 0) {
 		*error_r = t_strdup_printf(
 			"fts_solr: Failed to parse HTTP url: %s", error);
@@ -119,26 +227,29 @@ int solr_connection_init(const char *url, bool debug,
 	conn->http_port = http_url->port;
 	conn->http_base_url = i_strconcat(http_url->path, http_url->enc_query, NULL);
 	conn->http_ssl = http_url->have_ssl;
-	conn->debug = debug;
+	conn->debug = solr_set->debug;
+	if (solr_set->commit_within_msecs == 0)
+		conn->http_update_url = i_strconcat(conn->http_base_url, "update", NULL);
+	else {
+		conn->http_update_url =
+			i_strdup_printf("%supdate?commitWithin=%u",
+					conn->http_base_url,
+					solr_set->commit_within_msecs);
+	}
+	conn->max_pending_updates = I_MAX(solr_set->max_parallel_updates, 1);
 
 	if (solr_http_client == NULL) {
 		memset(&http_set, 0, sizeof(http_set));
 		http_set.max_idle_time_msecs = 5*1000;
-		http_set.max_parallel_connections = 1;
+		http_set.max_parallel_connections = conn->max_pending_updates;
 		http_set.max_pipelined_requests = 1;
 		http_set.max_redirects = 1;
 		http_set.max_attempts = 3;
-		http_set.debug = debug;
+		http_set.debug = solr_set->debug;
 		http_set.connect_timeout_msecs = 5*1000;
 		http_set.request_timeout_msecs = 60*1000;
 		solr_http_client = http_client_init(&http_set);
 	}
-
-	conn->xml_parser = XML_ParserCreate("UTF-8");
-	if (conn->xml_parser == NULL) {
-		i_fatal_status(FATAL_OUTOFMEM,
-			       "fts_solr: Failed to allocate XML parser");
-	}
 	*conn_r = conn;
 	return 0;
 }
@@ -148,9 +259,12 @@ void solr_connection_deinit(struct solr_connection **_conn)
 	struct solr_connection *conn = *_conn;
 
 	*_conn = NULL;
-	XML_ParserFree(conn->xml_parser);
+	i_assert(conn->updates_pending == 0);
+	i_assert(conn->selects_count == 0);
+
 	i_free(conn->http_host);
 	i_free(conn->http_base_url);
+	i_free(conn->http_update_url);
 	i_free(conn);
 }
 
@@ -369,98 +483,205 @@ static void solr_lookup_xml_data(void *context, const char *str, int len)
 	}
 }
 
-static void solr_connection_payload_input(struct solr_connection *conn)
+static void
+solr_connection_select_free(struct solr_connection_select **_select)
+{
+	struct solr_connection_select *select = *_select;
+
+	*_select = NULL;
+	DLLIST_REMOVE(&solr_selects, select);
+	i_assert(select->conn->selects_count > 0);
+	select->conn->selects_count--;
+
+	if (select->http_req != NULL)
+		http_client_request_abort(&select->http_req);
+	if (select->io != NULL)
+		io_remove(&select->io);
+	if (select->payload != NULL)
+		i_stream_unref(&select->payload);
+	if (select->to_callback != NULL)
+		timeout_remove(&select->to_callback);
+	XML_ParserFree(select->xml_parser);
+	hash_table_destroy(&select->lookup.mailboxes);
+	i_free(select->lookup.mailbox);
+	i_free(select->lookup.ns);
+	i_free(select);
+}
+
+static void
+solr_connection_select_callback(struct solr_connection_select *select)
+{
+	solr_connection_select_callback_t *callback = select->callback;
+	void *context = select->context;
+	struct solr_result **results;
+	int ret = select->ret;
+
+	array_append_zero(&select->lookup.results);
+	results = array_idx_modifiable(&select->lookup.results, 0);
+	solr_connection_select_free(&select);
+
+	callback(ret, results, context);
+}
+
+static void solr_connection_select_finish(struct solr_connection_select *select)
+{
+	if (select->ret == 0 &&
+	    select->lookup.content_state == SOLR_XML_CONTENT_STATE_ERROR)
+		select->ret = -1;
+	if (select->ret == 0)
+		select->ret = solr_xml_parse(select, "", 0, TRUE);
+	select->finished = TRUE;
+
+	if (select->ioloop == current_ioloop)
+		solr_connection_select_callback(select);
+	else {
+		/* finished while some other request was being waited for in
+		   a nested ioloop. solr_connection_wait_end() calls the
+		   callback. */
+	}
+}
+
+static void
+solr_connection_select_payload_input(struct solr_connection_select *select)
 {
 	const unsigned char *data;
 	size_t size;
 	int ret;
 
 	/* read payload */
-	while ((ret = i_stream_read_more(conn->payload, &data, &size)) > 0) {
-		(void)solr_xml_parse(conn, data, size, FALSE);
-		i_stream_skip(conn->payload, size);
+	while ((ret = i_stream_read_more(select->payload, &data, &size)) > 0) {
+		(void)solr_xml_parse(select, data, size, FALSE);
+		i_stream_skip(select->payload, size);
 	}
 
 	if (ret == 0) {
 		/* we will be called again for more data */
-	} else {
-		if (conn->payload->stream_errno != 0) {
-			i_error("fts_solr: failed to read payload from HTTP server: %m");
-			conn->request_status = -1;
-		}
-		io_remove(&conn->io);
-		i_stream_unref(&conn->payload);
+		return;
+	}
+	if (select->payload->stream_errno != 0) {
+		i_error("fts_solr: failed to read payload from HTTP server: %s",
+			i_stream_get_error(select->payload));
+		select->ret = -1;
 	}
+	io_remove(&select->io);
+	i_stream_unref(&select->payload);
+	solr_connection_select_finish(select);
 }
 
 static void
 solr_connection_select_response(const struct http_response *response,
-				struct solr_connection *conn)
+				struct solr_connection_select *select)
 {
+	/* the request is freed after this callback returns */
+	select->http_req = NULL;
+
 	if (response->status / 100 != 2) {
 		i_error("fts_solr: Lookup failed: %u %s",
 			response->status, response->reason);
-		conn->request_status = -1;
+		select->ret = -1;
+		solr_connection_select_finish(select);
 		return;
 	}
 
 	if (response->payload == NULL) {
 		i_error("fts_solr: Lookup failed: Empty response payload");
-		conn->request_status = -1;
+		select->ret = -1;
+		solr_connection_select_finish(select);
 		return;
 	}
 
 	i_stream_ref(response->payload);
-	conn->payload = response->payload;
-	conn->io = io_add_istream(response->payload,
-				  solr_connection_payload_input, conn);
-	solr_connection_payload_input(conn);
+	select->payload = response->payload;
+	select->io = io_add_istream(response->payload,
+				    solr_connection_select_payload_input,
+				    select);
+	solr_connection_select_payload_input(select);
+}
+
+struct solr_connection_select_sync_context {
+	struct solr_connection *conn;
+	struct solr_result **box_results;
+	int ret;
+	bool finished;
+};
+
+static void
+solr_connection_select_sync_callback(int ret, struct solr_result **box_results,
+				     struct solr_connection_select_sync_context *ctx)
+{
+	ctx->ret = ret;
+	ctx->box_results = box_results;
+	ctx->finished = TRUE;
+	solr_connection_wait_stop(ctx->conn);
 }
 
 int solr_connection_select(struct solr_connection *conn, const char *query,
 			   pool_t pool, struct solr_result ***box_results_r)
 {
-	struct solr_lookup_xml_context solr_lookup_context;
-	struct http_client_request *http_req;
-	const char *url;
-	int parse_ret;
+	struct solr_connection_select_sync_context ctx;
+	struct ioloop *prev_ioloop;
 
-	memset(&solr_lookup_context, 0, sizeof(solr_lookup_context));
-	solr_lookup_context.result_pool = pool;
-	hash_table_create(&solr_lookup_context.mailboxes, default_pool, 0,
-			  str_hash, strcmp);
-	p_array_init(&solr_lookup_context.results, pool, 32);
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.conn = conn;
 
-	i_free_and_null(conn->http_failure);
-	conn->xml_failed = FALSE;
-	XML_ParserReset(conn->xml_parser, "UTF-8");
-	XML_SetElementHandler(conn->xml_parser,
-			      solr_lookup_xml_start, solr_lookup_xml_end);
-	XML_SetCharacterDataHandler(conn->xml_parser, solr_lookup_xml_data);
-	XML_SetUserData(conn->xml_parser, &solr_lookup_context);
+	prev_ioloop = solr_connection_wait_begin(conn);
+	(void)solr_connection_select_async(conn, query, pool,
+			solr_connection_select_sync_callback, &ctx);
+	while (!ctx.finished)
+		io_loop_run(conn->wait_ioloop);
+	solr_connection_wait_end(conn, prev_ioloop);
 
-	url = t_strconcat(conn->http_base_url, "select?", query, NULL);
+	*box_results_r = ctx.box_results;
+	return ctx.ret;
+}
 
-	http_req = http_client_request(solr_http_client, "GET",
-				       conn->http_host, url,
-				       solr_connection_select_response, conn);
-	http_client_request_set_port(http_req, conn->http_port);
-	http_client_request_set_ssl(http_req, conn->http_ssl);
-	http_client_request_submit(http_req);
+#undef solr_connection_select_async
+struct solr_connection_select *
+solr_connection_select_async(struct solr_connection *conn, const char *query,
+			     pool_t pool,
+			     solr_connection_select_callback_t *callback,
+			     void *context)
+{
+	struct solr_connection_select *select;
+	const char *url;
 
-	conn->request_status = 0;
-	http_client_wait(solr_http_client);
+	select = i_new(struct solr_connection_select, 1);
+	select->conn = conn;
+	select->ioloop = current_ioloop;
+	select->callback = callback;
+	select->context = context;
 
-	if (conn->request_status < 0 ||
-	    solr_lookup_context.content_state == SOLR_XML_CONTENT_STATE_ERROR)
-		return -1;
+	select->lookup.result_pool = pool;
+	hash_table_create(&select->lookup.mailboxes, default_pool, 0,
+			  str_hash, strcmp);
+	p_array_init(&select->lookup.results, pool, 32);
+
+	select->xml_parser = XML_ParserCreate("UTF-8");
+	if (select->xml_parser == NULL) {
+		i_fatal_status(FATAL_OUTOFMEM,
+			       "fts_solr: Failed to allocate XML parser");
+	}
+	XML_SetElementHandler(select->xml_parser,
+			      solr_lookup_xml_start, solr_lookup_xml_end);
+	XML_SetCharacterDataHandler(select->xml_parser, solr_lookup_xml_data);
+	XML_SetUserData(select->xml_parser, &select->lookup);
+	DLLIST_PREPEND(&solr_selects, select);
+	conn->selects_count++;
 
-	parse_ret = solr_xml_parse(conn, "", 0, TRUE);
-	hash_table_destroy(&solr_lookup_context.mailboxes);
+	url = t_strconcat(conn->http_base_url, "select?", query, NULL);
+	select->http_req = http_client_request(solr_http_client, "GET",
+					       conn->http_host, url,
+					       solr_connection_select_response,
+					       select);
+	http_client_request_set_port(select->http_req, conn->http_port);
+	http_client_request_set_ssl(select->http_req, conn->http_ssl);
+	http_client_request_submit(select->http_req);
+	return select;
+}
 
-	array_append_zero(&solr_lookup_context.results);
-	*box_results_r = array_idx_modifiable(&solr_lookup_context.results, 0);
-	return parse_ret;
+void solr_connection_select_abort(struct solr_connection_select **_select)
+{
+	solr_connection_select_free(_select);
 }
 
 static void
@@ -472,6 +693,8 @@ solr_connection_update_response(const struct http_response *response,
 			response->status, response->reason);
 		conn->request_status = -1;
 	}
+	conn->post_pending = FALSE;
+	solr_connection_wait_stop(conn);
 }
 
 static struct http_client_request *
@@ -502,7 +725,6 @@ solr_connection_post_begin(struct solr_connection *conn)
 	post = i_new(struct solr_connection_post, 1);
 	post->conn = conn;
 	post->http_req = solr_connection_post_request(conn);
-	XML_ParserReset(conn->xml_parser, "UTF-8");
 	return post;
 }
 
@@ -550,19 +772,179 @@ int solr_connection_post(struct solr_connection *conn, const char *cmd)
 {
 	struct http_client_request *http_req;
 	struct istream *post_payload;
+	struct ioloop *prev_ioloop;
 
 	i_assert(!conn->posting);
 
+	prev_ioloop = solr_connection_wait_begin(conn);
 	http_req = solr_connection_post_request(conn);
 	post_payload = i_stream_create_from_data(cmd, strlen(cmd));
 	http_client_request_set_payload(http_req, post_payload, TRUE);
 	i_stream_unref(&post_payload);
 	http_client_request_submit(http_req);
 
-	XML_ParserReset(conn->xml_parser, "UTF-8");
-
 	conn->request_status = 0;
-	http_client_wait(solr_http_client);
+	conn->post_pending = TRUE;
+	while (conn->post_pending)
+		io_loop_run(conn->wait_ioloop);
+	solr_connection_wait_end(conn, prev_ioloop);
 
 	return conn->request_status;
 }
+
+static void solr_connection_update_free(struct solr_connection_update *update)
+{
+	i_stream_unref(&update->payload);
+	i_free(update);
+}
+
+static void
+solr_connection_update_async_response(const struct http_response *response,
+				      struct solr_connection_update *update)
+{
+	struct solr_connection *conn = update->conn;
+
+	if (response->status / 100 != 2) {
+		i_error("fts_solr: Indexing failed: %u %s",
+			response->status, response->reason);
+		conn->updates_failed = TRUE;
+	}
+	i_assert(conn->updates_pending > 0);
+	conn->updates_pending--;
+
+	/* the response may arrive before the whole body has been given to
+	   us, e.g. if the server fails the request early */
+	if (update->ended)
+		solr_connection_update_free(update);
+	else
+		update->finished = TRUE;
+	solr_connection_wait_stop(conn);
+}
+
+static void
+solr_connection_update_wait_pending(struct solr_connection *conn,
+				    unsigned int max_pending)
+{
+	struct ioloop *prev_ioloop;
+
+	if (conn->updates_pending <= max_pending)
+		return;
+
+	prev_ioloop = solr_connection_wait_begin(conn);
+	while (conn->updates_pending > max_pending)
+		io_loop_run(conn->wait_ioloop);
+	solr_connection_wait_end(conn, prev_ioloop);
+}
+
+static void solr_connection_run_pending(struct solr_connection *conn)
+{
+	struct ioloop *prev_ioloop;
+	struct timeout *to;
+
+	/* handle whatever the HTTP client can do right now without
+	   blocking: send more of the request bodies and process the
+	   responses that have already arrived */
+	prev_ioloop = solr_connection_wait_begin(conn);
+	to = timeout_add_short(0, io_loop_stop, conn->wait_ioloop);
+	io_loop_run(conn->wait_ioloop);
+	timeout_remove(&to);
+	solr_connection_wait_end(conn, prev_ioloop);
+}
+
+struct solr_connection_update *
+solr_connection_update_begin(struct solr_connection *conn)
+{
+	struct solr_connection_update *update;
+	struct http_client_request *http_req;
+
+	i_assert(!conn->updating);
+
+	/* don't allow more than the configured number of requests to be
+	   in flight */
+	solr_connection_update_wait_pending(conn,
+					    conn->max_pending_updates - 1);
+
+	update = i_new(struct solr_connection_update, 1);
+	update->conn = conn;
+	update->payload = i_stream_create_chain(&update->payload_chain);
+
+	http_req = http_client_request(solr_http_client, "POST",
+				       conn->http_host, conn->http_update_url,
+				       solr_connection_update_async_response,
+				       update);
+	http_client_request_set_port(http_req, conn->http_port);
+	http_client_request_set_ssl(http_req, conn->http_ssl);
+	http_client_request_add_header(http_req, "Content-Type",
+				       "application/json");
+	/* the body is sent with chunked encoding while it's being
+	   appended */
+	http_client_request_set_payload(http_req, update->payload, FALSE);
+	http_client_request_submit(http_req);
+
+	conn->updating = TRUE;
+	conn->updates_pending++;
+	return update;
+}
+
+void solr_connection_update_more(struct solr_connection_update *update,
+				 const void *data, size_t size)
+{
+	struct istream *input;
+
+	i_assert(!update->ended);
+
+	if (update->finished || size == 0)
+		return;
+
+	input = i_stream_create_copy_from_data(data, size);
+	i_stream_chain_append(update->payload_chain, input);
+	i_stream_unref(&input);
+	/* the chain stream doesn't notify its own io */
+	i_stream_set_input_pending(update->payload, TRUE);
+
+	update->progress_size += size;
+	if (update->progress_size >= SOLR_UPDATE_PROGRESS_SIZE) {
+		update->progress_size = 0;
+		solr_connection_run_pending(update->conn);
+	}
+}
+
+void solr_connection_update_end(struct solr_connection_update **_update)
+{
+	struct solr_connection_update *update = *_update;
+
+	*_update = NULL;
+	i_assert(!update->ended);
+	i_assert(update->conn->updating);
+
+	update->conn->updating = FALSE;
+	i_stream_chain_append_eof(update->payload_chain);
+	i_stream_set_input_pending(update->payload, TRUE);
+
+	if (update->finished)
+		solr_connection_update_free(update);
+	else
+		update->ended = TRUE;
+}
+
+void solr_connection_update(struct solr_connection *conn,
+			    const void *data, size_t size)
+{
+	struct solr_connection_update *update;
+
+	update = solr_connection_update_begin(conn);
+	solr_connection_update_more(update, data, size);
+	solr_connection_update_end(&update);
+}
+
+int solr_connection_update_wait(struct solr_connection *conn)
+{
+	int ret;
+
+	i_assert(!conn->updating);
+
+	solr_connection_update_wait_pending(conn, 0);
+	ret = conn->updates_failed ? -1 : 0;
+	conn->updates_failed = FALSE;
+	return ret;
+}
@@ -4,7 +4,10 @@
 #include "seq-range-array.h"
 #include "fts-api.h"
 
+struct fts_solr_settings;
 struct solr_connection;
+struct solr_connection_select;
+struct solr_connection_update;
 
 struct solr_result {
 	const char *box_id;
@@ -13,12 +16,33 @@ struct solr_result {
 	ARRAY_TYPE(fts_score_map) scores;
 };
 
-int solr_connection_init(const char *url, bool debug,
+int solr_connection_init(const struct fts_solr_settings *solr_set,
 			 struct solr_connection **conn_r, const char **error_r);
 void solr_connection_deinit(struct solr_connection **conn);
 
+/* box_results is a NULL-terminated array of the results, allocated from
+   the pool given to select. */
+typedef void solr_connection_select_callback_t(int ret,
+					       struct solr_result **box_results,
+					       void *context);
+
 int solr_connection_select(struct solr_connection *conn, const char *query,
 			   pool_t pool, struct solr_result ***box_results_r);
+/* Send a select request without waiting for the reply. The callback is
+   called from the current ioloop once the reply has been parsed, but never
+   before this function returns. */
+struct solr_connection_select *
+solr_connection_select_async(struct solr_connection *conn, const char *query,
+			     pool_t pool,
+			     solr_connection_select_callback_t *callback,
+			     void *context);
+#define solr_connection_select_async(conn, query, pool, callback, context) \
+	solr_connection_select_async(conn, query, pool, \
+		(solr_connection_select_callback_t *)callback, \
+		(void *)((char *)context + CALLBACK_TYPECHECK(callback, \
+			void (*)(int, struct solr_result **, typeof(context)))))
+/* Abort the select request. The callback isn't called. */
+void solr_connection_select_abort(struct solr_connection_select **select);
 int solr_connection_post(struct solr_connection *conn, const char *cmd);
 
 struct solr_connection_post *
@@ -27,4 +51,24 @@ void solr_connection_post_more(struct solr_connection_post *post,
 			       const unsigned char *data, size_t size);
 int solr_connection_post_end(struct solr_connection_post **post);
 
+/* Start sending a JSON update request asynchronously. If
+   max_parallel_updates requests are already pending, wait until one of them
+   finishes. Only one update can be built at a time. */
+struct solr_connection_update *
+solr_connection_update_begin(struct solr_connection *conn);
+/* Append more data to the update request's body. The body is streamed to
+   Solr while it's being built, and the earlier requests' responses are
+   handled at the same time. */
+void solr_connection_update_more(struct solr_connection_update *update,
+				 const void *data, size_t size);
+/* Finish the update request's body. The response is handled
+   asynchronously. */
+void solr_connection_update_end(struct solr_connection_update **update);
+/* Send the whole JSON update request asynchronously. */
+void solr_connection_update(struct solr_connection *conn,
+			    const void *data, size_t size);
+/* Wait until all the pending update requests have finished. Returns 0 if
+   all of them succeeded since the previous call, -1 if not. */
+int solr_connection_update_wait(struct solr_connection *conn);
+
 #endif
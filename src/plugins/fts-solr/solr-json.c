@@ -0,0 +1,68 @@
+/* Copyright (c) 2016 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "str.h"
+#include "unichar.h"
+#include "solr-json.h"
+
+static bool is_valid_unichar(unichar_t chr)
+{
+	/* UTF-16 surrogates aren't valid characters */
+	if (chr >= 0xd800 && chr < 0xe000)
+		return FALSE;
+	return chr <= 0x10ffff;
+}
+
+void solr_json_encode_data(string_t *dest, const unsigned char *data,
+			   size_t len)
+{
+	unichar_t chr;
+	size_t i;
+	int char_len;
+
+	for (i = 0; i < len; i++) {
+		switch (data[i]) {
+		case '"':
+			str_append(dest, "\\\"");
+			break;
+		case '\\':
+			str_append(dest, "\\\\");
+			break;
+		case '\t':
+			str_append(dest, "\\t");
+			break;
+		case '\n':
+			str_append(dest, "\\n");
+			break;
+		case '\r':
+			str_append(dest, "\\r");
+			break;
+		default:
+			if (data[i] < 32) {
+				/* SOLR doesn't like control characters.
+				   replace them with spaces. */
+				str_append_c(dest, ' ');
+			} else if (data[i] >= 0x80) {
+				/* make sure the character is valid UTF-8 so
+				   we don't get JSON parser errors */
+				char_len = uni_utf8_get_char_n(data + i,
+							       len - i, &chr);
+				if (char_len > 0 && is_valid_unichar(chr)) {
+					str_append_n(dest, data + i, char_len);
+					i += char_len - 1;
+				} else {
+					str_append_n(dest, utf8_replacement_char,
+						     UTF8_REPLACEMENT_CHAR_LEN);
+				}
+			} else {
+				str_append_c(dest, data[i]);
+			}
+			break;
+		}
+	}
+}
+
+void solr_json_encode(string_t *dest, const char *str)
+{
+	solr_json_encode_data(dest, (const unsigned char *)str, strlen(str));
+}
@@ -0,0 +1,11 @@
+#ifndef SOLR_JSON_H
+#define SOLR_JSON_H
+
+/* Append data escaped as a JSON string's contents. Control characters are
+   replaced with spaces, since Solr doesn't like them, and invalid UTF-8
+   sequences with the Unicode replacement character. */
+void solr_json_encode_data(string_t *dest, const unsigned char *data,
+			   size_t len);
+void solr_json_encode(string_t *dest, const char *str);
+
+#endif
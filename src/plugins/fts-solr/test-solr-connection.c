@@ -0,0 +1,388 @@
+/* Copyright (c) 2016 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "str.h"
+#include "hostpid.h"
+#include "ioloop.h"
+#include "istream.h"
+#include "write-full.h"
+#include "time-util.h"
+#include "http-url.h"
+#include "http-request.h"
+#include "http-server.h"
+#include "http-client.h"
+#include "fts-solr-plugin.h"
+#include "solr-connection.h"
+#include "test-common.h"
+
+#include <sys/wait.h>
+#include <signal.h>
+#include <unistd.h>
+
+#define TEST_BATCH_COUNT 50
+#define TEST_BATCH_SIZE 1000
+
+struct http_client *solr_http_client = NULL;
+
+static struct ip_addr bind_ip;
+static in_port_t bind_port = 0;
+static int fd_listen = -1;
+static int fd_count[2] = { -1, -1 };
+static pid_t server_pid = (pid_t)-1;
+
+/*
+ * Mock Solr server
+ */
+
+static struct http_server *http_server;
+static struct io *io_listen;
+static unsigned int server_docs_count = 0;
+
+static unsigned int test_count_docs(const char *data)
+{
+	unsigned int count = 0;
+
+	while ((data = strstr(data, "{\"uid\":")) != NULL) {
+		count++;
+		data++;
+	}
+	return count;
+}
+
+struct server_request {
+	struct http_server_request *req;
+	struct istream *payload;
+	struct io *io;
+	string_t *body;
+};
+
+static void server_request_finish(struct server_request *sreq)
+{
+	struct http_server_request *req = sreq->req;
+	struct http_server_response *resp;
+	const char *body = str_c(sreq->body);
+
+	if (strstr(body, "\"fail\"") != NULL) {
+		http_server_request_fail(req, 500, "Internal Server Error");
+		return;
+	}
+	server_docs_count += test_count_docs(body);
+	if (strstr(body, "{\"commit\":") != NULL) {
+		/* let the client know how many documents we've received */
+		const char *count_str =
+			t_strdup_printf("%u\n", server_docs_count);
+		if (write_full(fd_count[1], count_str, strlen(count_str)) < 0)
+			i_fatal("write(count pipe) failed: %m");
+	}
+	resp = http_server_response_create(req, 200, "OK");
+	http_server_response_submit(resp);
+}
+
+static void server_request_payload_input(struct server_request *sreq)
+{
+	const unsigned char *data;
+	size_t size;
+	int ret;
+
+	/* the update requests' bodies are chunked and may arrive slowly,
+	   so read them without blocking */
+	while ((ret = i_stream_read_more(sreq->payload, &data, &size)) > 0) {
+		str_append_n(sreq->body, data, size);
+		i_stream_skip(sreq->payload, size);
+	}
+	if (ret == 0)
+		return;
+	i_assert(sreq->payload->stream_errno == 0);
+
+	io_remove(&sreq->io);
+	i_stream_unref(&sreq->payload);
+	server_request_finish(sreq);
+	http_server_request_unref(&sreq->req);
+	str_free(&sreq->body);
+	i_free(sreq);
+}
+
+static void
+server_handle_request(void *context ATTR_UNUSED,
+		      struct http_server_request *req)
+{
+	const struct http_request *hreq = http_server_request_get(req);
+	struct server_request *sreq;
+
+	if (strcmp(hreq->method, "POST") != 0 ||
+	    strcmp(hreq->target.url->path, "/solr/update") != 0) {
+		http_server_request_fail(req, 404, "Not found");
+		return;
+	}
+
+	sreq = i_new(struct server_request, 1);
+	sreq->req = req;
+	http_server_request_ref(req);
+	sreq->body = str_new(default_pool, 1024*64);
+	sreq->payload = http_server_request_get_payload_input(req, FALSE);
+	sreq->io = io_add_istream(sreq->payload,
+				  server_request_payload_input, sreq);
+	server_request_payload_input(sreq);
+}
+
+static void server_connection_destroy(void *context ATTR_UNUSED,
+				      const char *reason ATTR_UNUSED)
+{
+}
+
+static const struct http_server_callbacks server_callbacks = {
+	.connection_destroy = server_connection_destroy,
+	.handle_request = server_handle_request
+};
+
+static void server_accept(void *context ATTR_UNUSED)
+{
+	int fd;
+
+	fd = net_accept(fd_listen, NULL, NULL);
+	if (fd == -1)
+		return;
+	if (fd == -2)
+		i_fatal("test server: accept() failed: %m");
+
+	net_set_nonblock(fd, TRUE);
+	(void)http_server_connection_create(http_server, fd, fd, FALSE,
+					    &server_callbacks, NULL);
+}
+
+static void test_server_run(void)
+{
+	struct http_server_settings http_set;
+	struct ioloop *ioloop;
+
+	memset(&http_set, 0, sizeof(http_set));
+	http_set.request_limits.max_payload_size = (uoff_t)-1;
+
+	ioloop = io_loop_create();
+	io_listen = io_add(fd_listen, IO_READ, server_accept, (void *)NULL);
+	http_server = http_server_init(&http_set);
+	io_loop_run(ioloop);
+	/* killed before we get here */
+	i_unreached();
+}
+
+static void test_server_start(void)
+{
+	fd_listen = net_listen(&bind_ip, &bind_port, 128);
+	if (fd_listen == -1) {
+		i_fatal("listen(%s:%u) failed: %m",
+			net_ip2addr(&bind_ip), bind_port);
+	}
+	if (pipe(fd_count) < 0)
+		i_fatal("pipe() failed: %m");
+
+	if ((server_pid = fork()) == (pid_t)-1)
+		i_fatal("fork() failed: %m");
+	if (server_pid == 0) {
+		server_pid = (pid_t)-1;
+		hostpid_init();
+		i_close_fd(&fd_count[0]);
+		test_server_run();
+	}
+	i_close_fd(&fd_listen);
+	i_close_fd(&fd_count[1]);
+}
+
+static void test_server_kill(void)
+{
+	if (server_pid != (pid_t)-1) {
+		(void)kill(server_pid, SIGKILL);
+		(void)waitpid(server_pid, NULL, 0);
+	}
+	server_pid = (pid_t)-1;
+	i_close_fd(&fd_count[0]);
+}
+
+static unsigned int test_server_read_count(void)
+{
+	char buf[32];
+	ssize_t ret;
+
+	ret = read(fd_count[0], buf, sizeof(buf)-1);
+	if (ret <= 0)
+		i_fatal("read(count pipe) failed: %m");
+	buf[ret] = '\0';
+	return strtoul(buf, NULL, 10);
+}
+
+/*
+ * Tests
+ */
+
+static struct solr_connection *test_solr_connection_init(void)
+{
+	struct fts_solr_settings set;
+	struct solr_connection *conn;
+	const char *error;
+
+	memset(&set, 0, sizeof(set));
+	set.url = t_strdup_printf("http://%s:%u/solr/",
+				  net_ip2addr(&bind_ip), bind_port);
+	set.max_parallel_updates = 4;
+	if (solr_connection_init(&set, &conn, &error) < 0)
+		i_fatal("solr_connection_init() failed: %s", error);
+	return conn;
+}
+
+static void test_solr_append_batch(string_t *str, unsigned int first_uid)
+{
+	unsigned int i;
+
+	str_truncate(str, 0);
+	str_append_c(str, '[');
+	for (i = 0; i < TEST_BATCH_SIZE; i++) {
+		if (i > 0)
+			str_append_c(str, ',');
+		str_printfa(str, "{\"uid\":%u,\"box\":\"%032x\","
+			    "\"user\":\"testuser\",\"id\":\"%u/%032x/testuser\","
+			    "\"hdr\":\"Subject: test message %u\","
+			    "\"body\":\"Lorem ipsum dolor sit amet, "
+			    "consectetur adipiscing elit.\"}",
+			    first_uid + i, 0, first_uid + i, 0, first_uid + i);
+	}
+	str_append_c(str, ']');
+}
+
+static void test_solr_connection_update(void)
+{
+	struct solr_connection *conn;
+	struct timeval start_time, end_time;
+	string_t *str = t_str_new(1024*128);
+	const char *cmd;
+	unsigned int i, msecs, docs_count;
+
+	test_begin("solr connection update");
+	conn = test_solr_connection_init();
+
+	if (gettimeofday(&start_time, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
+	for (i = 0; i < TEST_BATCH_COUNT; i++) {
+		test_solr_append_batch(str, i * TEST_BATCH_SIZE + 1);
+		solr_connection_update(conn, str_data(str), str_len(str));
+	}
+	/* the updates are sent over parallel connections, so the commit
+	   could otherwise overtake some of them */
+	test_assert(solr_connection_update_wait(conn) == 0);
+	cmd = "{\"commit\":{\"softCommit\":true}}";
+	solr_connection_update(conn, cmd, strlen(cmd));
+	test_assert(solr_connection_update_wait(conn) == 0);
+	if (gettimeofday(&end_time, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
+
+	docs_count = test_server_read_count();
+	test_assert(docs_count == TEST_BATCH_COUNT * TEST_BATCH_SIZE);
+	solr_connection_deinit(&conn);
+	test_end();
+
+	msecs = I_MAX(timeval_diff_msecs(&end_time, &start_time), 1);
+	test_out(t_strdup_printf("solr connection update: %u docs/sec",
+				 (unsigned int)((unsigned long long)docs_count *
+						1000 / msecs)), TRUE);
+}
+
+static void test_solr_connection_update_stream(void)
+{
+	struct solr_connection *conn;
+	struct solr_connection_update *update;
+	string_t *str = t_str_new(1024*128);
+	const char *cmd, *p;
+	unsigned int i, docs_count, start_count;
+	size_t size;
+
+	test_begin("solr connection update stream");
+	conn = test_solr_connection_init();
+
+	/* get the server's current document count */
+	cmd = "{\"commit\":{}}";
+	solr_connection_update(conn, cmd, strlen(cmd));
+	test_assert(solr_connection_update_wait(conn) == 0);
+	start_count = test_server_read_count();
+
+	/* the body is given in small pieces, which add up to multiple
+	   batches. the earlier failing request finishes while the body is
+	   still being built. */
+	cmd = "{\"fail\":true}";
+	solr_connection_update(conn, cmd, strlen(cmd));
+	update = solr_connection_update_begin(conn);
+	solr_connection_update_more(update, "[", 1);
+	for (i = 0; i < 3; i++) {
+		test_solr_append_batch(str, i * TEST_BATCH_SIZE + 1);
+		/* drop the batch's [] */
+		p = str_c(str) + 1;
+		size = str_len(str) - 2;
+		if (i > 0)
+			solr_connection_update_more(update, ",", 1);
+		for (; size > 100; p += 100, size -= 100)
+			solr_connection_update_more(update, p, 100);
+		solr_connection_update_more(update, p, size);
+	}
+	solr_connection_update_more(update, "]", 1);
+	solr_connection_update_end(&update);
+	test_expect_errors(1);
+	test_assert(solr_connection_update_wait(conn) < 0);
+	test_expect_no_more_errors();
+
+	cmd = "{\"commit\":{}}";
+	solr_connection_update(conn, cmd, strlen(cmd));
+	test_assert(solr_connection_update_wait(conn) == 0);
+	docs_count = test_server_read_count();
+	test_assert(docs_count - start_count == 3 * TEST_BATCH_SIZE);
+	solr_connection_deinit(&conn);
+	test_end();
+}
+
+static void test_solr_connection_update_failure(void)
+{
+	struct solr_connection *conn;
+	string_t *str = t_str_new(1024*128);
+	const char *cmd;
+
+	test_begin("solr connection update failure");
+	conn = test_solr_connection_init();
+
+	test_solr_append_batch(str, 1);
+	solr_connection_update(conn, str_data(str), str_len(str));
+	cmd = "{\"fail\":true}";
+	solr_connection_update(conn, cmd, strlen(cmd));
+	test_expect_errors(1);
+	test_assert(solr_connection_update_wait(conn) < 0);
+	test_expect_no_more_errors();
+
+	/* the failure is reported only once */
+	solr_connection_update(conn, str_data(str), str_len(str));
+	test_assert(solr_connection_update_wait(conn) == 0);
+	solr_connection_deinit(&conn);
+	test_end();
+}
+
+int main(void)
+{
+	static void (*test_functions[])(void) = {
+		test_solr_connection_update,
+		test_solr_connection_update_stream,
+		test_solr_connection_update_failure,
+		NULL
+	};
+	struct ioloop *ioloop;
+	int ret;
+
+	lib_init();
+	if (net_addr2ip("127.0.0.1", &bind_ip) < 0)
+		i_unreached();
+	test_server_start();
+
+	ioloop = io_loop_create();
+	ret = test_run(test_functions);
+	if (solr_http_client != NULL)
+		http_client_deinit(&solr_http_client);
+	io_loop_destroy(&ioloop);
+
+	test_server_kill();
+	lib_deinit();
+	return ret;
+}
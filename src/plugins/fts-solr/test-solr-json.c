@@ -0,0 +1,99 @@
+/* Copyright (c) 2016 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "str.h"
+#include "unichar.h"
+#include "solr-json.h"
+#include "test-common.h"
+
+#define REPLACEMENT_CHAR "\xef\xbf\xbd"
+
+static void test_solr_json_encode(void)
+{
+	static const struct {
+		const char *input, *output;
+	} tests[] = {
+		{ "", "" },
+		{ "plain text 123", "plain text 123" },
+		{ "\"quoted\"", "\\\"quoted\\\"" },
+		{ "back\\slash", "back\\\\slash" },
+		{ "tab\there", "tab\\there" },
+		{ "line1\r\nline2\n", "line1\\r\\nline2\\n" },
+		/* control characters become spaces */
+		{ "a\001b\033c\037d", "a b c d" },
+		{ "\x7f", "\x7f" },
+		/* valid UTF-8 is kept as it is */
+		{ "p\xc3\xa4iv\xc3\xa4\xc3\xa4", "p\xc3\xa4iv\xc3\xa4\xc3\xa4" },
+		{ "\xe2\x82\xac", "\xe2\x82\xac" },
+		{ "\xf0\x9f\x98\x80", "\xf0\x9f\x98\x80" },
+		/* JSON-looking input is escaped, not interpreted */
+		{ "\\u0041\"}", "\\\\u0041\\\"}" },
+	};
+	string_t *str = t_str_new(128);
+	unsigned int i;
+
+	test_begin("solr json encode");
+	for (i = 0; i < N_ELEMENTS(tests); i++) {
+		str_truncate(str, 0);
+		solr_json_encode(str, tests[i].input);
+		test_assert_idx(strcmp(str_c(str), tests[i].output) == 0, i);
+	}
+	test_end();
+}
+
+static void test_solr_json_encode_invalid_utf8(void)
+{
+	static const struct {
+		const char *input, *output;
+	} tests[] = {
+		/* invalid start byte */
+		{ "a\xff" "b", "a"REPLACEMENT_CHAR"b" },
+		/* truncated sequence at the end */
+		{ "a\xc3", "a"REPLACEMENT_CHAR },
+		/* continuation byte without a start byte */
+		{ "\x80" "x", REPLACEMENT_CHAR"x" },
+		/* UTF-16 surrogate encoded as UTF-8. each byte is replaced
+		   separately. */
+		{ "\xed\xa0\x80",
+		  REPLACEMENT_CHAR REPLACEMENT_CHAR REPLACEMENT_CHAR },
+	};
+	string_t *str = t_str_new(128);
+	unsigned int i;
+
+	test_begin("solr json encode invalid utf8");
+	for (i = 0; i < N_ELEMENTS(tests); i++) {
+		str_truncate(str, 0);
+		solr_json_encode(str, tests[i].input);
+		test_assert_idx(strcmp(str_c(str), tests[i].output) == 0, i);
+		/* the output must be valid UTF-8 */
+		test_assert_idx(uni_utf8_data_is_valid(str_data(str),
+						       str_len(str)), i);
+	}
+	test_end();
+}
+
+static void test_solr_json_encode_data(void)
+{
+	static const unsigned char data[] = { 'a', '\0', 'b', '"', '\0' };
+	string_t *str = t_str_new(32);
+
+	test_begin("solr json encode data");
+	/* NULs are control characters as well */
+	solr_json_encode_data(str, data, sizeof(data));
+	test_assert(strcmp(str_c(str), "a b\\\" ") == 0);
+	/* appends to the existing string */
+	solr_json_encode_data(str, (const unsigned char *)"\n", 1);
+	test_assert(strcmp(str_c(str), "a b\\\" \\n") == 0);
+	test_end();
+}
+
+int main(void)
+{
+	static void (*test_functions[])(void) = {
+		test_solr_json_encode,
+		test_solr_json_encode_invalid_utf8,
+		test_solr_json_encode_data,
+		NULL
+	};
+	return test_run(test_functions);
+}
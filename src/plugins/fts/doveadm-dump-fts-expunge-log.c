@@ -100,7 +100,8 @@ static bool test_dump_fts_expunge_log(const char *path)
 		p++;
 	else
 		p = path;
-	return strcmp(p, "dovecot-expunges.log") == 0;
+	return strcmp(p, "dovecot-expunges.log") == 0 ||
+		strcmp(p, "dovecot-fts-expunges.log") == 0;
 }
 
 static const struct doveadm_cmd_dump doveadm_cmd_dump_fts_expunge_log = {
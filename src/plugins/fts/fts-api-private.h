@@ -50,6 +50,19 @@ struct fts_backend_vfuncs {
 			    enum fts_lookup_flags flags,
 			    struct fts_multi_result *result);
 	void (*lookup_done)(struct fts_backend *backend);
+
+	/* Allocate a lookup context with struct fts_backend_lookup_async as
+	   its first member and start the lookup. Call
+	   fts_backend_lookup_async_finished() once it's done. */
+	struct fts_backend_lookup_async *
+		(*lookup_async)(struct fts_backend *backend,
+				struct mailbox *box,
+				struct mail_search_arg *args,
+				enum fts_lookup_flags flags,
+				struct fts_result *result);
+	/* Free the lookup context, aborting the lookup if it's still
+	   running. */
+	void (*lookup_async_deinit)(struct fts_backend_lookup_async *lookup);
 };
 
 enum fts_backend_flags {
@@ -79,6 +92,14 @@ struct fts_backend {
 	bool updating:1;
 };
 
+struct fts_backend_lookup_async {
+	struct fts_backend *backend;
+	struct fts_result *result;
+
+	fts_backend_lookup_callback_t *callback;
+	void *context;
+};
+
 struct fts_backend_update_context {
 	struct fts_backend *backend;
 	normalizer_func_t *normalizer;
@@ -101,6 +122,11 @@ struct fts_index_header {
 void fts_backend_register(const struct fts_backend *backend);
 void fts_backend_unregister(const char *name);
 
+/* Called by the backend once the asynchronous lookup is finished. The
+   lookup is freed before the callback is called. */
+void fts_backend_lookup_async_finished(struct fts_backend_lookup_async *lookup,
+				       int ret);
+
 bool fts_backend_default_can_lookup(struct fts_backend *backend,
 				    const struct mail_search_arg *args);
 
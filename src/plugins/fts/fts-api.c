@@ -341,6 +341,14 @@ static int fts_score_map_sort(const struct fts_score_map *m1,
 	return 0;
 }
 
+static void fts_result_sort_scores(struct fts_result *result)
+{
+	if (!result->scores_sorted && array_is_created(&result->scores)) {
+		array_sort(&result->scores, fts_score_map_sort);
+		result->scores_sorted = TRUE;
+	}
+}
+
 int fts_backend_lookup(struct fts_backend *backend, struct mailbox *box,
 		       struct mail_search_arg *args,
 		       enum fts_lookup_flags flags,
@@ -353,13 +361,60 @@ int fts_backend_lookup(struct fts_backend *backend, struct mailbox *box,
 	if (backend->v.lookup(backend, box, args, flags, result) < 0)
 		return -1;
 
-	if (!result->scores_sorted && array_is_created(&result->scores)) {
-		array_sort(&result->scores, fts_score_map_sort);
-		result->scores_sorted = TRUE;
-	}
+	fts_result_sort_scores(result);
 	return 0;
 }
 
+bool fts_backend_can_lookup_async(struct fts_backend *backend)
+{
+	return backend->v.lookup_async != NULL;
+}
+
+#undef fts_backend_lookup_async
+struct fts_backend_lookup_async *
+fts_backend_lookup_async(struct fts_backend *backend, struct mailbox *box,
+			 struct mail_search_arg *args,
+			 enum fts_lookup_flags flags,
+			 struct fts_result *result,
+			 fts_backend_lookup_callback_t *callback,
+			 void *context)
+{
+	struct fts_backend_lookup_async *lookup;
+
+	array_clear(&result->definite_uids);
+	array_clear(&result->maybe_uids);
+	array_clear(&result->scores);
+
+	lookup = backend->v.lookup_async(backend, box, args, flags, result);
+	if (lookup == NULL)
+		return NULL;
+	lookup->backend = backend;
+	lookup->result = result;
+	lookup->callback = callback;
+	lookup->context = context;
+	return lookup;
+}
+
+void fts_backend_lookup_async_finished(struct fts_backend_lookup_async *lookup,
+				       int ret)
+{
+	fts_backend_lookup_callback_t *callback = lookup->callback;
+	void *context = lookup->context;
+
+	if (ret == 0)
+		fts_result_sort_scores(lookup->result);
+	lookup->backend->v.lookup_async_deinit(lookup);
+	callback(ret, context);
+}
+
+void fts_backend_lookup_async_abort(struct fts_backend_lookup_async **_lookup)
+{
+	struct fts_backend_lookup_async *lookup = *_lookup;
+
+	*_lookup = NULL;
+	lookup->backend->v.lookup_async_deinit(lookup);
+}
+
 int fts_backend_lookup_multi(struct fts_backend *backend,
 			     struct mailbox *const boxes[],
 			     struct mail_search_arg *args,
@@ -387,6 +442,7 @@ int fts_backend_lookup_multi(struct fts_backend *backend,
 	for (i = 0; boxes[i] != NULL; i++) {
 		struct fts_result *box_result = &result->box_results[i];
 
+		box_result->box = boxes[i];
 		p_array_init(&box_result->definite_uids, result->pool, 32);
 		p_array_init(&box_result->maybe_uids, result->pool, 32);
 		p_array_init(&box_result->scores, result->pool, 32);
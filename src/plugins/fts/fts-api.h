@@ -7,6 +7,7 @@ struct mail_namespace;
 struct mail_search_arg;
 
 struct fts_backend;
+struct fts_backend_lookup_async;
 
 #include "seq-range-array.h"
 
@@ -139,6 +140,30 @@ int fts_backend_lookup(struct fts_backend *backend, struct mailbox *box,
 		       enum fts_lookup_flags flags,
 		       struct fts_result *result);
 
+typedef void fts_backend_lookup_callback_t(int ret, void *context);
+
+/* Returns TRUE if the backend supports fts_backend_lookup_async(). */
+bool fts_backend_can_lookup_async(struct fts_backend *backend);
+/* Like fts_backend_lookup(), but don't wait for the lookup to finish.
+   The callback is called from the current ioloop once the result has been
+   filled, but never before this function returns. The args and result must
+   stay valid until then. Returns NULL if the lookup couldn't be started. */
+struct fts_backend_lookup_async *
+fts_backend_lookup_async(struct fts_backend *backend, struct mailbox *box,
+			 struct mail_search_arg *args,
+			 enum fts_lookup_flags flags,
+			 struct fts_result *result,
+			 fts_backend_lookup_callback_t *callback,
+			 void *context);
+#define fts_backend_lookup_async(backend, box, args, flags, result, \
+				 callback, context) \
+	fts_backend_lookup_async(backend, box, args, flags, result, \
+		(fts_backend_lookup_callback_t *)callback, \
+		(void *)((char *)context + CALLBACK_TYPECHECK(callback, \
+			void (*)(int, typeof(context)))))
+/* Abort the lookup. The callback isn't called. */
+void fts_backend_lookup_async_abort(struct fts_backend_lookup_async **lookup);
+
 /* Search from multiple mailboxes. result->pool must be initialized. */
 int fts_backend_lookup_multi(struct fts_backend *backend,
 			     struct mailbox *const boxes[],
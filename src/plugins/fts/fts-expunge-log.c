@@ -617,3 +617,48 @@ int fts_expunge_log_flat_write(const struct fts_expunge_log_append_ctx *read_log
 
 	return ret;
 }
+
+int fts_expunge_log_apply(struct fts_expunge_log *log,
+			  fts_expunge_log_apply_callback_t *callback,
+			  void *context)
+{
+	struct fts_expunge_log_read_ctx *read_ctx;
+	const struct fts_expunge_log_read_record *record;
+	struct fts_expunge_log_append_ctx *flattened, *failed_ctx = NULL;
+	struct fts_expunge_log_read_record apply_rec;
+	struct hash_iterate_context *iter;
+	struct fts_expunge_log_mailbox *mailbox;
+	uint8_t *guid_p;
+	int ret;
+
+	/* the log usually has a record for each expunging transaction.
+	   merge them, so each mailbox's expunges get applied at once. */
+	flattened = fts_expunge_log_append_begin(NULL);
+	read_ctx = fts_expunge_log_read_begin(log);
+	while ((record = fts_expunge_log_read_next(read_ctx)) != NULL)
+		fts_expunge_log_append_record(flattened, record);
+	if ((ret = fts_expunge_log_read_end(&read_ctx)) < 0) {
+		(void)fts_expunge_log_append_abort(&flattened);
+		return -1;
+	}
+
+	memset(&apply_rec, 0, sizeof(apply_rec));
+	iter = hash_table_iterate_init(flattened->mailboxes);
+	while (hash_table_iterate(iter, flattened->mailboxes, &guid_p, &mailbox)) {
+		guid_128_copy(apply_rec.mailbox_guid, mailbox->guid);
+		apply_rec.uids = mailbox->uids;
+		if (callback(&apply_rec, context) < 0) {
+			if (failed_ctx == NULL)
+				failed_ctx = fts_expunge_log_append_begin(log);
+			fts_expunge_log_append_record(failed_ctx, &apply_rec);
+		}
+	}
+	hash_table_iterate_deinit(&iter);
+
+	if (failed_ctx != NULL) {
+		(void)fts_expunge_log_append_commit(&failed_ctx);
+		ret = -1;
+	}
+	(void)fts_expunge_log_append_abort(&flattened);
+	return ret;
+}
@@ -55,4 +55,18 @@ int fts_expunge_log_subtract(struct fts_expunge_log_append_ctx *from,
 /* Write a modified flattened log as a new file. */
 int fts_expunge_log_flat_write(const struct fts_expunge_log_append_ctx *flattened,
 			       const char *path);
+
+/* Returns 0 if the expunges were applied, -1 if not. */
+typedef int
+fts_expunge_log_apply_callback_t(const struct fts_expunge_log_read_record *record,
+				 void *context);
+/* Read the entire log and call the callback once for each mailbox with all
+   of its expunged UIDs merged together. The log is unlinked once it has been
+   read. The expunges for which the callback fails are written back to the
+   log, so they can be retried later. Returns 1 if all ok, 0 if the log was
+   corrupted (the readable part was still applied), -1 if reading the log or
+   applying any of the expunges failed. */
+int fts_expunge_log_apply(struct fts_expunge_log *log,
+			  fts_expunge_log_apply_callback_t *callback,
+			  void *context);
 #endif
@@ -0,0 +1,323 @@
+/* Copyright (c) 2016 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "str.h"
+#include "hash-format.h"
+#include "istream.h"
+#include "ostream.h"
+#include "iostream-temp.h"
+#include "iostream-ssl.h"
+#include "fs-api.h"
+#include "module-context.h"
+#include "message-parser.h"
+#include "mail-user.h"
+#include "mail-storage-settings.h"
+#include "fts-parser.h"
+
+#define CACHE_USER_CONTEXT(obj) \
+	MODULE_CONTEXT(obj, fts_parser_cache_user_module)
+
+#define FTS_PARSER_CACHE_DEFAULT_FS "posix"
+
+struct fts_parser_cache_user {
+	union mail_user_module_context module_ctx;
+
+	struct fs *fs;
+	const char *dir;
+	const char *hash_format;
+};
+
+struct cache_fts_parser {
+	struct fts_parser parser;
+	struct fts_parser_cache_user *cuser;
+	/* the real parser, used only if the text isn't already cached */
+	struct fts_parser *parent;
+
+	struct hash_format *hash;
+	struct ostream *body_output;
+	/* cached text on hit, the buffered body on miss */
+	struct istream *input;
+
+	char *path;
+	struct fs_file *file;
+	struct ostream *cache_output;
+
+	bool cache_hit;
+	bool parent_finishing;
+	bool parent_finished;
+	bool failed;
+};
+
+static MODULE_CONTEXT_DEFINE_INIT(fts_parser_cache_user_module,
+				  &mail_user_module_register);
+
+static void fts_parser_cache_user_deinit(struct mail_user *user)
+{
+	struct fts_parser_cache_user *cuser = CACHE_USER_CONTEXT(user);
+
+	fs_deinit(&cuser->fs);
+	cuser->module_ctx.super.deinit(user);
+}
+
+void fts_parser_cache_mail_user_created(struct mail_user *user)
+{
+	const struct mail_storage_settings *mail_set =
+		mail_user_set_get_storage_set(user);
+	struct mail_user_vfuncs *v = user->vlast;
+	struct fts_parser_cache_user *cuser;
+	struct fs_settings fs_set;
+	struct ssl_iostream_settings ssl_set;
+	struct fs *fs;
+	const char *dir, *driver, *args, *error;
+
+	dir = mail_user_plugin_getenv(user, "fts_parser_cache_dir");
+	if (dir == NULL || dir[0] == '\0')
+		return;
+
+	driver = mail_user_plugin_getenv(user, "fts_parser_cache_fs");
+	if (driver == NULL || driver[0] == '\0')
+		driver = FTS_PARSER_CACHE_DEFAULT_FS;
+	args = strpbrk(driver, ": ");
+	if (args == NULL)
+		args = "";
+	else
+		driver = t_strdup_until(driver, args++);
+
+	memset(&ssl_set, 0, sizeof(ssl_set));
+	memset(&fs_set, 0, sizeof(fs_set));
+	mail_user_init_fs_settings(user, &fs_set, &ssl_set);
+	if (fs_init(driver, args, &fs_set, &fs, &error) < 0) {
+		i_error("fts_parser_cache_fs: fs_init(%s) failed: %s",
+			driver, error);
+		return;
+	}
+
+	cuser = p_new(user->pool, struct fts_parser_cache_user, 1);
+	cuser->module_ctx.super = *v;
+	user->vlast = &cuser->module_ctx.super;
+	v->deinit = fts_parser_cache_user_deinit;
+
+	cuser->fs = fs;
+	cuser->dir = p_strdup(user->pool, dir);
+	cuser->hash_format = mail_set->mail_attachment_hash;
+	MODULE_CONTEXT_SET(user, fts_parser_cache_user_module, cuser);
+}
+
+struct fts_parser *
+fts_parser_cache_init(struct mail_user *user, struct fts_parser *parent,
+		      const char *parser_name, const char *content_type)
+{
+	struct fts_parser_cache_user *cuser = CACHE_USER_CONTEXT(user);
+	struct cache_fts_parser *parser;
+	struct hash_format *hash;
+	string_t *temp_prefix;
+	const char *error;
+
+	if (cuser == NULL)
+		return parent;
+
+	if (hash_format_init(cuser->hash_format, &hash, &error) < 0) {
+		/* we already checked this when verifying settings */
+		i_panic("mail_attachment_hash=%s unexpectedly failed: %s",
+			cuser->hash_format, error);
+	}
+
+	parser = i_new(struct cache_fts_parser, 1);
+	parser->parser.v = fts_parser_cache;
+	parser->cuser = cuser;
+	parser->parent = parent;
+	parser->hash = hash;
+	/* different parsers, or the same parser for a different content
+	   type, may extract different text from the same body */
+	hash_format_loop(hash, parser_name, strlen(parser_name) + 1);
+	hash_format_loop(hash, content_type, strlen(content_type) + 1);
+
+	temp_prefix = t_str_new(256);
+	mail_user_set_get_temp_prefix(temp_prefix, user->set);
+	parser->body_output = iostream_temp_create(str_c(temp_prefix), 0);
+	return &parser->parser;
+}
+
+static const char *
+fts_parser_cache_get_path(struct fts_parser_cache_user *cuser,
+			  const char *hash)
+{
+	/* use the same directory layout as mail_attachment_dir */
+	if (strlen(hash) < 4)
+		return t_strdup_printf("%s/%s", cuser->dir, hash);
+	return t_strdup_printf("%s/%c%c/%c%c/%s", cuser->dir,
+			       hash[0], hash[1], hash[2], hash[3], hash);
+}
+
+static void fts_parser_cache_lookup(struct cache_fts_parser *parser)
+{
+	struct fs *fs = parser->cuser->fs;
+	string_t *hash = t_str_new(64);
+	int ret;
+
+	hash_format_write(parser->hash, hash);
+	parser->path = i_strdup(fts_parser_cache_get_path(parser->cuser,
+							  str_c(hash)));
+
+	parser->file = fs_file_init(fs, parser->path, FS_OPEN_MODE_READONLY);
+	if ((ret = fs_exists(parser->file)) < 0) {
+		i_error("fts_parser_cache: %s",
+			fs_file_last_error(parser->file));
+	} else if (ret > 0) {
+		/* the text was already extracted earlier. the buffered
+		   body isn't needed. */
+		parser->cache_hit = TRUE;
+		o_stream_ignore_last_errors(parser->body_output);
+		o_stream_destroy(&parser->body_output);
+		parser->input = fs_read_stream(parser->file, IO_BLOCK_SIZE);
+		return;
+	}
+	fs_file_deinit(&parser->file);
+
+	if (o_stream_nfinish(parser->body_output) < 0) {
+		i_error("fts_parser_cache: write(%s) failed: %s",
+			o_stream_get_name(parser->body_output),
+			o_stream_get_error(parser->body_output));
+		parser->failed = TRUE;
+		return;
+	}
+	parser->input = iostream_temp_finish(&parser->body_output,
+					     IO_BLOCK_SIZE);
+	if (ret == 0) {
+		parser->file = fs_file_init(fs, parser->path,
+					    FS_OPEN_MODE_REPLACE);
+		parser->cache_output = fs_write_stream(parser->file);
+	}
+}
+
+static void
+fts_parser_cache_read_hit(struct cache_fts_parser *parser,
+			  struct message_block *block)
+{
+	const unsigned char *data;
+	size_t size;
+
+	if (i_stream_read_more(parser->input, &data, &size) > 0) {
+		block->data = data;
+		block->size = size;
+		i_stream_skip(parser->input, size);
+	} else if (parser->input->stream_errno != 0) {
+		i_error("fts_parser_cache: read(%s) failed: %s",
+			i_stream_get_name(parser->input),
+			i_stream_get_error(parser->input));
+		parser->failed = TRUE;
+	}
+}
+
+static void
+fts_parser_cache_more_parent(struct cache_fts_parser *parser,
+			     struct message_block *block)
+{
+	struct message_block parent_block;
+	const unsigned char *data;
+	size_t size;
+
+	parent_block = *block;
+	while (!parser->parent_finishing) {
+		if (i_stream_read_more(parser->input, &data, &size) <= 0) {
+			if (parser->input->stream_errno != 0) {
+				i_error("fts_parser_cache: read(%s) failed: %s",
+					i_stream_get_name(parser->input),
+					i_stream_get_error(parser->input));
+				parser->failed = TRUE;
+				return;
+			}
+			parser->parent_finishing = TRUE;
+			break;
+		}
+		parent_block.data = data;
+		parent_block.size = size;
+		parser->parent->v.more(parser->parent, &parent_block);
+		i_stream_skip(parser->input, size);
+		if (parent_block.size > 0)
+			break;
+	}
+	if (parser->parent_finishing) {
+		parent_block.data = NULL;
+		parent_block.size = 0;
+		parser->parent->v.more(parser->parent, &parent_block);
+		if (parent_block.size == 0)
+			parser->parent_finished = TRUE;
+	}
+
+	if (parser->cache_output != NULL) {
+		o_stream_nsend(parser->cache_output, parent_block.data,
+			       parent_block.size);
+	}
+	block->data = parent_block.data;
+	block->size = parent_block.size;
+}
+
+static void fts_parser_cache_more(struct fts_parser *_parser,
+				  struct message_block *block)
+{
+	struct cache_fts_parser *parser = (struct cache_fts_parser *)_parser;
+
+	if (block->size > 0) {
+		/* buffer the whole body first, so we know its hash */
+		hash_format_loop(parser->hash, block->data, block->size);
+		o_stream_nsend(parser->body_output, block->data, block->size);
+		block->size = 0;
+		return;
+	}
+
+	if (parser->failed || parser->parent_finished)
+		return;
+	if (parser->input == NULL) {
+		T_BEGIN {
+			fts_parser_cache_lookup(parser);
+		} T_END;
+		if (parser->failed)
+			return;
+	}
+
+	if (parser->cache_hit)
+		fts_parser_cache_read_hit(parser, block);
+	else
+		fts_parser_cache_more_parent(parser, block);
+}
+
+static int fts_parser_cache_deinit(struct fts_parser *_parser)
+{
+	struct cache_fts_parser *parser = (struct cache_fts_parser *)_parser;
+	bool no_cache = parser->parent->no_cache;
+	int ret = parser->failed ? -1 : 0;
+
+	if (fts_parser_deinit(&parser->parent) < 0)
+		ret = -1;
+	if (parser->cache_output != NULL) {
+		/* cache only text that the parser fully extracted */
+		if (ret < 0 || !parser->parent_finished || no_cache) {
+			fs_write_stream_abort_error(parser->file,
+				&parser->cache_output, "text extraction failed");
+		} else if (fs_write_stream_finish(parser->file,
+						  &parser->cache_output) < 0) {
+			i_error("fts_parser_cache: %s",
+				fs_file_last_error(parser->file));
+		}
+	}
+	if (parser->input != NULL)
+		i_stream_unref(&parser->input);
+	if (parser->body_output != NULL) {
+		o_stream_ignore_last_errors(parser->body_output);
+		o_stream_destroy(&parser->body_output);
+	}
+	if (parser->file != NULL)
+		fs_file_deinit(&parser->file);
+	hash_format_deinit_free(&parser->hash);
+	i_free(parser->path);
+	i_free(parser);
+	return ret;
+}
+
+struct fts_parser_vfuncs fts_parser_cache = {
+	NULL,
+	fts_parser_cache_more,
+	fts_parser_cache_deinit,
+	NULL
+};
@@ -102,6 +102,7 @@ fts_tika_parser_response(const struct http_response *response,
 				response->status, response->reason);
 		}
 		parser->payload = i_stream_create_from_data("", 0);
+		parser->parser.no_cache = TRUE;
 		break;
 	case 500:
 		/* Server Error - the problem could be anything (in Tika or
@@ -118,6 +119,8 @@ fts_tika_parser_response(const struct http_response *response,
 		       mail_user_plugin_getenv(parser->user, "fts_tika"),
 		       response->status, response->reason);
 		parser->payload = i_stream_create_from_data("", 0);
+		/* a later attempt might succeed */
+		parser->parser.no_cache = TRUE;
 		break;
 
 	default:
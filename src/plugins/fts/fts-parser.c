@@ -6,10 +6,15 @@
 #include "message-parser.h"
 #include "fts-parser.h"
 
-static const struct fts_parser_vfuncs *parsers[] = {
-	&fts_parser_html,
-	&fts_parser_script,
-	&fts_parser_tika
+static const struct {
+	const char *name;
+	const struct fts_parser_vfuncs *v;
+	/* the parser is slow enough that its output is worth caching */
+	bool cache;
+} parsers[] = {
+	{ "html", &fts_parser_html, FALSE },
+	{ "script", &fts_parser_script, TRUE },
+	{ "tika", &fts_parser_tika, TRUE }
 };
 
 static const char *plaintext_content_types[] = {
@@ -33,10 +38,16 @@ bool fts_parser_init(struct mail_user *user,
 	}
 
 	for (i = 0; i < N_ELEMENTS(parsers); i++) {
-		*parser_r = parsers[i]->try_init(user, content_type,
-						 content_disposition);
-		if (*parser_r != NULL)
+		*parser_r = parsers[i].v->try_init(user, content_type,
+						   content_disposition);
+		if (*parser_r != NULL) {
+			if (parsers[i].cache) {
+				*parser_r = fts_parser_cache_init(user,
+					*parser_r, parsers[i].name,
+					content_type);
+			}
 			return TRUE;
+		}
 	}
 	return FALSE;
 }
@@ -112,7 +123,7 @@ void fts_parsers_unload(void)
 	unsigned int i;
 
 	for (i = 0; i < N_ELEMENTS(parsers); i++) {
-		if (parsers[i]->unload != NULL)
-			parsers[i]->unload();
+		if (parsers[i].v->unload != NULL)
+			parsers[i].v->unload();
 	}
 }
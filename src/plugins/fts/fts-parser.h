@@ -16,17 +16,32 @@ struct fts_parser_vfuncs {
 struct fts_parser {
 	struct fts_parser_vfuncs v;
 	buffer_t *utf8_output;
+	/* The parser didn't really extract the text, e.g. because of a
+	   temporary error in an external service. Don't cache the output. */
+	bool no_cache;
 };
 
 extern struct fts_parser_vfuncs fts_parser_html;
 extern struct fts_parser_vfuncs fts_parser_script;
 extern struct fts_parser_vfuncs fts_parser_tika;
+extern struct fts_parser_vfuncs fts_parser_cache;
 
 bool fts_parser_init(struct mail_user *user,
 		     const char *content_type, const char *content_disposition,
 		     struct fts_parser **parser_r);
 struct fts_parser *fts_parser_text_init(void);
 
+/* If fts_parser_cache_dir is set, return a parser that looks up the text
+   extracted earlier by the same parser from the same content type and body
+   contents, and runs the parent parser only if it's not found. Otherwise
+   returns the parent parser as-is. Dovecot never removes anything from the
+   cache directory, so old files need to be expired externally (e.g. by
+   deleting files not accessed in a while). */
+struct fts_parser *
+fts_parser_cache_init(struct mail_user *user, struct fts_parser *parent,
+		      const char *parser_name, const char *content_type);
+void fts_parser_cache_mail_user_created(struct mail_user *user);
+
 /* The parser is initially called with message body blocks. Once message is
    finished, it's still called with incoming size=0 while the parser increases
    it to non-zero. */
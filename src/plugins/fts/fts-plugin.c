@@ -13,6 +13,7 @@
 const char *fts_plugin_version = DOVECOT_ABI_VERSION;
 
 static struct mail_storage_hooks fts_mail_storage_hooks = {
+	.mail_user_created = fts_parser_cache_mail_user_created,
 	.mail_namespaces_added = fts_mail_namespaces_added,
 	.mailbox_allocated = fts_mailbox_allocated,
 	.mail_allocated = fts_mail_allocated
@@ -0,0 +1,186 @@
+/* Copyright (c) 2016 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "buffer.h"
+#include "str.h"
+#include "hash.h"
+#include "llist.h"
+#include "seq-range-array.h"
+#include "mail-search.h"
+#include "fts-search-cache.h"
+
+struct fts_search_cache_entry {
+	struct fts_search_cache_entry *prev, *next;
+	pool_t pool;
+
+	/* "<mailbox guid>\t<query>" */
+	char *key;
+	struct fts_search_cache_state state;
+
+	ARRAY_TYPE(seq_range) definite_uids, maybe_uids;
+	ARRAY_TYPE(fts_score_map) scores;
+	bool scores_sorted;
+	buffer_t *args_matches;
+};
+
+struct fts_search_cache {
+	HASH_TABLE(char *, struct fts_search_cache_entry *) hash;
+	/* head is the most recently used entry */
+	struct fts_search_cache_entry *head, *tail;
+
+	unsigned int entries_count, max_entries;
+};
+
+struct fts_search_cache *fts_search_cache_init(unsigned int max_entries)
+{
+	struct fts_search_cache *cache;
+
+	i_assert(max_entries > 0);
+
+	cache = i_new(struct fts_search_cache, 1);
+	cache->max_entries = max_entries;
+	hash_table_create(&cache->hash, default_pool, 0, str_hash, strcmp);
+	return cache;
+}
+
+static void fts_search_cache_entry_free(struct fts_search_cache *cache,
+					struct fts_search_cache_entry *entry)
+{
+	hash_table_remove(cache->hash, entry->key);
+	DLLIST2_REMOVE(&cache->head, &cache->tail, entry);
+	cache->entries_count--;
+	pool_unref(&entry->pool);
+}
+
+void fts_search_cache_deinit(struct fts_search_cache **_cache)
+{
+	struct fts_search_cache *cache = *_cache;
+
+	*_cache = NULL;
+	while (cache->head != NULL)
+		fts_search_cache_entry_free(cache, cache->head);
+	hash_table_destroy(&cache->hash);
+	i_free(cache);
+}
+
+static void fts_search_cache_key_fuzzy(string_t *str,
+				       const struct mail_search_arg *args)
+{
+	for (; args != NULL; args = args->next) {
+		str_append_c(str, args->fuzzy ? '1' : '0');
+		if (args->type == SEARCH_OR || args->type == SEARCH_SUB) {
+			str_append_c(str, '(');
+			fts_search_cache_key_fuzzy(str, args->value.subargs);
+			str_append_c(str, ')');
+		}
+	}
+}
+
+const char *fts_search_cache_key(enum fts_lookup_flags flags,
+				 const struct mail_search_arg *args)
+{
+	string_t *str = t_str_new(128);
+	const char *error;
+
+	/* the IMAP SEARCH syntax doesn't contain the fuzzy flags, so they're
+	   appended separately */
+	str_printfa(str, "%x ", flags);
+	fts_search_cache_key_fuzzy(str, args);
+	str_append_c(str, ' ');
+	if (!mail_search_args_to_imap(str, args, &error))
+		return NULL;
+	return str_c(str);
+}
+
+static void
+fts_search_result_copy(pool_t pool, ARRAY_TYPE(seq_range) *definite_dest,
+		       ARRAY_TYPE(seq_range) *maybe_dest,
+		       ARRAY_TYPE(fts_score_map) *scores_dest,
+		       const ARRAY_TYPE(seq_range) *definite_src,
+		       const ARRAY_TYPE(seq_range) *maybe_src,
+		       const ARRAY_TYPE(fts_score_map) *scores_src)
+{
+	if (!array_is_created(definite_dest))
+		p_array_init(definite_dest, pool, 8);
+	if (!array_is_created(maybe_dest))
+		p_array_init(maybe_dest, pool, 8);
+	if (!array_is_created(scores_dest))
+		p_array_init(scores_dest, pool, 8);
+
+	/* lookup_multi() may leave the arrays uncreated for mailboxes
+	   without any matches */
+	if (array_is_created(definite_src))
+		array_append_array(definite_dest, definite_src);
+	if (array_is_created(maybe_src))
+		array_append_array(maybe_dest, maybe_src);
+	if (array_is_created(scores_src))
+		array_append_array(scores_dest, scores_src);
+}
+
+bool fts_search_cache_lookup(struct fts_search_cache *cache,
+			     const char *mailbox_guid, const char *query,
+			     const struct fts_search_cache_state *state,
+			     pool_t pool, struct fts_result *result,
+			     buffer_t *args_matches)
+{
+	struct fts_search_cache_entry *entry;
+	const char *key;
+
+	key = t_strconcat(mailbox_guid, "\t", query, NULL);
+	entry = hash_table_lookup(cache->hash, key);
+	if (entry == NULL)
+		return FALSE;
+	if (memcmp(&entry->state, state, sizeof(*state)) != 0) {
+		/* mailbox has changed since the results were cached */
+		fts_search_cache_entry_free(cache, entry);
+		return FALSE;
+	}
+
+	/* move to the head of the LRU list */
+	DLLIST2_REMOVE(&cache->head, &cache->tail, entry);
+	DLLIST2_PREPEND(&cache->head, &cache->tail, entry);
+
+	fts_search_result_copy(pool, &result->definite_uids,
+			       &result->maybe_uids, &result->scores,
+			       &entry->definite_uids, &entry->maybe_uids,
+			       &entry->scores);
+	result->scores_sorted = entry->scores_sorted;
+	buffer_append_buf(args_matches, entry->args_matches, 0, (size_t)-1);
+	return TRUE;
+}
+
+void fts_search_cache_add(struct fts_search_cache *cache,
+			  const char *mailbox_guid, const char *query,
+			  const struct fts_search_cache_state *state,
+			  const struct fts_result *result,
+			  const buffer_t *args_matches)
+{
+	struct fts_search_cache_entry *entry;
+	const char *key;
+	pool_t pool;
+
+	key = t_strconcat(mailbox_guid, "\t", query, NULL);
+	entry = hash_table_lookup(cache->hash, key);
+	if (entry != NULL)
+		fts_search_cache_entry_free(cache, entry);
+	if (cache->entries_count == cache->max_entries)
+		fts_search_cache_entry_free(cache, cache->tail);
+
+	pool = pool_alloconly_create("fts search cache entry", 1024);
+	entry = p_new(pool, struct fts_search_cache_entry, 1);
+	entry->pool = pool;
+	entry->key = p_strdup(pool, key);
+	entry->state = *state;
+	fts_search_result_copy(pool, &entry->definite_uids,
+			       &entry->maybe_uids, &entry->scores,
+			       &result->definite_uids, &result->maybe_uids,
+			       &result->scores);
+	entry->scores_sorted = result->scores_sorted;
+	entry->args_matches = buffer_create_dynamic(pool, args_matches->used);
+	buffer_append_buf(entry->args_matches, args_matches, 0, (size_t)-1);
+
+	hash_table_insert(cache->hash, entry->key, entry);
+	DLLIST2_PREPEND(&cache->head, &cache->tail, entry);
+	cache->entries_count++;
+}
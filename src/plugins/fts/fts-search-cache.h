@@ -0,0 +1,45 @@
+#ifndef FTS_SEARCH_CACHE_H
+#define FTS_SEARCH_CACHE_H
+
+#include "fts-api.h"
+
+#define FTS_SEARCH_CACHE_DEFAULT_SIZE 16
+
+/* Mailbox state that the cached results are valid for. If any of these
+   change, the cached results for the mailbox are dropped. */
+struct fts_search_cache_state {
+	uint32_t uid_validity;
+	uint32_t uid_next;
+	uint32_t messages_count;
+	uint32_t last_indexed_uid;
+	uint64_t highest_modseq;
+};
+
+/* Cache of FTS backend lookup results, keyed by mailbox GUID and the
+   normalized search query. At most max_entries results are kept, with the
+   least recently used ones dropped first. */
+struct fts_search_cache *fts_search_cache_init(unsigned int max_entries);
+void fts_search_cache_deinit(struct fts_search_cache **cache);
+
+/* Return the normalized query used as the cache key for the search args
+   looked up with the flags, or NULL if the args can't be cached. */
+const char *fts_search_cache_key(enum fts_lookup_flags flags,
+				 const struct mail_search_arg *args);
+
+/* Look up the results for the query. If found and still valid for the
+   given mailbox state, copy the results to result and the serialized
+   search arg matches to args_matches, both allocated from pool, and return
+   TRUE. Results for an older mailbox state are dropped. */
+bool fts_search_cache_lookup(struct fts_search_cache *cache,
+			     const char *mailbox_guid, const char *query,
+			     const struct fts_search_cache_state *state,
+			     pool_t pool, struct fts_result *result,
+			     buffer_t *args_matches);
+/* Add the results of a backend lookup to the cache. */
+void fts_search_cache_add(struct fts_search_cache *cache,
+			  const char *mailbox_guid, const char *query,
+			  const struct fts_search_cache_state *state,
+			  const struct fts_result *result,
+			  const buffer_t *args_matches);
+
+#endif
@@ -7,9 +7,50 @@
 #include "mail-search.h"
 #include "fts-api-private.h"
 #include "fts-search-args.h"
+#include "fts-search-cache.h"
 #include "fts-search-serialize.h"
 #include "fts-storage.h"
 
+struct fts_search_single_lookup {
+	struct mail_search_arg *args;
+	enum fts_lookup_flags flags;
+	unsigned int level_idx;
+	struct fts_result result;
+
+	/* cache is NULL if the results aren't cached */
+	struct fts_search_cache *cache;
+	const char *key, *guid;
+	struct fts_search_cache_state state;
+};
+
+struct fts_search_async_level {
+	struct mail_search_arg *args;
+	bool and_args;
+};
+
+struct fts_search_async_lookup {
+	struct fts_search_context *fctx;
+
+	/* levels in the order fts_search_lookup_level() looks them up */
+	ARRAY(struct fts_search_async_level) levels;
+	unsigned int next_level_idx;
+
+	struct fts_search_single_lookup single;
+	struct fts_backend_lookup_async *backend_lookup;
+
+	fts_search_lookup_callback_t *callback;
+	void *context;
+	/* fts_search_lookup_async() has returned */
+	bool started;
+};
+
+struct fts_search_multi_box {
+	struct mailbox *box;
+	/* NULL if the mailbox's results aren't cached */
+	const char *key, *guid;
+	struct fts_search_cache_state state;
+};
+
 static void
 uid_range_to_seqs(struct fts_search_context *fctx,
 		  const ARRAY_TYPE(seq_range) *uid_range,
@@ -32,32 +73,113 @@ uid_range_to_seqs(struct fts_search_context *fctx,
 	}
 }
 
-static int fts_search_lookup_level_single(struct fts_search_context *fctx,
-					  struct mail_search_arg *args,
-					  bool and_args)
+static bool
+fts_search_cache_get_state(struct mailbox *box, uint32_t last_indexed_uid,
+			   struct fts_search_cache_state *state_r,
+			   const char **guid_r)
 {
-	enum fts_lookup_flags flags = fctx->flags |
-		(and_args ? FTS_LOOKUP_FLAG_AND_ARGS : 0);
-	struct fts_search_level *level;
-	struct fts_result result;
+	struct mailbox_status status;
+
+	if (fts_mailbox_get_guid(box, guid_r) < 0)
+		return FALSE;
+	mailbox_get_open_status(box, STATUS_UIDVALIDITY | STATUS_UIDNEXT |
+				STATUS_MESSAGES | STATUS_HIGHESTMODSEQ, &status);
+
+	memset(state_r, 0, sizeof(*state_r));
+	state_r->uid_validity = status.uidvalidity;
+	state_r->uid_next = status.uidnext;
+	state_r->messages_count = status.messages;
+	state_r->last_indexed_uid = last_indexed_uid;
+	state_r->highest_modseq = status.highest_modseq;
+	return TRUE;
+}
 
-	memset(&result, 0, sizeof(result));
-	p_array_init(&result.definite_uids, fctx->result_pool, 32);
-	p_array_init(&result.maybe_uids, fctx->result_pool, 32);
-	p_array_init(&result.scores, fctx->result_pool, 32);
+/* Returns TRUE if the results were found from the search cache, FALSE if
+   they need to be looked up from the backend. */
+static bool
+fts_search_single_lookup_init(struct fts_search_context *fctx,
+			      struct mail_search_arg *args, bool and_args,
+			      struct fts_search_single_lookup *lookup_r)
+{
+	struct fts_search_single_lookup *lookup = lookup_r;
+	struct fts_search_level *level;
+	const char *key, *guid;
 
-	mail_search_args_reset(args, TRUE);
-	if (fts_backend_lookup(fctx->backend, fctx->box, args, flags,
-			       &result) < 0)
-		return -1;
+	memset(lookup, 0, sizeof(*lookup));
+	lookup->args = args;
+	lookup->flags = fctx->flags |
+		(and_args ? FTS_LOOKUP_FLAG_AND_ARGS : 0);
+	p_array_init(&lookup->result.definite_uids, fctx->result_pool, 32);
+	p_array_init(&lookup->result.maybe_uids, fctx->result_pool, 32);
+	p_array_init(&lookup->result.scores, fctx->result_pool, 32);
 
+	lookup->level_idx = array_count(&fctx->levels);
 	level = array_append_space(&fctx->levels);
 	level->args_matches = buffer_create_dynamic(fctx->result_pool, 16);
-	fts_search_serialize(level->args_matches, args);
 
-	uid_range_to_seqs(fctx, &result.definite_uids, &level->definite_seqs);
-	uid_range_to_seqs(fctx, &result.maybe_uids, &level->maybe_seqs);
-	level->score_map = result.scores;
+	lookup->cache = fts_mailbox_search_cache(fctx->box);
+	if (lookup->cache != NULL &&
+	    fts_search_cache_get_state(fctx->box, fctx->last_indexed_uid,
+				       &lookup->state, &guid)) {
+		/* the lookup may finish only after the data stack frame is
+		   gone */
+		key = fts_search_cache_key(lookup->flags, args);
+		lookup->key = p_strdup(fctx->result_pool, key);
+		lookup->guid = p_strdup(fctx->result_pool, guid);
+	}
+	if (lookup->key != NULL &&
+	    fts_search_cache_lookup(lookup->cache, lookup->guid, lookup->key,
+				    &lookup->state, fctx->result_pool,
+				    &lookup->result, level->args_matches)) {
+		/* same query with the same mailbox state - the backend
+		   would return the same results */
+		fctx->t->stats.fts_cache_hit_count++;
+		return TRUE;
+	}
+	mail_search_args_reset(args, TRUE);
+	return FALSE;
+}
+
+static void
+fts_search_single_lookup_finish(struct fts_search_context *fctx,
+				struct fts_search_single_lookup *lookup,
+				bool cached)
+{
+	struct fts_search_level *level;
+
+	level = array_idx_modifiable(&fctx->levels, lookup->level_idx);
+	if (!cached) {
+		fts_search_serialize(level->args_matches, lookup->args);
+		if (lookup->key != NULL) {
+			fts_search_cache_add(lookup->cache, lookup->guid,
+					     lookup->key, &lookup->state,
+					     &lookup->result,
+					     level->args_matches);
+			fctx->t->stats.fts_cache_miss_count++;
+		}
+	}
+
+	uid_range_to_seqs(fctx, &lookup->result.definite_uids,
+			  &level->definite_seqs);
+	uid_range_to_seqs(fctx, &lookup->result.maybe_uids,
+			  &level->maybe_seqs);
+	level->score_map = lookup->result.scores;
+}
+
+static int fts_search_lookup_level_single(struct fts_search_context *fctx,
+					  struct mail_search_arg *args,
+					  bool and_args)
+{
+	struct fts_search_single_lookup lookup;
+	bool cached;
+
+	cached = fts_search_single_lookup_init(fctx, args, and_args, &lookup);
+	if (!cached) {
+		if (fts_backend_lookup(fctx->backend, fctx->box, args,
+				       lookup.flags, &lookup.result) < 0)
+			return -1;
+	}
+	fts_search_single_lookup_finish(fctx, &lookup, cached);
 	return 0;
 }
 
@@ -148,17 +270,146 @@ multi_add_lookup_result(struct fts_search_context *fctx,
 	return 0;
 }
 
+static struct fts_result *
+multi_result_find_box(struct fts_multi_result *result, struct mailbox *box)
+{
+	unsigned int i;
+
+	for (i = 0; result->box_results[i].box != NULL; i++) {
+		if (result->box_results[i].box == box)
+			return &result->box_results[i];
+	}
+	return NULL;
+}
+
+static int
+fts_search_lookup_multi_cached(struct fts_search_context *fctx,
+			       struct fts_search_level *level,
+			       struct mail_search_arg *args,
+			       struct fts_search_multi_box *mbox)
+{
+	struct fts_search_cache *cache = fts_mailbox_search_cache(mbox->box);
+	struct fts_multi_result result;
+	buffer_t *args_matches;
+
+	memset(&result, 0, sizeof(result));
+	result.box_results = t_new(struct fts_result, 2);
+	result.box_results[0].box = mbox->box;
+	args_matches = buffer_create_dynamic(pool_datastack_create(), 16);
+	if (!fts_search_cache_lookup(cache, mbox->guid, mbox->key, &mbox->state,
+				     fctx->result_pool, &result.box_results[0],
+				     args_matches))
+		return 0;
+
+	fctx->t->stats.fts_cache_hit_count++;
+	fts_search_deserialize(args, args_matches);
+	if (multi_add_lookup_result(fctx, level, args, &result) < 0)
+		return -1;
+	return 1;
+}
+
+static void
+fts_search_multi_cache_add(struct fts_search_context *fctx,
+			   struct mail_search_arg *args,
+			   struct fts_multi_result *result,
+			   const struct fts_search_multi_box *mboxes,
+			   unsigned int count)
+{
+	struct fts_result empty_result, *br;
+	buffer_t *args_matches;
+	unsigned int i;
+
+	memset(&empty_result, 0, sizeof(empty_result));
+	args_matches = buffer_create_dynamic(pool_datastack_create(), 16);
+	fts_search_serialize(args_matches, args);
+
+	/* fan out the results back to the mailboxes' own caches. mailboxes
+	   without any matches may be missing from the results. */
+	for (i = 0; i < count; i++) {
+		if (mboxes[i].key == NULL)
+			continue;
+		br = multi_result_find_box(result, mboxes[i].box);
+		fts_search_cache_add(fts_mailbox_search_cache(mboxes[i].box),
+				     mboxes[i].guid, mboxes[i].key,
+				     &mboxes[i].state,
+				     br != NULL ? br : &empty_result,
+				     args_matches);
+		fctx->t->stats.fts_cache_miss_count++;
+	}
+}
+
+static int
+fts_search_lookup_multi_backend(struct fts_search_context *fctx,
+				struct fts_search_level *level,
+				struct fts_backend *backend,
+				struct mail_search_arg *args,
+				enum fts_lookup_flags flags,
+				struct mailbox *const *boxes,
+				unsigned int count)
+{
+	ARRAY_TYPE(mailboxes) lookup_boxes;
+	ARRAY(struct fts_search_multi_box) lookup_mboxes;
+	struct fts_search_multi_box mbox;
+	struct fts_multi_result result;
+	const char *key = NULL;
+	uint32_t last_uid;
+	unsigned int i;
+	int ret;
+
+	t_array_init(&lookup_boxes, count + 1);
+	t_array_init(&lookup_mboxes, count);
+	for (i = 0; i < count; i++) {
+		memset(&mbox, 0, sizeof(mbox));
+		mbox.box = boxes[i];
+		if (fts_mailbox_search_cache(boxes[i]) != NULL &&
+		    fts_backend_get_last_uid(backend, boxes[i], &last_uid) == 0 &&
+		    fts_search_cache_get_state(boxes[i], last_uid,
+					       &mbox.state, &mbox.guid)) {
+			if (key == NULL)
+				key = fts_search_cache_key(flags, args);
+			mbox.key = key;
+		}
+		if (mbox.key != NULL) {
+			ret = fts_search_lookup_multi_cached(fctx, level,
+							     args, &mbox);
+			if (ret < 0)
+				return -1;
+			if (ret > 0)
+				continue;
+		}
+		array_append(&lookup_boxes, &boxes[i], 1);
+		array_append(&lookup_mboxes, &mbox, 1);
+	}
+	if (array_count(&lookup_boxes) == 0) {
+		/* everything was found from cache */
+		return 0;
+	}
+	array_append_zero(&lookup_boxes);
+
+	memset(&result, 0, sizeof(result));
+	result.pool = fctx->result_pool;
+	mail_search_args_reset(args, TRUE);
+	if (fts_backend_lookup_multi(backend, array_idx(&lookup_boxes, 0),
+				     args, flags, &result) < 0)
+		return -1;
+	if (multi_add_lookup_result(fctx, level, args, &result) < 0)
+		return -1;
+	fts_search_multi_cache_add(fctx, args, &result,
+				   array_idx(&lookup_mboxes, 0),
+				   array_count(&lookup_mboxes));
+	return 0;
+}
+
 static int fts_search_lookup_level_multi(struct fts_search_context *fctx,
 					 struct mail_search_arg *args,
 					 bool and_args)
 {
 	enum fts_lookup_flags flags = fctx->flags |
 		(and_args ? FTS_LOOKUP_FLAG_AND_ARGS : 0);
-	ARRAY_TYPE(mailboxes) mailboxes_arr, tmp_mailboxes;
+	ARRAY_TYPE(mailboxes) mailboxes_arr;
 	struct mailbox *const *mailboxes;
 	struct fts_backend *backend;
 	struct fts_search_level *level;
-	struct fts_multi_result result;
 	unsigned int i, j, mailbox_count;
 
 	p_array_init(&mailboxes_arr, fctx->result_pool, 8);
@@ -166,34 +417,21 @@ static int fts_search_lookup_level_multi(struct fts_search_context *fctx,
 		&mailboxes_arr, TRUE);
 	array_sort(&mailboxes_arr, mailbox_cmp_fts_backend);
 
-	memset(&result, 0, sizeof(result));
-	result.pool = fctx->result_pool;
-
 	level = array_append_space(&fctx->levels);
 	level->args_matches = buffer_create_dynamic(fctx->result_pool, 16);
 	p_array_init(&level->score_map, fctx->result_pool, 1);
 
+	/* do a single lookup for all the mailboxes sharing a backend */
 	mailboxes = array_get(&mailboxes_arr, &mailbox_count);
-	t_array_init(&tmp_mailboxes, mailbox_count);
 	for (i = 0; i < mailbox_count; i = j) {
-		array_clear(&tmp_mailboxes);
-		array_append(&tmp_mailboxes, &mailboxes[i], 1);
-
 		backend = fts_mailbox_backend(mailboxes[i]);
 		for (j = i + 1; j < mailbox_count; j++) {
 			if (fts_mailbox_backend(mailboxes[j]) != backend)
 				break;
-			array_append(&tmp_mailboxes, &mailboxes[j], 1);
 		}
-		array_append_zero(&tmp_mailboxes);
-
-		mail_search_args_reset(args, TRUE);
-		if (fts_backend_lookup_multi(backend,
-					     array_idx(&tmp_mailboxes, 0),
-					     args, flags, &result) < 0)
-			return -1;
-
-		if (multi_add_lookup_result(fctx, level, args, &result) < 0)
+		if (fts_search_lookup_multi_backend(fctx, level, backend, args,
+						    flags, mailboxes + i,
+						    j - i) < 0)
 			return -1;
 	}
 	return 0;
@@ -336,7 +574,7 @@ static void fts_search_merge_scores(struct fts_search_context *fctx)
 				      TRUE, &fctx->scores->score_map);
 }
 
-void fts_search_lookup(struct fts_search_context *fctx)
+static int fts_search_lookup_init(struct fts_search_context *fctx)
 {
 	uint32_t last_uid, seq1, seq2;
 
@@ -344,20 +582,25 @@ void fts_search_lookup(struct fts_search_context *fctx)
 	i_assert(fctx->args->simplified);
 
 	if (fts_backend_refresh(fctx->backend) < 0)
-		return;
+		return -1;
 	if (fts_backend_get_last_uid(fctx->backend, fctx->box, &last_uid) < 0)
-		return;
+		return -1;
+	fctx->last_indexed_uid = last_uid;
 	mailbox_get_seq_range(fctx->box, last_uid+1, (uint32_t)-1,
 			      &seq1, &seq2);
 	fctx->first_unindexed_seq = seq1 != 0 ? seq1 : (uint32_t)-1;
 
 	if ((fctx->backend->flags & FTS_BACKEND_FLAG_TOKENIZED_INPUT) != 0) {
 		if (fts_search_args_expand(fctx->backend, fctx->args) < 0)
-			return;
+			return -1;
 	}
 	fts_search_serialize(fctx->orig_matches, fctx->args->args);
+	return 0;
+}
 
-	if (fts_search_lookup_level(fctx, fctx->args->args, TRUE) == 0) {
+static void fts_search_lookup_deinit(struct fts_search_context *fctx, int ret)
+{
+	if (ret == 0) {
 		fctx->fts_lookup_success = TRUE;
 		fts_search_merge_scores(fctx);
 	}
@@ -365,3 +608,141 @@ void fts_search_lookup(struct fts_search_context *fctx)
 	fts_search_deserialize(fctx->args->args, fctx->orig_matches);
 	fts_backend_lookup_done(fctx->backend);
 }
+
+void fts_search_lookup(struct fts_search_context *fctx)
+{
+	if (fts_search_lookup_init(fctx) < 0)
+		return;
+
+	fts_search_lookup_deinit(fctx,
+		fts_search_lookup_level(fctx, fctx->args->args, TRUE));
+}
+
+static void
+fts_search_async_levels_add(struct fts_search_async_lookup *alookup,
+			    struct mail_search_arg *args, bool and_args)
+{
+	struct fts_search_async_level *level;
+
+	level = array_append_space(&alookup->levels);
+	level->args = args;
+	level->and_args = and_args;
+
+	for (; args != NULL; args = args->next) {
+		if (args->type != SEARCH_OR && args->type != SEARCH_SUB)
+			continue;
+		fts_search_async_levels_add(alookup, args->value.subargs,
+					    args->type == SEARCH_SUB);
+	}
+}
+
+static void
+fts_search_lookup_async_finish(struct fts_search_async_lookup *alookup,
+			       int ret)
+{
+	struct fts_search_context *fctx = alookup->fctx;
+	fts_search_lookup_callback_t *callback = alookup->callback;
+	void *context = alookup->context;
+	bool started = alookup->started;
+
+	fctx->async_lookup = NULL;
+	array_free(&alookup->levels);
+	i_free(alookup);
+
+	fts_search_lookup_deinit(fctx, ret);
+	if (started)
+		callback(context);
+}
+
+static void
+fts_search_lookup_async_callback(int ret,
+				 struct fts_search_async_lookup *alookup);
+
+static void fts_search_lookup_async_next(struct fts_search_async_lookup *alookup)
+{
+	struct fts_search_context *fctx = alookup->fctx;
+	const struct fts_search_async_level *level;
+	bool cached;
+
+	/* the levels are looked up one at a time, because each lookup
+	   resets the match state of all the args below it */
+	while (alookup->next_level_idx < array_count(&alookup->levels)) {
+		level = array_idx(&alookup->levels, alookup->next_level_idx++);
+		T_BEGIN {
+			cached = fts_search_single_lookup_init(fctx,
+				level->args, level->and_args, &alookup->single);
+		} T_END;
+		if (cached) {
+			fts_search_single_lookup_finish(fctx, &alookup->single,
+							TRUE);
+			continue;
+		}
+
+		T_BEGIN {
+			alookup->backend_lookup =
+				fts_backend_lookup_async(fctx->backend,
+					fctx->box, level->args,
+					alookup->single.flags,
+					&alookup->single.result,
+					fts_search_lookup_async_callback,
+					alookup);
+		} T_END;
+		if (alookup->backend_lookup == NULL)
+			fts_search_lookup_async_finish(alookup, -1);
+		return;
+	}
+	fts_search_lookup_async_finish(alookup, 0);
+}
+
+static void
+fts_search_lookup_async_callback(int ret,
+				 struct fts_search_async_lookup *alookup)
+{
+	alookup->backend_lookup = NULL;
+	if (ret < 0) {
+		fts_search_lookup_async_finish(alookup, -1);
+		return;
+	}
+	fts_search_single_lookup_finish(alookup->fctx, &alookup->single, FALSE);
+	fts_search_lookup_async_next(alookup);
+}
+
+#undef fts_search_lookup_async
+bool fts_search_lookup_async(struct fts_search_context *fctx,
+			     fts_search_lookup_callback_t *callback,
+			     void *context)
+{
+	struct fts_search_async_lookup *alookup;
+
+	i_assert(fctx->async_lookup == NULL);
+	i_assert(!fctx->virtual_mailbox);
+
+	if (fts_search_lookup_init(fctx) < 0)
+		return FALSE;
+
+	alookup = i_new(struct fts_search_async_lookup, 1);
+	alookup->fctx = fctx;
+	alookup->callback = callback;
+	alookup->context = context;
+	i_array_init(&alookup->levels, 8);
+	fts_search_async_levels_add(alookup, fctx->args->args, TRUE);
+	fctx->async_lookup = alookup;
+
+	fts_search_lookup_async_next(alookup);
+	if (fctx->async_lookup == NULL) {
+		/* finished already, e.g. all the results were cached */
+		return FALSE;
+	}
+	alookup->started = TRUE;
+	return TRUE;
+}
+
+void fts_search_lookup_async_abort(struct fts_search_context *fctx)
+{
+	struct fts_search_async_lookup *alookup = fctx->async_lookup;
+
+	if (alookup->backend_lookup != NULL)
+		fts_backend_lookup_async_abort(&alookup->backend_lookup);
+	alookup->started = FALSE;
+	fts_search_lookup_async_finish(alookup, -1);
+}
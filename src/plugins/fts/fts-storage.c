@@ -15,6 +15,8 @@
 #include "fts-indexer.h"
 #include "fts-build-mail.h"
 #include "fts-search-serialize.h"
+#include "fts-search-cache.h"
+#include "fts-expunge-log.h"
 #include "fts-plugin.h"
 #include "fts-storage.h"
 
@@ -29,17 +31,26 @@
 #define INDEXER_SOCKET_NAME "indexer"
 #define INDEXER_HANDSHAKE "VERSION\tindexer\t1\t0\n"
 
+#define FTS_EXPUNGE_LOG_NAME "dovecot-fts-expunges.log"
+
 struct fts_mailbox_list {
 	union mailbox_list_module_context module_ctx;
 	struct fts_backend *backend;
+	struct fts_search_cache *search_cache;
+	/* expunges waiting for the indexer to apply them to the backend */
+	struct fts_expunge_log *expunge_log;
 
 	struct fts_backend_update_context *update_ctx;
 	unsigned int update_ctx_refcount;
+
+	bool deferred_expunges:1;
 };
 
 struct fts_mailbox {
 	union mailbox_module_context module_ctx;
 	struct fts_backend_update_context *sync_update_ctx;
+	struct fts_expunge_log_append_ctx *sync_expunge_ctx;
+	guid_128_t sync_expunge_guid;
 	bool fts_mailbox_excluded;
 };
 
@@ -108,7 +119,6 @@ fts_mailbox_get_status(struct mailbox *box, enum mailbox_status_items items,
 	return 0;
 }
 
-
 static void fts_scores_unref(struct fts_scores **_scores)
 {
 	struct fts_scores *scores = *_scores;
@@ -120,6 +130,29 @@ static void fts_scores_unref(struct fts_scores **_scores)
 	}
 }
 
+static void fts_search_lookup_or_defer(struct fts_search_context *fctx)
+{
+	if (!fctx->virtual_mailbox &&
+	    fts_backend_can_lookup_async(fctx->backend)) {
+		/* do the lookup on the first search_next*() call, so the
+		   caller can still enable asynchronous lookups */
+		fctx->lookup_deferred = TRUE;
+	} else {
+		fts_search_lookup(fctx);
+	}
+}
+
+static void fts_search_lookup_start(struct mail_search_context *ctx,
+				    struct fts_search_context *fctx)
+{
+	if (ctx->async_callback == NULL || fctx->virtual_mailbox ||
+	    !fts_backend_can_lookup_async(fctx->backend))
+		fts_search_lookup(fctx);
+	else if (fts_search_lookup_async(fctx, mailbox_search_async_continue,
+					 ctx))
+		ctx->async_waiting = TRUE;
+}
+
 static void fts_try_build_init(struct mail_search_context *ctx,
 			       struct fts_search_context *fctx)
 {
@@ -134,7 +167,7 @@ static void fts_try_build_init(struct mail_search_context *ctx,
 
 	if (ret == 0) {
 		/* the index was up to date */
-		fts_search_lookup(fctx);
+		fts_search_lookup_or_defer(fctx);
 	} else {
 		/* hide "searching" notifications while building index */
 		ctx->progress_hidden = TRUE;
@@ -237,7 +270,7 @@ fts_mailbox_search_init(struct mailbox_transaction_context *t,
 	if (fctx->enforced || fts_want_build_args(args->args))
 		fts_try_build_init(ctx, fctx);
 	else
-		fts_search_lookup(fctx);
+		fts_search_lookup_or_defer(fctx);
 	return ctx;
 }
 
@@ -255,7 +288,7 @@ static bool fts_mailbox_build_continue(struct mail_search_context *ctx)
 	if (fts_indexer_deinit(&fctx->indexer_ctx) < 0)
 		ret = -1;
 	if (ret > 0)
-		fts_search_lookup(fctx);
+		fts_search_lookup_start(ctx, fctx);
 	if (ret < 0) {
 		/* if indexing timed out, it probably means that
 		   the mailbox is still being indexed, but it's a large
@@ -295,6 +328,15 @@ fts_mailbox_search_next_nonblock(struct mail_search_context *ctx,
 			return FALSE;
 		}
 	}
+	if (fctx != NULL && fctx->lookup_deferred) {
+		fctx->lookup_deferred = FALSE;
+		fts_search_lookup_start(ctx, fctx);
+	}
+	if (fctx != NULL && fctx->async_lookup != NULL) {
+		/* waiting for the backend */
+		*tryagain_r = TRUE;
+		return FALSE;
+	}
 	if (fctx != NULL && !fctx->fts_lookup_success && fctx->enforced)
 		return FALSE;
 
@@ -333,6 +375,11 @@ static bool fts_mailbox_search_next_update_seq(struct mail_search_context *ctx)
 	struct fts_search_context *fctx = FTS_CONTEXT(ctx);
 	unsigned int idx;
 
+	if (fctx != NULL && fctx->lookup_deferred) {
+		/* search_next_nonblock() wasn't called */
+		fctx->lookup_deferred = FALSE;
+		fts_search_lookup(fctx);
+	}
 	if (fctx == NULL || !fctx->fts_lookup_success) {
 		/* fts lookup not done for this search */
 		if (fctx != NULL && fctx->indexing_timed_out)
@@ -369,6 +416,8 @@ static int fts_mailbox_search_deinit(struct mail_search_context *ctx)
 			if (fts_indexer_deinit(&fctx->indexer_ctx) < 0)
 				ft->failed = TRUE;
 		}
+		if (fctx->async_lookup != NULL)
+			fts_search_lookup_async_abort(fctx);
 		if (fctx->indexing_timed_out)
 			ret = -1;
 		if (!fctx->fts_lookup_success && fctx->enforced) {
@@ -660,6 +709,48 @@ fts_transaction_commit(struct mailbox_transaction_context *t,
 	return 0;
 }
 
+static void fts_mailbox_expunge_defer(struct mailbox *box, uint32_t uid)
+{
+	struct fts_mailbox_list *flist = FTS_LIST_CONTEXT(box->list);
+	struct fts_mailbox *fbox = FTS_CONTEXT(box);
+	struct mailbox_metadata metadata;
+
+	if (fbox->sync_expunge_ctx == NULL) {
+		if (mailbox_get_metadata(box, MAILBOX_METADATA_GUID,
+					 &metadata) < 0) {
+			i_error("fts: Failed to get mailbox %s GUID: %s",
+				box->vname, mailbox_get_last_error(box, NULL));
+			return;
+		}
+		guid_128_copy(fbox->sync_expunge_guid, metadata.guid);
+		fbox->sync_expunge_ctx =
+			fts_expunge_log_append_begin(flist->expunge_log);
+	}
+	fts_expunge_log_append_next(fbox->sync_expunge_ctx,
+				    fbox->sync_expunge_guid, uid);
+}
+
+static void
+fts_mailbox_expunges_queue(struct mailbox *box, bool notify_indexer)
+{
+	struct fts_mailbox *fbox = FTS_CONTEXT(box);
+	struct mail_user *user = box->storage->user;
+	const char *cmd, *path;
+	int fd;
+
+	if (fts_expunge_log_append_commit(&fbox->sync_expunge_ctx) < 0 ||
+	    !notify_indexer)
+		return;
+
+	/* the indexer applies the expunge log when optimizing */
+	cmd = t_strdup_printf("OPTIMIZE\t0\t%s\t%s\n",
+			      str_tabescape(user->username),
+			      str_tabescape(box->vname));
+	fd = fts_indexer_cmd(user, cmd, &path);
+	if (fd != -1)
+		i_close_fd(&fd);
+}
+
 static void fts_mailbox_sync_notify(struct mailbox *box, uint32_t uid,
 				    enum mailbox_sync_type sync_type)
 {
@@ -677,6 +768,12 @@ static void fts_mailbox_sync_notify(struct mailbox *box, uint32_t uid,
 		return;
 	}
 
+	if (flist->deferred_expunges) {
+		/* don't slow down the sync by updating the backend now */
+		fts_mailbox_expunge_defer(box, uid);
+		return;
+	}
+
 	if (fbox->sync_update_ctx == NULL) {
 		if (fts_backend_is_updating(flist->backend)) {
 			/* FIXME: maildir workaround - we could get here
@@ -690,6 +787,60 @@ static void fts_mailbox_sync_notify(struct mailbox *box, uint32_t uid,
 	fts_backend_update_expunge(fbox->sync_update_ctx, uid);
 }
 
+static int
+fts_expunges_apply_mailbox(const struct fts_expunge_log_read_record *record,
+			   void *context)
+{
+	struct mailbox_list *list = context;
+	struct fts_mailbox_list *flist = FTS_LIST_CONTEXT(list);
+	struct fts_backend_update_context *update_ctx;
+	struct mailbox *box;
+	struct seq_range_iter iter;
+	enum mail_error error;
+	const char *errstr;
+	unsigned int n = 0;
+	uint32_t uid;
+	int ret = 0;
+
+	box = mailbox_alloc_guid(list, record->mailbox_guid, 0);
+	if (mailbox_open(box) < 0) {
+		errstr = mailbox_get_last_error(box, &error);
+		if (error != MAIL_ERROR_NOTFOUND) {
+			i_error("fts: Failed to open mailbox with GUID %s "
+				"for applying expunges: %s",
+				guid_128_to_string(record->mailbox_guid),
+				errstr);
+			ret = -1;
+		}
+		/* otherwise the mailbox was already deleted */
+		mailbox_free(&box);
+		return ret;
+	}
+
+	update_ctx = fts_backend_update_init(flist->backend);
+	fts_backend_update_set_mailbox(update_ctx, box);
+	seq_range_array_iter_init(&iter, &record->uids);
+	while (seq_range_array_iter_nth(&iter, n++, &uid))
+		fts_backend_update_expunge(update_ctx, uid);
+	if (fts_backend_update_deinit(&update_ctx) < 0)
+		ret = -1;
+	mailbox_free(&box);
+	return ret;
+}
+
+static int fts_mailbox_list_apply_expunges(struct mailbox_list *list)
+{
+	struct fts_mailbox_list *flist = FTS_LIST_CONTEXT(list);
+
+	if (fts_backend_is_updating(flist->backend)) {
+		/* leave them for the next time */
+		return 0;
+	}
+	return fts_expunge_log_apply(flist->expunge_log,
+				     fts_expunges_apply_mailbox, list) < 0 ?
+		-1 : 0;
+}
+
 static int fts_sync_deinit(struct mailbox_sync_context *ctx,
 			   struct mailbox_sync_status *status_r)
 {
@@ -697,15 +848,26 @@ static int fts_sync_deinit(struct mailbox_sync_context *ctx,
 	struct fts_mailbox *fbox = FTS_CONTEXT(box);
 	struct fts_mailbox_list *flist = FTS_LIST_CONTEXT(box->list);
 	bool optimize;
-	int ret = 0;
+	int ret;
 
 	optimize = (ctx->flags & (MAILBOX_SYNC_FLAG_FORCE_RESYNC |
 				  MAILBOX_SYNC_FLAG_OPTIMIZE)) != 0;
-	if (fbox->module_ctx.super.sync_deinit(ctx, status_r) < 0)
-		return -1;
+	ret = fbox->module_ctx.super.sync_deinit(ctx, status_r);
 	ctx = NULL;
+	if (fbox->sync_expunge_ctx != NULL) {
+		/* when optimizing, the expunges are applied already below */
+		fts_mailbox_expunges_queue(box, !optimize);
+	}
+	if (ret < 0)
+		return -1;
 
 	if (optimize) {
+		if (fts_mailbox_list_apply_expunges(box->list) < 0) {
+			mail_storage_set_critical(box->storage,
+				"FTS expunges for mailbox %s failed",
+				box->vname);
+			ret = -1;
+		}
 		if (fts_backend_optimize(flist->backend) < 0) {
 			mail_storage_set_critical(box->storage,
 				"FTS optimize for mailbox %s failed",
@@ -826,6 +988,9 @@ static void fts_mailbox_list_deinit(struct mailbox_list *list)
 {
 	struct fts_mailbox_list *flist = FTS_LIST_CONTEXT(list);
 
+	if (flist->search_cache != NULL)
+		fts_search_cache_deinit(&flist->search_cache);
+	fts_expunge_log_deinit(&flist->expunge_log);
 	fts_backend_deinit(&flist->backend);
 	flist->module_ctx.super.deinit(list);
 }
@@ -836,7 +1001,8 @@ static void
 fts_mailbox_list_init(struct mailbox_list *list, const char *name)
 {
 	struct fts_backend *backend;
-	const char *path, *error;
+	const char *path, *value, *error;
+	unsigned int cache_size = FTS_SEARCH_CACHE_DEFAULT_SIZE;
 
 	if (!mailbox_list_get_root_path(list, MAILBOX_LIST_PATH_TYPE_INDEX, &path)) {
 		if (list->mail_set->mail_debug) {
@@ -856,9 +1022,24 @@ fts_mailbox_list_init(struct mailbox_list *list, const char *name)
 		if ((backend->flags & FTS_BACKEND_FLAG_FUZZY_SEARCH) != 0)
 			list->ns->user->fuzzy_search = TRUE;
 
+		value = mail_user_plugin_getenv(list->ns->user,
+						"fts_search_cache_size");
+		if (value != NULL && str_to_uint(value, &cache_size) < 0) {
+			i_error("Invalid fts_search_cache_size setting: %s",
+				value);
+			cache_size = FTS_SEARCH_CACHE_DEFAULT_SIZE;
+		}
+
 		flist = p_new(list->pool, struct fts_mailbox_list, 1);
 		flist->module_ctx.super = *v;
 		flist->backend = backend;
+		if (cache_size > 0)
+			flist->search_cache = fts_search_cache_init(cache_size);
+		flist->expunge_log = fts_expunge_log_init(
+			t_strconcat(path, "/"FTS_EXPUNGE_LOG_NAME, NULL));
+		flist->deferred_expunges =
+			mail_user_plugin_getenv_bool(list->ns->user,
+						     "fts_deferred_expunges");
 		list->vlast = &flist->module_ctx.super;
 		v->deinit = fts_mailbox_list_deinit;
 		MODULE_CONTEXT_SET(list, fts_mailbox_list_module, flist);
@@ -894,3 +1075,10 @@ struct fts_backend *fts_list_backend(struct mailbox_list *list)
 
 	return flist == NULL ? NULL : flist->backend;
 }
+
+struct fts_search_cache *fts_mailbox_search_cache(struct mailbox *box)
+{
+	struct fts_mailbox_list *flist = FTS_LIST_CONTEXT(box->list);
+
+	return flist->search_cache;
+}
@@ -28,17 +28,23 @@ struct fts_search_context {
 	ARRAY(struct fts_search_level) levels;
 	buffer_t *orig_matches;
 
+	uint32_t last_indexed_uid;
 	uint32_t first_unindexed_seq;
 
 	/* final scores, combined from all levels */
 	struct fts_scores *scores;
 
 	struct fts_indexer_context *indexer_ctx;
+	/* asynchronous lookup in progress */
+	struct fts_search_async_lookup *async_lookup;
 
 	bool virtual_mailbox:1;
 	bool fts_lookup_success:1;
 	bool indexing_timed_out:1;
 	bool enforced:1;
+	/* lookup is done once we know if the search can wait for it
+	   asynchronously */
+	bool lookup_deferred:1;
 };
 
 /* Figure out if we want to use full text search indexes and update
@@ -46,10 +52,27 @@ struct fts_search_context {
 void fts_search_analyze(struct fts_search_context *fctx);
 /* Perform the actual index lookup and update definite_uids and maybe_uids. */
 void fts_search_lookup(struct fts_search_context *fctx);
+typedef void fts_search_lookup_callback_t(void *context);
+/* Like fts_search_lookup(), but don't wait for the backend. Returns TRUE if
+   the lookup is still running, in which case the callback is called once
+   it's finished. Returns FALSE if the lookup already finished. */
+bool fts_search_lookup_async(struct fts_search_context *fctx,
+			     fts_search_lookup_callback_t *callback,
+			     void *context);
+#define fts_search_lookup_async(fctx, callback, context) \
+	fts_search_lookup_async(fctx, \
+		(fts_search_lookup_callback_t *)callback, \
+		(void *)((char *)context + CALLBACK_TYPECHECK(callback, \
+			void (*)(typeof(context)))))
+/* Abort the running asynchronous lookup. The callback isn't called. */
+void fts_search_lookup_async_abort(struct fts_search_context *fctx);
 /* Returns FTS backend for the given mailbox (assumes it has one). */
 struct fts_backend *fts_mailbox_backend(struct mailbox *box);
 /* Returns FTS backend for the given mailbox list, or NULL if it has none. */
 struct fts_backend *fts_list_backend(struct mailbox_list *list);
+/* Returns the search result cache for the mailbox, or NULL if it's
+   disabled. */
+struct fts_search_cache *fts_mailbox_search_cache(struct mailbox *box);
 
 void fts_mail_allocated(struct mail *mail);
 void fts_mailbox_allocated(struct mailbox *box);
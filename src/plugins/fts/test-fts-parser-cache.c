@@ -0,0 +1,200 @@
+/* Copyright (c) 2016 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "str.h"
+#include "message-parser.h"
+#include "mail-user.h"
+#include "fts-parser.h"
+#include "test-common.h"
+#include "test-mail-storage-common.h"
+
+struct test_fts_parser {
+	struct fts_parser parser;
+
+	const char *output;
+	bool output_sent;
+	bool no_cache;
+	bool fail;
+};
+
+static struct test_mail_storage test_storage;
+/* number of times the parent parser extracted text */
+static unsigned int test_extract_count;
+
+static void test_parser_more(struct fts_parser *_parser,
+			     struct message_block *block)
+{
+	struct test_fts_parser *parser = (struct test_fts_parser *)_parser;
+
+	if (block->size > 0) {
+		block->size = 0;
+		return;
+	}
+	if (parser->output_sent)
+		return;
+
+	parser->output_sent = TRUE;
+	parser->parser.no_cache = parser->no_cache;
+	test_extract_count++;
+	block->data = (const unsigned char *)parser->output;
+	block->size = strlen(parser->output);
+}
+
+static int test_parser_deinit(struct fts_parser *_parser)
+{
+	struct test_fts_parser *parser = (struct test_fts_parser *)_parser;
+	int ret = parser->fail ? -1 : 0;
+
+	i_free(parser);
+	return ret;
+}
+
+static struct fts_parser_vfuncs test_parser_vfuncs = {
+	NULL,
+	test_parser_more,
+	test_parser_deinit,
+	NULL
+};
+
+static const char *
+test_parse(const char *parser_name, const char *content_type,
+	   const char *body, const char *output, bool no_cache, bool fail)
+{
+	struct test_fts_parser *parent;
+	struct fts_parser *parser;
+	struct message_block block;
+	string_t *str = t_str_new(64);
+	int ret;
+
+	parent = i_new(struct test_fts_parser, 1);
+	parent->parser.v = test_parser_vfuncs;
+	parent->output = output;
+	parent->no_cache = no_cache;
+	parent->fail = fail;
+	parser = fts_parser_cache_init(test_storage.user, &parent->parser,
+				       parser_name, content_type);
+	test_assert(parser != &parent->parser);
+
+	memset(&block, 0, sizeof(block));
+	block.data = (const unsigned char *)body;
+	block.size = strlen(body);
+	fts_parser_more(parser, &block);
+	test_assert(block.size == 0);
+	for (;;) {
+		block.size = 0;
+		fts_parser_more(parser, &block);
+		if (block.size == 0)
+			break;
+		str_append_n(str, block.data, block.size);
+	}
+	ret = fts_parser_deinit(&parser);
+	test_assert(ret == (fail ? -1 : 0));
+	return str_c(str);
+}
+
+static void test_fts_parser_cache(void)
+{
+	const char *output;
+
+	test_begin("fts parser cache");
+	test_extract_count = 0;
+
+	/* miss */
+	output = test_parse("test", "application/pdf", "body1", "text1",
+			    FALSE, FALSE);
+	test_assert(strcmp(output, "text1") == 0);
+	test_assert(test_extract_count == 1);
+
+	/* hit: the parent parser isn't used */
+	output = test_parse("test", "application/pdf", "body1", "other",
+			    FALSE, FALSE);
+	test_assert(strcmp(output, "text1") == 0);
+	test_assert(test_extract_count == 1);
+
+	/* a different body, content type or parser is a miss */
+	output = test_parse("test", "application/pdf", "body2", "text2",
+			    FALSE, FALSE);
+	test_assert(strcmp(output, "text2") == 0);
+	test_assert(test_extract_count == 2);
+	output = test_parse("test", "application/msword", "body1", "text3",
+			    FALSE, FALSE);
+	test_assert(strcmp(output, "text3") == 0);
+	test_assert(test_extract_count == 3);
+	output = test_parse("test2", "application/pdf", "body1", "text4",
+			    FALSE, FALSE);
+	test_assert(strcmp(output, "text4") == 0);
+	test_assert(test_extract_count == 4);
+
+	/* each of them was cached separately */
+	test_assert(strcmp(test_parse("test", "application/msword", "body1",
+				      "", FALSE, FALSE), "text3") == 0);
+	test_assert(strcmp(test_parse("test2", "application/pdf", "body1",
+				      "", FALSE, FALSE), "text4") == 0);
+	test_assert(test_extract_count == 4);
+	test_end();
+}
+
+static void test_fts_parser_cache_not_cached(void)
+{
+	const char *output;
+
+	test_begin("fts parser cache not cached");
+	test_extract_count = 0;
+
+	/* the parser returned text, but it's not a real extraction */
+	output = test_parse("test", "application/pdf", "body3", "",
+			    TRUE, FALSE);
+	test_assert(strcmp(output, "") == 0);
+	output = test_parse("test", "application/pdf", "body3", "text5",
+			    FALSE, FALSE);
+	test_assert(strcmp(output, "text5") == 0);
+	test_assert(test_extract_count == 2);
+
+	/* the parser failed */
+	(void)test_parse("test", "application/pdf", "body4", "partial",
+			 FALSE, TRUE);
+	output = test_parse("test", "application/pdf", "body4", "text6",
+			    FALSE, FALSE);
+	test_assert(strcmp(output, "text6") == 0);
+	test_assert(test_extract_count == 4);
+
+	/* the successful extractions were cached */
+	test_assert(strcmp(test_parse("test", "application/pdf", "body3",
+				      "", FALSE, FALSE), "text5") == 0);
+	test_assert(strcmp(test_parse("test", "application/pdf", "body4",
+				      "", FALSE, FALSE), "text6") == 0);
+	test_assert(test_extract_count == 4);
+	test_end();
+}
+
+static void test_setup(void)
+{
+	test_mail_storage_init(&test_storage, "test-fts-parser-cache",
+			       NULL, NULL);
+	test_storage.user = test_mail_storage_user_init(&test_storage,
+		"parser_cache_test", (const char *const[]) {
+			"mail=maildir:~/",
+			t_strdup_printf("fts_parser_cache_dir=%s/cache",
+					test_storage.home),
+			NULL
+		}, &test_storage.service_user);
+	fts_parser_cache_mail_user_created(test_storage.user);
+}
+
+static void test_teardown(void)
+{
+	test_mail_storage_deinit(&test_storage);
+}
+
+int main(int argc, char **argv)
+{
+	static void (*test_functions[])(void) = {
+		test_setup,
+		test_fts_parser_cache,
+		test_fts_parser_cache_not_cached,
+		test_teardown,
+		NULL
+	};
+	return test_mail_storage_run("test-fts-parser-cache", &argc, &argv,
+				     test_functions);
+}
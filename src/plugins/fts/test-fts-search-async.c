@@ -0,0 +1,370 @@
+/* Copyright (c) 2016 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "str.h"
+#include "istream.h"
+#include "ioloop.h"
+#include "module-dir.h"
+#include "mail-user.h"
+#include "mail-namespace.h"
+#include "mail-storage.h"
+#include "mail-search-build.h"
+#include "fts-api-private.h"
+#include "fts-plugin.h"
+#include "test-common.h"
+#include "test-mail-storage-common.h"
+
+#define TEST_MAILS_COUNT 5
+/* the backend finds the search string from these UIDs */
+#define TEST_MATCH_UID1 2
+#define TEST_MATCH_UID2 4
+
+struct test_lookup {
+	struct fts_backend_lookup_async lookup;
+	struct timeout *to;
+	int ret;
+};
+
+static struct test_mail_storage test_storage;
+
+static struct test_lookup *test_lookup;
+static unsigned int test_lookup_count, test_lookup_deinit_count;
+static unsigned int test_search_callback_count;
+
+static const struct fts_backend test_backend;
+
+static struct fts_backend *test_backend_alloc(void)
+{
+	struct fts_backend *backend;
+
+	backend = i_new(struct fts_backend, 1);
+	*backend = test_backend;
+	return backend;
+}
+
+static int
+test_backend_init(struct fts_backend *backend ATTR_UNUSED,
+		  const char **error_r ATTR_UNUSED)
+{
+	return 0;
+}
+
+static void test_backend_deinit(struct fts_backend *backend)
+{
+	i_free(backend);
+}
+
+static int
+test_backend_get_last_uid(struct fts_backend *backend ATTR_UNUSED,
+			  struct mailbox *box, uint32_t *last_uid_r)
+{
+	struct mailbox_status status;
+
+	/* everything is always indexed */
+	mailbox_get_open_status(box, STATUS_UIDNEXT, &status);
+	*last_uid_r = status.uidnext - 1;
+	return 0;
+}
+
+static int test_backend_refresh(struct fts_backend *backend ATTR_UNUSED)
+{
+	return 0;
+}
+
+static int
+test_backend_lookup(struct fts_backend *backend ATTR_UNUSED,
+		    struct mailbox *box ATTR_UNUSED,
+		    struct mail_search_arg *args ATTR_UNUSED,
+		    enum fts_lookup_flags flags ATTR_UNUSED,
+		    struct fts_result *result ATTR_UNUSED)
+{
+	i_panic("synchronous lookup done");
+}
+
+static void test_lookup_finish(struct test_lookup *lookup)
+{
+	if (lookup->ret == 0) {
+		seq_range_array_add(&lookup->lookup.result->definite_uids,
+				    TEST_MATCH_UID1);
+		seq_range_array_add(&lookup->lookup.result->definite_uids,
+				    TEST_MATCH_UID2);
+	}
+	fts_backend_lookup_async_finished(&lookup->lookup, lookup->ret);
+}
+
+static struct fts_backend_lookup_async *
+test_backend_lookup_async(struct fts_backend *backend ATTR_UNUSED,
+			  struct mailbox *box ATTR_UNUSED,
+			  struct mail_search_arg *args,
+			  enum fts_lookup_flags flags ATTR_UNUSED,
+			  struct fts_result *result ATTR_UNUSED)
+{
+	struct test_lookup *lookup;
+
+	i_assert(test_lookup == NULL);
+
+	/* the results are used for all the args */
+	for (; args != NULL; args = args->next)
+		args->match_always = TRUE;
+	test_lookup_count++;
+	lookup = i_new(struct test_lookup, 1);
+	lookup->to = timeout_add_short(0, test_lookup_finish, lookup);
+	test_lookup = lookup;
+	return &lookup->lookup;
+}
+
+static void
+test_backend_lookup_async_deinit(struct fts_backend_lookup_async *_lookup)
+{
+	struct test_lookup *lookup = (struct test_lookup *)_lookup;
+
+	i_assert(lookup == test_lookup);
+
+	test_lookup_deinit_count++;
+	test_lookup = NULL;
+	timeout_remove(&lookup->to);
+	i_free(lookup);
+}
+
+static const struct fts_backend test_backend = {
+	.name = "test",
+	.flags = 0,
+	{
+		.alloc = test_backend_alloc,
+		.init = test_backend_init,
+		.deinit = test_backend_deinit,
+		.get_last_uid = test_backend_get_last_uid,
+		.refresh = test_backend_refresh,
+		.can_lookup = fts_backend_default_can_lookup,
+		.lookup = test_backend_lookup,
+		.lookup_async = test_backend_lookup_async,
+		.lookup_async_deinit = test_backend_lookup_async_deinit,
+	}
+};
+
+static struct mailbox *test_box_open(void)
+{
+	struct mail_namespace *ns;
+	struct mailbox *box;
+
+	ns = mail_namespace_find_inbox(test_storage.user->namespaces);
+	box = mailbox_alloc(ns->list, "INBOX", 0);
+	if (mailbox_sync(box, 0) < 0)
+		i_fatal("mailbox_sync(INBOX) failed: %s",
+			mailbox_get_last_error(box, NULL));
+	return box;
+}
+
+static void test_save(struct mailbox *box)
+{
+	struct mailbox_transaction_context *t;
+	struct mail_save_context *save_ctx;
+	struct istream *input;
+	const char *data;
+	unsigned int i;
+	int ret;
+
+	t = mailbox_transaction_begin(box, MAILBOX_TRANSACTION_FLAG_EXTERNAL);
+	for (i = 1; i <= TEST_MAILS_COUNT; i++) {
+		data = t_strdup_printf("Subject: message %u\r\n\r\nbody\r\n", i);
+		input = i_stream_create_from_data(data, strlen(data));
+		save_ctx = mailbox_save_alloc(t);
+		if (mailbox_save_begin(&save_ctx, input) < 0)
+			i_fatal("mailbox_save_begin() failed");
+		while ((ret = i_stream_read(input)) > 0 || ret == -2) {
+			if (mailbox_save_continue(save_ctx) < 0)
+				i_fatal("mailbox_save_continue() failed");
+		}
+		if (mailbox_save_finish(&save_ctx) < 0)
+			i_fatal("mailbox_save_finish() failed");
+		i_stream_unref(&input);
+	}
+	if (mailbox_transaction_commit(&t) < 0)
+		i_fatal("mailbox_transaction_commit() failed: %s",
+			mailbox_get_last_error(box, NULL));
+}
+
+static void test_search_callback(void *context ATTR_UNUSED)
+{
+	test_search_callback_count++;
+	io_loop_stop(current_ioloop);
+}
+
+static struct mail_search_context *
+test_search_init(struct mailbox_transaction_context *t, const char *value)
+{
+	struct mail_search_context *ctx;
+	struct mail_search_args *args;
+	struct mail_search_arg *arg;
+
+	args = mail_search_build_init();
+	arg = mail_search_build_add(args, SEARCH_BODY);
+	arg->value.str = p_strdup(args->pool, value);
+	ctx = mailbox_search_init(t, args, NULL, 0, NULL);
+	mail_search_args_unref(&args);
+	mailbox_search_set_async_callback(ctx, test_search_callback,
+					  (void *)NULL);
+	return ctx;
+}
+
+/* Run the search until it's finished. Returns the matching UIDs as
+   a string and the number of times the search had to wait. */
+static const char *
+test_search_run(struct mail_search_context *ctx, unsigned int *waits_r)
+{
+	string_t *str = t_str_new(32);
+	struct mail *mail;
+	bool tryagain;
+
+	*waits_r = 0;
+	for (;;) {
+		if (mailbox_search_next_nonblock(ctx, &mail, &tryagain)) {
+			str_printfa(str, "%u,", mail->uid);
+			continue;
+		}
+		if (!tryagain)
+			break;
+		if (mailbox_search_is_waiting(ctx)) {
+			*waits_r += 1;
+			io_loop_run(current_ioloop);
+		}
+	}
+	return str_c(str);
+}
+
+static void test_fts_search_lookup_async(void)
+{
+	struct mailbox *box;
+	struct mailbox_transaction_context *t;
+	struct mail_search_context *ctx;
+	const char *uids;
+	unsigned int waits;
+
+	test_begin("fts search lookup async");
+	test_lookup_count = test_lookup_deinit_count = 0;
+	test_search_callback_count = 0;
+
+	box = test_box_open();
+	test_save(box);
+	test_assert(mailbox_sync(box, 0) == 0);
+
+	/* the lookup doesn't start before the first search_next*() call,
+	   and the search waits until the backend has finished it */
+	t = mailbox_transaction_begin(box, 0);
+	ctx = test_search_init(t, "foo");
+	test_assert(test_lookup_count == 0);
+	uids = test_search_run(ctx, &waits);
+	test_assert(strcmp(uids, "2,4,") == 0);
+	test_assert(waits == 1);
+	test_assert(test_lookup_count == 1 && test_lookup_deinit_count == 1);
+	test_assert(test_search_callback_count == 1);
+	test_assert(mailbox_search_deinit(&ctx) == 0);
+
+	/* the same search is answered from the search cache without
+	   waiting */
+	ctx = test_search_init(t, "foo");
+	uids = test_search_run(ctx, &waits);
+	test_assert(strcmp(uids, "2,4,") == 0);
+	test_assert(waits == 0);
+	test_assert(test_lookup_count == 1);
+	test_assert(test_search_callback_count == 1);
+	test_assert(mailbox_search_deinit(&ctx) == 0);
+	test_assert(mailbox_transaction_commit(&t) == 0);
+	mailbox_free(&box);
+	test_end();
+}
+
+static void test_fts_search_lookup_async_abort(void)
+{
+	struct mailbox *box;
+	struct mailbox_transaction_context *t;
+	struct mail_search_context *ctx;
+	struct mail *mail;
+	bool tryagain;
+
+	test_begin("fts search lookup async abort");
+	test_lookup_count = test_lookup_deinit_count = 0;
+	test_search_callback_count = 0;
+
+	box = test_box_open();
+	t = mailbox_transaction_begin(box, 0);
+	ctx = test_search_init(t, "bar");
+	test_assert(!mailbox_search_next_nonblock(ctx, &mail, &tryagain));
+	test_assert(tryagain && mailbox_search_is_waiting(ctx));
+	test_assert(test_lookup_count == 1 && test_lookup != NULL);
+
+	/* deinitializing the search aborts the lookup without calling the
+	   callback */
+	(void)mailbox_search_deinit(&ctx);
+	test_assert(test_lookup_deinit_count == 1 && test_lookup == NULL);
+	test_assert(test_search_callback_count == 0);
+	mailbox_transaction_rollback(&t);
+
+	/* the aborted lookup's results weren't cached */
+	t = mailbox_transaction_begin(box, 0);
+	ctx = test_search_init(t, "bar");
+	test_assert(!mailbox_search_next_nonblock(ctx, &mail, &tryagain));
+	test_assert(tryagain && mailbox_search_is_waiting(ctx));
+	test_assert(test_lookup_count == 2);
+	(void)mailbox_search_deinit(&ctx);
+	mailbox_transaction_rollback(&t);
+
+	/* a failed lookup finishes the search as well */
+	t = mailbox_transaction_begin(box, 0);
+	ctx = test_search_init(t, "bar");
+	test_assert(!mailbox_search_next_nonblock(ctx, &mail, &tryagain));
+	test_assert(test_lookup != NULL);
+	test_lookup->ret = -1;
+	io_loop_run(current_ioloop);
+	test_assert(test_lookup_count == 3 && test_lookup_deinit_count == 3);
+	test_assert(test_search_callback_count == 1);
+	test_assert(!mailbox_search_is_waiting(ctx));
+	(void)mailbox_search_deinit(&ctx);
+	mailbox_transaction_rollback(&t);
+	mailbox_free(&box);
+	test_end();
+}
+
+static void test_setup(void)
+{
+	static struct module test_module;
+
+	test_mail_storage_init(&test_storage, "test-fts-search-async",
+			       NULL, NULL);
+
+	test_module.path = p_strdup(test_storage.pool, "lib20_fts_plugin.so");
+	test_module.name = p_strdup(test_storage.pool, "fts_plugin");
+	fts_plugin_init(&test_module);
+	fts_backend_register(&test_backend);
+
+	test_storage.user = test_mail_storage_user_init(&test_storage,
+		"fts_search_test", (const char *const[]) {
+			"mail=maildir:~/",
+			"mail_plugins=fts",
+			"fts=test",
+			NULL
+		}, &test_storage.service_user);
+}
+
+static void test_teardown(void)
+{
+	/* the storage hooks are freed by mail_storage_service_deinit(), so
+	   remove them before it in the reverse order of test_setup() */
+	fts_backend_unregister("test");
+	fts_plugin_deinit();
+	test_mail_storage_deinit(&test_storage);
+}
+
+int main(int argc, char **argv)
+{
+	static void (*test_functions[])(void) = {
+		test_setup,
+		test_fts_search_lookup_async,
+		test_fts_search_lookup_async_abort,
+		test_teardown,
+		NULL
+	};
+	return test_mail_storage_run("test-fts-search-async", &argc, &argv,
+				     test_functions);
+}
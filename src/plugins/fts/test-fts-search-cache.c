@@ -0,0 +1,328 @@
+/* Copyright (c) 2016 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "buffer.h"
+#include "seq-range-array.h"
+#include "mail-search-build.h"
+#include "fts-search-cache.h"
+#include "test-common.h"
+
+#define TEST_GUID1 "00112233445566778899aabbccddeeff"
+#define TEST_GUID2 "ffeeddccbbaa99887766554433221100"
+
+static const struct fts_search_cache_state test_state = {
+	.uid_validity = 1234,
+	.uid_next = 101,
+	.messages_count = 80,
+	.last_indexed_uid = 100,
+	.highest_modseq = 5000,
+};
+
+static struct mail_search_args *
+test_search_args_body(const char *value, bool fuzzy)
+{
+	struct mail_search_args *args;
+	struct mail_search_arg *arg;
+
+	args = mail_search_build_init();
+	arg = mail_search_build_add(args, SEARCH_BODY);
+	arg->value.str = p_strdup(args->pool, value);
+	arg->fuzzy = fuzzy;
+	return args;
+}
+
+static struct mail_search_args *
+test_search_args_or(bool fuzzy1, bool fuzzy2)
+{
+	struct mail_search_args *args;
+	struct mail_search_arg *or_arg, *arg;
+
+	args = mail_search_build_init();
+	or_arg = mail_search_build_add(args, SEARCH_OR);
+	arg = p_new(args->pool, struct mail_search_arg, 1);
+	arg->type = SEARCH_TEXT;
+	arg->value.str = "foo";
+	arg->fuzzy = fuzzy1;
+	or_arg->value.subargs = arg;
+	arg->next = p_new(args->pool, struct mail_search_arg, 1);
+	arg = arg->next;
+	arg->type = SEARCH_TEXT;
+	arg->value.str = "bar";
+	arg->fuzzy = fuzzy2;
+	return args;
+}
+
+static const char *
+test_key(struct mail_search_args *args, enum fts_lookup_flags flags)
+{
+	const char *key;
+
+	key = fts_search_cache_key(flags, args->args);
+	mail_search_args_unref(&args);
+	return key;
+}
+
+static const char *
+test_key_body(const char *value, bool fuzzy, enum fts_lookup_flags flags)
+{
+	return test_key(test_search_args_body(value, fuzzy), flags);
+}
+
+static void test_fts_search_cache_key(void)
+{
+	struct mail_search_args *args;
+	struct mail_search_arg *arg;
+	const char *key, *key2, *key3;
+
+	test_begin("fts search cache key");
+
+	key = test_key_body("foo", FALSE, 0);
+	test_assert(key != NULL && strstr(key, "BODY foo") != NULL);
+	/* the same query gives the same key */
+	test_assert(null_strcmp(key, test_key_body("foo", FALSE, 0)) == 0);
+
+	/* the value, the fuzzy flag and the lookup flags are all part of
+	   the key */
+	test_assert(null_strcmp(key, test_key_body("fo", FALSE, 0)) != 0);
+	test_assert(null_strcmp(key, test_key_body("foo", TRUE, 0)) != 0);
+	test_assert(null_strcmp(key, test_key_body("foo", FALSE,
+				FTS_LOOKUP_FLAG_AND_ARGS)) != 0);
+	test_assert(null_strcmp(key, test_key_body("foo", FALSE,
+				FTS_LOOKUP_FLAG_NO_AUTO_FUZZY)) != 0);
+
+	/* values are quoted, so they can't be confused with other args */
+	key = test_key_body("foo\" BODY \"bar", FALSE, 0);
+	test_assert(key != NULL &&
+		    strstr(key, "BODY \"foo\\\" BODY \\\"bar\"") != NULL);
+
+	/* fuzzy flags of the subargs matter as well */
+	key = test_key(test_search_args_or(FALSE, FALSE), 0);
+	key2 = test_key(test_search_args_or(FALSE, TRUE), 0);
+	key3 = test_key(test_search_args_or(TRUE, FALSE), 0);
+	test_assert(key != NULL && strstr(key, "OR") != NULL);
+	test_assert(null_strcmp(key, key2) != 0);
+	test_assert(null_strcmp(key2, key3) != 0);
+
+	/* args that can't be written as IMAP aren't cached */
+	args = mail_search_build_init();
+	arg = mail_search_build_add(args, SEARCH_BEFORE);
+	arg->value.date_type = MAIL_SEARCH_DATE_TYPE_SENT;
+	arg->value.search_flags = MAIL_SEARCH_ARG_FLAG_UTC_TIMES;
+	arg->value.time = 12345;
+	test_assert(test_key(args, 0) == NULL);
+	test_end();
+}
+
+static void
+test_result_init(pool_t pool, struct fts_result *result)
+{
+	struct fts_score_map *score;
+
+	memset(result, 0, sizeof(*result));
+	p_array_init(&result->definite_uids, pool, 4);
+	p_array_init(&result->maybe_uids, pool, 4);
+	p_array_init(&result->scores, pool, 4);
+	seq_range_array_add_range(&result->definite_uids, 1, 5);
+	seq_range_array_add(&result->definite_uids, 10);
+	seq_range_array_add(&result->maybe_uids, 7);
+	score = array_append_space(&result->scores);
+	score->uid = 1;
+	score->score = 0.5;
+	score = array_append_space(&result->scores);
+	score->uid = 10;
+	score->score = 2;
+	result->scores_sorted = TRUE;
+}
+
+static bool
+test_lookup(struct fts_search_cache *cache, const char *guid,
+	    const char *query, const struct fts_search_cache_state *state)
+{
+	struct fts_result result;
+	buffer_t *matches = buffer_create_dynamic(pool_datastack_create(), 16);
+
+	memset(&result, 0, sizeof(result));
+	return fts_search_cache_lookup(cache, guid, query, state,
+				       pool_datastack_create(), &result,
+				       matches);
+}
+
+static void test_fts_search_cache_copy(void)
+{
+	struct fts_search_cache *cache;
+	struct fts_result result, cached;
+	const struct fts_score_map *scores;
+	buffer_t *matches;
+	pool_t pool;
+	unsigned int count;
+
+	test_begin("fts search cache result copy");
+	cache = fts_search_cache_init(4);
+	pool = pool_alloconly_create("test fts result", 1024);
+	test_result_init(pool, &result);
+	matches = buffer_create_dynamic(pool, 16);
+	buffer_append(matches, "\x01\x00\x01", 3);
+	fts_search_cache_add(cache, TEST_GUID1, "query", &test_state,
+			     &result, matches);
+
+	/* the cache keeps its own copy of the results */
+	array_clear(&result.definite_uids);
+	array_clear(&result.scores);
+	buffer_set_used_size(matches, 0);
+	pool_unref(&pool);
+
+	pool = pool_alloconly_create("test fts result", 1024);
+	memset(&cached, 0, sizeof(cached));
+	matches = buffer_create_dynamic(pool, 16);
+	test_assert(fts_search_cache_lookup(cache, TEST_GUID1, "query",
+					    &test_state, pool, &cached,
+					    matches));
+	test_assert(seq_range_count(&cached.definite_uids) == 6);
+	test_assert(seq_range_exists(&cached.definite_uids, 10));
+	test_assert(seq_range_count(&cached.maybe_uids) == 1);
+	test_assert(seq_range_exists(&cached.maybe_uids, 7));
+	scores = array_get(&cached.scores, &count);
+	test_assert(count == 2 && scores[1].uid == 10 && scores[1].score == 2);
+	test_assert(cached.scores_sorted);
+	test_assert(matches->used == 3 &&
+		    memcmp(matches->data, "\x01\x00\x01", 3) == 0);
+
+	/* the returned copy can be modified without affecting the cache */
+	array_clear(&cached.definite_uids);
+	memset(&cached, 0, sizeof(cached));
+	buffer_set_used_size(matches, 0);
+	test_assert(fts_search_cache_lookup(cache, TEST_GUID1, "query",
+					    &test_state, pool, &cached,
+					    matches));
+	test_assert(seq_range_count(&cached.definite_uids) == 6);
+	pool_unref(&pool);
+
+	/* lookup_multi() may leave the arrays uncreated */
+	memset(&result, 0, sizeof(result));
+	matches = buffer_create_dynamic(pool_datastack_create(), 1);
+	fts_search_cache_add(cache, TEST_GUID2, "query", &test_state,
+			     &result, matches);
+	memset(&cached, 0, sizeof(cached));
+	test_assert(fts_search_cache_lookup(cache, TEST_GUID2, "query",
+					    &test_state,
+					    pool_datastack_create(),
+					    &cached, matches));
+	test_assert(array_is_created(&cached.definite_uids) &&
+		    array_count(&cached.definite_uids) == 0);
+	test_assert(array_is_created(&cached.maybe_uids) &&
+		    array_count(&cached.maybe_uids) == 0);
+	test_assert(array_is_created(&cached.scores) &&
+		    array_count(&cached.scores) == 0);
+	test_assert(!cached.scores_sorted);
+
+	fts_search_cache_deinit(&cache);
+	test_end();
+}
+
+static void test_fts_search_cache_state(void)
+{
+	struct fts_search_cache *cache;
+	struct fts_search_cache_state state;
+	struct fts_result result;
+	buffer_t *matches = buffer_create_dynamic(pool_datastack_create(), 1);
+	unsigned int i;
+
+	test_begin("fts search cache state");
+	cache = fts_search_cache_init(4);
+	test_result_init(pool_datastack_create(), &result);
+
+	for (i = 0; i < 5; i++) {
+		fts_search_cache_add(cache, TEST_GUID1, "query", &test_state,
+				     &result, matches);
+		test_assert_idx(test_lookup(cache, TEST_GUID1, "query",
+					    &test_state), i);
+
+		state = test_state;
+		switch (i) {
+		case 0:
+			state.uid_validity++;
+			break;
+		case 1:
+			/* new mail */
+			state.uid_next++;
+			break;
+		case 2:
+			/* expunge */
+			state.messages_count--;
+			break;
+		case 3:
+			/* more mails were indexed */
+			state.last_indexed_uid++;
+			break;
+		case 4:
+			/* flag changes */
+			state.highest_modseq++;
+			break;
+		}
+		test_assert_idx(!test_lookup(cache, TEST_GUID1, "query",
+					     &state), i);
+		/* the stale results were dropped */
+		test_assert_idx(!test_lookup(cache, TEST_GUID1, "query",
+					     &test_state), i);
+	}
+
+	/* adding the results for the new state replaces the old ones */
+	fts_search_cache_add(cache, TEST_GUID1, "query", &test_state,
+			     &result, matches);
+	state = test_state;
+	state.uid_next++;
+	fts_search_cache_add(cache, TEST_GUID1, "query", &state,
+			     &result, matches);
+	test_assert(test_lookup(cache, TEST_GUID1, "query", &state));
+	test_assert(!test_lookup(cache, TEST_GUID1, "query", &test_state));
+
+	/* the results are per mailbox and per query */
+	test_assert(!test_lookup(cache, TEST_GUID2, "query", &state));
+	test_assert(!test_lookup(cache, TEST_GUID1, "query2", &state));
+	fts_search_cache_deinit(&cache);
+	test_end();
+}
+
+static void test_fts_search_cache_lru(void)
+{
+	struct fts_search_cache *cache;
+	struct fts_result result;
+	buffer_t *matches = buffer_create_dynamic(pool_datastack_create(), 1);
+
+	test_begin("fts search cache lru");
+	cache = fts_search_cache_init(2);
+	test_result_init(pool_datastack_create(), &result);
+
+	fts_search_cache_add(cache, TEST_GUID1, "a", &test_state,
+			     &result, matches);
+	fts_search_cache_add(cache, TEST_GUID1, "b", &test_state,
+			     &result, matches);
+	/* a becomes the most recently used */
+	test_assert(test_lookup(cache, TEST_GUID1, "a", &test_state));
+	fts_search_cache_add(cache, TEST_GUID1, "c", &test_state,
+			     &result, matches);
+	test_assert(test_lookup(cache, TEST_GUID1, "a", &test_state));
+	test_assert(!test_lookup(cache, TEST_GUID1, "b", &test_state));
+	test_assert(test_lookup(cache, TEST_GUID1, "c", &test_state));
+
+	/* replacing an existing entry doesn't evict others */
+	fts_search_cache_add(cache, TEST_GUID1, "c", &test_state,
+			     &result, matches);
+	test_assert(test_lookup(cache, TEST_GUID1, "a", &test_state));
+	test_assert(test_lookup(cache, TEST_GUID1, "c", &test_state));
+	fts_search_cache_deinit(&cache);
+	test_end();
+}
+
+int main(void)
+{
+	static void (*test_functions[])(void) = {
+		test_fts_search_cache_key,
+		test_fts_search_cache_copy,
+		test_fts_search_cache_state,
+		test_fts_search_cache_lru,
+		NULL
+	};
+	return test_run(test_functions);
+}
@@ -2,6 +2,7 @@
 
 #include "lib.h"
 #include "time-util.h"
+#include "mail-index.h"
 #include "stats-plugin.h"
 #include "mail-stats.h"
 
@@ -99,6 +100,17 @@ static void process_read_io_stats(struct mail_stats *stats)
 	}
 }
 
+static void index_map_stats_get(struct mail_stats *stats)
+{
+	const struct mail_index_map_stats *map_stats =
+		mail_index_map_get_stats();
+
+	stats->index_map_clone_count = map_stats->clone_count;
+	stats->index_records_copy_count = map_stats->records_copy_count;
+	stats->index_records_copy_bytes = map_stats->records_copy_bytes;
+	stats->index_records_inplace_count = map_stats->records_inplace_count;
+}
+
 static void
 user_trans_stats_get(struct stats_user *suser, struct mail_stats *dest_r)
 {
@@ -139,5 +151,6 @@ void mail_stats_fill(struct stats_user *suser, struct mail_stats *stats_r)
 	stats_r->disk_output = (unsigned long long)usage.ru_oublock * 512ULL;
 	(void)gettimeofday(&stats_r->clock_time, NULL);
 	process_read_io_stats(stats_r);
+	index_map_stats_get(stats_r);
 	user_trans_stats_get(suser, stats_r);
 }
@@ -27,6 +27,14 @@ struct mail_stats {
 	uint32_t trans_files_read_count;
 	uint64_t trans_files_read_bytes;
 	uint64_t trans_cache_hit_count;
+	uint32_t trans_fts_cache_hit_count;
+	uint32_t trans_fts_cache_miss_count;
+
+	/* based on struct mail_index_map_stats: */
+	uint64_t index_map_clone_count;
+	uint64_t index_records_copy_count;
+	uint64_t index_records_copy_bytes;
+	uint64_t index_records_inplace_count;
 };
 
 extern const struct stats_vfuncs mail_stats_vfuncs;
@@ -10,6 +10,7 @@
 #include "index-storage.h"
 #include "index-mail.h"
 #include "compression.h"
+#include "iostream-zstd.h"
 #include "zlib-plugin.h"
 
 #include <fcntl.h>
@@ -62,6 +63,8 @@ static MODULE_CONTEXT_DEFINE_INIT(zlib_storage_module,
 				  &mail_storage_module_register);
 static MODULE_CONTEXT_DEFINE_INIT(zlib_mail_module, &mail_module_register);
 
+static char *zlib_zstd_dictionary_path = NULL;
+
 static void zlib_mail_cache_close(struct zlib_user *zuser)
 {
 	struct zlib_mail_cache *cache = &zuser->cache;
@@ -152,8 +155,12 @@ static int zlib_istream_opened(struct mail *_mail, struct istream **stream)
 		input = *stream;
 		*stream = handler->create_istream(input, TRUE);
 		i_stream_unref(&input);
-		/* dont cache the stream if _mail->uid is 0 */
-		*stream = zlib_mail_cache_open(zuser, _mail, *stream, (_mail->uid > 0));
+		/* seeking is already cheap with random access formats.
+		   dont cache the stream if _mail->uid is 0 */
+		if (!handler->random_access) {
+			*stream = zlib_mail_cache_open(zuser, _mail, *stream,
+						       (_mail->uid > 0));
+		}
 	}
 	return zmail->module_ctx.super.istream_opened(_mail, stream);
 }
@@ -407,6 +414,26 @@ static void zlib_mail_user_deinit(struct mail_user *user)
 	zuser->module_ctx.super.deinit(user);
 }
 
+static void zlib_mail_user_load_zstd_dictionary(struct mail_user *user)
+{
+	const char *path, *error;
+
+	/* the dictionary is shared by all the users in the process, so
+	   don't reload it unless the path changes */
+	path = mail_user_plugin_getenv(user, "zlib_zstd_dictionary");
+	if (path == NULL)
+		path = "";
+	if (null_strcmp(path, zlib_zstd_dictionary_path) == 0)
+		return;
+
+	i_free(zlib_zstd_dictionary_path);
+	zlib_zstd_dictionary_path = i_strdup(path);
+	if (*path == '\0')
+		iostream_zstd_set_dictionary(NULL, 0);
+	else if (iostream_zstd_load_dictionary(path, &error) < 0)
+		i_error("zlib_zstd_dictionary: %s", error);
+}
+
 static void zlib_mail_user_created(struct mail_user *user)
 {
 	struct mail_user_vfuncs *v = user->vlast;
@@ -438,6 +465,7 @@ static void zlib_mail_user_created(struct mail_user *user)
 	}
 	if (zuser->save_level == 0)
 		zuser->save_level = ZLIB_PLUGIN_DEFAULT_LEVEL;
+	zlib_mail_user_load_zstd_dictionary(user);
 	MODULE_CONTEXT_SET(user, zlib_user_module, zuser);
 }
 
@@ -455,4 +483,8 @@ void zlib_plugin_init(struct module *module)
 void zlib_plugin_deinit(void)
 {
 	mail_storage_hooks_remove(&zlib_mail_storage_hooks);
+	if (zlib_zstd_dictionary_path != NULL) {
+		iostream_zstd_set_dictionary(NULL, 0);
+		i_free(zlib_zstd_dictionary_path);
+	}
 }